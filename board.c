@@ -1,5 +1,6 @@
 #include <assert.h>
 #include <math.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,7 +10,9 @@
 #include "debug.h"
 #include "fbook.h"
 #include "mq.h"
+#include "perfstats.h"
 #include "random.h"
+#include "simd.h"
 
 #ifdef BOARD_SPATHASH
 #include "patternsp.h"
@@ -18,17 +21,9 @@
 #include "pattern3.h"
 #endif
 #ifdef BOARD_TRAITS
-static void board_trait_recompute(struct board *board, coord_t coord);
 #include "tactics/selfatari.h"
 #endif
 
-
-#if 0
-#define profiling_noinline __attribute__((noinline))
-#else
-#define profiling_noinline
-#endif
-
 #define gi_granularity 4
 #define gi_allocsize(gids) ((1 << gi_granularity) + ((gids) >> gi_granularity) * (1 << gi_granularity))
 
@@ -57,24 +52,30 @@ board_init(char *fbookfile)
 	return b;
 }
 
+/* Compute size of the board arrays storage and, unless @x is NULL,
+ * point the board arrays into it. */
 static size_t
-board_alloc(struct board *board)
+board_layout(struct board *board, void *x)
 {
-	/* We do not allocate the board structure itself but we allocate
-	 * all the arrays with board contents. */
 
 	int bsize = board_size2(board) * sizeof(*board->b);
 	int gsize = board_size2(board) * sizeof(*board->g);
 	int fsize = board_size2(board) * sizeof(*board->f);
 	int nsize = board_size2(board) * sizeof(*board->n);
 	int psize = board_size2(board) * sizeof(*board->p);
-	int hsize = board_size2(board) * 2 * sizeof(*board->h);
 	int gisize = board_size2(board) * sizeof(*board->gi);
 #ifdef WANT_BOARD_C
 	int csize = board_size2(board) * sizeof(*board->c);
 #else
 	int csize = 0;
 #endif
+#ifdef BOARD_EMPTY3
+	int e3size = board_size2(board) * sizeof(*board->e3);
+	int e3isize = board_size2(board) * sizeof(*board->e3i);
+#else
+	int e3size = 0;
+	int e3isize = 0;
+#endif
 #ifdef BOARD_SPATHASH
 	int ssize = board_size2(board) * sizeof(*board->spathash);
 #else
@@ -92,10 +93,17 @@ board_alloc(struct board *board)
 	int tsize = 0;
 	int tqsize = 0;
 #endif
-	int cdsize = board_size2(board) * sizeof(*board->coord);
+#ifdef BOARD_DCNN_PLANES
+	int dlsize = board_size2(board) * sizeof(*board->dcnn_libs);
+	int dasize = board_size2(board) * sizeof(*board->dcnn_age);
+#else
+	int dlsize = 0;
+	int dasize = 0;
+#endif
 
-	size_t size = bsize + gsize + fsize + psize + nsize + hsize + gisize + csize + ssize + p3size + tsize + tqsize + cdsize;
-	void *x = malloc2(size);
+	size_t size = bsize + gsize + fsize + psize + nsize + gisize + csize + e3size + ssize + p3size + tsize + tqsize + dlsize + dasize + e3isize;
+	if (!x)
+		return size;
 
 	/* board->b must come first */
 	board->b = x; x += bsize;
@@ -103,11 +111,13 @@ board_alloc(struct board *board)
 	board->f = x; x += fsize;
 	board->p = x; x += psize;
 	board->n = x; x += nsize;
-	board->h = x; x += hsize;
 	board->gi = x; x += gisize;
 #ifdef WANT_BOARD_C
 	board->c = x; x += csize;
 #endif
+#ifdef BOARD_EMPTY3
+	board->e3 = x; x += e3size;
+#endif
 #ifdef BOARD_SPATHASH
 	board->spathash = x; x += ssize;
 #endif
@@ -118,11 +128,28 @@ board_alloc(struct board *board)
 	board->t = x; x += tsize;
 	board->tq = x; x += tqsize;
 #endif
-	board->coord = x; x += cdsize;
+#ifdef BOARD_DCNN_PLANES
+	board->dcnn_age = x; x += dasize;
+	board->dcnn_libs = x; x += dlsize;
+#endif
+#ifdef BOARD_EMPTY3
+	/* Last, for alignment. */
+	board->e3i = x; x += e3isize;
+#endif
 
 	return size;
 }
 
+static size_t
+board_alloc(struct board *board)
+{
+	/* We do not allocate the board structure itself but we allocate
+	 * all the arrays with board contents. */
+	size_t size = board_layout(board, NULL);
+	board_layout(board, malloc2(size));
+	return size;
+}
+
 int
 board_cmp(struct board *b1, struct board *b2)
 {
@@ -136,9 +163,14 @@ board_cmp(struct board *b1, struct board *b2)
 		    &p1[i] != (void**)&b1->p &&
 		    &p1[i] != (void**)&b1->h &&
 		    &p1[i] != (void**)&b1->gi &&
+		    &p1[i] != (void**)&b1->history_hash &&
 #ifdef WANT_BOARD_C
 		    &p1[i] != (void**)&b1->c &&
 #endif
+#ifdef BOARD_EMPTY3
+		    &p1[i] != (void**)&b1->e3 &&
+		    &p1[i] != (void**)&b1->e3i &&
+#endif
 #ifdef BOARD_SPATHASH
 		    &p1[i] != (void**)&b1->spathash &&		   
 #endif
@@ -148,6 +180,10 @@ board_cmp(struct board *b1, struct board *b2)
 #ifdef BOARD_TRAITS
 		    &p1[i] != (void**)&b1->t &&
 		    &p1[i] != (void**)&b1->tq &&
+#endif
+#ifdef BOARD_DCNN_PLANES
+		    &p1[i] != (void**)&b1->dcnn_libs &&
+		    &p1[i] != (void**)&b1->dcnn_age &&
 #endif
 		    &p1[i] != (void**)&b1->coord)
 			return 1;
@@ -215,6 +251,30 @@ board_quick_cmp(struct board *b1, struct board *b2)
 }
 
 
+static void
+board_history_insert(struct board *board, hash_t hash)
+{
+	hash_t i = hash;
+	while (board->history_hash[i & history_hash_mask])
+		i = history_hash_next(i);
+	board->history_hash[i & history_hash_mask] = hash;
+}
+
+/* Give @b2 its own copy of the @b1 history. */
+static void
+board_history_copy(struct board *b2, struct board *b1)
+{
+	if (!b1->history_hash)
+		return;
+	size_t size = (1 << history_hash_bits) * sizeof(*b2->history_hash);
+	b2->history_hash = malloc2(size);
+	memcpy(b2->history_hash, b1->history_hash, size);
+	for (int i = 0; i < b1->history_recent_len; i++)
+		board_history_insert(b2, b1->history_recent[i]);
+	b2->history_recent_len = 0;
+	b2->history_shared = false;
+}
+
 struct board *
 board_copy(struct board *b2, struct board *b1)
 {
@@ -222,6 +282,7 @@ board_copy(struct board *b2, struct board *b1)
 
 	size_t size = board_alloc(b2);
 	memcpy(b2->b, b1->b, size);
+	board_history_copy(b2, b1);
 
 	// XXX: Special semantics.
 	b2->fbook = NULL;
@@ -230,14 +291,92 @@ board_copy(struct board *b2, struct board *b1)
 	return b2;
 }
 
+size_t
+board_storage_size(struct board *board)
+{
+	return board_layout(board, NULL);
+}
+
+/* Copy the board arrays of @b1 to the ones @b2 points to, only as far
+ * as they are in use: the queues up to their lengths and the group
+ * info of the groups on the board. */
+static void
+board_copy_used(struct board *b2, struct board *b1)
+{
+	int size2 = board_size2(b1);
+	memcpy(b2->b, b1->b, size2 * sizeof(*b1->b));
+	memcpy(b2->g, b1->g, size2 * sizeof(*b1->g));
+	memcpy(b2->p, b1->p, size2 * sizeof(*b1->p));
+	memcpy(b2->n, b1->n, size2 * sizeof(*b1->n));
+	memcpy(b2->f, b1->f, b1->flen * sizeof(*b1->f));
+#ifdef WANT_BOARD_C
+	memcpy(b2->c, b1->c, b1->clen * sizeof(*b1->c));
+#endif
+#ifdef BOARD_EMPTY3
+	memcpy(b2->e3, b1->e3, b1->e3len * sizeof(*b1->e3));
+	memcpy(b2->e3i, b1->e3i, size2 * sizeof(*b1->e3i));
+#endif
+#ifdef BOARD_SPATHASH
+	memcpy(b2->spathash, b1->spathash, size2 * sizeof(*b1->spathash));
+#endif
+#ifdef BOARD_PAT3
+	memcpy(b2->pat3, b1->pat3, size2 * sizeof(*b1->pat3));
+#endif
+#ifdef BOARD_TRAITS
+	memcpy(b2->t, b1->t, size2 * sizeof(*b1->t));
+	memcpy(b2->tq, b1->tq, b1->tqlen * sizeof(*b1->tq));
+#endif
+#ifdef BOARD_DCNN_PLANES
+	memcpy(b2->dcnn_libs, b1->dcnn_libs, size2 * sizeof(*b1->dcnn_libs));
+	memcpy(b2->dcnn_age, b1->dcnn_age, size2 * sizeof(*b1->dcnn_age));
+#endif
+	/* Most points are not group bases; new_group() clears the
+	 * info of the new ones. */
+	b2->gi[0] = b1->gi[0];
+	foreach_point(b1) {
+		if (group_at(b1, c) == c)
+			b2->gi[c] = b1->gi[c];
+	} foreach_point_end;
+}
+
+struct board *
+board_copy_to(struct board *b2, struct board *b1, void *storage)
+{
+	/* All but the unused part of history_recent[]. */
+	memcpy(b2, b1, offsetof(struct board, history_recent));
+	memcpy(b2->history_recent, b1->history_recent, b1->history_recent_len * sizeof(b1->history_recent[0]));
+	memcpy(&b2->history_recent_len, &b1->history_recent_len,
+	       sizeof(struct board) - offsetof(struct board, history_recent_len));
+
+	board_layout(b2, storage);
+	board_copy_used(b2, b1);
+	/* Playout copies don't own any history. */
+	b2->history_shared = true;
+
+	b2->fbook = NULL;
+	b2->ps = NULL;
+
+	return b2;
+}
+
 void
 board_done_noalloc(struct board *board)
 {
 	if (board->b) free(board->b);
+	if (board->history_hash && !board->history_shared) free(board->history_hash);
 	if (board->fbook) fbook_done(board->fbook);
 	if (board->ps) free(board->ps);
 }
 
+void
+board_history_off(struct board *board)
+{
+	if (board->history_hash && !board->history_shared)
+		free(board->history_hash);
+	board->history_hash = NULL;
+	board->history_recent_len = 0;
+}
+
 void
 board_done(struct board *board)
 {
@@ -245,6 +384,72 @@ board_done(struct board *board)
 	free(board);
 }
 
+/* The zobrist hashes and the coordinates cache only depend on the
+ * board size: all the boards of a size share them instead of copying
+ * them around with the rest. */
+static void
+board_size_tables(struct board *board)
+{
+	static void *tables[BOARD_MAX_SIZE + 3];
+	int hsize = board_size2(board) * 2 * sizeof(*board->h);
+	int cdsize = board_size2(board) * sizeof(*board->coord);
+
+	void *x = tables[board_size(board)];
+	if (!x) {
+		x = malloc2(hsize + cdsize);
+		hash_t *h = x;
+		uint8_t (*coord)[2] = x + hsize;
+
+		/* Set up coordinate cache */
+		foreach_point(board) {
+			coord[c][0] = c % board_size(board);
+			coord[c][1] = c / board_size(board);
+		} foreach_point_end;
+
+		/* Initialize zobrist hashtable. */
+		/* We will need these to be stable across Pachi runs for
+		 * certain kinds of pattern matching, thus we do not use
+		 * fast_random() for this. */
+		hash_t hseed = 0x3121110101112131;
+		foreach_point(board) {
+			h[c * 2] = (hseed *= 16807);
+			if (!h[c * 2])
+				h[c * 2] = 1;
+			/* And once again for white */
+			h[c * 2 + 1] = (hseed *= 16807);
+			if (!h[c * 2 + 1])
+				h[c * 2 + 1] = 1;
+		} foreach_point_end;
+
+		/* Boards may be set up by several threads. */
+		if (!__sync_bool_compare_and_swap(&tables[board_size(board)], NULL, x)) {
+			free(x);
+			x = tables[board_size(board)];
+		}
+	}
+	board->h = x;
+	board->coord = x + hsize;
+}
+
+/* The board_play.c builds, see struct board_kernels. */
+extern const struct board_kernels board_kernels_any;
+#ifndef BOARD_SIZE
+extern const struct board_kernels board_kernels_9, board_kernels_13, board_kernels_19;
+#endif
+
+static const struct board_kernels *
+board_kernels_for(int size)
+{
+#ifndef BOARD_SIZE
+	switch (size) {
+		case 9: return &board_kernels_9;
+		case 13: return &board_kernels_13;
+		case 19: return &board_kernels_19;
+	}
+#endif
+	return &board_kernels_any;
+}
+
 void
 board_resize(struct board *board, int size)
 {
@@ -263,8 +468,76 @@ board_resize(struct board *board, int size)
 
 	size_t asize = board_alloc(board);
 	memset(board->b, 0, asize);
+	board_size_tables(board);
+	board->kernels = board_kernels_for(size);
+}
+
+#ifdef BOARD_SPATHASH
+/* Spatial hash of the points at distance @d from @coord, as
+ * pattern_match_spatial() would compute it. */
+static uint32_t
+board_spathash_circle(struct board *board, coord_t coord, int d, bool w_to_play)
+{
+	/* We record all spatial patterns black-to-play; simply
+	 * reverse all colors if we are white-to-play. */
+	static enum stone bt_black[4] = { S_NONE, S_BLACK, S_WHITE, S_OFFBOARD };
+	static enum stone bt_white[4] = { S_NONE, S_WHITE, S_BLACK, S_OFFBOARD };
+	enum stone *bt = w_to_play ? bt_white : bt_black;
+
+	uint32_t h = 0;
+	for (unsigned int j = ptind[d]; j < ptind[d + 1]; j++) {
+		ptcoords_at(x, y, coord, board, j);
+		h ^= pthashes[0][j][bt[board_atxy(board, x, y)]];
+	}
+	return h;
+}
+#endif
+
+#ifdef BOARD_EMPTY3
+static inline void
+board_empty3_add(struct board *board, coord_t coord)
+{
+	if (board->e3i[coord] || board_at(board, coord) != S_NONE)
+		return;
+	foreach_8neighbor(board, coord) {
+		if (board_at(board, c) != S_NONE)
+			return;
+	} foreach_8neighbor_end;
+	board->e3[board->e3len++] = coord;
+	board->e3i[coord] = board->e3len;
 }
 
+static inline void
+board_empty3_rm(struct board *board, coord_t coord)
+{
+	int i = board->e3i[coord];
+	if (!i)
+		return;
+	coord_t last = board->e3[--board->e3len];
+	board->e3[i - 1] = last;
+	board->e3i[last] = i;
+	board->e3i[coord] = 0;
+}
+
+/* @coord changed color: a stone takes it and its neighbors out of
+ * the set, a removed stone may bring them in. */
+static void
+board_empty3_update(struct board *board, coord_t coord)
+{
+	if (board_at(board, coord) != S_NONE) {
+		board_empty3_rm(board, coord);
+		foreach_8neighbor(board, coord) {
+			board_empty3_rm(board, c);
+		} foreach_8neighbor_end;
+	} else {
+		board_empty3_add(board, coord);
+		foreach_8neighbor(board, coord) {
+			board_empty3_add(board, c);
+		} foreach_8neighbor_end;
+	}
+}
+#endif
+
 static void
 board_init_data(struct board *board)
 {
@@ -272,20 +545,7 @@ board_init_data(struct board *board)
 
 	board_setup(board);
 	board_resize(board, size - 2 /* S_OFFBOARD margin */);
-
-	/* Setup neighborhood iterators */
-	board->nei8[0] = -size - 1; // (-1,-1)
-	board->nei8[1] = 1;
-	board->nei8[2] = 1;
-	board->nei8[3] = size - 2; // (-1,0)
-	board->nei8[4] = 2;
-	board->nei8[5] = size - 2; // (-1,1)
-	board->nei8[6] = 1;
-	board->nei8[7] = 1;
-	board->dnei[0] = -size - 1;
-	board->dnei[1] = 2;
-	board->dnei[2] = size*2 - 2;
-	board->dnei[3] = 2;
+	board->history_hash = calloc2(1 << history_hash_bits, sizeof(*board->history_hash));
 
 	/* Setup initial symmetry */
 	if (size % 2) {
@@ -302,12 +562,6 @@ board_init_data(struct board *board)
 		board->symmetry.type = SYM_NONE;
 	}
 
-	/* Set up coordinate cache */
-	foreach_point(board) {
-		board->coord[c][0] = c % board_size(board);
-		board->coord[c][1] = c / board_size(board);
-	} foreach_point_end;
-
 	/* Draw the offboard margin */
 	int top_row = board_size2(board) - board_size(board);
 	int i;
@@ -330,35 +584,20 @@ board_init_data(struct board *board)
 		if (i % board_size(board) != 0 && i % board_size(board) != board_size(board) - 1)
 			board->f[board->flen++] = i;
 
-	/* Initialize zobrist hashtable. */
-	/* We will need these to be stable across Pachi runs for
-	 * certain kinds of pattern matching, thus we do not use
-	 * fast_random() for this. */
-	hash_t hseed = 0x3121110101112131;
-	foreach_point(board) {
-		board->h[c * 2] = (hseed *= 16807);
-		if (!board->h[c * 2])
-			board->h[c * 2] = 1;
-		/* And once again for white */
-		board->h[c * 2 + 1] = (hseed *= 16807);
-		if (!board->h[c * 2 + 1])
-			board->h[c * 2 + 1] = 1;
-	} foreach_point_end;
-
 #ifdef BOARD_SPATHASH
 	/* Initialize spatial hashes. */
 	foreach_point(board) {
 		for (int d = 1; d <= BOARD_SPATHASH_MAXD; d++) {
-			for (int j = ptind[d]; j < ptind[d + 1]; j++) {
-				ptcoords_at(x, y, c, board, j);
-				board->spathash[coord_xy(board, x, y)][d - 1][0] ^=
-					pthashes[0][j][board_at(board, c)];
-				board->spathash[coord_xy(board, x, y)][d - 1][1] ^=
-					pthashes[0][j][stone_other(board_at(board, c))];
-			}
+			board->spathash[c][d - 1][0] = board_spathash_circle(board, c, d, false);
+			board->spathash[c][d - 1][1] = board_spathash_circle(board, c, d, true);
 		}
 	} foreach_point_end;
 #endif
+#ifdef BOARD_EMPTY3
+	foreach_free_point(board) {
+		board_empty3_add(board, c);
+	} foreach_free_point_end;
+#endif
 #ifdef BOARD_PAT3
 	/* Initialize 3x3 pattern codes. */
 	foreach_point(board) {
@@ -403,10 +642,6 @@ board_clear(struct board *board)
 	board->komi = komi;
 	board->fbookfile = fbookfile;
 	board->rules = rules;
-
-	if (board->fbookfile) {
-		board->fbook = fbook_init(board->fbookfile, board);
-	}
 }
 
 static char *
@@ -527,149 +762,51 @@ board_print(struct board *board, FILE *f)
 }
 
 
-#ifdef BOARD_TRAITS
-
-#if BOARD_TRAIT_SAFE == 1
-static bool
-board_trait_safe(struct board *board, coord_t coord, enum stone color)
-{
-	return board_safe_to_play(board, coord, color);
-}
-#elif BOARD_TRAIT_SAFE == 2
-static bool
-board_trait_safe(struct board *board, coord_t coord, enum stone color)
-{
-	return !is_bad_selfatari(board, color, coord);
-}
-#endif
 
-static void
-board_trait_recompute(struct board *board, coord_t coord)
-{
-	int sfb = -1, sfw = -1;
-#ifdef BOARD_TRAIT_SAFE
-	sfb = trait_at(board, coord, S_BLACK).safe = board_trait_safe(board, coord, S_BLACK);
-	sfw = trait_at(board, coord, S_WHITE).safe = board_trait_safe(board, coord, S_WHITE);
-#endif
-	if (DEBUGL(8)) {
-		fprintf(stderr, "traits[%s:%s lib=%d] (black cap=%d cap1=%d safe=%d) (white cap=%d cap1=%d safe=%d)\n",
-			coord2sstr(coord, board), stone2str(board_at(board, coord)), immediate_liberty_count(board, coord),
-			trait_at(board, coord, S_BLACK).cap, trait_at(board, coord, S_BLACK).cap1, sfb,
-			trait_at(board, coord, S_WHITE).cap, trait_at(board, coord, S_WHITE).cap1, sfw);
-	}
-}
-#endif
 
-/* Recompute traits for dirty points that we have previously touched
- * somehow (libs of their neighbors changed or so). */
-static void
-board_traits_recompute(struct board *board)
+coord_t
+board_coord_transform(struct board *b, coord_t c, int sym)
 {
-#ifdef BOARD_TRAITS
-	for (int i = 0; i < board->tqlen; i++) {
-		coord_t coord = board->tq[i];
-		trait_at(board, coord, S_BLACK).dirty = false;
-		if (board_at(board, coord) != S_NONE)
-			continue;
-		board_trait_recompute(board, coord);
-	}
-	board->tqlen = 0;
-#endif
+	int n = real_board_size(b) + 1;
+	int x = coord_x(c, b), y = coord_y(c, b);
+	if (sym & 4) { int t = x; x = y; y = t; }
+	if (sym & 1) x = n - x;
+	if (sym & 2) y = n - y;
+	return coord_xy(b, x, y);
 }
 
-/* Queue traits of given point for recomputing. */
-static void
-board_trait_queue(struct board *board, coord_t coord)
+coord_t
+board_coord_untransform(struct board *b, coord_t c, int sym)
 {
-#ifdef BOARD_TRAITS
-	if (trait_at(board, coord, S_BLACK).dirty)
-		return;
-	board->tq[board->tqlen++] = coord;
-	trait_at(board, coord, S_BLACK).dirty = true;
-#endif
+	int n = real_board_size(b) + 1;
+	int x = coord_x(c, b), y = coord_y(c, b);
+	if (sym & 1) x = n - x;
+	if (sym & 2) y = n - y;
+	if (sym & 4) { int t = x; x = y; y = t; }
+	return coord_xy(b, x, y);
 }
 
-
-/* Update board hash with given coordinate. */
-static void profiling_noinline
-board_hash_update(struct board *board, coord_t coord, enum stone color)
+hash_t
+board_canonical_hash(struct board *b, int *sym)
 {
-	board->hash ^= hash_at(board, coord, color);
-	board->qhash[coord_quadrant(coord, board)] ^= hash_at(board, coord, color);
-	if (DEBUGL(8))
-		fprintf(stderr, "board_hash_update(%d,%d,%d) ^ %"PRIhash" -> %"PRIhash"\n", color, coord_x(coord, board), coord_y(coord, board), hash_at(board, coord, color), board->hash);
-
-#ifdef BOARD_SPATHASH
-	/* Gridcular metric is reflective, so we update all hashes
-	 * of appropriate ditance in OUR circle. */
-	for (int d = 1; d <= BOARD_SPATHASH_MAXD; d++) {
-		for (int j = ptind[d]; j < ptind[d + 1]; j++) {
-			ptcoords_at(x, y, coord, board, j);
-			/* We either changed from S_NONE to color
-			 * or vice versa; doesn't matter. */
-			board->spathash[coord_xy(board, x, y)][d - 1][0] ^=
-				pthashes[0][j][color] ^ pthashes[0][j][S_NONE];
-			board->spathash[coord_xy(board, x, y)][d - 1][1] ^=
-				pthashes[0][j][stone_other(color)] ^ pthashes[0][j][S_NONE];
-		}
-	}
-#endif
-
-#if defined(BOARD_PAT3)
-	/* @color is not what we need in case of capture. */
-	static const int ataribits[8] = { -1, 0, -1, 1, 2, -1, 3, -1 };
-	enum stone new_color = board_at(board, coord);
-	bool in_atari = false;
-	if (new_color == S_NONE) {
-		board->pat3[coord] = pattern3_hash(board, coord);
-	} else {
-		in_atari = (board_group_info(board, group_at(board, coord)).libs == 1);
-	}
-	foreach_8neighbor(board, coord) {
-		/* Internally, the loop uses fn__i=[0..7]. We can use
-		 * it directly to address bits within the bitmap of the
-		 * neighbors since the bitmap order is reverse to the
-		 * loop order. */
-		if (board_at(board, c) != S_NONE)
+	hash_t hashes[8] = { 0 };
+	foreach_point(b) {
+		enum stone color = board_at(b, c);
+		if (color != S_BLACK && color != S_WHITE)
 			continue;
-		board->pat3[c] &= ~(3 << (fn__i*2));
-		board->pat3[c] |= new_color << (fn__i*2);
-		if (ataribits[fn__i] >= 0) {
-			board->pat3[c] &= ~(1 << (16 + ataribits[fn__i]));
-			board->pat3[c] |= in_atari << (16 + ataribits[fn__i]);
-		}
-#if defined(BOARD_TRAITS)
-		board_trait_queue(board, c);
-#endif
-	} foreach_8neighbor_end;
-#endif
-}
+		for (int s = 0; s < 8; s++)
+			hashes[s] ^= hash_at(b, board_coord_transform(b, c, s), color);
+	} foreach_point_end;
 
-/* Commit current board hash to history. */
-static void profiling_noinline
-board_hash_commit(struct board *board)
-{
-	if (DEBUGL(8))
-		fprintf(stderr, "board_hash_commit %"PRIhash"\n", board->hash);
-	if (likely(board->history_hash[board->hash & history_hash_mask]) == 0) {
-		board->history_hash[board->hash & history_hash_mask] = board->hash;
-	} else {
-		hash_t i = board->hash;
-		while (board->history_hash[i & history_hash_mask]) {
-			if (board->history_hash[i & history_hash_mask] == board->hash) {
-				if (DEBUGL(5))
-					fprintf(stderr, "SUPERKO VIOLATION noted at %d,%d\n",
-						coord_x(board->last_move.coord, board), coord_y(board->last_move.coord, board));
-				board->superko_violation = true;
-				return;
-			}
-			i = history_hash_next(i);
-		}
-		board->history_hash[i & history_hash_mask] = board->hash;
-	}
+	int best = 0;
+	for (int s = 1; s < 8; s++)
+		if (hashes[s] < hashes[best])
+			best = s;
+	if (sym)
+		*sym = best;
+	return hashes[best];
 }
 
-
 void
 board_symmetry_update(struct board *b, struct board_symmetry *symmetry, coord_t c)
 {
@@ -798,1229 +935,147 @@ board_handicap(struct board *board, int stones, FILE *f)
 }
 
 
-static void __attribute__((noinline))
-check_libs_consistency(struct board *board, group_t g)
+
+
+/* Undo, supported only for pass moves. This form of undo is required by KGS
+ * to settle disputes on dead groups. See also fast_board_undo() */
+int board_undo(struct board *board)
 {
-#ifdef DEBUG
-	if (!g) return;
-	struct group *gi = &board_group_info(board, g);
-	for (int i = 0; i < GROUP_KEEP_LIBS; i++)
-		if (gi->lib[i] && board_at(board, gi->lib[i]) != S_NONE) {
-			fprintf(stderr, "BOGUS LIBERTY %s of group %d[%s]\n", coord2sstr(gi->lib[i], board), g, coord2sstr(group_base(g), board));
-			assert(0);
-		}
-#endif
+	if (!is_pass(board->last_move.coord))
+		return -1;
+	if (board->rules == RULES_SIMING) {
+		/* Return pass stone to the passing player. */
+		board->captures[stone_other(board->last_move.color)]--;
+	}
+	board->last_move = board->last_move2;
+	board->last_move2 = board->last_move3;
+	board->last_move3 = board->last_move4;
+	if (board->last_ko_age == board->moves)
+		board->ko = board->last_ko;
+	return 0;
 }
 
-static void
-check_pat3_consistency(struct board *board, coord_t coord)
+bool
+board_permit(struct board *b, struct move *m, void *data)
 {
-#ifdef DEBUG
-	foreach_8neighbor(board, coord) {
-		if (board_at(board, c) == S_NONE && pattern3_hash(board, c) != board->pat3[c]) {
-			board_print(board, stderr);
-			fprintf(stderr, "%s(%d)->%s(%d) computed %x != stored %x (%d)\n", coord2sstr(coord, board), coord, coord2sstr(c, board), c, pattern3_hash(board, c), board->pat3[c], fn__i);
-			assert(0);
-		}
-	} foreach_8neighbor_end;
-#endif
+	if (unlikely(board_is_one_point_eye(b, m->coord, m->color)) /* bad idea to play into one, usually */
+	    || !board_is_valid_move(b, m))
+		return false;
+	return true;
 }
 
-static void
-board_capturable_add(struct board *board, group_t group, coord_t lib, bool onestone)
-{
-	//fprintf(stderr, "group %s cap %s\n", coord2sstr(group, board), coord2sstr(lib, boarD));
-#ifdef BOARD_TRAITS
-	/* Increase capturable count trait of my last lib. */
-	enum stone capturing_color = stone_other(board_at(board, group));
-	assert(capturing_color == S_BLACK || capturing_color == S_WHITE);
-	foreach_neighbor(board, lib, {
-		if (DEBUGL(8) && group_at(board, c) == group)
-			fprintf(stderr, "%s[%d] %s cap bump bc of %s(%d) member %s onestone %d\n", coord2sstr(lib, board), trait_at(board, lib, capturing_color).cap, stone2str(capturing_color), coord2sstr(group, board), board_group_info(board, group).libs, coord2sstr(c, board), onestone);
-		trait_at(board, lib, capturing_color).cap += (group_at(board, c) == group);
-		trait_at(board, lib, capturing_color).cap1 += (group_at(board, c) == group && onestone);
-	});
-	board_trait_queue(board, lib);
-#endif
 
-#ifdef BOARD_PAT3
-	int fn__i = 0;
-	foreach_neighbor(board, lib, {
-		board->pat3[lib] |= (group_at(board, c) == group) << (16 + 3 - fn__i);
-		fn__i++;
-	});
-#endif
 
-#ifdef WANT_BOARD_C
-	/* Update the list of capturable groups. */
-	assert(group);
-	assert(board->clen < board_size2(board));
-	board->c[board->clen++] = group;
-#endif
+/* For each code of the 4 diagonal neighbors colors (2 bits each, as in
+ * pat3), bit @color set if the point could be a false eye of @color. */
+static uint8_t false_eye_table[256];
+
+static void __attribute__((constructor))
+false_eye_table_init(void)
+{
+	for (int code = 0; code < 256; code++) {
+		enum stone color_diag_libs[S_MAX] = {0, 0, 0, 0};
+		for (int i = 0; i < 4; i++)
+			color_diag_libs[(code >> (i * 2)) & 3]++;
+		/* For false eye, we need two enemy stones diagonally in the
+		 * middle of the board, or just one enemy stone at the edge
+		 * or in the corner. */
+		for (enum stone eye_color = S_BLACK; eye_color <= S_WHITE; eye_color++)
+			if (color_diag_libs[stone_other(eye_color)] + !!color_diag_libs[S_OFFBOARD] >= 2)
+				false_eye_table[code] |= 1 << eye_color;
+	}
 }
-static void
-board_capturable_rm(struct board *board, group_t group, coord_t lib, bool onestone)
+
+bool
+board_is_false_eyelike(struct board *board, coord_t coord, enum stone eye_color)
 {
-	//fprintf(stderr, "group %s nocap %s\n", coord2sstr(group, board), coord2sstr(lib, board));
-#ifdef BOARD_TRAITS
-	/* Decrease capturable count trait of my previously-last lib. */
-	enum stone capturing_color = stone_other(board_at(board, group));
-	assert(capturing_color == S_BLACK || capturing_color == S_WHITE);
-	foreach_neighbor(board, lib, {
-		if (DEBUGL(8) && group_at(board, c) == group)
-			fprintf(stderr, "%s[%d] cap dump bc of %s(%d) member %s onestone %d\n", coord2sstr(lib, board), trait_at(board, lib, capturing_color).cap, coord2sstr(group, board), board_group_info(board, group).libs, coord2sstr(c, board), onestone);
-		trait_at(board, lib, capturing_color).cap -= (group_at(board, c) == group);
-		trait_at(board, lib, capturing_color).cap1 -= (group_at(board, c) == group && onestone);
-	});
-	board_trait_queue(board, lib);
-#endif
+	/* XXX: We attempt false eye detection but we will yield false
+	 * positives in case of http://senseis.xmp.net/?TwoHeadedDragon :-( */
 
+	int code;
 #ifdef BOARD_PAT3
-	int fn__i = 0;
-	foreach_neighbor(board, lib, {
-		board->pat3[lib] &= ~((group_at(board, c) == group) << (16 + 3 - fn__i));
-		fn__i++;
-	});
+	if (!board->quicked) {
+		/* The pat3 code of the (empty) point has them already. */
+		hash3_t pat = board->pat3[coord];
+		code = ((pat >> 14) & 3) | ((pat >> 8) & 0xc) | (pat & 0x30) | ((pat & 3) << 6);
+	} else
 #endif
-
-#ifdef WANT_BOARD_C
-	/* Update the list of capturable groups. */
-	for (int i = 0; i < board->clen; i++) {
-		if (unlikely(board->c[i] == group)) {
-			board->c[i] = board->c[--board->clen];
-			return;
-		}
+	{
+		code = 0;
+		int i = 0;
+		foreach_diag_neighbor(board, coord) {
+			code |= board_at(board, c) << (i++ * 2);
+		} foreach_diag_neighbor_end;
 	}
-	fprintf(stderr, "rm of bad group %d\n", group_base(group));
-	assert(0);
-#endif
+	return false_eye_table[code] & (1 << eye_color);
 }
 
-static void
-board_atariable_add(struct board *board, group_t group, coord_t lib1, coord_t lib2)
+bool
+board_is_one_point_eye(struct board *board, coord_t coord, enum stone eye_color)
 {
-#ifdef BOARD_TRAITS
-	board_trait_queue(board, lib1);
-	board_trait_queue(board, lib2);
-#endif
+	return board_is_eyelike(board, coord, eye_color)
+		&& !board_is_false_eyelike(board, coord, eye_color);
 }
-static void
-board_atariable_rm(struct board *board, group_t group, coord_t lib1, coord_t lib2)
+
+enum stone
+board_get_one_point_eye(struct board *board, coord_t coord)
 {
-#ifdef BOARD_TRAITS
-	board_trait_queue(board, lib1);
-	board_trait_queue(board, lib2);
-#endif
+	if (board_is_one_point_eye(board, coord, S_WHITE))
+		return S_WHITE;
+	else if (board_is_one_point_eye(board, coord, S_BLACK))
+		return S_BLACK;
+	else
+		return S_NONE;
 }
 
-static void
-board_group_addlib(struct board *board, group_t group, coord_t coord, struct board_undo *u)
+
+floating_t
+board_fast_score(struct board *board)
 {
-	if (DEBUGL(7)) {
-		fprintf(stderr, "Group %d[%s] %d: Adding liberty %s\n",
-			group_base(group), coord2sstr(group_base(group), board),
-			board_group_info(board, group).libs, coord2sstr(coord, board));
-	}
+	int scores[S_MAX];
+	memset(scores, 0, sizeof(scores));
 
-	if (!u) check_libs_consistency(board, group);
+	/* Stones: vectorized pass over the whole stone array. */
+	simd.count_stones(board->b, board_size2(board), &scores[S_BLACK], &scores[S_WHITE]);
 
-	struct group *gi = &board_group_info(board, group);
-	bool onestone = group_is_onestone(board, group);
-	if (gi->libs < GROUP_KEEP_LIBS) {
-		for (int i = 0; i < GROUP_KEEP_LIBS; i++) {
-#if 0
-			/* Seems extra branch just slows it down */
-			if (!gi->lib[i])
-				break;
-#endif
-			if (unlikely(gi->lib[i] == coord))
-				return;
-		}
-		if (!u) {
-			if (gi->libs == 0) {
-				board_capturable_add(board, group, coord, onestone);
-			} else if (gi->libs == 1) {
-				board_capturable_rm(board, group, gi->lib[0], onestone);
-				board_atariable_add(board, group, gi->lib[0], coord);
-			} else if (gi->libs == 2) {
-				board_atariable_rm(board, group, gi->lib[0], gi->lib[1]);
-			}
-		}
-		gi->lib[gi->libs++] = coord;
+	/* Eyes: only free points can be, no need to scan the rest. */
+	if (board->rules != RULES_STONES_ONLY) {
+		foreach_free_point(board) {
+			scores[board_get_one_point_eye(board, c)]++;
+		} foreach_free_point_end;
 	}
 
-	if (!u) check_libs_consistency(board, group);
-}
-
-static void
-board_group_find_extra_libs(struct board *board, group_t group, struct group *gi, coord_t avoid)
-{
-	/* Add extra liberty from the board to our liberty list. */
-	unsigned char watermark[board_size2(board) / 8];
-	memset(watermark, 0, sizeof(watermark));
-#define watermark_get(c)	(watermark[c >> 3] & (1 << (c & 7)))
-#define watermark_set(c)	watermark[c >> 3] |= (1 << (c & 7))
-
-	for (int i = 0; i < GROUP_KEEP_LIBS - 1; i++)
-		watermark_set(gi->lib[i]);
-	watermark_set(avoid);
-
-	foreach_in_group(board, group) {
-		coord_t coord2 = c;
-		foreach_neighbor(board, coord2, {
-			if (board_at(board, c) + watermark_get(c) != S_NONE)
-				continue;
-			watermark_set(c);
-			gi->lib[gi->libs++] = c;
-			if (unlikely(gi->libs >= GROUP_KEEP_LIBS))
-				return;
-		} );
-	} foreach_in_group_end;
-#undef watermark_get
-#undef watermark_set
-}
-
-static void
-board_group_rmlib(struct board *board, group_t group, coord_t coord, struct board_undo *u)
-{
-	if (DEBUGL(7)) {
-		fprintf(stderr, "Group %d[%s] %d: Removing liberty %s\n",
-			group_base(group), coord2sstr(group_base(group), board),
-			board_group_info(board, group).libs, coord2sstr(coord, board));
-	}
-
-	struct group *gi = &board_group_info(board, group);
-	bool onestone = group_is_onestone(board, group);
-	for (int i = 0; i < GROUP_KEEP_LIBS; i++) {
-#if 0
-		/* Seems extra branch just slows it down */
-		if (!gi->lib[i])
-			break;
-#endif
-		if (likely(gi->lib[i] != coord))
-			continue;
-
-		coord_t lib = gi->lib[i] = gi->lib[--gi->libs];
-		gi->lib[gi->libs] = 0;
-		
-		if (!u) check_libs_consistency(board, group);
-
-		/* Postpone refilling lib[] until we need to. */
-		assert(GROUP_REFILL_LIBS > 1);
-		if (gi->libs > GROUP_REFILL_LIBS)
-			return;
-		if (gi->libs == GROUP_REFILL_LIBS)
-			board_group_find_extra_libs(board, group, gi, coord);
-		if (u) return;
-		
-		if (gi->libs == 2) {
-			board_atariable_add(board, group, gi->lib[0], gi->lib[1]);
-		} else if (gi->libs == 1) {
-			board_capturable_add(board, group, gi->lib[0], onestone);
-			board_atariable_rm(board, group, gi->lib[0], lib);
-		} else if (gi->libs == 0)
-			board_capturable_rm(board, group, lib, onestone);
-		return;
-	}
-
-	/* This is ok even if gi->libs < GROUP_KEEP_LIBS since we
-	 * can call this multiple times per coord. */
-	if (!u) check_libs_consistency(board, group);
-	return;
+	return board->komi + (board->rules != RULES_SIMING ? board->handicap : 0) + scores[S_WHITE] - scores[S_BLACK];
 }
 
+/* Owner map: 0: undecided; 1: black; 2: white; 3: dame */
 
-/* This is a low-level routine that doesn't maintain consistency
- * of all the board data structures. */
+/* Flood-fill the empty region containing @c in a single pass and
+ * assign it to the only color it reaches, or dame. */
 static void
-board_remove_stone(struct board *board, group_t group, coord_t c, struct board_undo *u)
-{
-	enum stone color = board_at(board, c);
-	board_at(board, c) = S_NONE;
-	group_at(board, c) = 0;
-	if (!u) {
-		board_hash_update(board, c, color);
-#ifdef BOARD_TRAITS
-		/* We mark as cannot-capture now. If this is a ko/snapback,
-		 * we will get incremented later in board_group_addlib(). */
-		trait_at(board, c, S_BLACK).cap = trait_at(board, c, S_BLACK).cap1 = 0;
-		trait_at(board, c, S_WHITE).cap = trait_at(board, c, S_WHITE).cap1 = 0;
-		board_trait_queue(board, c);
-#endif
- 	}
-
-	/* Increase liberties of surrounding groups */
-	coord_t coord = c;
-	foreach_neighbor(board, coord, {
-		dec_neighbor_count_at(board, c, color);
-		if (!u) board_trait_queue(board, c);
-		group_t g = group_at(board, c);
-		if (g && g != group)
-			board_group_addlib(board, g, coord, u);
-	});
-	if (u) return;
-
-#ifdef BOARD_PAT3
-	/* board_hash_update() might have seen the freed up point as able
-	 * to capture another group in atari that only after the loop
-	 * above gained enough liberties. Reset pat3 again. */
-	board->pat3[c] = pattern3_hash(board, c);
-#endif
-
-	if (DEBUGL(6))
-		fprintf(stderr, "pushing free move [%d]: %d,%d\n", board->flen, coord_x(c, board), coord_y(c, board));
-	board->f[board->flen++] = c;
-}
-
-static int profiling_noinline
-board_group_capture(struct board *board, group_t group, struct board_undo *u)
-{
-	int stones = 0;
-
-	foreach_in_group(board, group) {
-		board->captures[stone_other(board_at(board, c))]++;
-		board_remove_stone(board, group, c, u);
-		stones++;
-	} foreach_in_group_end;
-
-	struct group *gi = &board_group_info(board, group);
-	assert(gi->libs == 0);
-	memset(gi, 0, sizeof(*gi));
-
-	return stones;
-}
-
-
-static void profiling_noinline
-add_to_group(struct board *board, group_t group, coord_t prevstone, coord_t coord, struct board_undo *u)
-{
-#ifdef BOARD_TRAITS
-	struct group *gi = &board_group_info(board, group);
-	bool onestone = group_is_onestone(board, group);
-
-	if (!u && gi->libs == 1) {
-		/* Our group is temporarily in atari; make sure the capturable
-		 * counts also correspond to the newly added stone before we
-		 * start adding liberties again so bump-dump ops match. */
-		enum stone capturing_color = stone_other(board_at(board, group));
-		assert(capturing_color == S_BLACK || capturing_color == S_WHITE);
-
-		coord_t lib = board_group_info(board, group).lib[0];
-		if (coord_is_adjecent(lib, coord, board)) {
-			if (DEBUGL(8))
-				fprintf(stderr, "add_to_group %s: %s[%d] bump\n", coord2sstr(group, board), coord2sstr(lib, board), trait_at(board, lib, capturing_color).cap);
-			trait_at(board, lib, capturing_color).cap++;
-			/* This is never a 1-stone group, obviously. */
-			board_trait_queue(board, lib);
-		}
-
-		if (onestone) {
-			/* We are not 1-stone group anymore, update the cap1
-			 * counter specifically. */
-			foreach_neighbor(board, group, {
-				if (board_at(board, c) != S_NONE) continue;
-				trait_at(board, c, capturing_color).cap1--;
-				board_trait_queue(board, c);
-			});
-		}
-	}
-#endif
-
-	group_at(board, coord) = group;
-	groupnext_at(board, coord) = groupnext_at(board, prevstone);
-	groupnext_at(board, prevstone) = coord;
-
-	foreach_neighbor(board, coord, {
-		if (board_at(board, c) == S_NONE)
-			board_group_addlib(board, group, c, u);
-	});
-
-	if (DEBUGL(8))
-		fprintf(stderr, "add_to_group: added (%d,%d ->) %d,%d (-> %d,%d) to group %d\n",
-			coord_x(prevstone, board), coord_y(prevstone, board),
-			coord_x(coord, board), coord_y(coord, board),
-			groupnext_at(board, coord) % board_size(board), groupnext_at(board, coord) / board_size(board),
-			group_base(group));
-}
-
-static void profiling_noinline
-merge_groups(struct board *board, group_t group_to, group_t group_from, struct board_undo *u)
-{
-	if (DEBUGL(7))
-		fprintf(stderr, "board_play_raw: merging groups %d -> %d\n",
-			group_base(group_from), group_base(group_to));
-	struct group *gi_from = &board_group_info(board, group_from);
-	struct group *gi_to = &board_group_info(board, group_to);
-	bool onestone_from = group_is_onestone(board, group_from);
-	bool onestone_to = group_is_onestone(board, group_to);
-
-	if (!u) {
-		/* We do this early before the group info is rewritten. */
-		if (gi_from->libs == 2)
-			board_atariable_rm(board, group_from, gi_from->lib[0], gi_from->lib[1]);
-		else if (gi_from->libs == 1)
-			board_capturable_rm(board, group_from, gi_from->lib[0], onestone_from);
-	}
-
-	if (DEBUGL(7))
-		fprintf(stderr,"---- (froml %d, tol %d)\n", gi_from->libs, gi_to->libs);
-
-	if (gi_to->libs < GROUP_KEEP_LIBS) {
-		for (int i = 0; i < gi_from->libs; i++) {
-			for (int j = 0; j < gi_to->libs; j++)
-				if (gi_to->lib[j] == gi_from->lib[i])
-					goto next_from_lib;
-			if (!u) {
-				if (gi_to->libs == 0) {
-					board_capturable_add(board, group_to, gi_from->lib[i], onestone_to);
-				} else if (gi_to->libs == 1) {
-					board_capturable_rm(board, group_to, gi_to->lib[0], onestone_to);
-					board_atariable_add(board, group_to, gi_to->lib[0], gi_from->lib[i]);
-				} else if (gi_to->libs == 2) {
-					board_atariable_rm(board, group_to, gi_to->lib[0], gi_to->lib[1]);
+board_tromp_taylor_region(struct board *board, int *ownermap, coord_t *queue, coord_t c)
+{
+	int reach = 0;
+	int qlen = 0;
+	queue[qlen++] = c;
+	ownermap[c] = 3; // visited
+	for (int i = 0; i < qlen; i++) {
+		foreach_neighbor(board, queue[i], {
+			enum stone s = board_at(board, c);
+			if (s == S_NONE) {
+				if (!ownermap[c]) {
+					ownermap[c] = 3;
+					queue[qlen++] = c;
 				}
+			} else if (s != S_OFFBOARD) {
+				reach |= ownermap[c];
 			}
-			gi_to->lib[gi_to->libs++] = gi_from->lib[i];
-			if (gi_to->libs >= GROUP_KEEP_LIBS)
-				break;
-next_from_lib:;
-		}
-	}
-
-	if (!u && gi_to->libs == 1) {
-		coord_t lib = board_group_info(board, group_to).lib[0];
-#ifdef BOARD_TRAITS
-		enum stone capturing_color = stone_other(board_at(board, group_to));
-		assert(capturing_color == S_BLACK || capturing_color == S_WHITE);
-
-		/* Our group is currently in atari; make sure we properly
-		 * count in even the neighbors from the other group in the
-		 * capturable counter. */
-		foreach_neighbor(board, lib, {
-			if (DEBUGL(8) && group_at(board, c) == group_from)
-				fprintf(stderr, "%s[%d] cap bump\n", coord2sstr(lib, board), trait_at(board, lib, capturing_color).cap);
-			trait_at(board, lib, capturing_color).cap += (group_at(board, c) == group_from);
-			/* This is never a 1-stone group, obviously. */
 		});
-		board_trait_queue(board, lib);
-
-		if (onestone_to) {
-			/* We are not 1-stone group anymore, update the cap1
-			 * counter specifically. */
-			foreach_neighbor(board, group_to, {
-				if (board_at(board, c) != S_NONE) continue;
-				trait_at(board, c, capturing_color).cap1--;
-				board_trait_queue(board, c);
-			});
-		}
-#endif
-#ifdef BOARD_PAT3
-		if (gi_from->libs == 1) {
-			/* We removed group_from from capturable groups,
-			 * therefore switching the atari flag off.
-			 * We need to set it again since group_to is also
-			 * capturable. */
-			int fn__i = 0;
-			foreach_neighbor(board, lib, {
-				board->pat3[lib] |= (group_at(board, c) == group_from) << (16 + 3 - fn__i);
-				fn__i++;
-			});
-		}
-#endif
-	}
-
-	coord_t last_in_group;
-	foreach_in_group(board, group_from) {
-		last_in_group = c;
-		group_at(board, c) = group_to;
-	} foreach_in_group_end;
-
-	if (u) u->merged[++u->nmerged_tmp].last = last_in_group;
-	groupnext_at(board, last_in_group) = groupnext_at(board, group_base(group_to));
-	groupnext_at(board, group_base(group_to)) = group_base(group_from);
-	memset(gi_from, 0, sizeof(struct group));
-
-	if (DEBUGL(7))
-		fprintf(stderr, "board_play_raw: merged group: %d\n",
-			group_base(group_to));
-}
-
-static group_t profiling_noinline
-new_group(struct board *board, coord_t coord, struct board_undo *u)
-{
-	group_t group = coord;
-	struct group *gi = &board_group_info(board, group);
-	foreach_neighbor(board, coord, {
-		if (board_at(board, c) == S_NONE)
-			/* board_group_addlib is ridiculously expensive for us */
-#if GROUP_KEEP_LIBS < 4
-			if (gi->libs < GROUP_KEEP_LIBS)
-#endif
-			gi->lib[gi->libs++] = c;
-	});
-
-	group_at(board, coord) = group;
-	groupnext_at(board, coord) = 0;
-
-	if (!u) {
-		if (gi->libs == 2)
-			board_atariable_add(board, group, gi->lib[0], gi->lib[1]);
-		else if (gi->libs == 1)
-			board_capturable_add(board, group, gi->lib[0], true);
-		check_libs_consistency(board, group);
-	}
-
-	if (DEBUGL(8))
-		fprintf(stderr, "new_group: added %d,%d to group %d\n",
-			coord_x(coord, board), coord_y(coord, board),
-			group_base(group));
-
-	return group;
-}
-
-static inline void
-undo_save_merge(struct board *b, struct board_undo *u, group_t g, coord_t c)
-{
-	if (g == u->merged[0].group || g == u->merged[1].group || 
-	    g == u->merged[2].group || g == u->merged[3].group)
-		return;
-	
-	int i = u->nmerged++;
-	if (!i)
-		u->inserted = c;
-	u->merged[i].group = g;
-	u->merged[i].last = 0;   // can remove
-	u->merged[i].info = board_group_info(b, g);
-}
-
-static inline void
-undo_save_enemy(struct board *b, struct board_undo *u, group_t g)
-{
-	if (g == u->enemies[0].group || g == u->enemies[1].group ||
-	    g == u->enemies[2].group || g == u->enemies[3].group)
-		return;
-	
-	int i = u->nenemies++;
-	u->enemies[i].group = g;
-	u->enemies[i].info = board_group_info(b, g);
-		
-	int j = 0;
-	coord_t *stones = u->enemies[i].stones;
-	if (board_group_info(b, g).libs <= 1) { // Will be captured
-		foreach_in_group(b, g) {
-			stones[j++] = c;
-		} foreach_in_group_end;
-		u->captures += j;
-	}
-	stones[j] = 0;
-}
-
-static void
-undo_save_group_info(struct board *b, coord_t coord, enum stone color, struct board_undo *u)
-{
-	u->next_at = groupnext_at(b, coord);
-
-	foreach_neighbor(b, coord, {			
-		group_t g = group_at(b, c);
-	
-		if (board_at(b, c) == color)
-			undo_save_merge(b, u, g, c);
-		else if (board_at(b, c) == stone_other(color)) 
-			undo_save_enemy(b, u, g);
-	});
-}		
-
-static void
-undo_save_suicide(struct board *b, coord_t coord, enum stone color, struct board_undo *u)
-{
-	foreach_neighbor(b, coord, {
-		if (board_at(b, c) == color) {
-			// Handle suicide as a capture ...
-			undo_save_enemy(b, u, group_at(b, c));
-			return;
-		}
-	});
-	assert(0);
-}
-
-static inline group_t
-play_one_neighbor(struct board *board,
-		  coord_t coord, enum stone color, enum stone other_color,
-		  coord_t c, group_t group, struct board_undo *u)
-{
-	enum stone ncolor = board_at(board, c);
-	group_t ngroup = group_at(board, c);
-
-	inc_neighbor_count_at(board, c, color);
-	/* We can be S_NONE, in that case we need to update the safety
-	 * trait since we might be left with only one liberty. */
-	if (!u) board_trait_queue(board, c);
-
-	if (!ngroup)
-		return group;
-
-	board_group_rmlib(board, ngroup, coord, u);
-	if (DEBUGL(7))
-		fprintf(stderr, "board_play_raw: reducing libs for group %d (%d:%d,%d)\n",
-			group_base(ngroup), ncolor, color, other_color);
-
-	if (ncolor == color && ngroup != group) {
-		if (!group) {
-			group = ngroup;
-			add_to_group(board, group, c, coord, u);
-		} else {
-			merge_groups(board, group, ngroup, u);
-		}
-	} else if (ncolor == other_color) {
-		if (DEBUGL(8)) {
-			struct group *gi = &board_group_info(board, ngroup);
-			fprintf(stderr, "testing captured group %d[%s]: ", group_base(ngroup), coord2sstr(group_base(ngroup), board));
-			for (int i = 0; i < GROUP_KEEP_LIBS; i++)
-				fprintf(stderr, "%s ", coord2sstr(gi->lib[i], board));
-			fprintf(stderr, "\n");
-		}
-		if (unlikely(board_group_captured(board, ngroup)))
-			board_group_capture(board, ngroup, u);
-	}
-	return group;
-}
-
-/* We played on a place with at least one liberty. We will become a member of
- * some group for sure. */
-static group_t profiling_noinline
-board_play_outside(struct board *board, struct move *m, int f, struct board_undo *u)
-{
-	coord_t coord = m->coord;
-	enum stone color = m->color;
-	enum stone other_color = stone_other(color);
-	group_t group = 0;
-
-	if (u)  
-		undo_save_group_info(board, coord, color, u);
-	else {
-		board->f[f] = board->f[--board->flen];
-		if (DEBUGL(6))
-			fprintf(stderr, "popping free move [%d->%d]: %d\n", board->flen, f, board->f[f]);
-
-#if defined(BOARD_TRAITS) && defined(DEBUG)
-		/* Sanity check that cap matches reality. */
-		{
-			int a = 0, b = 0;
-			foreach_neighbor(board, coord, {
-					group_t g = group_at(board, c);
-					a += g && (board_at(board, c) == other_color && board_group_info(board, g).libs == 1);
-					b += g && (board_at(board, c) == other_color && board_group_info(board, g).libs == 1) && group_is_onestone(board, g);
-				});
-			assert(a == trait_at(board, coord, color).cap);
-			assert(b == trait_at(board, coord, color).cap1);
-#ifdef BOARD_TRAIT_SAFE
-			assert(board_trait_safe(board, coord, color) == trait_at(board, coord, color).safe);
-#endif
-		}
-#endif
-	}
-	foreach_neighbor(board, coord, {
-			group = play_one_neighbor(board, coord, color, other_color, c, group, u);
-	});
-
-	board_at(board, coord) = color;
-	if (unlikely(!group))
-		group = new_group(board, coord, u);
-
-	if (!u) {
-		board->last_move4 = board->last_move3;
-		board->last_move3 = board->last_move2;
-	}
-	board->last_move2 = board->last_move;
-	board->last_move = *m;
-	board->moves++;
-	if (!u) {
-		board_hash_update(board, coord, color);
-		board_symmetry_update(board, &board->symmetry, coord);
-	}
-	struct move ko = { pass, S_NONE };
-	board->ko = ko;
-
-	if (!u) check_pat3_consistency(board, coord);
-
-	return group;
-}
-
-/* We played in an eye-like shape. Either we capture at least one of the eye
- * sides in the process of playing, or return -1. */
-static int profiling_noinline
-board_play_in_eye(struct board *board, struct move *m, int f, struct board_undo *u)
-{
-	coord_t coord = m->coord;
-	enum stone color = m->color;
-	/* Check ko: Capture at a position of ko capture one move ago */
-	if (unlikely(color == board->ko.color && coord == board->ko.coord)) {
-		if (DEBUGL(5))
-			fprintf(stderr, "board_check: ko at %d,%d color %d\n", coord_x(coord, board), coord_y(coord, board), color);
-		return -1;
-	} else if (DEBUGL(6)) {
-		fprintf(stderr, "board_check: no ko at %d,%d,%d - ko is %d,%d,%d\n",
-			color, coord_x(coord, board), coord_y(coord, board),
-			board->ko.color, coord_x(board->ko.coord, board), coord_y(board->ko.coord, board));
-	}
-
-	struct move ko = { pass, S_NONE };
-
-	int captured_groups = 0;
-
-	foreach_neighbor(board, coord, {
-		group_t g = group_at(board, c);
-		if (DEBUGL(7))
-			fprintf(stderr, "board_check: group %d has %d libs\n",
-				g, board_group_info(board, g).libs);
-		captured_groups += (board_group_info(board, g).libs == 1);
-	});
-
-	if (likely(captured_groups == 0)) {
-		if (DEBUGL(5)) {
-			if (DEBUGL(6))
-				board_print(board, stderr);
-			fprintf(stderr, "board_check: one-stone suicide\n");
-		}
-
-		return -1;
-	}
-
-	if (!u) {
-#ifdef BOARD_TRAITS
-		/* We _will_ for sure capture something. */
-		assert(trait_at(board, coord, color).cap > 0);
-#ifdef BOARD_TRAIT_SAFE
-		assert(trait_at(board, coord, color).safe == board_trait_safe(board, coord, color));
-#endif
-#endif
-
-		board->f[f] = board->f[--board->flen];
-		if (DEBUGL(6))
-			fprintf(stderr, "popping free move [%d->%d]: %d\n", board->flen, f, board->f[f]);
 	}
-	else
-		undo_save_group_info(board, coord, color, u);
-
-	int ko_caps = 0;
-	coord_t cap_at = pass;
-	foreach_neighbor(board, coord, {
-		inc_neighbor_count_at(board, c, color);
-		/* Originally, this could not have changed any trait
-		 * since no neighbors were S_NONE, however by now some
-		 * of them might be removed from the board. */
-		if (!u) board_trait_queue(board, c);
-
-		group_t group = group_at(board, c);
-		if (!group)
-			continue;
 
-		board_group_rmlib(board, group, coord, u);
-		if (DEBUGL(7))
-			fprintf(stderr, "board_play_raw: reducing libs for group %d\n",
-				group_base(group));
-
-		if (board_group_captured(board, group)) {
-			ko_caps += board_group_capture(board, group, u);
-			cap_at = c;
-		}
-	});
-	if (ko_caps == 1) {
-		ko.color = stone_other(color);
-		ko.coord = cap_at; // unique
-		board->last_ko = ko;
-		board->last_ko_age = board->moves;
-		if (DEBUGL(5))
-			fprintf(stderr, "guarding ko at %d,%s\n", ko.color, coord2sstr(ko.coord, board));
-	}
-
-	board_at(board, coord) = color;
-	group_t group = new_group(board, coord, u);
-
-	if (!u) {
-		board->last_move4 = board->last_move3;
-		board->last_move3 = board->last_move2;
-	}
-	board->last_move2 = board->last_move;
-	board->last_move = *m;
-	board->moves++;
-	if (!u) {
-		board_hash_update(board, coord, color);
-		board_hash_commit(board);
-		board_traits_recompute(board);
-		board_symmetry_update(board, &board->symmetry, coord);
-	}
-	board->ko = ko;
-
-	if (!u) check_pat3_consistency(board, coord);
-
-	return !!group;
-}
-
-static int __attribute__((flatten))
-board_play_f(struct board *board, struct move *m, int f, struct board_undo *u)
-{
-	if (DEBUGL(7)) {
-		fprintf(stderr, "board_play(%s): ---- Playing %d,%d\n", coord2sstr(m->coord, board), coord_x(m->coord, board), coord_y(m->coord, board));
-	}
-	if (likely(!board_is_eyelike(board, m->coord, stone_other(m->color)))) {
-		/* NOT playing in an eye. Thus this move has to succeed. (This
-		 * is thanks to New Zealand rules. Otherwise, multi-stone
-		 * suicide might fail.) */
-		group_t group = board_play_outside(board, m, f, u);
-		if (unlikely(board_group_captured(board, group))) {
-			if (u) undo_save_suicide(board, m->coord, m->color, u);
-			board_group_capture(board, group, u);
-		}
-		if (!u) {
-			board_hash_commit(board);
-			board_traits_recompute(board);
-		}
-		return 0;
-	} else {
-		return board_play_in_eye(board, m, f, u);
-	}
-}
-
-static void
-undo_init(struct board *b, struct move *m, struct board_undo *u)
-{
-	// Paranoid uninitialized mem test
-	// memset(u, 0xff, sizeof(*u));
-	
-	u->last_move2 = b->last_move2;
-	u->ko = b->ko;
-	u->last_ko = b->last_ko;
-	u->last_ko_age = b->last_ko_age;
-	u->captures = 0;
-	
-	u->nmerged = u->nmerged_tmp = u->nenemies = 0;
-	for (int i = 0; i < 4; i++)
-		u->merged[i].group = u->enemies[i].group = 0;
-}
-
-static int
-board_play_(struct board *board, struct move *m, struct board_undo *u)
-{
-#ifdef BOARD_UNDO_CHECKS
-	assert(u || !board->quicked);
-#endif
-
-	if (u) undo_init(board, m, u);
-	
-	if (unlikely(is_pass(m->coord) || is_resign(m->coord))) {
-		if (is_pass(m->coord) && board->rules == RULES_SIMING) {
-			/* On pass, the player gives a pass stone
-			 * to the opponent. */
-			board->captures[stone_other(m->color)]++;
-		}
-		struct move nomove = { pass, S_NONE };
-		board->ko = nomove;
-		if (!u) { 
-			board->last_move4 = board->last_move3;
-			board->last_move3 = board->last_move2;
-		}
-		board->last_move2 = board->last_move;
-		board->last_move = *m;
-		return 0;
-	}
-
-	if (u)
-		return board_play_f(board, m, -1, u);
-	
-	int f;
-	for (f = 0; f < board->flen; f++)
-		if (board->f[f] == m->coord)
-			return board_play_f(board, m, f, u);
-
-	if (DEBUGL(7))
-		fprintf(stderr, "board_check: stone exists\n");
-	return -1;
-}
-
-int
-board_play(struct board *board, struct move *m)
-{
-	return board_play_(board, m, NULL);
-}
-
-int
-board_quick_play(struct board *board, struct move *m, struct board_undo *u)
-{
-	int r = board_play_(board, m, u);
-#ifdef BOARD_UNDO_CHECKS
-	if (r >= 0)
-		board->quicked++;
-#endif
-	return r;
-}
-
-static inline void
-undo_merge(struct board *b, struct board_undo *u, struct move *m)
-{
-	coord_t coord = m->coord;
-	group_t group = group_at(b, coord);
-	struct undo_merge *merged = u->merged;
-	
-	// Others groups, in reverse order ...
-	for (int i = u->nmerged - 1; i > 0; i--) {
-		group_t old_group = merged[i].group;
-			
-		board_group_info(b, old_group) = merged[i].info;
-			
-		groupnext_at(b, group_base(group)) = groupnext_at(b, merged[i].last);
-		groupnext_at(b, merged[i].last) = 0;
-
-#if 0
-		printf("merged_group[%i]:   (last: %s)", i, coord2sstr(merged[i].last, b));
-		foreach_in_group(b, old_group) {
-			printf("%s ", coord2sstr(c, b));
-		} foreach_in_group_end;
-		printf("\n");
-#endif
-			
-		foreach_in_group(b, old_group) {
-			group_at(b, c) = old_group;
-		} foreach_in_group_end;
-	}
-
-	// Restore first group
-	groupnext_at(b, u->inserted) = groupnext_at(b, coord);
-	board_group_info(b, merged[0].group) = merged[0].info;
-
-#if 0
-	printf("merged_group[0]: ");
-	foreach_in_group(b, merged[0].group) {
-		printf("%s ", coord2sstr(c, b));
-	} foreach_in_group_end;
-	printf("\n");
-#endif
-}
-
-
-static inline void
-restore_enemies(struct board *b, struct board_undo *u, struct move *m)
-{
-	enum stone color = m->color;
-	enum stone other_color = stone_other(m->color);
-	
-	struct undo_enemy *enemy = u->enemies;
-	for (int i = 0; i < u->nenemies; i++) {
-		group_t old_group = enemy[i].group;
-			
-		board_group_info(b, old_group) = enemy[i].info;
-			
-		coord_t *stones = enemy[i].stones;
-		for (int j = 0; stones[j]; j++) {
-			board_at(b, stones[j]) = other_color;
-			group_at(b, stones[j]) = old_group;
-			groupnext_at(b, stones[j]) = stones[j + 1];
-
-			foreach_neighbor(b, stones[j], {
-				inc_neighbor_count_at(b, c, other_color);
-			});
-
-			// Update liberties of neighboring groups
-			foreach_neighbor(b, stones[j], {
-					if (board_at(b, c) != color)
-						continue;
-					group_t g = group_at(b, c);
-					if (g == u->merged[0].group || g == u->merged[1].group || g == u->merged[2].group || g == u->merged[3].group)
-						continue;
-					board_group_rmlib(b, g, stones[j], u);
-				});
-		}
-	}
-}
-
-static void
-board_undo_stone(struct board *b, struct board_undo *u, struct move *m)
-{	
-	coord_t coord = m->coord;
-	enum stone color = m->color;
-	/* - update groups
-	 * - put captures back
-	 */
-	
-	//printf("nmerged: %i\n", u->nmerged);
-	
-	// Restore merged groups
-	if (u->nmerged)
-		undo_merge(b, u, m);
-	else			// Single stone group undo
-		memset(&board_group_info(b, group_at(b, coord)), 0, sizeof(struct group));
-	
-	board_at(b, coord) = S_NONE;
-	group_at(b, coord) = 0;
-	groupnext_at(b, coord) = u->next_at;
-	
-	foreach_neighbor(b, coord, {
-			dec_neighbor_count_at(b, c, color);
-	});
-
-	// Restore enemy groups
-	if (u->nenemies) {
-		b->captures[color] -= u->captures;
-		restore_enemies(b, u, m);
-	}
-}
-
-static inline void
-restore_suicide(struct board *b, struct board_undo *u, struct move *m)
-{
-	enum stone color = m->color;
-	enum stone other_color = stone_other(m->color);
-	
-	struct undo_enemy *enemy = u->enemies;
-	for (int i = 0; i < u->nenemies; i++) {
-		group_t old_group = enemy[i].group;
-			
-		board_group_info(b, old_group) = enemy[i].info;
-			
-		coord_t *stones = enemy[i].stones;
-		for (int j = 0; stones[j]; j++) {
-			board_at(b, stones[j]) = other_color;
-			group_at(b, stones[j]) = old_group;
-			groupnext_at(b, stones[j]) = stones[j + 1];
-
-			foreach_neighbor(b, stones[j], {
-				inc_neighbor_count_at(b, c, other_color);
-			});
-
-			// Update liberties of neighboring groups
-			foreach_neighbor(b, stones[j], {
-					if (board_at(b, c) != color)
-						continue;
-					group_t g = group_at(b, c);
-					if (g == u->enemies[0].group || g == u->enemies[1].group || 
-					    g == u->enemies[2].group || g == u->enemies[3].group)
-						continue;
-					board_group_rmlib(b, g, stones[j], u);
-				});
-		}
-	}
-}
-
-
-static void
-board_undo_suicide(struct board *b, struct board_undo *u, struct move *m)
-{	
-	coord_t coord = m->coord;
-	enum stone other_color = stone_other(m->color);
-	
-	// Pretend it's capture ...
-	struct move m2 = { .coord = m->coord, .color = other_color };
-	b->captures[other_color] -= u->captures;
-	
-	restore_suicide(b, u, &m2);
-
-	undo_merge(b, u, m);
-
-	board_at(b, coord) = S_NONE;
-	group_at(b, coord) = 0;
-	groupnext_at(b, coord) = u->next_at;
-
-	foreach_neighbor(b, coord, {
-		dec_neighbor_count_at(b, c, m->color);
-	});
-
-}
-
-
-void
-board_quick_undo(struct board *b, struct move *m, struct board_undo *u)
-{
-#ifdef BOARD_UNDO_CHECKS
-	b->quicked--;
-#endif
-	
-	b->last_move = b->last_move2;
-	b->last_move2 = u->last_move2;
-	b->ko = u->ko;
-	b->last_ko = u->last_ko;
-	b->last_ko_age = u->last_ko_age;
-	
-	if (unlikely(is_pass(m->coord) || is_resign(m->coord))) 
-		return;
-
-	b->moves--;
-
-	if (likely(board_at(b, m->coord) == m->color))
-		board_undo_stone(b, u, m);
-	else if (board_at(b, m->coord) == S_NONE)
-		board_undo_suicide(b, u, m);
-	else
-		assert(0);	/* Anything else doesn't make sense */
-}
-
-
-/* Undo, supported only for pass moves. This form of undo is required by KGS
- * to settle disputes on dead groups. See also fast_board_undo() */
-int board_undo(struct board *board)
-{
-	if (!is_pass(board->last_move.coord))
-		return -1;
-	if (board->rules == RULES_SIMING) {
-		/* Return pass stone to the passing player. */
-		board->captures[stone_other(board->last_move.color)]--;
-	}
-	board->last_move = board->last_move2;
-	board->last_move2 = board->last_move3;
-	board->last_move3 = board->last_move4;
-	if (board->last_ko_age == board->moves)
-		board->ko = board->last_ko;
-	return 0;
-}
-
-bool
-board_permit(struct board *b, struct move *m, void *data)
-{
-	if (unlikely(board_is_one_point_eye(b, m->coord, m->color)) /* bad idea to play into one, usually */
-	    || !board_is_valid_move(b, m))
-		return false;
-	return true;
-}
-
-static inline bool
-board_try_random_move(struct board *b, enum stone color, coord_t *coord, int f, ppr_permit permit, void *permit_data)
-{
-	*coord = b->f[f];
-	struct move m = { *coord, color };
-	if (DEBUGL(6))
-		fprintf(stderr, "trying random move %d: %d,%d %s %d\n", f, coord_x(*coord, b), coord_y(*coord, b), coord2sstr(*coord, b), board_is_valid_move(b, &m));
-	permit = (permit ? permit : board_permit);
-	if (!permit(b, &m, permit_data))
-		return false;
-	if (m.coord == *coord) {
-		return likely(board_play_f(b, &m, f, NULL) >= 0);
-	} else {
-		*coord = m.coord; // permit modified the coordinate
-		return likely(board_play(b, &m) >= 0);
-	}
-}
-
-void
-board_play_random(struct board *b, enum stone color, coord_t *coord, ppr_permit permit, void *permit_data)
-{
-	if (unlikely(b->flen == 0))
-		goto pass;
-
-	int base = fast_random(b->flen), f;
-	for (f = base; f < b->flen; f++)
-		if (board_try_random_move(b, color, coord, f, permit, permit_data))
-			return;
-	for (f = 0; f < base; f++)
-		if (board_try_random_move(b, color, coord, f, permit, permit_data))
-			return;
-
-pass:
-	*coord = pass;
-	struct move m = { pass, color };
-	board_play(b, &m);
-}
-
-
-bool
-board_is_false_eyelike(struct board *board, coord_t coord, enum stone eye_color)
-{
-	enum stone color_diag_libs[S_MAX] = {0, 0, 0, 0};
-
-	/* XXX: We attempt false eye detection but we will yield false
-	 * positives in case of http://senseis.xmp.net/?TwoHeadedDragon :-( */
-
-	foreach_diag_neighbor(board, coord) {
-		color_diag_libs[(enum stone) board_at(board, c)]++;
-	} foreach_diag_neighbor_end;
-	/* For false eye, we need two enemy stones diagonally in the
-	 * middle of the board, or just one enemy stone at the edge
-	 * or in the corner. */
-	color_diag_libs[stone_other(eye_color)] += !!color_diag_libs[S_OFFBOARD];
-	return color_diag_libs[stone_other(eye_color)] >= 2;
-}
-
-bool
-board_is_one_point_eye(struct board *board, coord_t coord, enum stone eye_color)
-{
-	return board_is_eyelike(board, coord, eye_color)
-		&& !board_is_false_eyelike(board, coord, eye_color);
-}
-
-enum stone
-board_get_one_point_eye(struct board *board, coord_t coord)
-{
-	if (board_is_one_point_eye(board, coord, S_WHITE))
-		return S_WHITE;
-	else if (board_is_one_point_eye(board, coord, S_BLACK))
-		return S_BLACK;
-	else
-		return S_NONE;
-}
-
-
-floating_t
-board_fast_score(struct board *board)
-{
-	int scores[S_MAX];
-	memset(scores, 0, sizeof(scores));
-
-	foreach_point(board) {
-		enum stone color = board_at(board, c);
-		if (color == S_NONE && board->rules != RULES_STONES_ONLY)
-			color = board_get_one_point_eye(board, c);
-		scores[color]++;
-		// fprintf(stderr, "%d, %d ++%d = %d\n", coord_x(c, board), coord_y(c, board), color, scores[color]);
-	} foreach_point_end;
-
-	return board->komi + (board->rules != RULES_SIMING ? board->handicap : 0) + scores[S_WHITE] - scores[S_BLACK];
-}
-
-/* Owner map: 0: undecided; 1: black; 2: white; 3: dame */
-
-/* One flood-fill iteration; returns true if next iteration
- * is required. */
-static bool
-board_tromp_taylor_iter(struct board *board, int *ownermap)
-{
-	bool needs_update = false;
-	foreach_free_point(board) {
-		/* Ignore occupied and already-dame positions. */
-		assert(board_at(board, c) == S_NONE);
-		if (board->rules == RULES_STONES_ONLY)
-		    ownermap[c] = 3;
-		if (ownermap[c] == 3)
-			continue;
-		/* Count neighbors. */
-		int nei[4] = {0};
-		foreach_neighbor(board, c, {
-			nei[ownermap[c]]++;
-		});
-		/* If we have neighbors of both colors, or dame,
-		 * we are dame too. */
-		if ((nei[1] && nei[2]) || nei[3]) {
-			ownermap[c] = 3;
-			/* Speed up the propagation. */
-			foreach_neighbor(board, c, {
-				if (board_at(board, c) == S_NONE)
-					ownermap[c] = 3;
-			});
-			needs_update = true;
-			continue;
-		}
-		/* If we have neighbors of one color, we are owned
-		 * by that color, too. */
-		if (!ownermap[c] && (nei[1] || nei[2])) {
-			int newowner = nei[1] ? 1 : 2;
-			ownermap[c] = newowner;
-			/* Speed up the propagation. */
-			foreach_neighbor(board, c, {
-				if (board_at(board, c) == S_NONE && !ownermap[c])
-					ownermap[c] = newowner;
-			});
-			needs_update = true;
-			continue;
-		}
-	} foreach_free_point_end;
-	return needs_update;
+	int owner = (reach == 1 || reach == 2) && board->rules != RULES_STONES_ONLY ? reach : 3;
+	for (int i = 0; i < qlen; i++)
+		ownermap[queue[i]] = owner;
 }
 
 /* Tromp-Taylor Counting */
@@ -2058,8 +1113,11 @@ board_official_score(struct board *board, struct move_queue *q)
 	if (!s[S_BLACK] && !s[S_WHITE])
 		return board->komi;
 
-	while (board_tromp_taylor_iter(board, ownermap))
-		/* Flood-fill... */;
+	coord_t queue[board_size2(board)];
+	foreach_free_point(board) {
+		if (!ownermap[c])
+			board_tromp_taylor_region(board, ownermap, queue, c);
+	} foreach_free_point_end;
 
 	int scores[S_MAX];
 	memset(scores, 0, sizeof(scores));
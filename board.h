@@ -26,16 +26,29 @@ struct fbook;
 #define WANT_BOARD_C // capturable groups queue
 
 //#define BOARD_SIZE 9 // constant board size, allows better optimization
+#if defined(BOARD_SIZE) && !defined(BOARD_KERNEL_SIZE)
+/* Size all the fixed arrays for just the one size. */
+#undef BOARD_MAX_SIZE
+#define BOARD_MAX_SIZE BOARD_SIZE
+#endif
 
 //#define BOARD_SPATHASH // incremental patternsp.h hashes
+#ifndef BOARD_SPATHASH_MAXD
 #define BOARD_SPATHASH_MAXD 3 // maximal diameter
+#endif
 
 #define BOARD_PAT3 // incremental 3x3 pattern codes
 
+//#define BOARD_DCNN_PLANES // incremental dcnn liberty and move age planes
+
 //#define BOARD_TRAITS 1 // incremental point traits (see struct btraits)
 //#define BOARD_TRAIT_SAFE 1 // include btraits.safe (rather expensive, unused)
 //#define BOARD_TRAIT_SAFE 2 // include btraits.safe based on full is_bad_selfatari()
 
+//#define BOARD_LIBMAP // per-group liberty bitmaps (exact libs, no refill scans)
+
+//#define BOARD_EMPTY3 // set of points with an empty 3x3 neighborhood (moggy fillboard)
+
 //#define BOARD_UNDO_CHECKS 1  // Guard against invalid quick_play() / quick_undo() uses
 
 #define BOARD_MAX_COORDS  ((BOARD_MAX_SIZE+2) * (BOARD_MAX_SIZE+2) )
@@ -93,6 +106,11 @@ struct group {
 	 * It denotes only number of items in lib[], thus you can rely
 	 * on it to store real liberties only up to <= GROUP_REFILL_LIBS. */
 	int libs;
+#ifdef BOARD_LIBMAP
+	/* Bitmap of all liberties of the group, indexed by coord. */
+#define BOARD_LIBMAP_WORDS ((BOARD_MAX_COORDS + 63) / 64)
+	uint64_t libmap[BOARD_LIBMAP_WORDS];
+#endif
 };
 
 struct neighbor_colors {
@@ -172,10 +190,10 @@ struct board {
 	} rules;
 
 	char *fbookfile;
+	/* Loaded at the first fbook_check() of the game, when the size
+	 * and handicap are known. */
 	struct fbook *fbook;
-
-	/* Iterator offsets for foreach_neighbor*() */
-	int nei8[8], dnei[4];
+	bool fbook_checked;
 
 	int moves;
 	struct move last_move;
@@ -203,12 +221,14 @@ FB_ONLY(bool superko_violation);
 	/* Zobrist hash for each position */
 	hash_t *h;
 #ifdef BOARD_SPATHASH
-	/* For spatial hashes, we use only 24 bits. */
+	/* For spatial hashes, we keep only the low 32 bits, more than
+	 * spatial_hash_mask needs. Each entry hashes just the points at
+	 * that distance, xor up to d for the whole pattern. */
 	/* [0] is d==1, we don't keep hash for d==0. */
 	/* We keep hashes for black-to-play ([][0]) and white-to-play
 	 * ([][1], reversed stone colors since we match all patterns as
 	 * black-to-play). */
-FB_ONLY(uint32_t (*spathash))[BOARD_SPATHASH_MAXD][2];
+	uint32_t (*spathash)[BOARD_SPATHASH_MAXD][2];
 #endif
 #ifdef BOARD_PAT3
 	/* 3x3 pattern code for each position; see pattern3.h for encoding
@@ -220,9 +240,22 @@ FB_ONLY(hash3_t *pat3);
 	 * ([][0]) and white-to-play ([][1]). */
 	/* The information is only valid for empty points. */
 FB_ONLY(struct btraits (*t)[2]);
+#endif
+#ifdef BOARD_DCNN_PLANES
+	/* Liberties of the group at each stone capped at 4, 0 for empty
+	 * points; kept valid by board_quick_play()/board_quick_undo(). */
+	uint8_t *dcnn_libs;
+	/* Value of dcnn_ply when a stone was last played at each point;
+	 * 0 == never. */
+	uint16_t *dcnn_age;
+	/* Moves played including passes, unlike moves, so that the
+	 * history planes see passes as the last_move fields do. */
+	int dcnn_ply;
 #endif
 	/* Cached information on x-y coordinates so that we avoid division. */
 	uint8_t (*coord)[2];
+	/* board_play() and friends built for this board size. */
+	const struct board_kernels *kernels;
 
 	/* Group information - indexed by gid (which is coord of base group stone) */
 	struct group *gi;
@@ -237,6 +270,13 @@ FB_ONLY(coord_t *f);  FB_ONLY(int flen);
 FB_ONLY(group_t *c);  FB_ONLY(int clen);
 #endif
 
+#ifdef BOARD_EMPTY3
+	/* Set of free points whose 8 neighbors are free too, and the
+	 * index + 1 of each point in it (0 if not in the set). */
+FB_ONLY(coord_t *e3);  FB_ONLY(int e3len);
+FB_ONLY(uint16_t *e3i);
+#endif
+
 #ifdef BOARD_TRAITS
 	/* Queue of positions that need their traits updated */
 FB_ONLY(coord_t *tq);  FB_ONLY(int tqlen);
@@ -252,10 +292,14 @@ FB_ONLY(int last_ko_age);
 	/* Basic ko check */
 	struct move ko;
 
-#ifdef BOARD_UNDO_CHECKS
-	/* Guard against invalid quick_play() / quick_undo() uses */
+	/* Number of board_quick_play() moves not undone yet; FB_ONLY
+	 * information (e.g. the hash) is stale while nonzero. Also guards
+	 * against invalid quick_play() / quick_undo() uses. */
 	int quicked;
-#endif
+	/* Number of board_quick_probe() moves not undone yet. Moves
+	 * played and undone meanwhile skip the dcnn planes, which are
+	 * stale during tactical probing. */
+	int probing;
 	
 	/* Engine-specific state; persistent through board development,
 	 * is reset only at clear_board. */
@@ -271,12 +315,18 @@ FB_ONLY(int last_ko_age);
 	/* For superko check: */
 
 	/* Board "history" - hashes encountered. Size of the hash should be
-	 * >> board_size^2. */
+	 * >> board_size^2. Boards made by board_copy_to() (the playout
+	 * copies) share it read-only, and note the positions they go
+	 * through in history_recent instead, as far as it goes. */
 #define history_hash_bits 12
 #define history_hash_mask ((1 << history_hash_bits) - 1)
 #define history_hash_prev(i) ((i - 1) & history_hash_mask)
 #define history_hash_next(i) ((i + 1) & history_hash_mask)
-FB_ONLY(hash_t history_hash)[1 << history_hash_bits];
+FB_ONLY(hash_t *history_hash);
+FB_ONLY(bool history_shared);
+#define BOARD_HISTORY_RECENT 64
+FB_ONLY(hash_t history_recent)[BOARD_HISTORY_RECENT];
+FB_ONLY(int history_recent_len);
 	/* Hash of current board position. */
 FB_ONLY(hash_t hash);
 	/* Hash of current board position quadrants. */
@@ -311,6 +361,10 @@ struct board_undo {
 	struct undo_enemy enemies[4];
 	int nenemies;
 	int captures; /* number of stones captured */
+	bool probe; /* played by board_quick_probe() */
+#ifdef BOARD_DCNN_PLANES
+	uint16_t dcnn_age;
+#endif
 };
 
 
@@ -369,12 +423,36 @@ struct board_undo {
 /* board_group_other_lib() makes sense only for groups with two liberties. */
 #define board_group_other_lib(b_, g_, l_) (board_group_info(b_, g_).lib[board_group_info(b_, g_).lib[0] != (l_) ? 0 : 1])
 
+#ifdef BOARD_LIBMAP
+#define board_group_libmap_has(b_, g_, c_) \
+	(board_group_info(b_, g_).libmap[(c_) >> 6] & (1ULL << ((c_) & 63)))
+/* Exact number of liberties of the group. */
+static int board_group_exact_libs(struct board *b, group_t group);
+/* Number of liberties the two groups have in common. */
+static int board_group_shared_libs(struct board *b, group_t g1, group_t g2);
+#endif
+
+/* Hash of the current position, or 0 while board_quick_play() moves
+ * are pending and the hash is stale. Usable from QUICK_BOARD_CODE. */
+#define board_position_hash(b_) ((b_)->quicked ? 0 : (b_)->FB_ONLY(hash))
+
 #define hash_at(b_, coord, color) ((b_)->h[((color) == S_BLACK ? board_size2(b_) : 0) + coord])
 
 struct board *board_init(char *fbookfile);
 struct board *board_copy(struct board *board2, struct board *board1);
+/* Like board_copy(), but place @board2 arrays in caller-owned @storage
+ * of board_storage_size(board1) bytes instead of allocating them.
+ * Do not board_done_noalloc() such a board, only free its ->ps.
+ * This is the per-simulation copy, so only the parts of the arrays in
+ * use are copied (the board code never looks at the rest), and board
+ * as a whole is not comparable with board_cmp(). */
+struct board *board_copy_to(struct board *board2, struct board *board1, void *storage);
+size_t board_storage_size(struct board *board);
 void board_done_noalloc(struct board *board);
 void board_done(struct board *board);
+/* Stop keeping the superko history of @board, superko_violation
+ * won't be noted anymore. For boards played out and dropped. */
+void board_history_off(struct board *board);
 /* size here is without the S_OFFBOARD margin. */
 void board_resize(struct board *board, int size);
 void board_clear(struct board *board);
@@ -394,7 +472,7 @@ int board_quick_cmp(struct board *b1, struct board *b2);
 void board_handicap(struct board *board, int stones, FILE *f);
 
 /* Returns group id, 0 on allowed suicide, pass or resign, -1 on error */
-int board_play(struct board *board, struct move *m);
+static int board_play(struct board *board, struct move *m);
 /* Like above, but plays random move; the move coordinate is recorded
  * to *coord. This method will never fill your own eye. pass is played
  * when no move can be played. You can impose extra restrictions if you
@@ -402,7 +480,20 @@ int board_play(struct board *board, struct move *m);
  * the move coordinate to redirect the move elsewhere. */
 typedef bool (*ppr_permit)(struct board *b, struct move *m, void *data);
 bool board_permit(struct board *b, struct move *m, void *data);
-void board_play_random(struct board *b, enum stone color, coord_t *coord, ppr_permit permit, void *permit_data);
+static void board_play_random(struct board *b, enum stone color, coord_t *coord, ppr_permit permit, void *permit_data);
+
+/* The board_play() family is built once for any board size and once
+ * for each of 9x9, 13x13 and 19x19 with the board geometry constant
+ * (see board_play.c); board_resize() points the board to the fastest
+ * build for its size, and the calls above dispatch through it. */
+struct board_kernels {
+	int size; /* 0 for any size */
+	int (*play)(struct board *board, struct move *m);
+	int (*quick_play)(struct board *board, struct move *m, struct board_undo *u);
+	int (*quick_probe)(struct board *board, struct move *m, struct board_undo *u);
+	void (*quick_undo)(struct board *b, struct move *m, struct board_undo *u);
+	void (*play_random)(struct board *b, enum stone color, coord_t *coord, ppr_permit permit, void *permit_data);
+};
 
 /* Undo, supported only for pass moves. Returns -1 on error, 0 otherwise. */
 int board_undo(struct board *board);
@@ -426,6 +517,14 @@ void board_symmetry_update(struct board *b, struct board_symmetry *symmetry, coo
 /* Check if coordinates are within symmetry base. (If false, they can
  * be derived from the base.) */
 static bool board_coord_in_symmetry(struct board *b, coord_t c);
+/* Coordinate @c under symmetry @sym (0..7: bit 2 swaps x and y, then
+ * bits 0 and 1 flip x and y), and back. */
+coord_t board_coord_transform(struct board *b, coord_t c, int sym);
+coord_t board_coord_untransform(struct board *b, coord_t c, int sym);
+/* Hash of the stones in canonical orientation, i.e. the least hash
+ * of the 8 symmetries of the position, which is @sym if not NULL.
+ * Scans the whole board. */
+hash_t board_canonical_hash(struct board *b, int *sym);
 #endif
 
 /* Returns true if given coordinate has all neighbors of given color or the edge. */
@@ -459,12 +558,15 @@ bool board_set_rules(struct board *board, char *name);
  *
  * Currently this means these can't be used:
  *   - incremental patterns (pat3)
- *   - hashes, superko_violation (spathash, hash, qhash, history_hash)
+ *   - hashes, superko_violation (hash, qhash, history_hash)
+ *     (spathash is kept up to date, both ways)
  *   - list of free positions (f / flen)
  *   - list of capturable groups (c / clen)
+ *   - set of empty 3x3 points (e3 / e3len / e3i)
  *   - traits (btraits, t, tq, tqlen)
  *   - last_move3, last_move4, last_ko_age
  *   - symmetry information
+ *   - within board_quick_probe() only: dcnn planes (dcnn_libs, dcnn_age, dcnn_ply)
  *
  * #define QUICK_BOARD_CODE at the top of your file to get compile-time
  * error if you try to access a forbidden field.
@@ -472,8 +574,16 @@ bool board_set_rules(struct board *board, char *name);
  * Invalid quick_play()/quick_undo() combinations (missing undo for example)
  * are caught at next board_play() if BOARD_UNDO_CHECKS is defined.
  */
-int  board_quick_play(struct board *board, struct move *m, struct board_undo *u);
-void board_quick_undo(struct board *b, struct move *m, struct board_undo *u);
+static int  board_quick_play(struct board *board, struct move *m, struct board_undo *u);
+static void board_quick_undo(struct board *b, struct move *m, struct board_undo *u);
+
+/* Probing several moves in turn in the same position: the part of
+ * the undo record that does not depend on the move is saved once by
+ * board_quick_probe_init(), then board_quick_probe() works like
+ * board_quick_play() as long as each probe is undone before the next
+ * one. See foreach_probe_move(). */
+void board_quick_probe_init(struct board *board, struct board_undo *u);
+static int  board_quick_probe(struct board *board, struct move *m, struct board_undo *u);
 
 /* quick_play() + quick_undo() combo.
  * Body is executed only if move is valid (silently ignored otherwise).
@@ -497,6 +607,25 @@ void board_quick_undo(struct board *b, struct move *m, struct board_undo *u);
 #define with_move_return(val_)  \
 	do {  typeof(val_) val__ = (val_); board_quick_undo(board__, &m_, &u_); return val__;  } while (0)
 
+/* with_move() for each of the @n_ moves at @coords_ in turn, sharing
+ * one undo record; the move played is at c within body. Same rules
+ * as with_move() otherwise: break skips to the next move and
+ * with_move_return(val) works if not nested in another with_move(). */
+#define foreach_probe_move(board_, coords_, n_, color_, body_) \
+	do { \
+		struct board *board__ = (board_); \
+		struct board_undo u_; \
+		board_quick_probe_init(board__, &u_); \
+		for (int i_ = 0; i_ < (n_); i_++) { \
+			coord_t c = (coords_)[i_]; \
+			struct move m_ = { .coord = c, .color = (color_) }; \
+			if (board_quick_probe(board__, &m_, &u_) >= 0) { \
+				do { body_ } while (0); \
+				board_quick_undo(board__, &m_, &u_); \
+			} \
+		} \
+	} while (0)
+
 /* Same as with_move() but assert out in case of invalid move. */
 #define with_move_strict(board_, coord_, color_, body_) \
        do { \
@@ -555,12 +684,21 @@ void board_quick_undo(struct board *b, struct move *m, struct board_undo *u);
 		c = coord__ + board_size(board__); do { loop_body } while (0); \
 	} while (0)
 
+/* Steps from one neighbor to the next for foreach_8neighbor() and
+ * foreach_diag_neighbor(), in rows and columns. The offsets are derived
+ * from board_size() rather than kept in the board, so that they fold
+ * into constants when BOARD_SIZE is fixed at compile time. */
+static const signed char nei8_drow[8] = { -1, 0, 0, 1, 0, 1, 0, 0 };
+static const signed char nei8_dcol[8] = { -1, 1, 1, -2, 2, -2, 1, 1 };
+static const signed char dnei_drow[4] = { -1, 0, 2, 0 };
+static const signed char dnei_dcol[4] = { -1, 2, -2, 2 };
+
 #define foreach_8neighbor(board_, coord_) \
 	do { \
 		int fn__i; \
 		coord_t c = (coord_); \
 		for (fn__i = 0; fn__i < 8; fn__i++) { \
-			c += (board_)->nei8[fn__i];
+			c += nei8_drow[fn__i] * board_size(board_) + nei8_dcol[fn__i];
 #define foreach_8neighbor_end \
 		} \
 	} while (0)
@@ -570,12 +708,42 @@ void board_quick_undo(struct board *b, struct move *m, struct board_undo *u);
 		int fn__i; \
 		coord_t c = (coord_); \
 		for (fn__i = 0; fn__i < 4; fn__i++) { \
-			c += (board_)->dnei[fn__i];
+			c += dnei_drow[fn__i] * board_size(board_) + dnei_dcol[fn__i];
 #define foreach_diag_neighbor_end \
 		} \
 	} while (0)
 
 
+static inline int
+board_play(struct board *board, struct move *m)
+{
+	return board->kernels->play(board, m);
+}
+
+static inline void
+board_play_random(struct board *b, enum stone color, coord_t *coord, ppr_permit permit, void *permit_data)
+{
+	b->kernels->play_random(b, color, coord, permit, permit_data);
+}
+
+static inline int
+board_quick_play(struct board *board, struct move *m, struct board_undo *u)
+{
+	return board->kernels->quick_play(board, m, u);
+}
+
+static inline void
+board_quick_undo(struct board *b, struct move *m, struct board_undo *u)
+{
+	b->kernels->quick_undo(b, m, u);
+}
+
+static inline int
+board_quick_probe(struct board *board, struct move *m, struct board_undo *u)
+{
+	return board->kernels->quick_probe(board, m, u);
+}
+
 static inline bool
 board_is_eyelike(struct board *board, coord_t coord, enum stone eye_color)
 {
@@ -747,4 +915,25 @@ board_coord_in_symmetry(struct board *b, coord_t c)
 #endif
 
 
+#ifdef BOARD_LIBMAP
+static inline int
+board_group_exact_libs(struct board *b, group_t group)
+{
+	int libs = 0;
+	for (int i = 0; i < BOARD_LIBMAP_WORDS; i++)
+		libs += __builtin_popcountll(board_group_info(b, group).libmap[i]);
+	return libs;
+}
+
+static inline int
+board_group_shared_libs(struct board *b, group_t g1, group_t g2)
+{
+	int libs = 0;
+	for (int i = 0; i < BOARD_LIBMAP_WORDS; i++)
+		libs += __builtin_popcountll(board_group_info(b, g1).libmap[i]
+					     & board_group_info(b, g2).libmap[i]);
+	return libs;
+}
+#endif
+
 #endif
@@ -0,0 +1,1591 @@
+/* Playing and undoing moves, with all the incremental bookkeeping of
+ * the board: the hot path of the playouts and of tactical reading.
+ *
+ * This file is built once for any board size, and again by
+ * board_play9.c, board_play13.c and board_play19.c with the size fixed
+ * at compile time, so that the neighbor offsets and the loops over the
+ * board fold into constants there. Each build exports only its struct
+ * board_kernels; board_resize() picks the one for the board size. */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef BOARD_KERNEL_SIZE
+/* board.h then treats the size as constant, without shrinking struct
+ * board to it. */
+#define BOARD_SIZE BOARD_KERNEL_SIZE
+#endif
+
+//#define DEBUG
+#include "board.h"
+#include "debug.h"
+#include "perfstats.h"
+#include "random.h"
+
+#ifdef BOARD_SPATHASH
+#include "patternsp.h"
+#endif
+#ifdef BOARD_PAT3
+#include "pattern3.h"
+#endif
+#ifdef BOARD_TRAITS
+static void board_trait_recompute(struct board *board, coord_t coord);
+#include "tactics/selfatari.h"
+#endif
+
+
+#if 0
+#define profiling_noinline __attribute__((noinline))
+#else
+#define profiling_noinline
+#endif
+
+
+#ifdef BOARD_TRAITS
+
+#if BOARD_TRAIT_SAFE == 1
+static bool
+board_trait_safe(struct board *board, coord_t coord, enum stone color)
+{
+	return board_safe_to_play(board, coord, color);
+}
+#elif BOARD_TRAIT_SAFE == 2
+static bool
+board_trait_safe(struct board *board, coord_t coord, enum stone color)
+{
+	return !is_bad_selfatari(board, color, coord);
+}
+#endif
+
+static void
+board_trait_recompute(struct board *board, coord_t coord)
+{
+	int sfb = -1, sfw = -1;
+#ifdef BOARD_TRAIT_SAFE
+	sfb = trait_at(board, coord, S_BLACK).safe = board_trait_safe(board, coord, S_BLACK);
+	sfw = trait_at(board, coord, S_WHITE).safe = board_trait_safe(board, coord, S_WHITE);
+#endif
+	if (DEBUGL(8)) {
+		fprintf(stderr, "traits[%s:%s lib=%d] (black cap=%d cap1=%d safe=%d) (white cap=%d cap1=%d safe=%d)\n",
+			coord2sstr(coord, board), stone2str(board_at(board, coord)), immediate_liberty_count(board, coord),
+			trait_at(board, coord, S_BLACK).cap, trait_at(board, coord, S_BLACK).cap1, sfb,
+			trait_at(board, coord, S_WHITE).cap, trait_at(board, coord, S_WHITE).cap1, sfw);
+	}
+}
+#endif
+
+/* Recompute traits for dirty points that we have previously touched
+ * somehow (libs of their neighbors changed or so). */
+static void
+board_traits_recompute(struct board *board)
+{
+#ifdef BOARD_TRAITS
+	for (int i = 0; i < board->tqlen; i++) {
+		coord_t coord = board->tq[i];
+		trait_at(board, coord, S_BLACK).dirty = false;
+		if (board_at(board, coord) != S_NONE)
+			continue;
+		board_trait_recompute(board, coord);
+	}
+	board->tqlen = 0;
+#endif
+}
+
+/* Queue traits of given point for recomputing. */
+static void
+board_trait_queue(struct board *board, coord_t coord)
+{
+#ifdef BOARD_TRAITS
+	if (trait_at(board, coord, S_BLACK).dirty)
+		return;
+	board->tq[board->tqlen++] = coord;
+	trait_at(board, coord, S_BLACK).dirty = true;
+#endif
+}
+
+
+/* Update spatial hashes after a stone of given color was placed at
+ * or removed from given coordinate. Maintained by quick_play() and
+ * quick_undo() as well. */
+static inline void
+board_spathash_update(struct board *board, coord_t coord, enum stone color)
+{
+#ifdef BOARD_SPATHASH
+	/* Gridcular metric is reflective: the points having @coord at
+	 * offset j in their circle are exactly those at offset -j from
+	 * @coord. Stones never change offboard, so the clamping done
+	 * by ptcoords_at() does not matter here. */
+	int cx = coord_x(coord, board), cy = coord_y(coord, board);
+	for (int d = 1; d <= BOARD_SPATHASH_MAXD; d++) {
+		for (unsigned int j = ptind[d]; j < ptind[d + 1]; j++) {
+			int x = cx - ptcoords[j].x, y = cy - ptcoords[j].y;
+			if (x < 0 || y < 0 || x >= board_size(board) || y >= board_size(board))
+				continue;
+			uint32_t (*h)[2] = &board->spathash[coord_xy(board, x, y)][d - 1];
+			/* We either changed from S_NONE to color
+			 * or vice versa; doesn't matter. */
+			(*h)[0] ^= pthashes[0][j][color] ^ pthashes[0][j][S_NONE];
+			(*h)[1] ^= pthashes[0][j][stone_other(color)] ^ pthashes[0][j][S_NONE];
+		}
+	}
+#endif
+}
+
+/* Update board hash with given coordinate. */
+static void profiling_noinline
+board_hash_update(struct board *board, coord_t coord, enum stone color)
+{
+	board->hash ^= hash_at(board, coord, color);
+	board->qhash[coord_quadrant(coord, board)] ^= hash_at(board, coord, color);
+	if (DEBUGL(8))
+		fprintf(stderr, "board_hash_update(%d,%d,%d) ^ %"PRIhash" -> %"PRIhash"\n", color, coord_x(coord, board), coord_y(coord, board), hash_at(board, coord, color), board->hash);
+
+	board_spathash_update(board, coord, color);
+#ifdef BOARD_EMPTY3
+	board_empty3_update(board, coord);
+#endif
+
+#if defined(BOARD_PAT3)
+	/* @color is not what we need in case of capture. */
+	static const int ataribits[8] = { -1, 0, -1, 1, 2, -1, 3, -1 };
+	enum stone new_color = board_at(board, coord);
+	bool in_atari = false;
+	if (new_color == S_NONE) {
+		board->pat3[coord] = pattern3_hash(board, coord);
+	} else {
+		in_atari = (board_group_info(board, group_at(board, coord)).libs == 1);
+	}
+	foreach_8neighbor(board, coord) {
+		/* Internally, the loop uses fn__i=[0..7]. We can use
+		 * it directly to address bits within the bitmap of the
+		 * neighbors since the bitmap order is reverse to the
+		 * loop order. */
+		if (board_at(board, c) != S_NONE)
+			continue;
+		board->pat3[c] &= ~(3 << (fn__i*2));
+		board->pat3[c] |= new_color << (fn__i*2);
+		if (ataribits[fn__i] >= 0) {
+			board->pat3[c] &= ~(1 << (16 + ataribits[fn__i]));
+			board->pat3[c] |= in_atari << (16 + ataribits[fn__i]);
+		}
+#if defined(BOARD_TRAITS)
+		board_trait_queue(board, c);
+#endif
+	} foreach_8neighbor_end;
+#endif
+}
+
+static void
+board_superko_violation(struct board *board)
+{
+	if (DEBUGL(5))
+		fprintf(stderr, "SUPERKO VIOLATION noted at %d,%d\n",
+			coord_x(board->last_move.coord, board), coord_y(board->last_move.coord, board));
+	board->superko_violation = true;
+}
+
+/* Commit current board hash to the history of a board sharing it. */
+static void
+board_hash_commit_shared(struct board *board)
+{
+	/* Too deep into the playout for superko to matter. */
+	if (board->history_recent_len == BOARD_HISTORY_RECENT)
+		return;
+	for (int i = 0; i < board->history_recent_len; i++) {
+		if (board->history_recent[i] == board->hash) {
+			board_superko_violation(board);
+			return;
+		}
+	}
+	for (hash_t i = board->hash; board->history_hash[i & history_hash_mask]; i = history_hash_next(i)) {
+		if (board->history_hash[i & history_hash_mask] == board->hash) {
+			board_superko_violation(board);
+			return;
+		}
+	}
+	board->history_recent[board->history_recent_len++] = board->hash;
+}
+
+/* Commit current board hash to history. */
+static void profiling_noinline
+board_hash_commit(struct board *board)
+{
+	if (DEBUGL(8))
+		fprintf(stderr, "board_hash_commit %"PRIhash"\n", board->hash);
+	if (unlikely(!board->history_hash))
+		return;
+	if (board->history_shared) {
+		board_hash_commit_shared(board);
+		return;
+	}
+	if (likely(board->history_hash[board->hash & history_hash_mask]) == 0) {
+		board->history_hash[board->hash & history_hash_mask] = board->hash;
+	} else {
+		hash_t i = board->hash;
+		while (board->history_hash[i & history_hash_mask]) {
+			if (board->history_hash[i & history_hash_mask] == board->hash) {
+				board_superko_violation(board);
+				return;
+			}
+			i = history_hash_next(i);
+		}
+		board->history_hash[i & history_hash_mask] = board->hash;
+	}
+}
+
+
+static void __attribute__((noinline))
+check_libs_consistency(struct board *board, group_t g)
+{
+#ifdef DEBUG
+	if (!g) return;
+	struct group *gi = &board_group_info(board, g);
+	for (int i = 0; i < GROUP_KEEP_LIBS; i++)
+		if (gi->lib[i] && board_at(board, gi->lib[i]) != S_NONE) {
+			fprintf(stderr, "BOGUS LIBERTY %s of group %d[%s]\n", coord2sstr(gi->lib[i], board), g, coord2sstr(group_base(g), board));
+			assert(0);
+		}
+#endif
+}
+
+static void
+check_pat3_consistency(struct board *board, coord_t coord)
+{
+#ifdef DEBUG
+	foreach_8neighbor(board, coord) {
+		if (board_at(board, c) == S_NONE && pattern3_hash(board, c) != board->pat3[c]) {
+			board_print(board, stderr);
+			fprintf(stderr, "%s(%d)->%s(%d) computed %x != stored %x (%d)\n", coord2sstr(coord, board), coord, coord2sstr(c, board), c, pattern3_hash(board, c), board->pat3[c], fn__i);
+			assert(0);
+		}
+	} foreach_8neighbor_end;
+#endif
+}
+
+static void
+board_capturable_add(struct board *board, group_t group, coord_t lib, bool onestone)
+{
+	//fprintf(stderr, "group %s cap %s\n", coord2sstr(group, board), coord2sstr(lib, boarD));
+#ifdef BOARD_TRAITS
+	/* Increase capturable count trait of my last lib. */
+	enum stone capturing_color = stone_other(board_at(board, group));
+	assert(capturing_color == S_BLACK || capturing_color == S_WHITE);
+	foreach_neighbor(board, lib, {
+		if (DEBUGL(8) && group_at(board, c) == group)
+			fprintf(stderr, "%s[%d] %s cap bump bc of %s(%d) member %s onestone %d\n", coord2sstr(lib, board), trait_at(board, lib, capturing_color).cap, stone2str(capturing_color), coord2sstr(group, board), board_group_info(board, group).libs, coord2sstr(c, board), onestone);
+		trait_at(board, lib, capturing_color).cap += (group_at(board, c) == group);
+		trait_at(board, lib, capturing_color).cap1 += (group_at(board, c) == group && onestone);
+	});
+	board_trait_queue(board, lib);
+#endif
+
+#ifdef BOARD_PAT3
+	int fn__i = 0;
+	foreach_neighbor(board, lib, {
+		board->pat3[lib] |= (group_at(board, c) == group) << (16 + 3 - fn__i);
+		fn__i++;
+	});
+#endif
+
+#ifdef WANT_BOARD_C
+	/* Update the list of capturable groups. */
+	assert(group);
+	assert(board->clen < board_size2(board));
+	board->c[board->clen++] = group;
+#endif
+}
+static void
+board_capturable_rm(struct board *board, group_t group, coord_t lib, bool onestone)
+{
+	//fprintf(stderr, "group %s nocap %s\n", coord2sstr(group, board), coord2sstr(lib, board));
+#ifdef BOARD_TRAITS
+	/* Decrease capturable count trait of my previously-last lib. */
+	enum stone capturing_color = stone_other(board_at(board, group));
+	assert(capturing_color == S_BLACK || capturing_color == S_WHITE);
+	foreach_neighbor(board, lib, {
+		if (DEBUGL(8) && group_at(board, c) == group)
+			fprintf(stderr, "%s[%d] cap dump bc of %s(%d) member %s onestone %d\n", coord2sstr(lib, board), trait_at(board, lib, capturing_color).cap, coord2sstr(group, board), board_group_info(board, group).libs, coord2sstr(c, board), onestone);
+		trait_at(board, lib, capturing_color).cap -= (group_at(board, c) == group);
+		trait_at(board, lib, capturing_color).cap1 -= (group_at(board, c) == group && onestone);
+	});
+	board_trait_queue(board, lib);
+#endif
+
+#ifdef BOARD_PAT3
+	int fn__i = 0;
+	foreach_neighbor(board, lib, {
+		board->pat3[lib] &= ~((group_at(board, c) == group) << (16 + 3 - fn__i));
+		fn__i++;
+	});
+#endif
+
+#ifdef WANT_BOARD_C
+	/* Update the list of capturable groups. */
+	for (int i = 0; i < board->clen; i++) {
+		if (unlikely(board->c[i] == group)) {
+			board->c[i] = board->c[--board->clen];
+			return;
+		}
+	}
+	fprintf(stderr, "rm of bad group %d\n", group_base(group));
+	assert(0);
+#endif
+}
+
+static void
+board_atariable_add(struct board *board, group_t group, coord_t lib1, coord_t lib2)
+{
+#ifdef BOARD_TRAITS
+	board_trait_queue(board, lib1);
+	board_trait_queue(board, lib2);
+#endif
+}
+static void
+board_atariable_rm(struct board *board, group_t group, coord_t lib1, coord_t lib2)
+{
+#ifdef BOARD_TRAITS
+	board_trait_queue(board, lib1);
+	board_trait_queue(board, lib2);
+#endif
+}
+
+static void
+board_group_addlib(struct board *board, group_t group, coord_t coord, struct board_undo *u)
+{
+	if (DEBUGL(7)) {
+		fprintf(stderr, "Group %d[%s] %d: Adding liberty %s\n",
+			group_base(group), coord2sstr(group_base(group), board),
+			board_group_info(board, group).libs, coord2sstr(coord, board));
+	}
+
+	if (!u) check_libs_consistency(board, group);
+
+	struct group *gi = &board_group_info(board, group);
+	bool onestone = group_is_onestone(board, group);
+#ifdef BOARD_LIBMAP
+	gi->libmap[coord >> 6] |= 1ULL << (coord & 63);
+#endif
+	if (gi->libs < GROUP_KEEP_LIBS) {
+		for (int i = 0; i < GROUP_KEEP_LIBS; i++) {
+#if 0
+			/* Seems extra branch just slows it down */
+			if (!gi->lib[i])
+				break;
+#endif
+			if (unlikely(gi->lib[i] == coord))
+				return;
+		}
+		if (!u) {
+			if (gi->libs == 0) {
+				board_capturable_add(board, group, coord, onestone);
+			} else if (gi->libs == 1) {
+				board_capturable_rm(board, group, gi->lib[0], onestone);
+				board_atariable_add(board, group, gi->lib[0], coord);
+			} else if (gi->libs == 2) {
+				board_atariable_rm(board, group, gi->lib[0], gi->lib[1]);
+			}
+		}
+		gi->lib[gi->libs++] = coord;
+	}
+
+	if (!u) check_libs_consistency(board, group);
+}
+
+static void
+board_group_find_extra_libs(struct board *board, group_t group, struct group *gi, coord_t avoid)
+{
+#ifdef BOARD_LIBMAP
+	/* Take the extra liberties straight from the bitmap, which
+	 * no longer has @avoid. */
+	for (int w = 0; w < BOARD_LIBMAP_WORDS; w++) {
+		uint64_t bits = gi->libmap[w];
+		while (bits) {
+			coord_t c = w * 64 + __builtin_ctzll(bits);
+			bits &= bits - 1;
+			for (int i = 0; i < gi->libs; i++)
+				if (gi->lib[i] == c)
+					goto next_lib;
+			gi->lib[gi->libs++] = c;
+			if (unlikely(gi->libs >= GROUP_KEEP_LIBS))
+				return;
+next_lib:;
+		}
+	}
+	return;
+#endif
+	/* Add extra liberty from the board to our liberty list. */
+	unsigned char watermark[board_size2(board) / 8];
+	memset(watermark, 0, sizeof(watermark));
+#define watermark_get(c)	(watermark[c >> 3] & (1 << (c & 7)))
+#define watermark_set(c)	watermark[c >> 3] |= (1 << (c & 7))
+
+	for (int i = 0; i < GROUP_KEEP_LIBS - 1; i++)
+		watermark_set(gi->lib[i]);
+	watermark_set(avoid);
+
+	foreach_in_group(board, group) {
+		coord_t coord2 = c;
+		foreach_neighbor(board, coord2, {
+			if (board_at(board, c) + watermark_get(c) != S_NONE)
+				continue;
+			watermark_set(c);
+			gi->lib[gi->libs++] = c;
+			if (unlikely(gi->libs >= GROUP_KEEP_LIBS))
+				return;
+		} );
+	} foreach_in_group_end;
+#undef watermark_get
+#undef watermark_set
+}
+
+static void
+board_group_rmlib(struct board *board, group_t group, coord_t coord, struct board_undo *u)
+{
+	if (DEBUGL(7)) {
+		fprintf(stderr, "Group %d[%s] %d: Removing liberty %s\n",
+			group_base(group), coord2sstr(group_base(group), board),
+			board_group_info(board, group).libs, coord2sstr(coord, board));
+	}
+
+	struct group *gi = &board_group_info(board, group);
+	bool onestone = group_is_onestone(board, group);
+#ifdef BOARD_LIBMAP
+	gi->libmap[coord >> 6] &= ~(1ULL << (coord & 63));
+#endif
+	for (int i = 0; i < GROUP_KEEP_LIBS; i++) {
+#if 0
+		/* Seems extra branch just slows it down */
+		if (!gi->lib[i])
+			break;
+#endif
+		if (likely(gi->lib[i] != coord))
+			continue;
+
+		coord_t lib = gi->lib[i] = gi->lib[--gi->libs];
+		gi->lib[gi->libs] = 0;
+		
+		if (!u) check_libs_consistency(board, group);
+
+		/* Postpone refilling lib[] until we need to. */
+		assert(GROUP_REFILL_LIBS > 1);
+		if (gi->libs > GROUP_REFILL_LIBS)
+			return;
+		if (gi->libs == GROUP_REFILL_LIBS)
+			board_group_find_extra_libs(board, group, gi, coord);
+		if (u) return;
+		
+		if (gi->libs == 2) {
+			board_atariable_add(board, group, gi->lib[0], gi->lib[1]);
+		} else if (gi->libs == 1) {
+			board_capturable_add(board, group, gi->lib[0], onestone);
+			board_atariable_rm(board, group, gi->lib[0], lib);
+		} else if (gi->libs == 0)
+			board_capturable_rm(board, group, lib, onestone);
+		return;
+	}
+
+	/* This is ok even if gi->libs < GROUP_KEEP_LIBS since we
+	 * can call this multiple times per coord. */
+	if (!u) check_libs_consistency(board, group);
+	return;
+}
+
+
+#ifdef BOARD_DCNN_PLANES
+/* Refresh capped liberty count of all stones in the group. Unless
+ * forced, the group is skipped when its base stone already carries
+ * the right value, which is the common case. */
+static void
+board_dcnn_group_update(struct board *board, group_t group, bool force)
+{
+	if (!group || group_at(board, group_base(group)) != group)
+		return;
+	int libs = board_group_info(board, group).libs;
+	uint8_t l = libs < 4 ? libs : 4;
+	if (!force && board->dcnn_libs[group_base(group)] == l)
+		return;
+	foreach_in_group(board, group) {
+		board->dcnn_libs[c] = l;
+	} foreach_in_group_end;
+}
+
+static void
+board_dcnn_planes_play(struct board *board, struct move *m, struct board_undo *u)
+{
+	coord_t coord = m->coord;
+	if (u) u->dcnn_age = board->dcnn_age[coord];
+	board->dcnn_age[coord] = ++board->dcnn_ply;
+
+	/* Captures were accounted for in board_remove_stone(). */
+	board_dcnn_group_update(board, group_at(board, coord), true);
+	foreach_neighbor(board, coord, {
+		board_dcnn_group_update(board, group_at(board, c), false);
+	});
+}
+
+static void
+board_dcnn_planes_undo(struct board *b, struct move *m, struct board_undo *u)
+{
+	coord_t coord = m->coord;
+	b->dcnn_age[coord] = u->dcnn_age;
+	b->dcnn_ply--;
+
+	for (int i = 0; i < u->nmerged; i++)
+		board_dcnn_group_update(b, u->merged[i].group, true);
+	for (int i = 0; i < u->nenemies; i++) {
+		board_dcnn_group_update(b, u->enemies[i].group, true);
+		/* Restored stones took liberties of their neighbors. */
+		coord_t *stones = u->enemies[i].stones;
+		for (int j = 0; stones[j]; j++)
+			foreach_neighbor(b, stones[j], {
+				board_dcnn_group_update(b, group_at(b, c), false);
+			});
+	}
+	foreach_neighbor(b, coord, {
+		board_dcnn_group_update(b, group_at(b, c), false);
+	});
+	b->dcnn_libs[coord] = 0;
+}
+#endif
+
+/* This is a low-level routine that doesn't maintain consistency
+ * of all the board data structures. */
+static void
+board_remove_stone(struct board *board, group_t group, coord_t c, struct board_undo *u)
+{
+	enum stone color = board_at(board, c);
+	board_at(board, c) = S_NONE;
+	group_at(board, c) = 0;
+	/* The board hash and pat3 codes are updated for the whole group
+	 * by board_capture_hash_update(). */
+	board_spathash_update(board, c, color);
+	if (!u) {
+#ifdef BOARD_TRAITS
+		/* We mark as cannot-capture now. If this is a ko/snapback,
+		 * we will get incremented later in board_group_addlib(). */
+		trait_at(board, c, S_BLACK).cap = trait_at(board, c, S_BLACK).cap1 = 0;
+		trait_at(board, c, S_WHITE).cap = trait_at(board, c, S_WHITE).cap1 = 0;
+		board_trait_queue(board, c);
+#endif
+ 	}
+
+	/* Increase liberties of surrounding groups */
+	coord_t coord = c;
+	foreach_neighbor(board, coord, {
+		dec_neighbor_count_at(board, c, color);
+		if (!u) board_trait_queue(board, c);
+		group_t g = group_at(board, c);
+		if (g && g != group)
+			board_group_addlib(board, g, coord, u);
+	});
+#ifdef BOARD_DCNN_PLANES
+	if (!board->probing) {
+		board->dcnn_libs[c] = 0;
+		foreach_neighbor(board, coord, {
+			if (group_at(board, c) != group)
+				board_dcnn_group_update(board, group_at(board, c), false);
+		});
+	}
+#endif
+	if (u) return;
+
+	if (DEBUGL(6))
+		fprintf(stderr, "pushing free move [%d]: %d,%d\n", board->flen, coord_x(c, board), coord_y(c, board));
+	board->f[board->flen++] = c;
+}
+
+#ifdef BOARD_PAT3
+/* Recompute the pat3 code of an empty point around a capture, unless
+ * already done (@seen). */
+static inline void
+board_pat3_refresh(struct board *board, uint64_t *seen, coord_t coord)
+{
+	if (board_at(board, coord) != S_NONE || (seen[coord / 64] & (1ULL << (coord % 64))))
+		return;
+	seen[coord / 64] |= 1ULL << (coord % 64);
+	board->pat3[coord] = pattern3_hash(board, coord);
+#if defined(BOARD_TRAITS)
+	board_trait_queue(board, coord);
+#endif
+}
+#endif
+
+/* Account for the @n stones at @removed just captured, whose Zobrist
+ * hashes XOR to @h (@qh by quadrant): the board hashes change at once,
+ * and each point around gets its pat3 code recomputed once, with the
+ * liberties of the neighbors already final, rather than once per
+ * stone removed next to it. */
+static void
+board_capture_hash_update(struct board *board, coord_t *removed, int n, hash_t h, hash_t *qh)
+{
+	board->hash ^= h;
+	for (int q = 0; q < 4; q++)
+		board->qhash[q] ^= qh[q];
+	if (DEBUGL(8))
+		fprintf(stderr, "board_capture_hash_update(%d stones) ^ %"PRIhash" -> %"PRIhash"\n", n, h, board->hash);
+
+#ifdef BOARD_EMPTY3
+	for (int i = 0; i < n; i++)
+		board_empty3_update(board, removed[i]);
+#endif
+
+#ifdef BOARD_PAT3
+	uint64_t seen[(BOARD_MAX_COORDS + 63) / 64] = { 0 };
+	for (int i = 0; i < n; i++) {
+		board_pat3_refresh(board, seen, removed[i]);
+		foreach_8neighbor(board, removed[i]) {
+			board_pat3_refresh(board, seen, c);
+		} foreach_8neighbor_end;
+	}
+#endif
+}
+
+static int profiling_noinline
+board_group_capture(struct board *board, group_t group, struct board_undo *u)
+{
+	int stones = 0;
+	enum stone color = board_at(board, group_base(group));
+	coord_t removed[BOARD_MAX_MOVES];
+	hash_t h = 0, qh[4] = { 0 };
+
+	foreach_in_group(board, group) {
+		board->captures[stone_other(color)]++;
+		if (!u) {
+			h ^= hash_at(board, c, color);
+			qh[coord_quadrant(c, board)] ^= hash_at(board, c, color);
+			removed[stones] = c;
+		}
+		board_remove_stone(board, group, c, u);
+		stones++;
+	} foreach_in_group_end;
+
+	struct group *gi = &board_group_info(board, group);
+	assert(gi->libs == 0);
+	memset(gi, 0, sizeof(*gi));
+
+	if (!u)
+		board_capture_hash_update(board, removed, stones, h, qh);
+
+	return stones;
+}
+
+
+static void profiling_noinline
+add_to_group(struct board *board, group_t group, coord_t prevstone, coord_t coord, struct board_undo *u)
+{
+#ifdef BOARD_TRAITS
+	struct group *gi = &board_group_info(board, group);
+	bool onestone = group_is_onestone(board, group);
+
+	if (!u && gi->libs == 1) {
+		/* Our group is temporarily in atari; make sure the capturable
+		 * counts also correspond to the newly added stone before we
+		 * start adding liberties again so bump-dump ops match. */
+		enum stone capturing_color = stone_other(board_at(board, group));
+		assert(capturing_color == S_BLACK || capturing_color == S_WHITE);
+
+		coord_t lib = board_group_info(board, group).lib[0];
+		if (coord_is_adjecent(lib, coord, board)) {
+			if (DEBUGL(8))
+				fprintf(stderr, "add_to_group %s: %s[%d] bump\n", coord2sstr(group, board), coord2sstr(lib, board), trait_at(board, lib, capturing_color).cap);
+			trait_at(board, lib, capturing_color).cap++;
+			/* This is never a 1-stone group, obviously. */
+			board_trait_queue(board, lib);
+		}
+
+		if (onestone) {
+			/* We are not 1-stone group anymore, update the cap1
+			 * counter specifically. */
+			foreach_neighbor(board, group, {
+				if (board_at(board, c) != S_NONE) continue;
+				trait_at(board, c, capturing_color).cap1--;
+				board_trait_queue(board, c);
+			});
+		}
+	}
+#endif
+
+	group_at(board, coord) = group;
+	groupnext_at(board, coord) = groupnext_at(board, prevstone);
+	groupnext_at(board, prevstone) = coord;
+
+	foreach_neighbor(board, coord, {
+		if (board_at(board, c) == S_NONE)
+			board_group_addlib(board, group, c, u);
+	});
+
+	if (DEBUGL(8))
+		fprintf(stderr, "add_to_group: added (%d,%d ->) %d,%d (-> %d,%d) to group %d\n",
+			coord_x(prevstone, board), coord_y(prevstone, board),
+			coord_x(coord, board), coord_y(coord, board),
+			groupnext_at(board, coord) % board_size(board), groupnext_at(board, coord) / board_size(board),
+			group_base(group));
+}
+
+static void profiling_noinline
+merge_groups(struct board *board, group_t group_to, group_t group_from, struct board_undo *u)
+{
+	if (DEBUGL(7))
+		fprintf(stderr, "board_play_raw: merging groups %d -> %d\n",
+			group_base(group_from), group_base(group_to));
+	struct group *gi_from = &board_group_info(board, group_from);
+	struct group *gi_to = &board_group_info(board, group_to);
+	bool onestone_from = group_is_onestone(board, group_from);
+	bool onestone_to = group_is_onestone(board, group_to);
+
+	if (!u) {
+		/* We do this early before the group info is rewritten. */
+		if (gi_from->libs == 2)
+			board_atariable_rm(board, group_from, gi_from->lib[0], gi_from->lib[1]);
+		else if (gi_from->libs == 1)
+			board_capturable_rm(board, group_from, gi_from->lib[0], onestone_from);
+	}
+
+	if (DEBUGL(7))
+		fprintf(stderr,"---- (froml %d, tol %d)\n", gi_from->libs, gi_to->libs);
+
+#ifdef BOARD_LIBMAP
+	for (int i = 0; i < BOARD_LIBMAP_WORDS; i++)
+		gi_to->libmap[i] |= gi_from->libmap[i];
+#endif
+
+	if (gi_to->libs < GROUP_KEEP_LIBS) {
+		for (int i = 0; i < gi_from->libs; i++) {
+			for (int j = 0; j < gi_to->libs; j++)
+				if (gi_to->lib[j] == gi_from->lib[i])
+					goto next_from_lib;
+			if (!u) {
+				if (gi_to->libs == 0) {
+					board_capturable_add(board, group_to, gi_from->lib[i], onestone_to);
+				} else if (gi_to->libs == 1) {
+					board_capturable_rm(board, group_to, gi_to->lib[0], onestone_to);
+					board_atariable_add(board, group_to, gi_to->lib[0], gi_from->lib[i]);
+				} else if (gi_to->libs == 2) {
+					board_atariable_rm(board, group_to, gi_to->lib[0], gi_to->lib[1]);
+				}
+			}
+			gi_to->lib[gi_to->libs++] = gi_from->lib[i];
+			if (gi_to->libs >= GROUP_KEEP_LIBS)
+				break;
+next_from_lib:;
+		}
+	}
+
+	if (!u && gi_to->libs == 1) {
+		coord_t lib = board_group_info(board, group_to).lib[0];
+#ifdef BOARD_TRAITS
+		enum stone capturing_color = stone_other(board_at(board, group_to));
+		assert(capturing_color == S_BLACK || capturing_color == S_WHITE);
+
+		/* Our group is currently in atari; make sure we properly
+		 * count in even the neighbors from the other group in the
+		 * capturable counter. */
+		foreach_neighbor(board, lib, {
+			if (DEBUGL(8) && group_at(board, c) == group_from)
+				fprintf(stderr, "%s[%d] cap bump\n", coord2sstr(lib, board), trait_at(board, lib, capturing_color).cap);
+			trait_at(board, lib, capturing_color).cap += (group_at(board, c) == group_from);
+			/* This is never a 1-stone group, obviously. */
+		});
+		board_trait_queue(board, lib);
+
+		if (onestone_to) {
+			/* We are not 1-stone group anymore, update the cap1
+			 * counter specifically. */
+			foreach_neighbor(board, group_to, {
+				if (board_at(board, c) != S_NONE) continue;
+				trait_at(board, c, capturing_color).cap1--;
+				board_trait_queue(board, c);
+			});
+		}
+#endif
+#ifdef BOARD_PAT3
+		if (gi_from->libs == 1) {
+			/* We removed group_from from capturable groups,
+			 * therefore switching the atari flag off.
+			 * We need to set it again since group_to is also
+			 * capturable. */
+			int fn__i = 0;
+			foreach_neighbor(board, lib, {
+				board->pat3[lib] |= (group_at(board, c) == group_from) << (16 + 3 - fn__i);
+				fn__i++;
+			});
+		}
+#endif
+	}
+
+	coord_t last_in_group;
+	foreach_in_group(board, group_from) {
+		last_in_group = c;
+		group_at(board, c) = group_to;
+	} foreach_in_group_end;
+
+	if (u) u->merged[++u->nmerged_tmp].last = last_in_group;
+	groupnext_at(board, last_in_group) = groupnext_at(board, group_base(group_to));
+	groupnext_at(board, group_base(group_to)) = group_base(group_from);
+	memset(gi_from, 0, sizeof(struct group));
+
+	if (DEBUGL(7))
+		fprintf(stderr, "board_play_raw: merged group: %d\n",
+			group_base(group_to));
+}
+
+static group_t profiling_noinline
+new_group(struct board *board, coord_t coord, struct board_undo *u)
+{
+	group_t group = coord;
+	struct group *gi = &board_group_info(board, group);
+	/* Garbage in board_copy_to() copies. */
+	memset(gi, 0, sizeof(*gi));
+	foreach_neighbor(board, coord, {
+		if (board_at(board, c) == S_NONE) {
+#ifdef BOARD_LIBMAP
+			gi->libmap[c >> 6] |= 1ULL << (c & 63);
+#endif
+			/* board_group_addlib is ridiculously expensive for us */
+#if GROUP_KEEP_LIBS < 4
+			if (gi->libs < GROUP_KEEP_LIBS)
+#endif
+			gi->lib[gi->libs++] = c;
+		}
+	});
+
+	group_at(board, coord) = group;
+	groupnext_at(board, coord) = 0;
+
+	if (!u) {
+		if (gi->libs == 2)
+			board_atariable_add(board, group, gi->lib[0], gi->lib[1]);
+		else if (gi->libs == 1)
+			board_capturable_add(board, group, gi->lib[0], true);
+		check_libs_consistency(board, group);
+	}
+
+	if (DEBUGL(8))
+		fprintf(stderr, "new_group: added %d,%d to group %d\n",
+			coord_x(coord, board), coord_y(coord, board),
+			group_base(group));
+
+	return group;
+}
+
+static inline void
+undo_save_merge(struct board *b, struct board_undo *u, group_t g, coord_t c)
+{
+	if (g == u->merged[0].group || g == u->merged[1].group || 
+	    g == u->merged[2].group || g == u->merged[3].group)
+		return;
+	
+	int i = u->nmerged++;
+	if (!i)
+		u->inserted = c;
+	u->merged[i].group = g;
+	u->merged[i].last = 0;   // can remove
+	u->merged[i].info = board_group_info(b, g);
+}
+
+static inline void
+undo_save_enemy(struct board *b, struct board_undo *u, group_t g)
+{
+	if (g == u->enemies[0].group || g == u->enemies[1].group ||
+	    g == u->enemies[2].group || g == u->enemies[3].group)
+		return;
+	
+	int i = u->nenemies++;
+	u->enemies[i].group = g;
+	u->enemies[i].info = board_group_info(b, g);
+		
+	int j = 0;
+	coord_t *stones = u->enemies[i].stones;
+	if (board_group_info(b, g).libs <= 1) { // Will be captured
+		foreach_in_group(b, g) {
+			stones[j++] = c;
+		} foreach_in_group_end;
+		u->captures += j;
+	}
+	stones[j] = 0;
+}
+
+static void
+undo_save_group_info(struct board *b, coord_t coord, enum stone color, struct board_undo *u)
+{
+	u->next_at = groupnext_at(b, coord);
+
+	foreach_neighbor(b, coord, {			
+		group_t g = group_at(b, c);
+	
+		if (board_at(b, c) == color)
+			undo_save_merge(b, u, g, c);
+		else if (board_at(b, c) == stone_other(color)) 
+			undo_save_enemy(b, u, g);
+	});
+}		
+
+static void
+undo_save_suicide(struct board *b, coord_t coord, enum stone color, struct board_undo *u)
+{
+	foreach_neighbor(b, coord, {
+		if (board_at(b, c) == color) {
+			// Handle suicide as a capture ...
+			undo_save_enemy(b, u, group_at(b, c));
+			return;
+		}
+	});
+	assert(0);
+}
+
+static inline group_t
+play_one_neighbor(struct board *board,
+		  coord_t coord, enum stone color, enum stone other_color,
+		  coord_t c, group_t group, struct board_undo *u)
+{
+	enum stone ncolor = board_at(board, c);
+	group_t ngroup = group_at(board, c);
+
+	inc_neighbor_count_at(board, c, color);
+	/* We can be S_NONE, in that case we need to update the safety
+	 * trait since we might be left with only one liberty. */
+	if (!u) board_trait_queue(board, c);
+
+	if (!ngroup)
+		return group;
+
+	board_group_rmlib(board, ngroup, coord, u);
+	if (DEBUGL(7))
+		fprintf(stderr, "board_play_raw: reducing libs for group %d (%d:%d,%d)\n",
+			group_base(ngroup), ncolor, color, other_color);
+
+	if (ncolor == color && ngroup != group) {
+		if (!group) {
+			group = ngroup;
+			add_to_group(board, group, c, coord, u);
+		} else {
+			merge_groups(board, group, ngroup, u);
+		}
+	} else if (ncolor == other_color) {
+		if (DEBUGL(8)) {
+			struct group *gi = &board_group_info(board, ngroup);
+			fprintf(stderr, "testing captured group %d[%s]: ", group_base(ngroup), coord2sstr(group_base(ngroup), board));
+			for (int i = 0; i < GROUP_KEEP_LIBS; i++)
+				fprintf(stderr, "%s ", coord2sstr(gi->lib[i], board));
+			fprintf(stderr, "\n");
+		}
+		if (unlikely(board_group_captured(board, ngroup)))
+			board_group_capture(board, ngroup, u);
+	}
+	return group;
+}
+
+/* We played on a place with at least one liberty. We will become a member of
+ * some group for sure. */
+static group_t profiling_noinline
+board_play_outside(struct board *board, struct move *m, int f, struct board_undo *u)
+{
+	coord_t coord = m->coord;
+	enum stone color = m->color;
+	enum stone other_color = stone_other(color);
+	group_t group = 0;
+
+	if (u)  
+		undo_save_group_info(board, coord, color, u);
+	else {
+		board->f[f] = board->f[--board->flen];
+		if (DEBUGL(6))
+			fprintf(stderr, "popping free move [%d->%d]: %d\n", board->flen, f, board->f[f]);
+
+#if defined(BOARD_TRAITS) && defined(DEBUG)
+		/* Sanity check that cap matches reality. */
+		{
+			int a = 0, b = 0;
+			foreach_neighbor(board, coord, {
+					group_t g = group_at(board, c);
+					a += g && (board_at(board, c) == other_color && board_group_info(board, g).libs == 1);
+					b += g && (board_at(board, c) == other_color && board_group_info(board, g).libs == 1) && group_is_onestone(board, g);
+				});
+			assert(a == trait_at(board, coord, color).cap);
+			assert(b == trait_at(board, coord, color).cap1);
+#ifdef BOARD_TRAIT_SAFE
+			assert(board_trait_safe(board, coord, color) == trait_at(board, coord, color).safe);
+#endif
+		}
+#endif
+	}
+	foreach_neighbor(board, coord, {
+			group = play_one_neighbor(board, coord, color, other_color, c, group, u);
+	});
+
+	board_at(board, coord) = color;
+	if (unlikely(!group))
+		group = new_group(board, coord, u);
+
+	if (!u) {
+		board->last_move4 = board->last_move3;
+		board->last_move3 = board->last_move2;
+	}
+	board->last_move2 = board->last_move;
+	board->last_move = *m;
+	board->moves++;
+	if (u)
+		board_spathash_update(board, coord, color);
+	else {
+		board_hash_update(board, coord, color);
+		board_symmetry_update(board, &board->symmetry, coord);
+	}
+	struct move ko = { pass, S_NONE };
+	board->ko = ko;
+
+	if (!u) check_pat3_consistency(board, coord);
+
+	return group;
+}
+
+/* We played in an eye-like shape. Either we capture at least one of the eye
+ * sides in the process of playing, or return -1. */
+static int profiling_noinline
+board_play_in_eye(struct board *board, struct move *m, int f, struct board_undo *u)
+{
+	coord_t coord = m->coord;
+	enum stone color = m->color;
+	/* Check ko: Capture at a position of ko capture one move ago */
+	if (unlikely(color == board->ko.color && coord == board->ko.coord)) {
+		if (DEBUGL(5))
+			fprintf(stderr, "board_check: ko at %d,%d color %d\n", coord_x(coord, board), coord_y(coord, board), color);
+		return -1;
+	} else if (DEBUGL(6)) {
+		fprintf(stderr, "board_check: no ko at %d,%d,%d - ko is %d,%d,%d\n",
+			color, coord_x(coord, board), coord_y(coord, board),
+			board->ko.color, coord_x(board->ko.coord, board), coord_y(board->ko.coord, board));
+	}
+
+	struct move ko = { pass, S_NONE };
+
+	int captured_groups = 0;
+
+	foreach_neighbor(board, coord, {
+		group_t g = group_at(board, c);
+		if (DEBUGL(7))
+			fprintf(stderr, "board_check: group %d has %d libs\n",
+				g, board_group_info(board, g).libs);
+		captured_groups += (board_group_info(board, g).libs == 1);
+	});
+
+	if (likely(captured_groups == 0)) {
+		if (DEBUGL(5)) {
+			if (DEBUGL(6))
+				board_print(board, stderr);
+			fprintf(stderr, "board_check: one-stone suicide\n");
+		}
+
+		return -1;
+	}
+
+	if (!u) {
+#ifdef BOARD_TRAITS
+		/* We _will_ for sure capture something. */
+		assert(trait_at(board, coord, color).cap > 0);
+#ifdef BOARD_TRAIT_SAFE
+		assert(trait_at(board, coord, color).safe == board_trait_safe(board, coord, color));
+#endif
+#endif
+
+		board->f[f] = board->f[--board->flen];
+		if (DEBUGL(6))
+			fprintf(stderr, "popping free move [%d->%d]: %d\n", board->flen, f, board->f[f]);
+	}
+	else
+		undo_save_group_info(board, coord, color, u);
+
+	int ko_caps = 0;
+	coord_t cap_at = pass;
+	foreach_neighbor(board, coord, {
+		inc_neighbor_count_at(board, c, color);
+		/* Originally, this could not have changed any trait
+		 * since no neighbors were S_NONE, however by now some
+		 * of them might be removed from the board. */
+		if (!u) board_trait_queue(board, c);
+
+		group_t group = group_at(board, c);
+		if (!group)
+			continue;
+
+		board_group_rmlib(board, group, coord, u);
+		if (DEBUGL(7))
+			fprintf(stderr, "board_play_raw: reducing libs for group %d\n",
+				group_base(group));
+
+		if (board_group_captured(board, group)) {
+			ko_caps += board_group_capture(board, group, u);
+			cap_at = c;
+		}
+	});
+	if (ko_caps == 1) {
+		ko.color = stone_other(color);
+		ko.coord = cap_at; // unique
+		board->last_ko = ko;
+		board->last_ko_age = board->moves;
+		if (DEBUGL(5))
+			fprintf(stderr, "guarding ko at %d,%s\n", ko.color, coord2sstr(ko.coord, board));
+	}
+
+	board_at(board, coord) = color;
+	group_t group = new_group(board, coord, u);
+
+	if (!u) {
+		board->last_move4 = board->last_move3;
+		board->last_move3 = board->last_move2;
+	}
+	board->last_move2 = board->last_move;
+	board->last_move = *m;
+	board->moves++;
+	if (u)
+		board_spathash_update(board, coord, color);
+	else {
+		board_hash_update(board, coord, color);
+		board_hash_commit(board);
+		board_traits_recompute(board);
+		board_symmetry_update(board, &board->symmetry, coord);
+	}
+	board->ko = ko;
+
+	if (!u) check_pat3_consistency(board, coord);
+
+	return !!group;
+}
+
+static int __attribute__((flatten))
+board_play_f_(struct board *board, struct move *m, int f, struct board_undo *u)
+{
+	if (DEBUGL(7)) {
+		fprintf(stderr, "board_play(%s): ---- Playing %d,%d\n", coord2sstr(m->coord, board), coord_x(m->coord, board), coord_y(m->coord, board));
+	}
+	if (likely(!board_is_eyelike(board, m->coord, stone_other(m->color)))) {
+		/* NOT playing in an eye. Thus this move has to succeed. (This
+		 * is thanks to New Zealand rules. Otherwise, multi-stone
+		 * suicide might fail.) */
+		group_t group = board_play_outside(board, m, f, u);
+		if (unlikely(board_group_captured(board, group))) {
+			if (u) undo_save_suicide(board, m->coord, m->color, u);
+			board_group_capture(board, group, u);
+		}
+#ifdef BOARD_DCNN_PLANES
+		if (!board->probing)
+			board_dcnn_planes_play(board, m, u);
+#endif
+		if (!u) {
+			board_hash_commit(board);
+			board_traits_recompute(board);
+		}
+		return 0;
+	} else {
+		int r = board_play_in_eye(board, m, f, u);
+#ifdef BOARD_DCNN_PLANES
+		if (r >= 0 && !board->probing)
+			board_dcnn_planes_play(board, m, u);
+#endif
+		return r;
+	}
+}
+
+static inline int
+board_play_f(struct board *board, struct move *m, int f, struct board_undo *u)
+{
+	uint64_t t = perf_start();
+	int r = board_play_f_(board, m, f, u);
+	perf_stop(PERF_BOARD_PLAY, t);
+	return r;
+}
+
+/* The part of the undo record that depends only on the position. */
+static inline void
+undo_init_position(struct board *b, struct board_undo *u)
+{
+	u->last_move2 = b->last_move2;
+	u->ko = b->ko;
+	u->last_ko = b->last_ko;
+	u->last_ko_age = b->last_ko_age;
+}
+
+static inline void
+undo_init_move(struct board *b, struct move *m, struct board_undo *u)
+{
+	u->captures = 0;
+	
+	u->nmerged = u->nmerged_tmp = u->nenemies = 0;
+	for (int i = 0; i < 4; i++)
+		u->merged[i].group = u->enemies[i].group = 0;
+}
+
+static void
+undo_init(struct board *b, struct move *m, struct board_undo *u)
+{
+	// Paranoid uninitialized mem test
+	// memset(u, 0xff, sizeof(*u));
+	
+	undo_init_position(b, u);
+	undo_init_move(b, m, u);
+}
+
+/* @u is initialized already, except for the move part if @probe. */
+static int
+board_play_u(struct board *board, struct move *m, struct board_undo *u, bool probe)
+{
+#ifdef BOARD_UNDO_CHECKS
+	assert(u || !board->quicked);
+#endif
+
+	if (u) {
+		if (probe) undo_init_move(board, m, u);
+		else undo_init(board, m, u);
+		u->probe = probe;
+	}
+	
+	if (unlikely(is_pass(m->coord) || is_resign(m->coord))) {
+		if (is_pass(m->coord) && board->rules == RULES_SIMING) {
+			/* On pass, the player gives a pass stone
+			 * to the opponent. */
+			board->captures[stone_other(m->color)]++;
+		}
+		struct move nomove = { pass, S_NONE };
+		board->ko = nomove;
+		if (!u) { 
+			board->last_move4 = board->last_move3;
+			board->last_move3 = board->last_move2;
+		}
+		board->last_move2 = board->last_move;
+		board->last_move = *m;
+#ifdef BOARD_DCNN_PLANES
+		if (!board->probing)
+			board->dcnn_ply++;
+#endif
+		return 0;
+	}
+
+	if (u)
+		return board_play_f(board, m, -1, u);
+	
+	int f;
+	for (f = 0; f < board->flen; f++)
+		if (board->f[f] == m->coord)
+			return board_play_f(board, m, f, u);
+
+	if (DEBUGL(7))
+		fprintf(stderr, "board_check: stone exists\n");
+	return -1;
+}
+
+static int
+board_play_(struct board *board, struct move *m, struct board_undo *u)
+{
+	return board_play_u(board, m, u, false);
+}
+
+static int
+board_kernel_play(struct board *board, struct move *m)
+{
+	return board_play_(board, m, NULL);
+}
+
+static int
+board_kernel_quick_play(struct board *board, struct move *m, struct board_undo *u)
+{
+	int r = board_play_(board, m, u);
+	if (r >= 0)
+		board->quicked++;
+	return r;
+}
+
+#ifndef BOARD_KERNEL_SIZE
+void
+board_quick_probe_init(struct board *board, struct board_undo *u)
+{
+	undo_init_position(board, u);
+}
+#endif
+
+static int
+board_kernel_quick_probe(struct board *board, struct move *m, struct board_undo *u)
+{
+	board->probing++;
+	int r = board_play_u(board, m, u, true);
+	if (r >= 0)
+		board->quicked++;
+	else
+		board->probing--;
+	return r;
+}
+
+static inline void
+undo_merge(struct board *b, struct board_undo *u, struct move *m)
+{
+	coord_t coord = m->coord;
+	group_t group = group_at(b, coord);
+	struct undo_merge *merged = u->merged;
+	
+	// Others groups, in reverse order ...
+	for (int i = u->nmerged - 1; i > 0; i--) {
+		group_t old_group = merged[i].group;
+			
+		board_group_info(b, old_group) = merged[i].info;
+			
+		groupnext_at(b, group_base(group)) = groupnext_at(b, merged[i].last);
+		groupnext_at(b, merged[i].last) = 0;
+
+#if 0
+		printf("merged_group[%i]:   (last: %s)", i, coord2sstr(merged[i].last, b));
+		foreach_in_group(b, old_group) {
+			printf("%s ", coord2sstr(c, b));
+		} foreach_in_group_end;
+		printf("\n");
+#endif
+			
+		foreach_in_group(b, old_group) {
+			group_at(b, c) = old_group;
+		} foreach_in_group_end;
+	}
+
+	// Restore first group
+	groupnext_at(b, u->inserted) = groupnext_at(b, coord);
+	board_group_info(b, merged[0].group) = merged[0].info;
+
+#if 0
+	printf("merged_group[0]: ");
+	foreach_in_group(b, merged[0].group) {
+		printf("%s ", coord2sstr(c, b));
+	} foreach_in_group_end;
+	printf("\n");
+#endif
+}
+
+
+static inline void
+restore_enemies(struct board *b, struct board_undo *u, struct move *m)
+{
+	enum stone color = m->color;
+	enum stone other_color = stone_other(m->color);
+	
+	struct undo_enemy *enemy = u->enemies;
+	for (int i = 0; i < u->nenemies; i++) {
+		group_t old_group = enemy[i].group;
+			
+		board_group_info(b, old_group) = enemy[i].info;
+			
+		coord_t *stones = enemy[i].stones;
+		for (int j = 0; stones[j]; j++) {
+			board_at(b, stones[j]) = other_color;
+			board_spathash_update(b, stones[j], other_color);
+			group_at(b, stones[j]) = old_group;
+			groupnext_at(b, stones[j]) = stones[j + 1];
+
+			foreach_neighbor(b, stones[j], {
+				inc_neighbor_count_at(b, c, other_color);
+			});
+
+			// Update liberties of neighboring groups
+			foreach_neighbor(b, stones[j], {
+					if (board_at(b, c) != color)
+						continue;
+					group_t g = group_at(b, c);
+					if (g == u->merged[0].group || g == u->merged[1].group || g == u->merged[2].group || g == u->merged[3].group)
+						continue;
+					board_group_rmlib(b, g, stones[j], u);
+				});
+		}
+	}
+}
+
+static void
+board_undo_stone(struct board *b, struct board_undo *u, struct move *m)
+{	
+	coord_t coord = m->coord;
+	enum stone color = m->color;
+	/* - update groups
+	 * - put captures back
+	 */
+	
+	//printf("nmerged: %i\n", u->nmerged);
+	
+	// Restore merged groups
+	if (u->nmerged)
+		undo_merge(b, u, m);
+	else			// Single stone group undo
+		memset(&board_group_info(b, group_at(b, coord)), 0, sizeof(struct group));
+	
+	board_at(b, coord) = S_NONE;
+	board_spathash_update(b, coord, color);
+	group_at(b, coord) = 0;
+	groupnext_at(b, coord) = u->next_at;
+	
+	foreach_neighbor(b, coord, {
+			dec_neighbor_count_at(b, c, color);
+	});
+
+	// Restore enemy groups
+	if (u->nenemies) {
+		b->captures[color] -= u->captures;
+		restore_enemies(b, u, m);
+	}
+}
+
+static inline void
+restore_suicide(struct board *b, struct board_undo *u, struct move *m)
+{
+	enum stone color = m->color;
+	enum stone other_color = stone_other(m->color);
+	
+	struct undo_enemy *enemy = u->enemies;
+	for (int i = 0; i < u->nenemies; i++) {
+		group_t old_group = enemy[i].group;
+			
+		board_group_info(b, old_group) = enemy[i].info;
+			
+		coord_t *stones = enemy[i].stones;
+		for (int j = 0; stones[j]; j++) {
+			board_at(b, stones[j]) = other_color;
+			board_spathash_update(b, stones[j], other_color);
+			group_at(b, stones[j]) = old_group;
+			groupnext_at(b, stones[j]) = stones[j + 1];
+
+			foreach_neighbor(b, stones[j], {
+				inc_neighbor_count_at(b, c, other_color);
+			});
+
+			// Update liberties of neighboring groups
+			foreach_neighbor(b, stones[j], {
+					if (board_at(b, c) != color)
+						continue;
+					group_t g = group_at(b, c);
+					if (g == u->enemies[0].group || g == u->enemies[1].group || 
+					    g == u->enemies[2].group || g == u->enemies[3].group)
+						continue;
+					board_group_rmlib(b, g, stones[j], u);
+				});
+		}
+	}
+}
+
+
+static void
+board_undo_suicide(struct board *b, struct board_undo *u, struct move *m)
+{	
+	coord_t coord = m->coord;
+	enum stone other_color = stone_other(m->color);
+	
+	// Pretend it's capture ...
+	struct move m2 = { .coord = m->coord, .color = other_color };
+	b->captures[other_color] -= u->captures;
+	
+	restore_suicide(b, u, &m2);
+
+	undo_merge(b, u, m);
+
+	if (board_at(b, coord) == m->color)
+		board_spathash_update(b, coord, m->color);
+	board_at(b, coord) = S_NONE;
+	group_at(b, coord) = 0;
+	groupnext_at(b, coord) = u->next_at;
+
+	foreach_neighbor(b, coord, {
+		dec_neighbor_count_at(b, c, m->color);
+	});
+
+}
+
+
+static void
+board_kernel_quick_undo(struct board *b, struct move *m, struct board_undo *u)
+{
+	b->quicked--;
+#ifdef BOARD_DCNN_PLANES
+	bool probing = b->probing;
+#endif
+	if (u->probe)
+		b->probing--;
+	
+	b->last_move = b->last_move2;
+	b->last_move2 = u->last_move2;
+	b->ko = u->ko;
+	b->last_ko = u->last_ko;
+	b->last_ko_age = u->last_ko_age;
+	
+	if (unlikely(is_pass(m->coord) || is_resign(m->coord))) {
+#ifdef BOARD_DCNN_PLANES
+		if (!probing)
+			b->dcnn_ply--;
+#endif
+		return;
+	}
+
+	b->moves--;
+
+	if (likely(board_at(b, m->coord) == m->color))
+		board_undo_stone(b, u, m);
+	else if (board_at(b, m->coord) == S_NONE)
+		board_undo_suicide(b, u, m);
+	else
+		assert(0);	/* Anything else doesn't make sense */
+
+#ifdef BOARD_DCNN_PLANES
+	if (!probing)
+		board_dcnn_planes_undo(b, m, u);
+#endif
+}
+
+
+static inline bool
+board_try_random_move(struct board *b, enum stone color, coord_t *coord, int f, ppr_permit permit, void *permit_data)
+{
+	*coord = b->f[f];
+	struct move m = { *coord, color };
+	if (DEBUGL(6))
+		fprintf(stderr, "trying random move %d: %d,%d %s %d\n", f, coord_x(*coord, b), coord_y(*coord, b), coord2sstr(*coord, b), board_is_valid_move(b, &m));
+	permit = (permit ? permit : board_permit);
+	if (!permit(b, &m, permit_data))
+		return false;
+	if (m.coord == *coord) {
+		return likely(board_play_f(b, &m, f, NULL) >= 0);
+	} else {
+		*coord = m.coord; // permit modified the coordinate
+		return likely(board_kernel_play(b, &m) >= 0);
+	}
+}
+
+static void
+board_kernel_play_random(struct board *b, enum stone color, coord_t *coord, ppr_permit permit, void *permit_data)
+{
+	if (unlikely(b->flen == 0))
+		goto pass;
+
+	int base = fast_random(b->flen), f;
+	for (f = base; f < b->flen; f++)
+		if (board_try_random_move(b, color, coord, f, permit, permit_data))
+			return;
+	for (f = 0; f < base; f++)
+		if (board_try_random_move(b, color, coord, f, permit, permit_data))
+			return;
+
+pass:
+	*coord = pass;
+	struct move m = { pass, color };
+	board_kernel_play(b, &m);
+}
+
+
+#ifdef BOARD_KERNEL_SIZE
+#define board_kernels_name_(s) board_kernels_ ## s
+#define board_kernels_name(s) board_kernels_name_(s)
+#define board_kernels_this board_kernels_name(BOARD_KERNEL_SIZE)
+#define board_kernels_size BOARD_KERNEL_SIZE
+#else
+#define board_kernels_this board_kernels_any
+#define board_kernels_size 0
+#endif
+
+const struct board_kernels board_kernels_this = {
+	.size = board_kernels_size,
+	.play = board_kernel_play,
+	.quick_play = board_kernel_quick_play,
+	.quick_probe = board_kernel_quick_probe,
+	.quick_undo = board_kernel_quick_undo,
+	.play_random = board_kernel_play_random,
+};
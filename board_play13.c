@@ -0,0 +1,6 @@
+/* board_play.c with the board size fixed to 13x13. */
+
+#ifndef BOARD_SIZE
+#define BOARD_KERNEL_SIZE 13
+#include "board_play.c"
+#endif
@@ -0,0 +1,6 @@
+/* board_play.c with the board size fixed to 9x9. */
+
+#ifndef BOARD_SIZE
+#define BOARD_KERNEL_SIZE 9
+#include "board_play.c"
+#endif
@@ -7,116 +7,393 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <sys/stat.h>
-
-#define CPU_ONLY 1
-#include <caffe/caffe.hpp>
-using namespace caffe;
+#include <pthread.h>
 
 extern "C" {
 #include "debug.h"
 #include "board.h"
 #include "dcnn.h"
+#include "dcnn_backend.h"
 #include "engine.h"
+#include "memstats.h"
 #include "uct/tree.h"
 	
-	
-static shared_ptr<Net<float> > net;
+
+static struct dcnn_backend *backends[] = {
+	&dcnn_backend_caffe,
+#ifdef DCNN_ONNX
+	&dcnn_backend_onnx,
+#endif
+};
+static const char *precision_names[] = { "fp32", "fp16", "int8" };
+
+/* Backend the network was loaded with, NULL if none. */
+static struct dcnn_backend *backend;
+
+/* Instances of the network, streams per device. Each evaluates one
+ * batch at a time; a batch goes to the device with the fewest
+ * positions in flight, so the gpus fill up evenly. */
+#define DCNN_MAX_INSTANCES 64
+
+static struct dcnn_instance {
+	void *net;
+	int device;
+	bool busy;
+} instances[DCNN_MAX_INSTANCES];
+static int instances_n;
+static int device_load[DCNN_MAX_INSTANCES]; // positions in flight by device
+static pthread_mutex_t sched_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sched_cond = PTHREAD_COND_INITIALIZER; // an instance became idle
 
 bool
 using_dcnn(struct board *b)
 {
-	return (real_board_size(b) == 19 && net);
+	return (real_board_size(b) == 19 && backend);
 }
 
-/* Make caffe quiet */
-void
-dcnn_quiet_caffe(int argc, char *argv[])
+/* Parse "fp32", "fp16" or "int8". */
+static bool
+dcnn_parse_precision(const char *name, enum dcnn_precision *precision)
 {
-	if (DEBUGL(7) || getenv("GLOG_minloglevel"))
+	for (int i = 0; i < DCNN_PRECISIONS; i++)
+		if (!strcasecmp(name, precision_names[i])) {
+			*precision = (enum dcnn_precision) i;
+			return true;
+		}
+	return false;
+}
+
+/* Cache of the move probabilities of the positions evaluated lately,
+ * shared by all threads and kept across games. The key is a hash of
+ * the network input, in the orientation of the board symmetry giving
+ * the smallest hash, so that the symmetric positions share an entry;
+ * the probabilities are stored in that canonical orientation.
+ * Buckets of DCNN_CACHE_WAYS entries, least recently used out. */
+#define DCNN_CACHE_WAYS 4
+#define DCNN_SYMMETRIES 8
+
+struct dcnn_cache_entry {
+	hash_t key; // 0 for an empty entry
+	unsigned long stamp; // time of the last use
+	float r[DCNN_PLANE_SIZE];
+};
+
+static struct dcnn_cache_entry *cache;
+static unsigned long cache_buckets, cache_stamp;
+static unsigned long cache_hits, cache_misses;
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static hash_t cache_zobrist[DCNN_PLANES][DCNN_PLANE_SIZE];
+/* Input plane point of each point under each symmetry. */
+static short dcnn_sym[DCNN_SYMMETRIES][DCNN_PLANE_SIZE];
+
+static void
+dcnn_cache_init(int entries)
+{
+	cache_buckets = entries / DCNN_CACHE_WAYS;
+	if (!cache_buckets)
 		return;
-	
-	setenv("GLOG_minloglevel", "2", 1);
-	execvp(argv[0], argv);   /* Sucks that we have to do this */
+	cache = (struct dcnn_cache_entry *) calloc2(cache_buckets * DCNN_CACHE_WAYS, sizeof(*cache));
+	mem_account(MEM_DCNN, cache_buckets * DCNN_CACHE_WAYS * sizeof(*cache));
+
+	/* splitmix64, the hashes don't need to match the board ones. */
+	hash_t seed = 0x9e3779b97f4a7c15ULL;
+	for (int i = 0; i < DCNN_PLANES; i++)
+		for (int p = 0; p < DCNN_PLANE_SIZE; p++) {
+			hash_t z = (seed += 0x9e3779b97f4a7c15ULL);
+			z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+			z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+			cache_zobrist[i][p] = z ^ (z >> 31);
+		}
+	/* Bit 0 flips x, bit 1 flips y, bit 2 swaps them. */
+	for (int s = 0; s < DCNN_SYMMETRIES; s++)
+		for (int x = 0; x < DCNN_SIZE; x++)
+			for (int y = 0; y < DCNN_SIZE; y++) {
+				int x2 = s & 1 ? DCNN_SIZE - 1 - x : x;
+				int y2 = s & 2 ? DCNN_SIZE - 1 - y : y;
+				if (s & 4) { int t = x2; x2 = y2; y2 = t; }
+				dcnn_sym[s][DCNN_SIZE * x + y] = DCNN_SIZE * x2 + y2;
+			}
 }
 
-void
-dcnn_init()
+/* Canonical key of the encoded position @data, and the symmetry
+ * mapping it to the canonical orientation in @sym. */
+static hash_t
+dcnn_cache_key(float *data, int *sym)
+{
+	/* All the planes are 0/1 and sparse. */
+	short plane[DCNN_PLANES * DCNN_PLANE_SIZE], point[DCNN_PLANES * DCNN_PLANE_SIZE];
+	int n = 0;
+	for (int i = 0; i < DCNN_PLANES; i++)
+		for (int p = 0; p < DCNN_PLANE_SIZE; p++)
+			if (data[i * DCNN_PLANE_SIZE + p]) {
+				plane[n] = i;
+				point[n++] = p;
+			}
+
+	hash_t best = 0;
+	for (int s = 0; s < DCNN_SYMMETRIES; s++) {
+		hash_t h = 0;
+		for (int j = 0; j < n; j++)
+			h ^= cache_zobrist[plane[j]][dcnn_sym[s][point[j]]];
+		if (!h) h = 1;
+		if (!s || h < best) {
+			best = h;
+			*sym = s;
+		}
+	}
+	return best;
+}
+
+static bool
+dcnn_cache_get(hash_t key, int sym, float *result)
+{
+	bool hit = false;
+	pthread_mutex_lock(&cache_mutex);
+	struct dcnn_cache_entry *e = &cache[key % cache_buckets * DCNN_CACHE_WAYS];
+	for (int w = 0; w < DCNN_CACHE_WAYS; w++)
+		if (e[w].key == key) {
+			e[w].stamp = ++cache_stamp;
+			for (int p = 0; p < DCNN_PLANE_SIZE; p++)
+				result[p] = e[w].r[dcnn_sym[sym][p]];
+			hit = true;
+			break;
+		}
+	if (hit) cache_hits++; else cache_misses++;
+	pthread_mutex_unlock(&cache_mutex);
+	return hit;
+}
+
+static void
+dcnn_cache_put(hash_t key, int sym, float *result)
 {
-	if (net)
+	pthread_mutex_lock(&cache_mutex);
+	struct dcnn_cache_entry *e = &cache[key % cache_buckets * DCNN_CACHE_WAYS];
+	int victim = 0;
+	for (int w = 0; w < DCNN_CACHE_WAYS; w++) {
+		if (e[w].key == key) {
+			/* Evaluated meanwhile by another thread. */
+			victim = w;
+			break;
+		}
+		if (e[w].stamp < e[victim].stamp)
+			victim = w;
+	}
+	e[victim].key = key;
+	e[victim].stamp = ++cache_stamp;
+	for (int p = 0; p < DCNN_PLANE_SIZE; p++)
+		e[victim].r[dcnn_sym[sym][p]] = result[p];
+	pthread_mutex_unlock(&cache_mutex);
+}
+
+/* Board coordinate of each input plane point, for 19x19 boards
+ * (board_size() 21 with the border). */
+static coord_t dcnn_coords[DCNN_PLANE_SIZE];
+
+static void
+dcnn_init_coords(void)
+{
+	if (dcnn_coords[0])
 		return;
+	int stride = DCNN_SIZE + 2;
+	for (int j = 0; j < DCNN_SIZE; j++)
+		for (int k = 0; k < DCNN_SIZE; k++)
+			dcnn_coords[DCNN_SIZE * j + k] = (j + 1) + (k + 1) * stride;
+}
+
+int
+dcnn_instances(void)
+{
+	return instances_n;
+}
 
-	struct stat s;	
-	const char *model_file =   "golast19.prototxt";
-	const char *trained_file = "golast.trained";
-	if (stat(model_file, &s) != 0  ||  stat(trained_file, &s) != 0) {
-		if (DEBUGL(1))
-			fprintf(stderr, "No dcnn files found, will not use dcnn code.\n");
+/* Take the idle instance of the least loaded device for @n positions,
+ * waiting if all instances are busy. */
+static struct dcnn_instance *
+dcnn_instance_get(int n)
+{
+	pthread_mutex_lock(&sched_mutex);
+	struct dcnn_instance *best;
+	while (true) {
+		best = NULL;
+		for (int i = 0; i < instances_n; i++) {
+			struct dcnn_instance *in = &instances[i];
+			if (!in->busy && (!best || device_load[in->device] < device_load[best->device]))
+				best = in;
+		}
+		if (best) break;
+		pthread_cond_wait(&sched_cond, &sched_mutex);
+	}
+	best->busy = true;
+	device_load[best->device] += n;
+	pthread_mutex_unlock(&sched_mutex);
+	return best;
+}
+
+static void
+dcnn_instance_put(struct dcnn_instance *in, int n)
+{
+	pthread_mutex_lock(&sched_mutex);
+	in->busy = false;
+	device_load[in->device] -= n;
+	pthread_cond_signal(&sched_cond);
+	pthread_mutex_unlock(&sched_mutex);
+}
+
+void
+dcnn_init(struct dcnn_setup *setup)
+{
+	if (backend)
 		return;
+
+	const char *backend_name = setup->backend;
+	enum dcnn_precision precision = setup->precision;
+	if (!backend_name)
+		backend_name = backends[0]->name;
+	struct dcnn_backend *be = NULL;
+	for (unsigned int i = 0; i < sizeof(backends) / sizeof(backends[0]); i++)
+		if (!strcasecmp(backend_name, backends[i]->name))
+			be = backends[i];
+	if (!be) {
+		fprintf(stderr, "dcnn: Unknown or not compiled in backend %s\n", backend_name);
+		exit(1);
 	}
-	
-	Caffe::set_mode(Caffe::CPU);       
-	
-	/* Load the network. */
-	net.reset(new Net<float>(model_file, TEST));
-	net->CopyTrainedLayersFrom(trained_file);
-	
+	if (!(be->precisions & (1 << precision))) {
+		fprintf(stderr, "dcnn: Backend %s does not support %s\n", be->name, precision_names[precision]);
+		exit(1);
+	}
+
+	if (setup->devices < 1 || setup->streams < 1
+	    || setup->devices * setup->streams > DCNN_MAX_INSTANCES) {
+		fprintf(stderr, "dcnn: devices x streams must be 1 to %d\n", DCNN_MAX_INSTANCES);
+		exit(1);
+	}
+
+	/* Interleaved, the first instances of each device come first. */
+	for (int s = 0; s < setup->streams; s++)
+		for (int d = 0; d < setup->devices; d++) {
+			void *net = be->init(precision, d);
+			if (!net) {
+				if (DEBUGL(1))
+					fprintf(stderr, "No dcnn files found, will not use dcnn code.\n");
+				return;
+			}
+			instances[instances_n].net = net;
+			instances[instances_n++].device = d;
+		}
+	dcnn_init_coords();
+	dcnn_cache_init(setup->cache_size);
+	backend = be;
+
 	if (DEBUGL(1))
-		fprintf(stderr, "Initialized dcnn.\n");
+		fprintf(stderr, "Initialized dcnn (%s, %s, %d devices x %d streams, cache %lu).\n",
+			be->name, precision_names[precision], setup->devices, setup->streams,
+			cache_buckets * DCNN_CACHE_WAYS);
 }
 
-void
-dcnn_get_moves(struct board *b, enum stone color, float result[])
+/* Input plane point of board coordinate @c. */
+static inline int
+dcnn_point(struct board *b, coord_t c)
+{
+	return DCNN_SIZE * (coord_x(c, b) - 1) + (coord_y(c, b) - 1);
+}
+
+/* Fill the 13 input planes for board @b into @data. */
+static void
+dcnn_encode(struct board *b, enum stone color, float *data)
 {
 	assert(real_board_size(b) == 19);
 
-	int size = 19;
-	int dsize = 13 * size * size;
-	float *data = new float[dsize];
-	for (int i = 0; i < dsize; i++) 
-		data[i] = 0.0;
-
-	for (int j = 0; j < size; j++) {
-		for(int k = 0; k < size; k++) {
-			int p = size * j + k;
-			coord_t c = coord_xy(b, j+1, k+1);
-			group_t g = group_at(b, c);
-			enum stone bc = board_at(b, c);
-			int libs = board_group_info(b, g).libs - 1;
-			if (libs > 3) libs = 3;
-			if (bc == S_NONE) 
-				data[8*size*size + p] = 1.0;
-			else if (bc == color)
-				data[(0+libs)*size*size + p] = 1.0;
-			else if (bc == stone_other(color))
-				data[(4+libs)*size*size + p] = 1.0;
-			
-			if (c == b->last_move.coord)
-				data[9*size*size + p] = 1.0;
-			else if (c == b->last_move2.coord)
-				data[10*size*size + p] = 1.0;
-			else if (c == b->last_move3.coord)
-				data[11*size*size + p] = 1.0;
-			else if (c == b->last_move4.coord)
-				data[12*size*size + p] = 1.0;
-			
+	memset(data, 0, DCNN_PLANES * DCNN_PLANE_SIZE * sizeof(*data));
+
+	/* Stone planes: 0-3 own stones by liberties, 4-7 opponent
+	 * stones by liberties, 8 empty. */
+	enum stone other = stone_other(color);
+	for (int p = 0; p < DCNN_PLANE_SIZE; p++) {
+		coord_t c = dcnn_coords[p];
+		enum stone bc = board_at(b, c);
+#ifdef BOARD_DCNN_PLANES
+		/* History planes 9-12 by age, most recent move in 9;
+		 * a pass takes an age too. */
+		int age = b->dcnn_ply - b->dcnn_age[c];
+		if (b->dcnn_age[c] && age < 4)
+			data[(9 + age) * DCNN_PLANE_SIZE + p] = 1.0;
+#endif
+		if (bc == S_NONE) {
+			data[8 * DCNN_PLANE_SIZE + p] = 1.0;
+			continue;
 		}
+#ifdef BOARD_DCNN_PLANES
+		int libs = b->dcnn_libs[c] - 1;
+#else
+		int libs = board_group_info(b, group_at(b, c)).libs - 1;
+		if (libs > 3) libs = 3;
+#endif
+		int plane = (bc == other ? 4 : 0) + libs;
+		data[plane * DCNN_PLANE_SIZE + p] = 1.0;
 	}
 
-	Blob<float> *blob = new Blob<float>(1,13,size,size);
-	blob->set_cpu_data(data);
-	vector<Blob<float>*> bottom;
-	bottom.push_back(blob);
-	assert(net);
-	const vector<Blob<float>*>& rr = net->Forward(bottom);
-	
-	for (int i = 0; i < size * size; i++) {
-		result[i] = rr[0]->cpu_data()[i];
-		if (result[i] < 0.00001)
-			result[i] = 0.00001;
+#ifndef BOARD_DCNN_PLANES
+	/* History planes 9-12: last four moves, most recent wins. */
+	coord_t last[4] = { b->last_move4.coord, b->last_move3.coord,
+			    b->last_move2.coord, b->last_move.coord };
+	for (int i = 0; i < 4; i++) {
+		if (is_pass(last[i]) || is_resign(last[i]))
+			continue;
+		int p = dcnn_point(b, last[i]);
+		for (int h = 9; h <= 12; h++)
+			data[h * DCNN_PLANE_SIZE + p] = 0.0;
+		data[(12 - i) * DCNN_PLANE_SIZE + p] = 1.0;
 	}
-	delete[] data;
-	delete blob;
+#endif
+}
+
+void
+dcnn_get_moves_batch(struct board **b, enum stone *color, float **result, int n)
+{
+	assert(n > 0 && n <= DCNN_MAX_BATCH);
+	assert(backend);
+
+	/* Only the positions missing from the cache are evaluated. */
+	int miss[DCNN_MAX_BATCH], misses = 0;
+	hash_t keys[DCNN_MAX_BATCH];
+	int syms[DCNN_MAX_BATCH];
+	for (int k = 0; k < n; k++) {
+		if (cache) {
+			float data[DCNN_PLANES * DCNN_PLANE_SIZE];
+			dcnn_encode(b[k], color[k], data);
+			keys[k] = dcnn_cache_key(data, &syms[k]);
+			if (dcnn_cache_get(keys[k], syms[k], result[k]))
+				continue;
+		}
+		miss[misses++] = k;
+	}
+	if (!misses)
+		return;
+
+	struct dcnn_instance *in = dcnn_instance_get(misses);
+	float *data = backend->input(in->net, misses);
+	for (int m = 0; m < misses; m++)
+		dcnn_encode(b[miss[m]], color[miss[m]], data + m * DCNN_PLANES * DCNN_PLANE_SIZE);
+
+	const float *outputs = backend->forward(in->net, misses);
+
+	for (int m = 0; m < misses; m++) {
+		const float *out = outputs + m * DCNN_PLANE_SIZE;
+		float *r = result[miss[m]];
+		for (int i = 0; i < DCNN_PLANE_SIZE; i++)
+			r[i] = out[i] < 0.00001 ? 0.00001 : out[i];
+	}
+	dcnn_instance_put(in, misses);
+
+	if (cache)
+		for (int m = 0; m < misses; m++)
+			dcnn_cache_put(keys[miss[m]], syms[miss[m]], result[miss[m]]);
+}
+
+void
+dcnn_get_moves(struct board *b, enum stone color, float result[])
+{
+	dcnn_get_moves_batch(&b, &color, &result, 1);
 }
 
 void
@@ -172,8 +449,41 @@ dcnn_genmove(struct engine *e, struct board *b, struct time_info *ti, enum stone
 struct engine *
 engine_dcnn_init(char *arg, struct board *b)
 {
-	dcnn_init();
-	if (!net) {
+	struct dcnn_setup setup = DCNN_SETUP_DEFAULT;
+	if (arg) {
+		char *optspec, *next = arg;
+		while (*next) {
+			optspec = next;
+			next += strcspn(next, ",");
+			if (*next) { *next++ = 0; } else { *next = 0; }
+
+			char *optname = optspec;
+			char *optval = strchr(optspec, '=');
+			if (optval) *optval++ = 0;
+
+			if (!strcasecmp(optname, "backend") && optval) {
+				/* See the uct dcnn_backend option. */
+				setup.backend = optval;
+			} else if (!strcasecmp(optname, "precision") && optval
+				   && dcnn_parse_precision(optval, &setup.precision)) {
+				/* fp32, fp16 or int8 */
+			} else if (!strcasecmp(optname, "cache") && optval) {
+				/* See the uct dcnn_cache option. */
+				setup.cache_size = atoi(optval);
+			} else if (!strcasecmp(optname, "devices") && optval) {
+				/* See the uct dcnn_devices option. */
+				setup.devices = atoi(optval);
+			} else if (!strcasecmp(optname, "streams") && optval) {
+				/* See the uct dcnn_streams option. */
+				setup.streams = atoi(optval);
+			} else {
+				fprintf(stderr, "dcnn: Invalid engine argument %s or missing value\n", optname);
+				exit(1);
+			}
+		}
+	}
+	dcnn_init(&setup);
+	if (!backend) {
 		fprintf(stderr, "Couldn't initialize dcnn, aborting.\n");
 		abort();
 	}
@@ -7,14 +7,50 @@ extern "C" {
 #endif
 
 
+/* Positions whose dcnn results are cached by default. */
+#define DCNN_CACHE_DEFAULT 4096
+
+/* Precision the network is evaluated at, if the backend supports it. */
+enum dcnn_precision {
+	DCNN_FP32,
+	DCNN_FP16,
+	DCNN_INT8,
+	DCNN_PRECISIONS,
+};
+
+/* How to run the network, see dcnn_init(). */
+struct dcnn_setup {
+	char *backend; // NULL for the default, caffe
+	enum dcnn_precision precision;
+	int cache_size; // positions whose results are cached
+	int devices; // gpus (or cpu copies of the network without gpu support)
+	int streams; // networks evaluated concurrently on each device
+};
+
+#define DCNN_SETUP_DEFAULT { NULL, DCNN_FP32, DCNN_CACHE_DEFAULT, 1, 1 }
+
 #ifdef DCNN
 
+struct board;
+struct tree_node;
+
 #define DCNN_BEST_N 5
 
+/* Maximum number of positions evaluated in one dcnn_get_moves_batch() call. */
+#define DCNN_MAX_BATCH 64
+
 void dcnn_get_moves(struct board *b, enum stone color, float result[]);
+/* Evaluate @n positions with a single forward pass.
+ * result[i] receives the 19x19 move probabilities for b[i]. */
+void dcnn_get_moves_batch(struct board **b, enum stone *color, float **result, int n);
 bool using_dcnn(struct board *b);
 void dcnn_quiet_caffe(int argc, char *argv[]);
-void dcnn_init();
+/* Load devices x streams instances of the network with the given
+ * backend. Does nothing if the network files are missing. */
+void dcnn_init(struct dcnn_setup *setup);
+/* Number of network instances, the batches that can be evaluated
+ * concurrently. */
+int dcnn_instances(void);
 void find_dcnn_best_moves(struct board *b, float *r, coord_t *best, float *best_r);
 void print_dcnn_best_moves(struct tree_node *node, struct board *b, coord_t *best, float *best_r);
 struct engine *engine_dcnn_init(char *arg, struct board *b);
@@ -23,7 +59,7 @@ struct engine *engine_dcnn_init(char *arg, struct board *b);
 
 #define using_dcnn(b)  0
 #define dcnn_quiet_caffe(argc, argv) 
-#define dcnn_init() 
+#define dcnn_init(setup) 
 
 #endif
 
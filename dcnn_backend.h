@@ -0,0 +1,36 @@
+#ifndef PACHI_DCNN_BACKEND_H
+#define PACHI_DCNN_BACKEND_H
+
+/* Inference backends of the dcnn. dcnn.cpp encodes the positions and
+ * post-processes the move probabilities; a backend only loads the
+ * network and runs the forward pass. There may be several instances
+ * of the network, each used by a single thread at a time. Backends
+ * built with DCNN_GPU run on the gpus. */
+
+#include "dcnn.h"
+
+#define DCNN_SIZE 19
+#define DCNN_PLANES 13
+#define DCNN_PLANE_SIZE (DCNN_SIZE * DCNN_SIZE)
+
+struct dcnn_backend {
+	const char *name;
+	/* Supported precisions, bit (1 << enum dcnn_precision). */
+	unsigned int precisions;
+	/* Load an instance of the network on gpu @device (ignored by cpu
+	 * only builds). Returns NULL if its files are not found. */
+	void *(*init)(enum dcnn_precision precision, int device);
+	/* Input buffer for @n positions of DCNN_PLANES x DCNN_PLANE_SIZE
+	 * floats each, valid until the next forward(). */
+	float *(*input)(void *net, int n);
+	/* Evaluate the @n positions of the input buffer, returning
+	 * DCNN_PLANE_SIZE move probabilities per position. */
+	const float *(*forward)(void *net, int n);
+};
+
+extern struct dcnn_backend dcnn_backend_caffe;
+#ifdef DCNN_ONNX
+extern struct dcnn_backend dcnn_backend_onnx;
+#endif
+
+#endif
@@ -0,0 +1,97 @@
+/* Caffe dcnn backend, see dcnn_backend.h. */
+
+#define DEBUG
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifndef DCNN_GPU
+#define CPU_ONLY 1
+#endif
+#include <caffe/caffe.hpp>
+using namespace caffe;
+
+extern "C" {
+#include "debug.h"
+#include "board.h"
+#include "dcnn_backend.h"
+
+
+struct caffe_net {
+	shared_ptr<Net<float> > net;
+	int device;
+};
+
+/* Make caffe quiet */
+void
+dcnn_quiet_caffe(int argc, char *argv[])
+{
+	if (DEBUGL(7) || getenv("GLOG_minloglevel"))
+		return;
+
+	setenv("GLOG_minloglevel", "2", 1);
+	execvp(argv[0], argv);   /* Sucks that we have to do this */
+}
+
+/* The caffe mode and device are per thread, and any thread
+ * may evaluate any instance. */
+static void
+caffe_set_device(int device)
+{
+#ifdef DCNN_GPU
+	Caffe::set_mode(Caffe::GPU);
+	Caffe::SetDevice(device);
+#else
+	Caffe::set_mode(Caffe::CPU);
+#endif
+}
+
+static void *
+caffe_init(enum dcnn_precision precision, int device)
+{
+	struct stat s;
+	const char *model_file =   "golast19.prototxt";
+	const char *trained_file = "golast.trained";
+	if (stat(model_file, &s) != 0  ||  stat(trained_file, &s) != 0)
+		return NULL;
+
+	caffe_set_device(device);
+
+	/* Load the network. */
+	struct caffe_net *cn = new caffe_net;
+	cn->device = device;
+	cn->net.reset(new Net<float>(model_file, TEST));
+	cn->net->CopyTrainedLayersFrom(trained_file);
+	return cn;
+}
+
+/* Encode straight into the network input blob, which is kept
+ * across calls and only reshaped when the batch size changes. */
+static float *
+caffe_input(void *data, int n)
+{
+	struct caffe_net *cn = (struct caffe_net *) data;
+	shared_ptr<Net<float> > &net = cn->net;
+	Blob<float> *input = net->input_blobs()[0];
+	if (input->num() != n) {
+		input->Reshape(n, DCNN_PLANES, DCNN_SIZE, DCNN_SIZE);
+		net->Reshape();
+	}
+	return input->mutable_cpu_data();
+}
+
+static const float *
+caffe_forward(void *data, int n)
+{
+	struct caffe_net *cn = (struct caffe_net *) data;
+	caffe_set_device(cn->device);
+	const vector<Blob<float>*>& rr = cn->net->Forward();
+	return rr[0]->cpu_data();
+}
+
+struct dcnn_backend dcnn_backend_caffe = {
+	"caffe", 1 << DCNN_FP32, caffe_init, caffe_input, caffe_forward,
+};
+
+} /* extern "C" */
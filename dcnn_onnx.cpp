@@ -0,0 +1,92 @@
+/* ONNX Runtime dcnn backend, see dcnn_backend.h. The network is the
+ * caffe one converted to ONNX; the reduced precisions are separately
+ * converted (fp16) or quantized (int8) models, so that any execution
+ * provider ONNX Runtime is built with can run them. */
+
+#define DEBUG
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+
+#include <onnxruntime_cxx_api.h>
+
+extern "C" {
+#include "debug.h"
+#include "board.h"
+#include "dcnn_backend.h"
+
+
+static const char *onnx_model_files[] = {
+	"golast19.onnx", "golast19.fp16.onnx", "golast19.int8.onnx",
+};
+
+static Ort::Env *env;
+
+/* One session per instance; with cuda each session has its own
+ * stream, so the instances of a gpu overlap. */
+struct onnx_net {
+	Ort::Session *session;
+	std::string input_name, output_name;
+	std::vector<float> input;
+	std::vector<Ort::Value> output;
+};
+
+static void *
+onnx_init(enum dcnn_precision precision, int device)
+{
+	struct stat s;
+	const char *model_file = onnx_model_files[precision];
+	if (stat(model_file, &s) != 0)
+		return NULL;
+
+	if (!env)
+		env = new Ort::Env(ORT_LOGGING_LEVEL_WARNING, "pachi");
+	Ort::SessionOptions opts;
+	opts.SetGraphOptimizationLevel(GraphOptimizationLevel::ORT_ENABLE_ALL);
+#ifdef DCNN_GPU
+	OrtCUDAProviderOptions cuda;
+	cuda.device_id = device;
+	opts.AppendExecutionProvider_CUDA(cuda);
+#endif
+	struct onnx_net *on = new onnx_net;
+	on->session = new Ort::Session(*env, model_file, opts);
+
+	Ort::AllocatorWithDefaultOptions allocator;
+	on->input_name = on->session->GetInputNameAllocated(0, allocator).get();
+	on->output_name = on->session->GetOutputNameAllocated(0, allocator).get();
+	on->input.resize(DCNN_MAX_BATCH * DCNN_PLANES * DCNN_PLANE_SIZE);
+	if (DEBUGL(2))
+		fprintf(stderr, "dcnn: onnx model %s on device %d\n", model_file, device);
+	return on;
+}
+
+static float *
+onnx_input(void *data, int n)
+{
+	struct onnx_net *on = (struct onnx_net *) data;
+	return on->input.data();
+}
+
+static const float *
+onnx_forward(void *data, int n)
+{
+	struct onnx_net *on = (struct onnx_net *) data;
+	std::vector<float> &input = on->input;
+	Ort::MemoryInfo mem = Ort::MemoryInfo::CreateCpu(OrtArenaAllocator, OrtMemTypeDefault);
+	int64_t shape[] = { n, DCNN_PLANES, DCNN_SIZE, DCNN_SIZE };
+	Ort::Value in = Ort::Value::CreateTensor<float>(mem, input.data(), n * DCNN_PLANES * DCNN_PLANE_SIZE,
+							 shape, 4);
+	const char *in_names[] = { on->input_name.c_str() };
+	const char *out_names[] = { on->output_name.c_str() };
+	on->output = on->session->Run(Ort::RunOptions{nullptr}, in_names, &in, 1, out_names, 1);
+	return on->output[0].GetTensorData<float>();
+}
+
+struct dcnn_backend dcnn_backend_onnx = {
+	"onnx", 1 << DCNN_FP32 | 1 << DCNN_FP16 | 1 << DCNN_INT8,
+	onnx_init, onnx_input, onnx_forward,
+};
+
+} /* extern "C" */
@@ -28,6 +28,12 @@
  * are merged together, plus one hash table per slave. The master
  * queue and the hash tables are cleared at each new move. */
 
+/* Once stats are exchanged, the genmoves command is streamed: each
+ * slave gets it again as soon as it has replied, with the stats
+ * merged since its last reply, and replies at most every stats_delay.
+ * The master main thread only updates the command from time to time
+ * (played count, time left), so the slaves never wait for it. */
+
 /* To allow the master to select the best move, slaves also send
  * absolute playout counts for the best top level nodes (children
  * of the root node), including contributions from other slaves.
@@ -40,13 +46,26 @@
 /* The master-slave protocol has fault tolerance. If a slave is
  * out of sync, the master sends it the appropriate command history. */
 
+/* Past a few dozen slaves the master network link and its merges
+ * become the bottleneck, so the slaves can be grouped behind relays.
+ * A relay is a distributed engine which is also a slave of the top
+ * master: it forwards the gtp commands to its own slaves, and answers
+ * pachi-genmoves like a slave, with the root children stats averaged
+ * over its slaves and one merged buffer of their incremental stats.
+ * The stats from the top master are inserted in the receive queue of
+ * the relay as if they came from one more slave, so each slave gets
+ * the stats from the rest of the cluster with the existing merges. */
+
 /* Pass me arguments like a=b,c=d,...
  * Supported arguments:
  * slave_port=SLAVE_PORT     slaves connect to this port; this parameter is mandatory.
  * max_slaves=MAX_SLAVES     default 24
+ * io_threads=IO_THREADS     default 4, threads serving the slave connections
+ * merge_threads=THREADS     default 4, max threads merging stats for one slave
  * shared_nodes=SHARED_NODES default 10K
  * stats_hbits=STATS_HBITS   default 21. 2^stats_bits = hash table size
  * slaves_quit=0|1           quit gtp command also sent to slaves, default false.
+ * relay                     act as slave of another master (see below).
  * proxy_port=PROXY_PORT     slaves optionally send their logs to this port.
  *    Warning: with proxy_port, the master stderr mixes the logs of all
  *    machines but you can separate them again:
@@ -64,6 +83,10 @@
  * If the master itself runs on a machine other than that running gogui,
  * gogui-twogtp, kgsGtp or cgosGtp, it can redirect its gtp port:
  *    pachi -e distributed -g 10000 slave_port=1234,proxy_port=1235
+ * A relay for a rack of slaves runs as:
+ *    pachi -e distributed -g masterhost:1234 slave_port=1236,relay
+ * with the slaves of the rack connecting to relayhost:1236. The
+ * shared_nodes value must be the same everywhere.
  */
 
 #include <assert.h>
@@ -84,6 +107,7 @@
 #include "mq.h"
 #include "debug.h"
 #include "chat.h"
+#include "gtp.h"
 #include "distributed/distributed.h"
 #include "distributed/merge.h"
 
@@ -92,9 +116,14 @@ struct distributed {
 	char *slave_port;
 	char *proxy_port;
 	int max_slaves;
+	int io_threads;
+	int merge_threads;
 	int shared_nodes;
 	int stats_hbits;
 	bool slaves_quit;
+	bool relay;
+	/* Relay: a genmoves search is running at this move. */
+	bool searching;
 	struct move my_last_move;
 	struct move_stats my_last_stats;
 	int slaves;
@@ -158,6 +187,20 @@ distributed_notify(struct engine *e, struct board *b, int id, char *cmd, char *a
 {
 	struct distributed *dist = e->data;
 
+	if (dist->relay) {
+		/* Any command ends the genmoves of the move. */
+		dist->searching = false;
+
+		/* Let the upstream master resend the history if we are
+		 * out of sync (see uct/slave.c:uct_notify()). */
+		if (move_number(id) != b->moves && !reply_disabled(id) && !is_reset(cmd)) {
+			static char buf[128];
+			snprintf(buf, sizeof(buf), "Out of sync, %d %s, move %d expected", id, cmd, b->moves);
+			*reply = buf;
+			return P_DONE_ERROR;
+		}
+	}
+
 	/* Commands that should not be sent to slaves.
 	 * time_left will be part of next pachi-genmoves,
 	 * we reduce latency by not forwarding it here. */
@@ -189,6 +232,9 @@ distributed_notify(struct engine *e, struct board *b, int id, char *cmd, char *a
 
 	protocol_unlock();
 
+	/* The history replayed by the upstream master gets no reply. */
+	if (dist->relay && reply_disabled(id)) return P_NOREPLY;
+
 	// At the beginning wait even more for late slaves.
 	if (b->moves == 0) sleep(1);
 	return P_OK;
@@ -401,6 +447,82 @@ distributed_genmove(struct engine *e, struct board *b, struct time_info *ti,
 	return coord_copy(best);
 }
 
+/* Relay genmoves, called repeatedly by the upstream master. The first
+ * call of a move starts the genmoves of the slaves; each call then
+ * forwards the stats of the upstream master, waits for a slave reply
+ * and reports like a slave, see uct/slave.c:uct_genmoves(). */
+static char *
+distributed_genmoves(struct engine *e, struct board *b, struct time_info *ti, enum stone color,
+		     char *args, bool pass_all_alive, void **stats_buf, int *stats_size)
+{
+	struct distributed *dist = e->data;
+	char *cmd = pass_all_alive ? "pachi-genmoves_cleanup" : "pachi-genmoves";
+
+	int played;
+	if ((ti->dim == TD_WALLTIME
+	     && sscanf(args, "%d %lf %lf %d %d", &played,
+		       &ti->len.t.main_time, &ti->len.t.byoyomi_time,
+		       &ti->len.t.byoyomi_periods, &ti->len.t.byoyomi_stones) != 5)
+
+	    || (ti->dim == TD_GAMES && sscanf(args, "%d", &played) != 1)) {
+		return NULL;
+	}
+
+	/* Read the stats of the upstream master before taking the lock. */
+	static unsigned char *wire = NULL;
+	int max_size = (dist->shared_nodes + 1) * sizeof(struct incr_stats);
+	if (!wire) wire = malloc2(max_size);
+	int size = 0;
+	char *sizep = strchr(args, '@');
+	if (sizep) size = atoi(sizep + 1);
+	if (size > max_size || fread(wire, 1, size, stdin) != (size_t)size)
+		return NULL;
+
+	protocol_lock();
+
+	char cmd_args[CMDS_SIZE];
+	if (!dist->searching) {
+		/* Send the first genmoves without stats. */
+		clear_receive_queue();
+		genmoves_args(cmd_args, color, played, ti, false);
+		new_cmd(b, cmd, cmd_args);
+		dist->searching = true;
+	} else {
+		genmoves_args(cmd_args, color, played, ti, true);
+		update_cmd(b, cmd, cmd_args, false);
+	}
+	if (size && !upstream_insert_stats(wire, size)) {
+		protocol_unlock();
+		return NULL;
+	}
+
+	get_replies(time_now() + MAX_GENMOVES_WAIT, 1);
+
+	struct large_stats stats_array[board_size2(b) + 2], *stats;
+	stats = &stats_array[2];
+	int played_own, playouts, threads;
+	bool keep_looking;
+	select_best_move(b, stats, &played_own, &playouts, &threads, &keep_looking);
+	int replies = reply_count;
+
+	*stats_buf = upstream_get_stats(stats_size);
+	protocol_unlock();
+
+	/* Same format as uct/slave.c:report_stats(), the children
+	 * stats being already averaged over the slaves. */
+	static char reply[10240];
+	char *r = reply;
+	char *end = reply + sizeof(reply);
+	r += snprintf(r, end - r, "%d %d %d %d @%d", played_own, playouts / replies,
+		      threads, keep_looking, *stats_size);
+	for (coord_t c = resign; c < board_size2(b); c++) {
+		if (stats[c].playouts <= 0 || r >= end) continue;
+		r += snprintf(r, end - r, "\n%s %ld %.16f", coord2sstr(c, b),
+			      stats[c].playouts, (double)stats[c].value);
+	}
+	return reply;
+}
+
 static char *
 distributed_chat(struct engine *e, struct board *b, bool opponent, char *from, char *cmd)
 {
@@ -459,6 +581,8 @@ distributed_state_init(char *arg, struct board *b)
 
 	dist->stats_hbits = DEFAULT_STATS_HBITS;
 	dist->max_slaves = DEFAULT_MAX_SLAVES;
+	dist->io_threads = DEFAULT_IO_THREADS;
+	dist->merge_threads = DEFAULT_MERGE_THREADS;
 	dist->shared_nodes = DEFAULT_SHARED_NODES;
 	if (arg) {
 		char *optspec, *next = arg;
@@ -477,6 +601,11 @@ distributed_state_init(char *arg, struct board *b)
 				dist->proxy_port = strdup(optval);
 			} else if (!strcasecmp(optname, "max_slaves") && optval) {
 				dist->max_slaves = atoi(optval);
+			} else if (!strcasecmp(optname, "io_threads") && optval) {
+				dist->io_threads = atoi(optval);
+			} else if (!strcasecmp(optname, "merge_threads") && optval) {
+				/* Split large stats merges among at most this many threads. */
+				dist->merge_threads = atoi(optval);
 			} else if (!strcasecmp(optname, "shared_nodes") && optval) {
 				/* Share at most shared_nodes between master and slave at each genmoves.
 				 * Must use the same value in master and slaves. */
@@ -486,6 +615,9 @@ distributed_state_init(char *arg, struct board *b)
 				dist->stats_hbits = atoi(optval);
 			} else if (!strcasecmp(optname, "slaves_quit")) {
 				dist->slaves_quit = !optval || atoi(optval);
+			} else if (!strcasecmp(optname, "relay")) {
+				/* Act as slave of another master, see the top of this file. */
+				dist->relay = !optval || atoi(optval);
 			} else {
 				fprintf(stderr, "distributed: Invalid engine argument %s or missing value\n", optname);
 			}
@@ -499,8 +631,10 @@ distributed_state_init(char *arg, struct board *b)
 		exit(1);
 	}
 
-	merge_init(&default_sstate, dist->shared_nodes, dist->stats_hbits, dist->max_slaves);
-	protocol_init(dist->slave_port, dist->proxy_port, dist->max_slaves);
+	merge_init(&default_sstate, dist->shared_nodes, dist->stats_hbits,
+		   dist->max_slaves, dist->merge_threads);
+	protocol_init(dist->slave_port, dist->proxy_port, dist->max_slaves, dist->io_threads,
+		      dist->relay);
 
 	return dist;
 }
@@ -516,6 +650,8 @@ engine_distributed_init(char *arg, struct board *b)
 		"Anyone can send me 'winrate' in private chat to get my assessment of the position.";
 	e->notify = distributed_notify;
 	e->genmove = distributed_genmove;
+	if (dist->relay)
+		e->genmoves = distributed_genmoves;
 	e->dead_group_list = distributed_dead_group_list;
 	e->chat = distributed_chat;
 	e->data = dist;
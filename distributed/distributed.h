@@ -73,6 +73,16 @@ struct incr_stats {
  * with a 100 MB/s network can thus support at most 24 slaves. */
 #define DEFAULT_MAX_SLAVES 24
 
+/* The master multiplexes the slave connections over a few I/O threads.
+ * One thread is enough for the gtp traffic; more of them let the stats
+ * merges for several slaves run in parallel. */
+#define DEFAULT_IO_THREADS 4
+
+/* A late slave may have to merge up to (max_slaves - 1) * shared_nodes
+ * nodes at once. Large merges are split among a few threads so that
+ * they do not eat into the search time of the slave. */
+#define DEFAULT_MERGE_THREADS 4
+
 /* In a 30s move at 270K nodes/s a slave can send and receive at most
  * 8.1M nodes so at worst 23 bits are needed for the hash table in the
  * slave and for the per-slave hash table in the master. However the
@@ -7,13 +7,17 @@
 #include <assert.h>
 #include <stdio.h>
 #include <limits.h>
+#include <pthread.h>
+#include <string.h>
 
 #define DEBUG
 
 #include "debug.h"
+#include "memstats.h"
 #include "timeinfo.h"
 #include "distributed/distributed.h"
 #include "distributed/merge.h"
+#include "distributed/wire.h"
 
 /* We merge together debug stats for all hash tables. */
 static struct hash_counts h_counts;
@@ -44,8 +48,14 @@ merge_print_stats(int total_hnodes)
  * nodes sent by different slaves so shared_nodes can be lower. */
 #define MAX_BUCKETS 1024
 
+/* Merges of fewer nodes per thread are not worth the thread creation. */
+#define MERGE_THREAD_NODES 4096
+
 /* Update the hash table for the given increment stats,
  * and increment the bucket count. Return the hash index.
+ * Several merge threads may update the hash table at once (see
+ * merge_new_stats()); each of them owns a distinct range of coord
+ * paths, so only the claim of an empty entry needs to be atomic.
  * The slave lock is not held on either entry or exit of this function */
 static inline int
 stats_tally(struct incr_stats *s, struct slave_state *sstate, int *bucket_count)
@@ -53,12 +63,17 @@ stats_tally(struct incr_stats *s, struct slave_state *sstate, int *bucket_count)
 	int h;
 	bool found;
 	struct incr_stats *stats_htable = sstate->stats_htable;
-	find_hash(h, stats_htable, sstate->stats_hbits, s->coord_path, found, h_counts);
-	if (found) {
-		assert(stats_htable[h].incr.playouts > 0);
-		stats_add_result(&stats_htable[h].incr, s->incr.value, s->incr.playouts);
-	} else {
-		stats_htable[h] = *s;
+	do {
+		find_hash(h, stats_htable, sstate->stats_hbits, s->coord_path, found, h_counts);
+		if (found) {
+			assert(stats_htable[h].incr.playouts > 0);
+			stats_add_result(&stats_htable[h].incr, s->incr.value, s->incr.playouts);
+			break;
+		}
+		/* If another thread took the entry, look again. */
+	} while (!__sync_bool_compare_and_swap(&stats_htable[h].coord_path, 0, s->coord_path));
+	if (!found) {
+		stats_htable[h].incr = s->incr;
 		if (DEBUG_MODE) h_counts.inserts++, h_counts.occupied++;
 	}
 
@@ -70,7 +85,8 @@ stats_tally(struct incr_stats *s, struct slave_state *sstate, int *bucket_count)
 
 static struct incr_stats terminator = { .coord_path = INT64_MAX };
 
-/* Initialize the next pointers (see merge_new_stats()).
+/* Initialize the next pointers (see merge_new_stats()) and the
+ * number of nodes of each buffer.
  * Exclude invalid buffers and my own buffers by setting their next pointer
  * to a terminator value. Update min if there are too many nodes to merge,
  * so that merge time remains reasonable and the merge buffer doesn't overflow.
@@ -80,21 +96,24 @@ static struct incr_stats terminator = { .coord_path = INT64_MAX };
  * The slave lock is not held on either entry or exit of this function. */
 static int
 filter_buffers(struct slave_state *sstate, struct incr_stats **next,
-	       int *min, int max)
+	       int *nodes, int *min, int max)
 {
 	int size = 0;
 	int max_size = sstate->max_merged_nodes * sizeof(struct incr_stats);
  
 	for (int q = max; q >= *min; q--) {
-		if (!receive_queue[q] || receive_queue[q]->owner == sstate->thread_id) {
+		struct buf_state *buf = receive_queue[q];
+		if (!buf || buf->owner == sstate->thread_id) {
 			next[q] = &terminator;
-		} else if (size + receive_queue[q]->size > max_size) {
+			nodes[q] = 0;
+		} else if (size + buf->size > max_size) {
 			*min = q + 1;
 			assert(*min <= max);
 			break;
 		} else {
-			next[q] = (struct incr_stats *)receive_queue[q]->buf;
-			size += receive_queue[q]->size;
+			next[q] = (struct incr_stats *)buf->buf;
+			nodes[q] = buf->size / sizeof(struct incr_stats);
+			size += buf->size;
 		}
 	}
 	return size / sizeof(struct incr_stats);
@@ -118,40 +137,39 @@ min_coord(struct incr_stats **next, int min, int max)
 	return min_c;
 }
 
-/* Merge all valid incremental stats in receive_queue[min..max],
- * update the hash table, set the bucket counts, and save the
- * list of updated hash table entries. The input buffers and
- * the output buffer are all sorted by increasing coord path.
- * The input buffers end with a terminator value INT64_MAX.
- * Return the number of updated hash table entries. */
-
-/* The slave lock is not held on either entry or exit of this function,
- * so receive_queue entries may be invalidated while we scan them.
- * The receive queue might grow while we scan it but we ignore
- * entries above max, they will be processed at the next call.
- * This function does not modify the receive queue. */
-static int
-merge_new_stats(struct slave_state *sstate, int min, int max,
-		int *bucket_count, int *nodes_read, int last_queue_age)
+/* One range of coord paths [next[q]->coord_path..end) merged by
+ * merge_range(), possibly in its own thread. */
+struct merge_range {
+	struct slave_state *sstate;
+	struct incr_stats **next;
+	int min, max;
+	path_t end;
+	int last_queue_age;
+
+	/* Output: updated hash table entries, bucket counts. */
+	int *merged;
+	int max_merged;
+	int merge_count;
+	bool aborted;
+	int bucket_count[MAX_BUCKETS];
+};
+
+/* Do N-way merge of the range, processing one coord path per iteration.
+ * If the minimum coord is >= end, either all buffers are invalidated,
+ * or at least one is valid and we are at the end of the range in all
+ * valid buffers. In both cases we're done. */
+static void *
+merge_range(void *arg)
 {
-	*nodes_read = 0;
-	if (max < min) return 0;
-
-	/* next[q] is the next value to be checked in receive_queue[q]->buf */
-	struct incr_stats *next_[max - min + 1];
-	struct incr_stats **next = next_ - min;
-	*nodes_read = filter_buffers(sstate, next, &min, max);
+	struct merge_range *r = arg;
+	struct incr_stats **next = r->next;
+	int min = r->min, max = r->max;
 
 	/* prev_min_c is only used for debugging. */
 	path_t prev_min_c = 0;
 
-	/* Do N-way merge, processing one coord path per iteration.
-	 * If the minimum coord is INT64_MAX, either all buffers are
-	 * invalidated, or at least one is valid and we are at the
-	 * end of all valid buffers. In both cases we're done. */
-	int merge_count = 0;
 	path_t min_c;
-	while ((min_c = min_coord(next, min, max)) != INT64_MAX) {
+	while ((min_c = min_coord(next, min, max)) < r->end) {
 
 		struct incr_stats sum = { .coord_path = min_c,
 					  .incr = { .playouts = 0, .value = 0.0 }};
@@ -174,7 +192,10 @@ merge_new_stats(struct slave_state *sstate, int min, int max,
 
 			/* Stop if we have a new move. If queue_age is incremented
 			 * after this check, the merged output will be discarded. */
-			if (unlikely(queue_age > last_queue_age)) return 0;
+			if (unlikely(queue_age > r->last_queue_age)) {
+				r->aborted = true;
+				return NULL;
+			}
 
 			/* s.coord_path is valid here, so min_c is valid too.
 			 * (An invalid min_c would be < s.coord_path.) */
@@ -195,8 +216,140 @@ merge_new_stats(struct slave_state *sstate, int min, int max,
 
 		/* At this point sum contains only valid increments,
 		 * so we can add it to the hash table. */
-		assert(merge_count < sstate->max_merged_nodes);
-		sstate->merged[merge_count++] = stats_tally(&sum, sstate, bucket_count);
+		assert(r->merge_count < r->max_merged);
+		r->merged[r->merge_count++] = stats_tally(&sum, r->sstate, r->bucket_count);
+	}
+	return NULL;
+}
+
+/* Return the index of the first node >= path in buf[lo..hi). */
+static int
+lower_bound(struct incr_stats *buf, int lo, int hi, path_t path)
+{
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (buf[mid].coord_path < path)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Split the coord paths in at most sstate->merge_threads ranges of
+ * similar sizes, using the largest buffer as a sample. Set ends[]
+ * to the exclusive end of each range and return the number of ranges. */
+static int
+split_ranges(struct slave_state *sstate, struct incr_stats **next, int *nodes,
+	     int min, int max, int nodes_read, path_t *ends)
+{
+	int ranges = sstate->merge_threads;
+	if (ranges > nodes_read / MERGE_THREAD_NODES)
+		ranges = nodes_read / MERGE_THREAD_NODES;
+
+	int largest = min;
+	for (int q = min + 1; q <= max; q++)
+		if (nodes[q] > nodes[largest]) largest = q;
+	if (ranges > nodes[largest]) ranges = nodes[largest];
+	if (ranges <= 1) {
+		ends[0] = INT64_MAX;
+		return 1;
+	}
+
+	/* The sample is strictly increasing unless the buffer has been
+	 * invalidated. In that case just merge sequentially. */
+	for (int i = 1; i < ranges; i++) {
+		ends[i - 1] = next[largest][i * nodes[largest] / ranges].coord_path;
+		if (i > 1 && ends[i - 1] <= ends[i - 2]) {
+			ends[0] = INT64_MAX;
+			return 1;
+		}
+	}
+	ends[ranges - 1] = INT64_MAX;
+	return ranges;
+}
+
+/* Merge all valid incremental stats in receive_queue[min..max],
+ * update the hash table, set the bucket counts, and save the
+ * list of updated hash table entries. The input buffers and
+ * the output buffer are all sorted by increasing coord path.
+ * The input buffers end with a terminator value INT64_MAX.
+ * Return the number of updated hash table entries. */
+
+/* Large merges are split in ranges of coord paths merged by separate
+ * threads. Since all buffers are sorted the start of each range in
+ * each buffer is found by binary search, and the concatenation of the
+ * outputs of all ranges is still sorted. */
+
+/* The slave lock is not held on either entry or exit of this function,
+ * so receive_queue entries may be invalidated while we scan them.
+ * The receive queue might grow while we scan it but we ignore
+ * entries above max, they will be processed at the next call.
+ * This function does not modify the receive queue. */
+static int
+merge_new_stats(struct slave_state *sstate, int min, int max,
+		int *bucket_count, int *nodes_read, int last_queue_age)
+{
+	*nodes_read = 0;
+	if (max < min) return 0;
+
+	/* next[q] is the next value to be checked in receive_queue[q]->buf */
+	struct incr_stats *next_[max - min + 1];
+	struct incr_stats **next = next_ - min;
+	int nodes_[max - min + 1];
+	int *nodes = nodes_ - min;
+	*nodes_read = filter_buffers(sstate, next, nodes, &min, max);
+
+	path_t ends[sstate->merge_threads];
+	int ranges = split_ranges(sstate, next, nodes, min, max, *nodes_read, ends);
+
+	struct merge_range r[ranges];
+	memset(r, 0, sizeof(r));
+	struct incr_stats *range_next[ranges][max - min + 1];
+	int start[max - min + 1];
+	memset(start, 0, sizeof(start));
+	int *merged = sstate->merged;
+	for (int i = 0; i < ranges; i++) {
+		r[i].sstate = sstate;
+		r[i].next = range_next[i] - min;
+		r[i].min = min;
+		r[i].max = max;
+		r[i].end = ends[i];
+		r[i].last_queue_age = last_queue_age;
+		r[i].merged = merged;
+
+		/* The range can produce at most one output
+		 * per input node in it. */
+		for (int q = min; q <= max; q++) {
+			int end = i < ranges - 1
+				? lower_bound(next[q], start[q - min], nodes[q], ends[i])
+				: nodes[q];
+			r[i].next[q] = next[q] + start[q - min];
+			r[i].max_merged += end - start[q - min];
+			start[q - min] = end;
+		}
+		merged += r[i].max_merged;
+	}
+
+	pthread_t threads[ranges];
+	for (int i = 1; i < ranges; i++)
+		pthread_create(&threads[i], NULL, merge_range, &r[i]);
+	merge_range(&r[0]);
+	for (int i = 1; i < ranges; i++)
+		pthread_join(threads[i], NULL);
+
+	/* Gather the outputs at the start of sstate->merged. */
+	int merge_count = 0;
+	for (int i = 0; i < ranges; i++) {
+		if (r[i].aborted) {
+			merge_count = 0;
+			break;
+		}
+		memmove(sstate->merged + merge_count, r[i].merged,
+			r[i].merge_count * sizeof(int));
+		merge_count += r[i].merge_count;
+		for (int b = 0; b < MAX_BUCKETS; b++)
+			bucket_count[b] += r[i].bucket_count[b];
 	}
 	return merge_count;
 }
@@ -246,12 +399,12 @@ output_stats(struct incr_stats *buf, struct slave_state *sstate,
 }
 
 /* Get all incremental stats received from other slaves since the
- * last send. Store in buf the stats with largest playout increments.
- * Return the byte size of the resulting buffer. The caller must
- * check that the result is still valid.
+ * last send. Store in buf the stats with largest playout increments,
+ * in wire format. Return the byte size of the resulting buffer.
+ * The caller must check that the result is still valid.
  * The slave lock is held on both entry and exit of this function. */
 static int
-get_new_stats(struct incr_stats *buf, struct slave_state *sstate, int cmd_id)
+get_new_stats(unsigned char *buf, struct slave_state *sstate, int cmd_id)
 {
 	/* Process all valid buffers in receive_queue[min..max] */
 	int min = sstate->last_processed + 1;
@@ -289,21 +442,23 @@ get_new_stats(struct incr_stats *buf, struct slave_state *sstate, int cmd_id)
 		for (int q = min; q <= max; q++) missed += !receive_queue[q];
 
 	/* Put the best increments in the output buffer. */
-	int output_nodes = output_stats(buf, sstate, bucket_count, merge_count);
+	int output_nodes = output_stats(sstate->out_stats, sstate, bucket_count, merge_count);
+	int size = output_nodes ? stats_wire_encode(sstate->out_stats, output_nodes,
+						     buf, sstate->max_buf_size) : 0;
 
 	if (DEBUGVV(2)) {
 		char b[1024];
 		snprintf(b, sizeof(b), "merged %d..%d missed %d %d/%d nodes,"
-			 " output %d/%d nodes in %.3fms (clear %.3fms)\n",
+			 " output %d/%d nodes %d bytes in %.3fms (clear %.3fms)\n",
 			 min, max, missed, merge_count, nodes_read, output_nodes,
-			 sstate->max_buf_size / (int)sizeof(*buf),
+			 sstate->max_buf_size / (int)sizeof(struct incr_stats), size,
 			 (time_now() - start)*1000, clear_time*1000);
 		logline(&sstate->client, "= ", b);
 	}
 
 	protocol_lock();
 
-	return output_nodes * sizeof(*buf);
+	return size;
 }
 
 /* Allocate the buffers in the merge specific part of the slave sate,
@@ -314,6 +469,9 @@ merge_state_alloc(struct slave_state *sstate)
 	sstate->stats_htable = calloc2(1 << sstate->stats_hbits, sizeof(struct incr_stats));
 	sstate->merged = malloc2(sstate->max_merged_nodes * sizeof(int));
 	sstate->max_buf_size -= sizeof(struct incr_stats);
+	sstate->out_stats = malloc2(sstate->max_buf_size);
+	mem_account(MEM_DISTRIBUTED, (1 << sstate->stats_hbits) * sizeof(struct incr_stats)
+		    + sstate->max_merged_nodes * sizeof(int) + sstate->max_buf_size);
 }
 
 /* Append a terminator value to make merge_new_stats() more
@@ -325,17 +483,29 @@ merge_insert_hook(struct incr_stats *buf, int size)
 	buf[nodes].coord_path = INT64_MAX;
 }
 
+/* Decode the stats received from a slave; merge_state_alloc()
+ * has reserved space for the terminator beyond max_size. */
+static int
+merge_decode_hook(struct incr_stats *buf, int max_size, unsigned char *wire, int wire_size)
+{
+	int nodes = stats_wire_decode(wire, wire_size, buf, max_size / sizeof(*buf));
+	return nodes < 0 ? -1 : nodes * (int)sizeof(*buf);
+}
+
 /* Initiliaze merge-related fields of the default slave state. */
 void
-merge_init(struct slave_state *sstate, int shared_nodes, int stats_hbits, int max_slaves)
+merge_init(struct slave_state *sstate, int shared_nodes, int stats_hbits,
+	   int max_slaves, int merge_threads)
 {
 	/* See merge_state_alloc() for shared_nodes + 1 */
 	sstate->max_buf_size = (shared_nodes + 1) * sizeof(struct incr_stats);
 	sstate->stats_hbits = stats_hbits;
+	sstate->merge_threads = merge_threads > 0 ? merge_threads : 1;
 
 	sstate->insert_hook = (buffer_hook)merge_insert_hook;
 	sstate->alloc_hook = merge_state_alloc;
 	sstate->args_hook = (getargs_hook)get_new_stats;
+	sstate->decode_hook = (buffer_decode_hook)merge_decode_hook;
 
 	/* At worst one late slave thread may have to merge up to
 	 *   shared_nodes * BUFFERS_PER_SLAVE * (max_slaves - 1)
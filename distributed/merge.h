@@ -4,6 +4,7 @@
 #include "distributed/protocol.h"
 
 void merge_print_stats(int total_hnodes);
-void merge_init(struct slave_state *sstate, int shared_nodes, int stats_hbits, int max_slaves);
+void merge_init(struct slave_state *sstate, int shared_nodes, int stats_hbits,
+		int max_slaves, int merge_threads);
 
 #endif
@@ -11,7 +11,13 @@
  * increment. */
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/uio.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <pthread.h>
 #include <ctype.h>
 #include <unistd.h>
@@ -23,6 +29,9 @@
 #include "playout.h"
 #include "network.h"
 #include "debug.h"
+#include "logger.h"
+#include "memstats.h"
+#include "metrics.h"
 #include "distributed/distributed.h"
 #include "distributed/protocol.h"
 
@@ -64,15 +73,9 @@ static int queue_max_length;
  * read without the lock but is only written with lock held. */
 static pthread_mutex_t slave_lock = PTHREAD_MUTEX_INITIALIZER;
 
-/* Condition signaled when a new gtp command is available. */
-static pthread_cond_t cmd_cond = PTHREAD_COND_INITIALIZER;
-
 /* Condition signaled when reply_count increases. */
 static pthread_cond_t reply_cond = PTHREAD_COND_INITIALIZER;
 
-/* Mutex protecting stderr. Must not be held at same time as slave_lock. */
-static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
-
 /* Absolute time when this program was started.
  * For debugging only. */
 static double start_time;
@@ -80,6 +83,10 @@ static double start_time;
 /* Default slave state. */
 struct slave_state default_sstate;
 
+/* In relay mode, state of the upstream master, as if it was one
+ * more slave: its buffers are in the receive queue with the others. */
+static struct slave_state *upstream;
+
 
 /* Get exclusive access to the threads and commands state. */
 void
@@ -112,9 +119,7 @@ logline(struct in_addr *client, char *prefix, char *s)
 	} else {
 		addr[0] = '\0';
 	}
-	pthread_mutex_lock(&log_lock);
-	fprintf(stderr, "%s%15s %9.3f: %s", prefix, addr, now - start_time, s);
-	pthread_mutex_unlock(&log_lock);
+	log_printf(0, "%s%15s %9.3f: %s", prefix, addr, now - start_time, s);
 }
 
 /* Thread opening a connection on the given socket and copying input
@@ -137,111 +142,67 @@ proxy_thread(void *arg)
 	pthread_exit(NULL);
 }
 
-/* Get a reply to one gtp command. Return the gtp command id,
- * or -1 if error. reply must have at least CMDS_SIZE bytes.
- * The ascii reply ends with an empty line; if the first line
- * contains "@size", a binary reply of size bytes follows the
- * empty line. @size is not standard gtp, it is only used
- * internally by Pachi for the genmoves command; it must be the
- * last parameter on the line.
- * *bin_size is the maximum size upon entry, actual size on return.
- * slave_lock is not held on either entry or exit of this function. */
-static int
-get_reply(FILE *f, struct in_addr client, char *reply, void *bin_reply, int *bin_size)
-{
-	double start = time_now();
-
-	int reply_id = -1;
-	*reply = '\0';
-	if (!fgets(reply, CMDS_SIZE, f)) return -1;
-
-	/* Check for binary reply. */
-	char *s = strchr(reply, '@');
-	int size = 0;
-	if (s) size = atoi(s+1);
-	assert(size <= *bin_size);
-	*bin_size = size;
-
-	if (DEBUGV(s, 2))
-		logline(&client, "<<", reply);
-	if ((*reply == '=' || *reply == '?') && isdigit(reply[1]))
-		reply_id = atoi(reply+1);
-
-	/* Read the rest of the ascii reply */
-	char *line = reply + strlen(reply);
-	while (fgets(line, reply + CMDS_SIZE - line, f) && *line != '\n') {
-		if (DEBUGL(3))
-			logline(&client, "<<", line);
-		line += strlen(line);
-	}
-	if (*line != '\n') return -1;
-
-	/* Read the binary reply if any. */
-	int len;
-	while (size && (len = fread(bin_reply, 1, size, f)) > 0) {
-		bin_reply = (char *)bin_reply + len;
-		size -= len;
-	}
-	if (*bin_size && DEBUGVV(2)) {
-		char buf[1024];
-		snprintf(buf, sizeof(buf), "read reply %d+%d bytes in %.4fms\n",
-			 (int)strlen(reply), *bin_size,
-			 (time_now() - start)*1000);
-		logline(&client, "= ", buf);
-	}
-	return size ? -1 : reply_id;
-}
-
-/* Send the gtp command to_send and get a reply from the slave machine.
- * Write the reply in buf which must have at least CMDS_SIZE bytes.
- * If *bin_size > 0, send bin_buf after the gtp command.
- * Return any binary reply in bin_buf and set its size in bin_size.
- * bin_buf is private to the slave and need not be copied.
- * Return the gtp command id, or -1 if error.
+/* Weight of the last reply time in the moving average of a slave. */
+#define LATENCY_EWMA 0.2
+
+/* Per-slave connection state. Each connection slot is owned by one
+ * I/O thread which multiplexes all its slots with poll(), so a large
+ * cluster does not need one thread per slave. */
+struct slave_conn {
+	int fd; // -1 if no slave is connected
+	enum slave_io {
+		SIO_IDLE, // waiting for a new command
+		SIO_SEND, // sending out[] then bin_buf[0..bin_len-1]
+		SIO_REPLY, // reading the ascii reply into in[]
+		SIO_BINARY, // reading the binary reply into bin_buf
+	} io;
+	/* The slave has answered the initial name command. */
+	bool active;
+
+	struct slave_state sstate;
+	bool resend;
+	int last_cmd_count;
+	int last_reply_id;
+	int reply_slot;
+
+	/* The command buffer and the ascii reply have CMDS_SIZE+1
+	 * bytes. The binary arg is written directly from bin_buf, one
+	 * of the sstate buffers. The binary reply is read there too,
+	 * or into wire first if it needs decoding. */
+	char *out;
+	int out_len, out_pos;
+	char *in;
+	int in_len;
+	void *bin_buf;
+	void *wire;
+	int bin_len, bin_pos;
+	/* Ascii part of the last valid reply, in gtp_replies. */
+	char *reply_buf;
+	char *resend_msg; // for debugging only
+	double start; // for debugging and metrics
+	/* Moving average of the reply times, 0 if no reply yet,
+	 * and whether it makes the slave a straggler. */
+	double latency;
+	bool straggler;
+};
+
+static struct slave_conn *slaves;
+static int slave_slots;
+static int io_threads;
+
+/* Pipes used to wake the I/O threads when a new command is available. */
+static int (*wake_pipes)[2];
+
+
+/* Notify the I/O threads about a new command.
  * slave_lock is held on both entry and exit of this function. */
-static int
-send_command(char *to_send, void *bin_buf, int *bin_size,
-	     FILE *f, struct slave_state *sstate, char *buf)
+static void
+wake_io_threads(void)
 {
-	assert(to_send && gtp_cmd && bin_buf && bin_size);
-	strncpy(buf, to_send, CMDS_SIZE);
-	bool resend = to_send != gtp_cmd;
-
-	pthread_mutex_unlock(&slave_lock);
-
-	if (DEBUGL(1) && resend)
-		logline(&sstate->client, "? ",
-			to_send == gtp_cmds ? "resend all\n" : "partial resend\n");
-
-	double start = time_now();
-	fputs(buf, f);
-
-	if (*bin_size)
-		fwrite(bin_buf, 1, *bin_size, f);
-	fflush(f);
-
-	if (DEBUGV(strchr(buf, '@'), 2)) {
-		double ms = (time_now() - start) * 1000.0;
-		if (!DEBUGL(3)) {
-			char *s = strchr(buf, '\n');
-			if (s) s[1] = '\0';
-		}
-		logline(&sstate->client, ">>", buf);
-		if (*bin_size) {
-			char b[1024];
-			snprintf(b, sizeof(b),
-				 "sent cmd %d+%d bytes in %.4fms\n",
-				 (int)strlen(buf), *bin_size, ms);
-			logline(&sstate->client, "= ", b);
-		}
+	for (int t = 0; t < io_threads; t++) {
+		/* If the pipe is full, the thread is going to wake up anyway. */
+		if (write(wake_pipes[t][1], "", 1) < 0) {}
 	}
-
-	/* Reuse the buffers for the reply. */
-	*bin_size = sstate->max_buf_size;
-	int reply_id = get_reply(f, sstate->client, buf, bin_buf, bin_size);
-
-	pthread_mutex_lock(&slave_lock);
-	return reply_id;
 }
 
 /* Return the command sent after that with the given gtp id,
@@ -268,7 +229,7 @@ next_command(int cmd_id)
 	return next;
 }
 
-/* Allocate buffers for a slave thread. The state should have been
+/* Allocate buffers for a slave connection slot. The state should have been
  * initialized already as a copy of the default slave state.
  * slave_lock is not held on either entry or exit of this function. */
 static void
@@ -278,6 +239,7 @@ slave_state_alloc(struct slave_state *sstate)
 		sstate->b[n].buf = malloc2(sstate->max_buf_size);
 		sstate->b[n].owner = sstate->thread_id;
 	}
+	mem_account(MEM_DISTRIBUTED, (long long) BUFFERS_PER_SLAVE * sstate->max_buf_size);
 	if (sstate->alloc_hook) sstate->alloc_hook(sstate);
 }
 
@@ -340,6 +302,7 @@ insert_buf(struct slave_state *sstate, void *buf, int size)
 	receive_queue[queue_length]->size = size;
 	receive_queue[queue_length]->queue_index = queue_length;
 	queue_length++;
+	metric_set(M_SLAVE_QUEUE, queue_length);
 }
 
 /* Clear the receive queue. The buffer pointers do not have to be cleared
@@ -356,6 +319,7 @@ clear_receive_queue(void)
 	}
 	queue_length = 0;
 	queue_age++;
+	metric_set(M_SLAVE_QUEUE, 0);
 }
 
 /* Process the reply received from a slave machine.
@@ -431,119 +395,436 @@ get_binary_arg(struct slave_state *sstate, char *cmd, int cmd_size, int *bin_siz
 	return buf;
 }
 
-/* Main loop of a slave thread.
- * Send the current command to the slave machine and wait for a reply.
- * Resend command history if the slave machine is out of sync.
- * Returns when the connection with the slave machine is cut.
+/* Relay mode: insert the stats sent by the upstream master, in wire
+ * format, in the receive queue so that they are merged into the
+ * stats sent to the slaves. Return false if the stats are invalid.
  * slave_lock is held on both entry and exit of this function. */
+bool
+upstream_insert_stats(void *wire, int size)
+{
+	assert(upstream);
+	void *buf = get_free_buf(upstream);
+	size = upstream->decode_hook(buf, upstream->max_buf_size, wire, size);
+	if (size < 0) return false;
+	if (size) insert_buf(upstream, buf, size);
+	return true;
+}
+
+/* Relay mode: get the stats merged from all slaves since the last
+ * call, excluding those of the upstream master, in wire format.
+ * The buffer stays valid until the next call.
+ * slave_lock is held on both entry and exit of this function. */
+void *
+upstream_get_stats(int *size)
+{
+	assert(upstream);
+	void *buf = get_free_buf(upstream);
+	*size = upstream->args_hook(buf, upstream, atoi(gtp_cmd));
+	return buf;
+}
+
+/* Close the connection with a slave machine. The slot keeps its
+ * buffers; the received ones are still useful for other slaves.
+ * slave_lock is not held on either entry or exit of this function. */
 static void
-slave_loop(FILE *f, char *reply_buf, struct slave_state *sstate, bool resend)
+slave_close(struct slave_conn *sc)
+{
+	close(sc->fd);
+	sc->fd = -1;
+	if (!sc->active) return;
+
+	sc->active = false;
+	pthread_mutex_lock(&slave_lock);
+	assert(active_slaves > 0);
+	active_slaves--;
+	metric_set(M_SLAVES, active_slaves);
+	// Unblock main thread if it was waiting for this slave.
+	pthread_cond_signal(&reply_cond);
+	pthread_mutex_unlock(&slave_lock);
+
+	if (DEBUGL(2))
+		logline(&sc->sstate.client, "= ", "lost slave\n");
+}
+
+/* Prepare the next command for the slave machine if there is one:
+ * the current command, or the history if the slave was out of sync.
+ * But first get binary arguments if necessary.
+ * slave_lock is held on both entry and exit of this function. */
+static void
+slave_next_command(struct slave_conn *sc)
 {
-	char *to_send;
-	int last_cmd_count = 0;
-	int last_reply_id = -1;
-	int reply_slot = -1;
 	for (;;) {
-		if (resend) {
+		char *to_send;
+		if (sc->resend) {
 			/* Resend complete or partial history */
-			to_send = next_command(last_reply_id);
+			to_send = next_command(sc->last_reply_id);
 		} else {
-			/* Wait for a new command. */
-			while (last_cmd_count == cmd_count)
-				pthread_cond_wait(&cmd_cond, &slave_lock);
+			/* Wait for a new command. But a command with binary
+			 * args (genmoves with stats) is streamed: it is sent
+			 * again as soon as the slave has replied to it, with
+			 * the stats merged since, so that the slave does not
+			 * wait for the main thread to update the command. */
+			if (sc->last_cmd_count == cmd_count
+			    && (sc->last_reply_id < 0 || sc->last_reply_id != atoi(gtp_cmd)
+				|| !strchr(gtp_cmd, '@'))) {
+				sc->io = SIO_IDLE;
+				return;
+			}
 			to_send = gtp_cmd;
 		}
 
-		/* Command available, send it to slave machine.
-		 * If slave was out of sync, send the history.
-		 * But first get binary arguments if necessary. */
 		int bin_size = 0;
-		void *bin_buf = get_binary_arg(sstate, gtp_cmd,
+		void *bin_buf = get_binary_arg(&sc->sstate, gtp_cmd,
 					       gtp_cmds + CMDS_SIZE - gtp_cmd,
 					       &bin_size);
 		/* Check that the command is still valid. */
-		resend = true;
+		sc->resend = true;
 		if (!bin_buf) continue;
 
-		/* Send the command and get the reply, which always ends with \n\n
-		 * The slave machine sends "=id reply" or "?id reply"
+		/* The slave machine sends "=id reply" or "?id reply"
 		 * with id == cmd_id if it is in sync. */
-		last_cmd_count = cmd_count;
-		char buf[CMDS_SIZE];
-		int reply_id = send_command(to_send, bin_buf, &bin_size, f,
-					    sstate, buf);
-		if (reply_id == -1) return;
+		sc->last_cmd_count = cmd_count;
+		strncpy(sc->out, to_send, CMDS_SIZE);
+		sc->out_len = strlen(sc->out);
+		sc->out_pos = 0;
+		sc->bin_buf = bin_buf;
+		sc->bin_len = bin_size;
+		sc->bin_pos = 0;
+		sc->resend_msg = to_send == gtp_cmd ? NULL
+			: to_send == gtp_cmds ? "resend all\n" : "partial resend\n";
+		sc->io = SIO_SEND;
+		return;
+	}
+}
+
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+/* Send as much of the pending command as the socket accepts,
+ * in a single system call if possible.
+ * Return false on error.
+ * slave_lock is not held on either entry or exit of this function. */
+static bool
+slave_write(struct slave_conn *sc)
+{
+	struct slave_state *sstate = &sc->sstate;
+	if (sc->out_pos == 0 && sc->bin_pos == 0) {
+		if (DEBUGL(1) && sc->resend_msg)
+			logline(&sstate->client, "? ", sc->resend_msg);
+		sc->start = time_now();
+	}
+
+	/* The command and the binary arg go out together, straight
+	 * from their buffers. */
+	while (sc->out_pos < sc->out_len || sc->bin_pos < sc->bin_len) {
+		struct iovec iov[2];
+		int n = 0;
+		if (sc->out_pos < sc->out_len)
+			iov[n++] = (struct iovec) { sc->out + sc->out_pos, sc->out_len - sc->out_pos };
+		if (sc->bin_pos < sc->bin_len)
+			iov[n++] = (struct iovec) { (char *)sc->bin_buf + sc->bin_pos, sc->bin_len - sc->bin_pos };
+		struct msghdr msg = { .msg_iov = iov, .msg_iovlen = n };
+		ssize_t len = sendmsg(sc->fd, &msg, SEND_FLAGS);
+		if (len < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+
+		int out = len < sc->out_len - sc->out_pos ? len : sc->out_len - sc->out_pos;
+		sc->out_pos += out;
+		sc->bin_pos += len - out;
+	}
+
+	if (DEBUGV(strchr(sc->out, '@'), 2)) {
+		double ms = (time_now() - sc->start) * 1000.0;
+		if (!DEBUGL(3)) {
+			char *s = strchr(sc->out, '\n');
+			if (s) s[1] = '\0';
+		}
+		logline(&sstate->client, ">>", sc->out);
+		if (sc->bin_len) {
+			char b[1024];
+			snprintf(b, sizeof(b),
+				 "sent cmd %d+%d bytes in %.4fms\n",
+				 sc->out_len, sc->bin_len, ms);
+			logline(&sstate->client, "= ", b);
+		}
+	}
+
+	/* Reuse the buffers for the reply. */
+	sc->in_len = 0;
+	sc->start = time_now();
+	sc->io = SIO_REPLY;
+	return true;
+}
+
+/* Read what is available of a reply to one gtp command.
+ * The ascii reply ends with an empty line; if the first line
+ * contains "@size", a binary reply of size bytes follows the
+ * empty line. @size is not standard gtp, it is only used
+ * internally by Pachi for the genmoves command; it must be the
+ * last parameter on the line. The ascii part is parsed in place
+ * in sc->in, the binary part goes straight to sc->bin_buf.
+ * Return 1 when the reply is complete, 0 if more data is needed,
+ * -1 if error.
+ * slave_lock is not held on either entry or exit of this function. */
+static int
+slave_read(struct slave_conn *sc)
+{
+	struct in_addr *client = &sc->sstate.client;
+
+	if (sc->io == SIO_REPLY) {
+		int len = read(sc->fd, sc->in + sc->in_len, CMDS_SIZE - sc->in_len);
+		if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+			return 0;
+		if (len <= 0) return -1;
+		sc->in_len += len;
+
+		char *end = memmem(sc->in, sc->in_len, "\n\n", 2);
+		if (!end) return sc->in_len < CMDS_SIZE ? 0 : -1;
+		int text_len = end + 2 - sc->in;
+
+		/* Check for binary reply. */
+		char *eol = memchr(sc->in, '\n', text_len);
+		char *s = memchr(sc->in, '@', eol - sc->in);
+		int size = s ? atoi(s + 1) : 0;
+		int extra = sc->in_len - text_len;
+		if (size > (sc->active ? sc->sstate.max_buf_size : 0) || extra > size)
+			return -1;
+		if (extra)
+			memcpy(sc->wire ? sc->wire : sc->bin_buf, sc->in + text_len, extra);
+		sc->in[text_len] = '\0';
+		sc->bin_len = size;
+		sc->bin_pos = extra;
+		sc->io = SIO_BINARY;
+
+		if (DEBUGL(3)) {
+			logline(client, "<<", sc->in);
+		} else if (DEBUGV(s, 2)) {
+			char c = eol[1];
+			eol[1] = '\0';
+			logline(client, "<<", sc->in);
+			eol[1] = c;
+		}
+	}
 
-		resend = process_reply(reply_id, buf, reply_buf, bin_buf, bin_size,
-				       &last_reply_id, &reply_slot, sstate);
+	/* Read the binary reply if any. */
+	char *dst = sc->wire ? sc->wire : sc->bin_buf;
+	while (sc->bin_pos < sc->bin_len) {
+		int len = read(sc->fd, dst + sc->bin_pos, sc->bin_len - sc->bin_pos);
+		if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+			return 0;
+		if (len <= 0) return -1;
+		sc->bin_pos += len;
 	}
+	if (sc->bin_len && DEBUGVV(2)) {
+		char buf[1024];
+		snprintf(buf, sizeof(buf), "read reply %d+%d bytes in %.4fms\n",
+			 (int)strlen(sc->in), sc->bin_len,
+			 (time_now() - sc->start)*1000);
+		logline(client, "= ", buf);
+	}
+	if (sc->bin_len && sc->wire) {
+		sc->bin_len = sc->sstate.decode_hook(sc->bin_buf, sc->sstate.max_buf_size,
+						     sc->wire, sc->bin_len);
+		if (sc->bin_len < 0) return -1;
+	}
+	return 1;
 }
 
-/* Minimimal check of slave identity. Close the file if error. */
+/* Minimimal check of slave identity, on its reply to "name". */
 static bool
-is_pachi_slave(FILE *f, struct in_addr *client)
+is_pachi_slave(struct slave_conn *sc)
 {
-	char buf[1024];
-	fputs("name\n", f);
-	if (!fgets(buf, sizeof(buf), f)
-	    || strncasecmp(buf, "= Pachi", 7)
-	    || !fgets(buf, sizeof(buf), f)
-	    || strcmp(buf, "\n")) {
-		logline(client, "? ", "bad slave\n");
-		fclose(f);
-		sleep(1); // avoid busy loop if error
+	char *eol = strchr(sc->in, '\n');
+	if (strncasecmp(sc->in, "= Pachi", 7) || strcmp(eol, "\n\n")) {
+		logline(&sc->sstate.client, "? ", "bad slave\n");
 		return false;
 	}
 	return true;
 }
 
-/* Thread sending gtp commands to one slave machine, and
- * reading replies. If a slave machine dies, this thread waits
- * for a connection from another slave.
- * The large buffers are allocated only once we get a first
- * connection, to avoid wasting memory if max_slaves is too large.
- * We do not invalidate the received buffers if a slave disconnects;
- * they are still useful for other slaves. */
-static void * __attribute__((noreturn))
-slave_thread(void *arg)
+/* Handle a complete reply from the slave machine, and prepare
+ * the next command. Return false if the connection must be closed.
+ * slave_lock is not held on either entry or exit of this function. */
+static bool
+slave_reply(struct slave_conn *sc)
 {
-	struct slave_state sstate = default_sstate;
-	sstate.thread_id = (intptr_t)arg;
+	if (!sc->active) {
+		if (!is_pachi_slave(sc)) return false;
+
+		/* The large buffers are allocated only once we get a first
+		 * connection, to avoid wasting memory if slave_slots is too
+		 * large. A slave reconnecting to a used slot gets the history. */
+		sc->resend = sc->sstate.b[0].buf != NULL;
+		if (!sc->resend) {
+			slave_state_alloc(&sc->sstate);
+			if (sc->sstate.decode_hook) {
+				sc->wire = malloc2(sc->sstate.max_buf_size);
+				mem_account(MEM_DISTRIBUTED, sc->sstate.max_buf_size);
+			}
+		}
+		sc->last_cmd_count = 0;
+		sc->last_reply_id = -1;
+		sc->reply_slot = -1;
 
-	assert(sstate.slave_sock >= 0);
-	char reply_buf[CMDS_SIZE];
-	bool resend = false;
+		pthread_mutex_lock(&slave_lock);
+		active_slaves++;
+		metric_set(M_SLAVES, active_slaves);
+		sc->active = true;
+		slave_next_command(sc);
+		pthread_mutex_unlock(&slave_lock);
+		return true;
+	}
 
-	for (;;) {
-		/* Wait for a connection from any slave. */
-		struct in_addr client;
-		int conn = open_server_connection(sstate.slave_sock, &client);
+	int reply_id = -1;
+	if ((*sc->in == '=' || *sc->in == '?') && isdigit(sc->in[1]))
+		reply_id = atoi(sc->in + 1);
+	if (reply_id == -1) return false;
+
+	double latency = time_now() - sc->start;
+	metric_add(M_SLAVE_REPLIES, 1);
+	metric_add(M_SLAVE_REPLY_SECONDS, latency);
+	metric_set(M_SLAVE_REPLY_LAST_SECONDS, latency);
+
+	pthread_mutex_lock(&slave_lock);
+	sc->latency = sc->latency ? sc->latency + (latency - sc->latency) * LATENCY_EWMA : latency;
+	sc->resend = process_reply(reply_id, sc->in, sc->reply_buf, sc->bin_buf, sc->bin_len,
+				   &sc->last_reply_id, &sc->reply_slot, &sc->sstate);
+	slave_next_command(sc);
+	pthread_mutex_unlock(&slave_lock);
+	return true;
+}
+
+/* Accept a connection from any slave in a free slot of the given
+ * I/O thread, and start the identity check. */
+static void
+slave_accept(int tid)
+{
+	struct slave_conn *sc = NULL;
+	for (int s = tid; s < slave_slots && !sc; s += io_threads)
+		if (slaves[s].fd < 0) sc = &slaves[s];
+	assert(sc);
+
+	struct in_addr client;
+	int conn = accept_server_connection(default_sstate.slave_sock, &client);
+	if (conn < 0) return;
+	fcntl(conn, F_SETFL, fcntl(conn, F_GETFL) | O_NONBLOCK);
+
+	if (!sc->in) {
+		sc->in = malloc2(CMDS_SIZE + 1);
+		sc->out = malloc2(CMDS_SIZE + 1);
+		sc->reply_buf = malloc2(CMDS_SIZE);
+		sc->out[CMDS_SIZE] = '\0';
+	}
+	sc->fd = conn;
+	sc->sstate.client = client;
+	if (DEBUGL(2)) {
+		char buf[64];
+		snprintf(buf, sizeof(buf), "new slave, id %d\n", sc->sstate.thread_id);
+		logline(&client, "= ", buf);
+	}
 
-		FILE *f = fdopen(conn, "r+");
-		if (DEBUGL(2)) {
-			snprintf(reply_buf, sizeof(reply_buf),
-				 "new slave, id %d\n", sstate.thread_id);
-			logline(&client, "= ", reply_buf);
+	strcpy(sc->out, "name\n");
+	sc->out_len = strlen(sc->out);
+	sc->out_pos = sc->bin_len = sc->bin_pos = 0;
+	sc->resend_msg = NULL;
+	sc->io = SIO_SEND;
+	if (!slave_write(sc)) slave_close(sc);
+}
+
+/* Do the I/O the connection is ready for. */
+static void
+slave_io(struct slave_conn *sc)
+{
+	switch (sc->io) {
+		case SIO_IDLE:
+			/* The slave machine has nothing to say while idle;
+			 * this is a disconnection or garbage. */
+			slave_close(sc);
+			return;
+		case SIO_SEND:
+			if (!slave_write(sc)) slave_close(sc);
+			return;
+		case SIO_REPLY:
+		case SIO_BINARY: {
+			int r = slave_read(sc);
+			if (r < 0 || (r > 0 && !slave_reply(sc))) {
+				slave_close(sc);
+				return;
+			}
+			/* Send the next command right away if any. */
+			if (r > 0 && sc->io == SIO_SEND && !slave_write(sc))
+				slave_close(sc);
+			return;
 		}
-		if (!is_pachi_slave(f, &client)) continue;
+	}
+}
 
-		if (!resend) slave_state_alloc(&sstate);
-		sstate.client = client;
+/* I/O thread sending gtp commands to a subset of the slave machines,
+ * and reading replies. Thread tid owns the slots tid, tid + io_threads,
+ * etc. While it has a free slot, it also accepts new connections. */
+static void * __attribute__((noreturn))
+io_thread(void *arg)
+{
+	int tid = (intptr_t)arg;
+	int slots = (slave_slots - tid + io_threads - 1) / io_threads;
+	struct pollfd fds[slots + 2];
+	struct slave_conn *fd_conn[slots + 2];
 
-		pthread_mutex_lock(&slave_lock);
-		active_slaves++;
-		slave_loop(f, reply_buf, &sstate, resend);
+	for (;;) {
+		int nfds = 0;
+		fds[nfds++] = (struct pollfd) { .fd = wake_pipes[tid][0], .events = POLLIN };
+
+		bool free_slot = false;
+		for (int s = tid; s < slave_slots; s += io_threads) {
+			struct slave_conn *sc = &slaves[s];
+			if (sc->fd < 0) {
+				free_slot = true;
+				continue;
+			}
+			fds[nfds] = (struct pollfd) { .fd = sc->fd, .events = sc->io == SIO_SEND ? POLLOUT : POLLIN };
+			fd_conn[nfds++] = sc;
+		}
+		int listen_fd = -1;
+		if (free_slot) {
+			listen_fd = nfds;
+			fds[nfds++] = (struct pollfd) { .fd = default_sstate.slave_sock, .events = POLLIN };
+		}
 
-		assert(active_slaves > 0);
-		active_slaves--;
-		// Unblock main thread if it was waiting for this slave.
-		pthread_cond_signal(&reply_cond);
-		pthread_mutex_unlock(&slave_lock);
+		if (poll(fds, nfds, -1) < 0) {
+			if (errno == EINTR) continue;
+			perror("poll");
+			exit(42);
+		}
 
-		resend = true;
-		if (DEBUGL(2))
-			logline(&client, "= ", "lost slave\n");
-		fclose(f);
+		for (int i = 1; i < nfds; i++) {
+			if (i != listen_fd && fds[i].revents)
+				slave_io(fd_conn[i]);
+		}
+		if (listen_fd >= 0 && fds[listen_fd].revents)
+			slave_accept(tid);
+
+		if (fds[0].revents) {
+			char buf[64];
+			while (read(wake_pipes[tid][0], buf, sizeof(buf)) > 0);
+
+			/* New command available, send it to the idle slaves. */
+			pthread_mutex_lock(&slave_lock);
+			for (int s = tid; s < slave_slots; s += io_threads) {
+				struct slave_conn *sc = &slaves[s];
+				if (sc->fd >= 0 && sc->active && sc->io == SIO_IDLE)
+					slave_next_command(sc);
+			}
+			pthread_mutex_unlock(&slave_lock);
+
+			for (int s = tid; s < slave_slots; s += io_threads) {
+				struct slave_conn *sc = &slaves[s];
+				if (sc->fd >= 0 && sc->io == SIO_SEND && sc->out_pos == 0
+				    && !slave_write(sc))
+					slave_close(sc);
+			}
+		}
 	}
 	pthread_exit(NULL);
 }
@@ -583,8 +864,8 @@ update_cmd(struct board *b, char *cmd, char *args, bool new_id)
 		last->gtp_id = gtp_id;
 		last->next_cmd = NULL;
 	}
-	// Notify the slave threads about the new command.
-	pthread_cond_broadcast(&cmd_cond);
+	// Notify the I/O threads about the new command.
+	wake_io_threads();
 }
 
 /* Update the command history, then create a new gtp command
@@ -613,18 +894,83 @@ new_cmd(struct board *b, char *cmd, char *args)
 		gtp_cmd += strlen(gtp_cmd);
 	}
 
-	// Let the slave threads send the new gtp command:
+	// Let the I/O threads send the new gtp command:
 	update_cmd(b, cmd, args, true);
 }
 
+/* A slave is a straggler when its replies are usually this many
+ * times slower than the median, and later by at least STRAGGLER_DELAY. */
+#define STRAGGLER_RATIO 4
+#define STRAGGLER_DELAY 0.02
+
+/* Don't stop waiting for the other slaves before that many median
+ * reply times, or STRAGGLER_DELAY. */
+#define REPLY_WAIT_RATIO 3
+
+static int
+double_cmp(const void *p1, const void *p2)
+{
+	double d1 = *(const double *)p1, d2 = *(const double *)p2;
+	return (d1 > d2) - (d1 < d2);
+}
+
+/* Classify the active slaves by their average reply time.
+ * Return the number of stragglers and set *median.
+ * slave_lock is held on both entry and exit of this function. */
+static int
+find_stragglers(double *median)
+{
+	double latency[slave_slots];
+	int n = 0;
+	for (int s = 0; s < slave_slots; s++)
+		if (slaves[s].active && slaves[s].latency > 0)
+			latency[n++] = slaves[s].latency;
+	*median = 0;
+	if (n < 3) return 0;
+	qsort(latency, n, sizeof(*latency), double_cmp);
+	*median = latency[n / 2];
+
+	int stragglers = 0;
+	for (int s = 0; s < slave_slots; s++) {
+		struct slave_conn *sc = &slaves[s];
+		bool straggler = sc->active && sc->latency > *median * STRAGGLER_RATIO
+			&& sc->latency > *median + STRAGGLER_DELAY;
+		if (straggler != sc->straggler && DEBUGL(2)) {
+			char buf[128];
+			snprintf(buf, sizeof(buf), "%sstraggler, latency %.3fs median %.3fs\n",
+				 straggler ? "" : "no longer ", sc->latency, *median);
+			logline(&sc->sstate.client, "= ", buf);
+		}
+		sc->straggler = straggler;
+		stragglers += straggler;
+	}
+	metric_set(M_SLAVE_STRAGGLERS, stragglers);
+	return stragglers;
+}
+
 /* Wait for at least one new reply. Return when at least
  * min_replies slaves have already replied, or when the
  * given absolute time is passed.
+ * The slaves much slower than the others are not waited for, and
+ * once replies come in the wait is cut to a few median reply times.
+ * The stragglers keep working; the streamed genmoves keeps its gtp
+ * id so their stats are still merged when they arrive, and the search
+ * stops on the total of games played, which the faster slaves reach.
  * The replies are returned in gtp_replies[0..reply_count-1]
  * slave_lock is held on entry and on return. */
 void
 get_replies(double time_limit, int min_replies)
 {
+	double median;
+	int stragglers = find_stragglers(&median);
+	if (min_replies > active_slaves - stragglers)
+		min_replies = active_slaves - stragglers > 1 ? active_slaves - stragglers : 1;
+	if (median > 0) {
+		double wait = median * REPLY_WAIT_RATIO;
+		if (wait < STRAGGLER_DELAY) wait = STRAGGLER_DELAY;
+		if (time_now() + wait < time_limit) time_limit = time_now() + wait;
+	}
+
 	for (;;) {
 		if (reply_count > 0) {
 			struct timespec ts;
@@ -654,16 +1000,18 @@ get_replies(double time_limit, int min_replies)
  * 300*200=60000 genmoves per slave. */
 #define MAX_GENMOVES_PER_SLAVE 60000
 
-/* Allocate the receive queue, and create the slave and proxy threads.
- * max_buf_size and the merge-related fields of default_sstate must
- * already be initialized. */
+/* Allocate the receive queue and the connection slots, and create
+ * the I/O and proxy threads. max_buf_size and the merge-related fields
+ * of default_sstate must already be initialized. */
 void
-protocol_init(char *slave_port, char *proxy_port, int max_slaves)
+protocol_init(char *slave_port, char *proxy_port, int max_slaves, int threads, bool relay)
 {
 	start_time = time_now();
 
-	queue_max_length = max_slaves * MAX_GENMOVES_PER_SLAVE;
+	/* The upstream master of a relay counts as one more slave. */
+	queue_max_length = (max_slaves + relay) * MAX_GENMOVES_PER_SLAVE;
 	receive_queue = calloc2(queue_max_length, sizeof(*receive_queue));
+	mem_account(MEM_DISTRIBUTED, queue_max_length * sizeof(*receive_queue));
 
 	default_sstate.slave_sock = port_listen(slave_port, max_slaves);
 	default_sstate.last_processed = -1;
@@ -672,9 +1020,39 @@ protocol_init(char *slave_port, char *proxy_port, int max_slaves)
 		default_sstate.b[n].queue_index = -1;
 	}
 
-	pthread_t thread;
+	/* Accept from all I/O threads; the losers of a race
+	 * must not block. */
+	fcntl(default_sstate.slave_sock, F_SETFL,
+	      fcntl(default_sstate.slave_sock, F_GETFL) | O_NONBLOCK);
+
+	slave_slots = max_slaves;
+	slaves = calloc2(max_slaves, sizeof(*slaves));
 	for (int id = 0; id < max_slaves; id++) {
-		pthread_create(&thread, NULL, slave_thread, (void *)(intptr_t)id);
+		slaves[id].fd = -1;
+		slaves[id].sstate = default_sstate;
+		slaves[id].sstate.thread_id = id;
+	}
+	if (relay) {
+		upstream = malloc2(sizeof(*upstream));
+		*upstream = default_sstate;
+		upstream->thread_id = max_slaves;
+		/* Stats from all slaves are merged for upstream. */
+		upstream->max_merged_nodes += upstream->max_buf_size / sizeof(struct incr_stats);
+		slave_state_alloc(upstream);
+	}
+
+	io_threads = threads < max_slaves ? threads : max_slaves;
+	if (io_threads < 1) io_threads = 1;
+	wake_pipes = calloc2(io_threads, sizeof(*wake_pipes));
+	pthread_t thread;
+	for (int t = 0; t < io_threads; t++) {
+		if (pipe(wake_pipes[t]) < 0) {
+			perror("pipe");
+			exit(42);
+		}
+		fcntl(wake_pipes[t][0], F_SETFL, O_NONBLOCK);
+		fcntl(wake_pipes[t][1], F_SETFL, O_NONBLOCK);
+		pthread_create(&thread, NULL, io_thread, (void *)(intptr_t)t);
 	}
 
 	if (proxy_port) {
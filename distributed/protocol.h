@@ -12,7 +12,7 @@
 #include "board.h"
 
 
-/* Each slave thread maintains a ring of 256 buffers holding
+/* Each slave connection slot maintains a ring of 256 buffers holding
  * incremental stats received from the slave. The oldest
  * buffer is recycled to hold stats sent to the slave and
  * received the next reply. */
@@ -23,6 +23,7 @@ struct slave_state;
 typedef void (*buffer_hook)(void *buf, int size);
 typedef void (*state_alloc_hook)(struct slave_state *sstate);
 typedef int (*getargs_hook)(void *buf, struct slave_state *sstate, int cmd_id);
+typedef int (*buffer_decode_hook)(void *buf, int max_size, void *wire, int wire_size);
 
 struct buf_state {
 	void *buf;
@@ -36,11 +37,14 @@ struct buf_state {
 
 struct slave_state {
 	int max_buf_size;
-	int thread_id;
+	int thread_id; // connection slot, owner of the buffers
 	struct in_addr client; // for debugging only
 	state_alloc_hook alloc_hook;
 	buffer_hook insert_hook;
 	getargs_hook args_hook;
+	/* Decode a binary reply received in wire format into buf,
+	 * return the decoded size or -1 if the reply is invalid. */
+	buffer_decode_hook decode_hook;
 
 	/* Index in received_queue of most recent processed
 	 * buffer, -1 if none processed yet. */
@@ -62,6 +66,12 @@ struct slave_state {
 	/* Hash indices updated by stats merge. */
 	int *merged;
 	int max_merged_nodes;
+
+	/* Maximum number of threads for one merge. */
+	int merge_threads;
+
+	/* Stats to be sent, before encoding. */
+	struct incr_stats *out_stats;
 };
 extern struct slave_state default_sstate;
 
@@ -74,7 +84,12 @@ void clear_receive_queue(void);
 void update_cmd(struct board *b, char *cmd, char *args, bool new_id);
 void new_cmd(struct board *b, char *cmd, char *args);
 void get_replies(double time_limit, int min_replies);
-void protocol_init(char *slave_port, char *proxy_port, int max_slaves);
+void protocol_init(char *slave_port, char *proxy_port, int max_slaves, int io_threads, bool relay);
+
+/* Relay mode: the upstream master is one more source of stats for
+ * the slaves, and gets the stats merged from all slaves. */
+bool upstream_insert_stats(void *wire, int size);
+void *upstream_get_stats(int *size);
 
 extern int reply_count;
 extern char **gtp_replies;
@@ -0,0 +1,92 @@
+/* Encoding and decoding of the incremental stats wire format,
+ * see wire.h. */
+
+#include <assert.h>
+#include <math.h>
+
+#include "distributed/wire.h"
+
+static inline uint64_t
+zigzag(int64_t x)
+{
+	return ((uint64_t)x << 1) ^ (uint64_t)(x >> 63);
+}
+
+static inline int64_t
+unzigzag(uint64_t x)
+{
+	return (int64_t)(x >> 1) ^ -(int64_t)(x & 1);
+}
+
+static inline unsigned char *
+varint_put(unsigned char *p, uint64_t x)
+{
+	while (x >= 0x80) {
+		*p++ = (x & 0x7f) | 0x80;
+		x >>= 7;
+	}
+	*p++ = x;
+	return p;
+}
+
+/* Return NULL if the varint is truncated or too long. */
+static inline unsigned char *
+varint_get(unsigned char *p, unsigned char *end, uint64_t *x)
+{
+	*x = 0;
+	for (int shift = 0; p < end && shift < 64; shift += 7) {
+		unsigned char c = *p++;
+		*x |= (uint64_t)(c & 0x7f) << shift;
+		if (!(c & 0x80))
+			return p;
+	}
+	return NULL;
+}
+
+int
+stats_wire_encode(struct incr_stats *stats, int nodes, unsigned char *buf, int max_size)
+{
+	if (max_size < 1) return 0;
+	unsigned char *p = buf, *end = buf + max_size;
+	*p++ = STATS_WIRE_VERSION;
+
+	path_t prev = 0;
+	for (int n = 0; n < nodes && end - p >= STATS_WIRE_MAX_RECORD; n++) {
+		p = varint_put(p, zigzag(stats[n].coord_path - prev));
+		prev = stats[n].coord_path;
+
+		floating_t v = stats[n].incr.value;
+		int q = v <= 0 ? 0 : v >= 1 ? 65535 : (int)lrint(v * 65535);
+		*p++ = q & 0xff;
+		*p++ = q >> 8;
+
+		p = varint_put(p, zigzag(stats[n].incr.playouts));
+	}
+	assert(p <= end);
+	return p - buf;
+}
+
+int
+stats_wire_decode(unsigned char *buf, int size, struct incr_stats *stats, int max_nodes)
+{
+	if (size < 1 || buf[0] != STATS_WIRE_VERSION) return -1;
+	unsigned char *p = buf + 1, *end = buf + size;
+
+	path_t prev = 0;
+	int n;
+	for (n = 0; p < end; n++) {
+		if (n >= max_nodes) return -1;
+
+		uint64_t x;
+		if (!(p = varint_get(p, end, &x))) return -1;
+		stats[n].coord_path = prev = prev + unzigzag(x);
+
+		if (end - p < 2) return -1;
+		stats[n].incr.value = (p[0] | p[1] << 8) / (floating_t)65535;
+		p += 2;
+
+		if (!(p = varint_get(p, end, &x))) return -1;
+		stats[n].incr.playouts = unzigzag(x);
+	}
+	return n;
+}
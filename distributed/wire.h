@@ -0,0 +1,36 @@
+#ifndef PACHI_DISTRIBUTED_WIRE_H
+#define PACHI_DISTRIBUTED_WIRE_H
+
+/* Compact wire format of the incremental stats exchanged between
+ * master and slaves, in both directions. The arrays are sorted by
+ * coord path, so each record stores only the difference with the
+ * previous path:
+ *
+ *   version byte (STATS_WIRE_VERSION)
+ *   for each node:
+ *     varint   zigzag(coord_path - previous coord_path)
+ *     uint16   value quantized to 1/65535, little endian
+ *     varint   zigzag(playouts)
+ *
+ * varints are little-endian base 128. A typical record takes 5-7
+ * bytes instead of sizeof(struct incr_stats). Values lose some
+ * precision, which is negligible compared to the noise of the
+ * playouts themselves. Master and slaves must use the same version. */
+
+#include "distributed/distributed.h"
+
+#define STATS_WIRE_VERSION 1
+
+/* Worst case size of one encoded record. */
+#define STATS_WIRE_MAX_RECORD (10 + 2 + 5)
+
+/* Encode nodes stats in buf, stopping early rather than write more
+ * than max_size bytes. Return the encoded size. */
+int stats_wire_encode(struct incr_stats *stats, int nodes, unsigned char *buf, int max_size);
+
+/* Decode size bytes from buf. Return the number of nodes stored
+ * in stats, or -1 if the buffer is invalid or has more than
+ * max_nodes nodes. */
+int stats_wire_decode(unsigned char *buf, int size, struct incr_stats *stats, int max_nodes);
+
+#endif
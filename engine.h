@@ -23,6 +23,10 @@ typedef char *(*engine_genmoves_t)(struct engine *e, struct board *b, struct tim
  * simulate each move from b->f[i] for time @ti, then set
  * 1-max(opponent_win_likelihood) in vals[i]. */
 typedef void (*engine_evaluate_t)(struct engine *e, struct board *b, struct time_info *ti, floating_t *vals, enum stone color);
+/* Like evaluate, for @n positions at once (e.g. all the positions of
+ * a game record, in order): player @colors[i] in @boards[i], setting
+ * vals[i][boards[i]->flen]. Without time limit. */
+typedef void (*engine_evaluate_batch_t)(struct engine *e, int n, struct board *boards, enum stone *colors, floating_t **vals);
 /* One dead group per queued move (coord_t is (ab)used as group_t). */
 typedef void (*engine_dead_group_list_t)(struct engine *e, struct board *b, struct move_queue *mq);
 /* Pause any background thinking being done, but do not tear down
@@ -30,6 +34,13 @@ typedef void (*engine_dead_group_list_t)(struct engine *e, struct board *b, stru
 typedef void (*engine_stop_t)(struct engine *e);
 /* e->data and e will be free()d by caller afterwards. */
 typedef void (*engine_done_t)(struct engine *e);
+/* Search the position with color to play in the background, streaming
+ * the candidates on stdout every interval seconds. The caller opened
+ * the GTP response; interval 0 stops the analysis and ends it. */
+typedef void (*engine_analyze_t)(struct engine *e, struct board *b, enum stone color, double interval);
+/* Root candidates of the last genmove search by decreasing visits,
+ * for training data. Returns how many were stored, at most @max. */
+typedef int (*engine_root_stats_t)(struct engine *e, coord_t *coords, int *visits, int max);
 
 /* GoGui hooks */
 typedef float (*engine_owner_map_t)(struct engine *e, struct board *b, coord_t c);
@@ -54,9 +65,12 @@ struct engine {
 	engine_genmove_t genmove;
 	engine_genmoves_t genmoves;
 	engine_evaluate_t evaluate;
+	engine_evaluate_batch_t evaluate_batch;
 	engine_dead_group_list_t dead_group_list;
 	engine_stop_t stop;
 	engine_done_t done;
+	engine_analyze_t analyze;
+	engine_root_stats_t root_stats;
 	engine_owner_map_t owner_map;
 	engine_best_moves_t best_moves;
 	engine_live_gfx_hook_t live_gfx_hook;
@@ -1,16 +1,42 @@
 #include <assert.h>
+#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 #define DEBUG
 
 #include "board.h"
 #include "debug.h"
 #include "fbook.h"
+#include "memstats.h"
 #include "random.h"
 
 
+/* Compiled book file: header, section directory with one section per
+ * board size and handicap, then for each section its hash table entries
+ * followed by its candidate moves. All offsets are from the start of
+ * the file, so the file can be mmap'ed and shared between processes. */
+
+#define FBOOK_MAGIC "PACHIFB1"
+
+struct fbook_header {
+	char magic[8];
+	uint32_t sections;
+	uint32_t entry_size; // sizeof(struct fbook_entry)
+};
+
+struct fbook_section {
+	int32_t bsize, handicap;
+	uint32_t slots, moves_n;
+	uint64_t offset;
+};
+
+
 static coord_t
 coord_transform(struct board *b, coord_t coord, int i)
 {
@@ -29,62 +55,137 @@ coord_transform(struct board *b, coord_t coord, int i)
 	return coord;
 }
 
+struct fbook_entry *
+fbook_lookup(struct fbook *fbook, hash_t hash)
+{
+	for (uint32_t i = hash & fbook->hash_mask; fbook->entries[i].count; i = (i + 1) & fbook->hash_mask)
+		if (fbook->entries[i].hash == hash)
+			return &fbook->entries[i];
+	return NULL;
+}
+
 /* Check if we can make a move along the fbook right away.
- * Otherwise return pass. */
+ * Otherwise return pass. The book is loaded at the first call. */
 coord_t
 fbook_check(struct board *board)
 {
+	if (!board->fbook_checked) {
+		board->fbook_checked = true;
+		if (board->fbookfile)
+			board->fbook = fbook_init(board->fbookfile, board);
+	}
 	if (!board->fbook) return pass;
 
-	hash_t hi = board->hash;
+	struct fbook_entry *e = fbook_lookup(board->fbook, board->hash);
 	coord_t cf = pass;
-	while (!is_pass(board->fbook->moves[hi & fbook_hash_mask])) {
-		if (board->fbook->hashes[hi & fbook_hash_mask] == board->hash) {
-			cf = board->fbook->moves[hi & fbook_hash_mask];
-			break;
-		}
-		hi++;
+	if (e) {
+		/* In case of multiple candidates, pick one with
+		 * exponentially decreasing likelihood. */
+		uint32_t k = 0;
+		while (k + 1 < e->count && fast_random(2))
+			k++;
+		cf = board->fbook->moves[e->first + k];
 	}
 	if (!is_pass(cf)) {
 		if (DEBUGL(1))
-			fprintf(stderr, "fbook match %"PRIhash":%"PRIhash"\n", board->hash, board->hash & fbook_hash_mask);
+			fprintf(stderr, "fbook match %"PRIhash":%"PRIhash"\n", board->hash, board->hash & board->fbook->hash_mask);
 	} else {
 		/* No match, also prevent further fbook usage
 		 * until the next clear_board. */
 		if (DEBUGL(4))
-			fprintf(stderr, "fbook out %"PRIhash":%"PRIhash"\n", board->hash, board->hash & fbook_hash_mask);
+			fprintf(stderr, "fbook out %"PRIhash":%"PRIhash"\n", board->hash, board->hash & board->fbook->hash_mask);
 		fbook_done(board->fbook);
 		board->fbook = NULL;
 	}
 	return cf;
 }
 
-static struct fbook *fbcache;
 
-struct fbook *
-fbook_init(char *filename, struct board *b)
+/* Positions of the text book, in the order they are read. */
+struct fbook_builder {
+	struct fbook_rec {
+		hash_t hash;
+		int seq; // later lines override earlier ones
+		uint32_t first, count;
+	} *recs;
+	int recs_n, recs_size;
+	int32_t *moves;
+	int moves_n, moves_size;
+};
+
+static void
+fbook_builder_add(struct fbook_builder *fb, hash_t hash, coord_t *moves, int count)
 {
-	if (fbcache && fbcache->bsize == board_size(b)
-	    && fbcache->handicap == b->handicap)
-		return fbcache;
+	if (fb->recs_n == fb->recs_size) {
+		fb->recs_size = fb->recs_size ? fb->recs_size * 2 : 1024;
+		fb->recs = realloc2(fb->recs, fb->recs_size * sizeof(*fb->recs));
+	}
+	while (fb->moves_n + count > fb->moves_size) {
+		fb->moves_size = fb->moves_size ? fb->moves_size * 2 : 1024;
+		fb->moves = realloc2(fb->moves, fb->moves_size * sizeof(*fb->moves));
+	}
+	fb->recs[fb->recs_n] = (struct fbook_rec){ .hash = hash, .seq = fb->recs_n,
+						   .first = fb->moves_n, .count = count };
+	fb->recs_n++;
+	for (int i = 0; i < count; i++)
+		fb->moves[fb->moves_n++] = moves[i];
+}
 
-	FILE *f = fopen(filename, "r");
-	if (!f) {
-		perror(filename);
-		return NULL;
+static int
+fbook_rec_cmp(const void *a_, const void *b_)
+{
+	const struct fbook_rec *a = a_, *b = b_;
+	if (a->hash != b->hash)
+		return a->hash < b->hash ? -1 : 1;
+	return a->seq - b->seq;
+}
+
+/* Build the hash table of fbook from the positions, in a single
+ * allocation at fbook->entries. */
+static void
+fbook_builder_finish(struct fbook_builder *fb, struct fbook *fbook)
+{
+	qsort(fb->recs, fb->recs_n, sizeof(*fb->recs), fbook_rec_cmp);
+	/* Keep only the last line for each position. */
+	int n = 0, moves_n = 0;
+	for (int i = 0; i < fb->recs_n; i++) {
+		if (i + 1 < fb->recs_n && fb->recs[i + 1].hash == fb->recs[i].hash)
+			continue;
+		fb->recs[n++] = fb->recs[i];
+		moves_n += fb->recs[i].count;
 	}
 
-	struct fbook *fbook = calloc(1, sizeof(*fbook));
-	fbook->bsize = board_size(b);
-	fbook->handicap = b->handicap;
-	/* We do not set handicap=1 in case of too low komi on purpose;
-	 * we want to go with the no-handicap fbook for now. */
-	for (int i = 0; i < 1<<fbook_hash_bits; i++)
-		fbook->moves[i] = pass;
+	uint32_t slots = 16;
+	while (slots < 2 * (uint32_t) n)
+		slots *= 2;
+	size_t entries_size = slots * sizeof(struct fbook_entry);
+	fbook->size = entries_size + moves_n * sizeof(int32_t);
+	fbook->entries = calloc2(1, fbook->size);
+	fbook->moves = (int32_t *)((char *)fbook->entries + entries_size);
+	fbook->hash_mask = slots - 1;
+	fbook->movecnt = n;
 
-	if (DEBUGL(1))
-		fprintf(stderr, "Loading opening fbook %s...\n", filename);
+	moves_n = 0;
+	for (int i = 0; i < n; i++) {
+		struct fbook_rec *r = &fb->recs[i];
+		uint32_t s = r->hash & fbook->hash_mask;
+		while (fbook->entries[s].count)
+			s = (s + 1) & fbook->hash_mask;
+		fbook->entries[s] = (struct fbook_entry){ .hash = r->hash, .first = moves_n, .count = r->count };
+		memcpy(&fbook->moves[moves_n], &fb->moves[r->first], r->count * sizeof(int32_t));
+		moves_n += r->count;
+	}
+
+	free(fb->recs);
+	free(fb->moves);
+	memset(fb, 0, sizeof(*fb));
+}
 
+/* Parse the lines of the text book for the size and handicap
+ * of fbook. */
+static void
+fbook_parse(FILE *f, struct fbook *fbook)
+{
 	/* Scratch board where we lay out the sequence;
 	 * one for each transposition. */
 	struct board *bs[8];
@@ -92,6 +193,7 @@ fbook_init(char *filename, struct board *b)
 		bs[i] = board_init(NULL);
 		board_resize(bs[i], fbook->bsize - 2);
 	}
+	struct fbook_builder fb = { 0 };
 
 	char linebuf[1024];
 	while (fgets(linebuf, sizeof(linebuf), f)) {
@@ -122,7 +224,7 @@ fbook_init(char *filename, struct board *b)
 			coord_t *c = str2coord(line, fbook->bsize);
 
 			for (int i = 0; i < 8; i++) {
-				coord_t coord = coord_transform(b, *c, i);
+				coord_t coord = coord_transform(bs[i], *c, i);
 				struct move m = { .coord = coord, .color = stone_other(bs[i]->last_move.color) };
 				int ret = board_play(bs[i], &m);
 				assert(ret >= 0);
@@ -136,47 +238,153 @@ fbook_init(char *filename, struct board *b)
 		line++;
 		while (isspace(*line)) line++;
 
-		/* In case of multiple candidates, pick one with
-		 * exponentially decreasing likelihood. */
-		while (strchr(line, ' ') && fast_random(2)) {
-			line = strchr(line, ' ');
+		/* All candidates are kept, fbook_check() picks one. */
+		coord_t cands[256];
+		int n = 0;
+		while (*line && n < 256) {
+			coord_t *c = str2coord(line, fbook->bsize);
+			cands[n++] = *c;
+			coord_done(c);
+			while (*line && !isspace(*line)) line++;
 			while (isspace(*line)) line++;
-			// fprintf(stderr, "<%s> skip to %s\n", linebuf, line);
 		}
+		if (!n)
+			continue;
 
-		coord_t *c = str2coord(line, fbook->bsize);
 		for (int i = 0; i < 8; i++) {
-			coord_t coord = coord_transform(b, *c, i);
-#if 0
-			char conflict = is_pass(fbook->moves[bs[i]->hash & fbook_hash_mask]) ? '+' : 'C';
-			if (conflict == 'C')
-				for (int j = 0; j < i; j++)
-					if (bs[i]->hash == bs[j]->hash)
-						conflict = '+';
-			if (conflict == 'C') {
-				hash_t hi = bs[i]->hash;
-				while (!is_pass(fbook->moves[hi & fbook_hash_mask]) && fbook->hashes[hi & fbook_hash_mask] != bs[i]->hash)
-					hi++;
-				if (fbook->hashes[hi & fbook_hash_mask] == bs[i]->hash)
-					hi = 'c';
-			}
-			fprintf(stderr, "%c %"PRIhash":%"PRIhash" (<%d> %s)\n", conflict,
-			        bs[i]->hash & fbook_hash_mask, bs[i]->hash, i, linebuf);
-#endif
-			hash_t hi = bs[i]->hash;
-			while (!is_pass(fbook->moves[hi & fbook_hash_mask]) && fbook->hashes[hi & fbook_hash_mask] != bs[i]->hash)
-				hi++;
-			fbook->moves[hi & fbook_hash_mask] = coord;
-			fbook->hashes[hi & fbook_hash_mask] = bs[i]->hash;
-			fbook->movecnt++;
+			coord_t moves[n];
+			for (int j = 0; j < n; j++)
+				moves[j] = coord_transform(bs[i], cands[j], i);
+			fbook_builder_add(&fb, bs[i]->hash, moves, n);
 		}
-		coord_done(c);
 	}
 
 	for (int i = 0; i < 8; i++) {
 		board_done(bs[i]);
 	}
 
+	fbook_builder_finish(&fb, fbook);
+}
+
+/* Map the section of the compiled book for the size and handicap
+ * of fbook. Returns false if there is none or the file is invalid. */
+static bool
+fbook_map(FILE *f, struct fbook *fbook)
+{
+#ifndef _WIN32
+	struct stat st;
+	if (fstat(fileno(f), &st))
+		return false;
+	size_t size = st.st_size;
+	void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fileno(f), 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return false;
+	}
+#else
+	fseek(f, 0, SEEK_END);
+	size_t size = ftell(f);
+	rewind(f);
+	void *map = malloc2(size);
+	if (fread(map, size, 1, f) != 1) {
+		free(map);
+		return false;
+	}
+#endif
+
+	struct fbook_header *h = map;
+	struct fbook_section *s = (struct fbook_section *)(h + 1);
+	bool found = false;
+	if (size >= sizeof(*h) && h->entry_size == sizeof(struct fbook_entry)
+	    && sizeof(*h) + (size_t) h->sections * sizeof(*s) <= size) {
+		for (uint32_t i = 0; i < h->sections; i++, s++) {
+			if (s->bsize != fbook->bsize || s->handicap != fbook->handicap)
+				continue;
+			size_t end = s->offset + (size_t) s->slots * sizeof(struct fbook_entry)
+				+ (size_t) s->moves_n * sizeof(int32_t);
+			if (!s->slots || (s->slots & (s->slots - 1)) || end > size) {
+				fprintf(stderr, "fbook: corrupted section %d/%d\n", s->bsize - 2, s->handicap);
+				break;
+			}
+			fbook->entries = (struct fbook_entry *)((char *)map + s->offset);
+			fbook->moves = (int32_t *)(fbook->entries + s->slots);
+			fbook->hash_mask = s->slots - 1;
+			found = true;
+			break;
+		}
+	}
+	if (!found) {
+#ifndef _WIN32
+		munmap(map, size);
+#else
+		free(map);
+#endif
+		return false;
+	}
+	fbook->map = map;
+	fbook->map_size = fbook->size = size;
+	for (uint32_t i = 0; i <= fbook->hash_mask; i++) {
+		if (!fbook->entries[i].count)
+			continue;
+		if (fbook->entries[i].first + fbook->entries[i].count > s->moves_n) {
+			fprintf(stderr, "fbook: corrupted section %d/%d\n", s->bsize - 2, s->handicap);
+			fbook->movecnt = 0;
+			break;
+		}
+		fbook->movecnt++;
+	}
+	return true;
+}
+
+/* All books loaded so far; boards of different sizes and handicaps
+ * may be in play at once (e.g. in the multi-game server), so they are
+ * kept for the rest of the run. */
+static struct fbook *fbcache;
+
+struct fbook *
+fbook_init(char *filename, struct board *b)
+{
+	for (struct fbook *fb = fbcache; fb; fb = fb->next)
+		if (fb->bsize == board_size(b) && fb->handicap == b->handicap)
+			return fb;
+
+	/* We do not set handicap=1 in case of too low komi on purpose;
+	 * we want to go with the no-handicap fbook for now. */
+	struct fbook *fbook = fbook_load(filename, board_size(b), b->handicap);
+	if (!fbook)
+		return NULL;
+
+	/* Cached books are never freed. */
+	mem_account(MEM_FBOOK, fbook->size);
+	fbook->next = fbcache;
+	fbcache = fbook;
+	return fbook;
+}
+
+struct fbook *
+fbook_load(char *filename, int bsize, int handicap)
+{
+	FILE *f = fopen(filename, "r");
+	if (!f) {
+		perror(filename);
+		return NULL;
+	}
+
+	struct fbook *fbook = calloc2(1, sizeof(*fbook));
+	fbook->bsize = bsize;
+	fbook->handicap = handicap;
+
+	if (DEBUGL(1))
+		fprintf(stderr, "Loading opening fbook %s...\n", filename);
+
+	char magic[8];
+	if (fread(magic, sizeof(magic), 1, f) == 1 && !memcmp(magic, FBOOK_MAGIC, sizeof(magic))) {
+		fbook_map(f, fbook);
+	} else {
+		rewind(f);
+		fbook_parse(f, fbook);
+	}
+
 	fclose(f);
 
 	if (!fbook->movecnt) {
@@ -184,17 +392,103 @@ fbook_init(char *filename, struct board *b)
 		fbook_done(fbook);
 		return NULL;
 	}
-
-	struct fbook *fbold = fbcache;
-	fbcache = fbook;
-	if (fbold)
-		fbook_done(fbold);
-
 	return fbook;
 }
 
+static void
+fbook_free(struct fbook *fbook)
+{
+	if (fbook->map) {
+#ifndef _WIN32
+		munmap(fbook->map, fbook->map_size);
+#else
+		free(fbook->map);
+#endif
+	} else {
+		free(fbook->entries);
+	}
+	free(fbook);
+}
+
 void fbook_done(struct fbook *fbook)
 {
-	if (fbook != fbcache)
-		free(fbook);
+	for (struct fbook *fb = fbcache; fb; fb = fb->next)
+		if (fb == fbook)
+			return;
+	fbook_free(fbook);
+}
+
+
+bool
+fbook_compile(char *infile, char *outfile)
+{
+	FILE *f = fopen(infile, "r");
+	if (!f) {
+		perror(infile);
+		return false;
+	}
+
+	/* Find all the sizes and handicaps in the book. */
+	struct fbook_section sections[64];
+	int sections_n = 0;
+	char linebuf[1024];
+	while (fgets(linebuf, sizeof(linebuf), f)) {
+		char *line = linebuf;
+		int bsize = strtol(line, &line, 10);
+		if (bsize < 1 || bsize > BOARD_MAX_SIZE)
+			continue;
+		int handi = *line == '/' ? atoi(line + 1) : 0;
+		int i;
+		for (i = 0; i < sections_n; i++)
+			if (sections[i].bsize == bsize + 2 && sections[i].handicap == handi)
+				break;
+		if (i == sections_n && sections_n < 64)
+			sections[sections_n++] = (struct fbook_section){ .bsize = bsize + 2, .handicap = handi };
+	}
+
+	FILE *out = fopen(outfile, "wb");
+	if (!out) {
+		perror(outfile);
+		fclose(f);
+		return false;
+	}
+	struct fbook_header h = { .sections = sections_n, .entry_size = sizeof(struct fbook_entry) };
+	memcpy(h.magic, FBOOK_MAGIC, sizeof(h.magic));
+	uint64_t offset = sizeof(h) + sections_n * sizeof(*sections);
+	fseek(out, offset, SEEK_SET);
+
+	for (int i = 0; i < sections_n; i++) {
+		struct fbook fbook = { .bsize = sections[i].bsize, .handicap = sections[i].handicap };
+		rewind(f);
+		fbook_parse(f, &fbook);
+
+		struct fbook_section *s = &sections[i];
+		s->slots = fbook.hash_mask + 1;
+		s->moves_n = 0;
+		for (uint32_t j = 0; j < s->slots; j++)
+			s->moves_n += fbook.entries[j].count;
+		s->offset = offset;
+		fwrite(fbook.entries, sizeof(struct fbook_entry), s->slots, out);
+		fwrite(fbook.moves, sizeof(int32_t), s->moves_n, out);
+		offset += s->slots * sizeof(struct fbook_entry) + s->moves_n * sizeof(int32_t);
+		/* Keep the next section aligned. */
+		while (offset % sizeof(hash_t)) {
+			fputc(0, out);
+			offset++;
+		}
+		if (DEBUGL(1))
+			fprintf(stderr, "fbook %d/%d: %d positions, %u slots\n",
+				s->bsize - 2, s->handicap, fbook.movecnt, s->slots);
+		free(fbook.entries);
+	}
+
+	rewind(out);
+	fwrite(&h, sizeof(h), 1, out);
+	fwrite(sections, sizeof(*sections), sections_n, out);
+	fclose(f);
+	if (fclose(out)) {
+		perror(outfile);
+		return false;
+	}
+	return true;
 }
@@ -1,6 +1,9 @@
 #ifndef PACHI_FBOOK_H
 #define PACHI_FBOOK_H
 
+#include <stdbool.h>
+#include <stdint.h>
+
 #include "move.h"
 
 struct board;
@@ -8,21 +11,49 @@ struct board;
 /* Opening book (fbook as in "forcing book" since the move is just
  * played unconditionally if found, or possibly "fuseki book"). */
 
+/* Book position; the candidate moves are moves[first .. first+count-1]. */
+struct fbook_entry {
+	hash_t hash;
+	uint32_t first;
+	uint32_t count; // 0 == free slot
+};
+
 struct fbook {
 	int bsize;
 	int handicap;
 
-	int movecnt;
+	int movecnt; // number of positions
+
+	/* Open addressing hash table with linear probing,
+	 * at most half full. */
+	uint32_t hash_mask;
+	struct fbook_entry *entries;
+	int32_t *moves; // candidates, in the order of the book
+
+	/* Compiled book mmap'ed by fbook_init(), or NULL. Otherwise
+	 * entries and moves are allocated at once at entries. */
+	void *map;
+	size_t map_size;
+	/* Bytes taken by the book, mapped or not (see memstats.h). */
+	size_t size;
 
-#define fbook_hash_bits 20 // 12M w/ 32-bit coord_t
-#define fbook_hash_mask ((1 << fbook_hash_bits) - 1)
-	/* pass == no move in this position */
-	coord_t moves[1<<fbook_hash_bits];
-	hash_t hashes[1<<fbook_hash_bits];
+	/* Next book loaded by fbook_init(). */
+	struct fbook *next;
 };
 
 coord_t fbook_check(struct board *board);
+/* Load the book for the size and handicap of b. filename is either
+ * the text book or a book compiled by fbook_compile(). */
 struct fbook *fbook_init(char *filename, struct board *b);
 void fbook_done(struct fbook *fbook);
+/* Load the book of filename for given size and handicap like
+ * fbook_init(), but not shared; free it with fbook_done(). */
+struct fbook *fbook_load(char *filename, int bsize, int handicap);
+/* Book entry of the position with given hash, or NULL. */
+struct fbook_entry *fbook_lookup(struct fbook *fbook, hash_t hash);
+
+/* Compile the text book infile for all board sizes and handicaps
+ * it contains to outfile. Returns false on error. */
+bool fbook_compile(char *infile, char *outfile);
 
 #endif
@@ -2,6 +2,7 @@
 #include <assert.h>
 #include <ctype.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -13,7 +14,9 @@
 #include "engine.h"
 #include "fbook.h"
 #include "gtp.h"
+#include "memstats.h"
 #include "mq.h"
+#include "perfstats.h"
 #include "uct/uct.h"
 #include "version.h"
 #include "timeinfo.h"
@@ -24,10 +27,18 @@
 /* Sleep 5 seconds after a game ends to give time to kill the program. */
 #define GAME_OVER_SLEEP 5
 
+/* With asynchronous input, replies come from two threads, so stdout
+ * is locked from the prefix to the final flush of each. */
+static __thread bool reply_locked;
+
 void
 gtp_prefix(char prefix, int id)
 {
 	if (id == NO_REPLY) return;
+	if (!reply_locked) {
+		flockfile(stdout);
+		reply_locked = true;
+	}
 	if (id >= 0)
 		printf("%c%d ", prefix, id);
 	else
@@ -39,6 +50,10 @@ gtp_flush(void)
 {
 	putchar('\n');
 	fflush(stdout);
+	if (reply_locked) {
+		reply_locked = false;
+		funlockfile(stdout);
+	}
 }
 
 void
@@ -72,7 +87,7 @@ gtp_error(int id, ...)
 	va_end(params);
 }
 
-static void
+void
 gtp_final_score(struct board *board, struct engine *engine, char *reply, int len)
 {
 	struct move_queue q = { .moves = 0 };
@@ -114,10 +129,13 @@ static char *known_commands_base =
 	"final_status_list\n"
 	"undo\n"
 	"pachi-evaluate\n"
+	"pachi-evaluate_moves\n"
 	"pachi-result\n"
 	"pachi-gentbook\n"
 	"pachi-dumptbook\n"
 	"pachi-predict\n"
+	"pachi-perfstats\n"
+	"pachi-memstats\n"
 	"kgs-chat\n"
 	"time_left\n"
 	"time_settings\n"
@@ -131,9 +149,9 @@ known_commands(struct engine *engine)
 		return str;
 	if (strcmp(engine->name, "UCT"))  /* Not uct ? */
 		return known_commands_base;
-	/* For now only uct supports gogui-analyze_commands */
-	str = malloc(strlen(known_commands_base) + 32);
-	sprintf(str, "%s\ngogui-analyze_commands", known_commands_base);
+	/* For now only uct supports gogui-analyze_commands and lz-analyze */
+	str = malloc(strlen(known_commands_base) + 48);
+	sprintf(str, "%s\ngogui-analyze_commands\nlz-analyze", known_commands_base);
 	return str;
 }
 
@@ -288,12 +306,6 @@ gtp_predict_move(struct board *board, struct engine *engine, struct time_info *t
 }
 
 
-/* XXX: THIS IS TOTALLY INSECURE!!!!
- * Even basic input checking is missing. */
-
-enum parse_code
-gtp_parse(struct board *board, struct engine *engine, struct time_info *ti, char *buf)
-{
 #define next_tok(to_) \
 	to_ = next; \
 	next = next + strcspn(next, " \t\r\n"); \
@@ -302,41 +314,26 @@ gtp_parse(struct board *board, struct engine *engine, struct time_info *ti, char
 		next += strspn(next, " \t\r\n"); \
 	}
 
-	if (strchr(buf, '#'))
-		*strchr(buf, '#') = 0;
-
-	char *cmd, *next = buf;
-	next_tok(cmd);
-
-	int id = -1;
-	if (isdigit(*cmd)) {
-		id = atoi(cmd);
-		next_tok(cmd);
-	}
-
-	if (!*cmd)
-		return P_OK;
-
+/* The commands which do not depend on the game state; returns
+ * whether @cmd was one of them (and was answered). */
+static bool
+gtp_query(struct engine *engine, int id, char *cmd, char *next)
+{
 	if (!strcasecmp(cmd, "protocol_version")) {
 		gtp_reply(id, "2", NULL);
-		return P_OK;
 
 	} else if (!strcasecmp(cmd, "name")) {
 		/* KGS hack */
 		gtp_reply(id, "Pachi ", engine->name, NULL);
-		return P_OK;
 
 	} else if (!strcasecmp(cmd, "echo")) {
 		gtp_reply(id, next, NULL);
-		return P_OK;
 
 	} else if (!strcasecmp(cmd, "version")) {
 		gtp_reply(id, PACHI_VERSION, ": ", engine->comment, " Have a nice game!", NULL);
-		return P_OK;
 
 	} else if (!strcasecmp(cmd, "list_commands")) {
 		gtp_reply(id, known_commands(engine), NULL);
-		return P_OK;
 
 	} else if (!strcasecmp(cmd, "known_command")) {
 		char *arg;
@@ -346,8 +343,181 @@ gtp_parse(struct board *board, struct engine *engine, struct time_info *ti, char
 		} else {
 			gtp_reply(id, "false", NULL);
 		}
+
+	} else {
+		return false;
+	}
+	return true;
+}
+
+
+/* Asynchronous input: a reader thread queues the commands, and
+ * answers the queries (see gtp_query()) by itself while the main
+ * thread is busy with another command, e.g. in a genmove search,
+ * as long as no command is pending before them. A time_left is
+ * answered at once too, and still queued to be applied in order,
+ * without a reply. */
+
+struct gtp_line {
+	char *buf;
+	bool answered; // parse silently
+	struct gtp_line *next;
+};
+
+static bool async_input;
+static pthread_mutex_t async_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_cond = PTHREAD_COND_INITIALIZER;
+static struct gtp_line *async_head, **async_tail = &async_head;
+static bool async_eof;
+/* Engine of the command being parsed by the main thread, if any. */
+static struct engine *async_busy;
+/* The command being parsed was answered by the reader already. */
+static bool async_answered;
+
+/* Answer @buf in the reader thread if it can be: P_DONE_OK if done,
+ * P_NOREPLY if it still needs parsing, else P_OK. */
+static enum parse_code
+gtp_async_answer(struct engine *engine, char *buf)
+{
+	char line[strlen(buf) + 1];
+	strcpy(line, buf);
+	if (strchr(line, '#'))
+		*strchr(line, '#') = 0;
+
+	char *cmd, *next = line;
+	next_tok(cmd);
+	int id = -1;
+	if (isdigit(*cmd)) {
+		id = atoi(cmd);
+		next_tok(cmd);
+	}
+	if (!*cmd)
+		return P_OK;
+
+	if (!strcasecmp(cmd, "time_left")) {
+		gtp_reply(id, NULL);
+		return P_NOREPLY;
+	}
+	if (!gtp_is_valid(engine, cmd) || !gtp_query(engine, id, cmd, next))
 		return P_OK;
+	return P_DONE_OK;
+}
+
+static void *
+gtp_async_reader(void *data)
+{
+	char buf[4096];
+	while (fgets(buf, sizeof(buf), stdin)) {
+		pthread_mutex_lock(&async_mutex);
+		enum parse_code c = P_OK;
+		if (async_busy && !async_head)
+			c = gtp_async_answer(async_busy, buf);
+		if (c != P_OK && DEBUGL(1))
+			fprintf(stderr, "IN (answered while busy): %s", buf);
+		if (c != P_DONE_OK) {
+			struct gtp_line *l = malloc2(sizeof(*l));
+			*l = (struct gtp_line) { .buf = strdup(buf), .answered = c == P_NOREPLY };
+			*async_tail = l;
+			async_tail = &l->next;
+			pthread_cond_signal(&async_cond);
+		}
+		pthread_mutex_unlock(&async_mutex);
+	}
+
+	pthread_mutex_lock(&async_mutex);
+	async_eof = true;
+	pthread_cond_signal(&async_cond);
+	pthread_mutex_unlock(&async_mutex);
+	return NULL;
+}
+
+void
+gtp_async_start(void)
+{
+	/* A reader is still there, e.g. after a gtp connection
+	 * dropped by us is reopened. */
+	if (async_input && !async_eof)
+		return;
+	async_input = true;
+	async_eof = false;
+	pthread_t thread;
+	pthread_create(&thread, NULL, gtp_async_reader, NULL);
+	pthread_detach(thread);
+}
+
+bool
+gtp_async_gets(char *buf, int size)
+{
+	pthread_mutex_lock(&async_mutex);
+	while (!async_head && !async_eof)
+		pthread_cond_wait(&async_cond, &async_mutex);
+	struct gtp_line *l = async_head;
+	if (l) {
+		async_head = l->next;
+		if (!async_head)
+			async_tail = &async_head;
+		snprintf(buf, size, "%s", l->buf);
+		async_answered = l->answered;
+		free(l->buf);
+		free(l);
 	}
+	pthread_mutex_unlock(&async_mutex);
+	return l;
+}
+
+
+static enum parse_code gtp_parse_cmd(struct board *board, struct engine *engine, struct time_info *ti, char *buf);
+
+enum parse_code
+gtp_parse(struct board *board, struct engine *engine, struct time_info *ti, char *buf)
+{
+	if (!async_input)
+		return gtp_parse_cmd(board, engine, ti, buf);
+
+	known_commands(engine); // built before the reader looks at it
+	pthread_mutex_lock(&async_mutex);
+	async_busy = engine;
+	pthread_mutex_unlock(&async_mutex);
+
+	enum parse_code c = gtp_parse_cmd(board, engine, ti, buf);
+
+	/* The engine may be reset now. */
+	pthread_mutex_lock(&async_mutex);
+	async_busy = NULL;
+	async_answered = false;
+	pthread_mutex_unlock(&async_mutex);
+	return c;
+}
+
+/* XXX: THIS IS TOTALLY INSECURE!!!!
+ * Even basic input checking is missing. */
+
+static enum parse_code
+gtp_parse_cmd(struct board *board, struct engine *engine, struct time_info *ti, char *buf)
+{
+	if (strchr(buf, '#'))
+		*strchr(buf, '#') = 0;
+
+	char *cmd, *next = buf;
+	next_tok(cmd);
+
+	int id = -1;
+	if (isdigit(*cmd)) {
+		id = atoi(cmd);
+		next_tok(cmd);
+	}
+	if (async_answered)
+		id = NO_REPLY;
+
+	if (!*cmd)
+		return P_OK;
+
+	/* Any command ends a running lz-analyze. */
+	if (engine->analyze)
+		engine->analyze(engine, board, S_NONE, 0);
+
+	if (gtp_query(engine, id, cmd, next))
+		return P_OK;
 
 	if (engine->notify && gtp_is_valid(engine, cmd)) {
 		char *reply;
@@ -369,7 +539,7 @@ gtp_parse(struct board *board, struct engine *engine, struct time_info *ti, char
 	    
 	if (!strcasecmp(cmd, "quit")) {
 		gtp_reply(id, NULL);
-		exit(0);
+		return P_QUIT;
 
 	} else if (!strcasecmp(cmd, "boardsize")) {
 		char *arg;
@@ -379,6 +549,13 @@ gtp_parse(struct board *board, struct engine *engine, struct time_info *ti, char
 			gtp_error(id, "illegal board size", NULL);
 			return P_OK;
 		}
+#ifdef BOARD_SIZE
+		if (size != BOARD_SIZE) {
+			/* Binary built for a single board size. */
+			gtp_error(id, "unacceptable size", NULL);
+			return P_OK;
+		}
+#endif
 		board_resize(board, size);
 		board_clear(board);
 		gtp_reply(id, NULL);
@@ -484,9 +661,7 @@ gtp_parse(struct board *board, struct engine *engine, struct time_info *ti, char
 			time_start_timer(&ti[color]);
 		}
 
-		coord_t cf = pass;
-		if (board->fbook)
-			cf = fbook_check(board);
+		coord_t cf = fbook_check(board);
 		if (!is_pass(cf)) {
 			c = coord_copy(cf);
 		} else {
@@ -689,6 +864,77 @@ next_group:;
 			gtp_flush();
 		}
 
+	} else if (!strcasecmp(cmd, "pachi-evaluate_moves")) {
+		/* pachi-evaluate_moves COLOR VERTEX...: rate each move of
+		 * the sequence (e.g. a game record) in the position it is
+		 * played in, starting from the current one, which is left
+		 * as is. One line per move: the move, its rating, the best
+		 * rated move and its rating. */
+		int n = 0;
+		struct move *moves = malloc2((strlen(next) / 4 + 1) * sizeof(*moves));
+		while (*next) {
+			char *arg;
+			next_tok(arg);
+			moves[n].color = str2stone(arg);
+			next_tok(arg);
+			coord_t *c = str2coord(arg, board_size(board));
+			moves[n].coord = *c; coord_done(c);
+			n++;
+		}
+
+		struct board *boards = calloc2(n, sizeof(*boards));
+		enum stone *colors = malloc2(n * sizeof(*colors));
+		floating_t **vals = malloc2(n * sizeof(*vals));
+		int ok = 0;
+		for (; ok < n; ok++) {
+			board_copy(&boards[ok], ok ? &boards[ok - 1] : board);
+			if (ok && board_play(&boards[ok], &moves[ok - 1]) < 0) {
+				board_done_noalloc(&boards[ok]);
+				break;
+			}
+			colors[ok] = moves[ok].color;
+			vals[ok] = malloc2(boards[ok].flen * sizeof(*vals[ok]));
+		}
+
+		if (!engine->evaluate_batch && !engine->evaluate) {
+			gtp_error(id, "pachi-evaluate_moves not supported by engine", NULL);
+		} else if (ok < n || (n && !is_pass(moves[n - 1].coord)
+		                      && !board_is_valid_move(&boards[n - 1], &moves[n - 1]))) {
+			gtp_error(id, "illegal move", NULL);
+		} else {
+			if (engine->evaluate_batch)
+				engine->evaluate_batch(engine, n, boards, colors, vals);
+			else
+				for (int i = 0; i < n; i++)
+					engine->evaluate(engine, &boards[i], &ti[colors[i]], vals[i], colors[i]);
+
+			gtp_prefix('=', id);
+			for (int i = 0; i < n; i++) {
+				struct board *b = &boards[i];
+				floating_t val = 0, best_val = 0;
+				coord_t best = pass;
+				for (int f = 0; f < b->flen; f++) {
+					if (isnan(vals[i][f]))
+						continue;
+					if (b->f[f] == moves[i].coord)
+						val = vals[i][f];
+					if (vals[i][f] > best_val) {
+						best_val = vals[i][f];
+						best = b->f[f];
+					}
+				}
+				printf("%s %.3f ", coord2sstr(moves[i].coord, b), (double) val);
+				printf("%s %.3f\n", coord2sstr(best, b), (double) best_val);
+			}
+			gtp_flush();
+		}
+
+		for (int i = 0; i < ok; i++) {
+			free(vals[i]);
+			board_done_noalloc(&boards[i]);
+		}
+		free(vals); free(colors); free(boards); free(moves);
+
 	} else if (!strcasecmp(cmd, "pachi-result")) {
 		/* More detailed result of the last genmove. */
 		/* For UCT, the output format is: = color move playouts winrate dynkomi */
@@ -800,6 +1046,51 @@ next_group:;
 		char *reply = gogui_best_moves(board, engine, arg, true);
 		gtp_reply(id, reply, NULL);
 
+	} else if (!strcasecmp(cmd, "pachi-perfstats")) {
+		/* pachi-perfstats [on|off|reset]: switch the hot path
+		 * counters, then report them (see perfstats.h). */
+		char *arg;
+		next_tok(arg);
+		if (!strcasecmp(arg, "on"))
+			perf_enabled = true;
+		else if (!strcasecmp(arg, "off"))
+			perf_enabled = false;
+		else if (!strcasecmp(arg, "reset"))
+			perf_reset();
+		char reply[4096];
+		perf_print(reply, sizeof(reply));
+		gtp_reply(id, reply, NULL);
+
+	} else if (!strcasecmp(cmd, "pachi-memstats")) {
+		/* pachi-memstats: memory held by each subsystem,
+		 * see memstats.h. */
+		char reply[4096];
+		mem_print(reply, sizeof(reply));
+		gtp_reply(id, reply, NULL);
+
+	} else if (!strcasecmp(cmd, "lz-analyze")) {
+		/* lz-analyze [COLOR] [interval] INTERVAL: search with COLOR
+		 * (default: the side to move) and report the candidates every
+		 * INTERVAL centiseconds, until the next command arrives. */
+		enum stone color = board->moves ? stone_other(board->last_move.color) : S_BLACK;
+		int interval = 100;
+		while (*next) {
+			char *arg;
+			next_tok(arg);
+			if (isdigit(*arg))
+				interval = atoi(arg);
+			else if (strcasecmp(arg, "interval"))
+				color = str2stone(arg);
+		}
+		if (!engine->analyze || color == S_NONE || interval <= 0) {
+			gtp_error(id, "cannot analyze", NULL);
+			return P_OK;
+		}
+		/* The response stays open, the engine streams into it. */
+		gtp_prefix('=', id);
+		gtp_flush();
+		engine->analyze(engine, board, color, interval / 100.0);
+
 	} else {
 		gtp_error(id, "unknown command", NULL);
 		return P_UNKNOWN_COMMAND;
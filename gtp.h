@@ -12,11 +12,20 @@ enum parse_code {
 	P_DONE_ERROR,
 	P_ENGINE_RESET,
 	P_UNKNOWN_COMMAND,
+	P_QUIT,
 };
 
 enum parse_code gtp_parse(struct board *b, struct engine *e, struct time_info *ti, char *buf);
+/* Read the commands from stdin in a background thread, answering
+ * the queries while gtp_parse() is busy (see gtp.c); the main thread
+ * gets the others with gtp_async_gets() instead of fgets(), which
+ * returns false at the end of input. */
+void gtp_async_start(void);
+bool gtp_async_gets(char *buf, int size);
 void gtp_reply(int id, ...);
 bool gtp_is_valid(struct engine *e, const char *cmd);
+/* Score the game over, as for final_score: "W+0.5", "B+12.0" or "0". */
+void gtp_final_score(struct board *board, struct engine *engine, char *reply, int len);
 
 #define is_gamestart(cmd) (!strcasecmp((cmd), "boardsize"))
 #define is_reset(cmd) (is_gamestart(cmd) || !strcasecmp((cmd), "clear_board") || !strcasecmp((cmd), "kgs-rules"))
@@ -1,28 +1,174 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 #define DEBUG
 #include "board.h"
 #include "debug.h"
+#include "memstats.h"
 #include "move.h"
 #include "joseki/base.h"
 
 
+/* Compiled dictionary file: header, then the hash table,
+ * then the move pool. */
+
+#define JOSEKI_MAGIC "PACHIJD1"
+
+struct joseki_header {
+	char magic[8];
+	int32_t bsize;
+	uint32_t slots, patterns_n, moves_n;
+	uint32_t coord_size; // sizeof(coord_t)
+};
+
+
 struct joseki_dict *
 joseki_init(int bsize)
 {
-	struct joseki_dict *jd = calloc(1, sizeof(*jd));
+	struct joseki_dict *jd = calloc2(1, sizeof(*jd));
 	jd->bsize = bsize;
-	jd->patterns = calloc(1 << joseki_hash_bits, sizeof(jd->patterns[0]));
+	jd->slots_mask = 1024 - 1;
+	jd->patterns = calloc2(jd->slots_mask + 1, sizeof(jd->patterns[0]));
+	mem_account(MEM_JOSEKI, (jd->slots_mask + 1) * sizeof(jd->patterns[0]));
 	return jd;
 }
 
-struct joseki_dict *
-joseki_load(int bsize)
+/* Returns the slot of key, or the free slot where it goes. */
+static uint32_t
+joseki_slot(struct joseki_dict *jd, uint32_t key)
+{
+	uint32_t i = key & jd->slots_mask;
+	while (jd->patterns[i].key && jd->patterns[i].key != key)
+		i = (i + 1) & jd->slots_mask;
+	return i;
+}
+
+static void
+joseki_grow(struct joseki_dict *jd)
+{
+	struct joseki_pattern *old = jd->patterns;
+	uint32_t old_slots = jd->slots_mask + 1;
+	jd->slots_mask = old_slots * 2 - 1;
+	jd->patterns = calloc2(old_slots * 2, sizeof(jd->patterns[0]));
+	mem_account(MEM_JOSEKI, old_slots * sizeof(jd->patterns[0]));
+	for (uint32_t i = 0; i < old_slots; i++)
+		if (old[i].key)
+			jd->patterns[joseki_slot(jd, old[i].key)] = old[i];
+	free(old);
+}
+
+/* Append n coords to the move pool, returns their offset. */
+static uint32_t
+joseki_pool_add(struct joseki_dict *jd, coord_t *cc, int n)
+{
+	while (jd->moves_n + n > jd->moves_size) {
+		uint32_t size = jd->moves_size ? jd->moves_size * 2 : 4096;
+		mem_account(MEM_JOSEKI, (size - jd->moves_size) * sizeof(coord_t));
+		jd->moves_size = size;
+		jd->moves = realloc2(jd->moves, jd->moves_size * sizeof(coord_t));
+	}
+	uint32_t first = jd->moves_n;
+	memcpy(&jd->moves[first], cc, n * sizeof(coord_t));
+	jd->moves_n += n;
+	return first;
+}
+
+/* Set the pass-terminated list of moves of key, growing the table
+ * if needed. The previous list, if any, is left unused in the pool. */
+static void
+joseki_set(struct joseki_dict *jd, uint32_t key, coord_t *cc, int n)
+{
+	assert(!jd->map);
+	if (2 * (jd->patterns_n + 1) > jd->slots_mask + 1)
+		joseki_grow(jd);
+	uint32_t i = joseki_slot(jd, key);
+	if (!jd->patterns[i].key) {
+		jd->patterns[i].key = key;
+		jd->patterns_n++;
+	}
+	jd->patterns[i].moves = joseki_pool_add(jd, cc, n);
+}
+
+bool
+joseki_add(struct joseki_dict *jd, hash_t qhash, enum stone color, coord_t c)
+{
+	coord_t *cc = joseki_moves(jd, qhash, color);
+	int count = 0;
+	if (cc) {
+		for (; !is_pass(cc[count]); count++)
+			if (cc[count] == c)
+				return false;
+	}
+	coord_t list[count + 2];
+	if (count)
+		memcpy(list, cc, count * sizeof(coord_t));
+	list[count] = c;
+	list[count + 1] = pass;
+	joseki_set(jd, joseki_key(qhash, color), list, count + 2);
+	return true;
+}
+
+static struct joseki_dict *
+joseki_map(char *fname, int bsize)
+{
+	FILE *f = fopen(fname, "rb");
+	if (!f)
+		return NULL;
+
+	struct joseki_header h;
+	if (fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, JOSEKI_MAGIC, sizeof(h.magic))
+	    || h.bsize != bsize || h.coord_size != sizeof(coord_t)
+	    || !h.slots || (h.slots & (h.slots - 1))) {
+		fprintf(stderr, "%s: invalid compiled joseki dictionary\n", fname);
+		fclose(f);
+		return NULL;
+	}
+	size_t size = sizeof(h) + (size_t) h.slots * sizeof(struct joseki_pattern)
+		+ (size_t) h.moves_n * sizeof(coord_t);
+
+#ifndef _WIN32
+	struct stat st;
+	void *map = MAP_FAILED;
+	if (!fstat(fileno(f), &st) && (size_t) st.st_size >= size)
+		map = mmap(NULL, size, PROT_READ, MAP_SHARED, fileno(f), 0);
+	fclose(f);
+	if (map == MAP_FAILED) {
+		perror(fname);
+		return NULL;
+	}
+#else
+	void *map = malloc2(size);
+	rewind(f);
+	bool ok = fread(map, size, 1, f) == 1;
+	fclose(f);
+	if (!ok) {
+		free(map);
+		return NULL;
+	}
+#endif
+
+	struct joseki_dict *jd = calloc2(1, sizeof(*jd));
+	jd->bsize = bsize;
+	jd->slots_mask = h.slots - 1;
+	jd->patterns_n = h.patterns_n;
+	jd->patterns = (struct joseki_pattern *)((char *)map + sizeof(h));
+	jd->moves = (coord_t *)(jd->patterns + h.slots);
+	jd->moves_n = jd->moves_size = h.moves_n;
+	jd->map = map;
+	jd->map_size = size;
+	mem_account(MEM_JOSEKI, size);
+	return jd;
+}
+
+static struct joseki_dict *
+joseki_parse(char *fname, int bsize)
 {
-	char fname[1024];
-	snprintf(fname, 1024, "joseki%d.pdict", bsize - 2);
 	FILE *f = fopen(fname, "r");
 	if (!f) {
 		if (DEBUGL(3))
@@ -47,36 +193,141 @@ joseki_load(int bsize)
 		char *cs = strrchr(line, ' '); assert(cs);
 		*cs++ = 0;
 		int count = atoi(cs);
-		
-		coord_t **ccp = &jd->patterns[h].moves[color - 1];
-		assert(!*ccp);
-		*ccp = calloc2(count + 1, sizeof(coord_t));
-		coord_t *cc = *ccp;
+
+		assert(!joseki_moves(jd, h, color));
+		coord_t list[count + 1];
+		int n = 0;
 		while (*line) {
-			assert(cc - *ccp < count);
+			assert(n < count);
 			coord_t *c = str2coord(line, bsize);
-			*cc++ = *c;
+			list[n++] = *c;
 			coord_done(c);
 			line += strcspn(line, " ");
 			line += strspn(line, " ");
 		}
-		*cc = pass;
+		list[n++] = pass;
+		joseki_set(jd, joseki_key(h, color), list, n);
 	}
 
 	fclose(f);
-	if (DEBUGL(2))
+	return jd;
+}
+
+/* Dictionaries handed out by joseki_load(), by board size. */
+static struct joseki_dict *joseki_cache[BOARD_MAX_SIZE + 3];
+
+struct joseki_dict *
+joseki_load(int bsize)
+{
+	assert(bsize <= BOARD_MAX_SIZE + 2);
+	if (joseki_cache[bsize]) {
+		joseki_cache[bsize]->refs++;
+		return joseki_cache[bsize];
+	}
+
+	char fname[1024];
+	snprintf(fname, 1024, "joseki%d.jdict", bsize - 2);
+	struct joseki_dict *jd = joseki_map(fname, bsize);
+	if (!jd) {
+		snprintf(fname, 1024, "joseki%d.pdict", bsize - 2);
+		jd = joseki_parse(fname, bsize);
+	}
+	if (jd && DEBUGL(2))
 		fprintf(stderr, "Joseki dictionary for board size %d loaded.\n", bsize - 2);
+	if (jd) {
+		jd->refs = 1;
+		joseki_cache[bsize] = jd;
+	}
 	return jd;
 }
 
+struct joseki_dict *
+joseki_load_file(char *fname, int bsize)
+{
+	FILE *f = fopen(fname, "rb");
+	if (!f) {
+		perror(fname);
+		return NULL;
+	}
+	char magic[8];
+	bool compiled = fread(magic, sizeof(magic), 1, f) == 1 && !memcmp(magic, JOSEKI_MAGIC, sizeof(magic));
+	fclose(f);
+	return compiled ? joseki_map(fname, bsize) : joseki_parse(fname, bsize);
+}
+
 void
 joseki_done(struct joseki_dict *jd)
 {
 	if (!jd) return;
-	for( unsigned long pid = 0; pid < 1<<joseki_hash_bits ; pid++){
-		free(jd->patterns[pid].moves[0]);
-		free(jd->patterns[pid].moves[1]);
+	if (jd->refs && --jd->refs > 0)
+		return;
+	if (joseki_cache[jd->bsize] == jd)
+		joseki_cache[jd->bsize] = NULL;
+	if (jd->map) {
+#ifndef _WIN32
+		munmap(jd->map, jd->map_size);
+#else
+		free(jd->map);
+#endif
+		mem_account(MEM_JOSEKI, -(long long) jd->map_size);
+	} else {
+		free(jd->patterns);
+		free(jd->moves);
+		mem_account(MEM_JOSEKI, -(long long) ((jd->slots_mask + 1) * sizeof(jd->patterns[0])
+						      + jd->moves_size * sizeof(coord_t)));
 	}
-	free(jd->patterns);
 	free(jd);
 }
+
+bool
+joseki_compile(int bsize)
+{
+	char infile[1024], outfile[1024];
+	snprintf(infile, 1024, "joseki%d.pdict", bsize - 2);
+	snprintf(outfile, 1024, "joseki%d.jdict", bsize - 2);
+	return joseki_compile_file(infile, outfile, bsize);
+}
+
+bool
+joseki_compile_file(char *infile, char *outfile, int bsize)
+{
+	struct joseki_dict *jd = joseki_parse(infile, bsize);
+	if (!jd)
+		return false;
+
+	/* Size the table to the data and drop the unused lists. */
+	struct joseki_dict *out = joseki_init(bsize);
+	while (out->slots_mask + 1 < 2 * jd->patterns_n)
+		joseki_grow(out);
+	for (uint32_t i = 0; i <= jd->slots_mask; i++) {
+		struct joseki_pattern *p = &jd->patterns[i];
+		if (!p->key) continue;
+		int n = 0;
+		while (!is_pass(jd->moves[p->moves + n++]));
+		joseki_set(out, p->key, &jd->moves[p->moves], n);
+	}
+	joseki_done(jd);
+
+	FILE *f = fopen(outfile, "wb");
+	if (!f) {
+		perror(outfile);
+		joseki_done(out);
+		return false;
+	}
+	struct joseki_header h = {
+		.bsize = bsize, .slots = out->slots_mask + 1,
+		.patterns_n = out->patterns_n, .moves_n = out->moves_n,
+		.coord_size = sizeof(coord_t),
+	};
+	memcpy(h.magic, JOSEKI_MAGIC, sizeof(h.magic));
+	fwrite(&h, sizeof(h), 1, f);
+	fwrite(out->patterns, sizeof(*out->patterns), h.slots, f);
+	fwrite(out->moves, sizeof(coord_t), h.moves_n, f);
+	bool ok = !fclose(f);
+	if (!ok)
+		perror(outfile);
+	if (DEBUGL(2))
+		fprintf(stderr, "%s: %u patterns, %u slots, %u moves\n", outfile, h.patterns_n, h.slots, h.moves_n);
+	joseki_done(out);
+	return ok;
+}
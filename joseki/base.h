@@ -1,25 +1,74 @@
 #ifndef PACHI_JOSEKI_BASE_H
 #define PACHI_JOSEKI_BASE_H
 
+#include <stdint.h>
+
 #include "board.h"
 
-/* Single joseki situation - moves for S_BLACK-1, S_WHITE-1. */
+/* Single joseki situation - moves for given quadrant hash and color,
+ * an offset of a pass-terminated list in the dictionary move pool. */
 struct joseki_pattern {
-	/* moves[] is a pass-terminated list or NULL */
-	coord_t *moves[2];
+	uint32_t key; // joseki_key(), 0 == free slot
+	uint32_t moves;
 };
 
-/* The joseki dictionary for given board size. */
+/* The joseki dictionary for given board size. All the move lists
+ * are kept in a single pool; the hash table is open addressing
+ * with linear probing, at most half full. */
 struct joseki_dict {
 	int bsize;
 
-#define joseki_hash_bits 20 // 8M w/ 32-bit pointers
+#define joseki_hash_bits 20
 #define joseki_hash_mask ((1 << joseki_hash_bits) - 1)
+	uint32_t slots_mask;
+	uint32_t patterns_n;
 	struct joseki_pattern *patterns;
+	coord_t *moves;
+	uint32_t moves_n, moves_size; // in coords
+
+	/* Compiled dictionary mmap'ed by joseki_load(), or NULL;
+	 * such dictionary cannot be modified. */
+	void *map;
+	size_t map_size;
+
+	/* Number of engines sharing the dictionary from joseki_load(). */
+	int refs;
 };
 
+static inline uint32_t
+joseki_key(hash_t qhash, enum stone color)
+{
+	return ((qhash & joseki_hash_mask) << 1 | (color - 1)) + 1;
+}
+
+/* Returns the pass-terminated list of joseki moves for color in
+ * the quadrant with hash qhash, or NULL. */
+static inline coord_t *
+joseki_moves(struct joseki_dict *jd, hash_t qhash, enum stone color)
+{
+	uint32_t key = joseki_key(qhash, color);
+	for (uint32_t i = key & jd->slots_mask; jd->patterns[i].key; i = (i + 1) & jd->slots_mask)
+		if (jd->patterns[i].key == key)
+			return &jd->moves[jd->patterns[i].moves];
+	return NULL;
+}
+
 struct joseki_dict *joseki_init(int bsize);
+/* Load joseki%d.jdict compiled by joseki_compile() if it exists,
+ * joseki%d.pdict otherwise. The dictionary is shared by all callers
+ * for the same board size until the last one calls joseki_done(). */
 struct joseki_dict *joseki_load(int bsize);
+/* Load the text or compiled dictionary fname, not shared. */
+struct joseki_dict *joseki_load_file(char *fname, int bsize);
 void joseki_done(struct joseki_dict *);
 
+/* Add move c to the list of color in the quadrant with hash qhash.
+ * Returns false if it was there already. */
+bool joseki_add(struct joseki_dict *jd, hash_t qhash, enum stone color, coord_t c);
+
+/* Compile joseki%d.pdict to joseki%d.jdict. */
+bool joseki_compile(int bsize);
+/* Compile the text dictionary infile to outfile. */
+bool joseki_compile_file(char *infile, char *outfile, int bsize);
+
 #endif
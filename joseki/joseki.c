@@ -22,7 +22,7 @@ struct joseki_engine {
 };
 
 /* We will record the joseki positions into incrementally-built
- * jdict->patterns[]. */
+ * jdict, see joseki_add(). */
 
 
 static char *
@@ -93,28 +93,10 @@ joseki_play(struct engine *e, struct board *b, struct move *m, char *enginearg)
 		if (i & HASH_OCOLOR)
 			color = stone_other(color);
 
-		coord_t **ccp = &j->jdict->patterns[j->b[i]->qhash[quadrant] & joseki_hash_mask].moves[color - 1];
+		joseki_add(j->jdict, j->b[i]->qhash[quadrant], color, coord);
 
-		int count = 1;
-		if (*ccp) {
-			for (coord_t *cc = *ccp; !is_pass(*cc); cc++) {
-				count++;
-				if (*cc == coord) {
-					//printf("%d,%d (%"PRIhash", %d) !+ %s\n", i, quadrant, j->b[i]->qhash[quadrant], count, coord2sstr(coord, b));
-					goto already_have;
-				}
-			}
-		}
-
-		//printf("%d,%d (%"PRIhash", %d) =+ %s\n", i, quadrant, j->b[i]->qhash[quadrant], count, coord2sstr(coord, b));
-		*ccp = realloc(*ccp, (count + 1) * sizeof(coord_t));
-		(*ccp)[count - 1] = coord;
-		(*ccp)[count] = pass;
-
-already_have: {
 		struct move m2 = { .coord = coord, .color = color };
 		board_play(j->b[i], &m2);
-	      }
 	}
 
 	return NULL;
@@ -127,6 +109,13 @@ joseki_genmove(struct engine *e, struct board *b, struct time_info *ti, enum sto
 	exit(EXIT_FAILURE);
 }
 
+static int
+joseki_key_cmp(const void *a, const void *b)
+{
+	uint32_t ka = *(const uint32_t *)a, kb = *(const uint32_t *)b;
+	return ka < kb ? -1 : ka > kb;
+}
+
 void
 engine_joseki_done(struct engine *e)
 {
@@ -135,21 +124,28 @@ engine_joseki_done(struct engine *e)
 	board_resize(b, j->size - 2);
 	board_clear(b);
 
-	for (hash_t i = 0; i < 1 << joseki_hash_bits; i++) {
-		for (int s = 0; s < 2; s++) {
-			static const char cs[] = "bw";
-			if (!j->jdict->patterns[i].moves[s])
-				continue;
-			printf("%" PRIhash " %c", i, cs[s]);
-			coord_t *cc = j->jdict->patterns[i].moves[s];
-			int count = 0;
-			while (!is_pass(*cc)) {
-				printf(" %s", coord2sstr(*cc, b));
-				cc++, count++;
-			}
-			printf(" %d\n", count);
+	/* Print in the order of the hashes. */
+	struct joseki_dict *jd = j->jdict;
+	uint32_t *keys = malloc2(jd->patterns_n * sizeof(*keys)), n = 0;
+	for (uint32_t i = 0; i <= jd->slots_mask; i++)
+		if (jd->patterns[i].key)
+			keys[n++] = jd->patterns[i].key;
+	qsort(keys, n, sizeof(keys[0]), joseki_key_cmp);
+
+	for (uint32_t k = 0; k < n; k++) {
+		static const char cs[] = "bw";
+		hash_t h = (keys[k] - 1) >> 1;
+		enum stone color = ((keys[k] - 1) & 1) + 1;
+		printf("%" PRIhash " %c", h, cs[color - 1]);
+		coord_t *cc = joseki_moves(jd, h, color);
+		int count = 0;
+		while (!is_pass(*cc)) {
+			printf(" %s", coord2sstr(*cc, b));
+			cc++, count++;
 		}
+		printf(" %d\n", count);
 	}
+	free(keys);
 
 	board_done(b);
 
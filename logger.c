@@ -0,0 +1,244 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logger.h"
+#include "timeinfo.h"
+#include "util.h"
+
+/* Each thread has its own ring with a single writer (the thread) and
+ * a single reader (the logger thread, or logger_flush() under the
+ * drain lock), so neither side needs a lock: the writer publishes
+ * its messages by moving head, the reader frees them by moving tail.
+ * Rings are kept in a list and never freed; the ring of a thread
+ * which exited is taken over by the next thread needing one. */
+
+#define LOG_RING_SIZE (64 * 1024)
+/* Longer messages are truncated. */
+#define LOG_MSG_MAX 4096
+/* How often the logger thread writes out the rings [s]. */
+#define LOG_DRAIN_INTERVAL 0.01
+
+struct log_msg {
+	double time;
+	uint16_t len; // of the text following
+	uint8_t level;
+};
+
+struct log_ring {
+	char buf[LOG_RING_SIZE];
+	volatile uint64_t head, tail;
+	volatile int owned;
+	bool bol; // reader at the beginning of a line
+	struct log_ring *next;
+};
+
+static bool logger_running;
+static double logger_start;
+static struct log_ring *volatile rings;
+static volatile int dropped;
+
+static __thread struct log_ring *thread_ring;
+static pthread_key_t ring_key;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+ring_release(void *data)
+{
+	struct log_ring *r = data;
+	r->owned = 0;
+}
+
+static void
+ring_key_init(void)
+{
+	pthread_key_create(&ring_key, ring_release);
+}
+
+static struct log_ring *
+ring_get(void)
+{
+	if (thread_ring)
+		return thread_ring;
+	pthread_once(&ring_once, ring_key_init);
+
+	struct log_ring *r;
+	for (r = rings; r; r = r->next)
+		if (!r->owned && __sync_bool_compare_and_swap(&r->owned, 0, 1))
+			break;
+	if (!r) {
+		r = calloc2(1, sizeof(*r));
+		r->owned = 1;
+		r->bol = true;
+		do {
+			r->next = rings;
+		} while (!__sync_bool_compare_and_swap(&rings, r->next, r));
+	}
+	pthread_setspecific(ring_key, r);
+	thread_ring = r;
+	return r;
+}
+
+static void
+ring_write(struct log_ring *r, uint64_t pos, const void *data, size_t len)
+{
+	size_t off = pos % LOG_RING_SIZE;
+	size_t first = len < LOG_RING_SIZE - off ? len : LOG_RING_SIZE - off;
+	memcpy(r->buf + off, data, first);
+	memcpy(r->buf, (const char *) data + first, len - first);
+}
+
+static void
+ring_read(struct log_ring *r, uint64_t pos, void *data, size_t len)
+{
+	size_t off = pos % LOG_RING_SIZE;
+	size_t first = len < LOG_RING_SIZE - off ? len : LOG_RING_SIZE - off;
+	memcpy(data, r->buf + off, first);
+	memcpy((char *) data + first, r->buf, len - first);
+}
+
+void
+log_printf(int level, const char *format, ...)
+{
+	va_list ap;
+	va_start(ap, format);
+	if (!logger_running) {
+		vfprintf(stderr, format, ap);
+		va_end(ap);
+		return;
+	}
+	char text[LOG_MSG_MAX];
+	int len = vsnprintf(text, sizeof(text), format, ap);
+	va_end(ap);
+	if (len <= 0)
+		return;
+	if (len >= LOG_MSG_MAX)
+		len = LOG_MSG_MAX - 1;
+
+	struct log_ring *r = ring_get();
+	struct log_msg m = { .time = time_now_coarse() - logger_start, .len = len, .level = level };
+	uint64_t head = r->head;
+	if (LOG_RING_SIZE - (head - r->tail) < sizeof(m) + len) {
+		__sync_fetch_and_add(&dropped, 1);
+		return;
+	}
+	ring_write(r, head, &m, sizeof(m));
+	ring_write(r, head + sizeof(m), text, len);
+	__sync_synchronize();
+	r->head = head + sizeof(m) + len;
+}
+
+
+/* Output buffer of the reader. */
+static char out[LOG_RING_SIZE + LOG_MSG_MAX];
+static size_t out_len;
+
+static void
+out_flush(void)
+{
+	if (!out_len)
+		return;
+	fwrite(out, 1, out_len, stderr);
+	fflush(stderr);
+	out_len = 0;
+}
+
+static void
+out_put(const char *s, size_t len)
+{
+	if (out_len + len > sizeof(out))
+		out_flush();
+	memcpy(out + out_len, s, len);
+	out_len += len;
+}
+
+/* Write out the complete lines of the ring, or everything if @all. */
+static void
+ring_drain(struct log_ring *r, bool all)
+{
+	uint64_t head = r->head;
+	__sync_synchronize();
+
+	uint64_t pos = r->tail, end = pos;
+	while (pos < head) {
+		struct log_msg m;
+		char last;
+		ring_read(r, pos, &m, sizeof(m));
+		ring_read(r, pos + sizeof(m) + m.len - 1, &last, 1);
+		pos += sizeof(m) + m.len;
+		if (last == '\n' || all)
+			end = pos;
+	}
+
+	for (pos = r->tail; pos < end; ) {
+		struct log_msg m;
+		char text[LOG_MSG_MAX];
+		ring_read(r, pos, &m, sizeof(m));
+		ring_read(r, pos + sizeof(m), text, m.len);
+		pos += sizeof(m) + m.len;
+		for (char *s = text, *e = text + m.len; s < e; ) {
+			if (r->bol) {
+				char prefix[32];
+				int n = snprintf(prefix, sizeof(prefix), "%10.3f [%d] ", m.time, m.level);
+				out_put(prefix, n);
+				r->bol = false;
+			}
+			char *nl = memchr(s, '\n', e - s);
+			size_t n = (nl ? nl + 1 : e) - s;
+			out_put(s, n);
+			s += n;
+			r->bol = !!nl;
+		}
+	}
+	__sync_synchronize();
+	r->tail = end;
+}
+
+static void
+logger_drain(bool all)
+{
+	pthread_mutex_lock(&drain_lock);
+	for (struct log_ring *r = rings; r; r = r->next)
+		ring_drain(r, all || !r->owned);
+	int n = dropped;
+	if (n) {
+		__sync_fetch_and_sub(&dropped, n);
+		char s[64];
+		out_put(s, snprintf(s, sizeof(s), "[logger: %d messages dropped]\n", n));
+	}
+	out_flush();
+	pthread_mutex_unlock(&drain_lock);
+}
+
+static void * __attribute__((noreturn))
+logger_thread(void *data)
+{
+	while (1) {
+		time_sleep(LOG_DRAIN_INTERVAL);
+		logger_drain(false);
+	}
+}
+
+void
+logger_flush(void)
+{
+	if (logger_running)
+		logger_drain(true);
+}
+
+void
+logger_init(void)
+{
+	if (logger_running)
+		return;
+	logger_start = time_now_coarse();
+	logger_running = true;
+	pthread_t thread;
+	pthread_create(&thread, NULL, logger_thread, NULL);
+	pthread_detach(thread);
+	atexit(logger_flush);
+}
@@ -0,0 +1,18 @@
+#ifndef PACHI_LOGGER_H
+#define PACHI_LOGGER_H
+
+/* Debug output without the stdio lock, for the search and slave
+ * threads. After logger_init() (-L option), log_printf() only copies
+ * the message to a ring buffer of the calling thread, and a background
+ * thread writes the complete lines out to stderr, prefixed with their
+ * time and @level (the DEBUGL() threshold of the message). A full ring
+ * drops messages rather than waiting. Without logger_init(),
+ * log_printf() is plain fprintf(stderr, ...). */
+
+void logger_init(void);
+/* Write out all the pending messages. */
+void logger_flush(void);
+
+void log_printf(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+#endif
@@ -0,0 +1,56 @@
+#include <stdio.h>
+
+#include "memstats.h"
+
+const char *mem_tag_names[MEM_MAX] = {
+	"tree", "spatial", "patterns", "joseki", "fbook", "dcnn", "boards", "distributed",
+};
+
+static volatile long long used[MEM_MAX], peak[MEM_MAX];
+
+void
+mem_account(enum mem_tag tag, long long bytes)
+{
+	long long now = __sync_add_and_fetch(&used[tag], bytes);
+	long long p = peak[tag];
+	while (now > p && !__sync_bool_compare_and_swap(&peak[tag], p, now))
+		p = peak[tag];
+}
+
+long long
+mem_used(enum mem_tag tag)
+{
+	return used[tag];
+}
+
+long long
+mem_peak(enum mem_tag tag)
+{
+	return peak[tag];
+}
+
+void
+mem_print(char *buf, int size)
+{
+	long long total = 0;
+	int len = 0;
+	for (int t = 0; t < MEM_MAX && len < size; t++) {
+		long long u = mem_used(t);
+		total += u;
+		len += snprintf(buf + len, size - len, "%-12s %10.1f MB  (peak %.1f MB)\n",
+				mem_tag_names[t], u / 1048576.0, mem_peak(t) / 1048576.0);
+	}
+	/* No trailing newline in a GTP reply. */
+	if (len < size)
+		snprintf(buf + len, size - len, "%-12s %10.1f MB", "total", total / 1048576.0);
+}
+
+void
+mem_json(FILE *f)
+{
+	fprintf(f, "{");
+	for (int t = 0; t < MEM_MAX; t++)
+		fprintf(f, "%s\"%s\": {\"bytes\": %lld, \"peak_bytes\": %lld}", t ? ", " : "",
+			mem_tag_names[t], mem_used(t), mem_peak(t));
+	fprintf(f, "}");
+}
@@ -0,0 +1,39 @@
+#ifndef PACHI_MEMSTATS_H
+#define PACHI_MEMSTATS_H
+
+/* Memory accounting: bytes currently held and the peak, per subsystem,
+ * reported by the pachi-memstats GTP command and the metrics endpoint.
+ * Only the large tables and buffers are accounted, by the code which
+ * allocates and frees them; small structures and the search tree nodes
+ * allocated one by one without fast_alloc are not (see M_TREE_SIZE for
+ * the latter). Mapped files count as their mapping size. */
+
+#include <stdio.h>
+
+enum mem_tag {
+	MEM_TREE, // fast_alloc nodes buffer, tree hash tables, tbook
+	MEM_SPATIAL, // spatial dictionary
+	MEM_PATTERN, // pattern probability dictionary
+	MEM_JOSEKI, // joseki dictionaries
+	MEM_FBOOK, // opening books
+	MEM_DCNN, // dcnn evaluation cache
+	MEM_BOARD, // per-thread playout boards
+	MEM_DISTRIBUTED, // slave buffers and merge tables
+	MEM_MAX,
+};
+
+extern const char *mem_tag_names[MEM_MAX];
+
+/* Record @bytes allocated (freed if negative) by subsystem @tag.
+ * Thread-safe. */
+void mem_account(enum mem_tag tag, long long bytes);
+
+long long mem_used(enum mem_tag tag);
+long long mem_peak(enum mem_tag tag);
+
+/* Text report, one line per subsystem and the total. */
+void mem_print(char *buf, int size);
+/* Current and peak bytes of each subsystem as a JSON object. */
+void mem_json(FILE *f);
+
+#endif
@@ -0,0 +1,188 @@
+/* Telemetry endpoint, see metrics.h. */
+
+#define DEBUG
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "debug.h"
+#include "memstats.h"
+#include "metrics.h"
+#include "network.h"
+#include "perfstats.h"
+#include "util.h"
+
+static struct metric {
+	const char *name;
+	const char *type;
+	const char *help;
+} metrics[M_MAX] = {
+	{ "pachi_playouts_total", "counter", "Playouts of all finished searches." },
+	{ "pachi_playouts_per_second", "gauge", "Playout rate of the running search." },
+	{ "pachi_search_threads", "gauge", "Search threads currently running." },
+	{ "pachi_search_thread_seconds_total", "counter", "Wall time spent searching, times the number of threads." },
+	{ "pachi_tree_bytes", "gauge", "Memory taken by the search tree nodes." },
+	{ "pachi_tree_max_bytes", "gauge", "Memory limit of the search tree." },
+	{ "pachi_gc_total", "counter", "Search tree garbage collections." },
+	{ "pachi_gc_seconds_total", "counter", "Time spent in tree garbage collection." },
+	{ "pachi_gc_last_seconds", "gauge", "Duration of the last tree garbage collection." },
+	{ "pachi_slaves", "gauge", "Active slaves of the distributed master." },
+	{ "pachi_slave_replies_total", "counter", "Replies received from slaves." },
+	{ "pachi_slave_reply_seconds_total", "counter", "Time from sending a command to a slave to receiving its reply." },
+	{ "pachi_slave_reply_last_seconds", "gauge", "Latency of the last slave reply." },
+	{ "pachi_slave_queue_length", "gauge", "Slave replies waiting in the receive queue." },
+	{ "pachi_slave_stragglers", "gauge", "Slow slaves the master does not wait for." },
+};
+
+static double values[M_MAX];
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void
+metric_set(enum metric_id m, double value)
+{
+	pthread_mutex_lock(&metrics_lock);
+	values[m] = value;
+	pthread_mutex_unlock(&metrics_lock);
+}
+
+void
+metric_add(enum metric_id m, double value)
+{
+	pthread_mutex_lock(&metrics_lock);
+	values[m] += value;
+	pthread_mutex_unlock(&metrics_lock);
+}
+
+double
+metric_get(enum metric_id m)
+{
+	pthread_mutex_lock(&metrics_lock);
+	double value = values[m];
+	pthread_mutex_unlock(&metrics_lock);
+	return value;
+}
+
+
+static void
+metrics_prometheus(FILE *f, double *v)
+{
+	for (int m = 0; m < M_MAX; m++) {
+		fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", metrics[m].name, metrics[m].help,
+			metrics[m].name, metrics[m].type);
+		fprintf(f, "%s %.9g\n", metrics[m].name, v[m]);
+	}
+	fprintf(f, "# HELP pachi_memory_bytes Memory held by the subsystem.\n"
+		"# TYPE pachi_memory_bytes gauge\n");
+	for (int t = 0; t < MEM_MAX; t++)
+		fprintf(f, "pachi_memory_bytes{subsystem=\"%s\"} %lld\n", mem_tag_names[t], mem_used(t));
+	fprintf(f, "# HELP pachi_memory_peak_bytes Peak memory held by the subsystem.\n"
+		"# TYPE pachi_memory_peak_bytes gauge\n");
+	for (int t = 0; t < MEM_MAX; t++)
+		fprintf(f, "pachi_memory_peak_bytes{subsystem=\"%s\"} %lld\n", mem_tag_names[t], mem_peak(t));
+	if (!perf_enabled)
+		return;
+	struct perf_counters sum;
+	perf_sum(&sum);
+	fprintf(f, "# HELP pachi_perf_calls_total Calls of the probed hot path sections.\n"
+		"# TYPE pachi_perf_calls_total counter\n");
+	for (int p = 0; p < PERF_MAX; p++)
+		fprintf(f, "pachi_perf_calls_total{probe=\"%s\"} %llu\n",
+			perf_probe_names[p], (unsigned long long) sum.count[p]);
+	fprintf(f, "# HELP pachi_perf_ticks_total Ticks spent in the probed hot path sections.\n"
+		"# TYPE pachi_perf_ticks_total counter\n");
+	for (int p = 0; p < PERF_MAX; p++)
+		fprintf(f, "pachi_perf_ticks_total{probe=\"%s\"} %llu\n",
+			perf_probe_names[p], (unsigned long long) sum.ticks[p]);
+}
+
+static void
+metrics_json(FILE *f, double *v)
+{
+	fprintf(f, "{");
+	/* Drop the pachi_ prefix, it says nothing here. */
+	for (int m = 0; m < M_MAX; m++)
+		fprintf(f, "%s\"%s\": %.9g", m ? ", " : "", metrics[m].name + 6, v[m]);
+	fprintf(f, ", \"memory\": ");
+	mem_json(f);
+	if (perf_enabled) {
+		fprintf(f, ", \"perf\": ");
+		perf_json(f);
+	}
+	fprintf(f, "}\n");
+}
+
+/* Answer one HTTP request. Anything but /json gets the Prometheus
+ * format; we do not bother checking the method. */
+static void
+metrics_reply(int fd)
+{
+	/* A stuck client must not block the endpoint forever. */
+	struct timeval tv = { .tv_sec = 1 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	char req[1024];
+	int len = 0;
+	while (len < (int) sizeof(req) - 1) {
+		int r = read(fd, req + len, sizeof(req) - 1 - len);
+		if (r <= 0) break;
+		len += r;
+		req[len] = 0;
+		if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n")) break;
+	}
+	req[len] = 0;
+	char *path = strchr(req, ' ');
+	bool json = path && !strncmp(path + 1, "/json", 5);
+
+	double v[M_MAX];
+	pthread_mutex_lock(&metrics_lock);
+	memcpy(v, values, sizeof(v));
+	pthread_mutex_unlock(&metrics_lock);
+
+	/* Send with MSG_NOSIGNAL, a client going away must not
+	 * take the engine down. */
+	char *out;
+	size_t out_len;
+	FILE *f = open_memstream(&out, &out_len);
+	fprintf(f, "HTTP/1.0 200 OK\r\nContent-Type: %s\r\nConnection: close\r\n\r\n",
+		json ? "application/json" : "text/plain; version=0.0.4");
+	if (json)
+		metrics_json(f, v);
+	else
+		metrics_prometheus(f, v);
+	fclose(f);
+	for (size_t sent = 0; sent < out_len; ) {
+		ssize_t r = send(fd, out + sent, out_len - sent, MSG_NOSIGNAL);
+		if (r <= 0) break;
+		sent += r;
+	}
+	free(out);
+	close(fd);
+}
+
+static void *
+metrics_thread(void *arg)
+{
+	int sock = (long) arg;
+	for (;;) {
+		/* Connections are limited to the private network,
+		 * as for the other network ports. */
+		int fd = open_server_connection(sock, NULL);
+		metrics_reply(fd);
+	}
+	return NULL;
+}
+
+void
+metrics_serve(char *port)
+{
+	int sock = port_listen(port, 4);
+	pthread_t thread;
+	pthread_create(&thread, NULL, metrics_thread, (void *) (long) sock);
+	pthread_detach(thread);
+	if (DEBUGL(1))
+		fprintf(stderr, "serving metrics on port %s\n", port);
+}
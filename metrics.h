@@ -0,0 +1,38 @@
+#ifndef PACHI_METRICS_H
+#define PACHI_METRICS_H
+
+/* Live telemetry for monitoring: a handful of process-wide counters
+ * and gauges updated by the search and the distributed master, served
+ * over HTTP (-m PORT) in the Prometheus text format, or as a JSON
+ * object on the /json path.
+ *
+ * Updates are rare (progress polls, garbage collections, slave
+ * replies), so a single mutex protects all the values. */
+
+enum metric_id {
+	M_PLAYOUTS, // playouts of all finished searches
+	M_PLAYOUTS_RATE, // playouts per second of the running search
+	M_SEARCH_THREADS, // search threads currently running
+	M_SEARCH_SECONDS, // wall time x threads spent searching
+	M_TREE_SIZE, // bytes taken by tree nodes
+	M_TREE_MAX_SIZE, // memory limit of the tree
+	M_GC, // tree garbage collections
+	M_GC_SECONDS, // time spent in them
+	M_GC_LAST_SECONDS, // duration of the last one
+	M_SLAVES, // active slaves (distributed master)
+	M_SLAVE_REPLIES, // replies received from slaves
+	M_SLAVE_REPLY_SECONDS, // command send to reply received, summed
+	M_SLAVE_REPLY_LAST_SECONDS,
+	M_SLAVE_QUEUE, // binary replies waiting in the receive queue
+	M_SLAVE_STRAGGLERS, // slaves not waited for (see get_replies())
+	M_MAX,
+};
+
+void metric_set(enum metric_id m, double value);
+void metric_add(enum metric_id m, double value);
+double metric_get(enum metric_id m);
+
+/* Serve the metrics on the given port from a background thread. */
+void metrics_serve(char *port);
+
+#endif
@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,10 +9,12 @@
 #include "joseki/base.h"
 #include "move.h"
 #include "playout/moggy.h"
+#include "playout/gamma.h"
 #include "playout/light.h"
 #include "montecarlo/internal.h"
 #include "montecarlo/montecarlo.h"
 #include "playout.h"
+#include "random.h"
 #include "timeinfo.h"
 
 
@@ -27,7 +30,8 @@
  * debug[=DEBUG_LEVEL]		1 is the default; more means more debugging prints
  * games=MC_GAMES		number of random games to play
  * gamelen=MC_GAMELEN		maximal length of played random game
- * playout={light,moggy}[:playout_params]
+ * threads=THREADS		number of threads playing the games, default 1
+ * playout={light,moggy,gamma}[:playout_params]
  */
 
 
@@ -74,35 +78,38 @@ board_stats_print(struct board *board, struct move_stat *moves, FILE *f)
 }
 
 
-static coord_t *
-montecarlo_genmove(struct engine *e, struct board *b, struct time_info *ti, enum stone color, bool pass_all_alive)
+/* The games are split evenly among the threads, each of them with its
+ * own stats merged at the end. The only shared state is the early stop
+ * if no game is lost. */
+struct mc_thread {
+	struct montecarlo *mc;
+	struct board *b;
+	enum stone color;
+	int playouts;
+	int tid;
+	unsigned long seed;
+	/* Shared by all threads. */
+	volatile int *games, *losses;
+	volatile bool *stop;
+
+	/* Output. */
+	struct move_stat *moves;
+	int played, superko, good_games, losses_own;
+	bool superko_loop;
+};
+
+static void *
+mc_thread_play(void *data)
 {
-	struct montecarlo *mc = e->data;
-
-	if (ti->dim == TD_WALLTIME) {
-		fprintf(stderr, "Warning: TD_WALLTIME time mode not supported, resetting to defaults.\n");
-		ti->period = TT_NULL;
-	}
-	if (ti->period == TT_NULL) {
-		ti->period = TT_MOVE;
-		ti->dim = TD_GAMES;
-		ti->len.games = MC_GAMES;
-	}
-	struct time_stop stop;
-	time_stop_conditions(ti, b, 20, 40, 3.0, &stop);
-
-	/* resign when the hope for win vanishes */
-	coord_t top_coord = resign;
-	floating_t top_ratio = mc->resign_ratio;
-
-	/* We use [0] for pass. Normally, this is an inaccessible corner
-	 * of board margin. */
-	struct move_stat moves[board_size2(b)];
-	memset(moves, 0, sizeof(moves));
-
-	int losses = 0;
-	int i, superko = 0, good_games = 0;
-	for (i = 0; i < stop.desired.playouts; i++) {
+	struct mc_thread *th = data;
+	struct montecarlo *mc = th->mc;
+	struct board *b = th->b;
+	enum stone color = th->color;
+	if (th->tid > 0)
+		fast_srandom_stream(th->seed, th->tid);
+
+	int i;
+	for (i = 0; i < th->playouts && !*th->stop; i++) {
 		assert(!b->superko_violation);
 
 		struct board b2;
@@ -118,6 +125,7 @@ montecarlo_genmove(struct engine *e, struct board *b, struct time_info *ti, enum
 				fprintf(stderr, "SUICIDE DETECTED at %d,%d:\n", coord_x(coord, b), coord_y(coord, b));
 				board_print(b, stderr);
 			}
+			board_done_noalloc(&b2);
 			continue;
 		}
 
@@ -132,16 +140,16 @@ montecarlo_genmove(struct engine *e, struct board *b, struct time_info *ti, enum
 		if (result == 0) {
 			/* Superko. We just ignore this playout.
 			 * And play again. */
-			if (unlikely(superko > 2 * stop.desired.playouts)) {
+			if (unlikely(th->superko > 2 * th->playouts)) {
 				/* Uhh. Triple ko, or something? */
-				if (MCDEBUGL(0))
-					fprintf(stderr, "SUPERKO LOOP. I will pass. Did we hit triple ko?\n");
-				goto pass_wins;
+				th->superko_loop = true;
+				*th->stop = true;
+				break;
 			}
 			/* This playout didn't count; we should not
 			 * disadvantage moves that lead to a superko.
 			 * And it is supposed to be rare. */
-			i--, superko++;
+			i--, th->superko++;
 			continue;
 		}
 
@@ -150,18 +158,93 @@ montecarlo_genmove(struct engine *e, struct board *b, struct time_info *ti, enum
 
 		int pos = is_pass(coord) ? 0 : coord;
 
-		good_games++;
-		moves[pos].games++;
+		th->good_games++;
+		th->moves[pos].games++;
 
-		losses += result > 0;
-		moves[pos].wins += 1 - (result > 0);
+		if (result > 0) {
+			th->losses_own++;
+			__sync_fetch_and_add(th->losses, 1);
+		}
+		th->moves[pos].wins += 1 - (result > 0);
 
-		if (unlikely(!losses && i == mc->loss_threshold)) {
+		if (unlikely(__sync_add_and_fetch(th->games, 1) == mc->loss_threshold + 1 && !*th->losses)) {
 			/* We played out many games and didn't lose once yet.
 			 * This game is over. */
+			*th->stop = true;
+			i++;
 			break;
 		}
 	}
+	th->played = i;
+	return NULL;
+}
+
+static coord_t *
+montecarlo_genmove(struct engine *e, struct board *b, struct time_info *ti, enum stone color, bool pass_all_alive)
+{
+	struct montecarlo *mc = e->data;
+
+	if (ti->dim == TD_WALLTIME) {
+		fprintf(stderr, "Warning: TD_WALLTIME time mode not supported, resetting to defaults.\n");
+		ti->period = TT_NULL;
+	}
+	if (ti->period == TT_NULL) {
+		ti->period = TT_MOVE;
+		ti->dim = TD_GAMES;
+		ti->len.games = MC_GAMES;
+	}
+	struct time_stop stop;
+	time_stop_conditions(ti, b, 20, 40, 3.0, &stop);
+
+	/* resign when the hope for win vanishes */
+	coord_t top_coord = resign;
+	floating_t top_ratio = mc->resign_ratio;
+
+	/* We use [0] for pass. Normally, this is an inaccessible corner
+	 * of board margin. */
+	struct move_stat moves[board_size2(b)];
+	memset(moves, 0, sizeof(moves));
+
+	int threads = mc->threads;
+	struct mc_thread th[threads];
+	volatile int games = 0, losses = 0;
+	volatile bool stop_all = false;
+	unsigned long seed = fast_irandom(~0U);
+	for (int t = 0; t < threads; t++) {
+		th[t] = (struct mc_thread) {
+			.mc = mc, .b = b, .color = color, .tid = t, .seed = seed,
+			.playouts = stop.desired.playouts / threads + (t < stop.desired.playouts % threads),
+			.games = &games, .losses = &losses, .stop = &stop_all,
+			.moves = calloc2(board_size2(b), sizeof(struct move_stat)),
+		};
+	}
+	/* A single thread plays in the engine thread, as it always did. */
+	pthread_t thread[threads];
+	for (int t = 1; t < threads; t++)
+		pthread_create(&thread[t], NULL, mc_thread_play, &th[t]);
+	mc_thread_play(&th[0]);
+	for (int t = 1; t < threads; t++)
+		pthread_join(thread[t], NULL);
+
+	int i = 0, superko = 0, good_games = 0;
+	bool superko_loop = false;
+	for (int t = 0; t < threads; t++) {
+		i += th[t].played;
+		superko += th[t].superko;
+		good_games += th[t].good_games;
+		superko_loop |= th[t].superko_loop;
+		foreach_point(b) {
+			moves[c].games += th[t].moves[c].games;
+			moves[c].wins += th[t].moves[c].wins;
+		} foreach_point_end;
+		free(th[t].moves);
+	}
+
+	if (superko_loop) {
+		if (MCDEBUGL(0))
+			fprintf(stderr, "SUPERKO LOOP. I will pass. Did we hit triple ko?\n");
+		goto pass_wins;
+	}
 
 	if (!good_games) {
 		/* No moves to try??? */
@@ -219,6 +302,7 @@ montecarlo_state_init(char *arg, struct board *b)
 
 	mc->debug_level = 1;
 	mc->gamelen = MC_GAMELEN;
+	mc->threads = 1;
 	mc->jdict = joseki_load(b->size);
 
 	if (arg) {
@@ -239,6 +323,8 @@ montecarlo_state_init(char *arg, struct board *b)
 					mc->debug_level++;
 			} else if (!strcasecmp(optname, "gamelen") && optval) {
 				mc->gamelen = atoi(optval);
+			} else if (!strcasecmp(optname, "threads") && optval) {
+				mc->threads = atoi(optval);
 			} else if (!strcasecmp(optname, "playout") && optval) {
 				char *playoutarg = strchr(optval, ':');
 				if (playoutarg)
@@ -247,6 +333,8 @@ montecarlo_state_init(char *arg, struct board *b)
 					mc->playout = playout_moggy_init(playoutarg, b, mc->jdict);
 				} else if (!strcasecmp(optval, "light")) {
 					mc->playout = playout_light_init(playoutarg, b);
+				} else if (!strcasecmp(optval, "gamma")) {
+					mc->playout = playout_gamma_init(playoutarg, b);
 				} else {
 					fprintf(stderr, "MonteCarlo: Invalid playout policy %s\n", optval);
 				}
@@ -256,6 +344,10 @@ montecarlo_state_init(char *arg, struct board *b)
 		}
 	}
 
+	if (mc->threads < 1) {
+		fprintf(stderr, "MonteCarlo: threads must be at least 1\n");
+		exit(1);
+	}
 	if (!mc->playout)
 		mc->playout = playout_light_init(NULL, b);
 	mc->playout->debug_level = mc->debug_level;
@@ -38,15 +38,21 @@ static void mq_nodup(struct move_queue *q);
 static void mq_print(struct move_queue *q, struct board *b, char *label);
 
 
-/* Variations of the above that allow move weighting. */
-/* XXX: The "kinds of move queue" issue (it's even worse in some other
- * branches) is one of the few good arguments for C++ in Pachi...
- * At least rewrite it to be less hacky and maybe make a move_gamma_queue
- * that encapsulates move_queue. */
+/* Variation of the above with weighted moves: a move queue with the
+ * gamma of each move and their running total, so that picking a move
+ * takes a single pass. */
+struct move_gamma_queue {
+	struct move_queue q;
+	fixp_t gamma[MQL];
+	fixp_t total;
+};
 
-static coord_t mq_gamma_pick(struct move_queue *q, fixp_t *gammas);
-static void mq_gamma_add(struct move_queue *q, fixp_t *gammas, coord_t c, double gamma, unsigned char tag);
-static void mq_gamma_print(struct move_queue *q, fixp_t *gammas, struct board *b, char *label);
+/* Empty the queue. */
+static void mq_gamma_init(struct move_gamma_queue *gq);
+/* Pick a move with probability proportional to its gamma. */
+static coord_t mq_gamma_pick(struct move_gamma_queue *gq);
+static void mq_gamma_add(struct move_gamma_queue *gq, coord_t c, double gamma, unsigned char tag);
+static void mq_gamma_print(struct move_gamma_queue *gq, struct board *b, char *label);
 
 
 static inline coord_t
@@ -75,7 +81,7 @@ mq_has(struct move_queue *q, coord_t c)
 static inline void
 mq_append(struct move_queue *qd, struct move_queue *qs)
 {
-	assert(qd->moves + qs->moves < MQL);
+	assert(qd->moves + qs->moves <= MQL);
 	memcpy(&qd->tag[qd->moves], qs->tag, qs->moves * sizeof(*qs->tag));
 	memcpy(&qd->move[qd->moves], qs->move, qs->moves * sizeof(*qs->move));
 	qd->moves += qs->moves;
@@ -105,40 +111,42 @@ mq_print(struct move_queue *q, struct board *b, char *label)
 	fprintf(stderr, "\n");
 }
 
+static inline void
+mq_gamma_init(struct move_gamma_queue *gq)
+{
+	gq->q.moves = 0;
+	gq->total = 0;
+}
+
 static inline coord_t
-mq_gamma_pick(struct move_queue *q, fixp_t *gammas)
+mq_gamma_pick(struct move_gamma_queue *gq)
 {
-	if (!q->moves)
+	if (!gq->total)
 		return pass;
-	fixp_t total = 0;
-	for (unsigned int i = 0; i < q->moves; i++) {
-		total += gammas[i];
-	}
-	if (!total)
-		return pass;
-	fixp_t stab = fast_irandom(total);
-	for (unsigned int i = 0; i < q->moves; i++) {
-		if (stab < gammas[i])
-			return q->move[i];
-		stab -= gammas[i];
+	fixp_t stab = fast_irandom(gq->total);
+	for (unsigned int i = 0; i < gq->q.moves; i++) {
+		if (stab < gq->gamma[i])
+			return gq->q.move[i];
+		stab -= gq->gamma[i];
 	}
 	assert(0);
 	return pass;
 }
 
 static inline void
-mq_gamma_add(struct move_queue *q, fixp_t *gammas, coord_t c, double gamma, unsigned char tag)
+mq_gamma_add(struct move_gamma_queue *gq, coord_t c, double gamma, unsigned char tag)
 {
-	mq_add(q, c, tag);
-	gammas[q->moves - 1] = double_to_fixp(gamma);
+	mq_add(&gq->q, c, tag);
+	gq->gamma[gq->q.moves - 1] = double_to_fixp(gamma);
+	gq->total += gq->gamma[gq->q.moves - 1];
 }
 
 static inline void
-mq_gamma_print(struct move_queue *q, fixp_t *gammas, struct board *b, char *label)
+mq_gamma_print(struct move_gamma_queue *gq, struct board *b, char *label)
 {
 	fprintf(stderr, "%s candidate moves: ", label);
-	for (unsigned int i = 0; i < q->moves; i++) {
-		fprintf(stderr, "%s(%.3f) ", coord2sstr(q->move[i], b), fixp_to_double(gammas[i]));
+	for (unsigned int i = 0; i < gq->q.moves; i++) {
+		fprintf(stderr, "%s(%.3f) ", coord2sstr(gq->q.move[i], b), fixp_to_double(gq->gamma[i]));
 	}
 	fprintf(stderr, "\n");
 }
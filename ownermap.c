@@ -29,7 +29,7 @@ printhook(struct board *board, coord_t c, char *s, char *end, void *data)
 void
 board_print_ownermap(struct board *b, FILE *f, struct board_ownermap *ownermap)
 {
-        board_print_custom(b, stderr, printhook, ownermap);
+        board_print_custom(b, f, printhook, ownermap);
 }
 
 void
@@ -10,23 +10,33 @@
 #include "board.h"
 #include "debug.h"
 #include "engine.h"
+#include "fbook.h"
 #include "replay/replay.h"
 #include "montecarlo/montecarlo.h"
 #include "random/random.h"
 #include "patternscan/patternscan.h"
 #include "patternplay/patternplay.h"
 #include "joseki/joseki.h"
+#include "joseki/base.h"
 #include "t-unit/test.h"
+#include "t-unit/bench.h"
 #include "uct/uct.h"
 #include "distributed/distributed.h"
 #include "gtp.h"
+#include "logger.h"
 #include "chat.h"
 #include "timeinfo.h"
 #include "random.h"
 #include "version.h"
 #include "network.h"
+#include "selfplay.h"
+#include "server.h"
+#include "metrics.h"
+#include "pattern.h"
+#include "patternsp.h"
 #include "uct/tree.h"
 #include "dcnn.h"
+#include "simd.h"
 
 int debug_level = 3;
 bool debug_boardprint = true;
@@ -72,12 +82,25 @@ static struct engine *init_engine(enum engine_id engine, char *e_arg, struct boa
 	return e;
 }
 
+/* Engine of the -M server sessions. */
+struct server_engine {
+	enum engine_id engine;
+	char *e_arg;
+};
+
+static struct engine *server_init_engine(struct board *b, void *data)
+{
+	struct server_engine *se = data;
+	return init_engine(se->engine, se->e_arg, b);
+}
+
 static void usage(char *name)
 {
 	fprintf(stderr, "Pachi version %s\n", PACHI_VERSION);
-	fprintf(stderr, "Usage: %s [-e random|replay|montecarlo|uct|distributed|dcnn]\n"
-		" [-d DEBUG_LEVEL] [-D] [-r RULESET] [-s RANDOM_SEED] [-t TIME_SETTINGS] [-u TEST_FILENAME]\n"
-		" [-g [HOST:]GTP_PORT] [-l [HOST:]LOG_PORT] [-f FBOOKFILE] [ENGINE_ARGS]\n", name);
+	fprintf(stderr, "Usage: %s [-e random|replay|montecarlo|uct|distributed|dcnn|bench|compile_fbook|compile_joseki|compile_spatial|scan_corpus|selfplay]\n"
+		" [-a] [-d DEBUG_LEVEL] [-D] [-r RULESET] [-s RANDOM_SEED] [-t TIME_SETTINGS] [-u TEST_FILENAME]\n"
+		" [-g [HOST:]GTP_PORT] [-M GTP_PORT[,MAX_GAMES]] [-l [HOST:]LOG_PORT] [-L] [-m METRICS_PORT] [-f FBOOKFILE]\n"
+		" [-x generic|avx2|avx512|neon] [ENGINE_ARGS]\n", name);
 }
 
 int main(int argc, char *argv[])
@@ -86,17 +109,33 @@ int main(int argc, char *argv[])
 	struct time_info ti_default = { .period = TT_NULL };
 	char *testfile = NULL;
 	char *gtp_port = NULL;
+	char *serve_port = NULL;
+	int serve_games = 64;
 	char *log_port = NULL;
+	char *metrics_port = NULL;
 	int gtp_sock = -1;
 	char *chatfile = NULL;
 	char *fbookfile = NULL;
 	char *ruleset = NULL;
+	char *simd_force = NULL;
+	bool benchmark = false;
+	bool compile_fbook = false;
+	bool compile_joseki = false;
+	bool compile_spatial = false;
+	bool scan_corpus = false;
+	bool self_play = false;
+	bool async_gtp = false;
 
 	seed = time(NULL) ^ getpid();
 
 	int opt;
-	while ((opt = getopt(argc, argv, "c:e:d:Df:g:l:r:s:t:u:")) != -1) {
+	while ((opt = getopt(argc, argv, "ac:e:d:Df:g:l:Lm:M:r:s:t:u:x:")) != -1) {
 		switch (opt) {
+			case 'a':
+				/* Answer the queries during a search,
+				 * see gtp_async_start(). */
+				async_gtp = true;
+				break;
 			case 'c':
 				chatfile = strdup(optarg);
 				break;
@@ -117,6 +156,30 @@ int main(int argc, char *argv[])
 					engine = E_PATTERNPLAY;
 				} else if (!strcasecmp(optarg, "joseki")) {
 					engine = E_JOSEKI;
+				} else if (!strcasecmp(optarg, "bench")) {
+					/* Not an engine; playout throughput benchmark,
+					 * or search thread scaling (bench search). */
+					benchmark = true;
+				} else if (!strcasecmp(optarg, "compile_fbook")) {
+					/* Not an engine; compile the -f text
+					 * fbook to the file given as argument. */
+					compile_fbook = true;
+				} else if (!strcasecmp(optarg, "compile_spatial")) {
+					/* Not an engine; compile the spatial
+					 * dictionary, see patternsp.h. */
+					compile_spatial = true;
+				} else if (!strcasecmp(optarg, "compile_joseki")) {
+					/* Not an engine; compile joseki<SIZE>.pdict
+					 * for the board size given as argument. */
+					compile_joseki = true;
+				} else if (!strcasecmp(optarg, "scan_corpus")) {
+					/* Not an engine; patternscan over game
+					 * files given as arguments, in parallel. */
+					scan_corpus = true;
+				} else if (!strcasecmp(optarg, "selfplay")) {
+					/* Not an engine; UCT self-play games,
+					 * see selfplay.h. */
+					self_play = true;
 #ifdef DCNN
 				} else if (!strcasecmp(optarg, "dcnn")) {
 					engine = E_DCNN;
@@ -141,6 +204,27 @@ int main(int argc, char *argv[])
 			case 'l':
 				log_port = strdup(optarg);
 				break;
+			case 'L':
+				/* Search threads log through a background
+				 * thread, see logger.h. */
+				logger_init();
+				break;
+			case 'm':
+				/* Live search telemetry over HTTP. */
+				metrics_port = strdup(optarg);
+				break;
+			case 'M':
+				/* Serve many games at once; see server.h. */
+				serve_port = strdup(optarg);
+				if (strchr(serve_port, ',')) {
+					serve_games = atoi(strchr(serve_port, ',') + 1);
+					*strchr(serve_port, ',') = 0;
+				}
+				if (serve_games < 1) {
+					fprintf(stderr, "%s: Invalid -M argument %s\n", argv[0], optarg);
+					exit(1);
+				}
+				break;
 			case 'r':
 				ruleset = strdup(optarg);
 				break;
@@ -166,15 +250,60 @@ int main(int argc, char *argv[])
 			case 'u':
 				testfile = strdup(optarg);
 				break;
+			case 'x':
+				/* Instruction set of the vectorized
+				 * kernels, instead of the best one
+				 * supported. */
+				simd_force = strdup(optarg);
+				break;
 			default: /* '?' */
 				usage(argv[0]);
 				exit(1);
 		}
 	}
 
+	simd_init(simd_force);
 	dcnn_quiet_caffe(argc, argv);
 	if (log_port)
 		open_log_port(log_port);
+	if (metrics_port)
+		metrics_serve(metrics_port);
+
+	if (benchmark) {
+		bench(optind < argc ? argv[optind] : NULL, optind + 1 < argc ? argv[optind + 1] : NULL);
+		return 0;
+	}
+	if (compile_fbook) {
+		if (!fbookfile || optind >= argc) {
+			fprintf(stderr, "Usage: %s -f FBOOKFILE -e compile_fbook OUTFILE\n", argv[0]);
+			exit(1);
+		}
+		return fbook_compile(fbookfile, argv[optind]) ? 0 : 1;
+	}
+	if (compile_spatial) {
+		/* Load the text dictionary hashed as for playing. */
+		struct pattern_setup pat;
+		patterns_init(&pat, optind < argc ? argv[optind] : NULL, true, true);
+		if (!pat.pc.spat_dict || pat.pc.spat_dict->nspatials <= 1) {
+			fprintf(stderr, "No spatial dictionary %s\n", spatial_dict_filename);
+			exit(1);
+		}
+		return spatial_dict_compile(pat.pc.spat_dict, spatial_dict_compiled_filename) ? 0 : 1;
+	}
+	if (compile_joseki) {
+		if (optind >= argc) {
+			fprintf(stderr, "Usage: %s -e compile_joseki SIZE\n", argv[0]);
+			exit(1);
+		}
+		return joseki_compile(atoi(argv[optind]) + 2) ? 0 : 1;
+	}
+	if (scan_corpus) {
+		if (optind + 1 >= argc) {
+			fprintf(stderr, "Usage: %s -e scan_corpus PATTERNSCAN_ARGS FILE...\n", argv[0]);
+			exit(1);
+		}
+		return patternscan_corpus(argv[optind], argc - optind - 1, argv + optind + 1);
+	}
 
 	fast_srandom(seed);
 	if (DEBUGL(0))
@@ -188,15 +317,40 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	struct time_info ti[S_MAX];
-	ti[S_BLACK] = ti_default;
-	ti[S_WHITE] = ti_default;
-
 	chat_init(chatfile);
 
 	char *e_arg = NULL;
 	if (optind < argc)
 		e_arg = argv[optind];
+
+	if (serve_port) {
+		struct server_engine se = { .engine = engine, .e_arg = e_arg };
+		struct gtp_server_setup setup = {
+			.port = serve_port, .max_games = serve_games,
+			.fbookfile = fbookfile, .ruleset = ruleset,
+			.ti_default = ti_default,
+			.init_engine = server_init_engine, .data = &se,
+		};
+		gtp_serve(&setup);
+	}
+	if (self_play) {
+		/* The engine arguments follow the selfplay ones. */
+		struct server_engine se = { .engine = engine, .e_arg = optind + 1 < argc ? argv[optind + 1] : NULL };
+		struct selfplay_setup setup = {
+			.fbookfile = fbookfile, .ruleset = ruleset,
+			.ti_default = ti_default,
+			.init_engine = server_init_engine, .data = &se,
+		};
+		return selfplay(&setup, e_arg);
+	}
+
+	/* The lag of our GTP peer, see struct time_lag. */
+	struct time_lag lag = { 0 };
+	ti_default.lag = &lag;
+	struct time_info ti[S_MAX];
+	ti[S_BLACK] = ti_default;
+	ti[S_WHITE] = ti_default;
+
 	struct engine *e = init_engine(engine, e_arg, b);
 
 	if (testfile) {
@@ -208,9 +362,12 @@ int main(int argc, char *argv[])
 		open_gtp_connection(&gtp_sock, gtp_port);
 	}
 
-	for (;;) {
+	bool quit = false;
+	while (!quit) {
 		char buf[4096];
-		while (fgets(buf, 4096, stdin)) {
+		if (async_gtp)
+			gtp_async_start();
+		while (async_gtp ? gtp_async_gets(buf, 4096) : !!fgets(buf, 4096, stdin)) {
 			if (DEBUGL(1))
 				fprintf(stderr, "IN: %s", buf);
 
@@ -227,10 +384,14 @@ int main(int argc, char *argv[])
 				/* The gtp command is a weak identity check,
 				 * close the connection with a wrong peer. */
 				break;
+			} else if (c == P_QUIT) {
+				quit = true;
+				break;
 			}
 		}
-		if (!gtp_port) break;
+		if (!gtp_port || quit) break;
 		open_gtp_connection(&gtp_sock, gtp_port);
+		lag = (struct time_lag) { 0 };
 	}
 	engine_done(e);
 	chat_done();
@@ -142,6 +142,11 @@ patterns_init(struct pattern_setup *pat, char *arg, bool will_append, bool load_
 			} else if (!strcasecmp(optname, "pdict_file") && optval) {
 				pdict_file = optval;
 
+			} else if (!strcasecmp(optname, "threads") && optval) {
+				/* Split the moves rated by pattern_rate_moves()
+				 * between this many threads. */
+				pat->threads = atoi(optval);
+
 			} else {
 				fprintf(stderr, "patterns: Invalid argument %s or missing value\n", optname);
 				exit(EXIT_FAILURE);
@@ -407,12 +412,11 @@ pattern_match_atari(struct pattern_config *pc, pattern_spec ps,
 #define BOARD_SPATHASH_MAXD 1
 #endif
 
-/* Match spatial features that are too distant to be pre-matched
- * incrementally. */
-struct feature *
-pattern_match_spatial_outer(struct pattern_config *pc, pattern_spec ps,
-                            struct pattern *p, struct feature *f,
-		            struct board *b, struct move *m, hash_t h)
+/* Compute the hashes of spatial features that are too distant to be
+ * pre-matched incrementally, from @h of the inner ones, to @hs[d]. */
+static void
+pattern_hash_spatial_outer(struct pattern_config *pc, struct board *b,
+                           struct move *m, hash_t h, hash_t *hs)
 {
 	/* We record all spatial patterns black-to-play; simply
 	 * reverse all colors if we are white-to-play. */
@@ -427,18 +431,10 @@ pattern_match_spatial_outer(struct pattern_config *pc, pattern_spec ps,
 			ptcoords_at(x, y, m->coord, b, j);
 			h ^= pthashes[0][j][(*bt)[board_atxy(b, x, y)]];
 		}
-		if (d < pc->spat_min)
-			continue;
-		/* Record spatial feature, one per distance. */
-		unsigned int sid = spatial_dict_get(pc->spat_dict, d, h & spatial_hash_mask);
-		if (sid > 0) {
-			f->id = FEAT_SPATIAL;
-			f->payload = sid;
-			if (!pc->spat_largest)
-				(f++, p->n++);
-		} /* else not found, ignore */
+		hs[d] = h & spatial_hash_mask;
+		if (d >= pc->spat_min)
+			spatial_dict_prefetch(pc->spat_dict, hs[d]);
 	}
-	return f;
 }
 
 struct feature *
@@ -452,16 +448,29 @@ pattern_match_spatial(struct pattern_config *pc, pattern_spec ps,
 	assert(pc->spat_min > 0);
 	f->id = -1;
 
+	/* First compute the hashes of all the distances and start
+	 * fetching their buckets, then look them up; the lookups of
+	 * large dictionaries are cache misses, this way they overlap. */
+	hash_t hs[MAX_PATTERN_DIST + 1];
 	hash_t h = pthashes[0][0][S_NONE];
 #ifdef BOARD_SPATHASH
 	bool w_to_play = m->color == S_WHITE;
-	for (int d = 2; d <= BOARD_SPATHASH_MAXD; d++) {
+	for (unsigned int d = 2; d <= BOARD_SPATHASH_MAXD; d++) {
 		/* Reuse all incrementally matched data. */
 		h ^= b->spathash[m->coord][d - 1][w_to_play];
-		if (d < pc->spat_min)
-			continue;
+		hs[d] = h & spatial_hash_mask;
+		if (d >= pc->spat_min)
+			spatial_dict_prefetch(pc->spat_dict, hs[d]);
+	}
+#else
+	assert(BOARD_SPATHASH_MAXD < 2);
+#endif
+	if (unlikely(pc->spat_max > BOARD_SPATHASH_MAXD))
+		pattern_hash_spatial_outer(pc, b, m, h, hs);
+
+	for (unsigned int d = pc->spat_min > 2 ? pc->spat_min : 2; d <= pc->spat_max; d++) {
 		/* Record spatial feature, one per distance. */
-		unsigned int sid = spatial_dict_get(pc->spat_dict, d, h & spatial_hash_mask);
+		unsigned int sid = spatial_dict_get(pc->spat_dict, d, hs[d]);
 		if (sid > 0) {
 			f->id = FEAT_SPATIAL;
 			f->payload = sid;
@@ -469,11 +478,6 @@ pattern_match_spatial(struct pattern_config *pc, pattern_spec ps,
 				(f++, p->n++);
 		} /* else not found, ignore */
 	}
-#else
-	assert(BOARD_SPATHASH_MAXD < 2);
-#endif
-	if (unlikely(pc->spat_max > BOARD_SPATHASH_MAXD))
-		f = pattern_match_spatial_outer(pc, ps, p, f, b, m, h);
 	if (pc->spat_largest && f->id == FEAT_SPATIAL)
 		(f++, p->n++);
 	return f;
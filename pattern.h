@@ -140,6 +140,9 @@ struct pattern_setup {
 	struct pattern_config pc;
 	pattern_spec ps;
 	struct pattern_pdict *pd;
+	/* Threads rating the moves in pattern_rate_moves(), including
+	 * the calling one; 0 or 1 to rate them serially. */
+	int threads;
 };
 
 void patterns_init(struct pattern_setup *pat, char *arg, bool will_append, bool load_prob);
@@ -20,25 +20,17 @@ struct move;
 
 /* XXX: See <board.h> for hash3_t typedef. */
 
-struct pattern2p {
-	hash3_t pattern;
-	unsigned char value;
-};
-
 struct pattern3s {
-	/* In case of a collision, following hash entries are
-	 * used. value==0 indicates an unoccupied hash entry. */
-	/* The hash indices are zobrist hashes based on p3hashes. */
-#define pattern3_hash_bits 19
+	/* Direct map indexed by the 20-bit hash3_t code itself; there are
+	 * no collisions or probe loops and the whole table is 1MiB, which
+	 * stays cache resident during playouts. */
+	/* Value bits 0-1: matching colors (0 == no pattern);
+	 * bits 2-7: pattern index. */
+#define pattern3_hash_bits 20
 #define pattern3_hash_size (1 << pattern3_hash_bits)
-#define pattern3_hash_mask (pattern3_hash_size - 1)
-	struct pattern2p hash[pattern3_hash_size];
+	unsigned char value[pattern3_hash_size];
 };
 
-/* Zobrist hashes for the various 3x3 points. */
-/* [point][is_atari][color] */
-hash_t p3hashes[8][2][S_MAX];
-
 /* Source pattern encoding:
  * X: black;  O: white;  .: empty;  #: edge
  * x: !black; o: !white; ?: any
@@ -90,17 +82,6 @@ pattern3_hash(struct board *b, coord_t c)
 	return pat;
 }
 
-static inline __attribute__((const)) hash_t
-hash3_to_hash(hash3_t pat)
-{
-	hash_t h = 0;
-	static const int ataribits[8] = { -1, 0, -1, 1, 2, -1, 3, -1 };
-	for (int i = 0; i < 8; i++) {
-		h ^= p3hashes[i][ataribits[i] >= 0 ? (pat >> (16 + ataribits[i])) & 1 : 0][(pat >> (i*2)) & 3];
-	}
-	return h;
-}
-
 static inline bool
 pattern3_move_here(struct pattern3s *p, struct board *b, struct move *m, char *idx)
 {
@@ -109,12 +90,9 @@ pattern3_move_here(struct pattern3s *p, struct board *b, struct move *m, char *i
 #else
 	hash3_t pat = pattern3_hash(b, m->coord);
 #endif
-	hash_t h = hash3_to_hash(pat);
-	while (p->hash[h & pattern3_hash_mask].pattern != pat
-	       && p->hash[h & pattern3_hash_mask].value != 0)
-		h++;
-	if (p->hash[h & pattern3_hash_mask].value & m->color) {
-		*idx = p->hash[h & pattern3_hash_mask].value >> 2;
+	unsigned char value = p->value[pat];
+	if (value & m->color) {
+		*idx = value >> 2;
 		return true;
 	} else {
 		return false;
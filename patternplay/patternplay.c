@@ -1,6 +1,8 @@
 #include <assert.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include "board.h"
 #include "debug.h"
@@ -16,6 +18,7 @@
 /* Internal engine state. */
 struct patternplay {
 	int debug_level;
+	int threads;
 
 	struct pattern_setup pat;
 };
@@ -71,6 +74,67 @@ patternplay_evaluate(struct engine *e, struct board *b, struct time_info *ti, fl
 }
 
 
+/* Batch positions are handed out to the threads in runs of this many
+ * consecutive ones, so that most can be rated incrementally from the
+ * position two moves back. */
+#define BATCH_RUN 16
+
+struct patternplay_batch {
+	struct patternplay *pp;
+	int n;
+	struct board *boards;
+	enum stone *colors;
+	floating_t **vals;
+	int next;
+};
+
+static void *
+patternplay_batch_thread(void *data)
+{
+	struct patternplay_batch *pb = data;
+	struct patternplay *pp = pb->pp;
+
+	/* Per-thread scratch, reused over all the positions. */
+	struct pattern *pats = malloc2(board_size2(&pb->boards[0]) * sizeof(*pats));
+	struct pattern_ratings prev[S_MAX] = {{ 0 }};
+
+	int i;
+	while ((i = __sync_fetch_and_add(&pb->next, BATCH_RUN)) < pb->n) {
+		int end = i + BATCH_RUN < pb->n ? i + BATCH_RUN : pb->n;
+		for (; i < end; i++) {
+			struct board *b = &pb->boards[i];
+			enum stone color = pb->colors[i];
+			pattern_rate_moves_incr(&pp->pat, b, color, &prev[color], pats, pb->vals[i]);
+			pattern_ratings_save(&prev[color], b, color, pb->vals[i]);
+		}
+	}
+
+	for (int c = 0; c < S_MAX; c++)
+		pattern_ratings_done(&prev[c]);
+	free(pats);
+	return NULL;
+}
+
+void
+patternplay_evaluate_batch(struct engine *e, int n, struct board *boards, enum stone *colors, floating_t **vals)
+{
+	struct patternplay *pp = e->data;
+	if (!n)
+		return;
+
+	struct patternplay_batch pb = {
+		.pp = pp, .n = n, .boards = boards, .colors = colors, .vals = vals,
+	};
+	int threads = (n + BATCH_RUN - 1) / BATCH_RUN;
+	if (threads > pp->threads) threads = pp->threads;
+	pthread_t thread[threads];
+	for (int t = 0; t < threads; t++)
+		pthread_create(&thread[t], NULL, patternplay_batch_thread, &pb);
+	for (int t = 0; t < threads; t++)
+		pthread_join(thread[t], NULL);
+}
+
+
 struct patternplay *
 patternplay_state_init(char *arg)
 {
@@ -78,6 +142,7 @@ patternplay_state_init(char *arg)
 	bool pat_setup = false;
 
 	pp->debug_level = debug_level;
+	pp->threads = sysconf(_SC_NPROCESSORS_ONLN);
 
 	if (arg) {
 		char *optspec, *next = arg;
@@ -96,6 +161,11 @@ patternplay_state_init(char *arg)
 				else
 					pp->debug_level++;
 
+			} else if (!strcasecmp(optname, "threads") && optval) {
+				/* Number of threads rating the positions
+				 * of pachi-evaluate_moves. */
+				pp->threads = atoi(optval);
+
 			} else if (!strcasecmp(optname, "patterns") && optval) {
 				patterns_init(&pp->pat, optval, false, true);
 				pat_setup = true;
@@ -107,6 +177,8 @@ patternplay_state_init(char *arg)
 		}
 	}
 
+	if (pp->threads < 1)
+		pp->threads = 1;
 	if (!pat_setup)
 		patterns_init(&pp->pat, NULL, false, true);
 
@@ -122,6 +194,7 @@ engine_patternplay_init(char *arg, struct board *b)
 	e->comment = "I select moves blindly according to learned patterns. I won't pass as long as there is a place on the board where I can play. When we both pass, I will consider all the stones on the board alive.";
 	e->genmove = patternplay_genmove;
 	e->evaluate = patternplay_evaluate;
+	e->evaluate_batch = patternplay_evaluate_batch;
 	e->data = pp;
 
 	return e;
@@ -1,16 +1,39 @@
 #define DEBUG
 #include <assert.h>
 #include <ctype.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "board.h"
 #include "debug.h"
+#include "memstats.h"
 #include "pattern.h"
 #include "patternsp.h"
 #include "patternprob.h"
 
 
+/* Pattern read from the probability table file. */
+struct pdict_rec {
+	struct pattern p;
+	floating_t prob;
+	uint64_t sig;
+	uint32_t spi;
+	int seq;
+};
+
+static int
+pdict_rec_cmp(const void *a_, const void *b_)
+{
+	const struct pdict_rec *a = a_, *b = b_;
+	if (a->spi != b->spi)
+		return a->spi < b->spi ? -1 : 1;
+	if (a->sig != b->sig)
+		return a->sig < b->sig ? -1 : 1;
+	return a->seq - b->seq;
+}
+
 /* We try to avoid needlessly reloading probability dictionary
  * since it may take rather long time. */
 static struct pattern_pdict *cached_dict;
@@ -18,10 +41,8 @@ static struct pattern_pdict *cached_dict;
 struct pattern_pdict *
 pattern_pdict_init(char *filename, struct pattern_config *pc)
 {
-	if (cached_dict) {
-		cached_dict->pc = pc;
+	if (cached_dict)
 		return cached_dict;
-	}
 
 	if (!filename)
 		filename = "patterns.prob";
@@ -33,37 +54,45 @@ pattern_pdict_init(char *filename, struct pattern_config *pc)
 	}
 
 	struct pattern_pdict *dict = calloc2(1, sizeof(*dict));
-	dict->pc = pc;
-	dict->table = calloc2(pc->spat_dict->nspatials + 1, sizeof(*dict->table));
+	dict->spat_dict = pc->spat_dict;
+	unsigned int nspatials = pc->spat_dict->nspatials;
 
-	char *sphcachehit = calloc2(pc->spat_dict->nspatials, 1);
-	hash_t (*sphcache)[PTH__ROTATIONS] = malloc(pc->spat_dict->nspatials * sizeof(sphcache[0]));
+	char *sphcachehit = calloc2(nspatials, 1);
+	hash_t (*sphcache)[PTH__ROTATIONS] = malloc(nspatials * sizeof(sphcache[0]));
 
+	/* Read all entries first, then group them by spatial. */
+	int size = 1024;
+	struct pdict_rec *recs = malloc2(size * sizeof(*recs));
 	int i = 0;
 	char sbuf[1024];
 	while (fgets(sbuf, sizeof(sbuf), f)) {
-		struct pattern_prob *pb = calloc2(1, sizeof(*pb));
 		int c, o;
 
 		char *buf = sbuf;
 		if (buf[0] == '#') continue;
+		if (i == size) {
+			size *= 2;
+			recs = realloc2(recs, size * sizeof(*recs));
+		}
+		struct pdict_rec *r = &recs[i];
+		memset(r, 0, sizeof(*r));
 		while (isspace(*buf)) buf++;
 		while (!isspace(*buf)) buf++; // we recompute the probability
 		while (isspace(*buf)) buf++;
 		c = strtol(buf, &buf, 10);
 		while (isspace(*buf)) buf++;
 		o = strtol(buf, &buf, 10);
-		pb->prob = (floating_t) c / o;
+		r->prob = (floating_t) c / o;
 		while (isspace(*buf)) buf++;
-		str2pattern(buf, &pb->p);
+		str2pattern(buf, &r->p);
+		r->sig = pattern_sig(&r->p);
+		r->seq = i;
 
-		uint32_t spi = pattern2spatial(dict, &pb->p);
-		pb->next = dict->table[spi];
-		dict->table[spi] = pb;
+		uint32_t spi = r->spi = pattern2spatial(dict, &r->p);
 
 		/* Some spatials may not have been loaded if they correspond
 		 * to a radius larger than supported. */
-		if (pc->spat_dict->spatials[spi].dist > 0) {
+		if (spi < nspatials && pc->spat_dict->spatials[spi].dist > 0) {
 			/* We rehash spatials in the order of loaded patterns. This way
 			 * we make sure that the most popular patterns will be hashed
 			 * last and therefore take priority. */
@@ -85,38 +114,308 @@ pattern_pdict_init(char *filename, struct pattern_config *pc)
 		spatial_dict_hashstats(pc->spat_dict);
 
 	fclose(f);
+
+	/* Sort by spatial and signature; of identical patterns,
+	 * the last one loaded is used. */
+	qsort(recs, i, sizeof(*recs), pdict_rec_cmp);
+	int n = 0;
+	for (int j = 0; j < i; j++) {
+		if (j + 1 < i && recs[j + 1].spi == recs[j].spi && recs[j + 1].sig == recs[j].sig
+		    && pattern_eq(&recs[j + 1].p, &recs[j].p))
+			continue;
+		recs[n++] = recs[j];
+	}
+	dict->offsets = calloc2(nspatials + 2, sizeof(*dict->offsets));
+	dict->probs = malloc2((n ? n : 1) * sizeof(*dict->probs));
+	dict->pats = malloc2((n ? n : 1) * sizeof(*dict->pats));
+	mem_account(MEM_PATTERN, (nspatials + 2) * sizeof(*dict->offsets)
+		    + (n ? n : 1) * (sizeof(*dict->probs) + sizeof(*dict->pats)));
+	for (int j = 0; j < n; j++) {
+		dict->offsets[recs[j].spi + 1]++;
+		dict->probs[j] = (struct pattern_prob){ .sig = recs[j].sig, .prob = recs[j].prob };
+		dict->pats[j] = recs[j].p;
+	}
+	for (unsigned int spi = 0; spi <= nspatials; spi++)
+		dict->offsets[spi + 1] += dict->offsets[spi];
+	free(recs);
+
 	if (DEBUGL(1))
 		fprintf(stderr, "Loaded %d pattern-probability pairs.\n", i);
 	cached_dict = dict;
 	return dict;
 }
 
+static void
+pattern_rate_move(struct pattern_setup *pat, struct board *b, enum stone color,
+		  int f, struct pattern *pats, floating_t *probs)
+{
+	probs[f] = NAN;
+
+	struct move mo = { .coord = b->f[f], .color = color };
+	if (is_pass(mo.coord))
+		return;
+	if (!board_is_valid_move(b, &mo))
+		return;
+
+	pattern_match(&pat->pc, pat->ps, &pats[f], b, &mo);
+	floating_t prob = pattern_prob(pat->pd, &pats[f]);
+	if (!isnan(prob))
+		probs[f] = prob;
+	if (DEBUGL(5)) {
+		char buf[256]; pattern2str(buf, &pats[f]);
+		fprintf(stderr, "=> move %s pattern %s prob %.3f\n", coord2sstr(mo.coord, b), buf, prob);
+	}
+}
+
+
+/* Parallel rating: each pattern_rate_moves() call is a job which the
+ * caller works on and puts in a queue, where helper threads join it.
+ * The moves are taken in chunks from a shared index. Matching plays
+ * moves on the board temporarily (ladder reading), so each helper
+ * works on its own copy of the board. The helpers are shared by all
+ * callers, e.g. all search threads expanding nodes. */
+
+#define RATE_CHUNK 8
+/* Not worth splitting below this many moves. */
+#define RATE_MIN_MOVES 64
+
+struct rate_job {
+	struct pattern_setup *pat;
+	enum stone color;
+	struct pattern *pats;
+	floating_t *probs;
+	int flen;
+	volatile int next; // next move to rate
+	struct board *boards; // copies for the helpers
+	int boards_n, boards_next;
+	int active; // helpers working on the job
+	struct rate_job *qnext;
+};
+
+static pthread_mutex_t rate_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rate_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t rate_done_cond = PTHREAD_COND_INITIALIZER;
+static struct rate_job *rate_queue;
+static int rate_helpers;
+
+static void
+rate_job_work(struct rate_job *job, struct board *b)
+{
+	int f;
+	while ((f = __sync_fetch_and_add(&job->next, RATE_CHUNK)) < job->flen) {
+		int end = f + RATE_CHUNK < job->flen ? f + RATE_CHUNK : job->flen;
+		for (; f < end; f++)
+			pattern_rate_move(job->pat, b, job->color, f, job->pats, job->probs);
+	}
+}
+
+/* Remove job from the queue; called with rate_lock held. */
+static void
+rate_job_dequeue(struct rate_job *job)
+{
+	for (struct rate_job **jp = &rate_queue; *jp; jp = &(*jp)->qnext)
+		if (*jp == job) {
+			*jp = job->qnext;
+			return;
+		}
+}
+
+static void *
+rate_helper(void *data)
+{
+	pthread_mutex_lock(&rate_lock);
+	while (true) {
+		while (!rate_queue)
+			pthread_cond_wait(&rate_cond, &rate_lock);
+		struct rate_job *job = rate_queue;
+		struct board *b = &job->boards[job->boards_next++];
+		if (job->boards_next == job->boards_n)
+			rate_job_dequeue(job);
+		job->active++;
+		pthread_mutex_unlock(&rate_lock);
+
+		rate_job_work(job, b);
+
+		pthread_mutex_lock(&rate_lock);
+		if (!--job->active)
+			pthread_cond_broadcast(&rate_done_cond);
+	}
+	return NULL;
+}
+
+static void
+rate_helpers_start(int n)
+{
+	pthread_mutex_lock(&rate_lock);
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for (; rate_helpers < n; rate_helpers++) {
+		pthread_t thread;
+		pthread_create(&thread, &attr, rate_helper, NULL);
+	}
+	pthread_attr_destroy(&attr);
+	pthread_mutex_unlock(&rate_lock);
+}
+
 floating_t
 pattern_rate_moves(struct pattern_setup *pat,
                    struct board *b, enum stone color,
                    struct pattern *pats, floating_t *probs)
 {
+	int helpers = pat->threads - 1;
+	if (helpers > 0 && b->flen >= RATE_MIN_MOVES) {
+		if (rate_helpers < helpers)
+			rate_helpers_start(helpers);
+
+		struct board *boards = malloc2(helpers * sizeof(*boards));
+		for (int i = 0; i < helpers; i++)
+			board_copy(&boards[i], b);
+		struct rate_job job = {
+			.pat = pat, .color = color, .pats = pats, .probs = probs,
+			.flen = b->flen, .boards = boards, .boards_n = helpers,
+		};
+
+		pthread_mutex_lock(&rate_lock);
+		job.qnext = rate_queue;
+		rate_queue = &job;
+		pthread_cond_broadcast(&rate_cond);
+		pthread_mutex_unlock(&rate_lock);
+
+		rate_job_work(&job, b);
+
+		pthread_mutex_lock(&rate_lock);
+		if (job.boards_next < job.boards_n)
+			rate_job_dequeue(&job);
+		while (job.active)
+			pthread_cond_wait(&rate_done_cond, &rate_lock);
+		pthread_mutex_unlock(&rate_lock);
+
+		for (int i = 0; i < helpers; i++)
+			board_done_noalloc(&boards[i]);
+		free(boards);
+	} else {
+		for (int f = 0; f < b->flen; f++)
+			pattern_rate_move(pat, b, color, f, pats, probs);
+	}
+
 	double total = 0;
-	for (int f = 0; f < b->flen; f++) {
-		probs[f] = NAN;
+	for (int f = 0; f < b->flen; f++)
+		if (!isnan(probs[f]))
+			total += probs[f];
+	return total;
+}
 
-		struct move mo = { .coord = b->f[f], .color = color };
-		if (is_pass(mo.coord))
-			continue;
-		if (!board_is_valid_move(b, &mo))
+
+/* Incremental rating: a move keeps its rating unless a stone within
+ * the spatial pattern radius changed, a neighboring group has changed
+ * liberties or few enough of them for the tactical features (capture,
+ * atari, ladders, self-atari) to come into play, or the move is at
+ * either of the ko points. Beyond this many changed points the
+ * affected area is most of the board anyway. */
+#define INCR_MAX_CHANGES 16
+#define INCR_TACTICAL_LIBS 3
+
+static unsigned char
+ratings_libs(struct board *b, coord_t c)
+{
+	group_t g = group_at(b, c);
+	if (!g)
+		return 0;
+	int libs = board_group_info(b, g).libs;
+	return libs < 255 ? libs : 255;
+}
+
+void
+pattern_ratings_save(struct pattern_ratings *r, struct board *b, enum stone color, floating_t *probs)
+{
+	int size2 = board_size2(b);
+	if (r->size2 != size2) {
+		pattern_ratings_done(r);
+		r->probs = malloc2(size2 * sizeof(*r->probs));
+		r->stones = malloc2(size2 * sizeof(*r->stones));
+		r->libs = malloc2(size2 * sizeof(*r->libs));
+		r->size2 = size2;
+		mem_account(MEM_PATTERN, size2 * (sizeof(*r->probs) + sizeof(*r->stones) + sizeof(*r->libs)));
+	}
+	r->color = color;
+	r->ko = b->ko.coord;
+	foreach_point(b) {
+		r->stones[c] = board_at(b, c);
+		r->libs[c] = ratings_libs(b, c);
+	} foreach_point_end;
+	for (int f = 0; f < b->flen; f++)
+		r->probs[b->f[f]] = probs[f];
+}
+
+void
+pattern_ratings_done(struct pattern_ratings *r)
+{
+	if (!r->size2)
+		return;
+	mem_account(MEM_PATTERN, -(long long) r->size2 * (sizeof(*r->probs) + sizeof(*r->stones) + sizeof(*r->libs)));
+	free(r->probs);
+	free(r->stones);
+	free(r->libs);
+	r->size2 = 0;
+}
+
+floating_t
+pattern_rate_moves_incr(struct pattern_setup *pat,
+                        struct board *b, enum stone color,
+                        struct pattern_ratings *prev,
+                        struct pattern *pats, floating_t *probs)
+{
+	if (!prev || prev->size2 != board_size2(b) || prev->color != color
+	    || is_pass(prev->ko) != is_pass(b->ko.coord))
+		return pattern_rate_moves(pat, b, color, pats, probs);
+
+	coord_t changed[INCR_MAX_CHANGES];
+	int nchanged = 0;
+	foreach_point(b) {
+		if (board_at(b, c) == prev->stones[c])
 			continue;
+		if (nchanged == INCR_MAX_CHANGES)
+			return pattern_rate_moves(pat, b, color, pats, probs);
+		changed[nchanged++] = c;
+	} foreach_point_end;
 
-		pattern_match(&pat->pc, pat->ps, &pats[f], b, &mo);
-		floating_t prob = pattern_prob(pat->pd, &pats[f]);
-		if (!isnan(prob)) {
-			probs[f] = prob;
-			total += prob;
-		}
-		if (DEBUGL(5)) {
-			char buf[256]; pattern2str(buf, &pats[f]);
-			fprintf(stderr, "=> move %s pattern %s prob %.3f\n", coord2sstr(mo.coord, b), buf, prob);
+	/* The radius covers the last move 8-neighborhood (contiguity)
+	 * even with small or no spatial patterns; the last moves are
+	 * among the changed points. */
+	unsigned int dist = pat->pc.spat_max > 3 ? pat->pc.spat_max : 3;
+	bool dirty[board_size2(b)];
+	memset(dirty, 0, sizeof(dirty));
+	for (int i = 0; i < nchanged; i++) {
+		int cx = coord_x(changed[i], b), cy = coord_y(changed[i], b);
+		for (unsigned int j = 0; j < ptind[dist + 1]; j++) {
+			int x = cx + ptcoords[j].x, y = cy + ptcoords[j].y;
+			if (x < 0 || x >= board_size(b) || y < 0 || y >= board_size(b))
+				continue;
+			dirty[coord_xy(b, x, y)] = true;
 		}
 	}
+	if (!is_pass(b->ko.coord)) {
+		dirty[b->ko.coord] = true;
+		dirty[prev->ko] = true;
+	}
+
+	double total = 0;
+	for (int f = 0; f < b->flen; f++) {
+		coord_t c = b->f[f];
+		bool rerate = dirty[c];
+		foreach_neighbor(b, c, {
+			if (rerate || !group_at(b, c))
+				continue;
+			unsigned char libs = ratings_libs(b, c);
+			rerate = libs <= INCR_TACTICAL_LIBS || libs != prev->libs[c];
+		});
+		if (rerate)
+			pattern_rate_move(pat, b, color, f, pats, probs);
+		else
+			probs[f] = prev->probs[c];
+		if (!isnan(probs[f]))
+			total += probs[f];
+	}
 	return total;
 }
-
@@ -15,24 +15,31 @@
  * of the pattern being played. */
 
 /* The table primary key is the pattern spatial (most distinctive
- * feature); within a single primary key chain, the entries are
- * unsorted (for now). */
+ * feature); the entries of a single spatial are kept contiguous and
+ * sorted by pattern_sig(), a compact code of the other features.
+ * Lookup is a binary search over the signatures of the spatial; the
+ * full pattern is compared only on signature match, to rule out
+ * signature collisions. */
 
 struct pattern_prob {
-	struct pattern p;
+	uint64_t sig;
 	floating_t prob;
-	struct pattern_prob *next;
 };
 
 struct pattern_pdict {
-	struct pattern_config *pc;
+	/* The (shared) spatial dictionary the patterns refer to. */
+	struct spatial_dict *spat_dict;
 
-	struct pattern_prob **table; /* [pc->spat_dict->nspatials + 1] */
+	/* Entries of spatial spi are [offsets[spi], offsets[spi + 1]). */
+	uint32_t *offsets; /* [spat_dict->nspatials + 2] */
+	struct pattern_prob *probs;
+	struct pattern *pats; /* parallel to probs[] */
 };
 
 /* Initialize the pdict data structure from a given file (pass NULL
  * to use default filename). Returns NULL if the file with patterns
- * has been found. */
+ * has been found. The dictionary is loaded once and shared by all
+ * callers. */
 struct pattern_pdict *pattern_pdict_init(char *filename, struct pattern_config *pc);
 
 /* Return probability associated with given pattern. Returns NaN if
@@ -47,19 +54,69 @@ floating_t pattern_rate_moves(struct pattern_setup *pat,
                         struct board *b, enum stone color,
                         struct pattern *pats, floating_t *probs);
 
+/* Ratings of all the moves of a position by coordinate, kept around
+ * to rate a later position incrementally. */
+struct pattern_ratings {
+	int size2; // of the arrays, 0 while empty
+	enum stone color;
+	coord_t ko; // the ko point of the position, or pass
+	floating_t *probs;
+	/* The stones and the liberties of their groups (saturated
+	 * at 255) of the rated position. */
+	unsigned char *stones, *libs;
+};
+
+/* Remember the ratings @probs[b->flen] of position @b. */
+void pattern_ratings_save(struct pattern_ratings *r, struct board *b, enum stone color, floating_t *probs);
+void pattern_ratings_done(struct pattern_ratings *r);
+
+/* Like pattern_rate_moves(), but take the ratings of position @prev
+ * (a few moves back, usually) for the moves too far from any change
+ * since to be affected by it, and re-rate only the rest; @pats is
+ * filled only for the re-rated moves. Falls back to rating all the
+ * moves if @prev is NULL or too different. */
+floating_t pattern_rate_moves_incr(struct pattern_setup *pat,
+                             struct board *b, enum stone color,
+                             struct pattern_ratings *prev,
+                             struct pattern *pats, floating_t *probs);
+
 /* Utility function - extract spatial id from a pattern. If the pattern
  * has no spatial feature, it is represented by the highest spatial id
  * plus one. */
 static uint32_t pattern2spatial(struct pattern_pdict *dict, struct pattern *p);
 
 
+/* Signature of the pattern features; the spatial feature is implied
+ * by the table index and not included. */
+static inline uint64_t
+pattern_sig(struct pattern *p)
+{
+	uint64_t h = 0xcbf29ce484222325ULL ^ p->n;
+	for (int i = 0; i < p->n; i++) {
+		if (p->f[i].id == FEAT_SPATIAL)
+			continue;
+		h ^= (uint64_t) p->f[i].id << 24 | p->f[i].payload;
+		h *= 0x100000001b3ULL;
+	}
+	return h ^ (h >> 29);
+}
+
 static inline floating_t
 pattern_prob(struct pattern_pdict *dict, struct pattern *p)
 {
 	uint32_t spi = pattern2spatial(dict, p);
-	for (struct pattern_prob *pb = dict->table[spi]; pb; pb = pb->next)
-		if (pattern_eq(p, &pb->p))
-			return pb->prob;
+	uint64_t sig = pattern_sig(p);
+	uint32_t lo = dict->offsets[spi], hi = dict->offsets[spi + 1];
+	while (lo < hi) {
+		uint32_t mid = (lo + hi) / 2;
+		if (dict->probs[mid].sig < sig)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (uint32_t i = lo; i < dict->offsets[spi + 1] && dict->probs[i].sig == sig; i++)
+		if (pattern_eq(p, &dict->pats[i]))
+			return dict->probs[i].prob;
 	return NAN; // XXX: We assume quiet NAN existence
 }
 
@@ -69,7 +126,7 @@ pattern2spatial(struct pattern_pdict *dict, struct pattern *p)
 	for (int i = 0; i < p->n; i++)
 		if (p->f[i].id == FEAT_SPATIAL)
 			return p->f[i].payload;
-	return dict->pc->spat_dict->nspatials;
+	return dict->spat_dict->nspatials;
 }
 
 #endif
@@ -1,6 +1,14 @@
 #include <assert.h>
+#include <ctype.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 #include "board.h"
 #include "debug.h"
@@ -44,6 +52,9 @@ struct patternscan {
 	 * in case gen_spat_dict is enabled. */
 	int loaded_spatials;
 
+	/* Number of threads for patternscan_corpus(). */
+	int threads;
+
 	/* Book-keeping of spatial occurence count. */
 	int gameno;
 	unsigned int nscounts;
@@ -212,6 +223,7 @@ patternscan_state_init(char *arg)
 
 	ps->debug_level = 1;
 	ps->color_mask = S_BLACK | S_WHITE;
+	ps->threads = 1;
 
 	if (arg) {
 		char *optspec, *next = arg;
@@ -281,6 +293,13 @@ patternscan_state_init(char *arg)
 				 * xspat==1: match *only* spatial features */
 				xspat = atoi(optval);
 
+			} else if (!strcasecmp(optname, "threads") && optval) {
+				/* Number of threads scanning the games
+				 * in parallel; used only when processing
+				 * the corpus files directly, see
+				 * patternscan_corpus(). */
+				ps->threads = atoi(optval);
+
 			} else if (!strcasecmp(optname, "patterns") && optval) {
 				patterns_init(&ps->pat, optval, ps->gen_spat_dict, false);
 				pat_setup = true;
@@ -321,3 +340,573 @@ engine_patternscan_init(char *arg, struct board *b)
 
 	return e;
 }
+
+
+/* Parallel corpus scanning: instead of reading a GTP stream as an
+ * engine, patternscan_corpus() takes the game files themselves and
+ * shards the games between threads. Each thread has its own board and
+ * counters; these are merged once all the games are scanned. */
+
+struct corpus_game {
+	const char *start, *end;
+	int size; // without the S_OFFBOARD margin
+	bool sgf;
+};
+
+/* Spatial seen by a scanning thread. */
+struct corpus_spat {
+	/* Smallest full hash of all rotations, with the distance
+	 * mixed in; 0 is a free slot. */
+	hash_t key;
+	struct spatial s;
+	int games, lastgame;
+	/* The first occurence, to number the spatials as a sequential
+	 * scan would. */
+	int first, firstseq;
+};
+
+/* Pattern string seen by a scanning thread. */
+struct corpus_pat {
+	char *str; // NULL is a free slot
+	hash_t hash;
+	int choices, counts;
+	/* Last move this pattern was counted for. */
+	int choice_stamp, count_stamp;
+};
+
+struct corpus {
+	struct patternscan *ps;
+	struct corpus_game *games;
+	int ngames;
+	int next; // next game to scan
+	/* board_clear() caches empty boards in a static array. */
+	pthread_mutex_t board_lock;
+};
+
+struct corpus_worker {
+	struct corpus *corpus;
+	pthread_t thread;
+	struct board *b;
+	int game, seq, stamp;
+
+	struct corpus_spat *spats;
+	uint32_t spats_mask;
+	int nspats;
+	struct corpus_pat *pats;
+	uint32_t pats_mask;
+	int npats;
+};
+
+
+static hash_t
+corpus_spat_key(struct spatial *s)
+{
+	hash_t key = ~0ULL;
+	for (unsigned int r = 0; r < PTH__ROTATIONS; r++) {
+		hash_t h = 0;
+		for (unsigned int i = 0; i < ptind[s->dist + 1]; i++)
+			h ^= pthashes[r][i][spatial_point_at(*s, i)];
+		if (h < key)
+			key = h;
+	}
+	key ^= (hash_t) s->dist << 58;
+	return key ? key : 1;
+}
+
+static struct corpus_spat *
+corpus_spat_slot(struct corpus_spat *spats, uint32_t mask, hash_t key)
+{
+	uint32_t i = key & mask;
+	while (spats[i].key && spats[i].key != key)
+		i = (i + 1) & mask;
+	return &spats[i];
+}
+
+/* Find the spatial in worker table, inserting a blank record if
+ * it is not there yet. */
+static struct corpus_spat *
+corpus_spat_get(struct corpus_worker *w, hash_t key)
+{
+	if (2 * (w->nspats + 1) > (int) w->spats_mask + 1) {
+		uint32_t mask = w->spats_mask * 2 + 1;
+		struct corpus_spat *spats = calloc2(mask + 1, sizeof(*spats));
+		for (uint32_t i = 0; i <= w->spats_mask; i++)
+			if (w->spats[i].key)
+				*corpus_spat_slot(spats, mask, w->spats[i].key) = w->spats[i];
+		free(w->spats);
+		w->spats = spats;
+		w->spats_mask = mask;
+	}
+	struct corpus_spat *cs = corpus_spat_slot(w->spats, w->spats_mask, key);
+	if (!cs->key) {
+		cs->key = key;
+		cs->first = INT_MAX;
+		w->nspats++;
+	}
+	return cs;
+}
+
+static struct corpus_pat *
+corpus_pat_slot(struct corpus_pat *pats, uint32_t mask, hash_t hash, const char *str, int len)
+{
+	uint32_t i = hash & mask;
+	while (pats[i].str && (pats[i].hash != hash || strncmp(pats[i].str, str, len) || pats[i].str[len]))
+		i = (i + 1) & mask;
+	return &pats[i];
+}
+
+/* Like corpus_spat_get(), for pattern string of given length. */
+static struct corpus_pat *
+corpus_pat_get(struct corpus_worker *w, const char *str, int len)
+{
+	hash_t hash = 0xcbf29ce484222325ULL; // FNV-1a
+	for (int i = 0; i < len; i++)
+		hash = (hash ^ (unsigned char) str[i]) * 0x100000001b3ULL;
+
+	if (2 * (w->npats + 1) > (int) w->pats_mask + 1) {
+		uint32_t mask = w->pats_mask * 2 + 1;
+		struct corpus_pat *pats = calloc2(mask + 1, sizeof(*pats));
+		for (uint32_t i = 0; i <= w->pats_mask; i++)
+			if (w->pats[i].str)
+				*corpus_pat_slot(pats, mask, w->pats[i].hash, w->pats[i].str, strlen(w->pats[i].str)) = w->pats[i];
+		free(w->pats);
+		w->pats = pats;
+		w->pats_mask = mask;
+	}
+	struct corpus_pat *cp = corpus_pat_slot(w->pats, w->pats_mask, hash, str, len);
+	if (!cp->str) {
+		cp->str = strndup(str, len);
+		cp->hash = hash;
+		w->npats++;
+	}
+	return cp;
+}
+
+/* Count patterns of the move; each distinct pattern at most once
+ * per played move (choices) and once per witness set (counts). */
+static void
+corpus_count_patterns(struct corpus_worker *w, struct board *b, struct move *m, bool choice)
+{
+	char buf[65536];
+	char *str = buf;
+	*str++ = '['; *str = 0; // process_pattern() looks back
+	process_pattern(w->corpus->ps, b, m, &str);
+	*str = 0;
+
+	for (char *p = buf + 1; (p = strchr(p, '(')); ) {
+		char *e = strchr(p, ')') + 1;
+		struct corpus_pat *cp = corpus_pat_get(w, p, e - p);
+		if (choice && cp->choice_stamp != w->stamp) {
+			cp->choices++;
+			cp->choice_stamp = w->stamp;
+		} else if (!choice && cp->count_stamp != w->stamp) {
+			cp->counts++;
+			cp->count_stamp = w->stamp;
+		}
+		p = e;
+	}
+}
+
+/* Record all spatials of the move, as process_pattern() would put
+ * them in the dictionary. */
+static void
+corpus_record_spatials(struct corpus_worker *w, struct board *b, struct move *m)
+{
+	struct pattern_config *pc = &w->corpus->ps->pat.pc;
+	struct spatial s;
+	spatial_from_board(pc, &s, b, m);
+	int dmax = s.dist;
+	for (int d = pc->spat_min; d <= dmax; d++) {
+		s.dist = d;
+		struct corpus_spat *cs = corpus_spat_get(w, corpus_spat_key(&s));
+		if (cs->first == INT_MAX) {
+			cs->s = s;
+			cs->first = w->game;
+			cs->firstseq = w->seq;
+		}
+		w->seq++;
+		if (cs->lastgame != w->game + 1) {
+			cs->games++;
+			cs->lastgame = w->game + 1;
+		}
+	}
+}
+
+/* The patternscan_play() counterpart. */
+static void
+corpus_scan_move(struct corpus_worker *w, struct board *b, struct move *m)
+{
+	struct patternscan *ps = w->corpus->ps;
+	if (!(m->color & ps->color_mask))
+		return;
+
+	w->stamp++;
+	if (ps->gen_spat_dict) {
+		if (!is_pass(m->coord))
+			corpus_record_spatials(w, b, m);
+	} else {
+		corpus_count_patterns(w, b, m, true);
+	}
+	if (!ps->competition)
+		return;
+
+	for (int f = 0; f < b->flen; f++) {
+		struct move mo = { .coord = b->f[f], .color = m->color };
+		if (is_pass(mo.coord) || !board_is_valid_move(b, &mo))
+			continue;
+		if (ps->gen_spat_dict)
+			corpus_record_spatials(w, b, &mo);
+		else
+			corpus_count_patterns(w, b, &mo, false);
+	}
+}
+
+static void
+corpus_play(struct corpus_worker *w, struct board *b, struct move *m)
+{
+	if (is_resign(m->coord))
+		return;
+	/* Deal with broken game records. */
+	if (!is_pass(m->coord) && board_at(b, m->coord) != S_NONE)
+		return;
+	corpus_scan_move(w, b, m);
+	board_play(b, m);
+}
+
+static void
+corpus_scan_gtp(struct corpus_worker *w, struct board *b, struct corpus_game *g)
+{
+	char line[256];
+	for (const char *p = g->start; p < g->end; ) {
+		const char *e = memchr(p, '\n', g->end - p);
+		if (!e) e = g->end;
+		int len = e - p < (int) sizeof(line) - 1 ? e - p : (int) sizeof(line) - 1;
+		memcpy(line, p, len); line[len] = 0;
+		p = e + 1;
+
+		char *save;
+		char *cmd = strtok_r(line, " \t\r", &save);
+		if (!cmd)
+			continue;
+		if (!strcasecmp(cmd, "play")) {
+			char *color = strtok_r(NULL, " \t\r", &save);
+			char *coord = strtok_r(NULL, " \t\r", &save);
+			if (!color || !coord)
+				continue;
+			coord_t *c = str2coord(coord, board_size(b));
+			struct move m = { .coord = *c, .color = str2stone(color) };
+			coord_done(c);
+			if (m.color != S_NONE)
+				corpus_play(w, b, &m);
+		} else if (!strcasecmp(cmd, "fixed_handicap")) {
+			char *stones = strtok_r(NULL, " \t\r", &save);
+			if (stones)
+				board_handicap(b, atoi(stones), NULL);
+		}
+	}
+}
+
+/* Skip SGF property value, return pointer past the closing bracket. */
+static const char *
+corpus_sgf_value(const char *p, const char *end)
+{
+	for (p++; p < end && *p != ']'; p++)
+		if (*p == '\\') p++;
+	return p + 1;
+}
+
+/* Main line of a SGF game, with the same simplifications as
+ * tools/sgf2gtp.pl: HA[] is fixed handicap, AB[] and AW[] are
+ * ignored. */
+static void
+corpus_scan_sgf(struct corpus_worker *w, struct board *b, struct corpus_game *g)
+{
+	char prop[8];
+	int plen = 0;
+	bool inprop = false;
+	for (const char *p = g->start; p < g->end; ) {
+		if (*p == ')')
+			return; // end of main line
+		if (isalpha(*p)) {
+			/* Old SGF may have lowercase letters
+			 * in the identifiers. */
+			if (!inprop)
+				plen = 0;
+			inprop = true;
+			if (isupper(*p) && plen < (int) sizeof(prop) - 1)
+				prop[plen++] = *p;
+			p++;
+			continue;
+		}
+		inprop = false;
+		if (*p != '[') {
+			if (!isspace(*p))
+				plen = 0;
+			p++;
+			continue;
+		}
+
+		/* Property value; multiple values share the identifier. */
+		prop[plen] = 0;
+		const char *v = p + 1;
+		p = corpus_sgf_value(p, g->end);
+		int vlen = p - 1 - v;
+		if (!strcmp(prop, "HA")) {
+			if (atoi(v) > 0)
+				board_handicap(b, atoi(v), NULL);
+		} else if ((!strcmp(prop, "B") || !strcmp(prop, "W")) && (vlen == 0 || vlen == 2)) {
+			struct move m = { .coord = pass, .color = prop[0] == 'B' ? S_BLACK : S_WHITE };
+			int x = vlen ? v[0] - 'a' + 1 : 0, y = vlen ? board_size(b) - 2 - (v[1] - 'a') : 0;
+			if (vlen && x >= 1 && x <= board_size(b) - 2 && y >= 1 && y <= board_size(b) - 2)
+				m.coord = coord_xy(b, x, y);
+			corpus_play(w, b, &m);
+		}
+	}
+}
+
+static void *
+corpus_worker_thread(void *data)
+{
+	struct corpus_worker *w = data;
+	struct corpus *corpus = w->corpus;
+
+	int i;
+	while ((i = __sync_fetch_and_add(&corpus->next, 1)) < corpus->ngames) {
+		struct corpus_game *g = &corpus->games[i];
+		pthread_mutex_lock(&corpus->board_lock);
+		board_resize(w->b, g->size);
+		board_clear(w->b);
+		pthread_mutex_unlock(&corpus->board_lock);
+
+		w->game = i;
+		w->seq = 0;
+		if (g->sgf)
+			corpus_scan_sgf(w, w->b, g);
+		else
+			corpus_scan_gtp(w, w->b, g);
+	}
+	return NULL;
+}
+
+static void
+corpus_add_game(struct corpus *corpus, int *nalloc, const char *start, const char *end, int size, bool sgf)
+{
+	if (corpus->ngames == *nalloc) {
+		*nalloc = *nalloc ? *nalloc * 2 : 1024;
+		corpus->games = realloc2(corpus->games, *nalloc * sizeof(*corpus->games));
+	}
+	struct corpus_game g = { .start = start, .end = end, .size = size, .sgf = sgf };
+	corpus->games[corpus->ngames++] = g;
+}
+
+/* Split file to games: SGF files hold a single game, GTP streams
+ * a new one at each clear_board. */
+static void
+corpus_split_games(struct corpus *corpus, int *nalloc, const char *data, size_t size)
+{
+	const char *end = data + size;
+	const char *p = data;
+	while (p < end && isspace(*p)) p++;
+
+	if (p < end && *p == '(') {
+		const char *sz = memmem(p, end - p, "SZ[", 3);
+		int bsize = sz ? atoi(sz + 3) : 19;
+		if (bsize < 2 || bsize > BOARD_MAX_SIZE) {
+			fprintf(stderr, "patternscan: Skipping game of size %d\n", bsize);
+			return;
+		}
+		corpus_add_game(corpus, nalloc, p, end, bsize, true);
+		return;
+	}
+
+	int bsize = 19;
+	const char *game = p;
+	while (p < end) {
+		const char *e = memchr(p, '\n', end - p);
+		if (!e) e = end;
+		while (p < e && isspace(*p)) p++;
+		if (!strncasecmp(p, "boardsize", 9) || !strncasecmp(p, "clear_board", 11)) {
+			if (memmem(game, p - game, "play", 4))
+				corpus_add_game(corpus, nalloc, game, p, bsize, false);
+			if (!strncasecmp(p, "boardsize", 9))
+				bsize = atoi(p + 9);
+			game = e;
+		}
+		p = e + 1;
+	}
+	if (game < end && memmem(game, end - game, "play", 4))
+		corpus_add_game(corpus, nalloc, game, end, bsize, false);
+}
+
+static int
+corpus_spat_cmp(const void *p1, const void *p2)
+{
+	const struct corpus_spat *s1 = p1, *s2 = p2;
+	if (s1->first != s2->first)
+		return s1->first < s2->first ? -1 : 1;
+	return s1->firstseq - s2->firstseq;
+}
+
+static void
+corpus_save_spatials(struct patternscan *ps, struct corpus_worker *w0)
+{
+	/* Compact the merged table and number the spatials
+	 * in order of their first occurence. */
+	struct corpus_spat *spats = malloc2(w0->nspats * sizeof(*spats));
+	int n = 0;
+	for (uint32_t i = 0; i <= w0->spats_mask; i++)
+		if (w0->spats[i].key)
+			spats[n++] = w0->spats[i];
+	qsort(spats, n, sizeof(*spats), corpus_spat_cmp);
+
+	struct spatial_dict *dict = ps->pat.pc.spat_dict;
+	for (int i = 0; i < n; i++) {
+		unsigned int sid = spatial_dict_put(dict, &spats[i].s, spatial_hash(0, &spats[i].s));
+		assert(sid > 0);
+		if (sid >= ps->nscounts) {
+			int newnsc = (sid / SCOUNTS_ALLOC + 1) * SCOUNTS_ALLOC;
+			ps->scounts = realloc2(ps->scounts, newnsc * sizeof(*ps->scounts));
+			memset(&ps->scounts[ps->nscounts], 0, (newnsc - ps->nscounts) * sizeof(*ps->scounts));
+			ps->nscounts = newnsc;
+		}
+		ps->scounts[sid] += spats[i].games;
+	}
+	free(spats);
+	if (ps->debug_level > 1)
+		fprintf(stderr, "%d spatials, %d collisions\n", dict->nspatials, dict->collisions);
+
+	/* patterns.spat is appended by patternscan_done(),
+	 * the engine would do the same. */
+	struct engine e = { .data = ps };
+	patternscan_done(&e);
+}
+
+static int
+corpus_pat_cmp(const void *p1, const void *p2)
+{
+	const struct corpus_pat *a = p1, *b = p2;
+	if (a->counts != b->counts)
+		return a->counts - b->counts;
+	return strcmp(a->str, b->str);
+}
+
+/* Print the pattern probability table in the format of
+ * tools/pattern_bayes_gen.sh. */
+static void
+corpus_print_patterns(struct corpus_worker *w0)
+{
+	struct corpus_pat *pats = malloc2(w0->npats * sizeof(*pats));
+	int n = 0;
+	for (uint32_t i = 0; i <= w0->pats_mask; i++)
+		if (w0->pats[i].str && w0->pats[i].counts >= 2)
+			pats[n++] = w0->pats[i];
+	qsort(pats, n, sizeof(*pats), corpus_pat_cmp);
+	for (int i = 0; i < n; i++)
+		printf("%.3f %d %d %s\n", (double) pats[i].choices / pats[i].counts,
+		       pats[i].choices, pats[i].counts, pats[i].str);
+	free(pats);
+}
+
+/* Merge worker @w into @w0. */
+static void
+corpus_merge(struct corpus_worker *w0, struct corpus_worker *w)
+{
+	for (uint32_t i = 0; w->spats && i <= w->spats_mask; i++) {
+		struct corpus_spat *s = &w->spats[i];
+		if (!s->key)
+			continue;
+		struct corpus_spat *s0 = corpus_spat_get(w0, s->key);
+		if (corpus_spat_cmp(s, s0) < 0) {
+			s0->s = s->s;
+			s0->first = s->first;
+			s0->firstseq = s->firstseq;
+		}
+		s0->games += s->games;
+	}
+	for (uint32_t i = 0; w->pats && i <= w->pats_mask; i++) {
+		struct corpus_pat *p = &w->pats[i];
+		if (!p->str)
+			continue;
+		struct corpus_pat *p0 = corpus_pat_get(w0, p->str, strlen(p->str));
+		p0->choices += p->choices;
+		p0->counts += p->counts;
+		free(p->str);
+	}
+}
+
+int
+patternscan_corpus(char *arg, int nfiles, char **files)
+{
+	struct patternscan *ps = patternscan_state_init(arg);
+	if (!ps->gen_spat_dict) {
+		/* The probability of pattern being played needs
+		 * all the candidates. */
+		ps->competition = true;
+		ps->no_pattern_match = false;
+	}
+	if (ps->threads < 1)
+		ps->threads = 1;
+
+	struct corpus corpus = { .ps = ps };
+	pthread_mutex_init(&corpus.board_lock, NULL);
+	int nalloc = 0;
+	for (int i = 0; i < nfiles; i++) {
+		FILE *f = fopen(files[i], "r");
+		if (!f) {
+			perror(files[i]);
+			continue;
+		}
+#ifndef _WIN32
+		struct stat st;
+		if (fstat(fileno(f), &st) || !st.st_size) {
+			fclose(f);
+			continue;
+		}
+		size_t size = st.st_size;
+		void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+		if (data == MAP_FAILED) {
+			perror("mmap");
+			exit(1);
+		}
+#else
+		fseek(f, 0, SEEK_END);
+		size_t size = ftell(f);
+		rewind(f);
+		void *data = malloc2(size);
+		if (fread(data, size, 1, f) != 1) {
+			perror(files[i]);
+			exit(1);
+		}
+#endif
+		fclose(f);
+		/* The files stay mapped until we exit. */
+		corpus_split_games(&corpus, &nalloc, data, size);
+	}
+	if (ps->debug_level > 0)
+		fprintf(stderr, "Scanning %d games in %d threads\n", corpus.ngames, ps->threads);
+
+	struct corpus_worker *workers = calloc2(ps->threads, sizeof(*workers));
+	for (int i = 0; i < ps->threads; i++) {
+		struct corpus_worker *w = &workers[i];
+		w->corpus = &corpus;
+		w->b = board_init(NULL);
+		w->spats_mask = w->pats_mask = 1023;
+		w->spats = calloc2(w->spats_mask + 1, sizeof(*w->spats));
+		w->pats = calloc2(w->pats_mask + 1, sizeof(*w->pats));
+	}
+	/* Only now, board_init() goes through board_clear() too. */
+	for (int i = 0; i < ps->threads; i++)
+		pthread_create(&workers[i].thread, NULL, corpus_worker_thread, &workers[i]);
+	for (int i = 0; i < ps->threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		if (i > 0)
+			corpus_merge(&workers[0], &workers[i]);
+		board_done(workers[i].b);
+	}
+
+	if (ps->gen_spat_dict)
+		corpus_save_spatials(ps, &workers[0]);
+	else
+		corpus_print_patterns(&workers[0]);
+	return 0;
+}
@@ -5,4 +5,11 @@
 
 struct engine *engine_patternscan_init(char *arg, struct board *b);
 
+/* Scan the given SGF files or GTP streams in parallel (threads=N),
+ * taking the same arguments as the engine. With gen_spat_dict, new
+ * spatials are appended to patterns.spat; otherwise, competition
+ * is implied and the pattern probability table is printed to stdout
+ * (see tools/pattern_bayes_gen.sh). Returns exit status. */
+int patternscan_corpus(char *arg, int nfiles, char **files);
+
 #endif
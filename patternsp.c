@@ -4,9 +4,15 @@
 #include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
 
 #include "board.h"
 #include "debug.h"
+#include "memstats.h"
 #include "pattern.h"
 #include "patternsp.h"
 
@@ -223,21 +229,95 @@ spatial_dict_addc(struct spatial_dict *dict, struct spatial *s)
 		dict->spatials = realloc(dict->spatials,
 				(dict->nspatials + SPATIALS_ALLOC)
 				* sizeof(*dict->spatials));
+		mem_account(MEM_SPATIAL, SPATIALS_ALLOC * sizeof(*dict->spatials));
 	}
 	dict->spatials[dict->nspatials] = *s;
 	return dict->nspatials++;
 }
 
+/* Put @entry to the emptier of its buckets; false if both are full. */
+static bool
+spatial_dict_place(struct spatial_dict *dict, struct spatial_entry *entry)
+{
+	struct spatial_entry *slot = NULL;
+	int best = 0;
+	for (int which = 0; which < 2; which++) {
+		struct spatial_entry *e = spatial_bucket(dict, entry->hash, which);
+		int empty = 0;
+		struct spatial_entry *first = NULL;
+		for (int i = 0; i < SPATIAL_BUCKET; i++)
+			if (!e[i].id && !empty++)
+				first = &e[i];
+		if (empty > best) {
+			best = empty;
+			slot = first;
+		}
+	}
+	if (!slot)
+		return false;
+	*slot = *entry;
+	return true;
+}
+
+/* Rebuild the hash table with at least 2^@bits buckets (more if
+ * the entries do not fit), or allocate the initial one. */
+static void
+spatial_dict_rehash(struct spatial_dict *dict, unsigned int bits)
+{
+	struct spatial_entry *old = dict->hash;
+	void *old_mem = dict->hash_mem;
+	size_t old_slots = old ? (size_t) SPATIAL_BUCKET << dict->hash_bucket_bits : 0;
+
+retry:;
+	size_t size = ((size_t) SPATIAL_BUCKET << bits) * sizeof(*dict->hash) + 63;
+	dict->hash_mem = calloc2(1, size);
+	dict->hash = (struct spatial_entry *) (((uintptr_t) dict->hash_mem + 63) & ~(uintptr_t) 63);
+	dict->hash_bucket_bits = bits;
+	for (size_t i = 0; i < old_slots; i++) {
+		if (old[i].id && !spatial_dict_place(dict, &old[i])) {
+			free(dict->hash_mem);
+			bits++;
+			goto retry;
+		}
+	}
+	mem_account(MEM_SPATIAL, size);
+
+	/* A mapped table is not ours to free. */
+	if (old_mem) {
+		free(old_mem);
+		mem_account(MEM_SPATIAL, -(long long) (old_slots * sizeof(*old) + 63));
+	}
+}
+
+/* Double the hash table, or allocate the initial one. */
+static void
+spatial_dict_growh(struct spatial_dict *dict)
+{
+	spatial_dict_rehash(dict, dict->hash ? dict->hash_bucket_bits + 1 : 13);
+}
+
 bool
 spatial_dict_addh(struct spatial_dict *dict, hash_t hash, unsigned int id)
 {
-	if (dict->hash[hash]) {
-		if (dict->hash[hash] != id)
+	for (int which = 0; which < 2; which++) {
+		struct spatial_entry *e = spatial_bucket(dict, hash, which);
+		for (int i = 0; i < SPATIAL_BUCKET; i++) {
+			if (!e[i].id || e[i].hash != hash)
+				continue;
+			if (e[i].id == id)
+				return true; // keep the compiled dictionary pages shared
 			dict->collisions++;
-	} else {
-		dict->fills++;
+			e[i].id = id;
+			return true;
+		}
 	}
-	dict->hash[hash] = id;
+
+	if (4 * ((size_t) dict->fills + 1) > 3 * ((size_t) SPATIAL_BUCKET << dict->hash_bucket_bits))
+		spatial_dict_growh(dict);
+	struct spatial_entry entry = { .hash = hash, .id = id };
+	while (!spatial_dict_place(dict, &entry))
+		spatial_dict_growh(dict);
+	dict->fills++;
 	return true;
 }
 
@@ -301,7 +381,7 @@ spatial_write(struct spatial_dict *dict, struct spatial *s, unsigned int id, FIL
 	fputs(spatial2str(s), f);
 	for (unsigned int r = 0; r < PTH__ROTATIONS; r++) {
 		hash_t rhash = spatial_hash(r, s);
-		unsigned int id2 = dict->hash[rhash];
+		unsigned int id2 = spatial_dict_lookup(dict, rhash);
 		if (id2 != id) {
 			/* This hash does not belong to us. Decide whether
 			 * we or the current owner is better owner. */
@@ -359,11 +439,14 @@ spatial_dict_hashstats(struct spatial_dict *dict)
 	 * -e patternscan), since it will insert a pattern multiple times,
 	 * multiplying the reported number of collisions. */
 
-	unsigned long buckets = (sizeof(dict->hash) / sizeof(dict->hash[0]));
+	unsigned long buckets = 1 << spatial_hash_bits;
 	fprintf(stderr, "\t(Spatial dictionary hash: %d collisions (incl. repetitions), %.2f%% (%d/%lu) fill rate).\n",
 			dict->collisions,
 			(double) dict->fills * 100 / buckets,
 			dict->fills, buckets);
+	size_t slots = (size_t) SPATIAL_BUCKET << dict->hash_bucket_bits;
+	fprintf(stderr, "\t(Spatial dictionary table: %zu slots, %.2f MiB).\n",
+			slots, (double) slots * sizeof(*dict->hash) / 1048576);
 }
 
 void
@@ -383,17 +466,143 @@ spatial_dict_writeinfo(struct spatial_dict *dict, FILE *f)
 	}
 }
 
+/* Compiled dictionary file: header, the records, then the hash table
+ * (@slots entries, aligned to a cache line). */
+
+#define SPATIAL_MAGIC "PACHISD2"
+
+struct spatial_header {
+	char magic[8];
+	uint32_t nspatials;
+	uint32_t slots;
+	int32_t fills, collisions;
+	uint32_t spatial_size, max_dist; // catch incompatible builds
+};
+
+bool
+spatial_dict_compile(struct spatial_dict *dict, const char *filename)
+{
+	FILE *f = fopen(filename, "wb");
+	if (!f) {
+		perror(filename);
+		return false;
+	}
+	/* Size the table to the data. */
+	unsigned int bits = 1;
+	while (4 * (size_t) dict->fills > 3 * ((size_t) SPATIAL_BUCKET << bits))
+		bits++;
+	struct spatial_dict table = { .hash = dict->hash, .hash_bucket_bits = dict->hash_bucket_bits };
+	spatial_dict_rehash(&table, bits);
+	uint32_t slots = SPATIAL_BUCKET << table.hash_bucket_bits;
+
+	struct spatial_header h = {
+		.nspatials = dict->nspatials, .slots = slots,
+		.fills = dict->fills, .collisions = dict->collisions,
+		.spatial_size = sizeof(struct spatial), .max_dist = MAX_PATTERN_DIST,
+	};
+	memcpy(h.magic, SPATIAL_MAGIC, sizeof(h.magic));
+	fwrite(&h, sizeof(h), 1, f);
+	fwrite(dict->spatials, sizeof(*dict->spatials), dict->nspatials, f);
+	/* Keep the table aligned to cache lines. */
+	size_t pad = (-(sizeof(h) + dict->nspatials * sizeof(*dict->spatials))) & 63;
+	for (size_t i = 0; i < pad; i++)
+		fputc(0, f);
+	fwrite(table.hash, sizeof(*table.hash), slots, f);
+	free(table.hash_mem);
+	mem_account(MEM_SPATIAL, -(long long) (slots * sizeof(*table.hash) + 63));
+	if (fclose(f)) {
+		perror(filename);
+		return false;
+	}
+	return true;
+}
+
+/* Map the compiled dictionary if it exists and is not older
+ * than the text one. */
+static struct spatial_dict *
+spatial_dict_map(void)
+{
+	FILE *f = fopen(spatial_dict_compiled_filename, "rb");
+	if (!f)
+		return NULL;
+	struct spatial_header h;
+	struct stat st, st_text;
+	if (fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, SPATIAL_MAGIC, sizeof(h.magic))
+	    || h.spatial_size != sizeof(struct spatial) || h.max_dist != MAX_PATTERN_DIST
+	    || h.slots < 2 * SPATIAL_BUCKET || (h.slots & (h.slots - 1)) || fstat(fileno(f), &st)) {
+		fprintf(stderr, "%s: invalid compiled spatial dictionary, ignoring\n", spatial_dict_compiled_filename);
+		fclose(f);
+		return NULL;
+	}
+	if (!stat(spatial_dict_filename, &st_text) && st_text.st_mtime > st.st_mtime) {
+		fprintf(stderr, "%s is older than %s, ignoring\n", spatial_dict_compiled_filename, spatial_dict_filename);
+		fclose(f);
+		return NULL;
+	}
+	size_t hash_off = sizeof(h) + h.nspatials * sizeof(struct spatial);
+	hash_off += (-hash_off) & 63;
+	size_t size = hash_off + (size_t) h.slots * sizeof(struct spatial_entry);
+	if ((size_t) st.st_size < size) {
+		fprintf(stderr, "%s: truncated, ignoring\n", spatial_dict_compiled_filename);
+		fclose(f);
+		return NULL;
+	}
+
+#ifndef _WIN32
+	/* Private writable mapping: the table stays shared between
+	 * processes as long as it is not modified. */
+	void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(f), 0);
+	fclose(f);
+	if (map == MAP_FAILED) {
+		perror(spatial_dict_compiled_filename);
+		return NULL;
+	}
+#else
+	void *map = malloc2(size);
+	rewind(f);
+	bool ok = fread(map, size, 1, f) == 1;
+	fclose(f);
+	if (!ok) {
+		free(map);
+		return NULL;
+	}
+#endif
+
+	struct spatial_dict *dict = calloc2(1, sizeof(*dict));
+	dict->map = map;
+	dict->map_size = size;
+	mem_account(MEM_SPATIAL, size);
+	dict->nspatials = h.nspatials;
+	dict->spatials = (struct spatial *)((char *)map + sizeof(h));
+	dict->hash = (struct spatial_entry *)((char *)map + hash_off);
+	dict->hash_bucket_bits = __builtin_ctz(h.slots / SPATIAL_BUCKET);
+	dict->fills = h.fills;
+	dict->collisions = h.collisions;
+	if (DEBUGL(1))
+		fprintf(stderr, "Mapped compiled spatial dictionary of %d patterns.\n", dict->nspatials);
+	return dict;
+}
+
 /* We try to avoid needlessly reloading spatial dictionary
  * since it may take rather long time. */
 static struct spatial_dict *cached_dict;
 
 const char *spatial_dict_filename = "patterns.spat";
+const char *spatial_dict_compiled_filename = "patterns.spatc";
 struct spatial_dict *
 spatial_dict_init(bool will_append, bool hash)
 {
 	if (cached_dict && !will_append)
 		return cached_dict;
 
+	if (!will_append) {
+		struct spatial_dict *dict = spatial_dict_map();
+		if (dict) {
+			cached_dict = dict;
+			return dict;
+		}
+	}
+
 	FILE *f = fopen(spatial_dict_filename, "r");
 	if (!f && !will_append) {
 		if (DEBUGL(1))
@@ -402,6 +611,7 @@ spatial_dict_init(bool will_append, bool hash)
 	}
 
 	struct spatial_dict *dict = calloc2(1, sizeof(*dict));
+	spatial_dict_growh(dict);
 	/* We create a dummy record for index 0 that we will
 	 * never reference. This is so that hash value 0 can
 	 * represent "no value". */
@@ -419,12 +629,37 @@ spatial_dict_init(bool will_append, bool hash)
 	return dict;
 }
 
+void
+spatial_dict_done(struct spatial_dict *dict)
+{
+	if (!dict) return;
+	if (cached_dict == dict)
+		cached_dict = NULL;
+	if (dict->hash_mem) {
+		free(dict->hash_mem);
+		mem_account(MEM_SPATIAL, -(long long) (((size_t) SPATIAL_BUCKET << dict->hash_bucket_bits) * sizeof(*dict->hash) + 63));
+	}
+	if (dict->map) {
+#ifndef _WIN32
+		munmap(dict->map, dict->map_size);
+#else
+		free(dict->map);
+#endif
+		mem_account(MEM_SPATIAL, -(long long) dict->map_size);
+	} else {
+		free(dict->spatials);
+		size_t allocated = (dict->nspatials + SPATIALS_ALLOC - 1) / SPATIALS_ALLOC * SPATIALS_ALLOC;
+		mem_account(MEM_SPATIAL, -(long long) (allocated * sizeof(*dict->spatials)));
+	}
+	free(dict);
+}
+
 unsigned int
 spatial_dict_put(struct spatial_dict *dict, struct spatial *s, hash_t h)
 {
 	/* We avoid spatial_dict_get() here, since we want to ignore radius
 	 * differences - we have custom collision detection. */
-	unsigned int id = dict->hash[h];
+	unsigned int id = spatial_dict_lookup(dict, h);
 	if (id > 0) {
 		/* Is this the same or isomorphous spatial? */
 		if (spatial_cmp(s, &dict->spatials[id]))
@@ -434,7 +669,7 @@ spatial_dict_put(struct spatial_dict *dict, struct spatial *s, hash_t h)
 		 * points at the correct spatial. */
 		for (unsigned int r = 0; r < PTH__ROTATIONS; r++) {
 			hash_t rhash = spatial_hash(r, s);
-			unsigned int rid = dict->hash[rhash];
+			unsigned int rid = spatial_dict_lookup(dict, rhash);
 			/* No match means we definitely aren't stored yet. */
 			if (!rid)
 				break;
@@ -98,13 +98,31 @@ struct spatial_dict {
 
 	/* Hashed access; all isomorphous configurations
 	 * are also hashed */
-#define spatial_hash_bits 26 // ~256mib array
+#define spatial_hash_bits 26
 #define spatial_hash_mask ((1 << spatial_hash_bits) - 1)
-	/* Maps to spatials[] indices. The hash function
-	 * used is zobrist hashing with fixed values. */
-	uint32_t hash[1 << spatial_hash_bits];
-	/* Auxiliary counters for statistics. */
+	/* Maps hashes to spatials[] indices. The hash function
+	 * used is zobrist hashing with fixed values. The table is
+	 * split to buckets of a cache line; each hash has two
+	 * buckets it can be in (see spatial_bucket()), so a lookup
+	 * is at most two independent memory accesses, which we can
+	 * prefetch. The table grows when both are full, or to stay
+	 * at most 3/4 full; id 0 is a free slot. */
+#define SPATIAL_BUCKET 8
+	struct spatial_entry {
+		uint32_t hash;
+		uint32_t id;
+	} *hash;
+	unsigned int hash_bucket_bits;
+	/* Allocation hash[] is aligned within, NULL if mapped. */
+	void *hash_mem;
+	/* Auxiliary counters for statistics. fills is also the
+	 * number of used slots. */
 	int fills, collisions;
+
+	/* Compiled dictionary mmap'ed by spatial_dict_init(), or NULL.
+	 * spatials[] always points into it, hash[] until it grows. */
+	void *map;
+	size_t map_size;
 };
 
 /* Initializes spatial dictionary, pre-loading existing records from
@@ -113,6 +131,8 @@ struct spatial_dict {
  * If hash is true, loaded spatials will be added to the hashtable;
  * use false if this is to be done later (e.g. by patternprob). */
 struct spatial_dict *spatial_dict_init(bool will_append, bool hash);
+/* Free the dictionary; spatial_dict_init() loads it again. */
+void spatial_dict_done(struct spatial_dict *dict);
 
 /* Lookup specified spatial pattern in the dictionary; return index
  * of the pattern. If the pattern is not found, 0 will be returned. */
@@ -146,11 +166,51 @@ void spatial_dict_writeinfo(struct spatial_dict *dict, FILE *f);
 /* Append specified spatial pattern to the given file. */
 void spatial_write(struct spatial_dict *dict, struct spatial *s, unsigned int id, FILE *f);
 
+/* Compiled spatial dict filename. The compiled dictionary holds the
+ * records and the hash table as left by the pattern probability
+ * table loading, and is used instead of the text dictionary if it
+ * is newer. */
+extern const char *spatial_dict_compiled_filename;
+
+/* Write dict in the compiled format. Returns false on error. */
+bool spatial_dict_compile(struct spatial_dict *dict, const char *filename);
+
+
+/* First entry of bucket @which (0 or 1) of @hash. */
+static inline struct spatial_entry *
+spatial_bucket(struct spatial_dict *dict, hash_t hash, int which)
+{
+	uint32_t h = hash;
+	uint32_t i = which ? (h * 0x9e3779b1U) >> (32 - dict->hash_bucket_bits)
+	                   : h & ((1U << dict->hash_bucket_bits) - 1);
+	return &dict->hash[i * SPATIAL_BUCKET];
+}
+
+/* Start fetching the buckets of @hash, to be looked up soon. */
+static inline void
+spatial_dict_prefetch(struct spatial_dict *dict, hash_t hash)
+{
+	__builtin_prefetch(spatial_bucket(dict, hash, 0));
+	__builtin_prefetch(spatial_bucket(dict, hash, 1));
+}
+
+/* Return the spatials[] index stored for hash, or 0. */
+static inline unsigned int
+spatial_dict_lookup(struct spatial_dict *dict, hash_t hash)
+{
+	for (int which = 0; which < 2; which++) {
+		struct spatial_entry *e = spatial_bucket(dict, hash, which);
+		for (int i = 0; i < SPATIAL_BUCKET; i++)
+			if (e[i].hash == hash && e[i].id)
+				return e[i].id;
+	}
+	return 0;
+}
 
 static inline unsigned int
 spatial_dict_get(struct spatial_dict *dict, int dist, hash_t hash)
 {
-	unsigned int id = dict->hash[hash];
+	unsigned int id = spatial_dict_lookup(dict, hash);
 #ifdef DEBUG
 	if (id && dict->spatials[id].dist != dist) {
 		if (DEBUGL(6))
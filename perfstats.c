@@ -0,0 +1,135 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "perfstats.h"
+#include "util.h"
+
+bool perf_enabled = false;
+
+const char *perf_probe_names[PERF_MAX] = {
+	"board_play", "playout_move", "descent", "backprop", "prior", "expand",
+	"playout_random",
+	"moggy_ko", "moggy_latari", "moggy_ladder", "moggy_2lib", "moggy_nlib", "moggy_eyefix",
+	"moggy_nakade", "moggy_pat3", "moggy_gatari", "moggy_joseki", "moggy_fillboard",
+};
+
+static struct perf_counters *perf_threads;
+static pthread_mutex_t perf_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct perf_counters *
+perf_register(void)
+{
+	struct perf_counters *pc = calloc2(1, sizeof(*pc));
+	pthread_mutex_lock(&perf_mutex);
+	pc->next = perf_threads;
+	perf_threads = pc;
+	pthread_mutex_unlock(&perf_mutex);
+	return pc;
+}
+
+
+#ifndef NO_THREAD_LOCAL
+
+static __thread struct perf_counters *perf_tls;
+
+struct perf_counters *
+perf_thread_counters(void)
+{
+	if (unlikely(!perf_tls))
+		perf_tls = perf_register();
+	return perf_tls;
+}
+
+#else
+
+/* Thread local storage not supported through __thread,
+ * use pthread_getspecific() instead. The counters are kept
+ * when the thread exits. */
+
+static pthread_key_t perf_key;
+
+static void __attribute__((constructor))
+perf_init(void)
+{
+	pthread_key_create(&perf_key, NULL);
+}
+
+struct perf_counters *
+perf_thread_counters(void)
+{
+	struct perf_counters *pc = pthread_getspecific(perf_key);
+	if (unlikely(!pc)) {
+		pc = perf_register();
+		pthread_setspecific(perf_key, pc);
+	}
+	return pc;
+}
+
+#endif
+
+
+void
+perf_reset(void)
+{
+	/* Racing with the running threads, a few counts may be lost. */
+	pthread_mutex_lock(&perf_mutex);
+	for (struct perf_counters *pc = perf_threads; pc; pc = pc->next) {
+		memset(pc->count, 0, sizeof(pc->count));
+		memset(pc->ticks, 0, sizeof(pc->ticks));
+		memset(pc->hits, 0, sizeof(pc->hits));
+	}
+	pthread_mutex_unlock(&perf_mutex);
+}
+
+void
+perf_sum(struct perf_counters *sum)
+{
+	memset(sum, 0, sizeof(*sum));
+	pthread_mutex_lock(&perf_mutex);
+	for (struct perf_counters *pc = perf_threads; pc; pc = pc->next)
+		for (int p = 0; p < PERF_MAX; p++) {
+			sum->count[p] += pc->count[p];
+			sum->ticks[p] += pc->ticks[p];
+			sum->hits[p] += pc->hits[p];
+		}
+	pthread_mutex_unlock(&perf_mutex);
+}
+
+void
+perf_print(char *buf, int size)
+{
+	struct perf_counters sum;
+	perf_sum(&sum);
+	int len = snprintf(buf, size, "%s", perf_enabled ? "" : "(disabled)\n");
+	for (int p = 0; p < PERF_MAX && len < size; p++) {
+		/* The moggy heuristics only when moggy ran. */
+		if (p >= PERF_MOGGY_KO && !sum.count[p])
+			continue;
+		len += snprintf(buf + len, size - len, "%-15s %12llu calls %8llu ticks/call %10llu Mticks",
+				perf_probe_names[p], (unsigned long long) sum.count[p],
+				(unsigned long long) (sum.count[p] ? sum.ticks[p] / sum.count[p] : 0),
+				(unsigned long long) (sum.ticks[p] / 1000000));
+		if (p >= PERF_MOGGY_KO && len < size)
+			len += snprintf(buf + len, size - len, " %5.1f%% hits", sum.hits[p] * 100.0 / sum.count[p]);
+		if (len < size)
+			len += snprintf(buf + len, size - len, "\n");
+	}
+	/* No trailing newline in a GTP reply. */
+	if (len > 0 && len < size && buf[len - 1] == '\n')
+		buf[len - 1] = 0;
+}
+
+void
+perf_json(FILE *f)
+{
+	struct perf_counters sum;
+	perf_sum(&sum);
+	fprintf(f, "{");
+	for (int p = 0; p < PERF_MAX; p++)
+		fprintf(f, "%s\"%s\": {\"calls\": %llu, \"hits\": %llu, \"ticks\": %llu}", p ? ", " : "",
+			perf_probe_names[p], (unsigned long long) sum.count[p],
+			(unsigned long long) sum.hits[p], (unsigned long long) sum.ticks[p]);
+	fprintf(f, "}");
+}
@@ -0,0 +1,113 @@
+#ifndef PACHI_PERFSTATS_H
+#define PACHI_PERFSTATS_H
+
+/* Hot path instrumentation: call counts and cycles spent in a few
+ * probed sections, counted per thread and summed on demand (see the
+ * pachi-perfstats GTP command). Timing is inclusive - a descent
+ * contains the board plays and expansions done during it, etc.
+ *
+ * The probes are always compiled in; while perf_enabled is false,
+ * each one is a single well-predicted branch. When enabled, a probe
+ * costs two timestamp reads and two thread-local increments. */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "util.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+enum perf_probe {
+	PERF_BOARD_PLAY, // board_play_f()
+	PERF_PLAYOUT_MOVE, // play_random_move()
+	PERF_DESCENT, // uct_playout() tree descent
+	PERF_BACKPROP, // uct_playout() result recording
+	PERF_PRIOR, // uct_prior()
+	PERF_EXPAND, // tree_expand_node()
+	PERF_PLAYOUT_RANDOM, // play_random_move() random fallback
+	/* Moggy heuristics, hits being the times they found a move. */
+	PERF_MOGGY_KO,
+	PERF_MOGGY_LATARI,
+	PERF_MOGGY_LADDER,
+	PERF_MOGGY_2LIB,
+	PERF_MOGGY_NLIB,
+	PERF_MOGGY_EYEFIX,
+	PERF_MOGGY_NAKADE,
+	PERF_MOGGY_PAT3,
+	PERF_MOGGY_GATARI,
+	PERF_MOGGY_JOSEKI,
+	PERF_MOGGY_FILLBOARD,
+	PERF_MAX,
+};
+
+struct perf_counters {
+	uint64_t count[PERF_MAX];
+	uint64_t ticks[PERF_MAX];
+	uint64_t hits[PERF_MAX];
+	struct perf_counters *next; // all threads' counters are chained
+};
+
+extern bool perf_enabled;
+
+/* Counters of the calling thread, registered on first use. */
+struct perf_counters *perf_thread_counters(void);
+
+/* Clear the counters of all threads. */
+void perf_reset(void);
+/* Sum the counters of all threads. */
+void perf_sum(struct perf_counters *sum);
+/* Text report, one line per probe. */
+void perf_print(char *buf, int size);
+/* perf_sum() as a JSON object. */
+void perf_json(FILE *f);
+
+extern const char *perf_probe_names[PERF_MAX];
+
+
+/* Cycle counter where cheap, nanoseconds otherwise. */
+static inline uint64_t
+perf_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/* uint64_t t = perf_start(); ...probed section...; perf_stop(PROBE, t); */
+static inline uint64_t
+perf_start(void)
+{
+	return unlikely(perf_enabled) ? perf_ticks() : 0;
+}
+
+static inline void
+perf_stop(enum perf_probe p, uint64_t start)
+{
+	if (likely(!start))
+		return;
+	struct perf_counters *pc = perf_thread_counters();
+	pc->count[p]++;
+	pc->ticks[p] += perf_ticks() - start;
+}
+
+/* perf_stop() of a probe counting its hits too. */
+static inline void
+perf_stop_hit(enum perf_probe p, uint64_t start, bool hit)
+{
+	if (likely(!start))
+		return;
+	struct perf_counters *pc = perf_thread_counters();
+	pc->count[p]++;
+	pc->hits[p] += hit;
+	pc->ticks[p] += perf_ticks() - start;
+}
+
+#endif
@@ -10,6 +10,7 @@
 #include "engine.h"
 #include "move.h"
 #include "ownermap.h"
+#include "perfstats.h"
 #include "playout.h"
 
 /* Whether to set global debug level to the same as the playout
@@ -20,6 +21,9 @@
 
 #define PLDEBUGL(n) DEBUGL_(policy->debug_level, n)
 
+/* Moves between the setup->cutoff score checks. */
+#define PLAYOUT_CUTOFF_INTERVAL 8
+
 
 /* Full permit logic, ie m->coord may get changed to an alternative move */
 static bool
@@ -68,6 +72,7 @@ play_random_move(struct playout_setup *setup,
 		 struct board *b, enum stone color,
 		 struct playout_policy *policy)
 {
+	uint64_t t = perf_start();
 	coord_t coord = pass;
 	
 	if (setup->prepolicy_hook) {
@@ -92,7 +97,9 @@ play_random_move(struct playout_setup *setup,
 		/* This must never happen if the policy is tracking
 		 * internal board state, obviously. */
 		assert(!policy->setboard || policy->setboard_randomok);
+		uint64_t tr = perf_start();
 		board_play_random(b, color, &coord, permit_handler, policy);
+		perf_stop(PERF_PLAYOUT_RANDOM, tr);
 
 	} else {
 		struct move m;
@@ -107,9 +114,29 @@ play_random_move(struct playout_setup *setup,
 		}
 	}
 
+	perf_stop(PERF_PLAYOUT_MOVE, t);
 	return coord;
 }
 
+/* Whether the rest of the playout can be skipped: no group is in
+ * atari and all the free points are one-point eyes, so that nothing
+ * but passes is left, or the score is beyond the cutoff margin. */
+static bool
+playout_cutoff(struct playout_setup *setup, struct board *b)
+{
+	if (!b->clen) {
+		int i;
+		for (i = 0; i < b->flen; i++)
+			if (board_get_one_point_eye(b, b->f[i]) == S_NONE)
+				break;
+		if (i == b->flen)
+			return true;
+	}
+	if (b->moves % PLAYOUT_CUTOFF_INTERVAL)
+		return false;
+	return fabs(board_fast_score(b)) > setup->cutoff;
+}
+
 int
 play_random_game(struct playout_setup *setup,
                  struct board *b, enum stone starting_color,
@@ -120,6 +147,8 @@ play_random_game(struct playout_setup *setup,
 	assert(setup && policy);
 
 	int gamelen = setup->gamelen - b->moves;
+	/* No superko check in the playouts (see below). */
+	board_history_off(b);
 
 	if (policy->setboard)
 		policy->setboard(policy, b);
@@ -181,6 +210,10 @@ play_random_game(struct playout_setup *setup,
 
 		if (setup->mercymin && abs(b->captures[S_BLACK] - b->captures[S_WHITE]) > setup->mercymin)
 			break;
+		if (setup->cutoff && playout_cutoff(setup, b))
+			break;
+		if (setup->halt && *setup->halt)
+			break;
 
 		color = stone_other(color);
 	}
@@ -194,7 +227,7 @@ play_random_game(struct playout_setup *setup,
 			board_print(b, stderr);
 	}
 
-	if (ownermap)
+	if (ownermap && !(setup->halt && *setup->halt))
 		board_ownermap_fill(ownermap, b);
 
 #ifdef DEBUGL_BY_PLAYOUT
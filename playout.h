@@ -1,6 +1,8 @@
 #ifndef PACHI_PLAYOUT_H
 #define PACHI_PLAYOUT_H
 
+#include <signal.h>
+
 #define MAX_GAMELEN 600
 
 struct board;
@@ -40,6 +42,14 @@ typedef bool (*playoutp_permit)(struct playout_policy *playout_policy, struct bo
 /* Tear down the policy state; policy and policy->data will be free()d by caller. */
 typedef void (*playoutp_done)(struct playout_policy *playout_policy);
 
+/* Run @n independent playouts from @b at once, as play_random_game()
+ * would without amaf map, storing their results in @results; @b is
+ * left untouched. Optional, for policies that can do it faster than
+ * one playout at a time. */
+typedef void (*playoutp_batch)(struct playout_policy *playout_policy, struct playout_setup *setup,
+			       struct board *b, enum stone starting_color, int n, int *results,
+			       struct board_ownermap *ownermap);
+
 struct playout_policy {
 	int debug_level;
 	/* We call setboard when we start new playout.
@@ -51,6 +61,7 @@ struct playout_policy {
 	playoutp_assess assess;
 	playoutp_permit permit;
 	playoutp_done done;
+	playoutp_batch batch;
 	/* By default, with setboard set we will refuse to make (random)
 	 * moves outside of the *choose routine in order not to mess up
 	 * state tracking. If you use *setboard but do not track state
@@ -78,6 +89,15 @@ struct playout_setup {
 	/* Minimal difference between captures to terminate the playout.
 	 * 0 means don't check. */
 	int mercymin;
+	/* Score difference [points] to terminate the playout, scored as it
+	 * stands; the board komi includes any dynamic komi. The playout
+	 * is also terminated once only eyes are left to play in. 0 means
+	 * don't check; only play_random_game() checks this. */
+	int cutoff;
+	/* When set, the playout is given up after the current move
+	 * and its result is meaningless; the ownermap is not filled.
+	 * NULL means never; only play_random_game() checks this. */
+	volatile sig_atomic_t *halt;
 
 	void *hook_data; // for hook to reference its state
 	playouth_prepolicy prepolicy_hook;
@@ -0,0 +1,339 @@
+/* Gamma-weighted playout policy. Every free point carries a weight
+ * which is the product of the gammas of the features present there,
+ * and moves are drawn from the resulting distribution (Coulom,
+ * "Computing Elo Ratings of Move Patterns in the Game of Go").
+ *
+ * The weights live in a probdist per color, kept in b->ps across the
+ * playout; after each move, only the points whose features may have
+ * changed are recomputed: the move's 8-neighborhood, the liberties of
+ * the groups next to it and the ko points. Anything more involved
+ * (captures, moves played behind our back) falls back to a full
+ * refresh. */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "board.h"
+#include "debug.h"
+#include "pattern3.h"
+#include "playout.h"
+#include "playout/gamma.h"
+#include "playout/moggy.h"
+#include "probdist.h"
+#include "random.h"
+#include "tactics/selfatari.h"
+
+
+#define PLDEBUGL(n) DEBUGL_(p->debug_level, n)
+
+/* Maximal weight of a single point (after the nearness boost); this
+ * keeps the probdist total well within fixp_t range. */
+#define GAMMA_MAX 100
+
+struct gamma_policy {
+	/* Weight of a pat3 match is 1 + pat3_scale * pat3_gammas[idx];
+	 * the gammas are moggy's pattern probabilities. */
+	double pat3_scale;
+	double pat3_gammas[PAT3_N];
+	/* Multipliers for capturing a group in atari and for extending
+	 * own group out of atari. */
+	double capture_gamma;
+	double escape_gamma;
+	/* Multiplier for the 8-neighborhood of the last move, applied
+	 * only while picking. */
+	double near_gamma;
+	/* How many bad self-atari picks to reject before giving up
+	 * and passing to the uniform policy. */
+	int selfatari_tries;
+
+	struct pattern3s patterns;
+};
+
+/* Per-board state, a single block (b->ps). */
+struct gamma_state {
+	int size2;
+	/* Board state at the last sync. */
+	int moves;
+	int captures[S_MAX];
+	coord_t ko;
+	/* Indexed by color - 1. */
+	struct probdist pd[2];
+	fixp_t data[];
+};
+
+
+static fixp_t
+gamma_point(struct gamma_policy *pp, struct board *b, coord_t c, enum stone color)
+{
+	if (board_at(b, c) != S_NONE
+	    || board_is_one_point_eye(b, c, color)
+	    || !board_is_valid_play(b, color, c))
+		return 0;
+
+	double gamma = 1;
+	struct move m = { .coord = c, .color = color };
+	char idx;
+	if (pattern3_move_here(&pp->patterns, b, &m, &idx))
+		gamma += pp->pat3_scale * pp->pat3_gammas[(int) idx];
+
+	bool capture = false, escape = false;
+	foreach_neighbor(b, c, {
+		group_t g = group_at(b, c);
+		if (g && board_group_info(b, g).libs == 1) {
+			if (board_at(b, c) == color)
+				escape = true;
+			else
+				capture = true;
+		}
+	});
+	if (capture)
+		gamma *= pp->capture_gamma;
+	if (escape)
+		gamma *= pp->escape_gamma;
+
+	if (gamma > GAMMA_MAX)
+		gamma = GAMMA_MAX;
+	return double_to_fixp(gamma);
+}
+
+static void
+gamma_refresh_all(struct gamma_policy *pp, struct board *b, struct gamma_state *gs)
+{
+	coord_t cs[gs->size2];
+	fixp_t vals[2][gs->size2];
+	int n = 0;
+	foreach_point(b) {
+		cs[n] = c;
+		vals[0][n] = gamma_point(pp, b, c, S_BLACK);
+		vals[1][n] = gamma_point(pp, b, c, S_WHITE);
+		n++;
+	} foreach_point_end;
+	probdist_set_many(&gs->pd[0], cs, vals[0], n);
+	probdist_set_many(&gs->pd[1], cs, vals[1], n);
+}
+
+static void
+gamma_refresh(struct gamma_policy *pp, struct board *b, struct gamma_state *gs, coord_t c)
+{
+	probdist_set(&gs->pd[0], c, gamma_point(pp, b, c, S_BLACK));
+	probdist_set(&gs->pd[1], c, gamma_point(pp, b, c, S_WHITE));
+}
+
+static void
+gamma_refresh_libs(struct gamma_policy *pp, struct board *b, struct gamma_state *gs, group_t g)
+{
+	int libs = board_group_info(b, g).libs;
+	if (libs > GROUP_KEEP_LIBS)
+		libs = GROUP_KEEP_LIBS;
+	for (int i = 0; i < libs; i++)
+		gamma_refresh(pp, b, gs, board_group_info(b, g).lib[i]);
+}
+
+/* Bring the distributions up to date with the board. */
+static void
+gamma_sync(struct gamma_policy *pp, struct board *b, struct gamma_state *gs)
+{
+	if (b->moves == gs->moves + 1
+	    && b->captures[S_BLACK] == gs->captures[S_BLACK]
+	    && b->captures[S_WHITE] == gs->captures[S_WHITE]
+	    && !is_pass(b->last_move.coord)) {
+		/* A single non-capturing move; it can only have changed
+		 * the features of its neighborhood and of liberties of
+		 * the groups it touches. */
+		coord_t m = b->last_move.coord;
+		gamma_refresh(pp, b, gs, m);
+		foreach_8neighbor(b, m) {
+			if (board_at(b, c) != S_OFFBOARD)
+				gamma_refresh(pp, b, gs, c);
+		} foreach_8neighbor_end;
+		gamma_refresh_libs(pp, b, gs, group_at(b, m));
+		foreach_neighbor(b, m, {
+			group_t g = group_at(b, c);
+			if (g && g != group_at(b, m))
+				gamma_refresh_libs(pp, b, gs, g);
+		});
+
+	} else if (b->moves != gs->moves
+	           || b->captures[S_BLACK] != gs->captures[S_BLACK]
+	           || b->captures[S_WHITE] != gs->captures[S_WHITE]) {
+		gamma_refresh_all(pp, b, gs);
+		goto done;
+	}
+
+	/* A pass or a move may have changed the ko. */
+	if (gs->ko != b->ko.coord) {
+		if (!is_pass(gs->ko))
+			gamma_refresh(pp, b, gs, gs->ko);
+		if (!is_pass(b->ko.coord))
+			gamma_refresh(pp, b, gs, b->ko.coord);
+	}
+
+done:
+	gs->moves = b->moves;
+	gs->captures[S_BLACK] = b->captures[S_BLACK];
+	gs->captures[S_WHITE] = b->captures[S_WHITE];
+	gs->ko = b->ko.coord;
+}
+
+
+void
+playout_gamma_setboard(struct playout_policy *p, struct board *b)
+{
+	struct gamma_policy *pp = p->data;
+	struct gamma_state *gs = b->ps;
+	int size2 = board_size2(b);
+
+	if (!gs || gs->size2 != size2) {
+		if (gs)
+			free(gs);
+		/* items[size2] and tree[size2 + 1] for each color. */
+		gs = malloc2(sizeof(*gs) + 2 * (2 * size2 + 1) * sizeof(fixp_t));
+		gs->size2 = size2;
+		for (int i = 0; i < 2; i++) {
+			struct probdist *pd = &gs->pd[i];
+			pd->b = b;
+			pd->n = size2;
+			pd->top = probdist_top(size2);
+			pd->items = &gs->data[i * (2 * size2 + 1)];
+			pd->tree = pd->items + size2;
+		}
+		b->ps = gs;
+	}
+	for (int i = 0; i < 2; i++) {
+		memset(gs->pd[i].items, 0, (2 * size2 + 1) * sizeof(fixp_t));
+		gs->pd[i].total = 0;
+		gs->pd[i].b = b;
+	}
+
+	gamma_refresh_all(pp, b, gs);
+	gs->moves = b->moves;
+	gs->captures[S_BLACK] = b->captures[S_BLACK];
+	gs->captures[S_WHITE] = b->captures[S_WHITE];
+	gs->ko = b->ko.coord;
+}
+
+coord_t
+playout_gamma_choose(struct playout_policy *p, struct playout_setup *s, struct board *b, enum stone to_play)
+{
+	struct gamma_policy *pp = p->data;
+	struct gamma_state *gs = b->ps;
+	if (!gs) {
+		playout_gamma_setboard(p, b);
+		gs = b->ps;
+	}
+	gamma_sync(pp, b, gs);
+	struct probdist *pd = &gs->pd[to_play - 1];
+
+	/* Boost the neighborhood of the last move for this pick. */
+	coord_t near[8]; fixp_t near_orig[8];
+	int nearn = 0;
+	if (!is_pass(b->last_move.coord)) {
+		foreach_8neighbor(b, b->last_move.coord) {
+			if (board_at(b, c) != S_NONE || !probdist_one(pd, c))
+				continue;
+			near[nearn] = c;
+			near_orig[nearn] = probdist_one(pd, c);
+			double gamma = fixp_to_double(near_orig[nearn]) * pp->near_gamma;
+			if (gamma > GAMMA_MAX)
+				gamma = GAMMA_MAX;
+			probdist_set(pd, c, double_to_fixp(gamma));
+			nearn++;
+		} foreach_8neighbor_end;
+	}
+
+	/* Picks turning out to be bad self-ataris are muted and we
+	 * try again. */
+	coord_t ignore[pp->selfatari_tries + 1];
+	int ignoren = 0;
+	ignore[0] = pass;
+	coord_t coord = pass;
+	while (probdist_total(pd) > 0) {
+		coord = probdist_pick(pd, ignore);
+		if (!is_bad_selfatari(b, to_play, coord))
+			break;
+		if (PLDEBUGL(5))
+			fprintf(stderr, "gamma: rejecting self-atari %s\n", coord2sstr(coord, b));
+		if (ignoren == pp->selfatari_tries) {
+			coord = pass;
+			break;
+		}
+		probdist_mute(pd, coord);
+		int i = ignoren++;
+		for (; i > 0 && ignore[i - 1] > coord; i--)
+			ignore[i] = ignore[i - 1];
+		ignore[i] = coord;
+		ignore[ignoren] = pass;
+		coord = pass;
+	}
+
+	for (int i = 0; i < ignoren; i++)
+		probdist_unmute(pd, ignore[i]);
+	for (int i = 0; i < nearn; i++)
+		probdist_set(pd, near[i], near_orig[i]);
+
+	return coord;
+}
+
+
+struct playout_policy *
+playout_gamma_init(char *arg, struct board *b)
+{
+	struct playout_policy *p = calloc2(1, sizeof(*p));
+	struct gamma_policy *pp = calloc2(1, sizeof(*pp));
+	p->data = pp;
+	p->setboard = playout_gamma_setboard;
+	p->choose = playout_gamma_choose;
+	/* We resync whenever moves were played behind our back. */
+	p->setboard_randomok = true;
+
+	/* These are hand-picked, not learned. */
+	pp->pat3_scale = 20;
+	memcpy(pp->pat3_gammas, moggy_pat3_gammas, sizeof(pp->pat3_gammas));
+	pp->capture_gamma = 30;
+	pp->escape_gamma = 15;
+	pp->near_gamma = 5;
+	pp->selfatari_tries = 4;
+
+	if (arg) {
+		char *optspec, *next = arg;
+		while (*next) {
+			optspec = next;
+			next += strcspn(next, ":");
+			if (*next) { *next++ = 0; } else { *next = 0; }
+
+			char *optname = optspec;
+			char *optval = strchr(optspec, '=');
+			if (optval) *optval++ = 0;
+
+			if (!strcasecmp(optname, "debug") && optval) {
+				p->debug_level = atoi(optval);
+			} else if (!strcasecmp(optname, "pat3scale") && optval) {
+				pp->pat3_scale = atof(optval);
+			} else if (!strcasecmp(optname, "pat3gammas") && optval) {
+				/* PAT3_N %-separated floating point values */
+				for (int i = 0; *optval && i < PAT3_N; i++) {
+					pp->pat3_gammas[i] = atof(optval);
+					optval += strcspn(optval, "%");
+					if (*optval) optval++;
+				}
+			} else if (!strcasecmp(optname, "capture") && optval) {
+				pp->capture_gamma = atof(optval);
+			} else if (!strcasecmp(optname, "escape") && optval) {
+				pp->escape_gamma = atof(optval);
+			} else if (!strcasecmp(optname, "near") && optval) {
+				pp->near_gamma = atof(optval);
+			} else if (!strcasecmp(optname, "selfataritries") && optval) {
+				pp->selfatari_tries = atoi(optval);
+			} else {
+				fprintf(stderr, "playout-gamma: Invalid policy argument %s or missing value\n", optname);
+				exit(1);
+			}
+		}
+	}
+
+	pattern3s_init(&pp->patterns, moggy_patterns_src, PAT3_N);
+
+	return p;
+}
@@ -0,0 +1,13 @@
+#ifndef PACHI_PLAYOUT_GAMMA_H
+#define PACHI_PLAYOUT_GAMMA_H
+
+struct board;
+struct playout_policy;
+
+/* Gamma-weighted random playouts: each free point is picked with
+ * probability proportional to the product of the gammas of the
+ * features present there (3x3 pattern, capture, atari escape,
+ * nearness to the last move), as in Coulom's Crazy Stone. */
+struct playout_policy *playout_gamma_init(char *arg, struct board *b);
+
+#endif
@@ -1,16 +1,28 @@
 #include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "board.h"
 #include "debug.h"
+#include "ownermap.h"
 #include "playout.h"
 #include "playout/light.h"
+#ifdef PLAYOUT_CUDA
+#include "playout/light_cuda.h"
+#endif
 #include "random.h"
 
 
 #define PLDEBUGL(n) DEBUGL_(p->debug_level, n)
 
+struct light_policy {
+	/* Gpu to run the batches on, -1 for none. */
+	int gpu;
+};
+
 
 coord_t
 playout_light_choose(struct playout_policy *p, struct playout_setup *s, struct board *b, enum stone to_play)
@@ -19,14 +31,390 @@ playout_light_choose(struct playout_policy *p, struct playout_setup *s, struct b
 }
 
 
+/* Batched playouts: the light policy being uniformly random moves
+ * with eye-filling avoided, the playouts can run on a stripped down
+ * board. It keeps the point colors, the free points list as struct
+ * board (so that moves are picked the same way) and one bitmap of
+ * stones per color, indexed by coord_t (border included, so that the
+ * neighbors of a point are at +-1 and +-stride without wrapping).
+ * Groups and liberties are not tracked: captures are found by
+ * flood-filling the bitmaps, only for the neighbor groups without
+ * a liberty next to the stone. A board is a few kB, the copies from
+ * the leaf are cheap and all the boards of a batch stay in the cache;
+ * they are advanced one move each in turn. The rules are those of
+ * board_play() and board_permit(), multi-stone suicide included. */
+
+#define LB_WORDS ((BOARD_MAX_COORDS + 63) / 64)
+#define LB_BATCH 64
+
+typedef uint64_t bitmap_t[LB_WORDS];
+
+struct light_geometry {
+	bitmap_t onboard;
+	int stride, size2;
+};
+
+struct light_board {
+	unsigned char at[BOARD_MAX_COORDS]; // enum stone
+	bitmap_t stones[2]; // by color - 1
+	coord_t free[BOARD_MAX_COORDS];
+	int free_n;
+	struct move ko;
+	int captures[S_MAX];
+	int passes;
+	bool over;
+};
+
+#define lb_stones(lb, color) ((lb)->stones[(color) - 1])
+
+static inline void
+bm_set(uint64_t *m, coord_t c)
+{
+	m[c >> 6] |= 1ULL << (c & 63);
+}
+
+/* @m and its neighbors, on board. */
+static inline void
+bm_dilate(const struct light_geometry *g, const uint64_t *m, uint64_t *out)
+{
+	int s = g->stride;
+	for (int i = 0; i < LB_WORDS; i++) {
+		uint64_t lo = i > 0 ? m[i - 1] : 0, hi = i < LB_WORDS - 1 ? m[i + 1] : 0;
+		out[i] = (m[i] | m[i] << 1 | lo >> 63 | m[i] >> 1 | hi << 63
+			  | m[i] << s | lo >> (64 - s) | m[i] >> s | hi << (64 - s)) & g->onboard[i];
+	}
+}
+
+#define lb_foreach_neighbor(g, c, n) \
+	for (coord_t n_[4] = { (c) - 1, (c) + 1, (c) - (g)->stride, (c) + (g)->stride }, *np_ = n_, n; \
+	     np_ < n_ + 4 && (n = *np_, true); np_++)
+
+/* See board_is_eyelike(). */
+static inline bool
+lb_eyelike(const struct light_geometry *g, const struct light_board *lb, coord_t c, enum stone color)
+{
+	lb_foreach_neighbor(g, c, n)
+		if (lb->at[n] != color && lb->at[n] != S_OFFBOARD)
+			return false;
+	return true;
+}
+
+static inline bool
+lb_has_liberty(const struct light_geometry *g, const struct light_board *lb, coord_t c)
+{
+	lb_foreach_neighbor(g, c, n)
+		if (lb->at[n] == S_NONE)
+			return true;
+	return false;
+}
+
+/* See board_is_one_point_eye(). */
+static bool
+lb_one_point_eye(const struct light_geometry *g, const struct light_board *lb, coord_t c, enum stone color)
+{
+	if (!lb_eyelike(g, lb, c, color))
+		return false;
+	int s = g->stride;
+	coord_t d[4] = { c - s - 1, c - s + 1, c + s - 1, c + s + 1 };
+	int other = 0, offboard = 0;
+	for (int i = 0; i < 4; i++) {
+		other += lb->at[d[i]] == stone_other(color);
+		offboard |= lb->at[d[i]] == S_OFFBOARD;
+	}
+	return other + offboard < 2;
+}
+
+/* Flood-fill the @color group at @c into @group, unless it has a
+ * liberty. Returns whether it has none. */
+static bool
+lb_group_dead(const struct light_geometry *g, const struct light_board *lb, coord_t c, enum stone color,
+	      uint64_t *group)
+{
+	if (lb_has_liberty(g, lb, c))
+		return false;
+	const uint64_t *own = lb_stones(lb, color), *other = lb_stones(lb, stone_other(color));
+	memset(group, 0, sizeof(bitmap_t));
+	bm_set(group, c);
+	while (true) {
+		bitmap_t d;
+		bm_dilate(g, group, d);
+		uint64_t libs = 0, grew = 0;
+		for (int i = 0; i < LB_WORDS; i++) {
+			libs |= d[i] & ~own[i] & ~other[i] & g->onboard[i];
+			uint64_t n = group[i] | (d[i] & own[i]);
+			grew |= n ^ group[i];
+			group[i] = n;
+		}
+		if (libs) return false;
+		if (!grew) return true;
+	}
+}
+
+/* Take the @color @group off, its points becoming free. */
+static int
+lb_remove(struct light_board *lb, enum stone color, const uint64_t *group)
+{
+	uint64_t *own = lb_stones(lb, color);
+	int n = 0;
+	for (int i = 0; i < LB_WORDS; i++) {
+		own[i] &= ~group[i];
+		for (uint64_t bits = group[i]; bits; bits &= bits - 1) {
+			coord_t c = i * 64 + __builtin_ctzll(bits);
+			lb->at[c] = S_NONE;
+			lb->free[lb->free_n++] = c;
+			n++;
+		}
+	}
+	lb->captures[stone_other(color)] += n;
+	return n;
+}
+
+/* Play @color at the free point lb->free[@f], as board_play_f()
+ * would. Returns false for an illegal move, leaving @lb unchanged. */
+static bool
+lb_play(const struct light_geometry *g, struct light_board *lb, int f, enum stone color)
+{
+	coord_t c = lb->free[f];
+	enum stone other = stone_other(color);
+	bool in_eye = lb_eyelike(g, lb, c, other);
+	if (in_eye && lb->ko.coord == c && lb->ko.color == color)
+		return false;
+
+	lb->at[c] = color;
+	bm_set(lb_stones(lb, color), c);
+	lb->free[f] = lb->free[--lb->free_n];
+	bitmap_t group;
+	int caps = 0;
+	coord_t cap_at = pass;
+	lb_foreach_neighbor(g, c, n) {
+		if (lb->at[n] != other || !lb_group_dead(g, lb, n, other, group))
+			continue;
+		caps += lb_remove(lb, other, group);
+		cap_at = n;
+	}
+
+	if (in_eye && !caps) {
+		/* One-stone suicide. */
+		lb->at[c] = S_NONE;
+		lb_stones(lb, color)[c >> 6] &= ~(1ULL << (c & 63));
+		lb->free[lb->free_n++] = lb->free[f];
+		lb->free[f] = c;
+		return false;
+	}
+	struct move ko = { pass, S_NONE };
+	if (in_eye && caps == 1) {
+		ko.coord = cap_at;
+		ko.color = other;
+	}
+	lb->ko = ko;
+	if (!in_eye && !caps && lb_group_dead(g, lb, c, color, group)) {
+		/* Multi-stone suicide. */
+		lb_remove(lb, color, group);
+	}
+	return true;
+}
+
+/* See board_play_random(). */
+static coord_t
+lb_play_random(const struct light_geometry *g, struct light_board *lb, enum stone color, enum go_ruleset rules)
+{
+	if (lb->free_n) {
+		int base = fast_random(lb->free_n);
+		for (int k = 0; k < lb->free_n; k++) {
+			int f = base + k < lb->free_n ? base + k : base + k - lb->free_n;
+			coord_t c = lb->free[f];
+			if (lb_one_point_eye(g, lb, c, color) || !lb_play(g, lb, f, color))
+				continue;
+			lb->passes = 0;
+			return c;
+		}
+	}
+
+	if (rules == RULES_SIMING)
+		lb->captures[stone_other(color)]++;
+	struct move noko = { pass, S_NONE };
+	lb->ko = noko;
+	lb->passes++;
+	return pass;
+}
+
+/* See board_fast_score(). */
+static floating_t
+lb_score(const struct light_geometry *g, const struct light_board *lb, struct board *b,
+	 struct board_ownermap *ownermap)
+{
+	int scores[S_MAX] = { 0 };
+	bool eyes = b->rules != RULES_STONES_ONLY;
+	if (ownermap) ownermap->playouts++;
+	for (coord_t c = 0; c < g->size2; c++) {
+		enum stone color = lb->at[c];
+		if (color == S_OFFBOARD)
+			continue;
+		if (color == S_NONE) {
+			if (lb_one_point_eye(g, lb, c, S_WHITE)) color = S_WHITE;
+			else if (lb_one_point_eye(g, lb, c, S_BLACK)) color = S_BLACK;
+			if (eyes) scores[color]++;
+		} else {
+			scores[color]++;
+		}
+		if (ownermap) ownermap->map[c][color]++;
+	}
+	return b->komi + (b->rules != RULES_SIMING ? b->handicap : 0) + scores[S_WHITE] - scores[S_BLACK];
+}
+
+#ifdef PLAYOUT_CUDA
+static void
+playout_light_batch_gpu(struct light_policy *lp, struct playout_setup *setup, struct board *b,
+			enum stone starting_color, int n, int *results, struct board_ownermap *ownermap)
+{
+	static __thread struct light_cuda_position *pos;
+	static __thread int (*owner)[S_MAX];
+	if (!pos) {
+		pos = malloc2(sizeof(*pos));
+		owner = malloc2(BOARD_MAX_COORDS * sizeof(*owner));
+	}
+
+	foreach_point(b) {
+		pos->at[c] = board_at(b, c);
+	} foreach_point_end;
+	memcpy(pos->free, b->f, b->flen * sizeof(*b->f));
+	pos->free_n = b->flen;
+	pos->ko = b->ko.coord;
+	pos->ko_color = b->ko.color;
+	memcpy(pos->captures, b->captures, sizeof(pos->captures));
+	pos->passes = is_pass(b->last_move.coord) && b->moves > 0;
+	pos->stride = board_size(b);
+	pos->size2 = board_size2(b);
+	pos->starting_color = starting_color;
+	pos->gamelen = setup->gamelen - b->moves;
+	pos->mercymin = setup->mercymin;
+	pos->siming = b->rules == RULES_SIMING;
+	pos->eyes = b->rules != RULES_STONES_ONLY;
+	pos->score_base = b->komi + (b->rules != RULES_SIMING ? b->handicap : 0);
+
+	light_cuda_batch(lp->gpu, pos, n, results, owner);
+
+	if (!ownermap)
+		return;
+	ownermap->playouts += n;
+	foreach_point(b) {
+		for (int j = 0; j < S_MAX; j++)
+			ownermap->map[c][j] += owner[c][j];
+	} foreach_point_end;
+}
+#endif
+
+static void
+playout_light_batch(struct playout_policy *p, struct playout_setup *setup, struct board *b,
+		    enum stone starting_color, int n, int *results, struct board_ownermap *ownermap)
+{
+#ifdef PLAYOUT_CUDA
+	struct light_policy *lp = p->data;
+	if (lp->gpu >= 0) {
+		playout_light_batch_gpu(lp, setup, b, starting_color, n, results, ownermap);
+		return;
+	}
+#endif
+
+	struct light_geometry g = { .stride = board_size(b), .size2 = board_size2(b) };
+	/* The boards and the start position, per thread. */
+	static __thread struct light_board *lbs;
+	if (!lbs) lbs = malloc2((LB_BATCH + 1) * sizeof(*lbs));
+
+	struct light_board *start = &lbs[LB_BATCH];
+	memset(start, 0, sizeof(*start));
+	memset(g.onboard, 0, sizeof(g.onboard));
+	foreach_point(b) {
+		enum stone s = board_at(b, c);
+		start->at[c] = s;
+		if (s == S_OFFBOARD)
+			continue;
+		bm_set(g.onboard, c);
+		if (s != S_NONE)
+			bm_set(lb_stones(start, s), c);
+	} foreach_point_end;
+	memcpy(start->free, b->f, b->flen * sizeof(*b->f));
+	start->free_n = b->flen;
+	start->ko = b->ko;
+	memcpy(start->captures, b->captures, sizeof(start->captures));
+	start->passes = is_pass(b->last_move.coord) && b->moves > 0;
+	/* Only the used part of the free list needs copying. */
+	size_t copy = offsetof(struct light_board, free) + start->free_n * sizeof(coord_t);
+
+	for (int base = 0; base < n; base += LB_BATCH) {
+		int count = n - base < LB_BATCH ? n - base : LB_BATCH;
+		for (int i = 0; i < count; i++) {
+			struct light_board *lb = &lbs[i];
+			memcpy(lb, start, copy);
+			lb->free_n = start->free_n;
+			lb->ko = start->ko;
+			memcpy(lb->captures, start->captures, sizeof(lb->captures));
+			lb->passes = start->passes;
+			lb->over = false;
+		}
+
+		/* All the boards move in turn, the same color. */
+		enum stone color = starting_color;
+		int running = count;
+		for (int gamelen = setup->gamelen - b->moves; gamelen-- && running; color = stone_other(color)) {
+			for (int i = 0; i < count; i++) {
+				struct light_board *lb = &lbs[i];
+				if (lb->over)
+					continue;
+				lb_play_random(&g, lb, color, b->rules);
+				if (lb->passes >= 2
+				    || (setup->mercymin && abs(lb->captures[S_BLACK] - lb->captures[S_WHITE]) > setup->mercymin)) {
+					lb->over = true;
+					running--;
+				}
+			}
+		}
+
+		for (int i = 0; i < count; i++) {
+			floating_t score = lb_score(&g, &lbs[i], b, ownermap);
+			results[base + i] = starting_color == S_WHITE ? score * 2 : - (score * 2);
+		}
+	}
+}
+
+
 struct playout_policy *
 playout_light_init(char *arg, struct board *b)
 {
 	struct playout_policy *p = calloc2(1, sizeof(*p));
 	p->choose = playout_light_choose;
+	p->batch = playout_light_batch;
+	struct light_policy *lp = calloc2(1, sizeof(*lp));
+	p->data = lp;
+	lp->gpu = -1;
+
+	if (arg) {
+		char *optspec, *next = arg;
+		while (*next) {
+			optspec = next;
+			next += strcspn(next, ":");
+			if (*next) { *next++ = 0; } else { *next = 0; }
+
+			char *optname = optspec;
+			char *optval = strchr(optspec, '=');
+			if (optval) *optval++ = 0;
 
-	if (arg)
-		fprintf(stderr, "playout-light: This policy does not accept arguments (%s)\n", arg);
+			if (!strcasecmp(optname, "gpu")) {
+				/* Run the batched playouts (leaf_playouts > 1)
+				 * on this gpu (default 0). Needs PLAYOUT_CUDA. */
+#ifdef PLAYOUT_CUDA
+				int gpu = optval ? atoi(optval) : 0;
+				if (light_cuda_init(gpu))
+					lp->gpu = gpu;
+#else
+				fprintf(stderr, "playout-light: gpu needs a build with PLAYOUT_CUDA, ignored\n");
+#endif
+			} else {
+				fprintf(stderr, "playout-light: Invalid policy argument %s or missing value\n", optname);
+				exit(1);
+			}
+		}
+	}
 
 	return p;
 }
@@ -0,0 +1,305 @@
+/* Light playouts on the gpu, see light_cuda.h. The boards are those of
+ * the cpu light batch (point colors and free points list, moves picked
+ * and checked as board_play_random() does), only groups are found by a
+ * plain flood fill instead of bitmaps, which suits one board per gpu
+ * thread better. Boards live in the thread local memory. */
+
+#define DEBUG
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <cuda_runtime.h>
+
+extern "C" {
+#include "debug.h"
+#include "random.h"
+#include "util.h"
+#include "playout/light_cuda.h"
+}
+
+#define LC_PASS (-1)
+#define LC_THREADS 128
+
+#define lc_other(color) (S_BLACK + S_WHITE - (color))
+
+#define cuda_check(call) do { \
+	cudaError_t err_ = (call); \
+	if (err_ != cudaSuccess) { \
+		fprintf(stderr, "light_cuda: %s: %s\n", #call, cudaGetErrorString(err_)); \
+		exit(1); \
+	} \
+} while (0)
+
+struct lc_board {
+	unsigned char at[BOARD_MAX_COORDS];
+	unsigned char mark[BOARD_MAX_COORDS];
+	short free[BOARD_MAX_COORDS];
+	short group[BOARD_MAX_COORDS];
+	int free_n;
+	int ko, ko_color;
+	int captures[S_MAX];
+	int passes;
+	unsigned int rnd;
+};
+
+/* xorshift32 */
+__device__ static inline unsigned int
+lc_random(struct lc_board *lb, unsigned int max)
+{
+	unsigned int x = lb->rnd;
+	x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+	lb->rnd = x;
+	return ((unsigned long long) x * max) >> 32;
+}
+
+__device__ static inline bool
+lc_eyelike(const struct lc_board *lb, int stride, int c, int color)
+{
+	int n[4] = { c - 1, c + 1, c - stride, c + stride };
+	for (int k = 0; k < 4; k++)
+		if (lb->at[n[k]] != color && lb->at[n[k]] != S_OFFBOARD)
+			return false;
+	return true;
+}
+
+__device__ static bool
+lc_one_point_eye(const struct lc_board *lb, int stride, int c, int color)
+{
+	if (!lc_eyelike(lb, stride, c, color))
+		return false;
+	int d[4] = { c - stride - 1, c - stride + 1, c + stride - 1, c + stride + 1 };
+	int other = 0, offboard = 0;
+	for (int k = 0; k < 4; k++) {
+		other += lb->at[d[k]] == lc_other(color);
+		offboard |= lb->at[d[k]] == S_OFFBOARD;
+	}
+	return other + offboard < 2;
+}
+
+/* Collect the @color group at @c into lb->group unless it has a
+ * liberty; returns its size, 0 if alive. */
+__device__ static int
+lc_group_dead(struct lc_board *lb, int stride, int c, int color)
+{
+	int top = 0;
+	lb->group[top++] = c;
+	lb->mark[c] = 1;
+	for (int i = 0; i < top; i++) {
+		int g = lb->group[i];
+		int n[4] = { g - 1, g + 1, g - stride, g + stride };
+		for (int k = 0; k < 4; k++) {
+			if (lb->at[n[k]] == S_NONE) {
+				for (int j = 0; j < top; j++)
+					lb->mark[lb->group[j]] = 0;
+				return 0;
+			}
+			if (lb->at[n[k]] == color && !lb->mark[n[k]]) {
+				lb->mark[n[k]] = 1;
+				lb->group[top++] = n[k];
+			}
+		}
+	}
+	return top;
+}
+
+/* Take the @size stones of lb->group off. */
+__device__ static int
+lc_remove(struct lc_board *lb, int size)
+{
+	int color = lb->at[lb->group[0]];
+	for (int j = 0; j < size; j++) {
+		int c = lb->group[j];
+		lb->at[c] = S_NONE;
+		lb->mark[c] = 0;
+		lb->free[lb->free_n++] = c;
+	}
+	lb->captures[lc_other(color)] += size;
+	return size;
+}
+
+/* See lb_play() in light.c. */
+__device__ static bool
+lc_play(struct lc_board *lb, int stride, int f, int color)
+{
+	int c = lb->free[f], other = lc_other(color);
+	bool in_eye = lc_eyelike(lb, stride, c, other);
+	if (in_eye && lb->ko == c && lb->ko_color == color)
+		return false;
+
+	lb->at[c] = color;
+	lb->free[f] = lb->free[--lb->free_n];
+	int caps = 0, cap_at = LC_PASS;
+	int n[4] = { c - 1, c + 1, c - stride, c + stride };
+	for (int k = 0; k < 4; k++) {
+		if (lb->at[n[k]] != other)
+			continue;
+		int size = lc_group_dead(lb, stride, n[k], other);
+		if (size) {
+			caps += lc_remove(lb, size);
+			cap_at = n[k];
+		}
+	}
+
+	if (in_eye && !caps) {
+		/* One-stone suicide. */
+		lb->at[c] = S_NONE;
+		lb->free[lb->free_n++] = lb->free[f];
+		lb->free[f] = c;
+		return false;
+	}
+	lb->ko = in_eye && caps == 1 ? cap_at : LC_PASS;
+	lb->ko_color = in_eye && caps == 1 ? other : S_NONE;
+	if (!in_eye && !caps) {
+		/* Multi-stone suicide. */
+		int size = lc_group_dead(lb, stride, c, color);
+		if (size)
+			lc_remove(lb, size);
+	}
+	return true;
+}
+
+__device__ static void
+lc_play_random(struct lc_board *lb, const struct light_cuda_position *pos, int color)
+{
+	if (lb->free_n) {
+		int base = lc_random(lb, lb->free_n);
+		for (int k = 0; k < lb->free_n; k++) {
+			int f = base + k < lb->free_n ? base + k : base + k - lb->free_n;
+			if (lc_one_point_eye(lb, pos->stride, lb->free[f], color)
+			    || !lc_play(lb, pos->stride, f, color))
+				continue;
+			lb->passes = 0;
+			return;
+		}
+	}
+
+	if (pos->siming)
+		lb->captures[lc_other(color)]++;
+	lb->ko = LC_PASS;
+	lb->ko_color = S_NONE;
+	lb->passes++;
+}
+
+__global__ static void
+light_cuda_kernel(const struct light_cuda_position *pos, int n, unsigned int seed,
+		  int *results, int (*owner)[S_MAX])
+{
+	int i = blockIdx.x * blockDim.x + threadIdx.x;
+	if (i >= n)
+		return;
+
+	struct lc_board lb;
+	for (int c = 0; c < pos->size2; c++) {
+		lb.at[c] = pos->at[c];
+		lb.mark[c] = 0;
+	}
+	for (int f = 0; f < pos->free_n; f++)
+		lb.free[f] = pos->free[f];
+	lb.free_n = pos->free_n;
+	lb.ko = pos->ko;
+	lb.ko_color = pos->ko_color;
+	for (int s = 0; s < S_MAX; s++)
+		lb.captures[s] = pos->captures[s];
+	lb.passes = pos->passes;
+	lb.rnd = (seed ^ (i * 0x9e3779b9U)) | 1;
+
+	int color = pos->starting_color;
+	for (int gamelen = pos->gamelen; gamelen-- && lb.passes < 2; color = lc_other(color)) {
+		lc_play_random(&lb, pos, color);
+		if (pos->mercymin && abs(lb.captures[S_BLACK] - lb.captures[S_WHITE]) > pos->mercymin)
+			break;
+	}
+
+	/* See lb_score() in light.c. */
+	int scores[S_MAX] = { 0 };
+	for (int c = 0; c < pos->size2; c++) {
+		int color = lb.at[c];
+		if (color == S_OFFBOARD)
+			continue;
+		if (color == S_NONE) {
+			if (lc_one_point_eye(&lb, pos->stride, c, S_WHITE)) color = S_WHITE;
+			else if (lc_one_point_eye(&lb, pos->stride, c, S_BLACK)) color = S_BLACK;
+			if (pos->eyes) scores[color]++;
+		} else {
+			scores[color]++;
+		}
+		atomicAdd(&owner[c][color], 1);
+	}
+	floating_t score = pos->score_base + scores[S_WHITE] - scores[S_BLACK];
+	results[i] = pos->starting_color == S_WHITE ? score * 2 : - (score * 2);
+}
+
+
+/* Per search thread: its stream and buffers. */
+struct light_cuda_stream {
+	int device;
+	cudaStream_t stream;
+	int capacity;
+	struct light_cuda_position *pos, *dpos;
+	int *results, *dresults;
+	int (*owner)[S_MAX], (*downer)[S_MAX];
+};
+
+static __thread struct light_cuda_stream *lcs;
+
+static struct light_cuda_stream *
+light_cuda_stream(int device, int n)
+{
+	if (!lcs) {
+		lcs = (struct light_cuda_stream *) calloc2(1, sizeof(*lcs));
+		lcs->device = device;
+		cuda_check(cudaSetDevice(device));
+		cuda_check(cudaStreamCreateWithFlags(&lcs->stream, cudaStreamNonBlocking));
+		cuda_check(cudaMallocHost((void **) &lcs->pos, sizeof(*lcs->pos)));
+		cuda_check(cudaMalloc((void **) &lcs->dpos, sizeof(*lcs->dpos)));
+		cuda_check(cudaMallocHost((void **) &lcs->owner, BOARD_MAX_COORDS * sizeof(*lcs->owner)));
+		cuda_check(cudaMalloc((void **) &lcs->downer, BOARD_MAX_COORDS * sizeof(*lcs->downer)));
+	}
+	cuda_check(cudaSetDevice(lcs->device));
+	if (n > lcs->capacity) {
+		if (lcs->capacity) {
+			cuda_check(cudaFreeHost(lcs->results));
+			cuda_check(cudaFree(lcs->dresults));
+		}
+		lcs->capacity = n;
+		cuda_check(cudaMallocHost((void **) &lcs->results, n * sizeof(*lcs->results)));
+		cuda_check(cudaMalloc((void **) &lcs->dresults, n * sizeof(*lcs->dresults)));
+	}
+	return lcs;
+}
+
+bool
+light_cuda_init(int device)
+{
+	int count = 0;
+	if (cudaGetDeviceCount(&count) != cudaSuccess || device >= count) {
+		fprintf(stderr, "light_cuda: no gpu %d (%d found)\n", device, count);
+		return false;
+	}
+	struct cudaDeviceProp prop;
+	cuda_check(cudaGetDeviceProperties(&prop, device));
+	if (DEBUGL(2))
+		fprintf(stderr, "light_cuda: playouts on gpu %d (%s)\n", device, prop.name);
+	return true;
+}
+
+void
+light_cuda_batch(int device, struct light_cuda_position *pos, int n, int *results, int (*owner)[S_MAX])
+{
+	struct light_cuda_stream *s = light_cuda_stream(device, n);
+	*s->pos = *pos;
+	size_t owner_size = pos->size2 * sizeof(*s->owner);
+
+	cuda_check(cudaMemcpyAsync(s->dpos, s->pos, sizeof(*s->pos), cudaMemcpyHostToDevice, s->stream));
+	cuda_check(cudaMemsetAsync(s->downer, 0, owner_size, s->stream));
+	unsigned int seed = fast_random(65536) << 16 | fast_random(65536);
+	light_cuda_kernel<<<(n + LC_THREADS - 1) / LC_THREADS, LC_THREADS, 0, s->stream>>>
+		(s->dpos, n, seed, s->dresults, s->downer);
+	cuda_check(cudaGetLastError());
+	cuda_check(cudaMemcpyAsync(s->results, s->dresults, n * sizeof(*s->results), cudaMemcpyDeviceToHost, s->stream));
+	cuda_check(cudaMemcpyAsync(s->owner, s->downer, owner_size, cudaMemcpyDeviceToHost, s->stream));
+	cuda_check(cudaStreamSynchronize(s->stream));
+
+	memcpy(results, s->results, n * sizeof(*results));
+	memcpy(owner, s->owner, owner_size);
+}
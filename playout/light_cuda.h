@@ -0,0 +1,38 @@
+#ifndef PACHI_PLAYOUT_LIGHT_CUDA_H
+#define PACHI_PLAYOUT_LIGHT_CUDA_H
+
+/* Light playouts on the gpu, for the light policy batch routine
+ * (playout=light:gpu). Each gpu thread plays one game out of the
+ * leaf on its own board. Each search thread has its own cuda stream,
+ * so the leaves of all the threads run at once on the gpu while
+ * their threads only wait for their own. Built with PLAYOUT_CUDA. */
+
+#include "board.h"
+#include "stone.h"
+
+/* The start position, as the compact light boards hold it. */
+struct light_cuda_position {
+	unsigned char at[BOARD_MAX_COORDS]; // enum stone
+	coord_t free[BOARD_MAX_COORDS];
+	int free_n;
+	coord_t ko;
+	int ko_color;
+	int captures[S_MAX];
+	int passes;
+
+	int stride, size2;
+	enum stone starting_color;
+	int gamelen, mercymin;
+	bool siming, eyes;
+	/* Score of an empty board, komi and handicap. */
+	floating_t score_base;
+};
+
+/* Returns false if gpu @device can't be used. */
+bool light_cuda_init(int device);
+/* Run @n playouts from @pos on gpu @device, storing results as
+ * play_random_game() would in @results and counting the final owner
+ * of each point into @owner. Blocks the calling thread only. */
+void light_cuda_batch(int device, struct light_cuda_position *pos, int n, int *results, int (*owner)[S_MAX]);
+
+#endif
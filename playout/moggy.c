@@ -12,6 +12,7 @@
 #include "joseki/base.h"
 #include "mq.h"
 #include "pattern3.h"
+#include "perfstats.h"
 #include "playout.h"
 #include "playout/moggy.h"
 #include "random.h"
@@ -52,8 +53,6 @@ enum mq_tag {
 };
 
 
-#define PAT3_N 15
-
 /* Note that the context can be shared by multiple threads! */
 
 struct moggy_policy {
@@ -87,6 +86,12 @@ struct moggy_policy {
 	/* nlib settings: */
 	int nlib_count;
 
+	/* Positions kept in the per-thread assess cache (0 disables it),
+	 * and how many points a position may differ from a cached one
+	 * to reuse its group assessments. */
+	int assess_cache;
+	int assess_diff;
+
 	struct joseki_dict *jdict;
 	struct pattern3s patterns;
 
@@ -105,7 +110,7 @@ struct moggy_state {
 	coord_t last_selfatari[S_MAX];
 };
 
-static char moggy_patterns_src[PAT3_N][11] = {
+char moggy_patterns_src[PAT3_N][11] = {
 	/* hane pattern - enclosing hane */	/* 0.52 */
 	"XOX"
 	"..."
@@ -185,6 +190,27 @@ static char moggy_patterns_src[PAT3_N][11] = {
 };
 #define moggy_patterns_src_n sizeof(moggy_patterns_src) / sizeof(moggy_patterns_src[0])
 
+/* Default 3x3 pattern gammas tuned on 15x15 with 500s/game on
+ * i7-3770 single thread using 40000 CLOP games. */
+const double moggy_pat3_gammas[PAT3_N] = {
+	0.52, 0.53, 0.32, 0.22, 0.37, 0.28, 0.21, 0.19, 0.82,
+	0.12, 0.20, 0.11, 0.16, 0.57, 0.44
+};
+
+/* Check that a 3x3 pattern move is not obviously stupid. */
+static inline bool
+pattern3_move_sane(struct board *b, struct move *m, bool middle_ladder)
+{
+	if (is_bad_selfatari(b, m->color, m->coord))
+		return false;
+	/* Ladder moves are stupid. */
+	group_t atari_neighbor = board_get_atari_neighbor(b, m->coord, m->color);
+	if (atari_neighbor && is_ladder(b, m->coord, atari_neighbor, middle_ladder)
+	    && !can_countercapture(b, atari_neighbor, NULL, 0))
+		return false;
+	return true;
+}
+
 static inline bool
 test_pattern3_here(struct playout_policy *p, struct board *b, struct move *m, bool middle_ladder, double *gamma)
 {
@@ -194,12 +220,7 @@ test_pattern3_here(struct playout_policy *p, struct board *b, struct move *m, bo
 	if (!pattern3_move_here(&pp->patterns, b, m, &pi))
 		return false;
 	/* ...and the move is not obviously stupid. */
-	if (is_bad_selfatari(b, m->color, m->coord))
-		return false;
-	/* Ladder moves are stupid. */
-	group_t atari_neighbor = board_get_atari_neighbor(b, m->coord, m->color);
-	if (atari_neighbor && is_ladder(b, m->coord, atari_neighbor, middle_ladder)
-	    && !can_countercapture(b, atari_neighbor, NULL, 0))
+	if (!pattern3_move_sane(b, m, middle_ladder))
 		return false;
 	//fprintf(stderr, "%s: %d (%.3f)\n", coord2sstr(m->coord, b), (int) pi, pp->pat3_gammas[(int) pi]);
 	if (gamma)
@@ -207,39 +228,50 @@ test_pattern3_here(struct playout_policy *p, struct board *b, struct move *m, bo
 	return true;
 }
 
+/* Match patterns at the empty 8-neighbors of @coord, except those also
+ * 8-adjecent to @skip. The pattern codes of all neighbors are looked up
+ * in one tight pass first; only the few matches go through the costly
+ * validity, self-atari and ladder checks. */
 static void
-apply_pattern_here(struct playout_policy *p, struct board *b, coord_t c, enum stone color, struct move_queue *q, fixp_t *gammas)
+apply_pattern_around(struct playout_policy *p, struct board *b, coord_t coord, coord_t skip, enum stone color, struct move_gamma_queue *gq)
 {
 	struct moggy_policy *pp = p->data;
-	struct move m2 = { .coord = c, .color = color };
-	double gamma;
-	if (board_is_valid_move(b, &m2) && test_pattern3_here(p, b, &m2, pp->middle_ladder, &gamma)) {
-		mq_gamma_add(q, gammas, c, gamma, 1<<MQ_PAT3);
+	coord_t cand[8];
+	char idx[8];
+	int n = 0;
+
+	foreach_8neighbor(b, coord) {
+		if (board_at(b, c) != S_NONE)
+			continue;
+		if (!is_pass(skip) && coord_is_8adjecent(skip, c, b))
+			continue;
+		struct move m2 = { .coord = c, .color = color };
+		if (pattern3_move_here(&pp->patterns, b, &m2, &idx[n]))
+			cand[n++] = c;
+	} foreach_8neighbor_end;
+
+	for (int i = 0; i < n; i++) {
+		struct move m2 = { .coord = cand[i], .color = color };
+		if (board_is_valid_move(b, &m2) && pattern3_move_sane(b, &m2, pp->middle_ladder))
+			mq_gamma_add(gq, cand[i], pp->pat3_gammas[(int) idx[i]], 1<<MQ_PAT3);
 	}
 }
 
 /* Check if we match any pattern around given move (with the other color to play). */
 static void
-apply_pattern(struct playout_policy *p, struct board *b, struct move *m, struct move *mm, struct move_queue *q, fixp_t *gammas)
+apply_pattern(struct playout_policy *p, struct board *b, struct move *m, struct move *mm, struct move_gamma_queue *gq)
 {
 	/* Suicides do not make any patterns and confuse us. */
 	if (board_at(b, m->coord) == S_NONE || board_at(b, m->coord) == S_OFFBOARD)
 		return;
 
-	foreach_8neighbor(b, m->coord) {
-		apply_pattern_here(p, b, c, stone_other(m->color), q, gammas);
-	} foreach_8neighbor_end;
+	apply_pattern_around(p, b, m->coord, pass, stone_other(m->color), gq);
 
-	if (mm) { /* Second move for pattern searching */
-		foreach_8neighbor(b, mm->coord) {
-			if (coord_is_8adjecent(m->coord, c, b))
-				continue;
-			apply_pattern_here(p, b, c, stone_other(m->color), q, gammas);
-		} foreach_8neighbor_end;
-	}
+	if (mm) /* Second move for pattern searching */
+		apply_pattern_around(p, b, mm->coord, m->coord, stone_other(m->color), gq);
 
 	if (PLDEBUGL(5))
-		mq_gamma_print(q, gammas, b, "Pattern");
+		mq_gamma_print(gq, b, "Pattern");
 }
 
 
@@ -251,8 +283,7 @@ joseki_check(struct playout_policy *p, struct board *b, enum stone to_play, stru
 		return;
 
 	for (int i = 0; i < 4; i++) {
-		hash_t h = b->qhash[i] & joseki_hash_mask;
-		coord_t *cc = pp->jdict->patterns[h].moves[to_play];
+		coord_t *cc = joseki_moves(pp->jdict, b->qhash[i], to_play);
 		if (!cc) continue;
 		for (; !is_pass(*cc); cc++) {
 			if (coord_quadrant(*cc, b) != i)
@@ -584,6 +615,12 @@ eye_fix_check(struct playout_policy *p, struct board *b, struct move *m, enum st
 static coord_t
 fillboard_check(struct playout_policy *p, struct board *b)
 {
+#ifdef BOARD_EMPTY3
+	/* The board keeps them: no need to hunt. */
+	if (b->e3len)
+		return b->e3[fast_random(b->e3len)];
+	return pass;
+#else
 	struct moggy_policy *pp = p->data;
 	unsigned int fbtries = b->flen / 8;
 	if (pp->fillboardtries < fbtries)
@@ -602,10 +639,41 @@ next_try:
 		;
 	}
 	return pass;
+#endif
 }
 
-static coord_t
-playout_moggy_seqchoose(struct playout_policy *p, struct playout_setup *s, struct board *b, enum stone to_play)
+/* seqchoose heuristics, for the compile-time specialized variants
+ * of the move picker. */
+enum moggy_heur {
+	MH_KO = 1 << 0,
+	MH_LADDER = 1 << 1,
+	MH_ATARI = 1 << 2,
+	MH_NLIB = 1 << 3,
+	MH_EYEFIX = 1 << 4,
+	MH_NAKADE = 1 << 5,
+	MH_PAT3 = 1 << 6,
+	MH_GATARI = 1 << 7,
+	MH_JOSEKI = 1 << 8,
+	MH_FILLBOARD = 1 << 9,
+};
+
+/* Whether to try heuristic @h of @rate percent. With @h in the
+ * compile-time @off or @always masks, the check folds away. */
+static inline bool __attribute__((always_inline))
+moggy_try(unsigned int rate, enum moggy_heur h, unsigned int off, unsigned int always)
+{
+	if (off & h)
+		return false;
+	if (always & h)
+		return true;
+	return rate > fast_random(100);
+}
+
+/* Heuristics in @off are disabled and these in @always are tried at
+ * each move, whatever their rate; see moggy_variants[] below. */
+static inline coord_t __attribute__((always_inline))
+moggy_seqchoose(struct playout_policy *p, struct playout_setup *s, struct board *b, enum stone to_play,
+		unsigned int off, unsigned int always)
 {
 	struct moggy_policy *pp = p->data;
 	struct moggy_state *ps = b->ps;
@@ -617,9 +685,12 @@ playout_moggy_seqchoose(struct playout_policy *p, struct playout_setup *s, struc
 	/* Ko fight check */
 	if (!is_pass(b->last_ko.coord) && is_pass(b->ko.coord)
 	    && b->moves - b->last_ko_age < pp->koage
-	    && pp->korate > fast_random(100)) {
-		if (board_is_valid_play(b, to_play, b->last_ko.coord)
-		    && !is_bad_selfatari(b, to_play, b->last_ko.coord))
+	    && moggy_try(pp->korate, MH_KO, off, always)) {
+		uint64_t t = perf_start();
+		bool ok = board_is_valid_play(b, to_play, b->last_ko.coord)
+			  && !is_bad_selfatari(b, to_play, b->last_ko.coord);
+		perf_stop_hit(PERF_MOGGY_KO, t, ok);
+		if (ok)
 			return b->last_ko.coord;
 	}
 
@@ -628,15 +699,19 @@ playout_moggy_seqchoose(struct playout_policy *p, struct playout_setup *s, struc
 		/* Local group in atari? */
 		if (true) {  // pp->lcapturerate check in local_atari_check()
 			struct move_queue q; q.moves = 0;
-			if (local_atari_check(p, b, &b->last_move, &q) && 
-			    q.moves > 0)
+			uint64_t t = perf_start();
+			bool ok = local_atari_check(p, b, &b->last_move, &q) && q.moves > 0;
+			perf_stop_hit(PERF_MOGGY_LATARI, t, ok);
+			if (ok)
 				return mq_pick(&q);
 		}
 
 		/* Local group trying to escape ladder? */
-		if (pp->ladderrate > fast_random(100)) {
+		if (moggy_try(pp->ladderrate, MH_LADDER, off, always)) {
 			struct move_queue q; q.moves = 0;
+			uint64_t t = perf_start();
 			local_ladder_check(p, b, &b->last_move, &q);
+			perf_stop_hit(PERF_MOGGY_LADDER, t, q.moves > 0);
 			if (q.moves > 0)
 				return mq_pick(&q);
 		}
@@ -644,80 +719,97 @@ playout_moggy_seqchoose(struct playout_policy *p, struct playout_setup *s, struc
 		/* Did we just reject selfatari move as opponent ?
 		 * Check if his group can be laddered / put in atari */
 		if (ps->last_selfatari[other_color] &&
-		    pp->atarirate > fast_random(100)) {
+		    moggy_try(pp->atarirate, MH_ATARI, off, always)) {
 			struct move_queue q; q.moves = 0;
 			struct move m = { .coord = ps->last_selfatari[other_color], .color = other_color };			
 			ps->last_selfatari[other_color] = 0;  /* Clear */
+			uint64_t t = perf_start();
 			local_2lib_capture_check(p, b, &m, &q);
+			perf_stop_hit(PERF_MOGGY_2LIB, t, q.moves > 0);
 			if (q.moves > 0)
 				return mq_pick(&q);
 		}
 
 		/* Local group can be PUT in atari? */
-		if (pp->atarirate > fast_random(100)) {
+		if (moggy_try(pp->atarirate, MH_ATARI, off, always)) {
 			struct move_queue q; q.moves = 0;
+			uint64_t t = perf_start();
 			local_2lib_check(p, b, &b->last_move, &q);
+			perf_stop_hit(PERF_MOGGY_2LIB, t, q.moves > 0);
 			if (q.moves > 0)
 				return mq_pick(&q);
 		}
 
 		/* Local group reduced some of our groups to 3 libs? */
-		if (pp->nlibrate > fast_random(100)) {
+		if (moggy_try(pp->nlibrate, MH_NLIB, off, always)) {
 			struct move_queue q; q.moves = 0;
+			uint64_t t = perf_start();
 			local_nlib_check(p, b, &b->last_move, &q);
+			perf_stop_hit(PERF_MOGGY_NLIB, t, q.moves > 0);
 			if (q.moves > 0)
 				return mq_pick(&q);
 		}
 
 		/* Some other semeai-ish shape checks */
-		if (pp->eyefixrate > fast_random(100)) {
+		if (moggy_try(pp->eyefixrate, MH_EYEFIX, off, always)) {
 			struct move_queue q; q.moves = 0;
+			uint64_t t = perf_start();
 			eye_fix_check(p, b, &b->last_move, to_play, &q);
+			perf_stop_hit(PERF_MOGGY_EYEFIX, t, q.moves > 0);
 			if (q.moves > 0)
 				return mq_pick(&q);
 		}
 
 		/* Nakade check */
-		if (pp->nakaderate > fast_random(100)
+		if (moggy_try(pp->nakaderate, MH_NAKADE, off, always)
 		    && immediate_liberty_count(b, b->last_move.coord) > 0) {
+			uint64_t t = perf_start();
 			coord_t nakade = nakade_check(p, b, &b->last_move, to_play);
+			perf_stop_hit(PERF_MOGGY_NAKADE, t, !is_pass(nakade));
 			if (!is_pass(nakade))
 				return nakade;
 		}
 
 		/* Check for patterns we know */
-		if (pp->patternrate > fast_random(100)) {
-			struct move_queue q; q.moves = 0;
-			fixp_t gammas[MQL];
+		if (moggy_try(pp->patternrate, MH_PAT3, off, always)) {
+			struct move_gamma_queue gq; mq_gamma_init(&gq);
+			uint64_t t = perf_start();
 			apply_pattern(p, b, &b->last_move,
 			                  pp->pattern2 && b->last_move2.coord >= 0 ? &b->last_move2 : NULL,
-					  &q, gammas);
-			if (q.moves > 0)
-				return mq_gamma_pick(&q, gammas);
+					  &gq);
+			perf_stop_hit(PERF_MOGGY_PAT3, t, gq.q.moves > 0);
+			if (gq.q.moves > 0)
+				return mq_gamma_pick(&gq);
 		}
 	}
 
 	/* Global checks */
 
 	/* Any groups in atari? */
-	if (pp->capturerate > fast_random(100)) {
+	if (moggy_try(pp->capturerate, MH_GATARI, off, always)) {
 		struct move_queue q; q.moves = 0;
+		uint64_t t = perf_start();
 		global_atari_check(p, b, to_play, &q);
+		perf_stop_hit(PERF_MOGGY_GATARI, t, q.moves > 0);
 		if (q.moves > 0)
 			return mq_pick(&q);
 	}
 
 	/* Joseki moves? */
-	if (pp->josekirate > fast_random(100)) {
+	if (moggy_try(pp->josekirate, MH_JOSEKI, off, always)) {
 		struct move_queue q; q.moves = 0;
+		uint64_t t = perf_start();
 		joseki_check(p, b, to_play, &q);
+		perf_stop_hit(PERF_MOGGY_JOSEKI, t, q.moves > 0);
 		if (q.moves > 0)
 			return mq_pick(&q);
 	}
 
 	/* Fill board */
-	if (pp->fillboardtries > 0) {
+	if (!(off & MH_FILLBOARD) && pp->fillboardtries > 0) {
+		uint64_t t = perf_start();
 		coord_t c = fillboard_check(p, b);
+		perf_stop_hit(PERF_MOGGY_FILLBOARD, t, !is_pass(c));
 		if (!is_pass(c))
 			return c;
 	}
@@ -725,6 +817,49 @@ playout_moggy_seqchoose(struct playout_policy *p, struct playout_setup *s, struc
 	return pass;
 }
 
+#define MOGGY_SEQCHOOSE(name, off, always) \
+static coord_t \
+name(struct playout_policy *p, struct playout_setup *s, struct board *b, enum stone to_play) \
+{ \
+	return moggy_seqchoose(p, s, b, to_play, off, always); \
+}
+
+MOGGY_SEQCHOOSE(playout_moggy_seqchoose, 0, 0)
+MOGGY_SEQCHOOSE(playout_moggy_seqchoose_default, MH_FILLBOARD, MH_PAT3 | MH_EYEFIX)
+MOGGY_SEQCHOOSE(playout_moggy_seqchoose_nojoseki, MH_FILLBOARD | MH_JOSEKI, MH_PAT3 | MH_EYEFIX)
+
+/* The specialized seqchoose variants, most specialized first; the first
+ * one matching the configuration is used, see moggy_variant_choose(). */
+static const struct moggy_variant {
+	const char *name;
+	playoutp_choose choose;
+	unsigned int off, always;
+} moggy_variants[] = {
+	{ "nojoseki", playout_moggy_seqchoose_nojoseki, MH_FILLBOARD | MH_JOSEKI, MH_PAT3 | MH_EYEFIX },
+	{ "default", playout_moggy_seqchoose_default, MH_FILLBOARD, MH_PAT3 | MH_EYEFIX },
+	{ "generic", playout_moggy_seqchoose, 0, 0 },
+};
+
+static const struct moggy_variant *
+moggy_variant_choose(struct moggy_policy *pp)
+{
+	struct { unsigned int rate; enum moggy_heur h; } rates[] = {
+		{ pp->korate, MH_KO }, { pp->ladderrate, MH_LADDER }, { pp->atarirate, MH_ATARI },
+		{ pp->nlibrate, MH_NLIB }, { pp->eyefixrate, MH_EYEFIX }, { pp->nakaderate, MH_NAKADE },
+		{ pp->patternrate, MH_PAT3 }, { pp->capturerate, MH_GATARI },
+		{ pp->jdict ? pp->josekirate : 0, MH_JOSEKI }, { pp->fillboardtries ? 100 : 0, MH_FILLBOARD },
+	};
+	unsigned int off = 0, always = 0;
+	for (unsigned int i = 0; i < sizeof(rates) / sizeof(rates[0]); i++) {
+		if (!rates[i].rate) off |= rates[i].h;
+		if (rates[i].rate >= 100) always |= rates[i].h;
+	}
+	const struct moggy_variant *v = moggy_variants;
+	while ((v->off & ~off) || (v->always & ~always))
+		v++;
+	return v;
+}
+
 /* Pick a move from queue q, giving different likelihoods to moves
  * based on their tags. */
 static coord_t
@@ -795,59 +930,88 @@ playout_moggy_fullchoose(struct playout_policy *p, struct playout_setup *s, stru
 	/* Ko fight check */
 	if (pp->korate > 0 && !is_pass(b->last_ko.coord) && is_pass(b->ko.coord)
 	    && b->moves - b->last_ko_age < pp->koage) {
-		if (board_is_valid_play(b, to_play, b->last_ko.coord)
-		    && !is_bad_selfatari(b, to_play, b->last_ko.coord))
+		uint64_t t = perf_start();
+		bool ok = board_is_valid_play(b, to_play, b->last_ko.coord)
+			  && !is_bad_selfatari(b, to_play, b->last_ko.coord);
+		perf_stop_hit(PERF_MOGGY_KO, t, ok);
+		if (ok)
 			mq_add(&q, b->last_ko.coord, 1<<MQ_KO);
 	}
 
 	/* Local checks */
 	if (!is_pass(b->last_move.coord)) {
 		/* Local group in atari? */
-		if (pp->lcapturerate > 0)
+		if (pp->lcapturerate > 0) {
+			unsigned int n = q.moves; uint64_t t = perf_start();
 			local_atari_check(p, b, &b->last_move, &q);
+			perf_stop_hit(PERF_MOGGY_LATARI, t, q.moves > n);
+		}
 
 		/* Local group trying to escape ladder? */
-		if (pp->ladderrate > 0)
+		if (pp->ladderrate > 0) {
+			unsigned int n = q.moves; uint64_t t = perf_start();
 			local_ladder_check(p, b, &b->last_move, &q);
+			perf_stop_hit(PERF_MOGGY_LADDER, t, q.moves > n);
+		}
 
 		/* Local group can be PUT in atari? */
-		if (pp->atarirate > 0)
+		if (pp->atarirate > 0) {
+			unsigned int n = q.moves; uint64_t t = perf_start();
 			local_2lib_check(p, b, &b->last_move, &q);
+			perf_stop_hit(PERF_MOGGY_2LIB, t, q.moves > n);
+		}
 
 		/* Local group reduced some of our groups to 3 libs? */
-		if (pp->nlibrate > 0)
+		if (pp->nlibrate > 0) {
+			unsigned int n = q.moves; uint64_t t = perf_start();
 			local_nlib_check(p, b, &b->last_move, &q);
+			perf_stop_hit(PERF_MOGGY_NLIB, t, q.moves > n);
+		}
 
 		/* Some other semeai-ish shape checks */
-		if (pp->eyefixrate > 0)
+		if (pp->eyefixrate > 0) {
+			unsigned int n = q.moves; uint64_t t = perf_start();
 			eye_fix_check(p, b, &b->last_move, to_play, &q);
+			perf_stop_hit(PERF_MOGGY_EYEFIX, t, q.moves > n);
+		}
 
 		/* Nakade check */
 		if (pp->nakaderate > 0 && immediate_liberty_count(b, b->last_move.coord) > 0) {
+			uint64_t t = perf_start();
 			coord_t nakade = nakade_check(p, b, &b->last_move, to_play);
+			perf_stop_hit(PERF_MOGGY_NAKADE, t, !is_pass(nakade));
 			if (!is_pass(nakade))
 				mq_add(&q, nakade, 1<<MQ_NAKADE);
 		}
 
 		/* Check for patterns we know */
 		if (pp->patternrate > 0) {
-			fixp_t gammas[MQL];
+			struct move_gamma_queue gq; mq_gamma_init(&gq);
+			uint64_t t = perf_start();
 			apply_pattern(p, b, &b->last_move,
 					pp->pattern2 && b->last_move2.coord >= 0 ? &b->last_move2 : NULL,
-					&q, gammas);
+					&gq);
+			perf_stop_hit(PERF_MOGGY_PAT3, t, gq.q.moves > 0);
 			/* FIXME: Use the gammas. */
+			mq_append(&q, &gq.q);
 		}
 	}
 
 	/* Global checks */
 
 	/* Any groups in atari? */
-	if (pp->capturerate > 0)
+	if (pp->capturerate > 0) {
+		unsigned int n = q.moves; uint64_t t = perf_start();
 		global_atari_check(p, b, to_play, &q);
+		perf_stop_hit(PERF_MOGGY_GATARI, t, q.moves > n);
+	}
 
 	/* Joseki moves? */
-	if (pp->josekirate > 0)
+	if (pp->josekirate > 0) {
+		unsigned int n = q.moves; uint64_t t = perf_start();
 		joseki_check(p, b, to_play, &q);
+		perf_stop_hit(PERF_MOGGY_JOSEKI, t, q.moves > n);
+	}
 
 #if 0
 	/* Average length of the queue is 1.4 move. */
@@ -862,7 +1026,9 @@ playout_moggy_fullchoose(struct playout_policy *p, struct playout_setup *s, stru
 
 	/* Fill board */
 	if (pp->fillboardtries > 0) {
+		uint64_t t = perf_start();
 		coord_t c = fillboard_check(p, b);
+		perf_stop_hit(PERF_MOGGY_FILLBOARD, t, !is_pass(c));
 		if (!is_pass(c))
 			return c;
 	}
@@ -871,8 +1037,239 @@ playout_moggy_fullchoose(struct playout_policy *p, struct playout_setup *s, stru
 }
 
 
+/* Per-thread cache of playout_moggy_assess_group() results for the
+ * last few assessed positions. A position with the same hash reuses
+ * all of them; one differing in at most assess_diff points from a
+ * cached one (typically a sibling or a near relative in the tree)
+ * reuses the results of the groups with unchanged liberties whose
+ * base stone and liberties are away from the differences, and reads
+ * out only the rest. Note that the latter is an approximation: far-reaching
+ * tactics (ladder breakers) are not tracked. */
+
+/* Changes within this distance make a group dirty. */
+#define ASSESS_DIRTY_DIST 2
+
+struct assess_prior {
+	coord_t coord;
+	floating_t value;
+	int playouts;
+};
+
+struct assess_group {
+	group_t g;
+	enum stone color;
+	int libs;
+	coord_t lib[GROUP_KEEP_LIBS];
+	int first, n; // range of priors[]
+};
+
+struct assess_slot {
+	struct playout_policy *p;
+	hash_t hash;
+	int size2;
+	enum stone to_play;
+	coord_t ko;
+	int games;
+	unsigned long age;
+	enum stone *stones; // [size2]
+	int *gidx; // [size2], 1 + index to groups[] for group ids, 0 otherwise
+	struct assess_group *groups; int groupsn, groups_alloc;
+	struct assess_prior *priors; int priorsn, priors_alloc;
+};
+
+struct assess_cache {
+	unsigned long age;
+	int slotsn;
+	struct assess_slot slots[];
+};
+static __thread struct assess_cache *assess_cache;
+
+static inline void
+assess_add(struct prior_map *map, struct assess_slot *rec, coord_t coord, floating_t value, int playouts)
+{
+	add_prior_value(map, coord, value, playouts);
+	if (!rec)
+		return;
+	if (rec->priorsn == rec->priors_alloc) {
+		rec->priors_alloc = rec->priors_alloc ? rec->priors_alloc * 2 : 64;
+		rec->priors = realloc2(rec->priors, rec->priors_alloc * sizeof(*rec->priors));
+	}
+	rec->priors[rec->priorsn++] = (struct assess_prior) { coord, value, playouts };
+}
+
 static void
-playout_moggy_assess_group(struct playout_policy *p, struct prior_map *map, group_t g, int games)
+assess_slot_reset(struct assess_slot *s, struct playout_policy *p, struct prior_map *map, int games)
+{
+	struct board *b = map->b;
+	if (s->size2 != board_size2(b)) {
+		s->size2 = board_size2(b);
+		s->stones = realloc2(s->stones, s->size2 * sizeof(*s->stones));
+		s->gidx = realloc2(s->gidx, s->size2 * sizeof(*s->gidx));
+		memset(s->gidx, 0, s->size2 * sizeof(*s->gidx));
+		s->groupsn = 0;
+	}
+	s->p = p;
+	s->hash = board_position_hash(b);
+	s->to_play = map->to_play;
+	s->ko = b->ko.coord;
+	s->games = games;
+	s->age = ++assess_cache->age;
+	memcpy(s->stones, b->b, s->size2 * sizeof(*s->stones));
+	for (int i = 0; i < s->groupsn; i++)
+		s->gidx[s->groups[i].g] = 0;
+	s->groupsn = s->priorsn = 0;
+}
+
+/* Start recording group g into s. */
+static struct assess_group *
+assess_slot_group(struct assess_slot *s, struct board *b, group_t g)
+{
+	if (s->groupsn == s->groups_alloc) {
+		s->groups_alloc = s->groups_alloc ? s->groups_alloc * 2 : 32;
+		s->groups = realloc2(s->groups, s->groups_alloc * sizeof(*s->groups));
+	}
+	struct assess_group *ag = &s->groups[s->groupsn];
+	s->gidx[g] = ++s->groupsn;
+	ag->g = g;
+	ag->color = board_at(b, g);
+	ag->libs = board_group_info(b, g).libs;
+	memcpy(ag->lib, board_group_info(b, g).lib, sizeof(ag->lib));
+	ag->first = s->priorsn;
+	return ag;
+}
+
+/* Whether group g was assessed in ref in the same state. */
+static bool
+assess_group_match(struct assess_slot *ref, struct board *b, group_t g, bool *dirty)
+{
+	if (!ref->gidx[g] || dirty[g])
+		return false;
+	struct assess_group *ag = &ref->groups[ref->gidx[g] - 1];
+	struct group *gi = &board_group_info(b, g);
+	if (ag->color != board_at(b, g) || ag->libs != gi->libs)
+		return false;
+	int libs = gi->libs < GROUP_KEEP_LIBS ? gi->libs : GROUP_KEEP_LIBS;
+	for (int i = 0; i < libs; i++)
+		if (ag->lib[i] != gi->lib[i] || dirty[gi->lib[i]])
+			return false;
+	return true;
+}
+
+/* Find the cached position closest to the board; returns the number
+ * of differing points in *diff, or NULL if none is within assess_diff. */
+static struct assess_slot *
+assess_cache_find(struct playout_policy *p, struct prior_map *map, int games, int *diff)
+{
+	struct moggy_policy *pp = p->data;
+	struct board *b = map->b;
+	hash_t hash = board_position_hash(b);
+	struct assess_slot *best = NULL;
+	int best_diff = pp->assess_diff + 1;
+
+	for (int i = 0; i < assess_cache->slotsn; i++) {
+		struct assess_slot *s = &assess_cache->slots[i];
+		if (s->p != p || s->size2 != board_size2(b) || s->to_play != map->to_play
+		    || s->ko != b->ko.coord || s->games != games)
+			continue;
+		if (hash && s->hash == hash) {
+			*diff = 0;
+			return s;
+		}
+		/* Compare in blocks, most of the board is the same. */
+		int d = 0;
+		for (coord_t c0 = 0; c0 < s->size2 && d < best_diff; c0 += 8) {
+			int n = s->size2 - c0 < 8 ? s->size2 - c0 : 8;
+			if (!memcmp(&s->stones[c0], &b->b[c0], n * sizeof(*s->stones)))
+				continue;
+			for (coord_t c = c0; c < c0 + n; c++)
+				d += s->stones[c] != board_at(b, c);
+		}
+		if (d < best_diff) {
+			best = s;
+			best_diff = d;
+		}
+	}
+	*diff = best_diff;
+	return best;
+}
+
+static void
+assess_replay(struct prior_map *map, struct assess_slot *ref, struct assess_group *ag, struct assess_slot *rec)
+{
+	for (int i = ag->first; i < ag->first + ag->n; i++)
+		assess_add(map, rec, ref->priors[i].coord, ref->priors[i].value, ref->priors[i].playouts);
+}
+
+static void playout_moggy_assess_group(struct playout_policy *p, struct prior_map *map, group_t g, int games,
+                                       struct assess_slot *rec);
+
+static void
+playout_moggy_assess_groups(struct playout_policy *p, struct prior_map *map, int games)
+{
+	struct moggy_policy *pp = p->data;
+	struct board *b = map->b;
+
+	if (unlikely(!assess_cache || assess_cache->slotsn != pp->assess_cache)) {
+		/* The slots leak when the option changes; it never does
+		 * in practice. */
+		assess_cache = calloc2(1, sizeof(*assess_cache) + pp->assess_cache * sizeof(assess_cache->slots[0]));
+		assess_cache->slotsn = pp->assess_cache;
+	}
+
+	int diff;
+	struct assess_slot *ref = assess_cache_find(p, map, games, &diff);
+	if (ref && !diff) {
+		/* Same position, just replay everything. */
+		for (int i = 0; i < ref->groupsn; i++)
+			assess_replay(map, ref, &ref->groups[i], NULL);
+		ref->age = ++assess_cache->age;
+		return;
+	}
+
+	bool dirty[board_size2(b)];
+	memset(dirty, 0, sizeof(dirty));
+	if (ref) {
+		foreach_point(b) {
+			if (ref->stones[c] == board_at(b, c))
+				continue;
+			int x = coord_x(c, b), y = coord_y(c, b);
+			for (int dy = -ASSESS_DIRTY_DIST; dy <= ASSESS_DIRTY_DIST; dy++)
+				for (int dx = -ASSESS_DIRTY_DIST; dx <= ASSESS_DIRTY_DIST; dx++) {
+					if (abs(dx) + abs(dy) > ASSESS_DIRTY_DIST)
+						continue;
+					int x2 = x + dx, y2 = y + dy;
+					if (x2 >= 0 && x2 < board_size(b) && y2 >= 0 && y2 < board_size(b))
+						dirty[coord_xy(b, x2, y2)] = true;
+				}
+		} foreach_point_end;
+	}
+
+	/* Record into the least recently used slot. */
+	struct assess_slot *rec = NULL;
+	for (int i = 0; i < assess_cache->slotsn; i++) {
+		struct assess_slot *s = &assess_cache->slots[i];
+		if (s != ref && (!rec || s->age < rec->age))
+			rec = s;
+	}
+	if (rec)
+		assess_slot_reset(rec, p, map, games);
+
+	for (group_t g = 1; g < board_size2(b); g++) {
+		if (group_at(b, g) != g || board_group_info(b, g).libs > pp->nlib_count)
+			continue;
+		struct assess_group *ag = rec ? assess_slot_group(rec, b, g) : NULL;
+		if (ref && assess_group_match(ref, b, g, dirty))
+			assess_replay(map, ref, &ref->groups[ref->gidx[g] - 1], rec);
+		else
+			playout_moggy_assess_group(p, map, g, games, rec);
+		if (ag)
+			ag->n = rec->priorsn - ag->first;
+	}
+}
+
+static void
+playout_moggy_assess_group(struct playout_policy *p, struct prior_map *map, group_t g, int games,
+                           struct assess_slot *rec)
 {
 	struct moggy_policy *pp = p->data;
 	struct board *b = map->b;
@@ -897,7 +1294,7 @@ playout_moggy_assess_group(struct playout_policy *p, struct prior_map *map, grou
 			if (PLDEBUGL(5))
 				fprintf(stderr, "1.0: nlib %s\n", coord2sstr(coord, b));
 			int assess = games / 2;
-			add_prior_value(map, coord, 1, assess);
+			assess_add(map, rec, coord, 1, assess);
 		}
 		return;
 	}
@@ -911,7 +1308,7 @@ playout_moggy_assess_group(struct playout_policy *p, struct prior_map *map, grou
 				coord_t chase = board_group_info(b, g).lib[i];
 				coord_t escape = board_group_info(b, g).lib[1 - i];
 				if (wouldbe_ladder(b, g, escape, chase, board_at(b, g))) {
-					add_prior_value(map, chase, 1, games);
+					assess_add(map, rec, chase, 1, games);
 					ladderable = true;
 				}
 			}
@@ -927,7 +1324,7 @@ playout_moggy_assess_group(struct playout_policy *p, struct prior_map *map, grou
 			if (PLDEBUGL(5))
 				fprintf(stderr, "1.0: 2lib %s\n", coord2sstr(coord, b));
 			int assess = games / 2;
-			add_prior_value(map, coord, 1, assess);
+			assess_add(map, rec, coord, 1, assess);
 		}
 		return;
 	}
@@ -953,7 +1350,7 @@ playout_moggy_assess_group(struct playout_policy *p, struct prior_map *map, grou
 			 * captures another group. */
 			if (PLDEBUGL(5))
 				fprintf(stderr, "0.0: ladder %s\n", coord2sstr(coord, b));
-			add_prior_value(map, coord, 0, games);
+			assess_add(map, rec, coord, 0, games);
 			continue;
 		}
 
@@ -967,7 +1364,7 @@ playout_moggy_assess_group(struct playout_policy *p, struct prior_map *map, grou
 		}
 		if (PLDEBUGL(5))
 			fprintf(stderr, "1.0 (%d): atari %s\n", assess, coord2sstr(coord, b));
-		add_prior_value(map, coord, 1, assess);
+		assess_add(map, rec, coord, 1, assess);
 	}
 }
 
@@ -1022,9 +1419,13 @@ playout_moggy_assess(struct playout_policy *p, struct prior_map *map, int games)
 	struct moggy_policy *pp = p->data;
 
 	/* First, go through all endangered groups. */
-	for (group_t g = 1; g < board_size2(map->b); g++)
-		if (group_at(map->b, g) == g)
-			playout_moggy_assess_group(p, map, g, games);
+	if (pp->assess_cache) {
+		playout_moggy_assess_groups(p, map, games);
+	} else {
+		for (group_t g = 1; g < board_size2(map->b); g++)
+			if (group_at(map->b, g) == g)
+				playout_moggy_assess_group(p, map, g, games, NULL);
+	}
 
 	/* Then, assess individual moves. */
 	if (!pp->patternrate && !pp->selfatarirate)
@@ -1181,6 +1582,9 @@ playout_moggy_init(char *arg, struct board *b, struct joseki_dict *jdict)
 	pp->atari_miaisafe = true;
 	pp->nlib_count = 4;
 
+	pp->assess_cache = 0;
+	pp->assess_diff = 6;
+
 	/* C is stupid. */
 	double mq_prob_default[MQ_MAX] = {
 		[MQ_KO] = 6.0,
@@ -1194,13 +1598,7 @@ playout_moggy_init(char *arg, struct board *b, struct joseki_dict *jdict)
 	};
 	memcpy(pp->mq_prob, mq_prob_default, sizeof(pp->mq_prob));
 
-	/* Default 3x3 pattern gammas tuned on 15x15 with 500s/game on
-	 * i7-3770 single thread using 40000 CLOP games. */
-	double pat3_gammas_default[PAT3_N] = {
-		0.52, 0.53, 0.32, 0.22, 0.37, 0.28, 0.21, 0.19, 0.82,
-		0.12, 0.20, 0.11, 0.16, 0.57, 0.44
-	};
-	memcpy(pp->pat3_gammas, pat3_gammas_default, sizeof(pp->pat3_gammas));
+	memcpy(pp->pat3_gammas, moggy_pat3_gammas, sizeof(pp->pat3_gammas));
 
 	if (arg) {
 		char *optspec, *next = arg;
@@ -1287,6 +1685,13 @@ playout_moggy_init(char *arg, struct board *b, struct joseki_dict *jdict)
 					optval += strcspn(optval, "%");
 					if (*optval) optval++;
 				}
+			} else if (!strcasecmp(optname, "assesscache") && optval) {
+				/* Number of positions in the assess cache */
+				pp->assess_cache = atoi(optval);
+			} else if (!strcasecmp(optname, "assessdiff") && optval) {
+				/* Max differing points for partial reuse;
+				 * 0 = reuse only for identical positions */
+				pp->assess_diff = atoi(optval);
 			} else if (!strcasecmp(optname, "tenukiprob") && optval) {
 				pp->tenuki_prob = atof(optval);
 			} else {
@@ -1311,5 +1716,12 @@ playout_moggy_init(char *arg, struct board *b, struct joseki_dict *jdict)
 
 	pattern3s_init(&pp->patterns, moggy_patterns_src, moggy_patterns_src_n);
 
+	if (p->choose == playout_moggy_seqchoose) {
+		const struct moggy_variant *v = moggy_variant_choose(pp);
+		if (DEBUGL(3))
+			fprintf(stderr, "moggy: %s seqchoose\n", v->name);
+		p->choose = v->choose;
+	}
+
 	return p;
 }
@@ -7,4 +7,10 @@ struct joseki_dict;
 
 struct playout_policy *playout_moggy_init(char *arg, struct board *b, struct joseki_dict *jdict);
 
+/* The 3x3 patterns matched by moggy (in pattern3s_init() format)
+ * and their default gammas; the gamma policy shares them. */
+#define PAT3_N 15
+extern char moggy_patterns_src[PAT3_N][11];
+extern const double moggy_pat3_gammas[PAT3_N];
+
 #endif
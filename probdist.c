@@ -18,38 +18,56 @@ probdist_pick(struct probdist *restrict pd, coord_t *restrict ignore)
 	if (DEBUGL(6))
 		fprintf(stderr, "stab %f / %f\n", fixp_to_double(stab), fixp_to_double(total));
 
-	int r = 1;
-	coord_t c = board_size(pd->b) + 1;
-	while (stab > pd->rowtotals[r]) {
-		if (DEBUGL(6))
-			fprintf(stderr, "[%s] skipping row %f (%f)\n", coord2sstr(c, pd->b), fixp_to_double(pd->rowtotals[r]), fixp_to_double(stab));
-
-		stab -= pd->rowtotals[r];
-		r++; assert(r < board_size(pd->b));
+	/* Descend the tree, looking for the first item whose partial
+	 * sum exceeds stab; zero-valued and muted items are thus never
+	 * picked. */
+	int i = 0;
+	for (int step = pd->top; step > 0; step >>= 1) {
+		if (i + step <= pd->n && pd->tree[i + step] <= stab) {
+			i += step;
+			stab -= pd->tree[i];
+		}
+	}
+	coord_t c = i;
 
-		c += board_size(pd->b);
-		while (!is_pass(*ignore) && *ignore <= c)
-			ignore++;
+	if (DEBUGL(6))
+		fprintf(stderr, "[%s] %f (%f)\n", coord2sstr(c, pd->b), fixp_to_double(pd->items[c]), fixp_to_double(stab));
+	if (c >= pd->n) {
+		fprintf(stderr, "overstab %f (total %f)\n", fixp_to_double(stab), fixp_to_double(total));
+		assert(0);
+		return -1;
 	}
+#ifndef NDEBUG
+	while (!is_pass(*ignore) && *ignore < c)
+		ignore++;
+	assert(*ignore != c);
+#endif
+	return c;
+}
 
-	for (; c < board_size2(pd->b); c++) {
-		if (DEBUGL(6))
-			fprintf(stderr, "[%s] %f (%f)\n", coord2sstr(c, pd->b), fixp_to_double(pd->items[c]), fixp_to_double(stab));
+void
+probdist_set_many(struct probdist *restrict pd, coord_t *restrict c, fixp_t *restrict val, int n)
+{
+	/* Updating the tree item by item costs O(log bsize2) each;
+	 * past ~1/8 of the board, rebuilding it from scratch in O(bsize2)
+	 * is cheaper. */
+	if (n * 8 < pd->n) {
+		for (int i = 0; i < n; i++)
+			probdist_set(pd, c[i], val[i]);
+		return;
+	}
 
-		assert(is_pass(*ignore) || c <= *ignore);
-		if (c == *ignore) {
-			if (DEBUGL(6))
-				fprintf(stderr, "\tignored\n");
-			ignore++;
-			continue;
-		}
+	for (int i = 0; i < n; i++)
+		pd->items[c[i]] = val[i];
 
-		if (stab <= pd->items[c])
-			return c;
-		stab -= pd->items[c];
+	pd->total = 0;
+	for (int i = 1; i <= pd->n; i++) {
+		pd->tree[i] = pd->items[i - 1];
+		pd->total += pd->items[i - 1];
+	}
+	for (int i = 1; i <= pd->n; i++) {
+		int j = i + (i & -i);
+		if (j <= pd->n)
+			pd->tree[j] += pd->tree[i];
 	}
-
-	fprintf(stderr, "overstab %f (total %f)\n", fixp_to_double(stab), fixp_to_double(total));
-	assert(0);
-	return -1;
 }
@@ -18,8 +18,11 @@ struct board;
 
 struct probdist {
 	struct board *b;
+	int n; // board_size2(b)
+	int top; // highest power of two <= n
 	fixp_t *items; // [bsize2], [i] = P(pick==i)
-	fixp_t *rowtotals; // [bsize], [i] = sum of items in row i
+	fixp_t *tree; // [bsize2+1], Fenwick tree of partial sums; [i]
+	              // covers items (i - (i & -i)) .. i - 1
 	fixp_t total; // sum of all items
 };
 
@@ -27,8 +30,9 @@ struct probdist {
 /* Declare pd_ corresponding to board b_ in the local scope. */
 #define probdist_alloca(pd_, b_) \
 	fixp_t pd_ ## __pdi[board_size2(b_)] __attribute__((aligned(32))); memset(pd_ ## __pdi, 0, sizeof(pd_ ## __pdi)); \
-	fixp_t pd_ ## __pdr[board_size(b_)] __attribute__((aligned(32))); memset(pd_ ## __pdr, 0, sizeof(pd_ ## __pdr)); \
-	struct probdist pd_ = { .b = b_, .items = pd_ ## __pdi, .rowtotals = pd_ ## __pdr, .total = 0 };
+	fixp_t pd_ ## __pdt[board_size2(b_) + 1] __attribute__((aligned(32))); memset(pd_ ## __pdt, 0, sizeof(pd_ ## __pdt)); \
+	struct probdist pd_ = { .b = b_, .n = board_size2(b_), .top = probdist_top(board_size2(b_)), \
+	                        .items = pd_ ## __pdi, .tree = pd_ ## __pdt, .total = 0 };
 
 /* Get the value of given item. */
 #define probdist_one(pd, c) ((pd)->items[c])
@@ -36,16 +40,25 @@ struct probdist {
 /* Get the cummulative probability value (normalizing constant). */
 #define probdist_total(pd) ((pd)->total)
 
-/* Set the value of given item. */
+/* Set the value of given item. O(log bsize2). */
 static void probdist_set(struct probdist *pd, coord_t c, fixp_t val);
 
+/* Set the values of n items at once. When a large part of the board
+ * changes, this rebuilds the tree in a single linear pass instead
+ * of updating it item by item. Must not be used while some items
+ * are muted. */
+void probdist_set_many(struct probdist *pd, coord_t *c, fixp_t *val, int n);
+
 /* Remove the item from the totals; this is used when you then
  * pass it in the ignore list to probdist_pick(). Of course you
- * must restore the totals afterwards. */
+ * must restore the totals afterwards, using probdist_unmute(). */
 static void probdist_mute(struct probdist *pd, coord_t c);
+static void probdist_unmute(struct probdist *pd, coord_t c);
 
 /* Pick a random item. ignore is a pass-terminated sorted array of items
- * that are not to be considered (and whose values are not in @total). */
+ * that are not to be considered (and whose values are not in @total).
+ * Since muted items do not contribute to the tree, the list is only
+ * checked by assertions. O(log bsize2). */
 coord_t probdist_pick(struct probdist *pd, coord_t *ignore);
 
 
@@ -54,6 +67,24 @@ coord_t probdist_pick(struct probdist *pd, coord_t *ignore);
 #include "board.h"
 
 
+static inline int
+probdist_top(int n)
+{
+	int top = 1;
+	while (top * 2 <= n)
+		top *= 2;
+	return top;
+}
+
+/* Add delta (possibly "negative", modulo fixp_t) to the partial sums
+ * covering item c. */
+static inline void
+probdist_tree_add(struct probdist *pd, coord_t c, fixp_t delta)
+{
+	for (int i = c + 1; i <= pd->n; i += i & -i)
+		pd->tree[i] += delta;
+}
+
 static inline void
 probdist_set(struct probdist *pd, coord_t c, fixp_t val)
 {
@@ -64,8 +95,9 @@ probdist_set(struct probdist *pd, coord_t c, fixp_t val)
 	assert(c >= 0 && c < board_size2(pd->b));
 	assert(val >= 0);
 #endif
-	pd->total += val - pd->items[c];
-	pd->rowtotals[coord_y(c, pd->b)] += val - pd->items[c];
+	fixp_t delta = val - pd->items[c];
+	pd->total += delta;
+	probdist_tree_add(pd, c, delta);
 	pd->items[c] = val;
 }
 
@@ -73,7 +105,14 @@ static inline void
 probdist_mute(struct probdist *pd, coord_t c)
 {
 	pd->total -= pd->items[c];
-	pd->rowtotals[coord_y(c, pd->b)] -= pd->items[c];
+	probdist_tree_add(pd, c, -pd->items[c]);
+}
+
+static inline void
+probdist_unmute(struct probdist *pd, coord_t c)
+{
+	pd->total += pd->items[c];
+	probdist_tree_add(pd, c, pd->items[c]);
 }
 
 #endif
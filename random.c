@@ -1,41 +1,130 @@
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "random.h"
 
 
-/* Simple Park-Miller for floating point; LCG as used in glibc and other places */
+/* xoshiro256++ (Blackman & Vigna), run as several interleaved lanes
+ * so that the refill loop vectorizes. Each lane is a separate stream,
+ * jump()ed 2^128 steps apart from the previous one; each thread stream
+ * is long_jump()ed 2^192 steps apart. The generated numbers are
+ * consumed 16 bits at a time from a small per-thread buffer. */
 
-#ifndef NO_THREAD_LOCAL
+#define RNG_LANES 4
+#define RNG_STEPS 4
+#define RNG_BUF (RNG_LANES * RNG_STEPS * 4) // 16-bit chunks
 
-static __thread unsigned long pmseed = 29264;
+struct fast_rng {
+	uint64_t s[4][RNG_LANES]; // [word][lane]
+	uint16_t buf[RNG_BUF];
+	int pos; // number of unused chunks in buf
+	unsigned long seed;
+	bool seeded;
+};
 
-void
-fast_srandom(unsigned long seed_)
+static inline uint64_t
+rotl(uint64_t x, int k)
 {
-	pmseed = seed_;
+	return (x << k) | (x >> (64 - k));
 }
 
-unsigned long
-fast_getseed(void)
+static inline uint64_t
+splitmix64(uint64_t *x)
 {
-	return pmseed;
+	uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
 }
 
-uint16_t
-fast_random(unsigned int max)
+static inline uint64_t
+xoshiro_next(uint64_t s[4])
 {
-	pmseed = ((pmseed * 1103515245) + 12345) & 0x7fffffff;
-	return ((pmseed & 0xffff) * max) >> 16;
+	uint64_t result = rotl(s[0] + s[3], 23) + s[0];
+	uint64_t t = s[1] << 17;
+	s[2] ^= s[0]; s[3] ^= s[1];
+	s[1] ^= s[2]; s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = rotl(s[3], 45);
+	return result;
 }
 
-float
-fast_frandom(void)
+/* Advance s by the polynomial given in poly, i.e. 2^128 steps for
+ * the jump and 2^192 steps for the long jump. */
+static void
+xoshiro_jump(uint64_t s[4], const uint64_t poly[4])
+{
+	uint64_t j[4] = { 0, 0, 0, 0 };
+	for (int i = 0; i < 4; i++)
+		for (int b = 0; b < 64; b++) {
+			if (poly[i] & (1ULL << b))
+				for (int w = 0; w < 4; w++)
+					j[w] ^= s[w];
+			xoshiro_next(s);
+		}
+	memcpy(s, j, sizeof(j));
+}
+
+static const uint64_t jump_poly[4] = {
+	0x180ec6d33cfd0abaULL, 0xd5a61266f0c9392cULL, 0xa9582618e03fc9aaULL, 0x39abdc4529b1661cULL };
+static const uint64_t long_jump_poly[4] = {
+	0x76e15d3efefdcbbfULL, 0xc5004e441c522fb3ULL, 0x77710069854ee241ULL, 0x39109bb02acbe635ULL };
+
+static void
+rng_seed(struct fast_rng *r, unsigned long seed, int stream)
+{
+	uint64_t x = seed, s[4];
+	for (int w = 0; w < 4; w++)
+		s[w] = splitmix64(&x);
+	for (int i = 0; i < stream; i++)
+		xoshiro_jump(s, long_jump_poly);
+
+	for (int l = 0; l < RNG_LANES; l++) {
+		for (int w = 0; w < 4; w++)
+			r->s[w][l] = s[w];
+		xoshiro_jump(s, jump_poly);
+	}
+	r->pos = 0;
+	r->seed = seed;
+	r->seeded = true;
+}
+
+static void __attribute__((noinline))
+rng_refill(struct fast_rng *r)
+{
+	if (unlikely(!r->seeded))
+		rng_seed(r, 29264UL, 0);
+
+	uint64_t out[RNG_STEPS][RNG_LANES];
+	for (int i = 0; i < RNG_STEPS; i++) {
+		/* The lanes are independent; this is xoshiro_next()
+		 * over all of them at once. */
+		for (int l = 0; l < RNG_LANES; l++) {
+			uint64_t s0 = r->s[0][l], s1 = r->s[1][l], s2 = r->s[2][l], s3 = r->s[3][l];
+			out[i][l] = rotl(s0 + s3, 23) + s0;
+			uint64_t t = s1 << 17;
+			s2 ^= s0; s3 ^= s1;
+			s1 ^= s2; s0 ^= s3;
+			s2 ^= t;
+			s3 = rotl(s3, 45);
+			r->s[0][l] = s0; r->s[1][l] = s1; r->s[2][l] = s2; r->s[3][l] = s3;
+		}
+	}
+	memcpy(r->buf, out, sizeof(r->buf));
+	r->pos = RNG_BUF;
+}
+
+
+#ifndef NO_THREAD_LOCAL
+
+static __thread struct fast_rng rng_tls;
+
+static inline struct fast_rng *
+rng_get(void)
 {
-	/* Construct (1,2) IEEE floating_t from our random integer */
-	/* http://rgba.org/articles/sfrand/sfrand.htm */
-	union { unsigned long ul; floating_t f; } p;
-	p.ul = (((pmseed *= 16807) & 0x007fffff) - 1) | 0x3f800000;
-	return p.f - 1.0f;
+	return &rng_tls;
 }
 
 #else
@@ -45,47 +134,75 @@ fast_frandom(void)
 
 #include <pthread.h>
 
-static pthread_key_t seed_key;
+#include "util.h"
+
+static pthread_key_t rng_key;
 
 static void __attribute__((constructor))
 random_init(void)
 {
-	pthread_key_create(&seed_key, NULL);
-	fast_srandom(29264UL);
+	pthread_key_create(&rng_key, free);
+}
+
+static inline struct fast_rng *
+rng_get(void)
+{
+	struct fast_rng *r = pthread_getspecific(rng_key);
+	if (unlikely(!r)) {
+		r = calloc2(1, sizeof(*r));
+		pthread_setspecific(rng_key, r);
+	}
+	return r;
 }
 
+#endif
+
+
 void
 fast_srandom(unsigned long seed_)
 {
-	pthread_setspecific(seed_key, (void *)seed_);
+	rng_seed(rng_get(), seed_, 0);
+}
+
+void
+fast_srandom_stream(unsigned long seed_, int stream)
+{
+	rng_seed(rng_get(), seed_, stream);
 }
 
 unsigned long
 fast_getseed(void)
 {
-	return (unsigned long)pthread_getspecific(seed_key);
+	struct fast_rng *r = rng_get();
+	return r->seeded ? r->seed : 29264UL;
+}
+
+static inline uint16_t
+rng_chunk(struct fast_rng *r)
+{
+	if (unlikely(r->pos == 0))
+		rng_refill(r);
+	return r->buf[--r->pos];
 }
 
 uint16_t
 fast_random(unsigned int max)
 {
-	unsigned long pmseed = (unsigned long)pthread_getspecific(seed_key);
-	pmseed = ((pmseed * 1103515245) + 12345) & 0x7fffffff;
-	pthread_setspecific(seed_key, (void *)pmseed);
-	return ((pmseed & 0xffff) * max) >> 16;
+	return (rng_chunk(rng_get()) * max) >> 16;
+}
+
+uint32_t
+fast_irandom(unsigned int max)
+{
+	struct fast_rng *r = rng_get();
+	uint32_t x = ((uint32_t) rng_chunk(r) << 16) | rng_chunk(r);
+	return ((uint64_t) x * max) >> 32;
 }
 
 float
 fast_frandom(void)
 {
-	/* Construct (1,2) IEEE floating_t from our random integer */
-	/* http://rgba.org/articles/sfrand/sfrand.htm */
-	unsigned long pmseed = (unsigned long)pthread_getspecific(seed_key);
-	pmseed *= 16807;
-	union { unsigned long ul; floating_t f; } p;
-	p.ul = ((pmseed & 0x007fffff) - 1) | 0x3f800000;
-	pthread_setspecific(seed_key, (void *)pmseed);
-	return p.f - 1.0f;
+	struct fast_rng *r = rng_get();
+	uint32_t x = ((uint32_t) rng_chunk(r) << 8) | (rng_chunk(r) >> 8);
+	return x * (1.0f / (1 << 24));
 }
-
-#endif
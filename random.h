@@ -6,25 +6,18 @@
 #include "util.h"
 
 void fast_srandom(unsigned long seed);
+/* Seed the calling thread with its own stream derived from seed;
+ * threads using different stream numbers never overlap, and the same
+ * (seed, stream) pair always reproduces the same sequence. */
+void fast_srandom_stream(unsigned long seed, int stream);
 unsigned long fast_getseed(void);
 
 /* Note that only 16bit numbers can be returned. */
 uint16_t fast_random(unsigned int max);
 /* Use this one if you want larger numbers. */
-static uint32_t fast_irandom(unsigned int max);
+uint32_t fast_irandom(unsigned int max);
 
 /* Get random number in [0..1] range. */
 float fast_frandom();
 
-
-static inline uint32_t
-fast_irandom(unsigned int max)
-{
-	if (max <= 65536)
-		return fast_random(max);
-	int himax = (max - 1) / 65536;
-	uint16_t hi = fast_random(himax + 1);
-	return ((uint32_t)hi << 16) | fast_random(hi < himax ? 65536 : max % 65536);
-}
-
 #endif
@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -7,8 +8,11 @@
 #include "debug.h"
 #include "engine.h"
 #include "move.h"
+#include "perfstats.h"
 #include "playout.h"
+#include "random.h"
 #include "joseki/base.h"
+#include "playout/gamma.h"
 #include "playout/light.h"
 #include "playout/moggy.h"
 #include "replay/replay.h"
@@ -18,6 +22,8 @@ struct replay {
 	int debug_level;
 	int runs;
 	int no_suicide;
+	int threads;
+	bool profile;
 	struct joseki_dict *jdict;
 	struct playout_policy *playout;
 };
@@ -32,34 +38,126 @@ suicide_stats(int suicide)
 		fprintf(stderr, "Suicides: %i/%i (%i%%)\n", suicides, total, suicides * 100 / total);
 }
 
-coord_t
-replay_sample_moves(struct engine *e, struct board *b, enum stone color, 
-		    int *played, int *pmost_played)
+/* The runs are split evenly among the threads, each counting the
+ * moves played in its own array, summed at the end. */
+struct replay_thread {
+	struct replay *r;
+	struct board *b;
+	enum stone color;
+	int runs;
+	int tid;
+	unsigned long seed;
+	int *played;
+};
+
+static void *
+replay_thread_sample(void *data)
 {
-	struct replay *r = e->data;
-	struct playout_policy *policy = r->playout;
+	struct replay_thread *th = data;
+	struct playout_policy *policy = th->r->playout;
 	struct playout_setup setup;	        memset(&setup, 0, sizeof(setup));
-	struct move m = { .coord = pass, .color = color };
-	int most_played = 0;
-	
-	/* Find out what moves policy plays most in this situation */
-        for (int i = 0; i < r->runs; i++) {
+	if (th->tid > 0)
+		fast_srandom_stream(th->seed, th->tid);
+
+	for (int i = 0; i < th->runs; i++) {
 		struct board b2;
-		board_copy(&b2, b);
+		board_copy(&b2, th->b);
 		
 		if (policy->setboard)
 			policy->setboard(policy, &b2);
 		
 		if (DEBUGL(4))  fprintf(stderr, "---------------------------------\n");		
-		coord_t c = play_random_move(&setup, &b2, color, r->playout);		
+		coord_t c = play_random_move(&setup, &b2, th->color, policy);		
 		if (DEBUGL(4))  fprintf(stderr, "-> %s\n", coord2sstr(c, &b2));
 		
-		played[c]++;
+		th->played[c]++;
+		board_done_noalloc(&b2);
+	}
+	return NULL;
+}
+
+/* Where the policy time goes: for each heuristic, how often it was
+ * tried, how often it found a move (which is then played, except with
+ * fullchoose, where the candidates of all heuristics are picked from)
+ * and its share of the playout move time. */
+static void
+replay_profile_print(struct perf_counters *sum)
+{
+	double total = sum->ticks[PERF_PLAYOUT_MOVE];
+	uint64_t moves = sum->count[PERF_PLAYOUT_MOVE];
+	if (!moves || !total)
+		return;
+	fprintf(stderr, "%-15s %9s %7s %10s %6s\n", "heuristic", "tried", "hits", "ticks/try", "time");
+	for (int p = PERF_MOGGY_KO; p < PERF_MAX; p++) {
+		if (!sum->count[p])
+			continue;
+		fprintf(stderr, "%-15s %9llu %6.1f%% %10llu %5.1f%%\n",
+			perf_probe_names[p] + strlen("moggy_"), (unsigned long long) sum->count[p],
+			sum->hits[p] * 100.0 / sum->count[p],
+			(unsigned long long) (sum->ticks[p] / sum->count[p]),
+			sum->ticks[p] * 100 / total);
+	}
+	/* The fallback hits are its share of the moves. */
+	int p = PERF_PLAYOUT_RANDOM;
+	fprintf(stderr, "%-15s %9llu %6.1f%% %10llu %5.1f%%\n",
+		"random", (unsigned long long) sum->count[p],
+		sum->count[p] * 100.0 / moves,
+		(unsigned long long) (sum->count[p] ? sum->ticks[p] / sum->count[p] : 0),
+		sum->ticks[p] * 100 / total);
+	fprintf(stderr, "%-15s %9llu %7s %10llu %5.1f%%\n\n",
+		"move", (unsigned long long) moves, "",
+		(unsigned long long) (total / moves), 100.0);
+}
+
+coord_t
+replay_sample_moves(struct engine *e, struct board *b, enum stone color, 
+		    int *played, int *pmost_played)
+{
+	struct replay *r = e->data;
+	struct move m = { .coord = pass, .color = color };
+	int most_played = 0;
+
+	bool perf_was_enabled = perf_enabled;
+	if (r->profile) {
+		perf_enabled = true;
+		perf_reset();
+	}
+
+	/* Find out what moves policy plays most in this situation */
+	int threads = r->threads;
+	struct replay_thread th[threads];
+	unsigned long seed = threads > 1 ? fast_irandom(~0U) : 0;
+	for (int t = 0; t < threads; t++) {
+		th[t] = (struct replay_thread) {
+			.r = r, .b = b, .color = color, .tid = t, .seed = seed,
+			.runs = r->runs / threads + (t < r->runs % threads),
+			/* Allow storing pass/resign. */
+			.played = (int *) calloc2(board_size2(b) + 2, sizeof(int)) + 2,
+		};
+	}
+	/* A single thread samples in the engine thread. */
+	pthread_t thread[threads];
+	for (int t = 1; t < threads; t++)
+		pthread_create(&thread[t], NULL, replay_thread_sample, &th[t]);
+	replay_thread_sample(&th[0]);
+	for (int t = 1; t < threads; t++)
+		pthread_join(thread[t], NULL);
+
+	for (int t = 0; t < threads; t++) {
+		for (coord_t c = resign; c < board_size2(b); c++)
+			played[c] += th[t].played[c];
+		free(th[t].played - 2);
+	}
+	for (coord_t c = resign; c < board_size2(b); c++)
 		if (played[c] > most_played) {
-			most_played++;  m.coord = c;
+			most_played = played[c];  m.coord = c;
 		}
 
-		board_done_noalloc(&b2);
+	if (r->profile) {
+		struct perf_counters sum;
+		perf_sum(&sum);
+		perf_enabled = perf_was_enabled;
+		replay_profile_print(&sum);
 	}
 	
 	*pmost_played = most_played;
@@ -127,6 +225,7 @@ replay_state_init(char *arg, struct board *b)
 	r->debug_level = 1;
 	r->runs = 1000;
 	r->no_suicide = 0;
+	r->threads = 1;
 	r->jdict = joseki_load(b->size);
 	
 	if (arg) {
@@ -153,6 +252,19 @@ replay_state_init(char *arg, struct board *b)
 				/* ensure engine doesn't allow group suicides
 				 * (off by default) */
 				r->no_suicide = 1;
+			} else if (!strcasecmp(optname, "threads") && optval) {
+				/* threads=n  sample the runs in n threads */
+				r->threads = atoi(optval);
+				if (r->threads < 1) {
+					fprintf(stderr, "Replay: threads must be positive\n");
+					exit(1);
+				}
+			} else if (!strcasecmp(optname, "profile")) {
+				/* profile  report the playout policy heuristics
+				 * tried for the sampled moves, how often they
+				 * found a move and their time (see perfstats.h;
+				 * this resets the pachi-perfstats counters) */
+				r->profile = true;
 			} else if (!strcasecmp(optname, "playout") && optval) {
 				char *playoutarg = strchr(optval, ':');
 				if (playoutarg)
@@ -161,6 +273,8 @@ replay_state_init(char *arg, struct board *b)
 					r->playout = playout_moggy_init(playoutarg, b, r->jdict);
 				} else if (!strcasecmp(optval, "light")) {
 					r->playout = playout_light_init(playoutarg, b);
+				} else if (!strcasecmp(optval, "gamma")) {
+					r->playout = playout_gamma_init(playoutarg, b);
 				} else {
 					fprintf(stderr, "Replay: Invalid playout policy %s\n", optval);
 				}
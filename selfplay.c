@@ -0,0 +1,212 @@
+/* Self-play game generator, see selfplay.h. */
+
+#define DEBUG
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "board.h"
+#include "debug.h"
+#include "engine.h"
+#include "fbook.h"
+#include "gtp.h"
+#include "selfplay.h"
+#include "timeinfo.h"
+#include "util.h"
+#include "version.h"
+
+struct selfplay_opts {
+	int games;
+	int size;
+	floating_t komi;
+	int maxmoves;
+	int candidates;
+	char *out;
+};
+
+struct selfplay_totals {
+	int games;
+	int moves;
+	int wins[S_MAX];
+};
+
+
+/* SGF point of @c, empty for pass. */
+static char *
+sgf_point(coord_t c, struct board *b, char *buf)
+{
+	if (is_pass(c)) {
+		buf[0] = 0;
+	} else {
+		buf[0] = 'a' + coord_x(c, b) - 1;
+		buf[1] = 'a' + board_size(b) - 2 - coord_y(c, b);
+		buf[2] = 0;
+	}
+	return buf;
+}
+
+/* One move of the game, appended to @sgf. Returns the move,
+ * resign included. */
+static coord_t
+selfplay_move(struct selfplay_opts *o, struct board *b, struct engine *e,
+	      struct time_info *ti, enum stone color, FILE *sgf)
+{
+	if (!ti[color].len.t.timer_start)
+		time_start_timer(&ti[color]);
+
+	coord_t c = fbook_check(b);
+	bool searched = false;
+	if (is_pass(c)) {
+		coord_t *cp = e->genmove(e, b, &ti[color], color, false);
+		c = *cp;
+		coord_done(cp);
+		searched = true;
+	}
+	if (is_resign(c))
+		return c;
+
+	struct move m = { c, color };
+	if (board_play(b, &m) < 0) {
+		fprintf(stderr, "Attempted to generate an illegal move: [%s, %s]\n", coord2sstr(m.coord, b), stone2str(m.color));
+		abort();
+	}
+	if (ti[color].period != TT_NULL && ti[color].dim == TD_WALLTIME)
+		time_sub(&ti[color], time_now() - ti[color].len.t.timer_start, true);
+
+	char p[3];
+	fprintf(sgf, ";%c[%s]", color == S_BLACK ? 'B' : 'W', sgf_point(c, b, p));
+	if (searched && e->root_stats) {
+		coord_t coords[o->candidates];
+		int visits[o->candidates];
+		int n = e->root_stats(e, coords, visits, o->candidates);
+		if (n > 0)
+			fputs("VS", sgf);
+		for (int i = 0; i < n; i++)
+			fprintf(sgf, "[%s:%d]", sgf_point(coords[i], b, p), visits[i]);
+	}
+	return c;
+}
+
+static void
+selfplay_game(struct selfplay_setup *setup, struct selfplay_opts *o, struct board *b,
+	      FILE *f, struct selfplay_totals *totals)
+{
+	board_resize(b, o->size);
+	board_clear(b);
+	b->komi = o->komi;
+	struct engine *e = setup->init_engine(b, setup->data);
+	struct time_info ti[S_MAX];
+	ti[S_BLACK] = setup->ti_default;
+	ti[S_WHITE] = setup->ti_default;
+
+	char *moves;
+	size_t moves_len;
+	FILE *sgf = open_memstream(&moves, &moves_len);
+
+	char result[64] = "";
+	enum stone color = S_BLACK;
+	int n = 0, passes = 0;
+	while (n < o->maxmoves && passes < 2) {
+		coord_t c = selfplay_move(o, b, e, ti, color, sgf);
+		if (is_resign(c)) {
+			snprintf(result, sizeof(result), "%c+R", color == S_BLACK ? 'W' : 'B');
+			break;
+		}
+		passes = is_pass(c) ? passes + 1 : 0;
+		color = stone_other(color);
+		n++;
+	}
+	fclose(sgf);
+	if (!*result)
+		gtp_final_score(b, e, result, sizeof(result));
+
+	fprintf(f, "(;GM[1]FF[4]CA[UTF-8]AP[Pachi:%s]SZ[%d]KM[%.1f]PB[Pachi]PW[Pachi]RE[%s]%s)\n",
+		PACHI_VERNUMS, o->size, b->komi, result, moves);
+	fflush(f);
+	free(moves);
+
+	totals->games++;
+	totals->moves += n;
+	if (result[0] == 'B' || result[0] == 'W')
+		totals->wins[result[0] == 'B' ? S_BLACK : S_WHITE]++;
+	if (DEBUGL(1))
+		fprintf(stderr, "selfplay game %d: %s in %d moves\n", totals->games, result, n);
+
+	b->es = NULL;
+	engine_done(e);
+}
+
+int
+selfplay(struct selfplay_setup *setup, char *arg)
+{
+	struct selfplay_opts o = { .games = 1, .size = BOARD_MAX_SIZE, .komi = 7.5, .maxmoves = 0, .candidates = BOARD_MAX_MOVES + 1 };
+
+	if (arg) {
+		char *optspec, *next = arg;
+		while (*next) {
+			optspec = next;
+			next += strcspn(next, ",");
+			if (*next) { *next++ = 0; } else { *next = 0; }
+
+			char *optname = optspec;
+			char *optval = strchr(optspec, '=');
+			if (optval) *optval++ = 0;
+
+			if (!strcasecmp(optname, "games") && optval) {
+				o.games = atoi(optval);
+			} else if (!strcasecmp(optname, "size") && optval) {
+				o.size = atoi(optval);
+			} else if (!strcasecmp(optname, "komi") && optval) {
+				o.komi = atof(optval);
+			} else if (!strcasecmp(optname, "maxmoves") && optval) {
+				/* Score the game after this many moves. */
+				o.maxmoves = atoi(optval);
+			} else if (!strcasecmp(optname, "candidates") && optval) {
+				/* Record the visits of this many most
+				 * searched moves at most. */
+				o.candidates = atoi(optval);
+			} else if (!strcasecmp(optname, "out") && optval) {
+				/* Append the games to this file. */
+				o.out = optval;
+			} else {
+				fprintf(stderr, "selfplay: Invalid argument %s or missing value\n", optname);
+				exit(1);
+			}
+		}
+	}
+	if (o.size < 2 || o.size > BOARD_MAX_SIZE || o.candidates < 1) {
+		fprintf(stderr, "selfplay: Invalid size or candidates\n");
+		exit(1);
+	}
+	if (!o.maxmoves)
+		o.maxmoves = 3 * o.size * o.size;
+
+	FILE *f = stdout;
+	if (o.out && !(f = fopen(o.out, "a"))) {
+		perror(o.out);
+		exit(1);
+	}
+
+	struct board *b = board_init(setup->fbookfile);
+	if (setup->ruleset && !board_set_rules(b, setup->ruleset)) {
+		fprintf(stderr, "Unknown ruleset: %s\n", setup->ruleset);
+		exit(1);
+	}
+
+	struct selfplay_totals totals = { 0 };
+	double start = time_now();
+	for (int i = 0; i < o.games; i++)
+		selfplay_game(setup, &o, b, f, &totals);
+
+	if (DEBUGL(0)) {
+		double time = time_now() - start + 0.000001;
+		fprintf(stderr, "selfplay: %d games, %d moves in %0.1fs (%0.2f moves/s), black %d white %d\n",
+			totals.games, totals.moves, time, totals.moves / time,
+			totals.wins[S_BLACK], totals.wins[S_WHITE]);
+	}
+	board_done(b);
+	if (f != stdout)
+		fclose(f);
+	return 0;
+}
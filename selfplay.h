@@ -0,0 +1,35 @@
+#ifndef PACHI_SELFPLAY_H
+#define PACHI_SELFPLAY_H
+
+/* Self-play game generator (-e selfplay): the engine plays both sides
+ * of many games in one process, and each game is written as a line of
+ * SGF with the root visit counts of every searched move in a VS[]
+ * property, e.g. ;B[pd]VS[pd:1204][dp:310][qp:95]. Moves from the
+ * fbook carry no VS[].
+ *
+ * Read-only resources (dictionaries, fbook, DCNN) are loaded once, and
+ * each game gets a fresh engine. As in the -M server, the search is
+ * process-wide: the games run one after another, each genmove using
+ * the whole thread pool of the engine (threads=N engine argument). */
+
+#include "timeinfo.h"
+
+struct board;
+struct engine;
+
+struct selfplay_setup {
+	char *fbookfile;
+	char *ruleset;
+	struct time_info ti_default;
+	/* Create the engine of a game. */
+	struct engine *(*init_engine)(struct board *b, void *data);
+	void *data;
+};
+
+/* Play the games. @arg: comma-separated games=N, size=N, komi=K,
+ * maxmoves=N (scored after that many moves), candidates=N (largest
+ * visit distributions recorded), out=FILE (stdout by default);
+ * may be NULL. */
+int selfplay(struct selfplay_setup *setup, char *arg);
+
+#endif
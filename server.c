@@ -0,0 +1,345 @@
+/* Multi-game GTP server, see server.h. */
+
+#define DEBUG
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "board.h"
+#include "debug.h"
+#include "engine.h"
+#include "gtp.h"
+#include "metrics.h"
+#include "network.h"
+#include "server.h"
+#include "timeinfo.h"
+#include "util.h"
+
+#define SESSION_BUF 4096
+
+struct gtp_session {
+	int fd;
+	int id; // for logging
+	struct board *b;
+	struct engine *e;
+	struct time_info ti[S_MAX];
+	/* The lag of the peer, see struct time_lag. */
+	struct time_lag lag;
+
+	/* Input received but not processed yet. */
+	char buf[SESSION_BUF];
+	int len;
+	/* The peer will send no more input. */
+	bool eof;
+	/* When did this session run a command last (in commands
+	 * served by the whole server). */
+	unsigned long served;
+	/* When the first command in buf got complete. */
+	double line_time;
+
+	/* Throughput of the game: playouts searched for it (own
+	 * pondering included), time spent in its genmoves, and the
+	 * longest time a command of it waited for the others. */
+	double playouts, search_time, max_wait;
+	int genmoves;
+};
+
+
+static struct gtp_session *
+session_open(struct gtp_server_setup *setup, int fd, int id)
+{
+	struct gtp_session *s = calloc2(1, sizeof(*s));
+	s->fd = fd;
+	s->id = id;
+	s->b = board_init(setup->fbookfile);
+	if (setup->ruleset)
+		board_set_rules(s->b, setup->ruleset);
+	s->ti[S_BLACK] = setup->ti_default;
+	s->ti[S_WHITE] = setup->ti_default;
+	s->ti[S_BLACK].lag = s->ti[S_WHITE].lag = &s->lag;
+	s->e = setup->init_engine(s->b, setup->data);
+	return s;
+}
+
+static void
+session_close(struct gtp_session *s)
+{
+	close(s->fd);
+	s->b->es = NULL;
+	engine_done(s->e);
+	board_done(s->b);
+	free(s);
+}
+
+/* Length of the first complete command in the input, or 0. */
+static int
+session_line(struct gtp_session *s)
+{
+	char *nl = memchr(s->buf, '\n', s->len);
+	if (nl)
+		return nl - s->buf + 1;
+	/* Overlong line or last line without newline; fgets()
+	 * in the single-game loop would return these too. */
+	if (s->len == SESSION_BUF || (s->eof && s->len > 0))
+		return s->len;
+	return 0;
+}
+
+/* The color to play if the first command of the session is a genmove,
+ * S_NONE otherwise. */
+static enum stone
+session_genmove_color(struct gtp_session *s, int len)
+{
+	char line[SESSION_BUF + 1];
+	memcpy(line, s->buf, len);
+	line[len] = 0;
+
+	char *cmd = line + strspn(line, " \t");
+	if (isdigit(*cmd)) {
+		cmd += strspn(cmd, "0123456789");
+		cmd += strspn(cmd, " \t");
+	}
+	if (strncasecmp(cmd, "genmove", 7)
+	    && strncasecmp(cmd, "kgs-genmove_cleanup", 19)
+	    && strncasecmp(cmd, "pachi-genmoves", 14))
+		return S_NONE;
+
+	char *arg = cmd + strcspn(cmd, " \t\r\n");
+	arg += strspn(arg, " \t");
+	return str2stone(arg);
+}
+
+/* How urgent the first command of the session is, lower runs first.
+ * Commands other than genmove are cheap and run right away (-1);
+ * genmoves run in order of their deadline, the time left for the move
+ * on the clock of the player to move, which may be running already. */
+static double
+session_urgency(struct gtp_session *s, int len, double now)
+{
+	enum stone color = session_genmove_color(s, len);
+	if (color == S_NONE)
+		return -1; // including bad colors, let gtp_parse() complain
+
+	struct time_info *ti = &s->ti[color];
+	if (ti->period == TT_NULL || ti->dim != TD_WALLTIME)
+		return INFINITY;
+	double left = ti->len.t.main_time;
+	if (ti->len.t.byoyomi_time > 0)
+		left += ti->len.t.byoyomi_time / (ti->len.t.byoyomi_stones > 0 ? ti->len.t.byoyomi_stones : 1);
+	if (ti->len.t.timer_start > 0)
+		left -= now - ti->len.t.timer_start;
+	/* Negative would make it cheap. */
+	return left > 0 ? left : 0;
+}
+
+/* The clocks started by a command count from when the command arrived,
+ * not from when it got its turn to run. */
+static void
+session_backdate_timers(struct gtp_session *s, double *before, double arrived)
+{
+	for (enum stone c = S_BLACK; c <= S_WHITE; c++) {
+		struct time_info *ti = &s->ti[c];
+		if (ti->period == TT_NULL || ti->dim != TD_WALLTIME)
+			continue;
+		if (ti->len.t.timer_start != before[c] && ti->len.t.timer_start > arrived)
+			ti->len.t.timer_start = arrived;
+	}
+}
+
+/* Run the first command of the session; its replies go to the peer.
+ * @genmove_color is the color of a genmove command, S_NONE for other
+ * commands. */
+static void
+session_run(struct gtp_server_setup *setup, struct gtp_session *s, int out, enum stone genmove_color)
+{
+	char buf[SESSION_BUF + 1];
+	int len = session_line(s);
+	memcpy(buf, s->buf, len);
+	buf[len] = 0;
+	s->len -= len;
+	memmove(s->buf, s->buf + len, s->len);
+
+	double start = time_now();
+	double arrived = s->line_time;
+	/* The next one arrived by the last read at the latest. */
+	s->line_time = start;
+	if (start - arrived > s->max_wait)
+		s->max_wait = start - arrived;
+
+	if (DEBUGL(1))
+		fprintf(stderr, "IN %d: %s", s->id, buf);
+
+	double before[S_MAX] = { 0 };
+	for (enum stone c = S_BLACK; c <= S_WHITE; c++)
+		if (s->ti[c].period != TT_NULL && s->ti[c].dim == TD_WALLTIME)
+			before[c] = s->ti[c].len.t.timer_start;
+	/* A genmove which waited started running out of time when it
+	 * arrived, if the clock was not running already. */
+	struct time_info *gti = genmove_color != S_NONE ? &s->ti[genmove_color] : NULL;
+	if (gti && gti->period != TT_NULL && gti->dim == TD_WALLTIME && !gti->len.t.timer_start)
+		gti->len.t.timer_start = before[genmove_color] = arrived;
+	double playouts = metric_get(M_PLAYOUTS);
+
+	/* gtp_parse() replies on stdout. */
+	fflush(stdout);
+	if (dup2(s->fd, STDOUT_FILENO) < 0) {
+		perror("dup2");
+		exit(1);
+	}
+	enum parse_code c = gtp_parse(s->b, s->e, s->ti, buf);
+	fflush(stdout);
+	dup2(out, STDOUT_FILENO);
+
+	session_backdate_timers(s, before, arrived);
+	s->playouts += metric_get(M_PLAYOUTS) - playouts;
+	if (genmove_color != S_NONE) {
+		double time = time_now() - start;
+		s->genmoves++;
+		s->search_time += time;
+		if (DEBUGL(2))
+			fprintf(stderr, "game %d: genmove in %.2fs after waiting %.3fs\n", s->id, time, start - arrived);
+	}
+
+	if (c == P_ENGINE_RESET) {
+		s->ti[S_BLACK] = setup->ti_default;
+		s->ti[S_WHITE] = setup->ti_default;
+		s->ti[S_BLACK].lag = s->ti[S_WHITE].lag = &s->lag;
+		if (!s->e->keep_on_clear) {
+			s->b->es = NULL;
+			engine_done(s->e);
+			s->e = setup->init_engine(s->b, setup->data);
+		}
+	} else if (c == P_UNKNOWN_COMMAND || c == P_QUIT) {
+		/* As in the single-game -g mode, an unknown command
+		 * means a wrong peer; drop the connection. */
+		s->eof = true;
+		s->len = 0;
+	}
+}
+
+
+void
+gtp_serve(struct gtp_server_setup *setup)
+{
+	/* A peer going away while we reply must not take down
+	 * all the other games. */
+	signal(SIGPIPE, SIG_IGN);
+
+	int out = dup(STDOUT_FILENO);
+	int sock = port_listen(setup->port, setup->max_games);
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+	if (DEBUGL(0))
+		fprintf(stderr, "serving up to %d games on port %s\n", setup->max_games, setup->port);
+
+	struct gtp_session **sessions = calloc2(setup->max_games, sizeof(*sessions));
+	int n = 0, ids = 0;
+	/* The session whose engine may be pondering. */
+	struct gtp_session *active = NULL;
+	unsigned long served = 0;
+
+	for (;;) {
+		/* Drop finished sessions once all their commands ran. */
+		for (int i = 0; i < n; i++) {
+			struct gtp_session *s = sessions[i];
+			if (!s->eof || session_line(s))
+				continue;
+			if (DEBUGL(0))
+				fprintf(stderr, "game %d closed: %d genmoves, %.0f playouts in %.1fs (%.0f/s), longest wait %.3fs\n",
+					s->id, s->genmoves, s->playouts, s->search_time,
+					s->search_time > 0 ? s->playouts / s->search_time : 0, s->max_wait);
+			if (active == s)
+				active = NULL;
+			session_close(s);
+			sessions[i--] = sessions[--n];
+		}
+
+		/* Wait for input unless some command is ready to run. */
+		bool ready = false;
+		struct pollfd fds[setup->max_games + 1];
+		fds[0].fd = sock;
+		fds[0].events = POLLIN;
+		for (int i = 0; i < n; i++) {
+			ready |= session_line(sessions[i]) > 0;
+			fds[i + 1].fd = sessions[i]->eof || sessions[i]->len == SESSION_BUF ? -1 : sessions[i]->fd;
+			fds[i + 1].events = POLLIN;
+		}
+		int nfds = n + 1;
+		if (poll(fds, nfds, ready ? 0 : -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			exit(1);
+		}
+
+		for (int i = 0; i < nfds - 1; i++) {
+			if (!fds[i + 1].revents)
+				continue;
+			struct gtp_session *s = sessions[i];
+			bool had_line = session_line(s) > 0;
+			ssize_t r = read(s->fd, s->buf + s->len, SESSION_BUF - s->len);
+			if (r > 0)
+				s->len += r;
+			else if (r == 0 || (errno != EINTR && errno != EAGAIN))
+				s->eof = true;
+			if (!had_line && session_line(s))
+				s->line_time = time_now();
+		}
+
+		if (fds[0].revents & POLLIN) {
+			struct in_addr client;
+			int fd;
+			while ((fd = accept_server_connection(sock, &client)) >= 0) {
+				if (n == setup->max_games) {
+					if (DEBUGL(0))
+						fprintf(stderr, "too many games, refusing %s\n", inet_ntoa(client));
+					close(fd);
+					continue;
+				}
+				sessions[n++] = session_open(setup, fd, ++ids);
+				if (DEBUGL(0))
+					fprintf(stderr, "game %d connected from %s\n", ids, inet_ntoa(client));
+			}
+		}
+
+		/* Pick the most urgent command; ties go to the session
+		 * which waited longest. */
+		struct gtp_session *best = NULL;
+		double best_urgency = INFINITY;
+		double now = time_now();
+		for (int i = 0; i < n; i++) {
+			struct gtp_session *s = sessions[i];
+			int len = session_line(s);
+			if (!len)
+				continue;
+			double urgency = session_urgency(s, len, now);
+			if (!best || urgency < best_urgency
+			    || (urgency == best_urgency && s->served < best->served)) {
+				best = s;
+				best_urgency = urgency;
+			}
+		}
+		if (!best)
+			continue;
+
+		/* The search is process-wide; stop pondering of the
+		 * previous game before running anything else. Its
+		 * workers drop the playouts they are in. */
+		if (active && active != best && active->e->stop) {
+			double playouts = metric_get(M_PLAYOUTS);
+			active->e->stop(active->e);
+			active->playouts += metric_get(M_PLAYOUTS) - playouts;
+		}
+		active = best;
+		best->served = ++served;
+		session_run(setup, best, out, session_genmove_color(best, session_line(best)));
+	}
+}
@@ -0,0 +1,39 @@
+#ifndef PACHI_SERVER_H
+#define PACHI_SERVER_H
+
+/* Multi-game GTP server: many GTP sessions (one game each) multiplexed
+ * over a single process. Every session has its own board, engine and
+ * clocks; read-only resources (spatial and pattern dictionaries,
+ * joseki dictionaries, fbook, DCNN) are loaded once and shared.
+ *
+ * The search itself (thread pool, tree memory manager) is process-wide
+ * in the UCT engine, so commands run one at a time: cheap commands
+ * first, then genmoves earliest deadline first, each genmove getting
+ * the whole thread pool. Clocks count from when a command arrived,
+ * waiting included. Pondering of the last game served yields to the
+ * others within a playout. Throughput of every game is logged when
+ * it closes. */
+
+#include "timeinfo.h"
+
+struct board;
+struct engine;
+
+struct gtp_server_setup {
+	/* Listening port and maximal number of concurrent sessions. */
+	char *port;
+	int max_games;
+
+	/* Template of a new session. */
+	char *fbookfile;
+	char *ruleset;
+	struct time_info ti_default;
+	/* Create the engine of a session, at connection and on reset. */
+	struct engine *(*init_engine)(struct board *b, void *data);
+	void *data;
+};
+
+/* Serve GTP sessions forever. */
+void gtp_serve(struct gtp_server_setup *setup);
+
+#endif
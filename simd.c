@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEBUG
+#include "debug.h"
+#include "simd.h"
+#include "util.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define SIMD_X86
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define SIMD_NEON
+#include <arm_neon.h>
+#endif
+
+/* The kernels compare the stones a vector of 32bit ints at a time. */
+_Static_assert(sizeof(enum stone) == 4, "enum stone is not 32bit");
+
+
+static void
+count_stones_generic(const enum stone *b, int n, int *black, int *white)
+{
+	/* Branchless, so the compiler can vectorize it for the build
+	 * target at least. */
+	int nb = 0, nw = 0;
+	for (int i = 0; i < n; i++) {
+		nb += b[i] == S_BLACK;
+		nw += b[i] == S_WHITE;
+	}
+	*black = nb; *white = nw;
+}
+
+#ifdef SIMD_X86
+
+static void __attribute__((target("avx2")))
+count_stones_avx2(const enum stone *b, int n, int *black, int *white)
+{
+	const __m256i vb = _mm256_set1_epi32(S_BLACK), vw = _mm256_set1_epi32(S_WHITE);
+	/* The matches are -1, so the sums count down. */
+	__m256i sb = _mm256_setzero_si256(), sw = _mm256_setzero_si256();
+	int i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) (b + i));
+		sb = _mm256_sub_epi32(sb, _mm256_cmpeq_epi32(v, vb));
+		sw = _mm256_sub_epi32(sw, _mm256_cmpeq_epi32(v, vw));
+	}
+	int lb[8], lw[8];
+	_mm256_storeu_si256((__m256i *) lb, sb);
+	_mm256_storeu_si256((__m256i *) lw, sw);
+	int nb = 0, nw = 0;
+	for (int j = 0; j < 8; j++) {
+		nb += lb[j]; nw += lw[j];
+	}
+	for (; i < n; i++) {
+		nb += b[i] == S_BLACK;
+		nw += b[i] == S_WHITE;
+	}
+	*black = nb; *white = nw;
+}
+
+static void __attribute__((target("avx512f,popcnt")))
+count_stones_avx512(const enum stone *b, int n, int *black, int *white)
+{
+	const __m512i vb = _mm512_set1_epi32(S_BLACK), vw = _mm512_set1_epi32(S_WHITE);
+	int nb = 0, nw = 0;
+	int i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m512i v = _mm512_loadu_si512(b + i);
+		nb += __builtin_popcount(_mm512_cmpeq_epi32_mask(v, vb));
+		nw += __builtin_popcount(_mm512_cmpeq_epi32_mask(v, vw));
+	}
+	if (i < n) {
+		/* The tail in one masked load. */
+		__mmask16 m = (1U << (n - i)) - 1;
+		__m512i v = _mm512_maskz_loadu_epi32(m, b + i);
+		nb += __builtin_popcount(_mm512_mask_cmpeq_epi32_mask(m, v, vb));
+		nw += __builtin_popcount(_mm512_mask_cmpeq_epi32_mask(m, v, vw));
+	}
+	*black = nb; *white = nw;
+}
+
+#endif
+
+#ifdef SIMD_NEON
+
+static void
+count_stones_neon(const enum stone *b, int n, int *black, int *white)
+{
+	const uint32x4_t vb = vdupq_n_u32(S_BLACK), vw = vdupq_n_u32(S_WHITE);
+	/* The matches are all ones, so the sums count down. */
+	uint32x4_t sb = vdupq_n_u32(0), sw = vdupq_n_u32(0);
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		uint32x4_t v = vld1q_u32((const uint32_t *) (b + i));
+		sb = vsubq_u32(sb, vceqq_u32(v, vb));
+		sw = vsubq_u32(sw, vceqq_u32(v, vw));
+	}
+	int nb = vaddvq_u32(sb), nw = vaddvq_u32(sw);
+	for (; i < n; i++) {
+		nb += b[i] == S_BLACK;
+		nw += b[i] == S_WHITE;
+	}
+	*black = nb; *white = nw;
+}
+
+#endif
+
+
+struct simd_kernels simd = { "generic", count_stones_generic };
+
+static const struct simd_kernels kernels[] = {
+	/* The best first. */
+#ifdef SIMD_X86
+	{ "avx512", count_stones_avx512 },
+	{ "avx2", count_stones_avx2 },
+#endif
+#ifdef SIMD_NEON
+	{ "neon", count_stones_neon },
+#endif
+	{ "generic", count_stones_generic },
+};
+
+static bool
+simd_supported(const char *name)
+{
+#ifdef SIMD_X86
+	__builtin_cpu_init();
+	if (!strcmp(name, "avx512"))
+		return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("popcnt");
+	if (!strcmp(name, "avx2"))
+		return __builtin_cpu_supports("avx2");
+#endif
+#ifdef SIMD_NEON
+	/* Part of the base aarch64 instruction set. */
+	if (!strcmp(name, "neon"))
+		return true;
+#endif
+	return !strcmp(name, "generic");
+}
+
+void
+simd_init(const char *force)
+{
+	unsigned int i;
+	for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+		if (force && strcasecmp(force, kernels[i].name))
+			continue;
+		if (simd_supported(kernels[i].name))
+			break;
+	}
+	if (i == sizeof(kernels) / sizeof(kernels[0])) {
+		fprintf(stderr, "Instruction set %s not supported here\n", force);
+		exit(1);
+	}
+	simd = kernels[i];
+	if (DEBUGL(1))
+		fprintf(stderr, "Using %s kernels.\n", simd.name);
+}
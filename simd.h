@@ -0,0 +1,25 @@
+#ifndef PACHI_SIMD_H
+#define PACHI_SIMD_H
+
+/* Vectorized kernels of the hot paths, with implementations for the
+ * instruction sets of the machines we run on (AVX2 and AVX-512 on
+ * x86-64, NEON on aarch64) besides the plain C one. simd_init() picks
+ * the best the CPU supports, once at startup, so that one binary
+ * (built without -march=native) runs well on all of them. Until then,
+ * the plain C kernels are used. */
+
+#include "stone.h"
+
+struct simd_kernels {
+	const char *name;
+	/* Count the black and white stones in @b[@n]. */
+	void (*count_stones)(const enum stone *b, int n, int *black, int *white);
+};
+
+extern struct simd_kernels simd;
+
+/* Select the kernels; @force is the name of the instruction set to use
+ * if supported ("generic" for plain C), or NULL for the best one. */
+void simd_init(const char *force);
+
+#endif
@@ -2,6 +2,7 @@
 #define PACHI_STATS_H
 
 #include <math.h>
+#include <stdint.h>
 
 /* Move statistics; we track how good value each move has. */
 /* These operations are supposed to be atomic - reasonably
@@ -12,11 +13,21 @@
 struct move_stats {
 	floating_t value; // BLACK wins/playouts
 	int playouts; // # of playouts
-};
+}
+#ifdef STATS_ATOMIC
+/* The whole struct is updated with a single compare-and-swap. */
+__attribute__((aligned(8)))
+#endif
+;
 
 /* Add a result to the stats. */
 static void stats_add_result(struct move_stats *s, floating_t result, int playouts);
 
+/* Same, for the many updates of approximate stats (AMAF): the value
+ * is still published before the playouts, but without full memory
+ * barriers, so concurrent updates are lost a bit more often. */
+static void stats_add_result_relaxed(struct move_stats *s, floating_t result, int playouts);
+
 /* Remove a result from the stats. */
 static void stats_rm_result(struct move_stats *s, floating_t result, int playouts);
 
@@ -27,6 +38,70 @@ static void stats_merge(struct move_stats *dest, struct move_stats *src);
 static void stats_reverse_parity(struct move_stats *s);
 
 
+#ifdef STATS_ATOMIC
+
+/* With STATS_ATOMIC, value and playouts are packed in a single
+ * 64-bit word and updated together by compare-and-swap, so
+ * concurrent updates are never lost and a reader always sees
+ * a value matching its playouts. */
+
+#ifdef DOUBLE_FLOATING
+#error "STATS_ATOMIC requires single precision floating_t"
+#endif
+
+typedef uint64_t __attribute__((__may_alias__)) move_stats_word_t;
+
+union move_stats_word {
+	struct move_stats s;
+	move_stats_word_t w;
+};
+
+static inline void
+stats_add_result(struct move_stats *s, floating_t result, int playouts)
+{
+	move_stats_word_t *w = (move_stats_word_t *) s;
+	union move_stats_word old, new;
+	old.w = *(volatile move_stats_word_t *) w;
+	do {
+		new.s.playouts = old.s.playouts + playouts;
+		new.s.value = old.s.value + (result - old.s.value) * playouts / new.s.playouts;
+		move_stats_word_t prev = __sync_val_compare_and_swap(w, old.w, new.w);
+		if (prev == old.w)
+			break;
+		old.w = prev;
+	} while (1);
+}
+
+static inline void
+stats_add_result_relaxed(struct move_stats *s, floating_t result, int playouts)
+{
+	stats_add_result(s, result, playouts);
+}
+
+static inline void
+stats_rm_result(struct move_stats *s, floating_t result, int playouts)
+{
+	move_stats_word_t *w = (move_stats_word_t *) s;
+	union move_stats_word old, new;
+	old.w = *(volatile move_stats_word_t *) w;
+	do {
+		new.s = old.s;
+		if (old.s.playouts > playouts) {
+			new.s.playouts = old.s.playouts - playouts;
+			new.s.value = old.s.value + (old.s.value - result) * playouts / new.s.playouts;
+		} else {
+			/* As below, keep the value with zero playouts. */
+			new.s.playouts = 0;
+		}
+		move_stats_word_t prev = __sync_val_compare_and_swap(w, old.w, new.w);
+		if (prev == old.w)
+			break;
+		old.w = prev;
+	} while (1);
+}
+
+#else
+
 /* We actually do the atomicity in a pretty hackish way - we simply
  * rely on the fact that int,floating_t operations should be atomic with
  * reasonable compilers (gcc) on reasonable architectures (i386,
@@ -54,6 +129,22 @@ stats_add_result(struct move_stats *s, floating_t result, int playouts)
 	s->playouts = s_playouts;
 }
 
+static inline void
+stats_add_result_relaxed(struct move_stats *s, floating_t result, int playouts)
+{
+	/* The acquire orders the value load after the playouts load,
+	 * the release the value store before the playouts store;
+	 * both are plain moves on x86. */
+	int s_playouts = __atomic_load_n(&s->playouts, __ATOMIC_ACQUIRE);
+	floating_t s_value = s->value;
+
+	s_playouts += playouts;
+	s_value += (result - s_value) * playouts / s_playouts;
+
+	s->value = s_value;
+	__atomic_store_n(&s->playouts, s_playouts, __ATOMIC_RELEASE);
+}
+
 static inline void
 stats_rm_result(struct move_stats *s, floating_t result, int playouts)
 {
@@ -82,6 +173,8 @@ stats_rm_result(struct move_stats *s, floating_t result, int playouts)
 	}
 }
 
+#endif /* STATS_ATOMIC */
+
 static inline void
 stats_merge(struct move_stats *dest, struct move_stats *src)
 {
@@ -0,0 +1,333 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "board.h"
+#include "debug.h"
+#include "engine.h"
+#include "metrics.h"
+#include "perfstats.h"
+#include "random.h"
+#include "playout.h"
+#include "timeinfo.h"
+#include "playout/gamma.h"
+#include "playout/light.h"
+#include "playout/moggy.h"
+#include "uct/uct.h"
+#include "t-unit/bench.h"
+
+
+/* Playout throughput benchmark. The positions are reproducible: each
+ * is reached by a light policy game from a fixed seed, stopped after
+ * a given fraction of the board area has been played. */
+
+#ifdef BOARD_SIZE
+static const int bench_sizes[] = { BOARD_SIZE };
+#else
+static const int bench_sizes[] = { 9, 13, 19 };
+#endif
+#define bench_sizes_n (int)(sizeof(bench_sizes) / sizeof(bench_sizes[0]))
+
+static const struct {
+	char *name;
+	int percent; // of board area played
+} bench_positions[] = {
+	{ "empty",    0 },
+	{ "fuseki",  10 },
+	{ "midgame", 35 },
+	{ "endgame", 65 },
+};
+#define bench_positions_n (int)(sizeof(bench_positions) / sizeof(bench_positions[0]))
+
+enum bench_policy {
+	BP_MOGGY,
+	BP_LIGHT,
+	BP_GAMMA,
+	BP_MAX,
+};
+static char *bench_policy_names[BP_MAX] = { "moggy", "light", "gamma" };
+
+struct bench_result {
+	int games;
+	long moves;
+	double playout_time;
+	double play_time;
+};
+
+
+static void
+bench_position(struct board *b, int size, int percent, unsigned long seed)
+{
+	board_resize(b, size);
+	board_clear(b);
+
+	struct playout_policy *policy = playout_light_init(NULL, b);
+	struct playout_setup setup = { .gamelen = MAX_GAMELEN };
+	fast_srandom(seed);
+
+	int moves = size * size * percent / 100;
+	enum stone color = S_BLACK;
+	for (int i = 0; i < moves; i++) {
+		play_random_move(&setup, b, color, policy);
+		color = stone_other(color);
+	}
+	playout_policy_done(policy);
+}
+
+static void
+bench_run(struct board *pos, struct playout_policy *policy, int games,
+          unsigned long seed, struct bench_result *r)
+{
+	struct playout_setup setup = { .gamelen = MAX_GAMELEN };
+	static struct playout_amafmap amaf;
+	enum stone to_play = stone_other(pos->last_move.color);
+	if (to_play == S_NONE)
+		to_play = S_BLACK;
+
+	fast_srandom(seed);
+	for (int i = 0; i < games; i++) {
+		struct board b;
+		board_copy(&b, pos);
+		amaf.gamelen = amaf.game_baselen = 0;
+
+		double time_start = time_now();
+		play_random_game(&setup, &b, to_play, &amaf, NULL, policy);
+		r->playout_time += time_now() - time_start;
+		board_done_noalloc(&b);
+
+		/* Replay the same game with plain board_play() to time
+		 * the board implementation alone. */
+		board_copy(&b, pos);
+		enum stone color = to_play;
+		time_start = time_now();
+		for (int j = 0; j < amaf.gamelen; j++) {
+			struct move m = { .coord = amaf.game[j], .color = color };
+			board_play(&b, &m);
+			color = stone_other(color);
+		}
+		r->play_time += time_now() - time_start;
+		board_done_noalloc(&b);
+
+		r->games++;
+		r->moves += amaf.gamelen;
+	}
+}
+
+static void
+bench_print(char *what, struct bench_result *r)
+{
+	printf("%-24s %6d games %9.0f playouts/s %6.1f moves/playout %7.1f ns/board_play\n",
+	       what, r->games, r->games / r->playout_time,
+	       (double) r->moves / r->games,
+	       r->moves ? r->play_time * 1e9 / r->moves : 0);
+}
+
+/* Search thread scaling benchmark: a fixed number of playouts of the
+ * UCT search on each position, with 1, 2, 4 ... threads. The time
+ * shares are from the perfstats probes, relative to the thread time
+ * of the search (wall time x threads); the descent includes the
+ * expansions. Moves are compared with the single thread search.
+ * The search notices its end only every TREE_BUSYWAIT_INTERVAL, so
+ * each should take a few seconds for the rates to mean anything. */
+
+struct search_result {
+	int positions;
+	int agree;
+	double playouts;
+	double time;
+};
+
+static void
+bench_search_run(struct board *b, char *engine_arg, int threads, int playouts,
+		 unsigned long seed, coord_t *best, struct search_result *r, char *what)
+{
+	char arg[1024];
+	snprintf(arg, sizeof(arg), "threads=%d,pondering=0,force_seed=%lu%s%s",
+		 threads, seed, engine_arg ? "," : "", engine_arg ? engine_arg : "");
+	struct engine *e = engine_uct_init(arg, b);
+
+	char tspec[32];
+	snprintf(tspec, sizeof(tspec), "=%d", playouts);
+	struct time_info ti;
+	time_parse(&ti, tspec);
+
+	enum stone to_play = stone_other(b->last_move.color);
+	if (to_play == S_NONE)
+		to_play = S_BLACK;
+
+	double played = metric_get(M_PLAYOUTS);
+	double gc = metric_get(M_GC_SECONDS);
+	perf_reset();
+	uint64_t ticks = perf_ticks();
+	double time_start = time_now();
+	coord_t *c = e->genmove(e, b, &ti, to_play, false);
+	double time = time_now() - time_start;
+	ticks = perf_ticks() - ticks;
+	played = metric_get(M_PLAYOUTS) - played;
+	gc = metric_get(M_GC_SECONDS) - gc;
+	struct perf_counters sum;
+	perf_sum(&sum);
+
+	if (threads == 1)
+		*best = *c;
+	bool agree = *c == *best;
+	double thread_ticks = (double) ticks * threads / 100;
+	printf("%-20s %2d threads %8.0f playouts/s %7.0f /thread  descent %4.1f%% expand %4.1f%% backprop %4.1f%%  gc %5.2fs  %-4s%s\n",
+	       what, threads, played / time, played / time / threads,
+	       sum.ticks[PERF_DESCENT] / thread_ticks, sum.ticks[PERF_EXPAND] / thread_ticks,
+	       sum.ticks[PERF_BACKPROP] / thread_ticks, gc,
+	       coord2sstr(*c, b), agree ? "" : " (differs)");
+	coord_done(c);
+
+	r->positions++;
+	r->agree += agree;
+	r->playouts += played;
+	r->time += time;
+
+	b->es = NULL;
+	engine_done(e);
+}
+
+static void
+bench_search(int max_threads, int playouts, int only_size, unsigned long seed, char *engine_arg)
+{
+	int threads_n = 0;
+	int threads[32];
+	for (int t = 1; t < max_threads && threads_n < 31; t *= 2)
+		threads[threads_n++] = t;
+	threads[threads_n++] = max_threads;
+	struct search_result total[threads_n];
+	memset(total, 0, sizeof(total));
+
+	bool perf_was_enabled = perf_enabled;
+	perf_enabled = true;
+	struct board *b = board_init(NULL);
+	for (int s = 0; s < bench_sizes_n; s++) {
+		int size = bench_sizes[s];
+		if (only_size && size != only_size)
+			continue;
+		for (int p = 0; p < bench_positions_n; p++) {
+			bench_position(b, size, bench_positions[p].percent, seed + p);
+			char what[64];
+			snprintf(what, sizeof(what), "%dx%d %s", size, size, bench_positions[p].name);
+			coord_t best = pass;
+			for (int i = 0; i < threads_n; i++)
+				bench_search_run(b, engine_arg, threads[i], playouts, seed, &best, &total[i], what);
+		}
+	}
+	board_done(b);
+	perf_enabled = perf_was_enabled;
+
+	double single = total[0].time ? total[0].playouts / total[0].time : 0;
+	for (int i = 0; i < threads_n; i++) {
+		struct search_result *r = &total[i];
+		if (!r->positions)
+			continue;
+		double rate = r->playouts / r->time;
+		printf("total %2d threads %8.0f playouts/s %7.0f /thread  speedup %5.2f efficiency %5.1f%%  same move %d/%d\n",
+		       threads[i], rate, rate / threads[i], rate / single,
+		       rate / single / threads[i] * 100, r->agree, r->positions);
+	}
+}
+
+void
+bench(char *arg, char *engine_arg)
+{
+	int games = 1000;
+	unsigned long seed = 1;
+	bool search = false;
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int playouts = 10000;
+	int only_size = 0;
+
+	if (arg) {
+		char *optspec, *next = arg;
+		while (*next) {
+			optspec = next;
+			next += strcspn(next, ",");
+			if (*next) { *next++ = 0; } else { *next = 0; }
+
+			char *optname = optspec;
+			char *optval = strchr(optspec, '=');
+			if (optval) *optval++ = 0;
+
+			if (!strcasecmp(optname, "games") && optval) {
+				/* Playouts per position and policy. */
+				games = atoi(optval);
+			} else if (!strcasecmp(optname, "seed") && optval) {
+				seed = strtoul(optval, NULL, 10);
+			} else if (!strcasecmp(optname, "search")) {
+				/* Search thread scaling instead of
+				 * playout throughput. */
+				search = true;
+			} else if (!strcasecmp(optname, "threads") && optval) {
+				/* Most threads of the search benchmark;
+				 * default is the number of CPUs. */
+				threads = atoi(optval);
+			} else if (!strcasecmp(optname, "playouts") && optval) {
+				/* Playouts per search. */
+				playouts = atoi(optval);
+			} else if (!strcasecmp(optname, "size") && optval) {
+				/* Search benchmark on this board size only. */
+				only_size = atoi(optval);
+			} else {
+				fprintf(stderr, "bench: Invalid argument %s or missing value\n", optname);
+				exit(1);
+			}
+		}
+	}
+	if (search) {
+		if (threads < 1 || playouts < 1) {
+			fprintf(stderr, "bench: Invalid threads or playouts\n");
+			exit(1);
+		}
+		bench_search(threads, playouts, only_size, seed, engine_arg);
+		return;
+	}
+
+	struct board *b = board_init(NULL);
+	struct bench_result total[BP_MAX];
+	memset(total, 0, sizeof(total));
+
+	for (int s = 0; s < bench_sizes_n; s++) {
+		int size = bench_sizes[s];
+		board_resize(b, size);
+		board_clear(b);
+		struct playout_policy *policies[BP_MAX] = {
+			playout_moggy_init(NULL, b, NULL),
+			playout_light_init(NULL, b),
+			playout_gamma_init(NULL, b),
+		};
+
+		for (int p = 0; p < bench_positions_n; p++) {
+			bench_position(b, size, bench_positions[p].percent, seed + p);
+			for (int i = 0; i < BP_MAX; i++) {
+				struct bench_result r;
+				memset(&r, 0, sizeof(r));
+				bench_run(b, policies[i], games, seed, &r);
+
+				char what[64];
+				snprintf(what, sizeof(what), "%dx%d %s %s", size, size,
+					 bench_positions[p].name, bench_policy_names[i]);
+				bench_print(what, &r);
+
+				total[i].games += r.games;
+				total[i].moves += r.moves;
+				total[i].playout_time += r.playout_time;
+				total[i].play_time += r.play_time;
+			}
+		}
+
+		for (int i = 0; i < BP_MAX; i++)
+			playout_policy_done(policies[i]);
+	}
+
+	for (int i = 0; i < BP_MAX; i++) {
+		char what[64];
+		snprintf(what, sizeof(what), "total %s", bench_policy_names[i]);
+		bench_print(what, &total[i]);
+	}
+	board_done(b);
+}
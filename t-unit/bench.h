@@ -0,0 +1,12 @@
+#ifndef PACHI_T_UNIT_BENCH_H
+#define PACHI_T_UNIT_BENCH_H
+
+/* Run the playout throughput benchmark and print results to stdout.
+ * @arg: comma-separated games=N (playouts per position and policy),
+ * seed=N; may be NULL.
+ * With the search option, run the UCT search thread scaling benchmark
+ * instead: threads=N (most threads), playouts=N (per search), size=N
+ * (only this board size); @engine_arg are extra UCT options. */
+void bench(char *arg, char *engine_arg);
+
+#endif
@@ -0,0 +1,19 @@
+
+% Compiled fbook and joseki dictionaries load back as the text ones
+compiled fbook
+compiled joseki
+
+
+% Compiled spatial dictionary, patterns of this position
+boardsize 9
+. . . . . . . . .
+. . . . . . . . .
+. . X O . . . . .
+. . X O . . X . .
+. . . X O . . . .
+. . . X O . . . .
+. . O . . . . . .
+. . . . . . . . .
+. . . . . . . . .
+
+compiled spatial
@@ -0,0 +1,98 @@
+#!/bin/sh
+# Test of the distributed engine with a master and its slaves all on
+# this machine, see distributed/distributed.c. Run from the top
+# directory, it takes about 15 seconds:
+#
+#	t-unit/distributed.sh
+#
+# It checks that:
+#  - genmoves with stats are streamed: a slave gets the command again
+#    as soon as it has replied, before the master updates it,
+#  - slaves joining during the game get the command history,
+#  - the master plays with several slaves, and keeps playing
+#    when one of them is replaced by a new one.
+
+PACHI=${PACHI:-./pachi}
+PORT=${PORT:-$((20000 + $$ % 20000))}
+DIR=$(mktemp -d)
+trap 'exec 3>&-; kill $(cat "$DIR"/*.pid 2>/dev/null) 2>/dev/null; rm -rf "$DIR"' EXIT
+
+fail()
+{
+	echo "distributed: FAILED: $*"
+	tail -n 20 "$DIR"/*.log
+	exit 1
+}
+
+# slave id
+slave()
+{
+	$PACHI -d 2 -e uct -g localhost:$PORT slave,threads=1 >/dev/null 2>"$DIR/slave$1.log" &
+	echo $! >"$DIR/slave$1.pid"
+}
+
+# Send a gtp command to the master and wait for its reply.
+gtp()
+{
+	n=$(grep -c '^[=?]' "$DIR/master.out")
+	echo "$1" >&3
+	t=0
+	while [ $(grep -c '^[=?]' "$DIR/master.out") -le $n ]; do
+		t=$((t + 1))
+		[ $t -le 300 ] || fail "no reply to $1"
+		sleep 0.1
+	done
+}
+
+# slave_count
+wait_slaves()
+{
+	t=0
+	while [ $(cat "$DIR"/slave*.log | grep -c 'IN: name') -lt $1 ]; do
+		t=$((t + 1))
+		[ $t -le 100 ] || fail "slaves did not connect"
+		sleep 0.1
+	done
+}
+
+mkfifo "$DIR/gtp"
+$PACHI -d 3 -e distributed -t =4000 slave_port=$PORT <"$DIR/gtp" >"$DIR/master.out" 2>"$DIR/master.log" &
+echo $! >"$DIR/master.pid"
+exec 3>"$DIR/gtp"
+
+# Streaming, with a single slave so that the master updates
+# the command only after the slave replied.
+slave 1
+wait_slaves 1
+gtp 'boardsize 9'
+gtp 'clear_board'
+gtp 'komi 7'
+gtp 'genmove b'
+# The same genmoves twice in a row, only the size of the stats differs.
+grep 'IN: .*pachi-genmoves .*@' "$DIR/slave1.log" | sed 's/ @.*//' | uniq -d | grep -q . \
+	|| fail "genmoves not streamed"
+
+# Two slaves join during the game.
+slave 2
+slave 3
+wait_slaves 3
+gtp 'genmove w'
+for i in 2 3; do
+	grep -q 'IN: .*boardsize 9' "$DIR/slave$i.log" || fail "slave $i did not get the history"
+done
+
+# The third one is replaced by a new one.
+kill $(cat "$DIR/slave3.pid")
+rm "$DIR/slave3.pid"
+slave 4
+wait_slaves 4
+gtp 'genmove b'
+grep -q 'IN: .*boardsize 9' "$DIR/slave4.log" || fail "slave 4 did not get the history"
+gtp 'genmove w'
+
+[ $(grep -c '^= [A-T][0-9]' "$DIR/master.out") -eq 4 ] || fail "missing moves"
+grep 'genmove .* games in ' "$DIR/master.log" | tail -n 1 | grep -q ' 3 slaves ' \
+	|| fail "not all slaves in the last genmove"
+grep -q 'resend all' "$DIR/master.log" || fail "no history resend"
+
+echo "distributed: OK"
@@ -1,9 +1,11 @@
 #define DEBUG
 #include <ctype.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <unistd.h>
 
 #include "board.h"
 #include "debug.h"
@@ -17,16 +19,18 @@
 #include "playout/moggy.h"
 #include "replay/replay.h"
 #include "ownermap.h"
+#include "t-unit/test.h"
 
+__thread FILE *tout, *terr;
 
-static bool board_printed;
+static __thread bool board_printed;
 
 static void
 board_print_test(int level, struct board *b)
 {
 	if (!DEBUGL(level) || board_printed)
 		return;
-	board_print(b, stderr);
+	board_print(b, terr);
 	board_printed = true;
 }
 
@@ -109,20 +113,20 @@ test_sar(struct board *b, char *arg)
 
 	board_print_test(2, b);
 	if (DEBUGL(1))
-		printf("sar %s %s %d...\t", stone2str(color), coord2sstr(c, b), eres);
+		fprintf(tout, "sar %s %s %d...\t", stone2str(color), coord2sstr(c, b), eres);
 
 	assert(board_at(b, c) == S_NONE);
 	int rres = is_bad_selfatari(b, color, c);
 
 	if (rres == eres) {
 		if (DEBUGL(1))
-			printf("OK\n");
+			fprintf(tout, "OK\n");
 	} else {
 		if (debug_level <= 2) {
 			board_print_test(0, b);
-			printf("sar %s %s %d...\t", stone2str(color), coord2sstr(c, b), eres);
+			fprintf(tout, "sar %s %s %d...\t", stone2str(color), coord2sstr(c, b), eres);
 		}
-		printf("FAILED (%d)\n", rres);
+		fprintf(tout, "FAILED (%d)\n", rres);
 	}
 	return rres == eres;
 }
@@ -140,7 +144,7 @@ test_ladder(struct board *b, char *arg)
 
 	board_print_test(2, b);
 	if (DEBUGL(1))
-		printf("ladder %s %s %d...\t", stone2str(color), coord2sstr(c, b), eres);
+		fprintf(tout, "ladder %s %s %d...\t", stone2str(color), coord2sstr(c, b), eres);
 	
 	assert(board_at(b, c) == S_NONE);
 	group_t atari_neighbor = board_get_atari_neighbor(b, c, color);
@@ -149,13 +153,13 @@ test_ladder(struct board *b, char *arg)
 	
 	if (rres == eres) {
 		if (DEBUGL(1))
-			printf("OK\n");
+			fprintf(tout, "OK\n");
 	} else {
 		if (debug_level <= 2) {
 			board_print_test(0, b);
-			printf("ladder %s %s %d...\t", stone2str(color), coord2sstr(c, b), eres);
+			fprintf(tout, "ladder %s %s %d...\t", stone2str(color), coord2sstr(c, b), eres);
 		}
-		printf("FAILED (%d)\n", rres);
+		fprintf(tout, "FAILED (%d)\n", rres);
 	}
 
 	return (rres == eres);
@@ -173,7 +177,7 @@ test_useful_ladder(struct board *b, char *arg)
 
 	board_print_test(2, b);
 	if (DEBUGL(1))
-		printf("useful_ladder %s %s %d...\t", stone2str(color), coord2sstr(c, b), eres);
+		fprintf(tout, "useful_ladder %s %s %d...\t", stone2str(color), coord2sstr(c, b), eres);
 	
 	assert(board_at(b, c) == S_NONE);
 	group_t atari_neighbor = board_get_atari_neighbor(b, c, color);
@@ -183,13 +187,13 @@ test_useful_ladder(struct board *b, char *arg)
 	
 	if (rres == eres) {
 		if (DEBUGL(1))
-			printf("OK\n");
+			fprintf(tout, "OK\n");
 	} else {
 		if (debug_level <= 2) {
 			board_print_test(0, b);
-			printf("useful_ladder %s %s %d...\t", stone2str(color), coord2sstr(c, b), eres);
+			fprintf(tout, "useful_ladder %s %s %d...\t", stone2str(color), coord2sstr(c, b), eres);
 		}
-		printf("FAILED (%d)\n", rres);
+		fprintf(tout, "FAILED (%d)\n", rres);
 	}
 
 	return (rres == eres);
@@ -204,7 +208,7 @@ test_can_countercapture(struct board *b, char *arg)
 
 	board_print_test(2, b);
 	if (DEBUGL(1))
-		printf("can_countercap %s %d...\t", coord2sstr(c, b), eres);
+		fprintf(tout, "can_countercap %s %d...\t", coord2sstr(c, b), eres);
 
 	enum stone color = board_at(b, c);
 	group_t g = group_at(b, c);
@@ -213,13 +217,13 @@ test_can_countercapture(struct board *b, char *arg)
 
 	if (rres == eres) {
 		if (DEBUGL(1))
-			printf("OK\n");
+			fprintf(tout, "OK\n");
 	} else {
 		if (debug_level <= 2) {
 			board_print_test(0, b);
-			printf("can_countercap %s %d...\t", coord2sstr(c, b), eres);
+			fprintf(tout, "can_countercap %s %d...\t", coord2sstr(c, b), eres);
 		}
-		printf("FAILED (%d)\n", rres);
+		fprintf(tout, "FAILED (%d)\n", rres);
 	}
 	return rres == eres;
 }
@@ -234,7 +238,7 @@ test_two_eyes(struct board *b, char *arg)
 
 	board_print_test(2, b);
 	if (DEBUGL(1))
-		printf("two_eyes %s %d...\t", coord2sstr(c, b), eres);
+		fprintf(tout, "two_eyes %s %d...\t", coord2sstr(c, b), eres);
 
 	enum stone color = board_at(b, c);
 	assert(color == S_BLACK || color == S_WHITE);
@@ -242,13 +246,13 @@ test_two_eyes(struct board *b, char *arg)
 
 	if (rres == eres) {
 		if (DEBUGL(1))
-			printf("OK\n");
+			fprintf(tout, "OK\n");
 	} else {
 		if (debug_level <= 2) {
 			board_print_test(0, b);
-			printf("two_eyes %s %d...\t", coord2sstr(c, b), eres);
+			fprintf(tout, "two_eyes %s %d...\t", coord2sstr(c, b), eres);
 		}
-		printf("FAILED (%d)\n", rres);
+		fprintf(tout, "FAILED (%d)\n", rres);
 	}
 	return rres == eres;
 }
@@ -268,13 +272,13 @@ test_moggy_moves(struct board *b, char *arg)
 	arg += strcspn(arg, " ") + 1;
 
 	b->last_move = last;
-	board_print(b, stderr);  // Always print board so we see last move
+	board_print(b, terr);  // Always print board so we see last move
 
 	char e_arg[128];  sprintf(e_arg, "runs=%i", runs);
 	struct engine *e = engine_replay_init(e_arg, b);
 	
 	if (DEBUGL(1))
-		printf("moggy moves %s, %s to play. Sampling moves (%i runs)...\n\n", 
+		fprintf(tout, "moggy moves %s, %s to play. Sampling moves (%i runs)...\n\n", 
 		       coord2sstr(last.coord, b), stone2str(color), runs);
 
         int played_[b->size2 + 2];		memset(played_, 0, sizeof(played_));
@@ -286,7 +290,7 @@ test_moggy_moves(struct board *b, char *arg)
 	for (int k = most_played; k > 0; k--)
 		for (coord_t c = resign; c < b->size2; c++)
 			if (played[c] == k)
-				printf("%3s: %.2f%%\n", coord2str(c, b), (float)k * 100 / runs);
+				fprintf(tout, "%3s: %.2f%%\n", coord2str(c, b), (float)k * 100 / runs);
 	
 	engine_done(e);
 	return true;   // Not much of a unit test right now =)
@@ -355,12 +359,12 @@ test_moggy_status(struct board *board, char *arg)
 		arg += strcspn(arg, " \t");
 	}
 	
-	board_print(board, stderr);
+	board_print(board, terr);
 	if (DEBUGL(1)) {
-		printf("moggy status ");
+		fprintf(tout, "moggy status ");
 		for (int i = 0; i < n; i++)
-			printf("%s%s", coord2sstr(status_at[i], board), (i != n-1 ? " " : ""));
-		printf(", %s to play. Playing %i games %s...\n", 
+			fprintf(tout, "%s%s", coord2sstr(status_at[i], board), (i != n-1 ? " " : ""));
+		fprintf(tout, ", %s to play. Playing %i games %s...\n", 
 		       stone2str(color), games, (pick_random ? "(random last move) " : ""));
 	}
 	
@@ -389,21 +393,21 @@ test_moggy_status(struct board *board, char *arg)
 		board_done_noalloc(&b);
 	}
 	double elapsed = time_now() - time_start;
-	printf("moggy status in %.1fs, %i games/s\n\n", elapsed, (int)((float)games / elapsed));
+	fprintf(tout, "moggy status in %.1fs, %i games/s\n\n", elapsed, (int)((float)games / elapsed));
 	
 	int wr_black = wr * 100 / games;
 	int wr_white = (games - wr) * 100 / games;
 	if (wr_black > wr_white)
-		printf("Winrate: [ black %i%% ]  white %i%%\n\n", wr_black, wr_white);
+		fprintf(tout, "Winrate: [ black %i%% ]  white %i%%\n\n", wr_black, wr_white);
 	else
-		printf("Winrate: black %i%%  [ white %i%% ]\n\n", wr_black, wr_white);
+		fprintf(tout, "Winrate: black %i%%  [ white %i%% ]\n\n", wr_black, wr_white);
 
-	board_print_ownermap(board, stderr, &ownermap);
+	board_print_ownermap(board, terr, &ownermap);
 
 	for (int i = 0; i < n; i++) {
 		coord_t c = status_at[i];
 		enum stone color = (ownermap.map[c][S_BLACK] > ownermap.map[c][S_WHITE] ? S_BLACK : S_WHITE);
-		fprintf(stderr, "%3s owned by %s: %i%%\n", 
+		fprintf(terr, "%3s owned by %s: %i%%\n", 
 			coord2sstr(c, board), stone2str(color), 
 			ownermap.map[c][color] * 100 / ownermap.playouts);
 	}
@@ -414,65 +418,208 @@ test_moggy_status(struct board *board, char *arg)
 }
 
 bool board_undo_stress_test(struct board *orig, char *arg);
+bool compiled_dict_test(struct board *b, char *arg);
 
-void
-unittest(char *filename)
+
+/* Several test files are run in parallel, one per thread with its own
+ * board, their output buffered and printed in order at the end. */
+
+#define SLOWEST_TESTS 10
+
+struct test_time {
+	double time;
+	char what[96]; // file:line test
+};
+
+struct test_file {
+	char *filename;
+	int total, passed, skipped;
+	double time;
+	/* Slowest test cases, slowest first. */
+	struct test_time slowest[SLOWEST_TESTS];
+	int nslowest;
+	/* Output when run in parallel. */
+	char *out;
+	size_t out_len;
+};
+
+static void
+record_time(struct test_time *slowest, int *n, double time, char *what)
 {
-	FILE *f = fopen(filename, "r");
+	int i = *n < SLOWEST_TESTS ? (*n)++ : SLOWEST_TESTS - 1;
+	if (i == SLOWEST_TESTS - 1 && slowest[i].time >= time)
+		return;
+	for (; i > 0 && slowest[i - 1].time < time; i--)
+		slowest[i] = slowest[i - 1];
+	slowest[i].time = time;
+	snprintf(slowest[i].what, sizeof(slowest[i].what), "%s", what);
+}
+
+static void
+test_file_run(struct test_file *t, unsigned long seed)
+{
+	FILE *f = fopen(t->filename, "r");
 	if (!f) {
-		perror(filename);
+		perror(t->filename);
 		exit(EXIT_FAILURE);
 	}
 
-	int total = 0;
-	int passed = 0;
-	int skipped = 0;
-	
+	/* Same results as when running the file alone. */
+	fast_srandom(seed);
 	struct board *b = board_init(NULL);
 	b->komi = 7.5;
 	char line[256];
+	int lineno = 0;
+	double file_start = time_now();
 
 	while (fgets(line, sizeof(line), f)) {
+		lineno++;
 		line[strlen(line) - 1] = 0; // chomp
 		switch (line[0]) {
-			case '%': printf("\n%s\n", line); continue;
-			case '!': printf("%s...\tSKIPPED\n", line); skipped++; continue;
+			case '%': fprintf(tout, "\n%s\n", line); continue;
+			case '!': fprintf(tout, "%s...\tSKIPPED\n", line); t->skipped++; continue;
 			case 0: continue;
 		}
 		if (!strncmp(line, "boardsize ", 10)) {
-			board_load(b, f, atoi(line + 10));  continue;
+			board_load(b, f, atoi(line + 10));
+			lineno += atoi(line + 10);
+			continue;
 		}
 		if (!strncmp(line, "ko ", 3)) {
 			set_ko(b, line + 3);  continue;
 		}
-		
-		total++;
+
+		char what[96];
+		snprintf(what, sizeof(what), "%s:%d %s", t->filename, lineno, line);
+		double start = time_now();
+
+		t->total++;
 		if (!strncmp(line, "sar ", 4))
-			passed += test_sar(b, line + 4); 
+			t->passed += test_sar(b, line + 4);
 		else if (!strncmp(line, "ladder ", 7))
-			passed += test_ladder(b, line + 7);
+			t->passed += test_ladder(b, line + 7);
 		else if (!strncmp(line, "useful_ladder ", 14))
-			passed += test_useful_ladder(b, line + 14);
+			t->passed += test_useful_ladder(b, line + 14);
 		else if (!strncmp(line, "can_countercap ", 15))
-			passed += test_can_countercapture(b, line + 15); 
+			t->passed += test_can_countercapture(b, line + 15);
 		else if (!strncmp(line, "two_eyes ", 9))
-			passed += test_two_eyes(b, line + 9); 
-		else if (!strncmp(line, "moggy moves ", 12)) 
-			passed += test_moggy_moves(b, line + 12);
-		else if (!strncmp(line, "moggy status ", 13)) 
-			passed += test_moggy_status(b, line + 13);
-   		else if (!strncmp(line, "board_undo_stress_test", 22))
-			passed += board_undo_stress_test(b, line + 22); 
+			t->passed += test_two_eyes(b, line + 9);
+		else if (!strncmp(line, "moggy moves ", 12))
+			t->passed += test_moggy_moves(b, line + 12);
+		else if (!strncmp(line, "moggy status ", 13))
+			t->passed += test_moggy_status(b, line + 13);
+		else if (!strncmp(line, "board_undo_stress_test", 22))
+			t->passed += board_undo_stress_test(b, line + 22);
+		else if (!strncmp(line, "compiled ", 9))
+			t->passed += compiled_dict_test(b, line + 9);
 		else {
 			fprintf(stderr, "Syntax error: %s\n", line);
 			exit(EXIT_FAILURE);
 		}
+		record_time(t->slowest, &t->nslowest, time_now() - start, what);
 	}
+	t->time = time_now() - file_start;
 
 	fclose(f);
-	
-	printf("\n\n----------- [  %i/%i tests passed (%i%%)  ] -----------\n\n", passed, total, passed * 100 / total);
- 	if (total == passed)
+	board_done(b);
+
+	fprintf(tout, "\n\n----------- [  %i/%i tests passed (%i%%) in %.2fs  ] -----------\n\n",
+		t->passed, t->total, t->total ? t->passed * 100 / t->total : 100, t->time);
+}
+
+struct test_pool {
+	struct test_file *files;
+	int nfiles;
+	int next;
+	unsigned long seed;
+};
+
+static void *
+test_thread(void *data)
+{
+	struct test_pool *p = data;
+	int i;
+	while ((i = __sync_fetch_and_add(&p->next, 1)) < p->nfiles) {
+		struct test_file *t = &p->files[i];
+		tout = terr = open_memstream(&t->out, &t->out_len);
+		test_file_run(t, p->seed);
+		fclose(tout);
+	}
+	return NULL;
+}
+
+static void
+test_summary(struct test_file *files, int nfiles, double time)
+{
+	struct test_time slowest[SLOWEST_TESTS];
+	int nslowest = 0;
+	int total = 0, passed = 0;
+
+	printf("\n----------- [  test files  ] -----------\n\n");
+	for (int i = 0; i < nfiles; i++) {
+		struct test_file *t = &files[i];
+		printf("%-32s %4i/%-4i passed %8.3fs%s\n", t->filename, t->passed, t->total, t->time,
+		       t->passed == t->total ? "" : "   FAILED");
+		total += t->total;
+		passed += t->passed;
+		for (int j = 0; j < t->nslowest; j++)
+			record_time(slowest, &nslowest, t->slowest[j].time, t->slowest[j].what);
+	}
+	printf("%-32s %4i/%-4i passed %8.3fs wall time\n", "total", passed, total, time);
+
+	printf("\nslowest tests:\n");
+	for (int i = 0; i < nslowest; i++)
+		printf("%9.2fms  %s\n", slowest[i].time * 1000, slowest[i].what);
+}
+
+/* @filenames: one test file, or several separated by commas
+ * to run them in parallel. */
+void
+unittest(char *filenames)
+{
+	int nfiles = 1;
+	for (char *s = filenames; *s; s++)
+		nfiles += (*s == ',');
+	struct test_file *files = calloc2(nfiles, sizeof(*files));
+	char *next = filenames;
+	for (int i = 0; i < nfiles; i++) {
+		files[i].filename = next;
+		next += strcspn(next, ",");
+		if (*next) *next++ = 0;
+	}
+
+	double start = time_now();
+	if (nfiles == 1) {
+		tout = stdout;
+		terr = stderr;
+		test_file_run(&files[0], fast_getseed());
+	} else {
+		struct test_pool p = { .files = files, .nfiles = nfiles, .seed = fast_getseed() };
+		int threads = sysconf(_SC_NPROCESSORS_ONLN);
+		if (threads > nfiles) threads = nfiles;
+		if (threads < 1) threads = 1;
+		pthread_t thread[threads];
+		for (int i = 0; i < threads; i++)
+			pthread_create(&thread[i], NULL, test_thread, &p);
+		for (int i = 0; i < threads; i++)
+			pthread_join(thread[i], NULL);
+
+		for (int i = 0; i < nfiles; i++) {
+			fwrite(files[i].out, 1, files[i].out_len, stdout);
+			free(files[i].out);
+		}
+		test_summary(files, nfiles, time_now() - start);
+	}
+
+	int total = 0, passed = 0, skipped = 0;
+	for (int i = 0; i < nfiles; i++) {
+		total += files[i].total;
+		passed += files[i].passed;
+		skipped += files[i].skipped;
+	}
+	free(files);
+
+	if (total == passed)
 		printf("\nAll tests PASSED");
 	else {
 		printf("\nSome tests FAILED\n");
@@ -1,6 +1,13 @@
 #ifndef PACHI_T_UNIT_TEST_H
 #define PACHI_T_UNIT_TEST_H
 
-void unittest(char *filename);
+#include <stdio.h>
+
+/* Run one test file, or several comma-separated ones in parallel,
+ * and report the time taken by each file and the slowest tests. */
+void unittest(char *filenames);
+
+/* Output of the test file run by the calling thread. */
+extern __thread FILE *tout, *terr;
 
 #endif
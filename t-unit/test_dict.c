@@ -0,0 +1,284 @@
+#define DEBUG
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "board.h"
+#include "debug.h"
+#include "fbook.h"
+#include "joseki/base.h"
+#include "pattern.h"
+#include "patternsp.h"
+#include "random.h"
+#include "t-unit/test.h"
+
+/* Round trip of the compiled dictionary formats: write a text
+ * dictionary, compile it, and check the compiled one loads back
+ * with the same contents as the text one. */
+
+
+/* Create an empty temporary file, its name is left in name. */
+static void
+temp_file(char *name, size_t size, char *what)
+{
+	char *dir = getenv("TMPDIR");
+	snprintf(name, size, "%s/pachi-%s-XXXXXX", dir ? dir : "/tmp", what);
+	int fd = mkstemp(name);
+	if (fd < 0) {
+		perror(name);
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+}
+
+
+/* Random book lines for 9x9 and 19x19, with and without handicap,
+ * some of them for the same position (the last one wins). */
+static void
+fbook_write_text(FILE *f)
+{
+	struct board *b = board_init(NULL);
+	for (int i = 0; i < 300; i++) {
+		int size = i % 2 ? 19 : 9;
+		int handi = i % 3 ? 0 : 2;
+		board_resize(b, size);
+		board_clear(b);
+
+		fprintf(f, handi ? "%d/%d" : "%d", size, handi);
+		int len = fast_random(i < 100 ? 3 : 8);
+		enum stone color = S_BLACK;
+		for (int j = 0; j < len; j++, color = stone_other(color)) {
+			coord_t c;
+			board_play_random(b, color, &c, NULL, NULL);
+			assert(!is_pass(c));
+			fprintf(f, " %s", coord2sstr(c, b));
+		}
+		fprintf(f, " |");
+		int cands = 1 + fast_random(3);
+		for (int j = 0; j < cands; j++)
+			fprintf(f, " %s", coord2sstr(coord_xy(b, 1 + fast_random(size), 1 + fast_random(size)), b));
+		fprintf(f, "\n");
+	}
+	board_done(b);
+}
+
+static bool
+fbook_same(struct fbook *text, struct fbook *compiled)
+{
+	if (!text || !compiled || text->movecnt != compiled->movecnt)
+		return false;
+	for (uint32_t i = 0; i <= text->hash_mask; i++) {
+		struct fbook_entry *e = &text->entries[i];
+		if (!e->count) continue;
+		struct fbook_entry *ce = fbook_lookup(compiled, e->hash);
+		if (!ce || ce->count != e->count
+		    || memcmp(&text->moves[e->first], &compiled->moves[ce->first], e->count * sizeof(int32_t)))
+			return false;
+	}
+	return true;
+}
+
+static bool
+test_compiled_fbook(void)
+{
+	char text[256], compiled[256];
+	temp_file(text, sizeof(text), "fbook");
+	temp_file(compiled, sizeof(compiled), "fbk");
+	FILE *f = fopen(text, "w");
+	fbook_write_text(f);
+	fclose(f);
+
+	bool ok = fbook_compile(text, compiled);
+	for (int size = 9; ok && size <= 19; size += 10) {
+		for (int handi = 0; ok && handi <= 2; handi += 2) {
+			struct fbook *tb = fbook_load(text, size + 2, handi);
+			struct fbook *cb = fbook_load(compiled, size + 2, handi);
+			ok = fbook_same(tb, cb) && cb->map;
+			if (!ok)
+				fprintf(tout, "section %d/%d differs...\t", size, handi);
+			if (tb) fbook_done(tb);
+			if (cb) fbook_done(cb);
+		}
+	}
+
+	unlink(text);
+	unlink(compiled);
+	return ok;
+}
+
+
+/* Random joseki move lists for distinct quadrant hashes. */
+static void
+joseki_write_text(FILE *f, struct board *b)
+{
+	static const char cs[] = "bw";
+	for (hash_t i = 1; i <= 2000; i++) {
+		hash_t h = i * 0x9e3779b97f4a7c15ULL;
+		enum stone color = 1 + fast_random(2);
+		int count = 1 + fast_random(5);
+		fprintf(f, "%" PRIhash " %c", h, cs[color - 1]);
+		for (int j = 0; j < count; j++) {
+			int size = board_size(b) - 2;
+			coord_t c = coord_xy(b, 1 + fast_random(size), 1 + fast_random(size));
+			fprintf(f, " %s", coord2sstr(c, b));
+		}
+		fprintf(f, " %d\n", count);
+	}
+}
+
+static bool
+joseki_same(struct joseki_dict *text, struct joseki_dict *compiled)
+{
+	if (!text || !compiled || text->patterns_n != compiled->patterns_n)
+		return false;
+	for (uint32_t i = 0; i <= text->slots_mask; i++) {
+		uint32_t key = text->patterns[i].key;
+		if (!key) continue;
+		hash_t qhash = (key - 1) >> 1;
+		enum stone color = ((key - 1) & 1) + 1;
+		coord_t *tm = joseki_moves(text, qhash, color);
+		coord_t *cm = joseki_moves(compiled, qhash, color);
+		if (!cm)
+			return false;
+		for (; !is_pass(*tm); tm++, cm++)
+			if (*tm != *cm)
+				return false;
+		if (!is_pass(*cm))
+			return false;
+	}
+	return true;
+}
+
+static bool
+test_compiled_joseki(void)
+{
+	char text[256], compiled[256];
+	temp_file(text, sizeof(text), "pdict");
+	temp_file(compiled, sizeof(compiled), "jdict");
+	struct board *b = board_init(NULL);
+	board_resize(b, 19);
+	board_clear(b);
+	FILE *f = fopen(text, "w");
+	joseki_write_text(f, b);
+	fclose(f);
+
+	bool ok = joseki_compile_file(text, compiled, board_size(b));
+	if (ok) {
+		struct joseki_dict *tj = joseki_load_file(text, board_size(b));
+		struct joseki_dict *cj = joseki_load_file(compiled, board_size(b));
+		ok = joseki_same(tj, cj) && cj->map;
+		joseki_done(tj);
+		joseki_done(cj);
+	}
+
+	board_done(b);
+	unlink(text);
+	unlink(compiled);
+	return ok;
+}
+
+
+/* Spatials of all distances around every free point of b,
+ * for both colors to play. */
+static void
+spatial_write_text(FILE *f, struct board *b)
+{
+	struct spatial_dict *dict = spatial_dict_init(true, true);
+	struct pattern_config pc = { .spat_min = 3 };
+	foreach_free_point(b) {
+		for (enum stone color = S_BLACK; color <= S_WHITE; color++) {
+			struct move m = { .coord = c, .color = color };
+			for (pc.spat_max = 3; pc.spat_max <= MAX_PATTERN_DIST; pc.spat_max++) {
+				struct spatial s;
+				spatial_from_board(&pc, &s, b, &m);
+				spatial_dict_put(dict, &s, spatial_hash(0, &s));
+			}
+		}
+	} foreach_free_point_end;
+
+	spatial_dict_writeinfo(dict, f);
+	for (unsigned int id = 1; id < dict->nspatials; id++)
+		spatial_write(dict, &dict->spatials[id], id, f);
+	spatial_dict_done(dict);
+}
+
+static bool
+test_compiled_spatial(struct board *b)
+{
+	char text[256], compiled[256];
+	temp_file(text, sizeof(text), "spat");
+	temp_file(compiled, sizeof(compiled), "spatc");
+	const char *filename = spatial_dict_filename;
+	const char *compiled_filename = spatial_dict_compiled_filename;
+	spatial_dict_filename = text;
+	spatial_dict_compiled_filename = compiled;
+
+	FILE *f = fopen(text, "w");
+	spatial_write_text(f, b);
+	fclose(f);
+
+	/* Load the text dictionary, and keep what it holds. */
+	struct spatial_dict *dict = spatial_dict_init(true, true);
+	bool ok = spatial_dict_compile(dict, compiled);
+	unsigned int n = dict->nspatials;
+	int fills = dict->fills;
+	struct spatial *spatials = malloc2(n * sizeof(*spatials));
+	memcpy(spatials, dict->spatials, n * sizeof(*spatials));
+	unsigned int *ids = malloc2(n * PTH__ROTATIONS * sizeof(*ids));
+	for (unsigned int id = 1; id < n; id++)
+		for (unsigned int r = 0; r < PTH__ROTATIONS; r++)
+			ids[id * PTH__ROTATIONS + r] = spatial_dict_lookup(dict, spatial_hash(r, &spatials[id]));
+	spatial_dict_done(dict);
+
+	/* Compare with the compiled one. */
+	dict = ok ? spatial_dict_init(false, true) : NULL;
+	ok = dict && dict->map && dict->nspatials == n && dict->fills == fills
+		&& !memcmp(dict->spatials, spatials, n * sizeof(*spatials));
+	for (unsigned int id = 1; ok && id < n; id++)
+		for (unsigned int r = 0; ok && r < PTH__ROTATIONS; r++)
+			ok = spatial_dict_lookup(dict, spatial_hash(r, &spatials[id])) == ids[id * PTH__ROTATIONS + r];
+	if (DEBUGL(2))
+		fprintf(tout, "%u spatials...\t", n - 1);
+	spatial_dict_done(dict);
+
+	free(spatials);
+	free(ids);
+	spatial_dict_filename = filename;
+	spatial_dict_compiled_filename = compiled_filename;
+	unlink(text);
+	unlink(compiled);
+	return ok;
+}
+
+
+bool
+compiled_dict_test(struct board *b, char *arg)
+{
+	while (*arg == ' ') arg++;
+	if (DEBUGL(1))
+		fprintf(tout, "compiled %s...\t", arg);
+
+	bool ok;
+	if (!strcmp(arg, "fbook"))
+		ok = test_compiled_fbook();
+	else if (!strcmp(arg, "joseki"))
+		ok = test_compiled_joseki();
+	else if (!strcmp(arg, "spatial"))
+		ok = test_compiled_spatial(b);
+	else {
+		fprintf(stderr, "Invalid compiled dictionary: %s\n", arg);
+		exit(EXIT_FAILURE);
+	}
+
+	if (ok) {
+		if (DEBUGL(1))
+			fprintf(tout, "OK\n");
+	} else {
+		if (debug_level <= 2)
+			fprintf(tout, "compiled %s...\t", arg);
+		fprintf(tout, "FAILED\n");
+	}
+	return ok;
+}
@@ -9,42 +9,43 @@
 #include "debug.h"
 #include "playout.h"
 #include "playout/light.h"
+#include "t-unit/test.h"
 
 
 static void
 board_dump_group(struct board *b, group_t g)
 {
-        printf("group base: %s  color: %s  libs: %i  stones: %i\n",
+        fprintf(tout, "group base: %s  color: %s  libs: %i  stones: %i\n",
                coord2sstr(g, b), stone2str(board_at(b, g)),
                board_group_info(b, g).libs, group_stone_count(b, g, 500));
 
-        printf("  stones: ");
+        fprintf(tout, "  stones: ");
         foreach_in_group(b, g) {
-                printf("%s ", coord2sstr(c, b));
+                fprintf(tout, "%s ", coord2sstr(c, b));
         } foreach_in_group_end;
-        printf("\n");
+        fprintf(tout, "\n");
 
-        printf("  libs  : ");   
+        fprintf(tout, "  libs  : ");   
         for (int i = 0; i < board_group_info(b, g).libs; i++) {
                 coord_t lib = board_group_info(b, g).lib[i];
-                printf("%s ", coord2sstr(lib, b));
+                fprintf(tout, "%s ", coord2sstr(lib, b));
         }
-        printf("\n");
+        fprintf(tout, "\n");
 }
 
 static void
 board_dump(struct board *b)
 {       
-        printf("board_dump(): size: %i  size2: %i  bits2: %i\n", 
+        fprintf(tout, "board_dump(): size: %i  size2: %i  bits2: %i\n", 
                b->size, b->size2, b->bits2);
         board_print(b, stdout);
 
-        printf("ko: %s %s  last_ko: %s %s  last_ko_age: %i\n",
+        fprintf(tout, "ko: %s %s  last_ko: %s %s  last_ko_age: %i\n",
                stone2str(b->ko.color), coord2sstr(b->ko.coord, b),
                stone2str(b->last_ko.color), coord2sstr(b->last_ko.coord, b),
                b->last_ko_age);
 
-        printf("groups: \n");
+        fprintf(tout, "groups: \n");
         int seen[BOARD_MAX_COORDS] = {0, };
         foreach_point(b) {
                 if (board_at(b, c) != S_BLACK && board_at(b, c) != S_WHITE)
@@ -56,7 +57,7 @@ board_dump(struct board *b)
                 board_dump_group(b, g);
         } foreach_point_end;
 
-        printf("\n");   
+        fprintf(tout, "\n");   
 }
 
 
@@ -83,7 +84,7 @@ show_suicide_info(struct board *b, struct board *orig, coord_t c, enum stone col
 		});
 
 	if (++n > 1)
-		fprintf(stderr, "multi-group suicide: %i groups    %i stones\n", n, stones);
+		fprintf(terr, "multi-group suicide: %i groups    %i stones\n", n, stones);
 }
 
 
@@ -106,7 +107,7 @@ test_undo(struct board *orig, coord_t c, enum stone color)
 	if (DEBUGL(3))
 		show_suicide_info(&b, orig, c, color);
 	if (DEBUGL(4))
-		board_print(&b, stderr);
+		board_print(&b, terr);
 
 	// Check board_quick_undo() restored board properly
 	if (board_quick_cmp(&b2, orig) || board_cmp(&b2, orig)) {
@@ -122,7 +123,7 @@ test_undo(struct board *orig, coord_t c, enum stone color)
 }
 
 
-static playoutp_permit policy_permit = NULL;
+static __thread playoutp_permit policy_permit = NULL;
 
 static bool
 permit_hook(struct playout_policy *playout_policy, struct board *b, struct move *m, bool alt)
@@ -144,9 +145,9 @@ board_undo_stress_test(struct board *board, char *arg)
 	int games = 1000;
 	enum stone color = S_BLACK;
 	
-	board_print(board, stderr);
+	board_print(board, terr);
 	if (DEBUGL(1))
-		printf("board_undo stress test.   Playing %i games checking every move...\n", games);
+		fprintf(tout, "board_undo stress test.   Playing %i games checking every move...\n", games);
 
 	// Light policy better to test wild multi-group suicides
 	struct playout_policy *policy = playout_light_init(NULL, board);
@@ -163,6 +164,6 @@ board_undo_stress_test(struct board *board, char *arg)
 		board_done_noalloc(&b);
 	}
 	
-	printf("All good.\n\n");
+	fprintf(tout, "All good.\n\n");
 	return true;
 }
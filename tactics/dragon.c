@@ -8,6 +8,7 @@
 #include "board.h"
 #include "debug.h"
 #include "tactics/dragon.h"
+#include "tactics/util.h"
 
 static char*
 print_handler(struct board *board, coord_t c, void *data)
@@ -149,11 +150,11 @@ typedef int (*foreach_in_connected_groups_t)(struct board *b, enum stone color,
 
 static int
 foreach_in_connected_groups_(struct board *b, enum stone color, group_t g, 
-			     foreach_in_connected_groups_t f, void *data, int *visited)
+			     foreach_in_connected_groups_t f, void *data, struct marks *visited)
 {
-	if (visited[group_base(g)])
+	if (marks_test(visited, group_base(g)))
 		return 0;
-	visited[group_base(g)] = 1;
+	marks_set(visited, group_base(g));
 
 	foreach_in_group(b, g) {
 		if (f(b, color, c, data) == -1)
@@ -168,7 +169,7 @@ foreach_in_connected_groups_(struct board *b, enum stone color, group_t g,
 				if (board_at(b, c) != color)
 					continue;
 				group_t g2 = group_at(b, c);
-				if (visited[g2] || !virtual_connection_at(b, color, lib, c, g, g2))
+				if (marks_test(visited, g2) || !virtual_connection_at(b, color, lib, c, g, g2))
 					continue;
 				if (foreach_in_connected_groups_(b, color, g2, f, data, visited) == -1)
 					return -1;
@@ -182,10 +183,11 @@ static void
 foreach_in_connected_groups(struct board *b, enum stone color, coord_t to, 
 			    foreach_in_connected_groups_t f, void *data)
 {
-	int visited[BOARD_MAX_COORDS] = {0, };
+	struct marks *visited = marks_get();
 	assert(board_at(b, to) == color);
 	group_t g = group_at(b, to);
 	foreach_in_connected_groups_(b, color, g, f, data, visited);
+	marks_put(visited);
 }
 
 
@@ -194,12 +196,12 @@ typedef int (*foreach_connected_group_t)(struct board *b, enum stone color, grou
 
 static int
 foreach_connected_group_(struct board *b, enum stone color, group_t g, 
-			 foreach_connected_group_t f, void *data, int *visited)
+			 foreach_connected_group_t f, void *data, struct marks *visited)
 {
-	if (visited[group_base(g)])
+	if (marks_test(visited, group_base(g)))
 		return 0;
 
-	visited[group_base(g)] = 1;
+	marks_set(visited, group_base(g));
 	if (f(b, color, g, data) == -1)
 		return -1;
 
@@ -211,7 +213,7 @@ foreach_connected_group_(struct board *b, enum stone color, group_t g,
 				if (board_at(b, c) != color)
 					continue;
 				group_t g2 = group_at(b, c);
-				if (visited[g2] || !virtual_connection_at(b, color, lib, c, g, g2))
+				if (marks_test(visited, g2) || !virtual_connection_at(b, color, lib, c, g, g2))
 					continue;
 				if (foreach_connected_group_(b, color, g2, f, data, visited) == -1)
 					return -1;
@@ -225,14 +227,15 @@ static void
 foreach_connected_group(struct board *b, enum stone color, coord_t to,
 			foreach_connected_group_t f, void *data)
 {
-	int visited[BOARD_MAX_COORDS] = {0, };
+	struct marks *visited = marks_get();
 	assert(board_at(b, to) == color);
 	group_t g = group_at(b, to);
 	foreach_connected_group_(b, color, g, f, data, visited);
+	marks_put(visited);
 }
 
 struct foreach_lib_data {
-	int *visited;
+	struct marks *visited;
 	foreach_in_connected_groups_t f;
 	void *data;
 };
@@ -243,9 +246,9 @@ foreach_lib_handler(struct board *b, enum stone color, group_t g, void *data)
 	struct foreach_lib_data *d = data;
 	for (int i = 0; i < board_group_info(b, g).libs; i++) {
 		coord_t lib = board_group_info(b, g).lib[i];
-		if (d->visited[lib])
+		if (marks_test(d->visited, lib))
 			continue;
-		d->visited[lib] = 1;
+		marks_set(d->visited, lib);
 		if (d->f(b, color, lib, d->data) == -1)
 			return -1;
 	}
@@ -257,31 +260,33 @@ static void
 foreach_lib_in_connected_groups(struct board *b, enum stone color, coord_t to,
 				foreach_in_connected_groups_t f, void *data)
 {
-	int visited[BOARD_MAX_COORDS] = {0, };
+	struct marks *visited = marks_get();
 	struct foreach_lib_data d = { .visited = visited, .f = f, .data = data };	
 	foreach_connected_group(b, color, to, foreach_lib_handler, &d);
+	marks_put(visited);
 }
 
 
 static int
 stones_all_connected_handler(struct board *b,  enum stone color, coord_t c, void *data)
 {
-	int *connected = data;
-	connected[c] = 1;  return 0;
+	struct marks *connected = data;
+	marks_set(connected, c);  return 0;
 }
 
 static bool
 stones_all_connected(struct board *b, enum stone color, coord_t *stones, int n)
 {
 	// TODO optimize: check if all same group first ...
-	int connected[BOARD_MAX_COORDS] = {0, };
+	struct marks *connected = marks_get();
 	
 	foreach_in_connected_groups(b, color, stones[0], stones_all_connected_handler, connected);
 
-	for (int i = 0; i < n; i++)
-		if (!connected[stones[i]])
-			return false;
-	return true;
+	bool all = true;
+	for (int i = 0; all && i < n; i++)
+		all = marks_test(connected, stones[i]);
+	marks_put(connected);
+	return all;
 }
 
 /* Try to detect big eye area, ie:
@@ -290,7 +295,7 @@ stones_all_connected(struct board *b, enum stone color, coord_t *stones, int n)
  *  - size >= 2  (so no false eye issues)
  * Returns size of the area, or 0 if doesn't match.  */
 int
-big_eye_area(struct board *b, enum stone color, coord_t around, int *visited)
+big_eye_area(struct board *b, enum stone color, coord_t around, struct marks *visited)
 {
 	int NAKADE_MAX = 8;  // min area size for living group (corner)
 	                     // could increase to 10 (side) and 12 (middle)
@@ -302,7 +307,7 @@ big_eye_area(struct board *b, enum stone color, coord_t around, int *visited)
 	int stones_n = 0;
 	area[area_n++] = around;
 
-	assert(!visited[around]);
+	assert(!marks_test(visited, around));
 	for (int i = 0; i < area_n; i++) {
 		foreach_neighbor(b, area[i], {
 			if (board_at(b, c) == S_OFFBOARD)
@@ -344,7 +349,7 @@ big_eye_area(struct board *b, enum stone color, coord_t around, int *visited)
 	// Ok good, mark area visited
 	// TODO if (area_n < 7) ...
 	for (int i = 0; i < area_n; i++) 
-		visited[area[i]] = 1;	
+		marks_set(visited, area[i]);
 
 	return area_n;
 }
@@ -446,7 +451,7 @@ is_real_two_point_eye(struct board *b, coord_t to, enum stone color, coord_t *po
 }
 
 struct safe_data {
-	int *visited;
+	struct marks *visited;
 	int *eyes;
 };
 
@@ -454,7 +459,7 @@ static int
 count_eyes(struct board *b, enum stone color, coord_t lib, void *data)
 {	
 	struct safe_data *d = data;
-	if (d->visited[lib])  /* Don't visit big eyes multiple times */
+	if (marks_test(d->visited, lib))  /* Don't visit big eyes multiple times */
 		return 0;
 
 	if (is_real_one_point_eye(b, lib, color))  {
@@ -467,7 +472,7 @@ count_eyes(struct board *b, enum stone color, coord_t lib, void *data)
 	coord_t other = pass;
 	if (is_real_two_point_eye(b, lib, color, &other))  {
 		// fprintf(stderr, "two-point eye: %s\n", coord2sstr(lib, b));
-		d->visited[other] = 1;
+		marks_set(d->visited, other);
 		if (++(*d->eyes) >= 2)
 			return -1;
 		return 0;
@@ -486,7 +491,7 @@ count_eyes(struct board *b, enum stone color, coord_t lib, void *data)
 }
 
 bool
-dragon_is_safe_full(struct board *b, group_t g, enum stone color, int *visited, int *eyes)
+dragon_is_safe_full(struct board *b, group_t g, enum stone color, struct marks *visited, int *eyes)
 {
 	struct safe_data d = { .visited = visited, .eyes = eyes };
 	foreach_lib_in_connected_groups(b, color, g, count_eyes, &d);
@@ -496,9 +501,11 @@ dragon_is_safe_full(struct board *b, group_t g, enum stone color, int *visited,
 bool
 dragon_is_safe(struct board *b, group_t g, enum stone color)
 {
-	int visited[BOARD_MAX_COORDS] = {0, };
+	struct marks *visited = marks_get();
 	int eyes = 0;
-	return dragon_is_safe_full(b, g, color, visited, &eyes);
+	bool safe = dragon_is_safe_full(b, g, color, visited, &eyes);
+	marks_put(visited);
+	return safe;
 }
 
 
@@ -586,7 +593,7 @@ dragon_at(struct board *b, coord_t to)
 
 /* Vertical gap ? */
 static inline bool
-is_vert_gap(struct board *b, enum stone color, int *connected, int lx, int ly,    int x, int dy) 
+is_vert_gap(struct board *b, enum stone color, struct marks *connected, int lx, int ly,    int x, int dy) 
 {
 	assert(dy);
 	for (int i = 0; i < GAP_LENGTH; i++) {
@@ -594,9 +601,9 @@ is_vert_gap(struct board *b, enum stone color, int *connected, int lx, int ly,
 		coord_t d = coord_xy(b, x, y);
 		if (board_at(b, d) == S_NONE)
 			continue;
-		if (board_at(b, d) == color && !connected[d])
+		if (board_at(b, d) == color && !marks_test(connected, d))
 			return false; // reach other group, could still be cut though ...
-		if (board_at(b, d) == color && connected[d])
+		if (board_at(b, d) == color && marks_test(connected, d))
 			return false; // wrong direction
 		return false;
 	}
@@ -606,7 +613,7 @@ is_vert_gap(struct board *b, enum stone color, int *connected, int lx, int ly,
 
 /* Horizontal gap ? */
 static inline bool
-is_horiz_gap(struct board *b, enum stone color, int *connected, int lx, int ly,   int y, int dx)
+is_horiz_gap(struct board *b, enum stone color, struct marks *connected, int lx, int ly,   int y, int dx)
 {
 	assert(dx);
 	for (int i = 0; i < GAP_LENGTH; i++) {
@@ -614,9 +621,9 @@ is_horiz_gap(struct board *b, enum stone color, int *connected, int lx, int ly,
 		coord_t d = coord_xy(b, x, y);
 		if (board_at(b, d) == S_NONE)
 			continue;
-		if (board_at(b, d) == color && !connected[d])
+		if (board_at(b, d) == color && !marks_test(connected, d))
 			return false; // reach other group, could still be cut though ...
-		if (board_at(b, d) == color && connected[d])
+		if (board_at(b, d) == color && marks_test(connected, d))
 			return false; // wrong direction
 		return false;
 	}
@@ -636,7 +643,7 @@ is_horiz_gap(struct board *b, enum stone color, int *connected, int lx, int ly,
  *    . O . X . .      
  */
 static bool
-two_stones_gap(struct board *b, enum stone color, coord_t lib, int *connected) 
+two_stones_gap(struct board *b, enum stone color, coord_t lib, struct marks *connected) 
 {
 	int lx = coord_x(lib, b);
 	int ly = coord_y(lib, b);		
@@ -655,15 +662,20 @@ two_stones_gap(struct board *b, enum stone color, coord_t lib, int *connected)
 	return false;
 }
 
+struct dragon_groups {
+	group_t groups[BOARD_MAX_COORDS];
+	int n;
+};
+
 static int
-mark_connected(struct board *b,  enum stone color, coord_t c, void *data)
+dragon_groups_handler(struct board *b, enum stone color, group_t g, void *data)
 {
-	int *connected = data;
-	connected[c] = 1;  return 0;
+	struct dragon_groups *d = data;
+	d->groups[d->n++] = g;  return 0;
 }
 
 struct surrounded_data {
-	int *connected;
+	struct marks *connected;
 	bool surrounded;
 };
 
@@ -676,7 +688,7 @@ surrounded_check(struct board *b,  enum stone color, coord_t lib, void *data)
 	}
 	/* Other group we could connect to ? */
 	foreach_neighbor(b, lib, {
-		if (board_at(b, c) == color && !d->connected[c]) {
+		if (board_at(b, c) == color && !marks_test(d->connected, c)) {
 			with_move(b, lib, color, {
 				if (!group_at(b, lib))
 					break;
@@ -693,13 +705,29 @@ dragon_is_surrounded(struct board *b, coord_t to)
 {
 	enum stone color = board_at(b, to);
 	assert(color == S_BLACK || color == S_WHITE);
-	int connected[BOARD_MAX_COORDS] = {0, };
+	struct marks *connected = marks_get();
+
+	/* Find the dragon's groups once, virtual connections are costly
+	 * to check. Both passes below go through them in the same order
+	 * as foreach_in_connected_groups() etc. would. */
+	struct dragon_groups dg = { .n = 0 };
+	foreach_connected_group(b, color, to, dragon_groups_handler, &dg);
 
 	/* Mark connected stones */
-	foreach_in_connected_groups(b, color, to, mark_connected, connected);
-	
+	for (int i = 0; i < dg.n; i++) {
+		foreach_in_group(b, dg.groups[i]) {
+			marks_set(connected, c);
+		} foreach_in_group_end;
+	}
+
 	struct surrounded_data d = { .connected = connected, .surrounded = 1 };
-	foreach_lib_in_connected_groups(b, color, to, surrounded_check, &d);
+	struct marks *visited = marks_get();
+	struct foreach_lib_data l = { .visited = visited, .f = surrounded_check, .data = &d };
+	for (int i = 0; i < dg.n; i++)
+		if (foreach_lib_handler(b, color, dg.groups[i], &l) == -1)
+			break;
+	marks_put(visited);
+	marks_put(connected);
 	return d.surrounded;
 }
 
@@ -7,6 +7,7 @@
  * Currently these are fairly expensive (dragon data is not cached) so shouldn't be
  * called by low-level / perf-critical code. */
 
+struct marks;
 
 /* Like group_at() but returns unique id for all stones in a dragon.
  * Depending on the situation what is considered to be a dragon here may or
@@ -34,7 +35,7 @@ char *pick_dragon_color(int i, bool bold, bool white_ok);
 bool dragon_is_safe(struct board *b, group_t g, enum stone color);
 
 /* Like group_is_safe() but passing already visited stones / eyes. */
-bool dragon_is_safe_full(struct board *b, group_t g, enum stone color, int *visited, int *eyes);
+bool dragon_is_safe_full(struct board *b, group_t g, enum stone color, struct marks *visited, int *eyes);
 
 /* Does one opposite color group neighbor of @g have 2 eyes ? */
 bool neighbor_is_safe(struct board *b, group_t g);
@@ -44,7 +45,7 @@ bool neighbor_is_safe(struct board *b, group_t g);
  *  - surrounding stones all connected to each other
  *  - size >= 2  (so no false eye issues)
  * Returns size of the area, or 0 if doesn't match.  */
-int big_eye_area(struct board *b, enum stone color, coord_t around, int *visited);
+int big_eye_area(struct board *b, enum stone color, coord_t around, struct marks *visited);
 
 /* Point we control: 
  * Opponent can't play there or we can capture if he does. */
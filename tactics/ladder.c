@@ -18,59 +18,103 @@
  * assume ladder doesn't work if countercapturing is possible. */
 #define MIDDLE_LADDER_CHECK_COUNTERCAP 1
 
+/* Per-thread cache of middle ladder reading outcomes, direct-mapped by
+ * position hash; a different position simply misses. Playouts keep
+ * asking about the same ladder move after move, and long ladders on
+ * 19x19 are expensive to read out. */
+#define LADDER_CACHE_BITS 12
+struct ladder_cache_entry {
+	hash_t key;
+	int length;
+};
+static __thread struct ladder_cache_entry *ladder_cache;
+
+
+/* Border ladder outcomes by the local shape along the edge, that is the
+ * stones two points away from the escape on both sides (S_NONE, friend,
+ * enemy or offboard):
+ *
+ * | ? s1
+ * | . O1 #     No ladder with friends at both s1 and s2, which is
+ * | c X  #     normally caught otherwise. A chaser shorter of two
+ * | . O2 #     liberties cannot block, and one with two liberties
+ * | ? s2       needs them apart and the point two away free not to
+ *              block into a self-atari. */
+#define BL_NONE   0
+#define BL_FRIEND 1
+#define BL_ENEMY  2
+#define BL_OFF    3
+#define BL_FAIL     1 // no ladder
+#define BL_O1_3LIBS 2 // O1 needs 3 liberties to block
+#define BL_O2_3LIBS 4 // O2 needs 3 liberties to block
+static unsigned char border_ladder_table[16];
+
+static void __attribute__((constructor))
+border_ladder_table_init(void)
+{
+	for (int s1 = 0; s1 < 4; s1++)
+		for (int s2 = 0; s2 < 4; s2++) {
+			unsigned char t = 0;
+			if (s1 == BL_FRIEND && s2 == BL_FRIEND)
+				t |= BL_FAIL;
+			if (s1 != BL_NONE)
+				t |= BL_O1_3LIBS;
+			if (s2 != BL_NONE)
+				t |= BL_O2_3LIBS;
+			border_ladder_table[s1 * 4 + s2] = t;
+		}
+}
 
-bool
-is_border_ladder(struct board *b, coord_t coord, group_t laddered, enum stone lcolor)
+static inline int
+border_ladder_stone(struct board *b, coord_t c, enum stone lcolor)
+{
+	enum stone s = board_at(b, c);
+	return s == S_NONE ? BL_NONE : s == lcolor ? BL_FRIEND : s == S_OFFBOARD ? BL_OFF : BL_ENEMY;
+}
+
+/* Can chaser @g block the escape along the border? */
+static inline bool
+border_ladder_blocks(struct board *b, group_t g, bool need3)
 {
-	if (can_countercapture(b, laddered, NULL, 0))
+	int libs = board_group_info(b, g).libs;
+	if (libs < 2)
 		return false;
-	
-	int x = coord_x(coord, b), y = coord_y(coord, b);
+	if (libs < 3 && (need3 || coord_is_adjecent(board_group_info(b, g).lib[0], board_group_info(b, g).lib[1], b)))
+		return false;
+	return true;
+}
 
+bool
+is_border_ladder(struct board *b, coord_t coord, group_t laddered, enum stone lcolor)
+{
 	if (DEBUGL(5))
 		fprintf(stderr, "border ladder\n");
-	/* Direction along border; xd is horiz. border, yd vertical. */
-	int xd = 0, yd = 0;
-	if (board_atxy(b, x + 1, y) == S_OFFBOARD || board_atxy(b, x - 1, y) == S_OFFBOARD)
-		yd = 1;
-	else
-		xd = 1;
-	/* Direction from the border; -1 is above/left, 1 is below/right. */
-	int dd = (board_atxy(b, x + yd, y + xd) == S_OFFBOARD) ? 1 : -1;
+	/* Directions along and away from the border. */
+	int x = coord_x(coord, b), y = coord_y(coord, b), size = board_size(b);
+	int along, inward;
+	if (x == 1 || x == size - 2) {
+		along = size; inward = x == 1 ? 1 : -1;
+	} else {
+		along = 1; inward = y == 1 ? size : -size;
+	}
+	/* Not in the corner, so two away along the border is still
+	 * within the board frame. */
+	int k1 = border_ladder_stone(b, coord + 2 * along, lcolor);
+	int k2 = border_ladder_stone(b, coord - 2 * along, lcolor);
+	unsigned char t = border_ladder_table[k1 * 4 + k2];
 	if (DEBUGL(6))
-		fprintf(stderr, "xd %d yd %d dd %d\n", xd, yd, dd);
-	/* | ? ?
-	 * | . O #
-	 * | c X #
-	 * | . O #
-	 * | ? ?   */
-	/* This is normally caught, unless we have friends both above
-	 * and below... */
-	if (board_atxy(b, x + xd * 2, y + yd * 2) == lcolor
-	    && board_atxy(b, x - xd * 2, y - yd * 2) == lcolor)
+		fprintf(stderr, "along %d inward %d table %d\n", along, inward, t);
+	if (t & BL_FAIL)
 		return false;
 
-	/* ...or can't block where we need because of shortage
-	 * of liberties. */
-	group_t g1 = group_atxy(b, x + xd - yd * dd, y + yd - xd * dd);
-	int libs1 = board_group_info(b, g1).libs;
-	group_t g2 = group_atxy(b, x - xd - yd * dd, y - yd - xd * dd);
-	int libs2 = board_group_info(b, g2).libs;
-	if (DEBUGL(6))
-		fprintf(stderr, "libs1 %d libs2 %d\n", libs1, libs2);
-	/* Already in atari? */
-	if (libs1 < 2 || libs2 < 2)
-		return false;
-	/* Would be self-atari? */
-	if (libs1 < 3 && (board_atxy(b, x + xd * 2, y + yd * 2) != S_NONE
-			  || coord_is_adjecent(board_group_info(b, g1).lib[0], board_group_info(b, g1).lib[1], b)))
-		return false;
-	if (libs2 < 3 && (board_atxy(b, x - xd * 2, y - yd * 2) != S_NONE
-			  || coord_is_adjecent(board_group_info(b, g2).lib[0], board_group_info(b, g2).lib[1], b)))
+	/* The local shape is fine, check the chasers can block. */
+	if (!border_ladder_blocks(b, group_at(b, coord + along + inward), t & BL_O1_3LIBS)
+	    || !border_ladder_blocks(b, group_at(b, coord - along + inward), t & BL_O2_3LIBS))
 		return false;
-	return true;
-}
 
+	/* The most expensive last. */
+	return !can_countercapture(b, laddered, NULL, 0);
+}
 
 
 static int middle_ladder_walk(struct board *b, group_t laddered, enum stone lcolor,
@@ -117,23 +161,22 @@ middle_ladder_chase(struct board *b, group_t laddered, enum stone lcolor, struct
 	}
 
 	/* Try out the alternatives. */
-	for (int i = 0; i < libs; i++) {		
-		coord_t ataristone = board_group_info(b, laddered).lib[liblist[i]];
+	coord_t ataristones[2];
+	for (int i = 0; i < libs; i++)
+		ataristones[i] = board_group_info(b, laddered).lib[liblist[i]];
 
-		with_move(b, ataristone, stone_other(lcolor), {
-			/* If we just played self-atari, abandon ship. */
-			if (board_group_info(b, group_at(b, ataristone)).libs <= 1)
-				break;
-			
-			if (DEBUGL(6))
-				fprintf(stderr, "(%d=0) ladder atari %s (%d libs)\n", i, coord2sstr(ataristone, b), board_group_info(b, group_at(b, ataristone)).libs);
+	foreach_probe_move(b, ataristones, libs, stone_other(lcolor), {
+		/* If we just played self-atari, abandon ship. */
+		if (board_group_info(b, group_at(b, c)).libs <= 1)
+			break;
 
-			int l = middle_ladder_walk(b, laddered, lcolor, ccq, prevmove, len);
-			if (l)
-				with_move_return(l);
-		});
+		if (DEBUGL(6))
+			fprintf(stderr, "ladder atari %s (%d libs)\n", coord2sstr(c, b), board_group_info(b, group_at(b, c)).libs);
 
-	}
+		int l = middle_ladder_walk(b, laddered, lcolor, ccq, prevmove, len);
+		if (l)
+			with_move_return(l);
+	});
 	
 	return 0;
 }
@@ -229,6 +272,140 @@ middle_ladder_walk(struct board *b, group_t laddered, enum stone lcolor,
 
 static __thread int length = 0;
 
+static inline hash_t
+ladder_cache_key(struct board *b, group_t laddered, enum stone lcolor)
+{
+	hash_t h = board_position_hash(b);
+	if (!h)
+		return 0;
+	/* Ko state and the last move are not part of the position hash
+	 * but matter to middle_ladder_walk(). */
+	return h ^ (laddered * 0x9e3779b97f4a7c15ULL)
+		 ^ ((b->ko.coord + 2) * 0xc2b2ae3d27d4eb4fULL)
+		 ^ ((b->last_move.coord + 2) * 0x165667b19e3779b9ULL)
+		 ^ ((hash_t) lcolor << 62);
+}
+
+/* The band around the path of a middle ladder which must be empty for
+ * the ladder to work without reading: with the escape at (0,0) and its
+ * two liberties at (1,0) and (0,1), the laddered group runs within
+ * |i - j| <= 1 of the diagonal and the chasers within 2; anything up to
+ * 3 away might break it. Row s of the band are the cells with i + j = s
+ * and i - j one of the offsets below, for even and odd rows. */
+static const signed char ladder_band[2][4] = { { -2, 0, 2, 0 }, { -3, -1, 1, 3 } };
+static const int ladder_band_len[2] = { 3, 4 };
+
+/* Quick middle ladder check, for the two cases which need no reading:
+ * the escape leaves the group in atari again, or the ladder works since
+ * nothing at all lies in its way to the edge and nothing around the
+ * start gives the laddered group a chance. Returns the length (estimated
+ * in the latter case), or 0 if the ladder has to be read out. */
+static int
+middle_ladder_scan(struct board *b, group_t laddered, enum stone lcolor, coord_t coord)
+{
+	if (b->ko.coord != pass)
+		return 0;
+
+	/* The escape must not connect or capture. */
+	int size = board_size(b);
+	int ex = coord_x(coord, b), ey = coord_y(coord, b);
+	int dirs[4][2], n = 0;
+	bool weak = false;
+	static const int d4[4][2] = { { 1, 0 }, { -1, 0 }, { 0, 1 }, { 0, -1 } };
+	for (int i = 0; i < 4; i++) {
+		coord_t c = coord + d4[i][0] + d4[i][1] * size;
+		enum stone s = board_at(b, c);
+		if (s == S_NONE) {
+			dirs[n][0] = d4[i][0]; dirs[n][1] = d4[i][1]; n++;
+		} else if (s == lcolor) {
+			if (group_at(b, c) != laddered)
+				return 0;
+		} else if (s != S_OFFBOARD) {
+			int libs = board_group_info(b, group_at(b, c)).libs;
+			if (libs < 2)
+				return 0;
+			weak |= libs < 3;
+		}
+	}
+	if (n <= 1)
+		return can_countercapture(b, laddered, NULL, 0) ? 0 : 1;
+
+	/* The liberties of the escape must be perpendicular. */
+	if (n != 2 || weak || dirs[0][0] == -dirs[1][0])
+		return 0;
+
+	/* No weak chaser the laddered group could ever capture. */
+	foreach_in_group(b, laddered) {
+		foreach_neighbor(b, c, {
+			if (board_at(b, c) == stone_other(lcolor)
+			    && board_group_info(b, group_at(b, c)).libs < 3)
+				return 0;
+		});
+	} foreach_in_group_end;
+
+	/* Walk the band until the diagonal leaves the board. */
+	int ux = dirs[0][0], uy = dirs[0][1], vx = dirs[1][0], vy = dirs[1][1];
+	/* The diagonal neighbors of the escape touching the band, (1,-1)
+	 * and (-1,1), are around the start: no friend, no weak chaser. */
+	for (int k = 0; k < 2; k++) {
+		int x = ex + (k ? -ux + vx : ux - vx), y = ey + (k ? -uy + vy : uy - vy);
+		enum stone s = board_atxy(b, x, y);
+		if (s == lcolor || (s == stone_other(lcolor) && board_group_info(b, group_atxy(b, x, y)).libs < 3))
+			return 0;
+	}
+	int steps = 0;
+	for (int s = 1; ; s++) {
+		int row = s & 1;
+		for (int k = 0; k < ladder_band_len[row]; k++) {
+			int d = ladder_band[row][k];
+			int i = (s + d) / 2, j = (s - d) / 2;
+			if (i < -1 || j < -1)
+				continue;
+			int x = ex + i * ux + j * vx, y = ey + i * uy + j * vy;
+			if (x < 1 || y < 1 || x > size - 2 || y > size - 2)
+				continue;
+			if (board_atxy(b, x, y) != S_NONE)
+				return 0;
+		}
+		/* The laddered group got to (i, j) with i + j = s. */
+		int cx = ex + (s / 2) * (ux + vx) + (s & 1) * ux;
+		int cy = ey + (s / 2) * (uy + vy) + (s & 1) * uy;
+		if (cx < 1 || cy < 1 || cx > size - 2 || cy > size - 2)
+			break;
+		steps++;
+	}
+	return steps ? steps : 1;
+}
+
+/* Read out middle ladder of @laddered starting with its escape. */
+static int
+middle_ladder_read(struct board *b, group_t laddered, enum stone lcolor)
+{
+	hash_t key = ladder_cache_key(b, laddered, lcolor);
+	struct ladder_cache_entry *e = NULL;
+	if (key) {
+		if (unlikely(!ladder_cache))
+			ladder_cache = calloc2(1 << LADDER_CACHE_BITS, sizeof(*ladder_cache));
+		e = &ladder_cache[key & ((1 << LADDER_CACHE_BITS) - 1)];
+		if (e->key == key)
+			return e->length;
+	}
+
+	int len = middle_ladder_scan(b, laddered, lcolor, board_group_info(b, laddered).lib[0]);
+	if (!len) {
+		/* We could escape by countercapturing a group. */
+		struct move_queue ccq = { .moves = 0 };
+		can_countercapture(b, laddered, &ccq, 0);
+
+		len = middle_ladder_walk(b, laddered, lcolor, &ccq, pass, 0);
+	}
+	if (e) {
+		e->key = key;
+		e->length = len;
+	}
+	return len;
+}
+
 bool
 is_middle_ladder(struct board *b, coord_t coord, group_t laddered, enum stone lcolor)
 {
@@ -248,12 +425,7 @@ is_middle_ladder(struct board *b, coord_t coord, group_t laddered, enum stone lc
 	/* A fair chance for a ladder. Group in atari, with some but limited
 	 * space to escape. Time for the expensive stuff - play it out and
 	 * start selective 2-liberty search. */
-
-	/* We could escape by countercapturing a group. */
-	struct move_queue ccq = { .moves = 0 };
-	can_countercapture(b, laddered, &ccq, 0);
-
-	length = middle_ladder_walk(b, laddered, lcolor, &ccq, pass, 0);
+	length = middle_ladder_read(b, laddered, lcolor);
 
 	if (DEBUGL(6) && length) {
 		fprintf(stderr, "is_ladder(): stones: %i  length: %i\n",
@@ -271,11 +443,7 @@ is_middle_ladder_any(struct board *b, coord_t coord, group_t laddered, enum ston
 	assert(board_group_info(b, laddered).lib[0] == coord);
 	assert(board_at(b, laddered) == lcolor);
 
-	/* We could escape by countercapturing a group. */
-	struct move_queue ccq = { .moves = 0 };
-	can_countercapture(b, laddered, &ccq, 0);
-	
-	length = middle_ladder_walk(b, laddered, lcolor, &ccq, pass, 0);
+	length = middle_ladder_read(b, laddered, lcolor);
 	return (length != 0);
 }
 
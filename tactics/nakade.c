@@ -1,6 +1,7 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #define QUICK_BOARD_CODE
 
@@ -46,26 +47,6 @@ nakade_area(struct board *b, coord_t around, enum stone color, coord_t *area)
 	return area_n;
 }
 
-static inline void
-get_neighbors(struct board *b, coord_t *area, int area_n, int *neighbors, int *ptbynei)
-{
-	/* We also collect adjecency information - how many neighbors
-	 * we have for each area point, and histogram of this. This helps
-	 * us verify the appropriate bulkiness of the shape. */
-        memset(neighbors, 0, area_n * sizeof(int));
-	for (int i = 0; i < area_n; i++) {
-		for (int j = i + 1; j < area_n; j++)
-			if (coord_is_adjecent(area[i], area[j], b)) {
-				ptbynei[neighbors[i]]--;
-				neighbors[i]++;
-				ptbynei[neighbors[i]]++;
-				ptbynei[neighbors[j]]--;
-				neighbors[j]++;
-				ptbynei[neighbors[j]]++;
-			}
-	}
-}
-
 static inline coord_t
 nakade_point_(coord_t *area, int area_n, int *neighbors, int *ptbynei)
 {
@@ -94,6 +75,118 @@ nakade_point_(coord_t *area, int area_n, int *neighbors, int *ptbynei)
 	return 0; /* NOTREACHED */
 }
 
+
+/* All the shapes an area can take, i.e. the fixed polyominoes of at
+ * most NAKADE_MAX points, are classified beforehand; the area is then
+ * looked up by its points within its bounding box (width w, at most
+ * 12 cells for a connected area of 6 points): the key is the cells
+ * bitmap, row by row, with (w - 1) << 12. */
+#define NAKADE_KEY_BITS 15
+#define NK_SHAPE 0x80 // valid entry
+#define NK_DEAD 0x40 // the area can be reduced to one eye
+#define NK_VITAL 0x0f // 1 + the cell index of the nakade point, 0 if none
+static uint8_t nakade_table[1 << NAKADE_KEY_BITS];
+
+struct nakade_cell { int x, y; };
+
+static int
+nakade_key(struct nakade_cell *cells, int n, int *xmin_, int *ymin_, int *w_)
+{
+	int xmin = cells[0].x, ymin = cells[0].y, xmax = xmin;
+	for (int i = 1; i < n; i++) {
+		if (cells[i].x < xmin) xmin = cells[i].x;
+		if (cells[i].x > xmax) xmax = cells[i].x;
+		if (cells[i].y < ymin) ymin = cells[i].y;
+	}
+	int w = xmax - xmin + 1;
+	int key = (w - 1) << 12;
+	for (int i = 0; i < n; i++) {
+		/* Make the cells relative to the bounding box. */
+		cells[i].x -= xmin; cells[i].y -= ymin;
+		key |= 1 << (cells[i].y * w + cells[i].x);
+	}
+	*xmin_ = xmin; *ymin_ = ymin; *w_ = w;
+	return key;
+}
+
+/* Classify the shape the same way the procedural check used to. */
+static uint8_t
+nakade_classify(struct nakade_cell *cells, int n, int w)
+{
+	coord_t area[NAKADE_MAX];
+	int neighbors[NAKADE_MAX] = { 0 }, ptbynei[9] = { n, 0 };
+	for (int i = 0; i < n; i++) {
+		area[i] = cells[i].y * w + cells[i].x;
+		for (int j = i + 1; j < n; j++)
+			if (abs(cells[i].x - cells[j].x) + abs(cells[i].y - cells[j].y) == 1) {
+				ptbynei[neighbors[i]]--;
+				neighbors[i]++;
+				ptbynei[neighbors[i]]++;
+				ptbynei[neighbors[j]]--;
+				neighbors[j]++;
+				ptbynei[neighbors[j]]++;
+			}
+	}
+
+	coord_t nakade = nakade_point_(area, n, neighbors, ptbynei);
+	uint8_t v = NK_SHAPE | (is_pass(nakade) ? 0 : nakade + 1);
+	if (n <= 3 || (n == 4 && ptbynei[2] == 4) || !is_pass(nakade))
+		v |= NK_DEAD; // up to three, square four and nakade shapes
+	return v;
+}
+
+static void __attribute__((constructor))
+nakade_table_init(void)
+{
+	/* Grow the shapes a point at a time. 216 shapes of 6 points. */
+	static struct nakade_cell shapes[2][256][NAKADE_MAX];
+	int count = 1, cur = 0;
+	shapes[0][0][0] = (struct nakade_cell) { 0, 0 };
+	int xmin, ymin, w;
+	int key = nakade_key(shapes[0][0], 1, &xmin, &ymin, &w);
+	nakade_table[key] = nakade_classify(shapes[0][0], 1, w);
+
+	for (int n = 1; n < NAKADE_MAX; n++, cur = !cur) {
+		int next = 0;
+		for (int s = 0; s < count; s++) {
+			for (int i = 0; i < n; i++) {
+				static const int dx[4] = { -1, 1, 0, 0 }, dy[4] = { 0, 0, -1, 1 };
+				for (int d = 0; d < 4; d++) {
+					struct nakade_cell c = { shapes[cur][s][i].x + dx[d], shapes[cur][s][i].y + dy[d] };
+					bool dup = false;
+					for (int j = 0; j < n; j++)
+						dup |= shapes[cur][s][j].x == c.x && shapes[cur][s][j].y == c.y;
+					if (dup) continue;
+
+					assert(next < 256);
+					struct nakade_cell *shape = shapes[!cur][next];
+					memcpy(shape, shapes[cur][s], n * sizeof(*shape));
+					shape[n] = c;
+					key = nakade_key(shape, n + 1, &xmin, &ymin, &w);
+					if (nakade_table[key])
+						continue;
+					nakade_table[key] = nakade_classify(shape, n + 1, w);
+					next++;
+				}
+			}
+		}
+		count = next;
+	}
+}
+
+/* Look up the shape of the area. Returns its table entry, the bounding
+ * box origin and width. */
+static inline uint8_t
+nakade_shape(struct board *b, coord_t *area, int area_n, int *xmin, int *ymin, int *w)
+{
+	struct nakade_cell cells[NAKADE_MAX];
+	for (int i = 0; i < area_n; i++)
+		cells[i] = (struct nakade_cell) { coord_x(area[i], b), coord_y(area[i], b) };
+	uint8_t v = nakade_table[nakade_key(cells, area_n, xmin, ymin, w)];
+	assert(v & NK_SHAPE);
+	return v;
+}
+
 coord_t
 nakade_point(struct board *b, coord_t around, enum stone color)
 {
@@ -103,10 +196,11 @@ nakade_point(struct board *b, coord_t around, enum stone color)
 	if (area_n == -1)
 		return pass;
 
-	int neighbors[area_n]; int ptbynei[9] = {area_n, 0};
-	get_neighbors(b, area, area_n, neighbors, ptbynei);
-	
-	return nakade_point_(area, area_n, neighbors, ptbynei);
+	int xmin, ymin, w;
+	int vital = nakade_shape(b, area, area_n, &xmin, &ymin, &w) & NK_VITAL;
+	if (!vital)
+		return pass;
+	return coord_xy(b, xmin + (vital - 1) % w, ymin + (vital - 1) / w);
 }
 
 
@@ -118,14 +212,7 @@ nakade_dead_shape(struct board *b, coord_t around, enum stone color)
 	area_n = nakade_area(b, around, color, area);
 	if (area_n == -1)	return false;
 	if (area_n <= 3)	return true;
-	
-	int neighbors[area_n]; int ptbynei[9] = {area_n, 0};
-	get_neighbors(b, area, area_n, neighbors, ptbynei);
-	
-	if (area_n == 4 && ptbynei[2] == 4)  // square 4
-		return true;
-	
-	/* nakade_point() should be able to deal with the rest ... */
-	coord_t nakade = nakade_point_(area, area_n, neighbors, ptbynei);
-	return  nakade != pass;
+
+	int xmin, ymin, w;
+	return nakade_shape(b, area, area_n, &xmin, &ymin, &w) & NK_DEAD;
 }
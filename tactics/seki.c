@@ -10,6 +10,7 @@
 #include "tactics/1lib.h"
 #include "tactics/dragon.h"
 #include "tactics/seki.h"
+#include "tactics/util.h"
 
 
 bool
@@ -75,13 +76,13 @@ breaking_3_stone_seki(struct board *b, coord_t coord, enum stone color)
 	 * If it can countercapture for sure it's not completely surrounded */
 	if (can_countercapture(b, g3, NULL, 0))
 		return false;
-	int visited[BOARD_MAX_COORDS] = {0, };
-	if (!big_eye_area(b, color, group_base(g3), visited))
-		return false;
-	
+	struct marks *visited = marks_get();
 	/* Already have 2 eyes ? No need for seki then */
 	int eyes = 1;
-	if (dragon_is_safe_full(b, own, color, visited, &eyes))
+	bool done = (!big_eye_area(b, color, group_base(g3), visited) ||
+		     dragon_is_safe_full(b, own, color, visited, &eyes));
+	marks_put(visited);
+	if (done)
 		return false;
 
 	/* Safe after capturing these stones ? */
@@ -678,8 +678,8 @@ init_selfatari_state(struct board *b, enum stone color, coord_t to, struct selfa
 	});	
 }
 
-bool
-is_bad_selfatari_slow(struct board *b, enum stone color, coord_t to, int flags)
+static bool
+is_bad_selfatari_read(struct board *b, enum stone color, coord_t to, int flags)
 {
 	if (DEBUGL(5))
 		fprintf(stderr, "sar check %s %s\n", stone2str(color), coord2sstr(to, b));
@@ -720,6 +720,39 @@ is_bad_selfatari_slow(struct board *b, enum stone color, coord_t to, int flags)
 	return true;
 }
 
+/* Per-thread memo of slow self-atari verdicts, direct-mapped by
+ * position hash. Moggy asks about the same candidate moves several
+ * times in one position (pattern, local tactics and permit checks);
+ * a changed position simply misses. */
+#define SELFATARI_CACHE_BITS 12
+struct selfatari_cache_entry {
+	hash_t key;
+	bool bad;
+};
+static __thread struct selfatari_cache_entry *selfatari_cache;
+
+bool
+is_bad_selfatari_slow(struct board *b, enum stone color, coord_t to, int flags)
+{
+	hash_t h = board_position_hash(b);
+	if (!h)
+		return is_bad_selfatari_read(b, color, to, flags);
+
+	/* The query as bit fields: coord | color (2 bits) | flags. */
+	assert(!(flags >> SELFATARI_FLAGS_BITS));
+	hash_t query = ((hash_t) to << (2 + SELFATARI_FLAGS_BITS)) | ((hash_t) color << SELFATARI_FLAGS_BITS) | flags;
+	hash_t key = h ^ (query * 0x9e3779b97f4a7c15ULL);
+	if (unlikely(!selfatari_cache))
+		selfatari_cache = calloc2(1 << SELFATARI_CACHE_BITS, sizeof(*selfatari_cache));
+	struct selfatari_cache_entry *e = &selfatari_cache[key & ((1 << SELFATARI_CACHE_BITS) - 1)];
+	if (e->key == key)
+		return e->bad;
+
+	bool bad = is_bad_selfatari_read(b, color, to, flags);
+	e->key = key;
+	e->bad = bad;
+	return bad;
+}
 
 coord_t
 selfatari_cousin(struct board *b, enum stone color, coord_t coord, group_t *bygroup)
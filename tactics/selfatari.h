@@ -32,6 +32,7 @@ coord_t selfatari_cousin(struct board *b, enum stone color, coord_t coord, group
 
 #define SELFATARI_3LIB_SUICIDE		1
 #define SELFATARI_BIG_GROUPS_ONLY	2
+#define SELFATARI_FLAGS_BITS		2 // bits taken by the flags above
 
 bool is_bad_selfatari_slow(struct board *b, enum stone color, coord_t to, int flags);
 
@@ -1,6 +1,8 @@
 #include <assert.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #define DEBUG
 #include "board.h"
@@ -8,6 +10,64 @@
 #include "tactics/util.h"
 
 
+struct marks_stack {
+	int n, size;
+	struct marks **sets;
+};
+
+static __thread struct marks_stack *marks_stack;
+static pthread_key_t marks_key;
+static pthread_once_t marks_once = PTHREAD_ONCE_INIT;
+
+static void
+marks_stack_free(void *data)
+{
+	struct marks_stack *s = data;
+	for (int i = 0; i < s->size; i++)
+		free(s->sets[i]);
+	free(s->sets);
+	free(s);
+}
+
+static void
+marks_key_init(void)
+{
+	pthread_key_create(&marks_key, marks_stack_free);
+}
+
+struct marks *
+marks_get(void)
+{
+	struct marks_stack *s = marks_stack;
+	if (unlikely(!s)) {
+		pthread_once(&marks_once, marks_key_init);
+		s = marks_stack = calloc2(1, sizeof(*s));
+		pthread_setspecific(marks_key, s);
+	}
+	if (unlikely(s->n == s->size)) {
+		int size = s->size ? s->size * 2 : 4;
+		s->sets = realloc2(s->sets, size * sizeof(*s->sets));
+		for (int i = s->size; i < size; i++)
+			s->sets[i] = calloc2(1, sizeof(struct marks));
+		s->size = size;
+	}
+	struct marks *m = s->sets[s->n++];
+	/* A new generation unmarks everything, except on wraparound. */
+	if (unlikely(!++m->gen)) {
+		memset(m->stamp, 0, sizeof(m->stamp));
+		m->gen = 1;
+	}
+	return m;
+}
+
+void
+marks_put(struct marks *m)
+{
+	assert(marks_stack->sets[marks_stack->n - 1] == m);
+	marks_stack->n--;
+}
+
+
 bool
 board_stone_radar(struct board *b, coord_t coord, int distance)
 {
@@ -42,9 +102,13 @@ cfg_distances(struct board *b, coord_t start, int *distances, int maxdist)
 #define qinc(x) (x = ((x + 1) >= board_size2(b) ? ((x) + 1 - board_size2(b)) : (x) + 1))
 	coord_t queue[board_size2(b)]; int qstart = 0, qstop = 0;
 
-	foreach_point(b) {
-		distances[c] = board_at(b, c) == S_OFFBOARD ? maxdist + 1 : -1;
-	} foreach_point_end;
+	/* The BFS reaches only a few points around start, so the
+	 * two whole-board passes are the bulk of the work; keep
+	 * them plain (vectorizable) loops and leave the edge
+	 * checks to the BFS itself. */
+	int size2 = board_size2(b);
+	for (int i = 0; i < size2; i++)
+		distances[i] = -1;
 
 	queue[qstop++] = start;
 	for (int d = 0; d <= maxdist; d++) {
@@ -56,7 +120,8 @@ cfg_distances(struct board *b, coord_t start, int *distances, int maxdist)
 #define cfg_one(coord, grp) do {\
 	distances[coord] = d; \
 	foreach_neighbor (b, coord, { \
-		if (distances[c] < 0 && (!grp || group_at(b, coord) != grp)) { \
+		if (distances[c] < 0 && board_at(b, c) != S_OFFBOARD \
+		    && (!grp || group_at(b, coord) != grp)) { \
 			queue[qstop] = c; \
 			qinc(qstop); \
 		} \
@@ -77,10 +142,8 @@ cfg_distances(struct board *b, coord_t start, int *distances, int maxdist)
 		}
 	}
 
-	foreach_point(b) {
-		if (distances[c] < 0)
-			distances[c] = maxdist + 1;
-	} foreach_point_end;
+	for (int i = 0; i < size2; i++)
+		distances[i] = distances[i] < 0 ? maxdist + 1 : distances[i];
 }
 
 
@@ -53,6 +53,32 @@ int board_estimated_moves_left(struct board *b);
  * encourage taking off external liberties during a semeai. */
 static double board_local_value(bool scan_neis, struct board *b, coord_t coord, enum stone color);
 
+/* Scratch marks on the board points which never need clearing: a point
+ * is marked iff its stamp is the current generation of the set. The sets
+ * come from a per-thread stack, so that nested tactical queries each get
+ * their own; marks_put() them in the reverse order of marks_get(). */
+struct marks {
+	unsigned int gen;
+	unsigned int stamp[BOARD_MAX_COORDS];
+};
+
+struct marks *marks_get(void);
+void marks_put(struct marks *m);
+static bool marks_test(struct marks *m, coord_t c);
+static void marks_set(struct marks *m, coord_t c);
+
+
+static inline bool
+marks_test(struct marks *m, coord_t c)
+{
+	return m->stamp[c] == m->gen;
+}
+
+static inline void
+marks_set(struct marks *m, coord_t c)
+{
+	m->stamp[c] = m->gen;
+}
 
 static inline int
 coord_edge_distance(coord_t c, struct board *b)
@@ -12,8 +12,19 @@
 #include "tactics/util.h"
 #include "timeinfo.h"
 
-/* Max net lag in seconds. TODO: estimate dynamically. */
+/* Max net lag in seconds, used until it is estimated (see struct time_lag). */
 #define MAX_NET_LAG 2.0
+/* Samples needed before the lag estimate is used, and their weight. */
+#define LAG_MIN_SAMPLES 3
+#define LAG_EWMA 0.25
+/* Time reserved for lag: the mean plus this many deviations, bounded. */
+#define LAG_DEVIATIONS 2
+#define MIN_NET_LAG 0.3
+#define MAX_EST_NET_LAG 10.0
+/* Samples beyond this are clock mismatches (e.g. of byoyomi periods). */
+#define MAX_LAG_SAMPLE 10.0
+/* Peers report whole seconds. */
+#define LAG_ROUNDING 1.0
 /* Minimal thinking time; in case reserved time gets smaller than MAX_NET_LAG,
  * this makes sure we play minimally sensible moves even in massive time
  * pressure; we still keep MAX_NET_LAG-MIN_THINK_WITH_LAG safety margin.
@@ -100,6 +111,61 @@ time_settings(struct time_info *ti, int main_time, int byoyomi_time, int byoyomi
 	}
 }
 
+/* Compare the peer's clock with ours after our move. */
+static void
+lag_sample(struct time_info *ti, int time_left, int stones_left)
+{
+	double move_time = ti->lag_move_time;
+	ti->lag_move_time = 0;
+	if (!ti->lag || !move_time || ti->dim != TD_WALLTIME)
+		return;
+
+	double ours;
+	if (ti->period == TT_TOTAL && stones_left == 0 && time_left > 0)
+		ours = ti->len.t.main_time;
+	else if (ti->period == TT_MOVE && stones_left > 0)
+		ours = ti->len.t.byoyomi_time;
+	else
+		return; // not in the same period
+	/* Our clock may be running already. */
+	if (ti->len.t.timer_start > move_time)
+		ours -= time_now() - ti->len.t.timer_start;
+
+	double lag = ours - time_left;
+	if (lag < -LAG_ROUNDING || lag > MAX_LAG_SAMPLE)
+		return;
+	if (lag < 0)
+		lag = 0;
+
+	struct time_lag *l = ti->lag;
+	if (!l->samples++) {
+		l->mean = lag;
+		l->var = 0;
+	} else {
+		double d = lag - l->mean;
+		l->mean += LAG_EWMA * d;
+		l->var = (1 - LAG_EWMA) * (l->var + LAG_EWMA * d * d);
+	}
+	if (DEBUGL(3))
+		fprintf(stderr, "net lag %0.2f, estimate %0.2f +- %0.2f (%d samples)\n",
+			lag, l->mean, sqrt(l->var), l->samples);
+}
+
+/* Time to reserve for the net lag. */
+static double
+lag_estimate(struct time_info *ti)
+{
+	struct time_lag *l = ti->lag;
+	if (!l || l->samples < LAG_MIN_SAMPLES)
+		return MAX_NET_LAG;
+	double lag = l->mean + LAG_DEVIATIONS * sqrt(l->var);
+	if (lag < MIN_NET_LAG)
+		return MIN_NET_LAG;
+	if (lag > MAX_EST_NET_LAG)
+		return MAX_EST_NET_LAG;
+	return lag;
+}
+
 /* Update time information according to gtp time_left command.
  * kgs doesn't give time_left for the first move, so make sure
  * that just time_settings + time_stop_conditions still work. */
@@ -107,6 +173,7 @@ void
 time_left(struct time_info *ti, int time_left, int stones_left)
 {
 	assert(ti->period != TT_NULL);
+	lag_sample(ti, time_left, stones_left);
 	ti->dim = TD_WALLTIME;
 
 	if (!time_left && !stones_left) {
@@ -150,6 +217,8 @@ void
 time_sub(struct time_info *ti, double interval, bool new_move)
 {
 	assert(ti->dim == TD_WALLTIME && ti->period != TT_NULL);
+	if (new_move)
+		ti->lag_move_time = time_now();
 
 	if (ti->period == TT_TOTAL) {
 		ti->len.t.main_time -= interval;
@@ -204,6 +273,18 @@ time_now(void)
 #endif
 }
 
+double
+time_now_coarse(void)
+{
+#ifdef CLOCK_REALTIME_COARSE
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME_COARSE, &now);
+	return now.tv_sec + now.tv_nsec/1000000000.0;
+#else
+	return time_now();
+#endif
+}
+
 /* Sleep for a given interval (in seconds). Return immediately if interval < 0. */
 void
 time_sleep(double interval)
@@ -364,9 +445,8 @@ time_stop_conditions(struct time_info *ti, struct board *b, int fuseki_end, int
 
 
 	/* Minimum net lag (seconds) to be reserved in the time for move. */
-	double net_lag = MAX_NET_LAG;
+	double net_lag = lag_estimate(ti);
 	net_lag += time_now() - ti->len.t.timer_start;
-	// TODO: keep statistics to get good estimate of lag not just current move
 
 
 	if (ti->period == TT_TOTAL && time_in_byoyomi(ti)) {
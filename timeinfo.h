@@ -12,6 +12,17 @@
 
 #include "board.h"
 
+/* Network lag estimate for a GTP peer keeping our clock: after each
+ * of our moves, the time_left the peer reports is compared with our
+ * own count, the difference being the time lost on the way (plus the
+ * rounding of the peer). Shared by the time_info of both colors, for
+ * all the games with the peer. */
+struct time_lag {
+	int samples;
+	/* Exponentially weighted. */
+	double mean, var;
+};
+
 struct time_info {
 	/* For how long we can spend the time? */
 	enum time_period {
@@ -59,6 +70,12 @@ struct time_info {
 	 * which will be ignored. This is the case if the time settings were
 	 * forced on the command line. */
 	bool ignore_gtp;
+
+	/* Lag estimate to use instead of the fixed safety margin, if set. */
+	struct time_lag *lag;
+	/* We moved at this time and the peer did not send time_left since;
+	 * 0 if not. */
+	double lag_move_time;
 };
 
 /* Parse time information provided in custom format:
@@ -73,7 +90,8 @@ bool time_parse(struct time_info *ti, char *s);
  * main_time < 0 implies no time limit. */
 void time_settings(struct time_info *ti, int main_time, int byoyomi_time, int byoyomi_stones, int byoyomi_periods);
 
-/* Update time information according to gtp time_left command. */
+/* Update time information according to gtp time_left command;
+ * feeds ti->lag too. */
 void time_left(struct time_info *ti, int time_left, int stones_left);
 
 /* Start our timer. kgs does this (correctly) on "play" not "genmove"
@@ -85,6 +103,9 @@ void time_sub(struct time_info *ti, double interval, bool new_move);
 
 /* Returns the current time. */
 double time_now(void);
+/* The same at the resolution of the kernel tick (a few ms), without
+ * a syscall: for the timestamps taken often, by the search threads. */
+double time_now_coarse(void);
 
 /* Sleep for a given interval (in seconds). Return immediately if interval < 0. */
 void time_sleep(double interval);
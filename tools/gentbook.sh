@@ -2,9 +2,11 @@
 size="$1" # board size
 opts="$2" # UCT engine options; must NOT specify different policy
 popts="$3" # UCT policy options
+jobs="$4" # pachi processes growing the book at once
 [ -n "$size" ] || size=9
 [ -z "$opts" ] || opts=",$opts"
 [ -z "$popts" ] || popts=":$popts"
+[ -n "$jobs" ] || jobs=1
 
 if [ "$size" -le 13 ]; then
 	games=400000
@@ -12,14 +14,17 @@ else
 	games=200000
 fi
 
-rm ucttbook-$size-7.5.pachitree
+rm -f ucttbook-$size-7.5.pachitree
 n=0
 gentbook1()
 {
 	echo "[#$n:$1]"
 	n=$((n+1))
 	echo -e 'boardsize '$size'\nclear_board\nkomi 7.5\npachi-gentbook b' |
-		./pachi -t =$games "policy=ucb1amaf:explore_p=$1$popts$opts"
+		./pachi -t =$games "policy=ucb1amaf:explore_p=$1$popts$opts" &
+	# Each process merges its playouts into the book when saving,
+	# see tree_save().
+	[ $((n % jobs)) -ne 0 ] || wait
 }
 gentbook1 0.0
 gentbook1 0.1
@@ -31,3 +36,4 @@ gentbook1 0.1
 gentbook1 0.0
 gentbook1 0.0
 gentbook1 0.0
+wait
@@ -1,8 +1,14 @@
 #!/bin/sh
 # pattern_bayes_gen: Generate pattern probability table from a SGF collection
 # (or stdin GTP stream).
+#
+# Set THREADS to the number of threads scanning the SGF collection.
 
-(if [ x"$1" = x"-" ]; then cat; else for i in "$@"; do echo $i >&2; tools/sgf2gtp.pl <$i; done; fi) |
+if [ x"$1" != x"-" ]; then
+	exec ./pachi -d 0 -e scan_corpus spat_split_sizes,threads=${THREADS:-1} "$@"
+fi
+
+cat |
 	./pachi -d 0 -e patternscan competition,spat_split_sizes |
 	perl -nle '
 		BEGIN { use List::MoreUtils qw(uniq); }
@@ -15,15 +15,16 @@
 #	PATARGS="competition" ./pattern_spatial_gen.sh ...
 #
 # Similarly, you can set SPATMIN to different number than 4 to include
-# spatial features with other number of occurences.
+# spatial features with other number of occurences, and THREADS to the
+# number of threads scanning the games.
 
 [ -n "$SPATMIN" ] || SPATMIN=4
+[ -n "$THREADS" ] || THREADS=1
 
 rm -f patterns.spat
 
 echo " Gathering population of spatials occuring more than $SPATMIN times..."
-(for i in "$@"; do echo $i >&2; tools/sgf2gtp.pl <$i; done) |
-	./pachi -d 0 -e patternscan gen_spat_dict,no_pattern_match,spat_threshold=$SPATMIN${PATARGS:+,$PATARGS} >/dev/null
+./pachi -d 0 -e scan_corpus gen_spat_dict,spat_threshold=$SPATMIN,threads=$THREADS${PATARGS:+,$PATARGS} "$@"
 
 echo " Renumbering patterns.spat..."
 perl -i -pe '/^#/ and next; s/^\d+/++$a/e' patterns.spat
@@ -16,11 +16,71 @@
 static void
 generic_done(struct uct_dynkomi *d)
 {
+	if (d->hist) score_hist_done(d->hist);
 	if (d->data) free(d->data);
 	free(d);
 }
 
 
+struct score_hist *
+score_hist_init(int threads)
+{
+	struct score_hist *h = calloc2(1, sizeof(*h));
+	h->threads = threads;
+	h->counts = calloc2(threads, sizeof(*h->counts));
+	return h;
+}
+
+void
+score_hist_done(struct score_hist *h)
+{
+	free(h->counts);
+	free(h);
+}
+
+void
+score_hist_reset(struct score_hist *h)
+{
+	memset(h->counts, 0, h->threads * sizeof(*h->counts));
+	memset(h->sum, 0, sizeof(h->sum));
+	memset(h->base, 0, sizeof(h->base));
+}
+
+void
+score_hist_merge(struct score_hist *h)
+{
+	/* The rows are read while the threads write them; each count
+	 * is read whole, we just miss the latest increments. */
+	memset(h->sum, 0, sizeof(h->sum));
+	for (int t = 0; t < h->threads; t++)
+		for (int i = 0; i < SCORE_HIST_BINS; i++)
+			h->sum[i] += h->counts[t][i];
+}
+
+void
+score_hist_rebase(struct score_hist *h)
+{
+	memcpy(h->base, h->sum, sizeof(h->base));
+}
+
+floating_t
+score_hist_quantile(struct score_hist *h, bool since_base, floating_t q, int *playouts)
+{
+	unsigned int total = 0;
+	for (int i = 0; i < SCORE_HIST_BINS; i++)
+		total += h->sum[i] - (since_base ? h->base[i] : 0);
+	*playouts = total;
+
+	unsigned int seen = 0;
+	for (int i = 0; i < SCORE_HIST_BINS; i++) {
+		seen += h->sum[i] - (since_base ? h->base[i] : 0);
+		if (seen > q * total)
+			return (floating_t) (i - SCORE_HIST_MAX) / 2;
+	}
+	return (floating_t) SCORE_HIST_MAX / 2;
+}
+
+
 /* NONE dynkomi strategy - never fiddle with komi values. */
 
 struct uct_dynkomi *
@@ -273,6 +333,7 @@ struct dynkomi_adaptive {
 	floating_t komi_ratchet;
 
 	/* Score-based adaptation. */
+	floating_t score_quantile; // of the score distribution, 0 for the average
 	floating_t (*adapter)(struct uct_dynkomi *d, struct board *b);
 	floating_t adapt_base; // [0,1)
 	/* Sigmoid adaptation rate parameter; see below for details. */
@@ -329,12 +390,18 @@ static floating_t
 komi_by_score(struct uct_dynkomi *d, struct board *b, struct tree *tree, enum stone color)
 {
 	struct dynkomi_adaptive *a = d->data;
-	if (d->score.playouts < TRUSTWORTHY_KOMI_PLAYOUTS)
+	struct move_stats score = d->score;
+	if (a->score_quantile > 0) {
+		/* Quantile of the scores since last adjustment. */
+		score_hist_merge(d->hist);
+		score.value = score_hist_quantile(d->hist, true, a->score_quantile, &score.playouts);
+	}
+	if (score.playouts < TRUSTWORTHY_KOMI_PLAYOUTS)
 		return tree->extra_komi;
 
-	struct move_stats score = d->score;
 	/* Almost-reset tree->score to gather fresh stats. */
 	d->score.playouts = 1;
+	score_hist_rebase(d->hist);
 
 	/* Look at average score and push extra_komi in that direction. */
 	floating_t p = a->adapter(d, b);
@@ -578,6 +645,10 @@ uct_dynkomi_init_adaptive(struct uct *u, char *arg, struct board *b)
 				a->komi_ratchet_maxage = atoi(optval);
 
 				/* score indicator settings */
+			} else if (!strcasecmp(optname, "score_quantile") && optval) {
+				/* Follow this quantile of the scores (0.5 for
+				 * the median) rather than their average. */
+				a->score_quantile = atof(optval);
 			} else if (!strcasecmp(optname, "adapter") && optval) {
 				/* Adaptatation method. */
 				if (!strcasecmp(optval, "sigmoid")) {
@@ -40,6 +40,45 @@ typedef floating_t (*uctd_persim)(struct uct_dynkomi *d, struct board *b, struct
 /* Destroy the uct_dynkomi structure. */
 typedef void (*uctd_done)(struct uct_dynkomi *d);
 
+/* Distribution of the playout scores since the search start, in half
+ * points from black's perspective, clamped to +-SCORE_HIST_MAX. Each
+ * search thread counts its results in its own row, without locks or
+ * atomics; score_hist_merge() sums the rows for the readers, which run
+ * in the main thread. */
+#define SCORE_HIST_MAX 800
+#define SCORE_HIST_BINS (2 * SCORE_HIST_MAX + 1)
+
+struct score_hist {
+	int threads;
+	unsigned int (*counts)[SCORE_HIST_BINS];
+	/* Sum of the rows at the last merge, and at the last rebase. */
+	unsigned int sum[SCORE_HIST_BINS];
+	unsigned int base[SCORE_HIST_BINS];
+};
+
+struct score_hist *score_hist_init(int threads);
+void score_hist_done(struct score_hist *h);
+/* Clear the histogram; the search threads must not be running. */
+void score_hist_reset(struct score_hist *h);
+void score_hist_merge(struct score_hist *h);
+/* Start counting the results since_base from the last merge. */
+void score_hist_rebase(struct score_hist *h);
+/* Score at quantile @q of the merged results, black's perspective,
+ * only since the last rebase if @since_base; *playouts is set to the
+ * number of results. */
+floating_t score_hist_quantile(struct score_hist *h, bool since_base, floating_t q, int *playouts);
+
+/* Count the playout @result of search thread @tid. */
+static inline void
+score_hist_add(struct score_hist *h, int tid, int result)
+{
+	if (tid < 0 || tid >= h->threads)
+		return;
+	if (result > SCORE_HIST_MAX) result = SCORE_HIST_MAX;
+	if (result < -SCORE_HIST_MAX) result = -SCORE_HIST_MAX;
+	h->counts[tid][result + SCORE_HIST_MAX]++;
+}
+
 struct uct_dynkomi {
 	struct uct *uct;
 	uctd_permove permove;
@@ -54,6 +93,8 @@ struct uct_dynkomi {
 	/* Information on average winrate of simulations since last
 	 * dynkomi adjustment. */
 	struct move_stats value;
+	/* Scores of all simulations of the search. */
+	struct score_hist *hist;
 };
 
 struct uct_dynkomi *uct_dynkomi_init_none(struct uct *u, char *arg, struct board *b);
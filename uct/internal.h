@@ -3,6 +3,9 @@
 
 /* Internal UCT structures */
 
+#include <pthread.h>
+
+#include "dcnn.h"
 #include "debug.h"
 #include "move.h"
 #include "ownermap.h"
@@ -11,13 +14,16 @@
 #include "patternprob.h"
 #include "playout.h"
 #include "stats.h"
+#include "uct/numa.h"
 
 struct tree;
 struct tree_node;
+struct tree_cand;
 struct uct_policy;
 struct uct_prior;
 struct uct_dynkomi;
 struct uct_pluginset;
+struct uct_analysis;
 struct joseki_dict;
 
 /* How many games to consider at minimum before judging groups. */
@@ -35,33 +41,75 @@ struct uct {
 
 	int games, gamelen;
 	floating_t resign_threshold, sure_win_threshold;
+	floating_t resign_score_quantile;
 	double best2_ratio, bestr_ratio;
+	/* Forecast from the recent playout rate and root visit gap whether
+	 * the best move can still change; stop early or extend the search
+	 * accordingly (see uct_search_forecast()). */
+	bool forecast;
+	/* Stop once the second best move's value is less than stop_margin
+	 * above the best's by this many standard errors (0 disables). */
+	double stop_confidence;
+	floating_t stop_margin;
 	floating_t max_maintime_ratio;
 	bool pass_all_alive; /* Current value */
 	bool allow_losing_pass;
+	/* Dead stones estimation (final_status_list) plays between
+	 * dead_min_games and dead_max_games playouts, until the
+	 * judgement of all the stones is settled. */
+	int dead_min_games, dead_max_games;
 	bool territory_scoring;
 	int expand_p;
+	/* Adaptive expansion: past expand_p_memstart% of max_tree_size,
+	 * the threshold doubles with each further 1/16 of memory filled,
+	 * and children of main line nodes expand at expand_p / expand_p_pv. */
+	bool expand_p_adapt;
+	int expand_p_memstart;
+	int expand_p_pv;
 	bool playout_amaf;
 	bool amaf_prior;
 	int playout_amaf_cutoff;
 	double dumpthres;
 	int force_seed;
 	bool no_tbook;
+	char *checkpoint;
+	double checkpoint_interval;
+	int checkpoint_thres;
 	bool fast_alloc;
 	unsigned long max_tree_size;
 	unsigned long max_pruned_size;
 	unsigned long pruning_threshold;
+	int undo_history;
+	int evict; // percent of max_tree_size freed by tree_evict()
+	bool lazy_children;
+	int tt_hbits;
+	int tt_symmetry; // moves with symmetry-canonical transposition keys
 	int mercymin;
+	int playout_cutoff;
 	int significant_threshold;
 
 	int threads;
 	enum uct_thread_model {
 		TM_TREE, /* Tree parallelization w/o virtual loss. */
 		TM_TREEVL, /* Tree parallelization with virtual loss. */
+		TM_ROOT, /* Root parallelization, private tree per thread group. */
 	} thread_model;
+	int root_groups; /* TM_ROOT thread groups, 0 for one per thread. */
+	bool deterministic; /* Reproducible search, see walk.c. */
 	int virtual_loss;
+	int leaf_playouts; /* Playouts run from each descended leaf. */
+	enum numa_pin pin_threads;
 	bool pondering_opt; /* User wants pondering */
 	bool pondering; /* Actually pondering now */
+	int ponder_focus; /* Replies deepened by speculative pondering, see walk.c. */
+	int ponder_focus_playouts;
+	/* pachi-evaluate: one search with the root children picked by
+	 * a UCB1 bandit, see uct_evaluate_focus(); or a search per
+	 * candidate with evaluate_separate. */
+	bool evaluate_separate;
+	floating_t evaluate_explore;
+	bool evaluating; /* Running the shared evaluation search now */
+	struct uct_analysis *analysis; /* lz-analyze running, see uct_analyze() */
 	bool slave; /* Act as slave in distributed engine. */
 	int max_slaves; /* Optional, -1 if not set */
 	int slave_index; /* 0..max_slaves-1, or -1 if not set */
@@ -85,6 +133,7 @@ struct uct {
 	int random_policy_chance;
 	bool local_tree;
 	int tenuki_d;
+	int ltree_hbits;
 	floating_t local_tree_aging;
 #define LTREE_PLAYOUTS_MULTIPLIER 100
 	floating_t local_tree_depth_decay;
@@ -115,9 +164,26 @@ struct uct {
 	/* Various modules (prior, policy, ...) set this if they want pattern
 	 * database to be loaded. */
 	bool want_pat;
+	/* How to run the dcnn. */
+	struct dcnn_setup dcnn;
+	/* The pattern dictionaries and the dcnn are loaded by
+	 * background threads, see uct_load_start(). */
+	char *patterns_arg;
+	bool async_load;
+	pthread_t loaders[2];
+	int loaders_n;
 
 	/* Used within frame of single genmove. */
 	struct board_ownermap ownermap;
+	/* Hash of the position the ownermap is of. */
+	hash_t ownermap_hash;
+	/* Playouts between merges of the search threads' ownermaps
+	 * into u->ownermap; 0 for the default, see uct/walk.c. */
+	int ownermap_merge;
+	/* Root children of the last genmove by visits, see uct_root_stats(). */
+	coord_t root_coords[BOARD_MAX_MOVES + 1];
+	int root_visits[BOARD_MAX_MOVES + 1];
+	int root_n;
 	/* Used for coordination among slaves of the distributed engine. */
 	int stats_hbits;
 	int shared_nodes;
@@ -125,6 +191,15 @@ struct uct {
 	double stats_delay; /* stored in seconds */
 	int played_own;
 	int played_all; /* games played by all slaves */
+	/* Used for sharing stats with other processes on the same host. */
+	char *shm_name;
+	int shm_slots;
+	struct uct_shm *shm;
+	/* Root stats of deep searches kept from game to game. */
+	char *poscache_file;
+	int poscache_size;
+	int poscache_playouts;
+	struct uct_poscache *poscache;
 
 	/* Game state - maintained by setup_state(), reset_state(). */
 	struct tree *t;
@@ -147,6 +222,9 @@ struct uct_descent {
 	/* Active tree nodes: */
 	struct tree_node *node; /* Main tree. */
 	struct tree_node *lnode; /* Local tree. */
+	/* Candidate not taken yet, node being only a view of it;
+	 * see uctd_try_node_children(). */
+	struct tree_cand *cand;
 	/* Value of main tree node (with all value factors, but unbiased
 	 * - without exploration factor), from black's perspective. */
 	struct move_stats value;
@@ -158,7 +236,7 @@ typedef floating_t (*uctp_evaluate)(struct uct_policy *p, struct tree *tree, str
 typedef void (*uctp_descend)(struct uct_policy *p, struct tree *tree, struct uct_descent *descent, int parity, bool allow_pass);
 typedef void (*uctp_winner)(struct uct_policy *p, struct tree *tree, struct uct_descent *descent);
 typedef void (*uctp_prior)(struct uct_policy *p, struct tree *tree, struct tree_node *node, struct board *b, enum stone color, int parity);
-typedef void (*uctp_update)(struct uct_policy *p, struct tree *tree, struct tree_node *node, enum stone node_color, enum stone player_color, struct playout_amafmap *amaf, struct board *final_board, floating_t result);
+typedef void (*uctp_update)(struct uct_policy *p, struct tree *tree, struct tree_node *node, enum stone node_color, enum stone player_color, struct playout_amafmap *amaf, struct board *final_board, floating_t result, int playouts);
 typedef void (*uctp_done)(struct uct_policy *p);
 
 struct uct_policy {
@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEBUG
+#include "debug.h"
+#include "util.h"
+#include "uct/numa.h"
+
+static enum numa_pin pin_policy = NUMA_PIN_NONE;
+
+#if defined(__linux__) && !defined(NO_THREAD_LOCAL)
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+__thread int numa_thread_node = 0;
+
+/* cpus of each node with cpus, from /sys/devices/system/node/node<N>/cpulist */
+static int nodes = 0;
+static int *node_cpus[NUMA_MAX_NODES];
+static int node_ncpus[NUMA_MAX_NODES];
+
+/* Parse a cpu list like "0-7,16-23". */
+static int
+parse_cpulist(char *s, int **cpus)
+{
+	int n = 0, max = 0;
+	*cpus = NULL;
+	while (*s && *s != '\n') {
+		char *end;
+		int lo = strtol(s, &end, 10), hi = lo;
+		if (end == s) break;
+		if (*end == '-') hi = strtol(end + 1, &end, 10);
+		for (int c = lo; c <= hi; c++) {
+			if (n == max) {
+				max = max ? 2 * max : 16;
+				*cpus = realloc2(*cpus, max * sizeof(**cpus));
+			}
+			(*cpus)[n++] = c;
+		}
+		s = *end == ',' ? end + 1 : end;
+	}
+	return n;
+}
+
+/* First line of a sysfs file, empty if missing. */
+static void
+read_line(char *path, char *buf, int size)
+{
+	FILE *f = fopen(path, "r");
+	if (!f || !fgets(buf, size, f)) *buf = 0;
+	if (f) fclose(f);
+}
+
+static void
+numa_detect(void)
+{
+	/* Node ids need not be contiguous (offlined or hotplugged nodes),
+	 * the online ones are listed in the same format as the cpus. */
+	char buf[1024];
+	int *ids;
+	read_line("/sys/devices/system/node/online", buf, sizeof(buf));
+	int n = parse_cpulist(buf, &ids);
+	for (int i = 0; i < n && nodes < NUMA_MAX_NODES; i++) {
+		char path[64];
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", ids[i]);
+		read_line(path, buf, sizeof(buf));
+		/* Skip memory-only nodes, no thread runs there. */
+		node_ncpus[nodes] = parse_cpulist(buf, &node_cpus[nodes]);
+		if (node_ncpus[nodes]) nodes++;
+	}
+	if (n > NUMA_MAX_NODES && DEBUGL(1))
+		fprintf(stderr, "NUMA: %d nodes, using the first %d\n", n, NUMA_MAX_NODES);
+	free(ids);
+	if (nodes) return;
+
+	/* No NUMA information, a single node with all cpus. */
+	int ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpus < 1) ncpus = 1;
+	node_cpus[0] = malloc2(ncpus * sizeof(int));
+	for (int c = 0; c < ncpus; c++)
+		node_cpus[0][c] = c;
+	node_ncpus[0] = ncpus;
+	nodes = 1;
+}
+
+int
+numa_setup(enum numa_pin policy)
+{
+	pin_policy = policy;
+	if (!nodes) numa_detect();
+	if (DEBUGL(2) && policy != NUMA_PIN_NONE)
+		fprintf(stderr, "NUMA: %d nodes, pinning threads %s\n", nodes,
+			policy == NUMA_PIN_COMPACT ? "compact" : "scatter");
+	return numa_arenas();
+}
+
+int
+numa_arenas(void)
+{
+	return pin_policy == NUMA_PIN_NONE ? 1 : nodes;
+}
+
+void
+numa_pin_thread(int tid)
+{
+	if (pin_policy == NUMA_PIN_NONE) return;
+
+	int node, cpu;
+	if (pin_policy == NUMA_PIN_SCATTER) {
+		node = tid % nodes;
+		cpu = node_cpus[node][(tid / nodes) % node_ncpus[node]];
+	} else {
+		int total = 0;
+		for (int n = 0; n < nodes; n++)
+			total += node_ncpus[n];
+		int i = tid % total;
+		for (node = 0; i >= node_ncpus[node]; node++)
+			i -= node_ncpus[node];
+		cpu = node_cpus[node][i];
+	}
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) {
+		if (DEBUGL(1))
+			fprintf(stderr, "NUMA: cannot pin thread %d to cpu %d\n", tid, cpu);
+		return;
+	}
+	numa_thread_node = node;
+	if (DEBUGL(3))
+		fprintf(stderr, "NUMA: thread %d on cpu %d node %d\n", tid, cpu, node);
+}
+
+#else
+
+int
+numa_setup(enum numa_pin policy)
+{
+	pin_policy = policy;
+	if (DEBUGL(1) && policy != NUMA_PIN_NONE)
+		fprintf(stderr, "NUMA: thread pinning not supported on this platform\n");
+	return 1;
+}
+
+int
+numa_arenas(void)
+{
+	return 1;
+}
+
+void
+numa_pin_thread(int tid)
+{
+}
+
+#endif
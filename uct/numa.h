@@ -0,0 +1,34 @@
+#ifndef PACHI_UCT_NUMA_H
+#define PACHI_UCT_NUMA_H
+
+/* Pinning of the search threads and NUMA node of the calling thread,
+ * used to keep the tree nodes expanded by a thread in memory local
+ * to it (see tree_alloc_node()). Only implemented on Linux, which
+ * places pages on the node of the thread touching them first. */
+
+enum numa_pin {
+	NUMA_PIN_NONE,
+	/* Thread i on the i-th cpu, filling one node after another. */
+	NUMA_PIN_COMPACT,
+	/* Threads spread round-robin over the nodes. */
+	NUMA_PIN_SCATTER,
+};
+
+#define NUMA_MAX_NODES 16
+
+/* Set the pinning policy for the threads pinned from now on.
+ * Returns the number of NUMA nodes used, 1 without pinning. */
+int numa_setup(enum numa_pin policy);
+/* Number of NUMA nodes the tree should be split for. */
+int numa_arenas(void);
+/* Pin the calling thread, worker number tid, per the policy. */
+void numa_pin_thread(int tid);
+
+#if defined(__linux__) && !defined(NO_THREAD_LOCAL)
+extern __thread int numa_thread_node;
+#define numa_node() numa_thread_node
+#else
+#define numa_node() 0
+#endif
+
+#endif
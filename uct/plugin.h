@@ -59,6 +59,18 @@ void *pachi_plugin_init(char *args, struct board *b, int seed);
  * <uct/prior.c> for the default prior evaluation functions. */
 void pachi_plugin_prior(void *data, struct tree_node *node, struct prior_map *map, int eqex);
 
+/* Optionally, a plugin may export this function instead of (or in addition
+ * to) pachi_plugin_prior(), to evaluate @n positions at once: @maps[i] is
+ * the prior map of node @nodes[i], to be filled the same way. Except for
+ * the root, which is evaluated right away (with @n = 1), the positions of
+ * the expanded nodes are queued and the function is called with up to
+ * plugin_batch (a UCT option) of them from a worker thread, while the
+ * search goes on; the priors are added to the node children when it
+ * returns. The maps and their boards are private copies, valid only
+ * during the call; do not look at the nodes other than as keys, they
+ * are being searched meanwhile. */
+void pachi_plugin_prior_batch(void *data, int n, struct tree_node **nodes, struct prior_map **maps, int eqex);
+
 /* This function is called when the game has ended and the context needs
  * to be deinitialized. */
 void pachi_plugin_done(void *data);
@@ -2,6 +2,7 @@
 #ifndef WIN32
 #include <dlfcn.h>
 #endif
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,6 +11,7 @@
 #include "debug.h"
 #include "move.h"
 #include "random.h"
+#include "timeinfo.h"
 #include "uct/plugins.h"
 #include "uct/prior.h"
 #include "uct/tree.h"
@@ -28,13 +30,51 @@ struct plugin {
 
 	void *(*init)(char *args, struct board *b, int seed);
 	void (*prior)(void *data, struct tree_node *node, struct prior_map *map, int eqex);
+	void (*prior_batch)(void *data, int n, struct tree_node **nodes, struct prior_map **maps, int eqex);
 	void (*done)(void *data);
 };
 
+/* Batched priors: for the in-tree nodes, the expanding thread only
+ * queues the position and goes on, a worker thread hands the queued
+ * positions in batches to the plugins exporting pachi_plugin_prior_batch
+ * and adds the priors to the node children when they return (as for the
+ * asynchronous dcnn priors, see uct/prior.c). Meanwhile the pending node
+ * carries a virtual loss which keeps other threads mostly away from it. */
+#define PLUGIN_QUEUE_SIZE 1024
+#define PLUGIN_MAX_BATCH 256
+#define PLUGIN_DEFAULT_BATCH 16
+/* Virtual loss of a node waiting for the plugins. */
+#define PLUGIN_PENDING_VLOSS 8
+/* Maximum time to wait for a batch to fill up [s]. */
+#define PLUGIN_BATCH_WAIT 0.002
+/* Batches to wait for the children of a node before giving up. */
+#define PLUGIN_MAX_RETRIES 100
+
+struct plugin_request {
+	struct tree *t;
+	struct tree_node *node;
+	struct board b;
+	struct prior_map map;
+	int eqex;
+	int retries;
+};
+
 struct uct_pluginset {
 	struct plugin *plugins;
 	int n_plugins;
 	struct board *b;
+
+	/* Batched priors, see above. */
+	int batch_plugins;
+	int batch;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond; // new requests, or quit
+	pthread_cond_t done_cond; // queue drained
+	struct plugin_request *queue[PLUGIN_QUEUE_SIZE];
+	int queue_head, queue_len;
+	int pending; // queued or being evaluated
+	bool worker_running, quit;
+	pthread_t worker;
 };
 
 
@@ -58,10 +98,25 @@ plugin_load(struct uct_pluginset *ps, char *path, char *args)
 	assert(!ps);
 }
 void
-plugin_prior(struct uct_pluginset *ps, struct tree_node *node, struct prior_map *map, int eqex)
+plugin_prior(struct uct_pluginset *ps, struct tree *t, struct tree_node *node, struct prior_map *map, int eqex)
+{
+	assert(!ps);
+}
+void
+plugin_batch_size(struct uct_pluginset *ps, int batch)
 {
 	assert(!ps);
 }
+void
+plugin_flush(struct uct_pluginset *ps)
+{
+	assert(!ps);
+}
+int
+plugin_batched(struct uct_pluginset *ps)
+{
+	return 0;
+}
 
 #else
 
@@ -70,12 +125,24 @@ pluginset_init(struct board *b)
 {
 	struct uct_pluginset *ps = calloc(1, sizeof(*ps));
 	ps->b = b;
+	ps->batch = PLUGIN_DEFAULT_BATCH;
+	pthread_mutex_init(&ps->mutex, NULL);
+	pthread_cond_init(&ps->cond, NULL);
+	pthread_cond_init(&ps->done_cond, NULL);
 	return ps;
 }
 
 void
 pluginset_done(struct uct_pluginset *ps)
 {
+	if (ps->worker_running) {
+		plugin_flush(ps);
+		pthread_mutex_lock(&ps->mutex);
+		ps->quit = true;
+		pthread_cond_signal(&ps->cond);
+		pthread_mutex_unlock(&ps->mutex);
+		pthread_join(ps->worker, NULL);
+	}
 	for (int i = 0; i < ps->n_plugins; i++) {
 		struct plugin *p = &ps->plugins[i];
 		p->done(p->data);
@@ -108,19 +175,222 @@ plugin_load(struct uct_pluginset *ps, char *path, char *args)
 	} \
 } while (0)
 	loadsym(init);
-	loadsym(prior);
 	loadsym(done);
+	/* One of prior and prior_batch is enough. */
+	p->prior_batch = dlsym(p->dlh, "pachi_plugin_prior_batch");
+	if (p->prior_batch)
+		ps->batch_plugins++;
+	else
+		loadsym(prior);
 
 	p->data = p->init(p->args, ps->b, fast_random(65536));
 }
 
 void
-plugin_prior(struct uct_pluginset *ps, struct tree_node *node, struct prior_map *map, int eqex)
+plugin_batch_size(struct uct_pluginset *ps, int batch)
+{
+	if (batch < 1 || batch > PLUGIN_MAX_BATCH) {
+		fprintf(stderr, "UCT: plugin_batch must be within 1..%d\n", PLUGIN_MAX_BATCH);
+		exit(1);
+	}
+	ps->batch = batch;
+}
+
+static void
+plugin_request_done(struct plugin_request *req)
+{
+	board_done_noalloc(&req->b);
+	free(req->map.prior - 1);
+	free(req->map.consider - 1);
+	free(req->map.distances);
+	free(req);
+}
+
+/* Returns false if the node children are not published yet,
+ * the request is retried after the next batch then. */
+static bool
+plugin_apply_result(struct plugin_request *req)
+{
+	struct tree_node *node = req->node;
+	/* The expanding thread publishes children right after queueing,
+	 * as in dcnn_apply_result(). A result applies only once to the
+	 * children. */
+	if (node->is_expanded && !node->children)
+		return false;
+	bool first = node->children
+		&& !(__sync_fetch_and_or(&node->hints, TREE_HINT_PLUGIN_PRIOR) & TREE_HINT_PLUGIN_PRIOR);
+
+	struct move_stats *prior = req->map.prior;
+	struct tree_cands *cands = first ? tree_node_cands(req->t, node) : NULL;
+	for (int k = 0; cands && k < cands->count; k++) {
+		struct move_stats *s = &prior[cands->cand[k].coord];
+		if (s->playouts && !cands->cand[k].taken)
+			stats_merge(&cands->cand[k].prior, s);
+	}
+	for (struct tree_node *ni = first ? node->children : NULL; ni; ni = ni->sibling) {
+		struct move_stats *s = &prior[node_coord(ni)];
+		if (s->playouts)
+			stats_merge(&ni->prior, s);
+	}
+	__sync_fetch_and_sub(&node->descents, PLUGIN_PENDING_VLOSS);
+	return true;
+}
+
+static void
+plugins_prior_batch(struct uct_pluginset *ps, int n, struct tree_node **nodes, struct prior_map **maps, int eqex)
 {
 	for (int i = 0; i < ps->n_plugins; i++) {
 		struct plugin *p = &ps->plugins[i];
-		p->prior(p->data, node, map, eqex);
+		if (p->prior_batch)
+			p->prior_batch(p->data, n, nodes, maps, eqex);
 	}
 }
 
+static void *
+plugin_worker(void *data)
+{
+	struct uct_pluginset *ps = data;
+	struct plugin_request *reqs[PLUGIN_MAX_BATCH];
+	struct tree_node *nodes[PLUGIN_MAX_BATCH];
+	struct prior_map *maps[PLUGIN_MAX_BATCH];
+	/* Requests whose node children were not published yet. */
+	struct plugin_request *retry[PLUGIN_QUEUE_SIZE];
+	int retry_n = 0;
+
+	while (true) {
+		pthread_mutex_lock(&ps->mutex);
+		while (!ps->queue_len && !retry_n && !ps->quit)
+			pthread_cond_wait(&ps->cond, &ps->mutex);
+		if (ps->quit) {
+			pthread_mutex_unlock(&ps->mutex);
+			return NULL;
+		}
+		if (ps->queue_len < ps->batch) {
+			/* Give the batch a chance to fill up,
+			 * and the pending children to show up. */
+			struct timespec ts;
+			double deadline = time_now() + PLUGIN_BATCH_WAIT;
+			ts.tv_sec = (int)deadline;
+			ts.tv_nsec = (int)((deadline - ts.tv_sec) * 1000000000);
+			pthread_cond_timedwait(&ps->cond, &ps->mutex, &ts);
+		}
+		int n = ps->queue_len < ps->batch ? ps->queue_len : ps->batch;
+		for (int k = 0; k < n; k++) {
+			reqs[k] = ps->queue[ps->queue_head];
+			ps->queue_head = (ps->queue_head + 1) % PLUGIN_QUEUE_SIZE;
+		}
+		ps->queue_len -= n;
+		pthread_mutex_unlock(&ps->mutex);
+
+		for (int k = 0; k < n; k++) {
+			nodes[k] = reqs[k]->node;
+			maps[k] = &reqs[k]->map;
+		}
+		if (n)
+			plugins_prior_batch(ps, n, nodes, maps, reqs[0]->eqex);
+
+		/* The retries first, then the new requests; retry[] is
+		 * refilled behind the retries being read. */
+		int done = 0, retries = retry_n;
+		retry_n = 0;
+		for (int k = 0; k < retries + n; k++) {
+			struct plugin_request *req = k < retries ? retry[k] : reqs[k - retries];
+			if (plugin_apply_result(req)) {
+				plugin_request_done(req);
+				done++;
+			} else if (++req->retries < PLUGIN_MAX_RETRIES && retry_n < PLUGIN_QUEUE_SIZE) {
+				retry[retry_n++] = req;
+			} else {
+				/* The expansion was abandoned, the node
+				 * goes without the plugin priors. */
+				__sync_fetch_and_sub(&req->node->descents, PLUGIN_PENDING_VLOSS);
+				plugin_request_done(req);
+				done++;
+			}
+		}
+
+		pthread_mutex_lock(&ps->mutex);
+		ps->pending -= done;
+		if (!ps->pending)
+			pthread_cond_broadcast(&ps->done_cond);
+		pthread_mutex_unlock(&ps->mutex);
+	}
+}
+
+static void
+plugin_queue(struct uct_pluginset *ps, struct tree *t, struct tree_node *node, struct prior_map *map, int eqex)
+{
+	pthread_mutex_lock(&ps->mutex);
+	if (!ps->worker_running) {
+		pthread_create(&ps->worker, NULL, plugin_worker, ps);
+		ps->worker_running = true;
+	}
+	bool full = ps->queue_len >= PLUGIN_QUEUE_SIZE;
+	pthread_mutex_unlock(&ps->mutex);
+	/* Evaluation can't keep up, go on without the plugin priors. */
+	if (full)
+		return;
+
+	/* The copies are made outside the lock. */
+	struct board *b = map->b;
+	struct plugin_request *req = malloc2(sizeof(*req));
+	board_copy(&req->b, b);
+	req->t = t;
+	req->node = node;
+	req->retries = 0;
+	req->eqex = eqex;
+	req->map = *map;
+	req->map.b = &req->b;
+	req->map.prior = (struct move_stats *)calloc2(board_size2(b) + 1, sizeof(*req->map.prior)) + 1;
+	req->map.consider = (bool *)malloc2((board_size2(b) + 1) * sizeof(*req->map.consider)) + 1;
+	memcpy(req->map.consider - 1, map->consider - 1, (board_size2(b) + 1) * sizeof(*map->consider));
+	req->map.distances = malloc2(board_size2(b) * sizeof(*req->map.distances));
+	memcpy(req->map.distances, map->distances, board_size2(b) * sizeof(*map->distances));
+	__sync_fetch_and_add(&node->descents, PLUGIN_PENDING_VLOSS);
+
+	pthread_mutex_lock(&ps->mutex);
+	if (ps->queue_len >= PLUGIN_QUEUE_SIZE) {
+		pthread_mutex_unlock(&ps->mutex);
+		__sync_fetch_and_sub(&node->descents, PLUGIN_PENDING_VLOSS);
+		plugin_request_done(req);
+		return;
+	}
+	ps->queue[(ps->queue_head + ps->queue_len++) % PLUGIN_QUEUE_SIZE] = req;
+	ps->pending++;
+	pthread_cond_signal(&ps->cond);
+	pthread_mutex_unlock(&ps->mutex);
+}
+
+void
+plugin_prior(struct uct_pluginset *ps, struct tree *t, struct tree_node *node, struct prior_map *map, int eqex)
+{
+	for (int i = 0; i < ps->n_plugins; i++) {
+		struct plugin *p = &ps->plugins[i];
+		if (p->prior)
+			p->prior(p->data, node, map, eqex);
+	}
+	if (!ps->batch_plugins)
+		return;
+	/* The root priors are needed right away. */
+	if (!node->parent)
+		plugins_prior_batch(ps, 1, &node, &map, eqex);
+	else
+		plugin_queue(ps, t, node, map, eqex);
+}
+
+void
+plugin_flush(struct uct_pluginset *ps)
+{
+	pthread_mutex_lock(&ps->mutex);
+	while (ps->pending)
+		pthread_cond_wait(&ps->done_cond, &ps->mutex);
+	pthread_mutex_unlock(&ps->mutex);
+}
+
+int
+plugin_batched(struct uct_pluginset *ps)
+{
+	return ps->batch_plugins;
+}
+
 #endif
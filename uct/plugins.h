@@ -1,6 +1,7 @@
 #ifndef PACHI_UCT_PLUGINS_H
 #define PACHI_UCT_PLUGINS_H
 
+struct tree;
 struct tree_node;
 struct board;
 struct prior_map;
@@ -14,7 +15,14 @@ void pluginset_done(struct uct_pluginset *ps);
 /* Load a new plugin with DLL at path, passed arguments in args. */
 void plugin_load(struct uct_pluginset *ps, char *path, char *args);
 
-/* Query plugins for priors of a node's leaves. */
-void plugin_prior(struct uct_pluginset *ps, struct tree_node *node, struct prior_map *map, int eqex);
+/* Query plugins for priors of a node's leaves. The plugins with batched
+ * priors get the in-tree nodes later, from a worker thread. */
+void plugin_prior(struct uct_pluginset *ps, struct tree *t, struct tree_node *node, struct prior_map *map, int eqex);
+/* Maximum number of positions in a batch. */
+void plugin_batch_size(struct uct_pluginset *ps, int batch);
+/* Wait for the pending batched priors to be applied. */
+void plugin_flush(struct uct_pluginset *ps);
+/* Number of plugins with batched priors. */
+int plugin_batched(struct uct_pluginset *ps);
 
 #endif
@@ -6,6 +6,7 @@
 #include "board.h"
 #include "stone.h"
 #include "uct/internal.h"
+#include "uct/tree.h"
 
 struct board;
 struct tree_node;
@@ -22,15 +23,53 @@ void uctp_generic_winner(struct uct_policy *p, struct tree *tree, struct uct_des
 #define uctd_debug(fmt...)
 #endif
 
+/* Move the children iterator dci to the next child of descent->node:
+ * the next sibling, then each candidate not taken yet (see
+ * tree_node_cands()), seen through view. */
+static inline void
+uctd_next_child(struct uct_descent *descent, struct uct_descent *dci,
+		struct tree_cands *cands, int *cand, struct tree_node *view)
+{
+	if (*cand < 0 && dci->node->sibling) {
+		dci->node = dci->node->sibling;
+		return;
+	}
+	/* The candidates are in coordinate order on their own. */
+	if (*cand < 0 && descent->lnode)
+		dci->lnode = descent->lnode->children;
+	dci->node = NULL;
+	while (cands && ++*cand < cands->count) {
+		struct tree_cand *c = &cands->cand[*cand];
+		if (c->taken)
+			continue;
+		*view = (struct tree_node) {
+			.parent = descent->node, .prior = c->prior, .amaf = c->amaf,
+			.coord = c->coord, .depth = descent->node->depth + 1, .d = c->d,
+		};
+		dci->node = view;
+		dci->cand = c;
+		return;
+	}
+}
+
 #define uctd_try_node_children(tree, descent, allow_pass, parity, tenuki_d, di, urgency) \
 	/* Information abound best children. */ \
 	/* XXX: We assume board <=25x25. */ \
-	struct uct_descent dbest[BOARD_MAX_MOVES + 1] = { { .node = descent->node->children, .lnode = NULL } }; int dbests = 1; \
+	/* Not initialized as a whole, this would clear several kB \
+	 * at each level of each descent. */ \
+	struct uct_descent dbest[BOARD_MAX_MOVES + 1]; int dbests = 1; \
+	dbest[0] = (struct uct_descent) { .node = descent->node->children, .lnode = NULL }; \
 	floating_t best_urgency = -9999; \
+	/* Best child which is a node already, in case the best \
+	 * candidate cannot be taken. */ \
+	struct tree_node *dparent = descent->node; \
+	struct uct_descent dnode = dbest[0]; floating_t dnode_urgency = -9999; \
 	/* Descent children iterator. */ \
 	struct uct_descent dci = { .node = descent->node->children, .lnode = descent->lnode ? descent->lnode->children : NULL }; \
+	struct tree_cands *dcands = tree_node_cands(tree, descent->node); \
+	struct tree_node dview; int dcand = -1; \
 	\
-	for (; dci.node; dci.node = dci.node->sibling) { \
+	for (; dci.node; uctd_next_child(descent, &dci, dcands, &dcand, &dview)) { \
 		floating_t urgency; \
 		/* Do not consider passing early. */ \
 		if (unlikely((!allow_pass && is_pass(node_coord(dci.node))) || (dci.node->hints & TREE_HINT_INVALID))) \
@@ -54,6 +93,16 @@ void uctp_generic_winner(struct uct_policy *p, struct tree *tree, struct uct_des
 
 #define uctd_set_best_child(di, urgency) \
 		uctd_debug("(%s) %f\n", coord2sstr(node_coord(di.node), tree->board), urgency); \
+		struct uct_descent db = di; \
+		/* Make sure lnode information is meaningful. */ \
+		if (db.lnode && is_pass(node_coord(db.lnode))) \
+			db.lnode = NULL; \
+		/* The view of a candidate does not outlive this iteration. */ \
+		if (db.cand) { \
+			db.node = NULL; \
+		} else if (urgency > dnode_urgency) { \
+			dnode_urgency = urgency; dnode = db; \
+		} \
 		if (urgency - best_urgency > __FLT_EPSILON__) { /* urgency > best_urgency */ \
 			uctd_debug("new best\n"); \
 			best_urgency = urgency; dbests = 0; \
@@ -62,18 +111,24 @@ void uctp_generic_winner(struct uct_policy *p, struct tree *tree, struct uct_des
 			uctd_debug("another best\n"); \
 			/* We want to always choose something else than a pass \
 			 * in case of a tie. pass causes degenerative behaviour. */ \
-			if (dbests == 1 && is_pass(node_coord(dbest[0].node))) { \
+			if (dbests == 1 && dbest[0].node && is_pass(node_coord(dbest[0].node))) { \
 				dbests--; \
 			} \
-			struct uct_descent db = di; \
-			/* Make sure lnode information is meaningful. */ \
-			if (db.lnode && is_pass(node_coord(db.lnode))) \
-				db.lnode = NULL; \
 			dbest[dbests++] = db; \
 		} \
 	}
 
-#define uctd_get_best_child(descent) *(descent) = dbest[fast_random(dbests)];
+#define uctd_get_best_child(descent) \
+	*(descent) = dbest[fast_random(dbests)]; \
+	if ((descent)->cand) { \
+		struct tree_node *dtaken = tree_take_cand(tree, dparent, (descent)->cand); \
+		if (dtaken) { \
+			(descent)->node = dtaken; \
+			(descent)->cand = NULL; \
+		} else { \
+			*(descent) = dnode; \
+		} \
+	}
 
 
 #endif
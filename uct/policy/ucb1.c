@@ -59,7 +59,7 @@ ucb1_descend(struct uct_policy *p, struct tree *tree, struct uct_descent *descen
 }
 
 void
-ucb1_update(struct uct_policy *p, struct tree *tree, struct tree_node *node, enum stone node_color, enum stone player_color, struct playout_amafmap *map, struct board *final_board, floating_t result)
+ucb1_update(struct uct_policy *p, struct tree *tree, struct tree_node *node, enum stone node_color, enum stone player_color, struct playout_amafmap *map, struct board *final_board, floating_t result, int playouts)
 {
 	/* It is enough to iterate by a single chain; we will
 	 * update all the preceding positions properly since
@@ -68,11 +68,12 @@ ucb1_update(struct uct_policy *p, struct tree *tree, struct tree_node *node, enu
 	enum stone winner_color = result > 0.5 ? S_BLACK : S_WHITE;
 
 	for (; node; node = node->parent) {
-		stats_add_result(&node->u, result, 1);
+		stats_add_result(&node->u, result, playouts);
 
 		if (!is_pass(node_coord(node))) {
-			stats_add_result(&node->winner_owner, board_at(final_board, node_coord(node)) == winner_color ? 1.0 : 0.0, 1);
-			stats_add_result(&node->black_owner, board_at(final_board, node_coord(node)) == S_BLACK ? 1.0 : 0.0, 1);
+			struct tree_node_cold *cold = tree_node_cold(tree, node);
+			stats_add_result(&cold->winner_owner, board_at(final_board, node_coord(node)) == winner_color ? 1.0 : 0.0, 1);
+			stats_add_result(&cold->black_owner, board_at(final_board, node_coord(node)) == S_BLACK ? 1.0 : 0.0, 1);
 		}
 	}
 }
@@ -30,6 +30,17 @@ struct ucb1_policy_amaf {
 	 * exploration caused by this may cause a wrong mean value computed
 	 * for the parent node. */
 	bool vloss_sqrt;
+	/* Scale the virtual loss with the visits of the node: each descent
+	 * in flight counts as 1 + vloss_adaptive * sqrt(visits) virtual
+	 * playouts, so that a few threads still make a difference on the
+	 * heavily visited nodes of the principal variation. 0 for a fixed
+	 * virtual loss. */
+	floating_t vloss_adaptive;
+	/* Virtual visits instead of virtual losses: the descents in flight
+	 * count as playouts at the current value of the node. This spreads
+	 * the threads through the exploration term (explore_p > 0) only,
+	 * without distorting the winrates. */
+	bool vloss_visit;
 	/* In distributed mode, encourage different slaves to work on different
 	 * parts of the tree by adding virtual wins to different nodes. */
 	int virtual_win;
@@ -56,51 +67,61 @@ struct ucb1_policy_amaf {
 	bool crit_negflip;
 	bool crit_amaf;
 	bool crit_lvalue;
+	/* Update the criticality stats only in every crit_sample-th
+	 * playout on average, and only for nodes at most crit_maxdepth
+	 * below the root (0 = any). They are a ratio, so sampling does
+	 * not bias them. Without crit_rave they are not updated at all. */
+	int crit_sample;
+	int crit_maxdepth;
 };
 
 
+/* sqrt(x) and sqrt(log(x)) of the small visit counts met at most tree
+ * nodes, for the exploration term. The entries are computed by the very
+ * expressions they stand for, so the results do not change. */
+#define UCB_TABLE_SIZE 4096
+static floating_t sqrt_table[UCB_TABLE_SIZE];
+static floating_t sqrt_log_table[UCB_TABLE_SIZE];
+
+static void
+ucb_tables_init(void)
+{
+	for (unsigned int x = 0; x < UCB_TABLE_SIZE; x++) {
+		sqrt_table[x] = sqrt(x);
+		sqrt_log_table[x] = sqrt(log(x));
+	}
+}
+
 static inline floating_t fast_sqrt(unsigned int x)
 {
-	static const floating_t table[] = {
-		0, 1, 1.41421356237309504880, 1.73205080756887729352,
-		2.00000000000000000000, 2.23606797749978969640,
-		2.44948974278317809819, 2.64575131106459059050,
-		2.82842712474619009760, 3.00000000000000000000,
-		3.16227766016837933199, 3.31662479035539984911,
-		3.46410161513775458705, 3.60555127546398929311,
-		3.74165738677394138558, 3.87298334620741688517,
-		4.00000000000000000000, 4.12310562561766054982,
-		4.24264068711928514640, 4.35889894354067355223,
-		4.47213595499957939281, 4.58257569495584000658,
-		4.69041575982342955456, 4.79583152331271954159,
-		4.89897948556635619639, 5.00000000000000000000,
-		5.09901951359278483002, 5.19615242270663188058,
-		5.29150262212918118100, 5.38516480713450403125,
-		5.47722557505166113456, 5.56776436283002192211,
-		5.65685424949238019520, 5.74456264653802865985,
-		5.83095189484530047087, 5.91607978309961604256,
-		6.00000000000000000000, 6.08276253029821968899,
-		6.16441400296897645025, 6.24499799839839820584,
-		6.32455532033675866399, 6.40312423743284868648,
-		6.48074069840786023096, 6.55743852430200065234,
-		6.63324958071079969822, 6.70820393249936908922,
-		6.78232998312526813906, 6.85565460040104412493,
-		6.92820323027550917410, 7.00000000000000000000,
-		7.07106781186547524400, 7.14142842854284999799,
-		7.21110255092797858623, 7.28010988928051827109,
-		7.34846922834953429459, 7.41619848709566294871,
-		7.48331477354788277116, 7.54983443527074969723,
-		7.61577310586390828566, 7.68114574786860817576,
-		7.74596669241483377035, 7.81024967590665439412,
-		7.87400787401181101968, 7.93725393319377177150,
-	};
-	if (x < sizeof(table) / sizeof(*table)) {
-		return table[x];
+	if (x < UCB_TABLE_SIZE) {
+		return sqrt_table[x];
 	} else {
 		return sqrt(x);
 	}
 }
 
+static inline floating_t fast_sqrt_log(unsigned int x)
+{
+	if (x < UCB_TABLE_SIZE) {
+		return sqrt_log_table[x];
+	} else {
+		return sqrt(log(x));
+	}
+}
+
+/* Number of virtual playouts for the descents in flight through node. */
+static inline floating_t
+ucb1rave_virtual_playouts(struct ucb1_policy_amaf *b, struct uct *u, struct tree_node *node, int visits)
+{
+	if (node->descents <= 0)
+		return 0;
+	floating_t vloss_coeff = b->vloss_sqrt ? sqrt(u->threads) / u->threads : 1.;
+	if (b->vloss_adaptive > 0)
+		vloss_coeff *= 1 + b->vloss_adaptive * fast_sqrt(visits);
+	return node->descents * vloss_coeff;
+}
+
 #define URAVE_DEBUG if (0)
 static inline floating_t
 ucb1rave_evaluate(struct uct_policy *p, struct tree *tree, struct uct_descent *descent, int parity)
@@ -109,7 +130,7 @@ ucb1rave_evaluate(struct uct_policy *p, struct tree *tree, struct uct_descent *d
 	struct tree_node *node = descent->node;
 	struct tree_node *lnode = descent->lnode;
 
-	struct move_stats n = node->u, r = node->amaf;
+	struct move_stats n = tree_node_stats(tree, node), r = node->amaf;
 	if (p->uct->amaf_prior) {
 		stats_merge(&r, &node->prior);
 	} else {
@@ -120,8 +141,17 @@ ucb1rave_evaluate(struct uct_policy *p, struct tree *tree, struct uct_descent *d
 		/* Add virtual loss if we need to; this is used to discourage
 		 * other threads from visiting this node in case of multiple
 		 * threads doing the tree search. */
-		floating_t vloss_coeff = b->vloss_sqrt ? sqrt(p->uct->threads) / p->uct->threads : 1.;
-		struct move_stats c = { .value = parity > 0 ? 0. : 1., .playouts = node->descents * vloss_coeff };
+		struct move_stats c = {
+			.value = parity > 0 ? 0. : 1.,
+			.playouts = ucb1rave_virtual_playouts(b, p->uct, node, node->u.playouts),
+		};
+		/* Virtual visits keep the value, a node without any
+		 * playout yet has none to keep. */
+		if (b->vloss_visit) {
+			c.value = n.value;
+			if (!n.playouts)
+				c.playouts = 0;
+		}
 		stats_merge(&n, &c);
 	}
 
@@ -129,6 +159,7 @@ ucb1rave_evaluate(struct uct_policy *p, struct tree *tree, struct uct_descent *d
 	assert(!lnode || lnode->parent);
 	if (p->uct->local_tree && b->ltree_rave > 0 && lnode
 	    && (p->uct->local_tree_rootchoose || lnode->parent->parent)) {
+		tree_lnode_age(tree, lnode);
 		struct move_stats l = lnode->u;
 		l.playouts = ((floating_t) l.playouts) * b->ltree_rave / LTREE_PLAYOUTS_MULTIPLIER;
 		URAVE_DEBUG fprintf(stderr, "[ltree] adding [%s] %f%%%d to [%s] RAVE %f%%%d\n",
@@ -198,7 +229,7 @@ ucb1rave_descend(struct uct_policy *p, struct tree *tree, struct uct_descent *de
 	struct ucb1_policy_amaf *b = p->data;
 	floating_t nconf = 1.f;
 	if (b->explore_p > 0)
-		nconf = sqrt(log(descent->node->u.playouts + descent->node->prior.playouts));
+		nconf = fast_sqrt_log(descent->node->u.playouts + descent->node->prior.playouts);
 	struct uct *u = p->uct;
 	int vwin = 0;
 	if (u->max_slaves > 0 && u->slave_index >= 0)
@@ -216,7 +247,10 @@ ucb1rave_descend(struct uct_policy *p, struct tree *tree, struct uct_descent *de
 			urgency += vwin / (ni->u.playouts + vwin);
 
 		if (ni->u.playouts > 0 && b->explore_p > 0) {
-			urgency += b->explore_p * nconf / fast_sqrt(ni->u.playouts);
+			int visits = ni->u.playouts;
+			if (b->vloss_visit && u->virtual_loss)
+				visits += ucb1rave_virtual_playouts(b, u, ni, ni->u.playouts);
+			urgency += b->explore_p * nconf / fast_sqrt(visits);
 
 		} else if (ni->u.playouts + ni->amaf.playouts + ni->prior.playouts == 0) {
 			/* assert(!u->even_eqex); */
@@ -244,11 +278,45 @@ static inline int ko_length(bool *ko_capture_map, int map_length)
 	return length;
 }
 
+/* AMAF result and weight of the playout for the child at coord of the
+ * node at index move of the game. Returns false if the child does not
+ * get this playout. */
+static inline bool
+ucb1amaf_child_result(struct ucb1_policy_amaf *b, struct playout_amafmap *map, int *first_move,
+		      int move, int max_threat_dist, coord_t coord, floating_t result,
+		      floating_t *res, int *weight_)
+{
+	if (is_pass(coord)) return false;
+
+	/* Use the child move only if it was first played by the same color. */
+	int first = first_move[coord];
+	if (first == INT_MAX) return false;
+	assert(first > move && first < map->gamelen);
+	int distance = first - (move + 1);
+	if (distance & 1) return false;
+
+	int weight = 1;
+	*res = result;
+
+	/* Don't give amaf bonus to a ko threat before taking the ko.
+	 * http://www.grappa.univ-lille3.fr/~coulom/Aja_PhD_Thesis.pdf
+	 */
+	if (distance <= max_threat_dist && distance % 6 == 4) {
+		weight = - b->threat_rave;
+		*res = 1.0 - *res;
+	} else if (b->distance_rave != 0) {
+		/* Give more weight to moves played earlier */
+		weight += b->distance_rave * (map->gamelen - first) / (map->gamelen - move);
+	}
+	*weight_ = weight;
+	return true;
+}
+
 void
 ucb1amaf_update(struct uct_policy *p, struct tree *tree, struct tree_node *node,
 		enum stone node_color, enum stone player_color,
 		struct playout_amafmap *map, struct board *final_board,
-		floating_t result)
+		floating_t result, int playouts)
 {
 	struct ucb1_policy_amaf *b = p->data;
 	enum stone winner_color = result > 0.5 ? S_BLACK : S_WHITE;
@@ -276,12 +344,16 @@ ucb1amaf_update(struct uct_policy *p, struct tree *tree, struct tree_node *node,
 	for (move = map->gamelen - 1; move >= map->game_baselen; move--)
 		first_move[map->game[move]] = move;
 
+	bool crit_update = b->crit_rave > 0 && (b->crit_sample <= 1 || !fast_random(b->crit_sample));
+
 	while (node) {
-		if (!b->crit_amaf && !is_pass(node_coord(node))) {
-			stats_add_result(&node->winner_owner, board_local_value(b->crit_lvalue, final_board, node_coord(node), winner_color), 1);
-			stats_add_result(&node->black_owner, board_local_value(b->crit_lvalue, final_board, node_coord(node), S_BLACK), 1);
+		bool crit = crit_update && (!b->crit_maxdepth || node->depth - tree->root->depth <= b->crit_maxdepth);
+		if (crit && !b->crit_amaf && !is_pass(node_coord(node))) {
+			struct tree_node_cold *cold = tree_node_cold(tree, node);
+			stats_add_result_relaxed(&cold->winner_owner, board_local_value(b->crit_lvalue, final_board, node_coord(node), winner_color), 1);
+			stats_add_result_relaxed(&cold->black_owner, board_local_value(b->crit_lvalue, final_board, node_coord(node), S_BLACK), 1);
 		}
-		stats_add_result(&node->u, result, 1);
+		stats_add_result(&node->u, result, playouts);
 
 		bool *ko_capture_map = &map->is_ko_capture[move+1];
 		int max_threat_dist = b->threat_rave <= 0 ? ko_length(ko_capture_map, map->gamelen - (move+1)) : -1;
@@ -290,33 +362,16 @@ ucb1amaf_update(struct uct_policy *p, struct tree *tree, struct tree_node *node,
 		 * matter only at a point when AMAF doesn't help much. */
 		assert(map->game_baselen >= 0);
 		for (struct tree_node *ni = node->children; ni; ni = ni->sibling) {
-			if (is_pass(node_coord(ni))) continue;
-
-			/* Use the child move only if it was first played by the same color. */
-			int first = first_move[node_coord(ni)];
-			if (first == INT_MAX) continue;
-			assert(first > move && first < map->gamelen);
-			int distance = first - (move + 1);
-			if (distance & 1) continue;
-
-			int weight = 1;
-			floating_t res = result;
-
-			/* Don't give amaf bonus to a ko threat before taking the ko.
-			 * http://www.grappa.univ-lille3.fr/~coulom/Aja_PhD_Thesis.pdf
-			 */
-			if (distance <= max_threat_dist && distance % 6 == 4) {
-				weight = - b->threat_rave;
-				res = 1.0 - res;
-			} else if (b->distance_rave != 0) {
-				/* Give more weight to moves played earlier */
-				weight += b->distance_rave * (map->gamelen - first) / (map->gamelen - move);
-			}
-			stats_add_result(&ni->amaf, res, weight);
-
-			if (b->crit_amaf) {
-				stats_add_result(&ni->winner_owner, board_local_value(b->crit_lvalue, final_board, node_coord(ni), winner_color), 1);
-				stats_add_result(&ni->black_owner, board_local_value(b->crit_lvalue, final_board, node_coord(ni), S_BLACK), 1);
+			floating_t res; int weight;
+			if (!ucb1amaf_child_result(b, map, first_move, move, max_threat_dist,
+						   node_coord(ni), result, &res, &weight))
+				continue;
+			stats_add_result_relaxed(&ni->amaf, res, weight);
+
+			if (crit && b->crit_amaf) {
+				struct tree_node_cold *cold = tree_node_cold(tree, ni);
+				stats_add_result_relaxed(&cold->winner_owner, board_local_value(b->crit_lvalue, final_board, node_coord(ni), winner_color), 1);
+				stats_add_result_relaxed(&cold->black_owner, board_local_value(b->crit_lvalue, final_board, node_coord(ni), S_BLACK), 1);
 			}
 #if 0
 			struct board bb; bb.size = 9+2;
@@ -326,6 +381,17 @@ ucb1amaf_update(struct uct_policy *p, struct tree *tree, struct tree_node *node,
 				player_color, result, move, res);
 #endif
 		}
+		/* The candidates get their AMAF stats too, the criticality
+		 * is for nodes only. */
+		struct tree_cands *cands = tree_node_cands(tree, node);
+		for (int i = 0; cands && i < cands->count; i++) {
+			struct tree_cand *c = &cands->cand[i];
+			if (c->taken) continue;
+			floating_t res; int weight;
+			if (ucb1amaf_child_result(b, map, first_move, move, max_threat_dist,
+						  c->coord, result, &res, &weight))
+				stats_add_result_relaxed(&c->amaf, res, weight);
+		}
 		if (node->parent) {
 			assert(move >= 0 && map->game[move] == node_coord(node) && first_move[node_coord(node)] > move);
 			first_move[node_coord(node)] = move;
@@ -357,6 +423,7 @@ policy_ucb1amaf_init(struct uct *u, char *arg, struct board *board)
 	p->descend = ucb1rave_descend;
 	p->update = ucb1amaf_update;
 	p->wants_amaf = true;
+	ucb_tables_init();
 
 	b->explore_p = 0;
 	b->equiv_rave = board_large(board) ? 4000 : 3000;
@@ -370,6 +437,7 @@ policy_ucb1amaf_init(struct uct *u, char *arg, struct board *board)
 	b->crit_min_playouts = 2000;
 	b->crit_negative = 1;
 	b->crit_amaf = 0;
+	b->crit_sample = 1;
 
 	b->vloss_sqrt = true;
 
@@ -416,6 +484,10 @@ policy_ucb1amaf_init(struct uct *u, char *arg, struct board *board)
 				b->crit_amaf = !optval || *optval == '1';
 			} else if (!strcasecmp(optname, "crit_lvalue")) {
 				b->crit_lvalue = !optval || *optval == '1';
+			} else if (!strcasecmp(optname, "crit_sample") && optval) {
+				b->crit_sample = atoi(optval);
+			} else if (!strcasecmp(optname, "crit_maxdepth") && optval) {
+				b->crit_maxdepth = atoi(optval);
 			} else if (!strcasecmp(optname, "virtual_win") && optval) {
 				b->virtual_win = atoi(optval);
 			} else if (!strcasecmp(optname, "root_virtual_win") && optval) {
@@ -424,6 +496,10 @@ policy_ucb1amaf_init(struct uct *u, char *arg, struct board *board)
 				b->vwin_min_playouts = atoi(optval);
 			} else if (!strcasecmp(optname, "vloss_sqrt")) {
 				b->vloss_sqrt = !optval || *optval == '1';
+			} else if (!strcasecmp(optname, "vloss_adaptive") && optval) {
+				b->vloss_adaptive = atof(optval);
+			} else if (!strcasecmp(optname, "vloss_visit")) {
+				b->vloss_visit = !optval || *optval == '1';
 			} else {
 				fprintf(stderr, "ucb1amaf: Invalid policy argument %s or missing value\n",
 					optname);
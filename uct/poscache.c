@@ -0,0 +1,244 @@
+/* The same openings come back game after game, but each search starts
+ * from scratch. The position cache keeps the root stats of the deep
+ * searches (the most searched children with their visits and values)
+ * in a file mapped in memory, so that they survive the process and are
+ * shared by all the processes using the same file: when a cached
+ * position is expanded again, near the root, its children get the
+ * cached results as priors (see uct_prior()).
+ *
+ * Positions are keyed by a zobrist hash of the position in canonical
+ * orientation (the least of its 8 symmetries), the color to play, the
+ * ko and the komi, and the moves are stored in the canonical
+ * orientation as well. The file is a plain hash table with a few
+ * probes per key; a slot is written with its key cleared first, so a
+ * reader can detect a slot replaced under it. When the probed slots
+ * are all full, the position with the fewest playouts is replaced. */
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEBUG
+
+#include "debug.h"
+#include "board.h"
+#include "move.h"
+#include "uct/internal.h"
+#include "uct/poscache.h"
+#include "uct/prior.h"
+#include "uct/tree.h"
+
+#ifndef _WIN32
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define POSCACHE_MAGIC 0x70637031 // "pcp1"
+
+/* Moves stored per position. */
+#define POSCACHE_MOVES 16
+/* Slots tried for a key. */
+#define POSCACHE_PROBES 4
+
+struct poscache_header {
+	uint32_t magic;
+	int entries;
+};
+
+struct poscache_move {
+	coord_t coord; // canonical orientation
+	int playouts;
+	float value; // for the color to play
+};
+
+struct poscache_entry {
+	volatile uint64_t key; // 0 if free or being written
+	int playouts; // of the root
+	int moves;
+	struct poscache_move move[POSCACHE_MOVES];
+};
+
+struct uct_poscache {
+	struct poscache_header *h;
+	struct poscache_entry *e;
+	size_t size;
+};
+
+struct uct_poscache *
+uct_poscache_init(char *file, int entries)
+{
+	struct uct_poscache *pc = calloc2(1, sizeof(*pc));
+	pc->size = sizeof(struct poscache_header) + (size_t)entries * sizeof(struct poscache_entry);
+
+	int fd = open(file, O_RDWR | O_CREAT, 0644);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror(file);
+		exit(1);
+	}
+	bool created = !st.st_size;
+	if (created && ftruncate(fd, pc->size) < 0) {
+		perror(file);
+		exit(1);
+	}
+	if (!created && (size_t)st.st_size != pc->size) {
+		fprintf(stderr, "UCT: position cache %s has a different size, check poscache_size\n", file);
+		exit(1);
+	}
+	pc->h = mmap(NULL, pc->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (pc->h == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+
+	if (created) {
+		pc->h->entries = entries;
+		pc->h->magic = POSCACHE_MAGIC;
+	}
+	if (pc->h->magic != POSCACHE_MAGIC || pc->h->entries != entries) {
+		fprintf(stderr, "UCT: %s is not a position cache\n", file);
+		exit(1);
+	}
+	pc->e = (struct poscache_entry *)(pc->h + 1);
+	if (DEBUGL(2))
+		fprintf(stderr, "poscache %s: %d entries\n", file, entries);
+	return pc;
+}
+
+void
+uct_poscache_done(struct uct_poscache *pc)
+{
+	munmap(pc->h, pc->size);
+	free(pc);
+}
+
+/* Key of the position with @to_play to move; @sym is set to the
+ * symmetry taking it to the canonical orientation. */
+static uint64_t
+poscache_key(struct board *b, enum stone to_play, int *sym)
+{
+	hash_t key = board_canonical_hash(b, sym);
+	if (!is_pass(b->ko.coord))
+		key ^= ~hash_at(b, board_coord_transform(b, b->ko.coord, *sym), S_WHITE);
+	key ^= (uint64_t)(int)(b->komi * 2) << 8 | to_play;
+	return key ? key : 1;
+}
+
+static struct poscache_entry *
+poscache_slot(struct uct_poscache *pc, uint64_t key, int probe)
+{
+	return &pc->e[(key + probe) % pc->h->entries];
+}
+
+void
+uct_poscache_store(struct uct_poscache *pc, struct tree *t, struct board *b, enum stone color, int min_playouts)
+{
+	struct tree_node *root = t->root;
+	if (root->u.playouts < min_playouts)
+		return;
+	int sym;
+	uint64_t key = poscache_key(b, color, &sym);
+
+	/* The same position, else a free slot, else the shallowest. */
+	struct poscache_entry *e = NULL;
+	for (int i = 0; i < POSCACHE_PROBES && !e; i++)
+		if (poscache_slot(pc, key, i)->key == key)
+			e = poscache_slot(pc, key, i);
+	for (int i = 0; i < POSCACHE_PROBES && (!e || e->key != key); i++) {
+		struct poscache_entry *ei = poscache_slot(pc, key, i);
+		if (!e || (e->key && (!ei->key || ei->playouts < e->playouts)))
+			e = ei;
+	}
+	if (e->key && e->playouts > root->u.playouts)
+		return;
+
+	/* The most searched children, by visits. */
+	struct poscache_entry ne = { .playouts = root->u.playouts };
+	for (struct tree_node *ni = root->children; ni; ni = ni->sibling) {
+		if (is_pass(node_coord(ni)) || ni->u.playouts <= 0 || (ni->hints & TREE_HINT_INVALID))
+			continue;
+		if (ne.moves == POSCACHE_MOVES && ne.move[ne.moves - 1].playouts >= ni->u.playouts)
+			continue;
+		int i = ne.moves < POSCACHE_MOVES ? ne.moves++ : ne.moves - 1;
+		for (; i > 0 && ne.move[i - 1].playouts < ni->u.playouts; i--)
+			ne.move[i] = ne.move[i - 1];
+		ne.move[i] = (struct poscache_move) {
+			.coord = board_coord_transform(b, node_coord(ni), sym),
+			.playouts = ni->u.playouts,
+			.value = tree_node_get_value(t, 1, ni->u.value),
+		};
+	}
+	if (!ne.moves)
+		return;
+
+	e->key = 0;
+	__sync_synchronize();
+	e->playouts = ne.playouts;
+	e->moves = ne.moves;
+	memcpy(e->move, ne.move, sizeof(ne.move));
+	__sync_synchronize();
+	e->key = key;
+}
+
+int
+uct_poscache_prior(struct uct_poscache *pc, struct prior_map *map, int eqex)
+{
+	struct board *b = map->b;
+	int sym;
+	uint64_t key = poscache_key(b, map->to_play, &sym);
+
+	struct poscache_entry e;
+	for (int i = 0; i < POSCACHE_PROBES; i++) {
+		struct poscache_entry *ei = poscache_slot(pc, key, i);
+		if (ei->key != key)
+			continue;
+		memcpy(&e, (void *)ei, sizeof(e));
+		__sync_synchronize();
+		if (ei->key != key || e.moves <= 0 || e.moves > POSCACHE_MOVES)
+			continue;
+
+		int n = 0;
+		for (int k = 0; k < e.moves; k++) {
+			coord_t c = board_coord_untransform(b, e.move[k].coord, sym);
+			int playouts = (int64_t)eqex * e.move[k].playouts / e.move[0].playouts;
+			if (!playouts || !map->consider[c])
+				continue;
+			add_prior_value(map, c, e.move[k].value, playouts);
+			n++;
+		}
+		return n;
+	}
+	return 0;
+}
+
+#else
+
+struct uct_poscache *
+uct_poscache_init(char *file, int entries)
+{
+	fprintf(stderr, "UCT: poscache is not supported on this platform\n");
+	exit(1);
+}
+
+void
+uct_poscache_done(struct uct_poscache *pc)
+{
+}
+
+void
+uct_poscache_store(struct uct_poscache *pc, struct tree *t, struct board *b, enum stone color, int min_playouts)
+{
+}
+
+int
+uct_poscache_prior(struct uct_poscache *pc, struct prior_map *map, int eqex)
+{
+	return 0;
+}
+
+#endif
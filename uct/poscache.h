@@ -0,0 +1,29 @@
+#ifndef PACHI_UCT_POSCACHE_H
+#define PACHI_UCT_POSCACHE_H
+
+/* Persistent cache of the root stats of deep searches, kept in a file
+ * mapped in memory and shared by all the pachi processes using it, so
+ * that positions recurring from game to game (openings especially)
+ * start with the priors of the earlier searches (see uct/poscache.c). */
+
+#include "stone.h"
+
+struct board;
+struct tree;
+struct prior_map;
+struct uct_poscache;
+
+/* Map (or create) the cache file with room for @entries positions.
+ * Exits on error. */
+struct uct_poscache *uct_poscache_init(char *file, int entries);
+void uct_poscache_done(struct uct_poscache *pc);
+
+/* Store the root children stats of @t, searched on @b with @color
+ * to play, if the root has at least @min_playouts playouts. */
+void uct_poscache_store(struct uct_poscache *pc, struct tree *t, struct board *b, enum stone color, int min_playouts);
+/* Add the cached results for the position of @map as priors, the
+ * most searched move getting @eqex playouts. Returns the number of
+ * moves given priors. */
+int uct_poscache_prior(struct uct_poscache *pc, struct prior_map *map, int eqex);
+
+#endif
@@ -1,5 +1,6 @@
 #include <assert.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,13 +10,16 @@
 #include "debug.h"
 #include "joseki/base.h"
 #include "move.h"
+#include "perfstats.h"
 #include "random.h"
 #include "tactics/ladder.h"
 #include "tactics/util.h"
 #include "uct/internal.h"
 #include "uct/plugins.h"
+#include "uct/poscache.h"
 #include "uct/prior.h"
 #include "uct/tree.h"
+#include "timeinfo.h"
 #include "dcnn.h"
 
 /* Applying heuristic values to the tree nodes, skewing the reading in
@@ -31,8 +35,30 @@ struct uct_prior {
 	int eqex;
 	int even_eqex, policy_eqex, b19_eqex, eye_eqex, ko_eqex, plugin_eqex, joseki_eqex, pattern_eqex;
 	int dcnn_eqex;
+	/* Cached results of earlier searches, see uct/poscache.c;
+	 * this is the eqex of the most searched cached move. */
+	int poscache_eqex;
+	/* Also use dcnn for in-tree nodes, evaluated asynchronously
+	 * in batches of dcnn_batch positions. */
+	bool dcnn_tree;
+	int dcnn_batch;
 	int cfgdn; int *cfgd_eqex;
 	bool prune_ladders;
+	/* Give in-tree nodes only the cheap priors on expansion and
+	 * add the heavy ones (dcnn, playout policy, patterns, plugins)
+	 * once the node has been visited lazy times; 0 = disabled. */
+	int lazy;
+	/* Pattern ratings of the last expanded nodes, by node, so
+	 * that their grandchildren are rated incrementally; number
+	 * of entries, 0 = disabled. */
+	int pattern_cache;
+	struct pattern_cache_entry *pcache;
+};
+
+struct pattern_cache_entry {
+	struct tree_node *node;
+	volatile int lock;
+	struct pattern_ratings r;
 };
 
 void
@@ -96,10 +122,247 @@ uct_prior_dcnn(struct uct *u, struct tree_node *node, struct prior_map *map)
 	} foreach_free_point_end;
 }
 
+
+/* Asynchronous dcnn priors for in-tree nodes: the expanding thread only
+ * queues the position and goes on, a dedicated thread evaluates queued
+ * positions in batches and adds the priors to the node children when
+ * they return. Meanwhile the pending node carries a virtual loss which
+ * keeps other threads mostly away from it. A node has at most one
+ * request pending (TREE_HINT_DCNN_QUEUED), so the virtual losses do
+ * not pile up in its descents counter. */
+
+#define DCNN_QUEUE_SIZE 1024
+/* Virtual loss of a node waiting for dcnn evaluation. */
+#define DCNN_PENDING_VLOSS 8
+/* Maximum time to wait for a batch to fill up [s]. */
+#define DCNN_BATCH_WAIT 0.002
+/* Batches to wait for the children of a node before giving up. */
+#define DCNN_MAX_RETRIES 100
+
+struct dcnn_request {
+	struct tree *t;
+	struct tree_node *node;
+	struct board b;
+	enum stone color;
+	int parity;
+	int eqex;
+	float r[19 * 19]; // result kept for a retry
+	int retries;
+};
+
+static pthread_mutex_t dcnn_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dcnn_cond = PTHREAD_COND_INITIALIZER; // new requests
+static pthread_cond_t dcnn_done_cond = PTHREAD_COND_INITIALIZER; // queue drained
+static struct dcnn_request *dcnn_queue[DCNN_QUEUE_SIZE];
+static int dcnn_queue_head, dcnn_queue_len;
+static int dcnn_pending; // queued, being evaluated or retried
+static int dcnn_batch = 1;
+static bool dcnn_thread_running;
+
+static void
+dcnn_add_prior(struct dcnn_request *req, float *r, coord_t c, struct move_stats *prior)
+{
+	if (is_pass(c))
+		return;
+	int i = coord_x(c, &req->b) - 1;
+	int j = coord_y(c, &req->b) - 1;
+	float val = r[i * 19 + j];
+	if (isnan(val) || val < 0.001)
+		return;
+	int playouts = sqrt(val) * req->eqex;
+	if (playouts > 0)
+		stats_add_result(prior, req->parity > 0 ? 1 : 0, playouts);
+}
+
+/* Returns false if the node children are not published yet,
+ * the request is retried after the next batch then. */
+static bool
+dcnn_apply_result(struct dcnn_request *req, float *r)
+{
+	struct tree_node *node = req->node;
+	/* The expanding thread publishes children right after queueing,
+	 * but don't spin on a search thread which may be descheduled. */
+	if (node->is_expanded && !node->children)
+		return false;
+	bool first = node->children
+		&& !(__sync_fetch_and_or(&node->hints, TREE_HINT_DCNN_PRIOR) & TREE_HINT_DCNN_PRIOR);
+
+	/* The candidates first: one taken meanwhile is in the children
+	 * by the time we walk them, most of the time. */
+	struct tree_cands *cands = first ? tree_node_cands(req->t, node) : NULL;
+	for (int k = 0; cands && k < cands->count; k++)
+		if (!cands->cand[k].taken)
+			dcnn_add_prior(req, r, cands->cand[k].coord, &cands->cand[k].prior);
+	for (struct tree_node *ni = first ? node->children : NULL; ni; ni = ni->sibling)
+		dcnn_add_prior(req, r, node_coord(ni), &ni->prior);
+	/* The expansion failed: let the next one queue again. */
+	if (!node->children)
+		__sync_fetch_and_and(&node->hints, (unsigned char) ~TREE_HINT_DCNN_QUEUED);
+	__sync_fetch_and_sub(&node->descents, DCNN_PENDING_VLOSS);
+	return true;
+}
+
+/* Give up on a request, the node goes without dcnn priors. */
+static void
+dcnn_request_drop(struct dcnn_request *req)
+{
+	struct tree_node *node = req->node;
+	__sync_fetch_and_and(&node->hints, (unsigned char) ~TREE_HINT_DCNN_QUEUED);
+	__sync_fetch_and_sub(&node->descents, DCNN_PENDING_VLOSS);
+}
+
+static void
+dcnn_request_done(struct dcnn_request *req)
+{
+	board_done_noalloc(&req->b);
+	free(req);
+}
+
+static void *
+dcnn_worker(void *data)
+{
+	struct dcnn_request *reqs[DCNN_MAX_BATCH];
+	struct board *boards[DCNN_MAX_BATCH];
+	enum stone colors[DCNN_MAX_BATCH];
+	float *presults[DCNN_MAX_BATCH];
+	/* Requests whose node children were not published yet. */
+	struct dcnn_request *retry[DCNN_QUEUE_SIZE];
+	int retry_n = 0;
+
+	while (true) {
+		pthread_mutex_lock(&dcnn_mutex);
+		int batch = dcnn_batch;
+		while (!dcnn_queue_len && !retry_n)
+			pthread_cond_wait(&dcnn_cond, &dcnn_mutex);
+		if (dcnn_queue_len < batch) {
+			/* Give the batch a chance to fill up,
+			 * and the pending children to show up. */
+			struct timespec ts;
+			double deadline = time_now() + DCNN_BATCH_WAIT;
+			ts.tv_sec = (int)deadline;
+			ts.tv_nsec = (int)((deadline - ts.tv_sec) * 1000000000);
+			pthread_cond_timedwait(&dcnn_cond, &dcnn_mutex, &ts);
+		}
+		int n = dcnn_queue_len < batch ? dcnn_queue_len : batch;
+		for (int k = 0; k < n; k++) {
+			reqs[k] = dcnn_queue[dcnn_queue_head];
+			dcnn_queue_head = (dcnn_queue_head + 1) % DCNN_QUEUE_SIZE;
+		}
+		dcnn_queue_len -= n;
+		pthread_mutex_unlock(&dcnn_mutex);
+
+		for (int k = 0; k < n; k++) {
+			boards[k] = &reqs[k]->b;
+			colors[k] = reqs[k]->color;
+			presults[k] = reqs[k]->r;
+		}
+		if (n)
+			dcnn_get_moves_batch(boards, colors, presults, n);
+
+		/* The retries first, then the new requests; retry[] is
+		 * refilled behind the retries being read. An expansion
+		 * may be abandoned: give up after a while, so that
+		 * uct_prior_dcnn_flush() does not wait forever. */
+		int done = 0, retries = retry_n;
+		retry_n = 0;
+		for (int k = 0; k < retries + n; k++) {
+			struct dcnn_request *req = k < retries ? retry[k] : reqs[k - retries];
+			if (dcnn_apply_result(req, req->r)) {
+				dcnn_request_done(req);
+				done++;
+			} else if (++req->retries < DCNN_MAX_RETRIES && retry_n < DCNN_QUEUE_SIZE) {
+				retry[retry_n++] = req;
+			} else {
+				dcnn_request_drop(req);
+				dcnn_request_done(req);
+				done++;
+			}
+		}
+
+		pthread_mutex_lock(&dcnn_mutex);
+		dcnn_pending -= done;
+		if (!dcnn_pending)
+			pthread_cond_broadcast(&dcnn_done_cond);
+		pthread_mutex_unlock(&dcnn_mutex);
+	}
+	return NULL;
+}
+
+static void
+uct_prior_dcnn_async(struct uct *u, struct tree_node *node, struct prior_map *map)
+{
+	pthread_mutex_lock(&dcnn_mutex);
+	if (!dcnn_thread_running) {
+		/* One worker per network instance, so that
+		 * all the devices get batches. */
+		for (int i = 0; i < dcnn_instances(); i++) {
+			pthread_t thread;
+			pthread_create(&thread, NULL, dcnn_worker, NULL);
+			pthread_detach(thread);
+		}
+		dcnn_thread_running = true;
+	}
+	dcnn_batch = u->prior->dcnn_batch;
+	if (dcnn_queue_len >= DCNN_QUEUE_SIZE) {
+		/* Evaluation can't keep up, go on without dcnn priors. */
+		pthread_mutex_unlock(&dcnn_mutex);
+		return;
+	}
+	pthread_mutex_unlock(&dcnn_mutex);
+	/* Queue a node only once, until its result is applied. */
+	if (__sync_fetch_and_or(&node->hints, TREE_HINT_DCNN_QUEUED) & TREE_HINT_DCNN_QUEUED)
+		return;
+
+	/* The board copy is made outside the lock. */
+	struct dcnn_request *req = malloc2(sizeof(*req));
+	board_copy(&req->b, map->b);
+	req->t = u->t;
+	req->node = node;
+	req->retries = 0;
+	req->color = map->to_play;
+	req->parity = map->parity;
+	req->eqex = u->prior->dcnn_eqex;
+	__sync_fetch_and_add(&node->descents, DCNN_PENDING_VLOSS);
+
+	pthread_mutex_lock(&dcnn_mutex);
+	if (dcnn_queue_len >= DCNN_QUEUE_SIZE) {
+		pthread_mutex_unlock(&dcnn_mutex);
+		__sync_fetch_and_sub(&node->descents, DCNN_PENDING_VLOSS);
+		__sync_fetch_and_and(&node->hints, (unsigned char) ~TREE_HINT_DCNN_QUEUED);
+		dcnn_request_done(req);
+		return;
+	}
+	dcnn_queue[(dcnn_queue_head + dcnn_queue_len++) % DCNN_QUEUE_SIZE] = req;
+	dcnn_pending++;
+	pthread_cond_signal(&dcnn_cond);
+	pthread_mutex_unlock(&dcnn_mutex);
+}
+
+static void
+uct_prior_dcnn_flush(struct uct *u)
+{
+	if (!u->prior->dcnn_tree)
+		return;
+	pthread_mutex_lock(&dcnn_mutex);
+	while (dcnn_pending)
+		pthread_cond_wait(&dcnn_done_cond, &dcnn_mutex);
+	pthread_mutex_unlock(&dcnn_mutex);
+}
+
 #else
 #define uct_prior_dcnn(u, node, map)  
+#define uct_prior_dcnn_async(u, node, map)
+#define uct_prior_dcnn_flush(u)
 #endif /* DCNN */
 
+void
+uct_prior_flush(struct uct *u)
+{
+	uct_prior_dcnn_flush(u);
+	if (u->prior->plugin_eqex)
+		plugin_flush(u->plugins);
+}
+
 
 void
 uct_prior_ko(struct uct *u, struct tree_node *node, struct prior_map *map)
@@ -168,8 +431,7 @@ uct_prior_joseki(struct uct *u, struct tree_node *node, struct prior_map *map)
 	if (!u->jdict)
 		return;
 	for (int i = 0; i < 4; i++) {
-		hash_t h = map->b->qhash[i] & joseki_hash_mask;
-		coord_t *cc = u->jdict->patterns[h].moves[map->to_play - 1];
+		coord_t *cc = joseki_moves(u->jdict, map->b->qhash[i], map->to_play);
 		if (!cc) continue;
 		for (; !is_pass(*cc); cc++) {
 			if (coord_quadrant(*cc, map->b) != i)
@@ -179,6 +441,23 @@ uct_prior_joseki(struct uct *u, struct tree_node *node, struct prior_map *map)
 	}
 }
 
+/* The entry of @node's slot, or NULL if another thread holds it.
+ * The slot may belong to another node. */
+static struct pattern_cache_entry *
+pattern_cache_lock(struct uct_prior *p, struct tree_node *node)
+{
+	struct pattern_cache_entry *e = &p->pcache[((uintptr_t) node / sizeof(*node)) % p->pattern_cache];
+	if (__sync_lock_test_and_set(&e->lock, 1))
+		return NULL;
+	return e;
+}
+
+static void
+pattern_cache_unlock(struct pattern_cache_entry *e)
+{
+	__sync_lock_release(&e->lock);
+}
+
 void
 uct_prior_pattern(struct uct *u, struct tree_node *node, struct prior_map *map)
 {
@@ -189,7 +468,24 @@ uct_prior_pattern(struct uct *u, struct tree_node *node, struct prior_map *map)
 	struct board *b = map->b;
 	struct pattern pats[b->flen];
 	floating_t probs[b->flen];
-	pattern_rate_moves(&u->pat, b, map->to_play, pats, probs);
+	/* The position of the grandparent differs just by the last
+	 * two moves, so most of its ratings are still good. pats[]
+	 * would not be complete, so not when debugging. */
+	struct tree_node *grandparent = node->parent ? node->parent->parent : NULL;
+	struct pattern_cache_entry *e = NULL;
+	if (u->prior->pcache && grandparent && !UDEBUGL(5))
+		e = pattern_cache_lock(u->prior, grandparent);
+	if (e && e->node == grandparent)
+		pattern_rate_moves_incr(&u->pat, b, map->to_play, &e->r, pats, probs);
+	else
+		pattern_rate_moves(&u->pat, b, map->to_play, pats, probs);
+	if (e)
+		pattern_cache_unlock(e);
+	if (u->prior->pcache && (e = pattern_cache_lock(u->prior, node))) {
+		e->node = node;
+		pattern_ratings_save(&e->r, b, map->to_play, probs);
+		pattern_cache_unlock(e);
+	}
 	if (UDEBUGL(5)) {
 		fprintf(stderr, "Pattern prior at node %s\n", coord2sstr(node->coord, b));
 		board_print(b, stderr);
@@ -207,9 +503,28 @@ uct_prior_pattern(struct uct *u, struct tree_node *node, struct prior_map *map)
 	}
 }
 
+static bool
+uct_prior_has_heavy(struct uct *u)
+{
+	return (u->prior->dcnn_eqex && u->prior->dcnn_tree)
+		|| (u->prior->policy_eqex && u->playout->assess)
+		|| (u->prior->pattern_eqex && u->pat.pd)
+		|| u->prior->plugin_eqex;
+}
+
+static void
+uct_prior_dcnn_node(struct uct *u, struct tree_node *node, struct prior_map *map)
+{
+	if (!node->parent)  // Use dcnn for root priors
+		uct_prior_dcnn(u, node, map);
+	else if (u->prior->dcnn_tree)
+		uct_prior_dcnn_async(u, node, map);
+}
+
 void
 uct_prior(struct uct *u, struct tree_node *node, struct prior_map *map)
 {
+	uint64_t t = perf_start();
 	if (u->prior->prune_ladders && !board_playing_ko_threat(map->b)) {
 		foreach_free_point(map->b) {
 			if (!map->consider[c])
@@ -225,6 +540,9 @@ uct_prior(struct uct *u, struct tree_node *node, struct prior_map *map)
 		} foreach_free_point_end;
 	}
 
+	/* Leave the heavy priors for uct_prior_lazy() or another thread? */
+	bool lazy = (u->prior->lazy && node->parent && uct_prior_has_heavy(u)) || !map->heavy;
+
 	if (u->prior->even_eqex)
 		uct_prior_even(u, node, map);
 	if (u->prior->eye_eqex)
@@ -234,20 +552,91 @@ uct_prior(struct uct *u, struct tree_node *node, struct prior_map *map)
 	if (u->prior->b19_eqex)
 		uct_prior_b19(u, node, map);
 	
-	if (!node->parent)  // Use dcnn for root priors
-		if (u->prior->dcnn_eqex)
-			uct_prior_dcnn(u, node, map);
+	if (u->prior->dcnn_eqex && !lazy)
+		uct_prior_dcnn_node(u, node, map);
 	
-	if (u->prior->policy_eqex)
+	if (u->prior->policy_eqex && !lazy)
 		uct_prior_playout(u, node, map);
 	if (u->prior->cfgd_eqex)
 		uct_prior_cfgd(u, node, map);
 	if (u->prior->joseki_eqex)
 		uct_prior_joseki(u, node, map);
-	if (u->prior->pattern_eqex)
+	if (u->prior->pattern_eqex && !lazy)
 		uct_prior_pattern(u, node, map);
+	if (u->prior->plugin_eqex && !lazy)
+		plugin_prior(u->plugins, u->t, node, map, u->prior->plugin_eqex);
+	/* Only near the root, the canonical hash costs. */
+	if (u->poscache && u->prior->poscache_eqex && map->heavy && (!node->parent || !node->parent->parent)) {
+		int n = uct_poscache_prior(u->poscache, map, u->prior->poscache_eqex);
+		if (UDEBUGL(3) && n && !node->parent)
+			fprintf(stderr, "poscache: priors for %d moves\n", n);
+	}
+
+	/* The children are published only after we return. */
+	if (lazy && map->heavy)
+		__sync_fetch_and_or(&node->hints, TREE_HINT_LAZY_PRIOR);
+	perf_stop(PERF_PRIOR, t);
+}
+
+void
+uct_prior_lazy(struct uct *u, struct tree *t, struct tree_node *node, struct board *b, enum stone color, int parity)
+{
+	if (node->u.playouts < u->prior->lazy || !node->children)
+		return;
+	/* Only the thread clearing the hint computes the priors. */
+	if (!(__sync_fetch_and_and(&node->hints, ~TREE_HINT_LAZY_PRIOR) & TREE_HINT_LAZY_PRIOR))
+		return;
+
+	uint64_t start = perf_start();
+	struct prior_map map = {
+		.b = b,
+		.to_play = color,
+		.parity = tree_parity(t, parity),
+	};
+	struct move_stats map_prior[board_size2(b) + 1]; map.prior = &map_prior[1];
+	bool map_consider[board_size2(b) + 1]; map.consider = &map_consider[1];
+	int distances[board_size2(b)]; map.distances = distances;
+	memset(map_prior, 0, sizeof(map_prior));
+	memset(map_consider, 0, sizeof(map_consider));
+	foreach_point(b) { distances[c] = TREE_NODE_D_MAX + 1; } foreach_point_end;
+	for (struct tree_node *ni = node->children; ni; ni = ni->sibling) {
+		coord_t c = node_coord(ni);
+		map.consider[c] = true;
+		if (!is_pass(c))
+			distances[c] = ni->d;
+	}
+	struct tree_cands *cands = tree_node_cands(t, node);
+	for (int i = 0; cands && i < cands->count; i++) {
+		map.consider[cands->cand[i].coord] = true;
+		distances[cands->cand[i].coord] = cands->cand[i].d;
+	}
+
+	if (u->prior->dcnn_eqex)
+		uct_prior_dcnn_node(u, node, &map);
+	if (u->prior->policy_eqex)
+		uct_prior_playout(u, node, &map);
+	if (u->prior->pattern_eqex)
+		uct_prior_pattern(u, node, &map);
 	if (u->prior->plugin_eqex)
-		plugin_prior(u->plugins, node, map, u->prior->plugin_eqex);
+		plugin_prior(u->plugins, t, node, &map, u->prior->plugin_eqex);
+
+	for (int i = 0; cands && i < cands->count; i++) {
+		struct move_stats *s = &map.prior[cands->cand[i].coord];
+		if (s->playouts && !cands->cand[i].taken)
+			stats_merge(&cands->cand[i].prior, s);
+	}
+	for (struct tree_node *ni = node->children; ni; ni = ni->sibling) {
+		struct move_stats *s = &map.prior[node_coord(ni)];
+		if (s->playouts)
+			stats_merge(&ni->prior, s);
+	}
+	perf_stop(PERF_PRIOR, start);
+}
+
+bool
+uct_prior_async(struct uct *u)
+{
+	return u->prior->dcnn_tree || (u->prior->plugin_eqex && plugin_batched(u->plugins));
 }
 
 struct uct_prior *
@@ -264,13 +653,16 @@ uct_prior_init(char *arg, struct board *b, struct uct *u)
 	 * against regular pachi. Below 1200 is bad (50% winrate and worse), more
 	 * gives diminishing returns (1500 -> 78%, 2000 -> 70% ...) */
 	p->dcnn_eqex    = 1300;
+	p->dcnn_batch = 16;
 	p->joseki_eqex = -200;
+	p->poscache_eqex = -2000;
 	p->cfgdn = -1;
 
 	/* Even number! */
 	p->eqex = board_large(b) ? 20 : 14;
 
 	p->prune_ladders = true;
+	p->pattern_cache = 1024;
 
 	if (arg) {
 		char *optspec, *next = arg;
@@ -326,14 +718,38 @@ uct_prior_init(char *arg, struct board *b, struct uct *u)
 				 * used only if you have downloaded or
 				 * generated the pattern files! */
 				p->pattern_eqex = atoi(optval);
+			} else if (!strcasecmp(optname, "pattern_cache") && optval) {
+				/* Number of expanded nodes to keep the
+				 * pattern ratings of, to rate their
+				 * grandchildren incrementally; 0 = off. */
+				p->pattern_cache = atoi(optval);
 			} else if (!strcasecmp(optname, "plugin") && optval) {
 				/* Unlike others, this is just a *recommendation*. */
 				p->plugin_eqex = atoi(optval);
+			} else if (!strcasecmp(optname, "poscache") && optval) {
+				/* Priors from the cached searches (poscache
+				 * uct option), for the most searched move;
+				 * the others get a share by their visits. */
+				p->poscache_eqex = atoi(optval);
+			} else if (!strcasecmp(optname, "lazy") && optval) {
+				/* Compute the heavy priors of in-tree nodes
+				 * only once they have this many playouts. */
+				p->lazy = atoi(optval);
 			} else if (!strcasecmp(optname, "prune_ladders")) {
 				p->prune_ladders = !optval || atoi(optval);
 #ifdef DCNN
 			} else if (!strcasecmp(optname, "dcnn") && optval) {
 				p->dcnn_eqex = atoi(optval);
+			} else if (!strcasecmp(optname, "dcnn_tree")) {
+				/* Use dcnn priors for in-tree nodes too, not just root. */
+				p->dcnn_tree = !optval || atoi(optval);
+			} else if (!strcasecmp(optname, "dcnn_batch") && optval) {
+				/* Number of positions per dcnn evaluation batch. */
+				p->dcnn_batch = atoi(optval);
+				if (p->dcnn_batch < 1 || p->dcnn_batch > DCNN_MAX_BATCH) {
+					fprintf(stderr, "uct: dcnn_batch must be 1..%d\n", DCNN_MAX_BATCH);
+					exit(1);
+				}
 #endif
 			} else {
 				fprintf(stderr, "uct: Invalid prior argument %s or missing value\n", optname);
@@ -351,9 +767,12 @@ uct_prior_init(char *arg, struct board *b, struct uct *u)
 	if (p->pattern_eqex < 0) p->pattern_eqex = p->eqex * -p->pattern_eqex / 100;
 	if (p->plugin_eqex < 0) p->plugin_eqex = p->eqex * -p->plugin_eqex / 100;
 	if (p->dcnn_eqex < 0) p->dcnn_eqex = p->eqex * -p->dcnn_eqex / 100;
+	if (p->poscache_eqex < 0) p->poscache_eqex = p->eqex * -p->poscache_eqex / 100;
 
 	if (!using_dcnn(b))
 		p->dcnn_eqex = 0;
+	if (!p->dcnn_eqex)
+		p->dcnn_tree = false;
 	
 	if (p->cfgdn < 0) {
 		static int large_bonuses[] = { 0, 55, 50, 15 };
@@ -369,6 +788,8 @@ uct_prior_init(char *arg, struct board *b, struct uct *u)
 
 	if (p->pattern_eqex)
 		u->want_pat = true;
+	if (p->pattern_eqex && p->pattern_cache > 0)
+		p->pcache = calloc2(p->pattern_cache, sizeof(*p->pcache));
 
 	return p;
 }
@@ -378,5 +799,10 @@ uct_prior_done(struct uct_prior *p)
 {
 	assert(p->cfgd_eqex);
 	free(p->cfgd_eqex);
+	if (p->pcache) {
+		for (int i = 0; i < p->pattern_cache; i++)
+			pattern_ratings_done(&p->pcache[i].r);
+		free(p->pcache);
+	}
 	free(p);
 }
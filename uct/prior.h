@@ -22,12 +22,26 @@ struct prior_map {
 	bool *consider;
 	/* [board_size2(b)] array from cfg_distances() */
 	int *distances;
+	/* Compute the costly priors too (dcnn, patterns, plugins...),
+	 * only one of the threads expanding a node does. */
+	bool heavy;
 };
 
 /* @value is the value, @playouts is its weight. */
 static void add_prior_value(struct prior_map *map, coord_t c, floating_t value, int playouts);
 
 void uct_prior(struct uct *u, struct tree_node *node, struct prior_map *map);
+/* With the lazy prior option, uct_prior() gives the children of non-root
+ * nodes only the cheap priors and tags the node TREE_HINT_LAZY_PRIOR;
+ * call this on further descents through the node (with the node's
+ * position on @b) to add the heavy priors once it has enough playouts. */
+void uct_prior_lazy(struct uct *u, struct tree *t, struct tree_node *node, struct board *b, enum stone color, int parity);
+/* Wait for pending asynchronous priors to be applied. Must be
+ * called before the tree is modified outside of the search. */
+void uct_prior_flush(struct uct *u);
+/* Whether priors may still be applied to nodes after their expansion
+ * (dcnn in the tree, batched plugins). */
+bool uct_prior_async(struct uct *u);
 
 struct uct_prior;
 struct uct_prior *uct_prior_init(char *arg, struct board *b, struct uct *u);
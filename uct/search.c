@@ -11,12 +11,14 @@
 #define DEBUG
 
 #include "debug.h"
+#include "metrics.h"
 #include "distributed/distributed.h"
 #include "move.h"
 #include "random.h"
 #include "timeinfo.h"
 #include "uct/dynkomi.h"
 #include "uct/internal.h"
+#include "uct/prior.h"
 #include "uct/search.h"
 #include "uct/tree.h"
 #include "uct/uct.h"
@@ -52,6 +54,14 @@ static const struct time_info unlimited_ti = {
 /* Minimal time to consider early break (in seconds). */
 #define TIME_EARLY_BREAK_MIN 1.0
 
+/* Smoothing factor of the forecast samples. */
+#define FORECAST_ALPHA 0.3
+/* Forecast stops require the gap to stay out of reach even if the
+ * second best move got this many times its recent playout share... */
+#define FORECAST_SHARE_MARGIN 3
+/* ...but at least this share. */
+#define FORECAST_SHARE_MIN 0.2
+
 
 /* Pachi threading structure:
  *
@@ -60,7 +70,7 @@ static const struct time_info unlimited_ti = {
  *   |         starts and stops the search managed by thread_manager
  *   |
  * thread_manager
- *   |         spawns and collects worker threads
+ *   |         starts and collects worker threads
  *   |
  * worker0
  * worker1
@@ -68,6 +78,11 @@ static const struct time_info unlimited_ti = {
  * workerK
  *             uct_playouts() loop, doing descend-playout until uct_halt
  *
+ * The worker threads are persistent: they are created on first use and
+ * kept in a pool, sleeping between searches. This avoids thread
+ * creation and join overhead at each genmove, which matters in blitz.
+ * The thread manager is still started per search.
+ *
  * Another way to look at it is by functions (lines denote thread boundaries):
  *
  * | uct_genmove()
@@ -75,7 +90,7 @@ static const struct time_info unlimited_ti = {
  * | -----------------------
  * | spawn_thread_manager()
  * | -----------------------
- * | spawn_worker()
+ * | pool_worker()
  * V uct_playouts() */
 
 /* Set in thread manager in case the workers should stop. */
@@ -89,23 +104,202 @@ static pthread_cond_t finish_cond = PTHREAD_COND_INITIALIZER;
 static volatile int finish_thread;
 static pthread_mutex_t finish_serializer = PTHREAD_MUTEX_INITIALIZER;
 
-static void *
-spawn_worker(void *ctx_)
+/* Worker pool. A search is started by setting up pool_ctx[] for the
+ * first pool_active workers and bumping pool_generation. */
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static unsigned int pool_generation;
+static int pool_threads; // number of workers in the pool
+static int pool_active; // number of workers taking part in current search
+static struct uct_thread_ctx **pool_ctx;
+
+struct pool_worker_arg {
+	int tid;
+	unsigned int generation; // last generation seen
+};
+
+static void
+run_worker(struct uct_thread_ctx *ctx)
 {
-	struct uct_thread_ctx *ctx = ctx_;
-	/* Setup */
-	fast_srandom(ctx->seed);
+	/* Setup; each worker gets its own non-overlapping stream,
+	 * the manager uses stream 0. */
+	fast_srandom_stream(ctx->seed, ctx->tid + 1);
 	/* Run */
-	ctx->games = uct_playouts(ctx->u, ctx->b, ctx->color, ctx->t, ctx->ti);
+	ctx->games = uct_playouts(ctx->u, ctx->b, ctx->color, ctx->t, ctx->ti, ctx->tid);
 	/* Finish */
 	pthread_mutex_lock(&finish_serializer);
 	pthread_mutex_lock(&finish_mutex);
 	finish_thread = ctx->tid;
 	pthread_cond_signal(&finish_cond);
 	pthread_mutex_unlock(&finish_mutex);
-	return ctx;
 }
 
+static void *
+pool_worker(void *arg_)
+{
+	struct pool_worker_arg *arg = arg_;
+	int tid = arg->tid;
+	unsigned int generation = arg->generation;
+	free(arg);
+	numa_pin_thread(tid);
+
+	while (true) {
+		pthread_mutex_lock(&pool_mutex);
+		while (generation == pool_generation)
+			pthread_cond_wait(&pool_cond, &pool_mutex);
+		generation = pool_generation;
+		struct uct_thread_ctx *ctx = tid < pool_active ? pool_ctx[tid] : NULL;
+		pthread_mutex_unlock(&pool_mutex);
+
+		if (ctx)
+			run_worker(ctx);
+	}
+	return NULL;
+}
+
+/* Wake up the first @threads workers of the pool to run @ctxs,
+ * spawning new workers if needed. */
+static void
+pool_start(struct uct *u, struct uct_thread_ctx **ctxs, int threads)
+{
+	pthread_mutex_lock(&pool_mutex);
+	if (threads > pool_threads)
+		pool_ctx = realloc2(pool_ctx, threads * sizeof(*pool_ctx));
+	for (int ti = 0; ti < threads; ti++)
+		pool_ctx[ti] = ctxs[ti];
+	pool_active = threads;
+
+	for (; pool_threads < threads; pool_threads++) {
+		struct pool_worker_arg *arg = malloc2(sizeof(*arg));
+		arg->tid = pool_threads;
+		arg->generation = pool_generation;
+		pthread_attr_t a;
+		pthread_attr_init(&a);
+		pthread_attr_setstacksize(&a, 1048576);
+		pthread_attr_setdetachstate(&a, PTHREAD_CREATE_DETACHED);
+		pthread_t thread;
+		pthread_create(&thread, &a, pool_worker, arg);
+		pthread_attr_destroy(&a);
+		if (UDEBUGL(4))
+			fprintf(stderr, "Spawned worker %d\n", pool_threads);
+	}
+
+	pool_generation++;
+	pthread_cond_broadcast(&pool_cond);
+	pthread_mutex_unlock(&pool_mutex);
+}
+
+/* Root parallelization (TM_ROOT): the workers are split in groups,
+ * group 0 searches the main tree and each other group a private tree
+ * of the same position, root_trees[g]. Nothing is shared between the
+ * groups but the stats of the root children, which the main thread
+ * periodically adds to the main tree root - incrementally, as the
+ * distributed slaves do (see uct/slave.c): the cold pu stats of a
+ * private node hold what was already merged. */
+static struct tree **root_trees;
+static int root_groups = 1;
+
+static void
+root_trees_init(struct uct *u, struct board *b, enum stone color, struct tree *t)
+{
+	root_groups = 1;
+	if (u->thread_model != TM_ROOT)
+		return;
+	root_groups = u->root_groups > 0 && u->root_groups < u->threads ? u->root_groups : u->threads;
+	root_trees = calloc2(root_groups, sizeof(*root_trees));
+	root_trees[0] = t;
+	for (int g = 1; g < root_groups; g++) {
+		struct tree *rt = tree_init(b, color, u->fast_alloc ? u->max_tree_size / root_groups : 0,
+					    0, 0, u->local_tree_aging, 0, 0, 0);
+		rt->use_extra_komi = t->use_extra_komi;
+		rt->extra_komi = t->extra_komi;
+		root_trees[g] = rt;
+	}
+}
+
+/* Add the new playouts of the private trees to the main tree. */
+static void
+root_trees_merge(struct tree *t)
+{
+	if (root_groups < 2 || !t->root->children)
+		return;
+	struct tree_node *main_child[board_size2(t->board) + 1];
+	memset(main_child, 0, sizeof(main_child));
+	for (struct tree_node *ni = t->root->children; ni; ni = ni->sibling)
+		main_child[node_coord(ni) + 1] = ni; // +1 for pass
+
+	for (int g = 1; g < root_groups; g++) {
+		struct tree *rt = root_trees[g];
+		struct tree_node *nodes[BOARD_MAX_COORDS + 1] = { rt->root };
+		int n = 1;
+		for (struct tree_node *ni = rt->root->children; ni && n <= BOARD_MAX_COORDS; ni = ni->sibling)
+			nodes[n++] = ni;
+
+		for (int i = 0; i < n; i++) {
+			struct tree_node *dest = i ? main_child[node_coord(nodes[i]) + 1] : t->root;
+			if (!dest)
+				continue;
+			struct move_stats *pu = &tree_node_cold(rt, nodes[i])->pu;
+			struct move_stats cur = nodes[i]->u;
+			if (cur.playouts <= pu->playouts)
+				continue;
+			struct move_stats incr = cur;
+			stats_rm_result(&incr, pu->value, pu->playouts);
+			stats_add_result(&dest->u, incr.value, incr.playouts);
+			*pu = cur;
+		}
+	}
+}
+
+static void
+root_trees_done(void)
+{
+	for (int g = 1; g < root_groups; g++)
+		tree_done(root_trees[g]);
+	free(root_trees);
+	root_trees = NULL;
+	root_groups = 1;
+}
+
+
+/* Checkpointing thread, saving the top of the tree every
+ * checkpoint_interval seconds while the search runs, see
+ * tree_checkpoint(). */
+
+static pthread_t checkpoint_thread;
+static volatile bool checkpoint_halt;
+
+static void *
+uct_checkpoint_thread(void *ctx_)
+{
+	struct uct_thread_ctx *mctx = ctx_;
+	struct uct *u = mctx->u;
+	double next = time_now() + u->checkpoint_interval;
+	while (!checkpoint_halt) {
+		time_sleep(TREE_BUSYWAIT_INTERVAL);
+		if (time_now() < next)
+			continue;
+		tree_checkpoint(mctx->t, mctx->b, u->checkpoint_thres, u->checkpoint);
+		next = time_now() + u->checkpoint_interval;
+	}
+	return NULL;
+}
+
+static void
+uct_checkpoint_start(struct uct_thread_ctx *mctx)
+{
+	checkpoint_halt = false;
+	pthread_create(&checkpoint_thread, NULL, uct_checkpoint_thread, mctx);
+}
+
+static void
+uct_checkpoint_stop(void)
+{
+	checkpoint_halt = true;
+	pthread_join(checkpoint_thread, NULL);
+}
+
+
 /* Thread manager, controlling worker threads. It must be called with
  * finish_mutex lock held, but it will unlock it itself before exiting;
  * this is necessary to be completely deadlock-free. */
@@ -124,7 +318,7 @@ spawn_thread_manager(void *ctx_)
 	fast_srandom(mctx->seed);
 
 	int played_games = 0;
-	pthread_t threads[u->threads];
+	struct uct_thread_ctx *ctxs[u->threads];
 	int joined = 0;
 
 	uct_halt = 0;
@@ -134,20 +328,23 @@ spawn_thread_manager(void *ctx_)
 		t->root = tree_garbage_collect(t, t->root);
 	}
 
-	/* Spawn threads... */
+	/* Start workers... */
 	for (int ti = 0; ti < u->threads; ti++) {
 		struct uct_thread_ctx *ctx = malloc2(sizeof(*ctx));
 		ctx->u = u; ctx->b = mctx->b; ctx->color = mctx->color;
 		mctx->t = ctx->t = t;
-		ctx->tid = ti; ctx->seed = fast_random(65536) + ti;
+		if (root_groups > 1)
+			ctx->t = root_trees[ti % root_groups];
+		ctx->tid = ti; ctx->seed = mctx->seed;
 		ctx->ti = mctx->ti;
-		pthread_attr_t a;
-		pthread_attr_init(&a);
-		pthread_attr_setstacksize(&a, 1048576);
-		pthread_create(&threads[ti], &a, spawn_worker, ctx);
-		if (UDEBUGL(4))
-			fprintf(stderr, "Spawned worker %d\n", ti);
+		ctxs[ti] = ctx;
 	}
+	uct_deterministic_start();
+	pool_start(u, ctxs, u->threads);
+	/* The tree is not pruned nor promoted until the workers
+	 * are joined. */
+	if (u->checkpoint)
+		uct_checkpoint_start(mctx);
 
 	/* ...and collect them back: */
 	while (joined < u->threads) {
@@ -157,6 +354,7 @@ spawn_thread_manager(void *ctx_)
 			/* Stop-by-caller. Tell the workers to wrap up
 			 * and unblock them from terminating. */
 			uct_halt = 1;
+			uct_deterministic_halt();
 			/* We need to make sure the workers do not complete
 			 * the termination sequence before we get officially
 			 * stopped - their wake and the stop wake could get
@@ -165,8 +363,7 @@ spawn_thread_manager(void *ctx_)
 			continue;
 		}
 		/* ...and gather its remnants. */
-		struct uct_thread_ctx *ctx;
-		pthread_join(threads[finish_thread], (void **) &ctx);
+		struct uct_thread_ctx *ctx = ctxs[finish_thread];
 		played_games += ctx->games;
 		joined++;
 		free(ctx);
@@ -176,6 +373,12 @@ spawn_thread_manager(void *ctx_)
 	}
 
 	pthread_mutex_unlock(&finish_mutex);
+	if (u->checkpoint)
+		uct_checkpoint_stop();
+
+	/* Asynchronous priors reference tree nodes, they must land
+	 * before the tree gets promoted or pruned. */
+	uct_prior_flush(u);
 
 	mctx->games = played_games;
 	return mctx;
@@ -193,6 +396,9 @@ uct_search_games(struct uct_search_state *s)
 	return s->ctx->t->root->u.playouts;
 }
 
+/* When did the running search start, for the metrics. */
+static double search_start_time;
+
 void
 uct_search_start(struct uct *u, struct board *b, enum stone color,
 		 struct tree *t, struct time_info *ti,
@@ -202,6 +408,10 @@ uct_search_start(struct uct *u, struct board *b, enum stone color,
 	s->base_playouts = s->last_dynkomi = s->last_print = t->root->u.playouts;
 	s->print_interval = u->reportfreq * u->threads;
 	s->fullmem = false;
+	memset(&s->fc, 0, sizeof(s->fc));
+	s->now = s->metrics_time = time_now();
+	s->metrics_played = s->base_playouts;
+	score_hist_reset(u->dynkomi->hist);
 
 	if (ti) {
 		if (ti->period == TT_NULL) {
@@ -220,8 +430,12 @@ uct_search_start(struct uct *u, struct board *b, enum stone color,
 	assert(u->threads > 0);
 	assert(!thread_manager_running);
 	static struct uct_thread_ctx mctx;
-	mctx = (struct uct_thread_ctx) { .u = u, .b = b, .color = color, .t = t, .seed = fast_random(65536), .ti = ti };
+	mctx = (struct uct_thread_ctx) { .u = u, .b = b, .color = color, .t = t, .seed = fast_irandom(~0U), .ti = ti };
 	s->ctx = &mctx;
+	root_trees_init(u, b, color, t);
+	search_start_time = s->metrics_time;
+	metric_set(M_SEARCH_THREADS, u->threads);
+	metric_set(M_TREE_MAX_SIZE, u->max_tree_size);
 	pthread_mutex_lock(&finish_serializer);
 	pthread_mutex_lock(&finish_mutex);
 	pthread_create(&thread_manager, NULL, spawn_thread_manager, s->ctx);
@@ -243,6 +457,14 @@ uct_search_stop(void)
 	struct uct_thread_ctx *pctx;
 	thread_manager_running = false;
 	pthread_join(thread_manager, (void **) &pctx);
+	root_trees_merge(pctx->t);
+	root_trees_done();
+
+	metric_add(M_SEARCH_SECONDS, (time_now() - search_start_time) * pctx->u->threads);
+	metric_set(M_SEARCH_THREADS, 0);
+	metric_set(M_PLAYOUTS_RATE, 0);
+	metric_add(M_PLAYOUTS, pctx->games);
+	metric_set(M_TREE_SIZE, pctx->t->nodes_size);
 	return pctx;
 }
 
@@ -253,11 +475,12 @@ uct_search_progress(struct uct *u, struct board *b, enum stone color,
 		    struct uct_search_state *s, int i)
 {
 	struct uct_thread_ctx *ctx = s->ctx;
+	s->now = time_now();
 
 	/* Adjust dynkomi? */
 	int di = u->dynkomi_interval * u->threads;
 	if (ctx->t->use_extra_komi && u->dynkomi->permove
-	    && !u->pondering && di
+	    && !u->pondering && !u->deterministic && di
 	    && i > s->last_dynkomi + di) {
 		s->last_dynkomi += di;
 		floating_t old_dynkomi = ctx->t->extra_komi;
@@ -270,10 +493,26 @@ uct_search_progress(struct uct *u, struct board *b, enum stone color,
 	/* Print progress? */
 	if (i - s->last_print > s->print_interval) {
 		s->last_print += s->print_interval; // keep the numbers tidy
-		uct_progress_status(u, ctx->t, color, s->last_print, NULL);
+		/* The candidate sequences go deep, so the main thread
+		 * is a reader of the tree too; see setup_state(). */
+		tree_read_begin(ctx->t, u->threads + 1);
+		uct_progress_update(u, ctx->t, color, s->last_print);
+		tree_read_end(ctx->t, u->threads + 1);
+	}
+
+	root_trees_merge(ctx->t);
+
+	/* Update the live metrics about once a second. */
+	double now = s->now;
+	if (now - s->metrics_time >= 1) {
+		metric_set(M_PLAYOUTS_RATE, (i - s->metrics_played) / (now - s->metrics_time));
+		metric_set(M_TREE_SIZE, ctx->t->nodes_size);
+		s->metrics_time = now;
+		s->metrics_played = i;
 	}
 
-	if (!s->fullmem && ctx->t->nodes_size > u->max_tree_size) {
+	/* With evict, the tree keeps growing in the memory freed. */
+	if (!s->fullmem && !u->evict && ctx->t->nodes_size > u->max_tree_size) {
 		if (UDEBUGL(2))
 			fprintf(stderr, "memory limit hit (%lu > %lu)\n",
 				ctx->t->nodes_size, u->max_tree_size);
@@ -282,10 +521,48 @@ uct_search_progress(struct uct *u, struct board *b, enum stone color,
 }
 
 
+/* Sample the playout rate and the race of the two best root children
+ * for the time manager forecast. */
+static void
+uct_search_forecast(struct uct_search_state *s, struct tree_node *best, struct tree_node *best2, int played)
+{
+	struct uct_forecast *fc = &s->fc;
+	double now = s->now;
+	double dt = now - fc->time;
+	if (fc->samples && dt < TREE_BUSYWAIT_INTERVAL / 2)
+		return;
+
+	coord_t bc = node_coord(best);
+	int bp = best->u.playouts, b2p = best2 ? best2->u.playouts : 0;
+	int dplayed = played - fc->played;
+	/* The second best may swap with the third; only the best matters. */
+	if (fc->samples && dplayed > 0 && bc == fc->best) {
+		double pps = dplayed / dt;
+		double share2 = (double) (b2p - fc->best2_playouts) / dplayed;
+		if (share2 < 0) share2 = 0;
+		double gapv = ((bp - b2p) - (fc->best_playouts - fc->best2_playouts)) / dt;
+		if (fc->samples == 1) {
+			fc->pps = pps; fc->share2 = share2; fc->gapv = gapv;
+		} else {
+			fc->pps += FORECAST_ALPHA * (pps - fc->pps);
+			fc->share2 += FORECAST_ALPHA * (share2 - fc->share2);
+			fc->gapv += FORECAST_ALPHA * (gapv - fc->gapv);
+		}
+		fc->samples++;
+	} else {
+		/* New leader, start over. */
+		fc->samples = 1;
+	}
+	fc->time = now;
+	fc->played = played;
+	fc->best = bc;
+	fc->best_playouts = bp; fc->best2_playouts = b2p;
+}
+
 /* Determine whether we should terminate the search early. */
 static bool
 uct_search_stop_early(struct uct *u, struct tree *t, struct board *b,
-		struct time_info *ti, struct time_stop *stop,
+		struct time_info *ti, struct uct_search_state *s,
 		struct tree_node *best, struct tree_node *best2,
 		int played, bool fullmem)
 {
@@ -298,12 +575,18 @@ uct_search_stop_early(struct uct *u, struct tree *t, struct board *b,
 	 * on the spot.) */
 	if (fullmem)
 		return true;
+	/* The evaluation search wants all its time for the
+	 * candidates, not just for the best one. */
+	if (u->evaluating)
+		return false;
+
+	struct time_stop *stop = &s->stop;
 
 	/* Think at least 100ms to avoid a random move. This is particularly
 	 * important in distributed mode, where this function is called frequently. */
 	double elapsed = 0.0;
 	if (ti->dim == TD_WALLTIME) {
-		elapsed = time_now() - ti->len.t.timer_start;
+		elapsed = s->now - ti->len.t.timer_start;
 		if (elapsed < TREE_BUSYWAIT_INTERVAL) return false;
 	}
 
@@ -326,6 +609,52 @@ uct_search_stop_early(struct uct *u, struct tree *t, struct board *b,
 		}
 	}
 
+	/* Break early if the recent trend says the second-best move
+	 * is not going to catch up within the desired time: even if it
+	 * got FORECAST_SHARE_MARGIN times its recent share of playouts,
+	 * the gap would not close. */
+	struct uct_forecast *fc = &s->fc;
+	if (u->forecast && best2 && ti->dim == TD_WALLTIME && fc->samples >= 3
+	    && played >= PLAYOUT_EARLY_BREAK_MIN && elapsed > TIME_EARLY_BREAK_MIN
+	    && elapsed < stop->desired.time && !time_indulgent) {
+		/* Past the desired time, uct_search_keep_looking() decides. */
+		double remaining = stop->desired.time - elapsed;
+		double share = fc->share2 * FORECAST_SHARE_MARGIN;
+		if (share < FORECAST_SHARE_MIN) share = FORECAST_SHARE_MIN;
+		if (share > 1) share = 1;
+		double catchup = remaining * fc->pps * share + PLAYOUT_DELTA_SAFEMARGIN;
+		/* Also never stop while keep_looking() would extend
+		 * the search for a close best2 ratio. */
+		if (fc->gapv >= 0 && best->u.playouts > best2->u.playouts + catchup
+		    && best->u.playouts >= best2->u.playouts * u->best2_ratio) {
+			if (UDEBUGL(2))
+				fprintf(stderr, "Early stop, forecast: best %d, best2 %d, "
+					"best2 may gain %f simulations (%.0f pps, share %.3f, gap %+.0f/s)\n",
+					best->u.playouts, best2->u.playouts, catchup, fc->pps, fc->share2, fc->gapv);
+			return true;
+		}
+	}
+
+	/* Break early if the second-best move could still catch up
+	 * in playouts, but is very unlikely to be better by more than
+	 * stop_margin: the difference of their values is clear of it
+	 * by stop_confidence standard errors (taken as binomial). The
+	 * margin covers the usual case of two moves found equal. */
+	if (u->stop_confidence > 0 && best2 && best2->u.playouts > 0 && ti->dim == TD_WALLTIME
+	    && played >= PLAYOUT_EARLY_BREAK_MIN && elapsed > TIME_EARLY_BREAK_MIN && !time_indulgent) {
+		floating_t v1 = tree_node_get_value(t, 1, best->u.value);
+		floating_t v2 = tree_node_get_value(t, 1, best2->u.value);
+		double se = sqrt(v1 * (1 - v1) / best->u.playouts + v2 * (1 - v2) / best2->u.playouts);
+		if (v2 - v1 + u->stop_confidence * se < u->stop_margin) {
+			if (UDEBUGL(2))
+				fprintf(stderr, "Early stop, best settled: best %.3f (%d), best2 %.3f (%d), "
+					"se %.4f, about %.0f simulations saved\n",
+					v1, best->u.playouts, v2, best2->u.playouts, se,
+					(stop->desired.time - elapsed) * played / elapsed);
+			return true;
+		}
+	}
+
 	/* Early break in won situation. */
 	if (best->u.playouts >= PLAYOUT_EARLY_BREAK_MIN
 	    && (ti->dim != TD_WALLTIME || elapsed > TIME_EARLY_BREAK_MIN)
@@ -339,10 +668,14 @@ uct_search_stop_early(struct uct *u, struct tree *t, struct board *b,
 /* Determine whether we should terminate the search later than expected. */
 static bool
 uct_search_keep_looking(struct uct *u, struct tree *t, struct board *b,
-		struct time_info *ti, struct time_stop *stop,
+		struct time_info *ti, struct uct_search_state *s,
 		struct tree_node *best, struct tree_node *best2,
 		struct tree_node *bestr, struct tree_node *winner, int i)
 {
+	struct time_stop *stop = &s->stop;
+
+	if (u->evaluating)
+		return false;
 	if (!best) {
 		if (UDEBUGL(2))
 			fprintf(stderr, "Did not find best move, still trying...\n");
@@ -354,10 +687,23 @@ uct_search_keep_looking(struct uct *u, struct tree *t, struct board *b,
 	floating_t beta = 2 * (tree_node_get_value(t, 1, best->u.value) - 0.5);
 	if (ti->dim == TD_WALLTIME && beta > 0) {
 		double good_enough = stop->desired.time * beta + stop->worst.time * (1 - beta);
-		double elapsed = time_now() - ti->len.t.timer_start;
+		double elapsed = s->now - ti->len.t.timer_start;
 		if (elapsed > good_enough) return false;
 	}
 
+	/* Keep simulating if at the recent pace, the second-best move
+	 * overtakes the best one before the worst time. */
+	struct uct_forecast *fc = &s->fc;
+	if (u->forecast && best2 && ti->dim == TD_WALLTIME && fc->samples >= 3 && fc->gapv < 0) {
+		double elapsed = s->now - ti->len.t.timer_start;
+		double eta = (best->u.playouts - best2->u.playouts) / -fc->gapv;
+		if (eta < stop->worst.time - elapsed) {
+			if (UDEBUGL(2))
+				fprintf(stderr, "Forecast: best2 catching up in %.2fs (gap %+.0f/s)\n", eta, fc->gapv);
+			return true;
+		}
+	}
+
 	if (u->best2_ratio > 0) {
 		/* Check best/best2 simulations ratio. If the
 		 * two best moves give very similar results,
@@ -428,13 +774,15 @@ uct_search_check_stop(struct uct *u, struct board *b, enum stone color,
 
 	/* Possibly stop search early if it's no use to try on. */
 	int played = u->played_all + i - s->base_playouts;
-	if (best && uct_search_stop_early(u, ctx->t, b, ti, &s->stop, best, best2, played, s->fullmem))
+	if (best && ti->dim == TD_WALLTIME)
+		uct_search_forecast(s, best, best2, played);
+	if (best && uct_search_stop_early(u, ctx->t, b, ti, s, best, best2, played, s->fullmem))
 		return true;
 
 	/* Check against time settings. */
 	bool desired_done;
 	if (ti->dim == TD_WALLTIME) {
-		double elapsed = time_now() - ti->len.t.timer_start;
+		double elapsed = s->now - ti->len.t.timer_start;
 		if (elapsed > s->stop.worst.time) return true;
 		desired_done = elapsed > s->stop.desired.time;
 
@@ -451,9 +799,11 @@ uct_search_check_stop(struct uct *u, struct board *b, enum stone color,
 			u->policy->winner(u->policy, ctx->t, &descent);
 			winner = descent.node;
 		}
-		if (best)
+		if (best) {
+			tree_fix_node(ctx->t, best);
 			bestr = u->policy->choose(u->policy, best, b, stone_other(color), resign);
-		if (!uct_search_keep_looking(u, ctx->t, b, ti, &s->stop, best, best2, bestr, winner, i))
+		}
+		if (!uct_search_keep_looking(u, ctx->t, b, ti, s, best, best2, bestr, winner, i))
 			return true;
 	}
 
@@ -464,6 +814,25 @@ uct_search_check_stop(struct uct *u, struct board *b, enum stone color,
 }
 
 
+/* Whether the resign_score_quantile of the playout scores is still a
+ * win for @color: the losses may be by a few points only, comebacks
+ * are likely. */
+static bool
+uct_search_score_hope(struct uct *u, enum stone color)
+{
+	if (u->resign_score_quantile <= 0)
+		return false;
+	struct score_hist *h = u->dynkomi->hist;
+	score_hist_merge(h);
+	int playouts;
+	floating_t q = color == S_BLACK ? u->resign_score_quantile : 1 - u->resign_score_quantile;
+	floating_t score = komi_by_color(score_hist_quantile(h, false, q, &playouts), color);
+	if (UDEBUGL(2) && score > 0)
+		fprintf(stderr, "not resigning, score %.1f at quantile %.2f of %d playouts\n",
+			score, u->resign_score_quantile, playouts);
+	return playouts >= GJ_MINGAMES && score > 0;
+}
+
 struct tree_node *
 uct_search_result(struct uct *u, struct board *b, enum stone color,
 		  bool pass_all_alive, int played_games, int base_playouts,
@@ -495,7 +864,8 @@ uct_search_result(struct uct *u, struct board *b, enum stone color,
 	    // been returned; test therefore also for #simulations at root.
 	    && (best->u.playouts > GJ_MINGAMES || u->t->root->u.playouts > GJ_MINGAMES * 2)
 	    && (!u->t->use_extra_komi || komi_by_color(u->t->extra_komi, color) < 0.5)
-	    && !u->t->untrustworthy_tree) {
+	    && !u->t->untrustworthy_tree
+	    && !uct_search_score_hope(u, color)) {
 		*best_coord = resign;
 		return NULL;
 	}
@@ -59,6 +59,26 @@ struct uct_search_state {
 	/* Printed notification about full memory? */
 	bool fullmem;
 
+	/* Time manager forecast: the last sample and smoothed recent
+	 * playout rate, share of playouts going to the second best
+	 * root child and rate of change of the best-best2 visit gap. */
+	struct uct_forecast {
+		double time;
+		int played;
+		coord_t best;
+		int best_playouts, best2_playouts;
+		double pps, share2, gapv;
+		int samples;
+	} fc;
+
+	/* Time of the current poll, taken once by uct_search_progress()
+	 * for all the checks made by the thread manager until the next. */
+	double now;
+
+	/* Last update of the playout rate metric. */
+	double metrics_time;
+	int metrics_played;
+
 	struct time_stop stop;
 	struct uct_thread_ctx *ctx;
 };
@@ -0,0 +1,306 @@
+/* Several pachi processes on the same host, for instance one per
+ * NUMA node, can share their search through a shared memory segment
+ * instead of running the distributed engine over loopback sockets.
+ * Each process is a normal uct engine fed with the same gtp commands,
+ * except that only one of them gets genmove: the others can search
+ * with gogui-best_moves instead, then get the move played as usual.
+ *
+ * The stats are exchanged exactly like between the slaves of the
+ * distributed engine (see uct/slave.c): each process publishes the
+ * increments of its own playouts for the nodes of level <= shared_levels,
+ * identified by coord path, and adds the increments published by the
+ * others to its tree. There is no master; each process merges the
+ * stats of all the others itself.
+ *
+ * The segment has one slot per process. A slot is a ring of buffers
+ * written by its owner only. Each buffer has a sequence number, which
+ * is 0 while the buffer is being written, so a reader can detect a
+ * buffer overwritten under it. A reader too much behind skips stats,
+ * as the distributed master does for slaves that are late.
+ *
+ * The last process to leave removes the segment; one left over by a
+ * crash is reused if its layout matches, which the header records. */
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEBUG
+
+#include "debug.h"
+#include "board.h"
+#include "uct/internal.h"
+#include "uct/shm.h"
+#include "uct/slave.h"
+#include "distributed/wire.h"
+
+#ifndef _WIN32
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SHM_MAGIC 0x70616332 // "pac2", with the version field
+/* Bump whenever the layout of the segment changes. */
+#define SHM_VERSION 2
+
+/* Buffers per slot. A reader polls all slots every stats_delay,
+ * which is also how often each writer publishes. */
+#define SHM_RING 8
+
+struct shm_header {
+	volatile uint32_t magic; // set last by the creator
+	uint32_t version;
+	int slots;
+	int buf_size;
+	int ring;
+	int stats_size; // sizeof(struct incr_stats) of the creator
+};
+
+struct shm_slot {
+	volatile int pid; // owner process, 0 if free
+	volatile uint64_t seq; // number of buffers published so far
+};
+
+struct shm_buf {
+	volatile uint64_t seq; // 0 while written
+	uint64_t key; // searched position, see position_key()
+	int size;
+	unsigned char data[];
+};
+
+struct uct_shm {
+	char *name;
+	struct shm_header *h;
+	size_t size;
+	int slot;
+	int buf_stride;
+	int slot_size;
+	uint64_t *last_seq; // last buffer read from each slot
+	unsigned char *in; // copy of the buffer being read
+};
+
+static inline struct shm_slot *
+shm_slot(struct uct_shm *shm, int i)
+{
+	return (struct shm_slot *)((char *)(shm->h + 1) + i * shm->slot_size);
+}
+
+static inline struct shm_buf *
+shm_buf(struct uct_shm *shm, struct shm_slot *slot, uint64_t seq)
+{
+	return (struct shm_buf *)((char *)(slot + 1) + (seq % SHM_RING) * shm->buf_stride);
+}
+
+/* Coord paths are relative to the root, so only stats for
+ * the same position and color to play can be merged. */
+static uint64_t
+position_key(struct board *b, enum stone color)
+{
+	return b->hash ^ ((uint64_t)b->moves << 2 | color);
+}
+
+struct uct_shm *
+uct_shm_init(char *name, int slots, int shared_nodes)
+{
+	struct uct_shm *shm = calloc2(1, sizeof(*shm));
+	int buf_size = shared_nodes * sizeof(struct incr_stats);
+	shm->buf_stride = (sizeof(struct shm_buf) + buf_size + 7) & ~7;
+	shm->slot_size = (sizeof(struct shm_slot) + SHM_RING * shm->buf_stride + 7) & ~7;
+	shm->size = sizeof(struct shm_header) + slots * shm->slot_size;
+
+	shm->name = strdup(name);
+
+retry:;
+	/* The first process creates and initializes the segment. */
+	bool created = true;
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0) {
+		created = false;
+		fd = shm_open(name, O_RDWR, 0600);
+	}
+	if (fd < 0 || (created && ftruncate(fd, shm->size) < 0)) {
+		perror("shm_open");
+		exit(1);
+	}
+	/* Wait for the creator to size the segment. */
+	struct stat st;
+	for (int tries = 0; !fstat(fd, &st) && (size_t)st.st_size < shm->size && tries < 100; tries++)
+		usleep(10000);
+	shm->h = mmap(NULL, shm->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (shm->h == MAP_FAILED || fstat(fd, &st) < 0) {
+		perror("mmap");
+		exit(1);
+	}
+	close(fd);
+
+	struct shm_header *h = shm->h;
+	if (created) {
+		h->version = SHM_VERSION;
+		h->slots = slots;
+		h->buf_size = buf_size;
+		h->ring = SHM_RING;
+		h->stats_size = sizeof(struct incr_stats);
+		__sync_synchronize();
+		h->magic = SHM_MAGIC;
+	}
+	for (int tries = 0; h->magic != SHM_MAGIC && tries < 100; tries++)
+		usleep(10000);
+	if (h->magic != SHM_MAGIC || h->version != SHM_VERSION
+	    || h->stats_size != sizeof(struct incr_stats)) {
+		fprintf(stderr, "UCT: shm segment %s is of another pachi version; "
+			"remove /dev/shm/%s if no process uses it\n", name, name[0] == '/' ? name + 1 : name);
+		exit(1);
+	}
+	if (h->slots != slots || h->buf_size != buf_size || h->ring != SHM_RING) {
+		fprintf(stderr, "UCT: shm segment %s has a different layout, "
+			"check shm_slots and shared_nodes\n", name);
+		exit(1);
+	}
+
+	/* Claim a free slot, or the slot of a dead process. */
+	int pid = getpid();
+	shm->slot = -1;
+	for (int i = 0; i < slots && shm->slot < 0; i++) {
+		struct shm_slot *s = shm_slot(shm, i);
+		int owner = s->pid;
+		if (owner && kill(owner, 0) == 0) continue;
+		if (__sync_bool_compare_and_swap(&s->pid, owner, pid))
+			shm->slot = i;
+	}
+	if (shm->slot < 0) {
+		fprintf(stderr, "UCT: no free slot in shm segment %s\n", name);
+		exit(1);
+	}
+
+	/* The last process out may have removed the segment meanwhile,
+	 * see uct_shm_done(); then start over with a new one. */
+	struct stat st2;
+	fd = shm_open(name, O_RDWR, 0600);
+	bool linked = fd >= 0 && !fstat(fd, &st2) && st2.st_ino == st.st_ino;
+	if (fd >= 0)
+		close(fd);
+	if (!linked) {
+		shm_slot(shm, shm->slot)->pid = 0;
+		munmap(shm->h, shm->size);
+		goto retry;
+	}
+
+	shm->last_seq = calloc2(slots, sizeof(*shm->last_seq));
+	for (int i = 0; i < slots; i++)
+		shm->last_seq[i] = shm_slot(shm, i)->seq;
+	shm->in = malloc2(buf_size);
+	if (DEBUGL(2))
+		fprintf(stderr, "shm %s: slot %d/%d\n", name, shm->slot, slots);
+	return shm;
+}
+
+void
+uct_shm_done(struct uct_shm *shm)
+{
+	shm_slot(shm, shm->slot)->pid = 0;
+	__sync_synchronize();
+
+	/* The last one out removes the segment. */
+	bool last = true;
+	for (int i = 0; i < shm->h->slots && last; i++) {
+		int owner = shm_slot(shm, i)->pid;
+		if (owner && kill(owner, 0) == 0)
+			last = false;
+	}
+	if (last)
+		shm_unlink(shm->name);
+
+	munmap(shm->h, shm->size);
+	free(shm->name);
+	free(shm->last_seq);
+	free(shm->in);
+	free(shm);
+}
+
+/* Publish our stats increments since the last call. */
+static void
+shm_publish(struct uct_shm *shm, struct uct *u, uint64_t key)
+{
+	int size;
+	void *stats = uct_report_incr_stats(u, &size);
+	if (!size) return;
+	assert(size <= shm->h->buf_size);
+
+	struct shm_slot *slot = shm_slot(shm, shm->slot);
+	uint64_t seq = slot->seq + 1;
+	struct shm_buf *sb = shm_buf(shm, slot, seq);
+	sb->seq = 0;
+	__sync_synchronize();
+	sb->key = key;
+	sb->size = size;
+	memcpy(sb->data, stats, size);
+	__sync_synchronize();
+	sb->seq = seq;
+	slot->seq = seq;
+}
+
+/* Merge the new stats of all other slots for our position.
+ * Return the number of buffers merged. */
+static int
+shm_collect(struct uct_shm *shm, struct uct *u, uint64_t key)
+{
+	int merged = 0;
+	for (int i = 0; i < shm->h->slots; i++) {
+		if (i == shm->slot) continue;
+		struct shm_slot *slot = shm_slot(shm, i);
+		uint64_t head = slot->seq;
+		uint64_t seq = shm->last_seq[i] + 1;
+		/* Skip what has been overwritten already. */
+		if (head >= SHM_RING && seq < head - SHM_RING + 1)
+			seq = head - SHM_RING + 1;
+
+		for (; seq <= head; seq++) {
+			struct shm_buf *sb = shm_buf(shm, slot, seq);
+			if (sb->seq != seq || sb->key != key) continue;
+			int size = sb->size;
+			if (size <= 0 || size > shm->h->buf_size) continue;
+			memcpy(shm->in, sb->data, size);
+			__sync_synchronize();
+			if (sb->seq != seq) continue;
+			merged += uct_apply_stats(u, shm->in, size);
+		}
+		shm->last_seq[i] = head;
+	}
+	return merged;
+}
+
+void
+uct_shm_exchange(struct uct *u, struct board *b, enum stone color)
+{
+	uint64_t key = position_key(b, color);
+	shm_publish(u->shm, u, key);
+	int merged = shm_collect(u->shm, u, key);
+	if (UDEBUGL(4) && merged)
+		fprintf(stderr, "shm: merged %d buffers\n", merged);
+}
+
+#else
+
+struct uct_shm *
+uct_shm_init(char *name, int slots, int shared_nodes)
+{
+	fprintf(stderr, "UCT: shm is not supported on this platform\n");
+	exit(1);
+}
+
+void
+uct_shm_done(struct uct_shm *shm)
+{
+}
+
+void
+uct_shm_exchange(struct uct *u, struct board *b, enum stone color)
+{
+}
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef PACHI_UCT_SHM_H
+#define PACHI_UCT_SHM_H
+
+/* Sharing of tree stats between several pachi processes on the
+ * same host, through a shared memory segment (see uct/shm.c). */
+
+#include "stone.h"
+
+struct board;
+struct uct;
+struct uct_shm;
+
+/* Attach to (or create) the segment of the given name, with room
+ * for slots processes sharing at most shared_nodes nodes at once.
+ * Exits on error. */
+struct uct_shm *uct_shm_init(char *name, int slots, int shared_nodes);
+void uct_shm_done(struct uct_shm *shm);
+
+/* Publish our own new stats and merge the ones published by the
+ * other processes searching the same position. Called periodically
+ * by the main thread while the search is running. */
+void uct_shm_exchange(struct uct *u, struct board *b, enum stone color);
+
+#endif
@@ -23,7 +23,7 @@
  * and distributed.c for the port arguments) :
  *  slave                   required to indicate slave mode
  *  max_nodes=MAX_NODES     default 80K
- *  stats_hbits=STATS_HBITS default 24. 2^stats_bits = hash table size
+ *  stats_hbits=STATS_HBITS default 24. 2^stats_bits = initial hash table size
  */
 
 #include <assert.h>
@@ -39,51 +39,146 @@
 #include "board.h"
 #include "fbook.h"
 #include "gtp.h"
+#include "logger.h"
+#include "memstats.h"
 #include "move.h"
 #include "timeinfo.h"
 #include "uct/internal.h"
 #include "uct/search.h"
 #include "uct/slave.h"
 #include "uct/tree.h"
+#include "distributed/wire.h"
 
 
 /* UCT infrastructure for a distributed engine slave. */
 
 /* For debugging only. */
-static struct hash_counts h_counts;
 static long parent_not_found = 0;
 static long parent_leaf = 0;
 static long node_not_found = 0;
 
-/* Hash table entry mapping path to node. */
+/* Hash table entry mapping path to node. Entries are valid only in
+ * the epoch of the table, so that a new move starts with an empty table
+ * without clearing it. */
 struct tree_hash {
 	path_t coord_path;
 	struct tree_node *node;
+	unsigned int epoch;
 };
 
-void *
+struct tree_htable {
+	struct tree_hash *e;
+	int hbits;
+	unsigned int epoch;
+	/* Counts of the current epoch, deciding when to grow the table. */
+	long occupied;
+	long lookups;
+	long collisions;
+};
+
+/* The table is doubled as soon as it gets 3/4 full during a move,
+ * and at the next move if it got half full or the lookups averaged
+ * more than one collision. */
+#define HTABLE_MAX_BITS 30
+
+static void
+htable_setup(struct tree_htable *h, int hbits)
+{
+	h->e = calloc2(1 << hbits, sizeof(*h->e));
+	h->hbits = hbits;
+	h->epoch = 1;
+	h->occupied = h->lookups = h->collisions = 0;
+	mem_account(MEM_TREE, (1 << hbits) * sizeof(*h->e));
+}
+
+static void
+htable_free(struct tree_htable *h)
+{
+	free(h->e);
+	mem_account(MEM_TREE, -(long long) ((1 << h->hbits) * sizeof(*h->e)));
+}
+
+struct tree_htable *
 uct_htable_alloc(int hbits)
 {
-	return calloc2(1 << hbits, sizeof(struct tree_hash));
+	struct tree_htable *h = malloc2(sizeof(*h));
+	htable_setup(h, hbits);
+	return h;
+}
+
+void
+uct_htable_done(struct tree_htable *h)
+{
+	htable_free(h);
+	free(h);
+}
+
+/* Find the entry of the path, or the free entry where to insert it.
+ * We use double hashing. */
+static struct tree_hash *
+htable_find(struct tree_htable *h, path_t path, bool *found)
+{
+	h->lookups++;
+	int mask = hash_mask(h->hbits);
+	int delta = (int)(path >> h->hbits) | 1;
+	int i = ((int)path ^ delta ^ (delta >> h->hbits)) & mask;
+	/* Never full, and delta is odd, so we find a free entry. */
+	while (h->e[i].epoch == h->epoch) {
+		if (h->e[i].coord_path == path) {
+			*found = true;
+			return &h->e[i];
+		}
+		h->collisions++;
+		i = (i + delta) & mask;
+	}
+	*found = false;
+	return &h->e[i];
+}
+
+/* Double the table, keeping the entries of the current epoch. */
+static void
+htable_grow(struct tree_htable *h)
+{
+	struct tree_htable old = *h;
+	htable_setup(h, old.hbits + 1);
+	for (int i = 0; i < 1 << old.hbits; i++) {
+		if (old.e[i].epoch != old.epoch) continue;
+		bool found;
+		*htable_find(h, old.e[i].coord_path, &found) = (struct tree_hash) {
+			.coord_path = old.e[i].coord_path, .node = old.e[i].node, .epoch = h->epoch,
+		};
+		h->occupied++;
+	}
+	h->lookups = h->collisions = 0;
+	htable_free(&old);
 }
 
-/* Clear the hash table. Used only when running as slave for the distributed engine. */
+/* Empty the hash table for a new move. Used only when running as slave
+ * for the distributed engine. */
 void uct_htable_reset(struct tree *t)
 {
-	if (!t->htable) return;
-	double start = time_now();
-	memset(t->htable, 0, (1 << t->hbits) * sizeof(t->htable[0]));
+	struct tree_htable *h = t->htable;
+	if (!h) return;
+	int size = 1 << h->hbits;
 	if (DEBUGL(3))
-		fprintf(stderr, "tree occupied %ld %.1f%% inserts %ld collisions %ld/%ld %.1f%% clear %.3fms\n"
+		log_printf(3, "tree occupied %ld %.1f%% lookups %ld collisions %.1f%% table 2^%d\n"
 			"parent_not_found %.1f%% parent_leaf %.1f%% node_not_found %.1f%%\n",
-			h_counts.occupied, h_counts.occupied * 100.0 / (1 << t->hbits),
-			h_counts.inserts, h_counts.collisions, h_counts.lookups,
-			h_counts.collisions * 100.0 / (h_counts.lookups + 1),
-			(time_now() - start)*1000,
-			parent_not_found * 100.0 / (h_counts.lookups + 1),
-			parent_leaf * 100.0 / (h_counts.lookups + 1),
-			node_not_found * 100.0 / (h_counts.lookups + 1));
-	if (DEBUG_MODE) h_counts.occupied = 0;
+			h->occupied, h->occupied * 100.0 / size, h->lookups,
+			h->collisions * 100.0 / (h->lookups + 1), h->hbits,
+			parent_not_found * 100.0 / (h->lookups + 1),
+			parent_leaf * 100.0 / (h->lookups + 1),
+			node_not_found * 100.0 / (h->lookups + 1));
+
+	if ((h->occupied > size / 2 || h->collisions > h->lookups) && h->hbits < HTABLE_MAX_BITS) {
+		htable_free(h);
+		htable_setup(h, h->hbits + 1);
+		return;
+	}
+	if (!++h->epoch) {
+		memset(h->e, 0, size * sizeof(*h->e));
+		h->epoch = 1;
+	}
+	h->occupied = h->lookups = h->collisions = 0;
 }
 
 /* Find a node given its coord path from root. Insert it in the
@@ -97,19 +192,18 @@ static struct tree_node *
 tree_find_node(struct tree *t, struct incr_stats *is, struct tree_node *prev)
 {
 	assert(t && t->htable);
+	struct tree_htable *h = t->htable;
 	path_t path = is->coord_path;
 	/* pass and resign must never be inserted in the hash table. */
 	assert(path > 0);
 
-	int hash, parent_hash;
 	bool found;
-	find_hash(hash, t->htable, t->hbits, path, found, h_counts);
-	struct tree_hash *hnode = &t->htable[hash];
+	struct tree_hash *hnode = htable_find(h, path, &found);
 
 	if (DEBUGVV(7))
-		fprintf(stderr,
+		log_printf(7,
 			"find_node %"PRIpath" %s found %d hash %d playouts %d node %p\n", path,
-			path2sstr(path, t->board), found, hash, is->incr.playouts, hnode->node);
+			path2sstr(path, t->board), found, (int)(hnode - h->e), is->incr.playouts, hnode->node);
 
 	if (found) return hnode->node;
 
@@ -118,9 +212,8 @@ tree_find_node(struct tree *t, struct incr_stats *is, struct tree_node *prev)
 	path_t parent_p = parent_path(path, t->board);
 	struct tree_node *parent;
 	if (parent_p) {
-		find_hash(parent_hash, t->htable, t->hbits,
-			  parent_p, found, h_counts);
-		parent = t->htable[parent_hash].node;
+		struct tree_hash *pnode = htable_find(h, parent_p, &found);
+		parent = found ? pnode->node : NULL;
 	} else {
 		parent = t->root;
 	}
@@ -128,6 +221,7 @@ tree_find_node(struct tree *t, struct incr_stats *is, struct tree_node *prev)
 	if (parent) {
 		/* Search for the node in parent's children. */
 		coord_t leaf = leaf_coord(path, t->board);
+		tree_fix_node(t, parent);
 		node = (prev && prev->parent == parent ? prev->sibling : parent->children);
 		while (node && node_coord(node) != leaf) node = node->sibling;
 
@@ -135,20 +229,20 @@ tree_find_node(struct tree *t, struct incr_stats *is, struct tree_node *prev)
 	} else {
 		if (DEBUG_MODE) parent_not_found++;
 		if (DEBUGVV(7))
-			fprintf(stderr, "parent of %"PRIpath" %s not found\n",
+			log_printf(7, "parent of %"PRIpath" %s not found\n",
 				path, path2sstr(path, t->board));
 	}
 
 	/* Insert the node in the hash table. */
-	hnode->node = node;
-	if (DEBUG_MODE) h_counts.inserts++, h_counts.occupied++;
 	if (DEBUGVV(7))
-		fprintf(stderr, "insert path %"PRIpath" %s hash %d playouts %d node %p\n",
-			path, path2sstr(path, t->board), hash, is->incr.playouts, node);
+		log_printf(7, "insert path %"PRIpath" %s hash %d playouts %d node %p\n",
+			path, path2sstr(path, t->board), (int)(hnode - h->e), is->incr.playouts, node);
 
 	if (DEBUG_MODE && !node) node_not_found++;
 
-	hnode->coord_path = path;
+	*hnode = (struct tree_hash) { .coord_path = path, .node = node, .epoch = h->epoch };
+	if (++h->occupied > (3L << h->hbits) / 4 && h->hbits < HTABLE_MAX_BITS)
+		htable_grow(h);
 	return node;
 }
 
@@ -176,7 +270,9 @@ uct_notify(struct engine *e, struct board *b, int id, char *cmd, char *args, cha
 {
 	struct uct *u = e->data;
 
-	static bool board_resized = true;
+	/* A slave joining during a game has not seen the boardsize,
+	 * it asks once for the whole history. */
+	static bool board_resized = false;
 	if (is_gamestart(cmd)) {
 		board_resized = true;
 		uct_pondering_stop(u);
@@ -188,8 +284,9 @@ uct_notify(struct engine *e, struct board *b, int id, char *cmd, char *args, cha
 	    && !reply_disabled(id) && !is_reset(cmd)) {
 		static char buf[128];
 		snprintf(buf, sizeof(buf), "Out of sync, %d %s, move %d expected", id, cmd, b->moves);
+		board_resized = true;
 		if (UDEBUGL(0))
-			fprintf(stderr, "%s\n", buf); 
+			log_printf(0, "%s\n", buf); 
 		discard_bin_args(args);
 
 		*reply = buf;
@@ -201,31 +298,32 @@ uct_notify(struct engine *e, struct board *b, int id, char *cmd, char *args, cha
 }
 
 
-/* Read the move stats sent by the master, as a binary array of
- * incr_stats structs. The stats come sorted by increasing coord path.
- * To simplify the code, we assume that master and slave have the same
- * architecture (store values identically).
+/* Add to the tree the move stats received from the master or from
+ * other processes (see uct/shm.c), as incr_stats structs in wire
+ * format (see distributed/wire.h). The stats come sorted by
+ * increasing coord path.
  * Keep this code in sync with distributed/merge.c:output_stats()
  * Return true if ok, false if error. */
-static bool
-receive_stats(struct uct *u, int size)
+bool
+uct_apply_stats(struct uct *u, unsigned char *wire, int size)
 {
-	if (size % sizeof(struct incr_stats)) return false;
-	int nodes = size / sizeof(struct incr_stats);
-	if (nodes > (1 << u->stats_hbits)) return false;
+	int max_nodes = 1 << u->stats_hbits;
+	static struct incr_stats *in_stats = NULL;
+	if (!in_stats) in_stats = malloc2(max_nodes * sizeof(*in_stats));
+
+	int nodes = stats_wire_decode(wire, size, in_stats, max_nodes);
+	if (nodes < 0) return false;
 
 	struct tree *t = u->t;
-	assert(nodes && t->htable);
+	assert(t->htable);
 	struct tree_node *prev = NULL;
 	double start_time = time_now();
 
 	for (int n = 0; n < nodes; n++) {
-		struct incr_stats is;
-		if (fread(&is, sizeof(struct incr_stats), 1, stdin) != 1)
-			return false;
+		struct incr_stats is = in_stats[n];
 
 		if (UDEBUGL(7))
-			fprintf(stderr, "read %5d/%d %6d %.3f %"PRIpath" %s\n", n, nodes,
+			log_printf(7, "read %5d/%d %6d %.3f %"PRIpath" %s\n", n, nodes,
 				is.incr.playouts, is.incr.value, is.coord_path,
 				path2sstr(is.coord_path, t->board));
 
@@ -236,17 +334,37 @@ receive_stats(struct uct *u, int size)
 		stats_add_result(&node->u, is.incr.value, is.incr.playouts);
 
 		/* last_total += others_incr */
-		stats_add_result(&node->pu, is.incr.value, is.incr.playouts);
+		stats_add_result(&tree_node_cold(t, node)->pu, is.incr.value, is.incr.playouts);
 
 		prev = node;
 	}
 	if (DEBUGVV(2))
-		fprintf(stderr, "read args for %d nodes in %.4fms\n", nodes,
+		log_printf(2, "read args for %d nodes in %.4fms\n", nodes,
 			(time_now() - start_time)*1000);
 	return true;
 }
 
-/* A tree traversal fills this array, then the nodes with most increments are sent. */
+/* Read the move stats sent by the master (see uct_apply_stats()).
+ * Return true if ok, false if error. */
+static bool
+receive_stats(struct uct *u, int size)
+{
+	int max_nodes = 1 << u->stats_hbits;
+	if (size > 1 + max_nodes * STATS_WIRE_MAX_RECORD) return false;
+
+	static unsigned char *wire = NULL;
+	static int wire_size = 0;
+	if (size > wire_size) {
+		wire = realloc2(wire, size);
+		wire_size = size;
+	}
+	if (fread(wire, 1, size, stdin) != (size_t)size)
+		return false;
+	return uct_apply_stats(u, wire, size);
+}
+
+/* The dirty rings or a tree traversal fill this array, then the nodes
+ * with most increments are sent. */
 struct stats_candidate {
 	path_t coord_path;
 	int playout_incr;
@@ -267,23 +385,24 @@ static int bucket_count[MAX_BUCKETS];
  * have been made since the last send, and the level is not too deep.
  * Return the updated stats count. */
 static int
-append_stats(struct stats_candidate *stats_queue, struct tree_node *node, int stats_count,
+append_stats(struct stats_candidate *stats_queue, struct tree *t, struct tree_node *node, int stats_count,
 	     int max_count, path_t start_path, path_t max_path, int min_increment, struct board *b)
 {
 	/* The children field is set only after all children are created
 	 * so we can traverse the the tree while it is updated. */
+	tree_fix_node(t, node);
 	for (struct tree_node *ni = node->children; ni; ni = ni->sibling) {
 
 		if (is_pass(node_coord(ni))) continue;
 		if (ni->hints & TREE_HINT_INVALID) continue;
 
-		int incr = ni->u.playouts - ni->pu.playouts;
+		int incr = ni->u.playouts - tree_node_cold(t, ni)->pu.playouts;
 		if (incr < min_increment) continue;
 
 		/* min_increment should be tuned to avoid overflow. */
 		if (stats_count >= max_count) {
 			if (DEBUGL(0))
-				fprintf(stderr, "*** stats overflow %d nodes\n", stats_count);
+				log_printf(0, "*** stats overflow %d nodes\n", stats_count);
 			return stats_count;
 		}
 		path_t child_path = append_child(start_path, node_coord(ni), b);
@@ -297,25 +416,228 @@ append_stats(struct stats_candidate *stats_queue, struct tree_node *node, int st
 		/* Do not recurse if level deep enough. */
 		if (child_path >= max_path) continue;
 
-		stats_count = append_stats(stats_queue, ni, stats_count, max_count,
+		stats_count = append_stats(stats_queue, t, ni, stats_count, max_count,
 					   child_path, max_path, min_increment, b);
 	}
 	return stats_count;
 }
 
-/* Used to sort by coord path the incremental stats to be sent. */
+
+/* Rather than walking the shared levels of the tree at each report, the
+ * search threads record the nodes they update there (see
+ * uct_dirty_record()), each in its own ring, and the report takes
+ * its candidates from the rings. A node is queued only once until it
+ * is reported: its cold dirty field is the generation it was queued
+ * in. The candidates not sent stay queued for the next report. If a
+ * ring gets full, the next report falls back to walking the tree. */
+
+/* Nodes evicted during the search are deeper than this, see
+ * TREE_EVICT_MIN_DEPTH in uct/tree.c. */
+#define DIRTY_MAX_LEVELS 4
+#define DIRTY_RING_SIZE 8192
+
+struct dirty_ring {
+	struct tree_node *node[DIRTY_RING_SIZE];
+	volatile unsigned long head, tail;
+};
+
+struct tree_dirty {
+	volatile unsigned int gen; // never 0
+	volatile bool overflow;
+	int levels;
+	int rings_n;
+	struct dirty_ring *rings;
+	/* Candidates left over by the last report, main thread only. */
+	struct stats_candidate *queue;
+	int queue_n;
+};
+
+struct tree_dirty *
+uct_dirty_init(int threads, int levels)
+{
+	if (levels > DIRTY_MAX_LEVELS)
+		return NULL;
+	struct tree_dirty *d = calloc2(1, sizeof(*d));
+	d->gen = 1;
+	d->levels = levels;
+	d->rings_n = threads;
+	d->rings = calloc2(threads, sizeof(*d->rings));
+	return d;
+}
+
+void
+uct_dirty_done(struct tree_dirty *d)
+{
+	free(d->rings);
+	free(d->queue);
+	free(d);
+}
+
+/* Forget all the queued nodes. Nodes the search threads queue at the
+ * same time may be queued twice, which sort_stats() takes care of. */
+static void
+dirty_restart(struct tree_dirty *d)
+{
+	if (!++d->gen)
+		d->gen = 1;
+	for (int i = 0; i < d->rings_n; i++)
+		d->rings[i].tail = d->rings[i].head;
+	d->queue_n = 0;
+	d->overflow = false;
+}
+
+void
+uct_dirty_reset(struct tree *t)
+{
+	if (t->dirty)
+		dirty_restart(t->dirty);
+}
+
+void
+uct_dirty_record(struct tree *t, int tid, struct uct_descent *descent, int dlen)
+{
+	struct tree_dirty *d = t->dirty;
+	if (tid < 0 || tid >= d->rings_n) {
+		d->overflow = true;
+		return;
+	}
+	struct dirty_ring *r = &d->rings[tid];
+	unsigned int gen = d->gen;
+	for (int i = 1; i < dlen && i <= d->levels; i++) {
+		struct tree_node *n = descent[i].node;
+		if (is_pass(node_coord(n)))
+			return;
+		struct tree_node_cold *cold = tree_node_cold(t, n);
+		unsigned int old = cold->dirty;
+		if (old == gen)
+			continue;
+		if (r->head - r->tail >= DIRTY_RING_SIZE) {
+			d->overflow = true;
+			return;
+		}
+		if (!__sync_bool_compare_and_swap(&cold->dirty, old, gen))
+			continue;
+		r->node[r->head % DIRTY_RING_SIZE] = n;
+		__sync_synchronize();
+		r->head++;
+	}
+}
+
+/* Coord path of @n, false if it is not to be shared. */
+static bool
+dirty_path(struct tree *t, struct tree_node *n, int levels, path_t *path)
+{
+	coord_t coords[DIRTY_MAX_LEVELS];
+	int k = 0;
+	for (; n != t->root; n = n->parent) {
+		if (!n || k == levels || is_pass(node_coord(n)) || (n->hints & TREE_HINT_INVALID))
+			return false;
+		coords[k++] = node_coord(n);
+	}
+	*path = 0;
+	while (k > 0)
+		*path = append_child(*path, coords[--k], t->board);
+	return *path > 0;
+}
+
+/* Fill stats_queue with the candidates left over by the last report
+ * and the nodes recorded since. Return the stats count. */
+static int
+dirty_stats(struct tree_dirty *d, struct stats_candidate *stats_queue, struct tree *t, int max_count)
+{
+	int stats_count = 0;
+	for (int i = 0; i < d->queue_n; i++) {
+		stats_queue[stats_count] = d->queue[i];
+		tree_node_cold(t, stats_queue[stats_count++].node)->dirty = 0;
+	}
+	for (int i = 0; i < d->rings_n; i++) {
+		struct dirty_ring *r = &d->rings[i];
+		unsigned long head = r->head;
+		__sync_synchronize();
+		/* Nodes not taken stay queued in the ring. */
+		for (; r->tail < head && stats_count < max_count; r->tail++) {
+			struct tree_node *n = r->node[r->tail % DIRTY_RING_SIZE];
+			tree_node_cold(t, n)->dirty = 0;
+			if (dirty_path(t, n, d->levels, &stats_queue[stats_count].coord_path))
+				stats_queue[stats_count++].node = n;
+		}
+	}
+	__sync_synchronize();
+
+	int count = 0;
+	for (int i = 0; i < stats_count; i++) {
+		struct tree_node *n = stats_queue[i].node;
+		int incr = n->u.playouts - tree_node_cold(t, n)->pu.playouts;
+		if (incr < 1)
+			continue;
+		stats_queue[i].playout_incr = incr;
+		stats_queue[count++] = stats_queue[i];
+		bucket_count[incr < MAX_BUCKETS ? incr : MAX_BUCKETS - 1]++;
+	}
+	return count;
+}
+
+/* Queue again the candidates with increments still unsent, unless
+ * a search thread queued them already. */
+static void
+dirty_keep(struct tree_dirty *d, struct stats_candidate *stats_queue, int stats_count, struct tree *t, int max_count)
+{
+	if (!d->queue)
+		d->queue = malloc2(max_count * sizeof(*d->queue));
+	d->queue_n = 0;
+	for (int i = 0; i < stats_count; i++) {
+		struct tree_node *n = stats_queue[i].node;
+		struct tree_node_cold *cold = tree_node_cold(t, n);
+		if (n->u.playouts > cold->pu.playouts
+		    && __sync_bool_compare_and_swap(&cold->dirty, 0, d->gen))
+			d->queue[d->queue_n++] = stats_queue[i];
+	}
+}
+
+/* Sort the increments by increasing coord path, with a radix sort on
+ * the bytes of the path in use. A node queued twice is merged into
+ * a single increment. Return the new count. */
 static int
-coord_cmp(const void *p1, const void *p2)
+sort_stats(struct incr_stats *stats, int count)
 {
-	path_t diff = ((struct incr_stats *)p1)->coord_path
-		    - ((struct incr_stats *)p2)->coord_path;
-	return (int)(diff >> 32) | !!(int)diff;
+	static struct incr_stats *tmp = NULL;
+	static int tmp_size = 0;
+	if (count > tmp_size) {
+		tmp = realloc2(tmp, count * sizeof(*tmp));
+		tmp_size = count;
+	}
+
+	path_t bits = 0;
+	for (int i = 0; i < count; i++)
+		bits |= stats[i].coord_path;
+	struct incr_stats *src = stats, *dst = tmp;
+	for (int shift = 0; shift < 64 && bits >> shift; shift += 8) {
+		int start[257] = { 0 };
+		for (int i = 0; i < count; i++)
+			start[((src[i].coord_path >> shift) & 0xff) + 1]++;
+		for (int k = 1; k < 257; k++)
+			start[k] += start[k - 1];
+		for (int i = 0; i < count; i++)
+			dst[start[(src[i].coord_path >> shift) & 0xff]++] = src[i];
+		struct incr_stats *s = src; src = dst; dst = s;
+	}
+	if (src != stats)
+		memcpy(stats, src, count * sizeof(*stats));
+
+	int n = 0;
+	for (int i = 0; i < count; i++) {
+		if (n > 0 && stats[n - 1].coord_path == stats[i].coord_path)
+			stats_merge(&stats[n - 1].incr, &stats[i].incr);
+		else
+			stats[n++] = stats[i];
+	}
+	return n;
 }
 
 /* Select from stats_queue at most shared_nodes candidates with
  * biggest increments. Return a binary array sorted by coord path. */
 static struct incr_stats *
-select_best_stats(struct stats_candidate *stats_queue, int stats_count,
+select_best_stats(struct stats_candidate *stats_queue, struct tree *t, int stats_count,
 		  int shared_nodes, int *byte_size)
 {
 	static struct incr_stats *out_stats = NULL;
@@ -339,8 +661,9 @@ select_best_stats(struct stats_candidate *stats_queue, int stats_count,
 		if (delta < 0 || (delta == 0 && --min_count < 0)) continue;
 
 		struct tree_node *node = stats_queue[count].node;
+		struct tree_node_cold *cold = tree_node_cold(t, node);
 		os->incr = node->u;
-		stats_rm_result(&os->incr, node->pu.value, node->pu.playouts);
+		stats_rm_result(&os->incr, cold->pu.value, cold->pu.playouts);
 
 		/* With virtual loss os->incr.playouts might be <= 0; we only
 		 * send positive increments to other slaves so a virtual loss
@@ -348,7 +671,7 @@ select_best_stats(struct stats_candidate *stats_queue, int stats_count,
 		 * virtual loss will be propagated later when node->u gets
 		 * above node->pu. */
 		if (os->incr.playouts > 0) {
-			node->pu = node->u;
+			cold->pu = node->u;
 			os->coord_path = stats_queue[count].coord_path;
 			assert(os->coord_path > 0);
 			os++;
@@ -356,22 +679,21 @@ select_best_stats(struct stats_candidate *stats_queue, int stats_count,
 		}
 		assert (out_count <= shared_nodes);
 	}
-	*byte_size = (char *)os - (char *)out_stats;
-
-	/* Sort the increments by increasing coord path (required by master).
-	 * Can be done in linear time with radix sort if qsort is too slow. */
-	qsort(out_stats, out_count, sizeof(*os), coord_cmp);
+	/* Sort the increments by increasing coord path (required by master). */
+	out_count = sort_stats(out_stats, out_count);
+	*byte_size = out_count * sizeof(*os);
 	return out_stats;
 }
 
-/* Get incremental stats updates for the distributed engine.
- * Return a binary array of incr_stats structs in coordinate order
- * (increasing levels and increasing coordinates within a level).
+/* Get incremental stats updates for the distributed engine, or for
+ * the other processes sharing stats through shared memory.
+ * Return incr_stats structs in coordinate order (increasing levels
+ * and increasing coordinates within a level), in wire format.
  * This function is called only by the main thread, but may be
  * called while the tree is updated by the worker threads. Keep this
  * code in sync with distributed/merge.c:merge_new_stats(). */
-static void *
-report_incr_stats(struct uct *u, int *stats_size)
+void *
+uct_report_incr_stats(struct uct *u, int *stats_size)
 {
 	double start_time = time_now();
 
@@ -398,24 +720,41 @@ report_incr_stats(struct uct *u, int *stats_size)
 	 * more frequently. */
 	static int min_increment = 1;
 	static int stats_count = 0;
-	if (stats_count > 2 * u->shared_nodes) {
-		min_increment++;
-	} else if (stats_count < u->shared_nodes / 2 && min_increment > 1) {
-		min_increment--;
+	struct tree_dirty *d = u->t->dirty;
+	bool dirty = d && !d->overflow;
+	if (dirty) {
+		stats_count = dirty_stats(d, stats_queue, u->t, max_nodes);
+	} else {
+		if (stats_count > 2 * u->shared_nodes) {
+			min_increment++;
+		} else if (stats_count < u->shared_nodes / 2 && min_increment > 1) {
+			min_increment--;
+		}
+		stats_count = append_stats(stats_queue, u->t, root, 0, max_nodes, 0,
+					   max_parent_path(u, b), min_increment, b);
+		/* The walk found all the candidates. */
+		if (d) dirty_restart(d);
 	}
 
-	stats_count = append_stats(stats_queue, root, 0, max_nodes, 0,
-				   max_parent_path(u, b), min_increment, b);
+	int raw_size;
+	struct incr_stats *out_stats = select_best_stats(stats_queue, u->t, stats_count, u->shared_nodes, &raw_size);
+	if (dirty)
+		dirty_keep(d, stats_queue, stats_count, u->t, max_nodes);
+	int out_nodes = raw_size / sizeof(struct incr_stats);
 
-	void *buf = select_best_stats(stats_queue, stats_count, u->shared_nodes, stats_size);
+	/* The master accepts at most shared_nodes raw structs worth of wire data. */
+	static unsigned char *buf = NULL;
+	int max_size = u->shared_nodes * sizeof(struct incr_stats);
+	if (!buf) buf = malloc2(max_size);
+	*stats_size = out_nodes ? stats_wire_encode(out_stats, out_nodes, buf, max_size) : 0;
 
 	if (DEBUGVV(2))
-		fprintf(stderr,
-			"min_incr %d games %d stats_queue %d/%d sending %d/%d in %.3fms\n",
-			min_increment, root->u.playouts - root->pu.playouts, stats_count,
-			max_nodes, *stats_size / (int)sizeof(struct incr_stats), u->shared_nodes,
+		log_printf(2,
+			"min_incr %d games %d stats_queue %d/%d sending %d/%d (%d bytes) in %.3fms\n",
+			min_increment, root->u.playouts - tree_node_cold(u->t, root)->pu.playouts, stats_count,
+			max_nodes, out_nodes, u->shared_nodes, *stats_size,
 			(time_now() - start_time)*1000);
-	root->pu = root->u;
+	tree_node_cold(u->t, root)->pu = root->u;
 	return buf;
 }
 
@@ -492,6 +831,12 @@ uct_genmoves(struct engine *e, struct board *b, struct time_info *ti, enum stone
 	assert(u->slave);
 	u->pass_all_alive |= pass_all_alive;
 
+	/* The search started by pondering after our last move has
+	 * no time info and another search state; restart it on the
+	 * same tree, as uct_genmove() does. */
+	if (u->pondering)
+		uct_pondering_stop(u);
+
 	/* Prepare the state if the search is not already running.
 	 * We must do this first since we tweak the state below
 	 * based on instructions from the master. */
@@ -517,16 +862,18 @@ uct_genmoves(struct engine *e, struct board *b, struct time_info *ti, enum stone
 		uct_search_start(u, b, color, u->t, ti, &s);
 	}
 
-	/* Read binary incremental stats if present, otherwise
-	 * wait a bit to populate the statistics. */
+	/* Read binary incremental stats if present. The master streams
+	 * genmoves with stats as fast as we reply, so reply at most every
+	 * stats_delay; without stats wait a bit to populate the statistics. */
+	static double last_reply = 0;
 	int size = 0;
 	char *sizep = strchr(args, '@');
 	if (sizep) size = atoi(sizep+1);
-	if (!size) {
-		time_sleep(u->stats_delay);
-	} else if (!receive_stats(u, size)) {
+	if (size && !receive_stats(u, size))
 		return NULL;
-	}
+	double wait = (size ? last_reply : time_now()) + u->stats_delay - time_now();
+	if (wait > 0) time_sleep(wait);
+	last_reply = time_now();
 
 	/* Check the state of the Monte Carlo Tree Search. */
 
@@ -536,9 +883,7 @@ uct_genmoves(struct engine *e, struct board *b, struct time_info *ti, enum stone
 
 	*stats_size = 0;
 	bool keep_looking = false;
-	coord_t best_coord = pass;
-	if (b->fbook)
-		best_coord = fbook_check(b);
+	coord_t best_coord = fbook_check(b);
 	if (best_coord == pass) {
 		keep_looking = !uct_search_check_stop(u, b, color, u->t, ti, &s, played_games);
 		uct_search_result(u, b, color, u->pass_all_alive, played_games, s.base_playouts, &best_coord);
@@ -546,7 +891,7 @@ uct_genmoves(struct engine *e, struct board *b, struct time_info *ti, enum stone
 		if (best_coord > 0) best_coord = 0; 
 
 		if (u->shared_levels) {
-			*stats_buf = report_incr_stats(u, stats_size);
+			*stats_buf = uct_report_incr_stats(u, stats_size);
 		}
 	}
 	char *reply = report_stats(u, b, best_coord, keep_looking, *stats_size);
@@ -7,11 +7,27 @@
 struct board;
 struct engine;
 struct time_info;
+struct uct;
 
 enum parse_code uct_notify(struct engine *e, struct board *b, int id, char *cmd, char *args, char **reply);
 char *uct_genmoves(struct engine *e, struct board *b, struct time_info *ti, enum stone color,
 		   char *args, bool pass_all_alive, void **stats_buf, int *stats_size);
-void *uct_htable_alloc(int hbits);
+void *uct_report_incr_stats(struct uct *u, int *stats_size);
+bool uct_apply_stats(struct uct *u, unsigned char *wire, int size);
+struct tree_htable;
+struct tree_htable *uct_htable_alloc(int hbits);
+void uct_htable_done(struct tree_htable *h);
 void uct_htable_reset(struct tree *t);
 
+/* Tracking of the shared nodes updated since the last report, for
+ * uct_report_incr_stats(). uct_dirty_init() returns NULL if @levels
+ * is too deep to track. */
+struct tree_dirty;
+struct uct_descent;
+struct tree_dirty *uct_dirty_init(int threads, int levels);
+void uct_dirty_done(struct tree_dirty *d);
+void uct_dirty_reset(struct tree *t);
+/* Record the shared nodes of the descent of search thread @tid. */
+void uct_dirty_record(struct tree *t, int tid, struct uct_descent *descent, int dlen);
+
 #endif
@@ -1,15 +1,25 @@
 #include <assert.h>
+#include <limits.h>
 #include <math.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #define DEBUG
 #include "board.h"
 #include "debug.h"
 #include "engine.h"
+#include "memstats.h"
+#include "metrics.h"
 #include "move.h"
 #include "playout.h"
 #include "tactics/util.h"
@@ -20,24 +30,140 @@
 #include "uct/slave.h"
 
 
-/* Allocate tree node(s). The returned nodes are initialized with zeroes.
+/* Empty the fast_alloc arenas. */
+static void
+tree_reset_arenas(struct tree *t)
+{
+	for (int a = 0; a < t->arenas_n; a++)
+		t->arenas[a].used = 0;
+	t->free_n = 0;
+	t->small_head = t->small_n = 0;
+	t->nodes_full = false;
+}
+
+/* Take count contiguous nodes from the arena of the NUMA node of the
+ * calling thread, or from the next arena with enough space. An arena
+ * may become full with a few nodes unused at its end. Returns the
+ * index of the first node in t->nodes, or -1 if all arenas are full.
+ * This function may be called by multiple threads in parallel. */
+static long
+tree_arena_alloc(struct tree *t, int count)
+{
+	int first = numa_node() % t->arenas_n;
+	for (int i = 0; i < t->arenas_n; i++) {
+		struct tree_arena *a = &t->arenas[(first + i) % t->arenas_n];
+		if (a->used + count > a->size) continue;
+		unsigned long index = __sync_fetch_and_add(&a->used, count);
+		if (index + count <= a->size)
+			return a->start + index;
+	}
+	return -1;
+}
+
+/* Runs of nodes freed by tree_evict() shorter than this go to the
+ * small runs queue rather than the free runs. */
+#define TREE_FREE_RUN_MIN 8
+
+/* Queue a short run of freed nodes. Called with free_lock held. */
+static void
+tree_free_small(struct tree *t, struct tree_free_run *run)
+{
+	if (t->small_n == t->small_max) {
+		if (t->small_head > t->small_max / 2) {
+			t->small_n -= t->small_head;
+			memmove(t->small_runs, t->small_runs + t->small_head, t->small_n * sizeof(*t->small_runs));
+			t->small_head = 0;
+		} else {
+			t->small_max = t->small_max ? t->small_max * 2 : 1024;
+			t->small_runs = realloc2(t->small_runs, t->small_max * sizeof(*t->small_runs));
+		}
+	}
+	t->small_runs[t->small_n++] = *run;
+}
+
+/* Take count contiguous nodes from the runs freed by tree_evict()
+ * that no reader can see anymore: those evicted before the walks of
+ * all the readers began. Small requests (mostly single nodes, with
+ * lazy_children) are served from the oldest short run, the others
+ * first fit from the free runs. Returns the index of the first node
+ * as tree_arena_alloc(). */
+static long
+tree_free_alloc(struct tree *t, int count)
+{
+	unsigned long safe = t->evict_epoch;
+	for (int r = 0; r < t->readers; r++) {
+		unsigned long e = t->reader_epoch[r];
+		if (e && e < safe)
+			safe = e;
+	}
+
+	long index = -1;
+	pthread_mutex_lock(&t->free_lock);
+	if (count < TREE_FREE_RUN_MIN && t->small_head < t->small_n) {
+		struct tree_free_run *f = &t->small_runs[t->small_head];
+		if (f->count >= count && f->epoch <= safe) {
+			index = f->first - (struct tree_node *)t->nodes;
+			f->first += count;
+			f->count -= count;
+			if (!f->count)
+				t->small_head++;
+			goto done;
+		}
+	}
+	for (int i = 0; i < t->free_n; i++) {
+		struct tree_free_run *f = &t->free_runs[i];
+		if (f->count < count || f->epoch > safe)
+			continue;
+		index = f->first - (struct tree_node *)t->nodes;
+		f->first += count;
+		f->count -= count;
+		if (f->count < TREE_FREE_RUN_MIN) {
+			if (f->count)
+				tree_free_small(t, f);
+			*f = t->free_runs[--t->free_n];
+		}
+		break;
+	}
+done:
+	pthread_mutex_unlock(&t->free_lock);
+	return index;
+}
+
+/* Allocate tree node(s). The returned nodes are initialized with zeroes,
+ * including their cold stats. In fast_alloc mode the nodes are contiguous.
+ * Without fast_alloc only a single node can be allocated at once.
  * Returns NULL if not enough memory.
  * This function may be called by multiple threads in parallel. */
 static struct tree_node *
 tree_alloc_node(struct tree *t, int count, bool fast_alloc)
 {
 	struct tree_node *n = NULL;
-	size_t nsize = count * sizeof(*n);
+	size_t nsize = count * TREE_NODE_SIZE;
 	unsigned long old_size = __sync_fetch_and_add(&t->nodes_size, nsize);
 
 	if (fast_alloc) {
-		if (old_size + nsize > t->max_tree_size)
+		if (old_size + nsize > t->max_tree_size) {
+			__sync_fetch_and_sub(&t->nodes_size, nsize);
+			t->nodes_full = true;
 			return NULL;
+		}
 		assert(t->nodes != NULL);
-		n = (struct tree_node *)(t->nodes + old_size);
-		memset(n, 0, nsize);
+		long index = tree_arena_alloc(t, count);
+		if (index < 0 && (t->free_n || t->small_head < t->small_n))
+			index = tree_free_alloc(t, count);
+		if (index < 0) {
+			__sync_fetch_and_sub(&t->nodes_size, nsize);
+			t->nodes_full = true;
+			return NULL;
+		}
+		/* The memset is also the first touch of the pages,
+		 * which places them on the node of this thread. */
+		n = (struct tree_node *)t->nodes + index;
+		memset(n, 0, count * sizeof(*n));
+		memset(t->nodes_cold + index, 0, count * sizeof(struct tree_node_cold));
 	} else {
-		n = calloc2(count, sizeof(*n));
+		assert(count == 1);
+		n = calloc2(1, TREE_NODE_SIZE);
 	}
 	return n;
 }
@@ -50,10 +176,14 @@ tree_setup_node(struct tree *t, struct tree_node *n, coord_t coord, int depth)
 	static volatile unsigned int hash = 0;
 	n->coord = coord;
 	n->depth = depth;
+	n->sym_epoch = t->sym_epoch;
 	/* n->hash is used only for debugging. It is very likely (but not
-	 * guaranteed) to be unique. */
-	hash_t h = n - (struct tree_node *)0;
-	n->hash = (h << 32) + (hash++ & 0xffffffff);
+	 * guaranteed) to be unique. With a transposition table it is set
+	 * to the position key later, on first descent. */
+	if (!t->ttable) {
+		hash_t h = n - (struct tree_node *)0;
+		n->hash = (h << 32) + (hash++ & 0xffffffff);
+	}
 	if (depth > t->max_depth)
 		t->max_depth = depth;
 }
@@ -71,32 +201,116 @@ tree_init_node(struct tree *t, coord_t coord, int depth, bool fast_alloc)
 	return n;
 }
 
+/* Bytes of a block of count candidates. */
+static size_t
+tree_cands_size(int count)
+{
+	return sizeof(struct tree_cands) + count * sizeof(struct tree_cand);
+}
+
+/* Nodes of the buffer taken by a block of count candidates (fast_alloc). */
+static int
+tree_cands_nodes(int count)
+{
+	return (tree_cands_size(count) + sizeof(struct tree_node) - 1) / sizeof(struct tree_node);
+}
+
+/* Allocate a block for count candidates, cleared, with its count set.
+ * Returns NULL if not enough memory (fast_alloc).
+ * This function may be called by multiple threads in parallel. */
+static struct tree_cands *
+tree_alloc_cands(struct tree *t, int count)
+{
+	struct tree_cands *cands;
+	if (t->nodes) {
+		cands = (struct tree_cands *) tree_alloc_node(t, tree_cands_nodes(count), true);
+		if (!cands)
+			return NULL;
+	} else {
+		__sync_fetch_and_add(&t->nodes_size, tree_cands_size(count));
+		cands = calloc2(1, tree_cands_size(count));
+	}
+	cands->count = count;
+	return cands;
+}
+
+/* Map the fast_alloc nodes buffer. Descent touches nodes all over it,
+ * so with small pages TLB misses dominate on large trees: try explicit
+ * huge pages first, then ask for transparent huge pages. The mapping
+ * size is rounded up in @mapped, to be given back to munmap(). */
+#define TREE_HUGE_PAGE (2 * 1024 * 1024)
+
+static void *
+tree_map_nodes(unsigned long size, unsigned long *mapped)
+{
+	*mapped = (size + TREE_HUGE_PAGE - 1) & ~(unsigned long) (TREE_HUGE_PAGE - 1);
+	void *p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+	p = mmap(NULL, *mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+	if (p == MAP_FAILED) {
+		p = mmap(NULL, *mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED) {
+			perror("mmap");
+			exit(1);
+		}
+#ifdef MADV_HUGEPAGE
+		madvise(p, *mapped, MADV_HUGEPAGE);
+#endif
+	} else if (DEBUGL(3))
+		fprintf(stderr, "tree: %lu bytes of huge pages\n", *mapped);
+	return p;
+}
+
 /* Create a tree structure. Pre-allocate all nodes if max_tree_size is > 0. */
 struct tree *
 tree_init(struct board *board, enum stone color, unsigned long max_tree_size,
-	  unsigned long max_pruned_size, unsigned long pruning_threshold, floating_t ltree_aging, int hbits)
+	  unsigned long max_pruned_size, unsigned long pruning_threshold, floating_t ltree_aging, int hbits,
+	  int tt_hbits, int ltree_hbits)
 {
 	struct tree *t = calloc2(1, sizeof(*t));
 	t->board = board;
 	t->max_tree_size = max_tree_size;
 	t->max_pruned_size = max_pruned_size;
 	t->pruning_threshold = pruning_threshold;
+	t->gc_threads = 1;
 	if (max_tree_size != 0) {
-		t->nodes = malloc2(max_tree_size);
+		/* Split the buffer between the nodes and their cold stats. */
+		t->nodes_max = max_tree_size / TREE_NODE_SIZE;
+		t->nodes = tree_map_nodes(max_tree_size, &t->nodes_mapped);
+		mem_account(MEM_TREE, t->nodes_mapped);
+		t->nodes_cold = (struct tree_node_cold *)((struct tree_node *)t->nodes + t->nodes_max);
+		t->arenas_n = numa_arenas();
+		for (int a = 0; a < t->arenas_n; a++) {
+			t->arenas[a].start = t->nodes_max * a / t->arenas_n;
+			t->arenas[a].size = t->nodes_max * (a + 1) / t->arenas_n - t->arenas[a].start;
+		}
+		pthread_mutex_init(&t->free_lock, NULL);
 		/* The nodes buffer doesn't need initialization. This is currently
 		 * done by tree_init_node to spread the load. Doing a memset for the
 		 * entire buffer here would be too slow for large trees (>10 GB). */
 	}
+	t->tt_hbits = tt_hbits;
+	if (tt_hbits > 0) {
+		assert(tt_hbits <= 30);
+		t->ttable = calloc2(1 << tt_hbits, sizeof(*t->ttable));
+		mem_account(MEM_TREE, (1 << tt_hbits) * sizeof(*t->ttable));
+	}
 	/* The root PASS move is only virtual, we never play it. */
 	t->root = tree_init_node(t, pass, 0, t->nodes);
 	t->root_symmetry = board->symmetry;
+	pthread_mutex_init(&t->sym_lock, NULL);
 	t->root_color = stone_other(color); // to research black moves, root will be white
 
 	t->ltree_black = tree_init_node(t, pass, 0, false);
 	t->ltree_white = tree_init_node(t, pass, 0, false);
 	t->ltree_aging = ltree_aging;
+	t->ltree_hbits = ltree_hbits;
+	if (ltree_hbits) {
+		t->ltree_index = calloc2(1 << ltree_hbits, sizeof(*t->ltree_index));
+		mem_account(MEM_TREE, (1 << ltree_hbits) * sizeof(*t->ltree_index));
+	}
 
-	t->hbits = hbits;
 	if (hbits) t->htable = uct_htable_alloc(hbits);
 	return t;
 }
@@ -115,9 +329,14 @@ tree_done_node(struct tree *t, struct tree_node *n)
 		tree_done_node(t, ni);
 		ni = nj;
 	}
+	struct tree_cands *cands = tree_node_cold(t, n)->cands;
+	if (cands) {
+		__sync_fetch_and_sub(&t->nodes_size, tree_cands_size(cands->count));
+		free(cands);
+	}
 	free(n);
-	unsigned long old_size = __sync_fetch_and_sub(&t->nodes_size, sizeof(*n));
-	return old_size - sizeof(*n);
+	unsigned long old_size = __sync_fetch_and_sub(&t->nodes_size, TREE_NODE_SIZE);
+	return old_size - TREE_NODE_SIZE;
 }
 
 struct subtree_ctx {
@@ -164,15 +383,43 @@ tree_done_node_detached(struct tree *t, struct tree_node *n)
 	pthread_attr_destroy(&attr);
 }
 
+static void tree_tbook_done(struct tree *tree);
+
 void
 tree_done(struct tree *t)
 {
 	tree_done_node(t, t->ltree_black);
 	tree_done_node(t, t->ltree_white);
-
-	if (t->htable) free(t->htable);
+	if (!t->nodes)
+		for (int i = 0; i < t->history_n; i++)
+			tree_done_node(t, t->history[i].root);
+
+	if (t->htable) uct_htable_done(t->htable);
+	if (t->dirty) uct_dirty_done(t->dirty);
+	if (t->ttable) {
+		free(t->ttable);
+		mem_account(MEM_TREE, -(long long) ((1 << t->tt_hbits) * sizeof(*t->ttable)));
+	}
 	if (t->nodes) {
-		free(t->nodes);
+		free(t->free_runs);
+		free(t->small_runs);
+		pthread_mutex_destroy(&t->free_lock);
+	}
+	if (t->reader_epoch) {
+		free((void *) t->reader_epoch);
+		pthread_mutex_destroy(&t->evict_lock);
+	}
+	if (t->ltree_index) {
+		free(t->ltree_index);
+		mem_account(MEM_TREE, -(long long) ((1 << t->ltree_hbits) * sizeof(*t->ltree_index)));
+	}
+	pthread_mutex_destroy(&t->sym_lock);
+	tree_tbook_done(t);
+	if (t->gc_tree)
+		tree_done(t->gc_tree);
+	if (t->nodes) {
+		munmap(t->nodes, t->nodes_mapped);
+		mem_account(MEM_TREE, -(long long) t->nodes_mapped);
 		free(t);
 	} else if (!tree_done_node(t, t->root)) {
 		free(t);
@@ -187,6 +434,7 @@ static void
 tree_node_dump(struct tree *tree, struct tree_node *node, int treeparity, int l, int thres)
 {
 	for (int i = 0; i < l; i++) fputc(' ', stderr);
+	tree_fix_node(tree, node);
 	int children = 0;
 	for (struct tree_node *ni = node->children; ni; ni = ni->sibling)
 		children++;
@@ -249,78 +497,569 @@ tree_book_name(struct board *b)
 	return buf;
 }
 
+/* Node record in the opening tbook. This is the layout of the
+ * node stats before the hot/cold split, keep it for compatibility. */
+struct tree_node_tbook {
+	struct move_stats u, prior, amaf;
+	struct move_stats pu, winner_owner, black_owner;
+	short coord;
+	unsigned short depth;
+	signed char descents;
+	unsigned char d;
+	unsigned char hints;
+	bool is_expanded;
+};
+
+/* The tbook file is a header followed by a flat array of nodes in
+ * breadth-first order, so that the children of each node are consecutive
+ * records; the root is record 0. Records refer to each other by index
+ * only, and the file is mmap'ed read-only by tree_load(), so all
+ * processes on a host share a single copy of the book. Nodes are copied
+ * into the tree only when it expands them, see tree_tbook_expand(). */
+
+#define TBOOK_MAGIC "PACHITB2"
+
+struct tree_tbook_header {
+	char magic[8];
+	uint32_t count; // number of records
+	uint32_t rec_size; // sizeof(struct tree_tbook_rec), catches floating_t mismatch
+};
+
+struct tree_tbook_rec {
+	struct tree_node_tbook n;
+	uint32_t first_child, children;
+};
+
+struct tree_tbook {
+	void *map;
+	size_t map_size;
+	bool mapped; // else malloc'ed, see tree_tbook_read_old()
+	struct tree_tbook_rec *recs;
+	unsigned int count;
+	/* Record of the tree root. */
+	unsigned int root;
+	/* Book coordinate -> tree coordinate, after the flips
+	 * of tree_fix_symmetry(). */
+	coord_t *coord;
+};
+
+static inline coord_t
+tbook_coord(struct tree_tbook *tb, short coord)
+{
+	return is_pass(coord) ? coord : tb->coord[coord];
+}
+
 static void
-tree_node_save(FILE *f, struct tree_node *node, int thres)
+tree_tbook_unmap(struct tree_tbook *tb)
 {
-	bool save_children = node->u.playouts >= thres;
+#ifndef _WIN32
+	if (tb->mapped)
+		munmap(tb->map, tb->map_size);
+	else
+#endif
+		free(tb->map);
+	free(tb->coord);
+	mem_account(MEM_TREE, -(long long) tb->map_size);
+	free(tb);
+}
 
-	if (!save_children)
-		node->is_expanded = 0;
+static void
+tree_tbook_done(struct tree *tree)
+{
+	struct tree_tbook *tb = tree->tbook;
+	if (!tb)
+		return;
+	tree->tbook = NULL;
+	tree_tbook_unmap(tb);
+}
 
-	fputc(1, f);
-	fwrite(((void *) node) + offsetof(struct tree_node, u),
-	       sizeof(struct tree_node) - offsetof(struct tree_node, u),
-	       1, f);
+/* Returns the record of the child of record parent playing c, or -1. */
+static int
+tree_tbook_child(struct tree_tbook *tb, unsigned int parent, coord_t c)
+{
+	struct tree_tbook_rec *r = &tb->recs[parent];
+	for (unsigned int i = r->first_child; i < r->first_child + r->children; i++)
+		if (tbook_coord(tb, tb->recs[i].n.coord) == c)
+			return i;
+	return -1;
+}
 
-	if (save_children) {
-		for (struct tree_node *ni = node->children; ni; ni = ni->sibling)
-			tree_node_save(f, ni, thres);
+static void
+tree_node_from_tbook(struct tree *tree, struct tree_node *node, struct tree_node_tbook *rec)
+{
+	struct tree_node_cold *cold = tree_node_cold(tree, node);
+	node->u = rec->u; node->prior = rec->prior; node->amaf = rec->amaf;
+	cold->winner_owner = rec->winner_owner; cold->black_owner = rec->black_owner;
+	node->d = rec->d; node->hints = rec->hints & ~TREE_HINT_HEAVY_PRIOR;
+
+	/* Keep values in sane scale, otherwise we start overflowing. */
+#define MAX_PLAYOUTS	10000000
+	if (node->u.playouts > MAX_PLAYOUTS) {
+		node->u.playouts = MAX_PLAYOUTS;
+	}
+	if (node->amaf.playouts > MAX_PLAYOUTS) {
+		node->amaf.playouts = MAX_PLAYOUTS;
+	}
+	cold->pu = node->u;
+}
+
+/* Give back count nodes from first, which no other thread has seen,
+ * to the fast_alloc allocator. They go with the runs freed by
+ * tree_evict(), reusable right away. */
+static void
+tree_free_block(struct tree *t, struct tree_node *first, int count)
+{
+	struct tree_free_run run = { .first = first, .count = count, .epoch = 0 };
+	pthread_mutex_lock(&t->free_lock);
+	if (count < TREE_FREE_RUN_MIN) {
+		tree_free_small(t, &run);
 	} else {
-		if (node->children)
-			node->is_expanded = 1;
+		if (t->free_n == t->free_max) {
+			t->free_max = t->free_max ? t->free_max * 2 : 64;
+			t->free_runs = realloc2(t->free_runs, t->free_max * sizeof(*t->free_runs));
+		}
+		t->free_runs[t->free_n++] = run;
 	}
+	pthread_mutex_unlock(&t->free_lock);
+	__sync_fetch_and_sub(&t->nodes_size, count * TREE_NODE_SIZE);
+}
 
-	fputc(0, f);
+/* Attach the children list built off to the side to node, with its
+ * candidates if any, unless another thread did so first. The losing
+ * list and candidates go back to the allocator. Returns true if
+ * first_child won. */
+static bool
+tree_publish_children(struct tree *t, struct tree_node *node, struct tree_node *first_child, int count,
+		      struct tree_cands *cands)
+{
+	if (!cands && __sync_bool_compare_and_swap(&node->children, NULL, first_child))
+		return true;
+	/* The candidates must be there before the children: whoever
+	 * sets them publishes its children too. */
+	if (cands && __sync_bool_compare_and_swap(&tree_node_cold(t, node)->cands, NULL, cands)) {
+		__sync_fetch_and_or(&node->hints, TREE_HINT_CANDS);
+		node->children = first_child;
+		return true;
+	}
+
+	if (t->nodes) {
+		tree_free_block(t, first_child, count);
+		if (cands)
+			tree_free_block(t, (struct tree_node *) cands, tree_cands_nodes(cands->count));
+		return false;
+	}
+	if (cands) {
+		__sync_fetch_and_sub(&t->nodes_size, tree_cands_size(cands->count));
+		free(cands);
+	}
+	while (first_child) {
+		struct tree_node *next = first_child->sibling;
+		free(first_child);
+		__sync_fetch_and_sub(&t->nodes_size, TREE_NODE_SIZE);
+		first_child = next;
+	}
+	return false;
+}
+
+/* Create the children of node from the tbook, if it has them.
+ * Called for node being expanded, i.e. with is_expanded set and no
+ * children yet. Returns false if the normal expansion must be done.
+ * This function must be thread safe, like tree_expand_node(). */
+static bool
+tree_tbook_expand(struct tree *t, struct tree_node *node)
+{
+	struct tree_tbook *tb = t->tbook;
+	if (!tb)
+		return false;
+
+	/* Nodes out of the book have no record, nor their children. */
+	unsigned int rec = tree_node_cold(t, node)->tbook_rec;
+	if (!rec-- || !tb->recs[rec].children)
+		return false;
+
+	struct tree_tbook_rec *r = &tb->recs[rec];
+	struct tree_node *first_child = t->nodes ? tree_alloc_node(t, r->children, true) : NULL;
+	if (t->nodes && !first_child) {
+		if (!node->children)
+			node->is_expanded = false;
+		return true;
+	}
+	struct tree_node *prev = NULL;
+	for (unsigned int j = 0; j < r->children; j++) {
+		struct tree_node *ni = t->nodes ? first_child + j : tree_alloc_node(t, 1, false);
+		struct tree_node_tbook *rc = &tb->recs[r->first_child + j].n;
+		tree_setup_node(t, ni, tbook_coord(tb, rc->coord), node->depth + 1);
+		tree_node_from_tbook(t, ni, rc);
+		tree_node_cold(t, ni)->tbook_rec = r->first_child + j + 1;
+		ni->parent = node;
+		if (prev) prev->sibling = ni; else first_child = ni;
+		prev = ni;
+	}
+	tree_publish_children(t, node, first_child, r->children, NULL);
+	return true;
+}
+
+/* Follow the tbook to the child c of the root. */
+static void
+tree_tbook_promote(struct tree *tree, coord_t c)
+{
+	struct tree_tbook *tb = tree->tbook;
+	int rec = tree_tbook_child(tb, tb->root, c);
+	if (rec < 0 || !tb->recs[rec].children) {
+		tree_tbook_done(tree);
+		return;
+	}
+	tb->root = rec;
+}
+
+/* Copy the whole tbook subtree of node into the tree. */
+static void
+tree_tbook_expand_all(struct tree *tree, struct tree_node *node, int *num)
+{
+	(*num)++;
+	node->is_expanded = true;
+	if (!tree_tbook_expand(tree, node) || !node->children) {
+		node->is_expanded = false;
+		return;
+	}
+	for (struct tree_node *ni = node->children; ni; ni = ni->sibling)
+		tree_tbook_expand_all(tree, ni, num);
+}
+
+/* Copy in the tbook nodes below the leaves of the tree. */
+static void
+tree_tbook_expand_leaves(struct tree *tree, struct tree_node *node)
+{
+	if (!node->children) {
+		int num = 0;
+		tree_tbook_expand_all(tree, node, &num);
+		return;
+	}
+	for (struct tree_node *ni = node->children; ni; ni = ni->sibling)
+		tree_tbook_expand_leaves(tree, ni);
+}
+
+static bool tree_take_cands(struct tree *t, struct tree_node *node);
+
+static bool
+tree_node_save_children(struct tree *tree, struct tree_node *node, int thres)
+{
+	return node->u.playouts >= thres && node->children && !tree_node_cands(tree, node);
+}
+
+/* Several processes may grow the same book at once (see
+ * tools/gentbook.sh): each one merges its own playouts into the book
+ * as found on disk when saving, much like the distributed slaves send
+ * only their increments to the master. The increments are u - pu, pu
+ * being the stats a node got from the book when it was loaded (see
+ * tree_node_from_tbook()). The book nodes are matched by their move
+ * path from the root; the saving itself is serialized by a lock file. */
+
+/* A record to write: a tree node, the same position in the book on
+ * disk, or both. */
+struct tbook_item {
+	struct tree_node *node;
+	int cur; // record in the book on disk, -1 if none
+	uint32_t children;
+};
+
+static struct tree_tbook *tree_tbook_map(FILE *f, struct board *b);
+static void tree_tbook_check(struct tree_tbook *tb, struct board *b);
+
+/* Stats of node merged with those of the book on disk. */
+static struct move_stats
+tbook_merge_stats(struct tree *tree, struct tree_node *node, struct tree_tbook_rec *cur)
+{
+	if (!cur)
+		return node->u;
+	struct move_stats merged = cur->n.u;
+	struct move_stats incr = node->u;
+	struct move_stats *pu = &tree_node_cold(tree, node)->pu;
+	stats_rm_result(&incr, pu->value, pu->playouts);
+	if (incr.playouts > 0)
+		stats_add_result(&merged, incr.value, incr.playouts);
+	return merged;
+}
+
+static bool
+tbook_tree_child(struct tree_node *node, coord_t c)
+{
+	for (struct tree_node *ni = node->children; ni; ni = ni->sibling)
+		if (node_coord(ni) == c)
+			return true;
+	return false;
+}
+
+static void
+tbook_queue(struct tbook_item **queue, int *size, int *count, struct tree_node *node, int cur)
+{
+	if (*count == *size) {
+		*size *= 2;
+		*queue = realloc2(*queue, *size * sizeof(**queue));
+	}
+	(*queue)[(*count)++] = (struct tbook_item) { .node = node, .cur = cur };
 }
 
 void
 tree_save(struct tree *tree, struct board *b, int thres)
 {
+	/* The book nodes never visited by the search must be saved too. */
+	if (tree->tbook)
+		tree_tbook_expand_leaves(tree, tree->root);
+
+	/* The old book may still be mapped, by us or by other processes:
+	 * write a new file and rename it over the old one. */
 	char *filename = tree_book_name(b);
-	FILE *f = fopen(filename, "wb");
+	char tmpname[276];
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename);
+#ifndef _WIN32
+	char lockname[276];
+	snprintf(lockname, sizeof(lockname), "%s.lock", filename);
+	int lock = open(lockname, O_RDWR | O_CREAT, 0644);
+	if (lock < 0 || flock(lock, LOCK_EX) < 0)
+		perror(lockname);
+#endif
+	FILE *f = fopen(tmpname, "wb");
 	if (!f) {
 		perror("fopen");
-		return;
+		goto unlock;
+	}
+
+	/* The book as other processes left it. Merging makes sense
+	 * only if we have the whole book, from its root. */
+	struct tree_tbook *cur = NULL;
+	if (!tree->root->depth && (!tree->tbook || !tree->tbook->root)) {
+		FILE *cf = fopen(filename, "rb");
+		if (cf) {
+			cur = tree_tbook_map(cf, b);
+			fclose(cf);
+		}
+		if (cur && !cur->count) {
+			tree_tbook_unmap(cur);
+			cur = NULL;
+		}
 	}
-	tree_node_save(f, tree->root, thres);
-	fputc(0, f);
+
+	/* Number the records breadth-first. Children stay in the
+	 * coord order of the tree, those only in the book on disk
+	 * are interleaved. */
+	int size = 1024, count = 0;
+	struct tbook_item *queue = malloc2(size * sizeof(*queue));
+	tbook_queue(&queue, &size, &count, tree->root, cur ? 0 : -1);
+	for (int i = 0; i < count; i++) {
+		struct tree_node *node = queue[i].node;
+		struct tree_tbook_rec *cr = queue[i].cur >= 0 ? &cur->recs[queue[i].cur] : NULL;
+		int first = count;
+		if (node)
+			tree_fix_node(tree, node);
+		/* The book has no candidates, only nodes. */
+		if (node && node->u.playouts >= thres)
+			tree_take_cands(tree, node);
+		if (!node || !tree_node_save_children(tree, node, thres)) {
+			for (uint32_t j = 0; cr && cr->n.is_expanded && j < cr->children; j++)
+				tbook_queue(&queue, &size, &count, NULL, cr->first_child + j);
+			queue[i].children = count - first;
+			continue;
+		}
+
+		uint32_t j = 0, cend = cr ? cr->children : 0;
+		for (struct tree_node *ni = node->children; ni; ni = ni->sibling) {
+			int c = node_coord(ni);
+			for (; j < cend && cur->recs[cr->first_child + j].n.coord < c; j++)
+				if (!tbook_tree_child(node, cur->recs[cr->first_child + j].n.coord))
+					tbook_queue(&queue, &size, &count, NULL, cr->first_child + j);
+			int rec = cr ? tree_tbook_child(cur, queue[i].cur, c) : -1;
+			tbook_queue(&queue, &size, &count, ni, rec);
+		}
+		for (; j < cend; j++)
+			if (!tbook_tree_child(node, cur->recs[cr->first_child + j].n.coord))
+				tbook_queue(&queue, &size, &count, NULL, cr->first_child + j);
+		queue[i].children = count - first;
+	}
+
+	struct tree_tbook_header h = { .count = count, .rec_size = sizeof(struct tree_tbook_rec) };
+	memcpy(h.magic, TBOOK_MAGIC, sizeof(h.magic));
+	fwrite(&h, sizeof(h), 1, f);
+
+	uint32_t next = 1;
+	for (int i = 0; i < count; i++) {
+		struct tree_node *node = queue[i].node;
+		struct tree_tbook_rec *cr = queue[i].cur >= 0 ? &cur->recs[queue[i].cur] : NULL;
+		struct tree_tbook_rec rec;
+		if (node) {
+			struct tree_node_cold *cold = tree_node_cold(tree, node);
+			/* From now on, the merged stats are the book ones. */
+			node->u = cold->pu = tbook_merge_stats(tree, node, cr);
+			if (cr && cr->n.amaf.playouts > node->amaf.playouts)
+				node->amaf = cr->n.amaf;
+			rec = (struct tree_tbook_rec) {
+				.n = {
+					.u = node->u, .prior = node->prior, .amaf = node->amaf,
+					.pu = cold->pu, .winner_owner = cold->winner_owner, .black_owner = cold->black_owner,
+					.coord = node->coord, .depth = node->depth, .descents = node->descents,
+					.d = node->d, .hints = node->hints & ~(TREE_HINT_CANDS | TREE_HINT_HEAVY_PRIOR), .is_expanded = node->is_expanded,
+				},
+			};
+		} else {
+			rec = *cr;
+		}
+		rec.first_child = next;
+		rec.children = queue[i].children;
+		rec.n.is_expanded = !!rec.children;
+		next += rec.children;
+		fwrite(&rec, sizeof(rec), 1, f);
+	}
+	assert(next == (uint32_t) count);
+	free(queue);
 	fclose(f);
+	if (rename(tmpname, filename))
+		perror("rename");
+
+	if (cur)
+		tree_tbook_unmap(cur);
+unlock:
+#ifndef _WIN32
+	if (lock >= 0)
+		close(lock);
+#endif
+	return;
 }
 
 
-void
-tree_node_load(FILE *f, struct tree_node *node, int *num)
+/* Map the tbook starting at the current position of file f, returns
+ * NULL if it is not a valid tbook. */
+static struct tree_tbook *
+tree_tbook_map(FILE *f, struct board *b)
 {
-	(*num)++;
-
-	fread(((void *) node) + offsetof(struct tree_node, u),
-	      sizeof(struct tree_node) - offsetof(struct tree_node, u),
-	      1, f);
+	struct tree_tbook_header h;
+	long off = ftell(f);
+	if (off < 0 || fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, TBOOK_MAGIC, sizeof(h.magic))
+	    || h.rec_size != sizeof(struct tree_tbook_rec) || !h.count)
+		return NULL;
+	size_t map_size = off + sizeof(h) + (size_t) h.count * h.rec_size;
 
-	/* Keep values in sane scale, otherwise we start overflowing. */
-#define MAX_PLAYOUTS	10000000
-	if (node->u.playouts > MAX_PLAYOUTS) {
-		node->u.playouts = MAX_PLAYOUTS;
+#ifndef _WIN32
+	struct stat st;
+	if (fstat(fileno(f), &st) || (size_t) st.st_size < map_size)
+		return NULL;
+	void *map = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fileno(f), 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return NULL;
 	}
-	if (node->amaf.playouts > MAX_PLAYOUTS) {
-		node->amaf.playouts = MAX_PLAYOUTS;
+#else
+	void *map = malloc2(map_size);
+	rewind(f);
+	if (fread(map, map_size, 1, f) != 1) {
+		free(map);
+		return NULL;
 	}
-	memcpy(&node->pu, &node->u, sizeof(node->u));
+#endif
+
+	struct tree_tbook *tb = calloc2(1, sizeof(*tb));
+	tb->map = map;
+	tb->map_size = map_size;
+	tb->mapped = true;
+	tb->recs = (struct tree_tbook_rec *)((char *)map + off + sizeof(h));
+	tb->count = h.count;
+	tree_tbook_check(tb, b);
+	return tb;
+}
 
-	struct tree_node *ni = NULL, *ni_prev = NULL;
-	while (fgetc(f)) {
-		ni_prev = ni; ni = calloc2(1, sizeof(*ni));
-		if (!node->children)
-			node->children = ni;
+/* Sanity check the records and set up the coordinates map. */
+static void
+tree_tbook_check(struct tree_tbook *tb, struct board *b)
+{
+	mem_account(MEM_TREE, tb->map_size);
+	for (unsigned int i = 0; i < tb->count; i++) {
+		struct tree_tbook_rec *r = &tb->recs[i];
+		if (r->first_child > tb->count || r->children > tb->count - r->first_child
+		    || (!is_pass(r->n.coord) && (r->n.coord < 0 || r->n.coord >= board_size2(b)))) {
+			fprintf(stderr, "Corrupted tbook record %u\n", i);
+			tb->count = 0;
+			break;
+		}
+	}
+	tb->coord = malloc2(board_size2(b) * sizeof(*tb->coord));
+	for (coord_t c = 0; c < board_size2(b); c++)
+		tb->coord[c] = c;
+}
+
+/* Books saved before the flat format are a preorder dump of the tree:
+ * each node is a 1 byte, its record, its children, then a 0 byte.
+ * Read one into memory in the flat layout. */
+struct tbook_old_node {
+	struct tree_node_tbook n;
+	int first_child, sibling, last_child;
+};
+
+static int
+tbook_read_old_node(FILE *f, struct tbook_old_node **nodes, int *size, int *count)
+{
+	if (*count == *size) {
+		*size *= 2;
+		*nodes = realloc2(*nodes, *size * sizeof(**nodes));
+	}
+	int i = (*count)++;
+	struct tbook_old_node *on = &(*nodes)[i];
+	if (fread(&on->n, sizeof(on->n), 1, f) != 1)
+		return -1;
+	on->first_child = on->sibling = on->last_child = -1;
+	int c;
+	while ((c = fgetc(f)) == 1) {
+		int child = tbook_read_old_node(f, nodes, size, count);
+		if (child < 0)
+			return -1;
+		on = &(*nodes)[i];
+		if (on->last_child < 0)
+			on->first_child = child;
 		else
-			ni_prev->sibling = ni;
-		ni->parent = node;
-		tree_node_load(f, ni, num);
+			(*nodes)[on->last_child].sibling = child;
+		on->last_child = child;
+	}
+	return c ? -1 : i;
+}
+
+static struct tree_tbook *
+tree_tbook_read_old(FILE *f, struct board *b)
+{
+	rewind(f);
+	if (fgetc(f) != 1)
+		return NULL;
+	int size = 1024, count = 0;
+	struct tbook_old_node *nodes = malloc2(size * sizeof(*nodes));
+	if (tbook_read_old_node(f, &nodes, &size, &count) < 0) {
+		free(nodes);
+		return NULL;
 	}
+
+	/* Renumber breadth-first, the root stays first. */
+	struct tree_tbook_rec *recs = malloc2(count * sizeof(*recs));
+	int *order = malloc2(count * sizeof(*order));
+	int n = 1;
+	order[0] = 0;
+	for (int i = 0; i < n; i++) {
+		struct tbook_old_node *on = &nodes[order[i]];
+		recs[i].n = on->n;
+		recs[i].first_child = n;
+		for (int c = on->first_child; c >= 0; c = nodes[c].sibling)
+			order[n++] = c;
+		recs[i].children = n - recs[i].first_child;
+		recs[i].n.is_expanded = !!recs[i].children;
+	}
+	free(order);
+	free(nodes);
+
+	struct tree_tbook *tb = calloc2(1, sizeof(*tb));
+	tb->map = tb->recs = recs;
+	tb->map_size = count * sizeof(*recs);
+	tb->count = count;
+	tree_tbook_check(tb, b);
+	return tb;
 }
 
 void
-tree_load(struct tree *tree, struct board *b)
+tree_load(struct tree *tree, struct board *b, bool lazy)
 {
 	char *filename = tree_book_name(b);
 	FILE *f = fopen(filename, "rb");
@@ -329,34 +1068,191 @@ tree_load(struct tree *tree, struct board *b)
 
 	fprintf(stderr, "Loading opening tbook %s...\n", filename);
 
+	tree->tbook = tree_tbook_map(f, b);
+	if (!tree->tbook) {
+		/* The next tree_save() writes it in the new format. */
+		tree->tbook = tree_tbook_read_old(f, b);
+		if (tree->tbook)
+			fprintf(stderr, "Converting tbook %s from the old format\n", filename);
+	}
+	fclose(f);
+	if (!tree->tbook) {
+		fprintf(stderr, "Ignoring tbook %s in an unknown format\n", filename);
+		return;
+	}
+	if (!tree->tbook->count) {
+		tree_tbook_done(tree);
+		return;
+	}
+	tree_node_from_tbook(tree, tree->root, &tree->tbook->recs[0].n);
+	tree_node_cold(tree, tree->root)->tbook_rec = 1;
+
 	int num = 0;
-	if (fgetc(f))
-		tree_node_load(f, tree->root, &num);
-	fprintf(stderr, "Loaded %d nodes.\n", num);
+	if (!lazy) {
+		tree_tbook_expand_all(tree, tree->root, &num);
+		tree_tbook_done(tree);
+	} else {
+		/* The search may stop before the first descent when the
+		 * book has enough playouts already, expand the root now. */
+		tree->root->is_expanded = true;
+		if (!tree_tbook_expand(tree, tree->root) || !tree->root->children)
+			tree->root->is_expanded = false;
+		num = tree->tbook->count;
+	}
+	fprintf(stderr, "%s %d nodes.\n", lazy ? "Mapped" : "Loaded", num);
+}
+
+
+/* A checkpoint is the top of the tree of a position, saved periodically
+ * during the search so that a restarted process can pick it up: the
+ * position key below, then a tbook of the tree root. */
+
+#define CHECKPOINT_MAGIC "PACHICK1"
+
+struct tree_checkpoint_header {
+	char magic[8];
+	hash_t hash; // of the position
+	int32_t to_play, size;
+	double komi;
+};
+
+void
+tree_checkpoint(struct tree *tree, struct board *b, int thres, const char *filename)
+{
+	/* Unlike tree_save(), this runs alongside the search: the tree
+	 * is only read, and the nodes with candidates are saved without
+	 * their children, as their lists are still growing. */
+	char tmpname[strlen(filename) + 5];
+	sprintf(tmpname, "%s.tmp", filename);
+	FILE *f = fopen(tmpname, "wb");
+	if (!f) {
+		perror(tmpname);
+		return;
+	}
 
+	int size = 1024, count = 0;
+	struct tbook_item *queue = malloc2(size * sizeof(*queue));
+	tbook_queue(&queue, &size, &count, tree->root, -1);
+	for (int i = 0; i < count; i++) {
+		struct tree_node *node = queue[i].node;
+		int first = count;
+		tree_fix_node(tree, node);
+		if (tree_node_save_children(tree, node, thres))
+			for (struct tree_node *ni = node->children; ni; ni = ni->sibling)
+				tbook_queue(&queue, &size, &count, ni, -1);
+		queue[i].children = count - first;
+	}
+
+	struct tree_checkpoint_header ch = {
+		.hash = b->hash, .to_play = stone_other(tree->root_color),
+		.size = board_size(b), .komi = b->komi,
+	};
+	memcpy(ch.magic, CHECKPOINT_MAGIC, sizeof(ch.magic));
+	fwrite(&ch, sizeof(ch), 1, f);
+	struct tree_tbook_header h = { .count = count, .rec_size = sizeof(struct tree_tbook_rec) };
+	memcpy(h.magic, TBOOK_MAGIC, sizeof(h.magic));
+	fwrite(&h, sizeof(h), 1, f);
+
+	uint32_t next = 1;
+	for (int i = 0; i < count; i++) {
+		struct tree_node *node = queue[i].node;
+		struct tree_node_cold *cold = tree_node_cold(tree, node);
+		struct tree_tbook_rec rec = {
+			.n = {
+				.u = node->u, .prior = node->prior, .amaf = node->amaf,
+				.pu = node->u, .winner_owner = cold->winner_owner, .black_owner = cold->black_owner,
+				.coord = node->coord, .depth = node->depth,
+				.d = node->d, .hints = node->hints & ~(TREE_HINT_CANDS | TREE_HINT_HEAVY_PRIOR),
+				.is_expanded = !!queue[i].children,
+			},
+			.first_child = next, .children = queue[i].children,
+		};
+		next += rec.children;
+		fwrite(&rec, sizeof(rec), 1, f);
+	}
+	free(queue);
+	/* Replace the previous checkpoint only by a complete one. */
+	if (fclose(f) || rename(tmpname, filename))
+		perror(filename);
+	else if (DEBUGL(3))
+		fprintf(stderr, "Checkpoint of %d nodes saved to %s\n", count, filename);
+}
+
+bool
+tree_checkpoint_load(struct tree *tree, struct board *b, enum stone color, const char *filename)
+{
+	FILE *f = fopen(filename, "rb");
+	if (!f)
+		return false;
+	struct tree_checkpoint_header ch;
+	if (fread(&ch, sizeof(ch), 1, f) != 1 || memcmp(ch.magic, CHECKPOINT_MAGIC, sizeof(ch.magic))
+	    || ch.hash != b->hash || ch.to_play != (int) color
+	    || ch.size != board_size(b) || ch.komi != b->komi) {
+		/* A checkpoint of another position. */
+		fclose(f);
+		return false;
+	}
+	tree->tbook = tree_tbook_map(f, b);
 	fclose(f);
+	if (!tree->tbook || !tree->tbook->count) {
+		fprintf(stderr, "Ignoring invalid checkpoint %s\n", filename);
+		tree_tbook_done(tree);
+		return false;
+	}
+
+	tree_node_from_tbook(tree, tree->root, &tree->tbook->recs[0].n);
+	tree_node_cold(tree, tree->root)->tbook_rec = 1;
+	int num = 0;
+	tree_tbook_expand_all(tree, tree->root, &num);
+	tree_tbook_done(tree);
+	if (DEBUGL(2))
+		fprintf(stderr, "Resuming from checkpoint %s: %d nodes, %d playouts.\n",
+			filename, num, tree->root->u.playouts);
+	return true;
 }
 
+/* Copy the candidates of node to its copy n2, which gets its children
+ * as well. Returns false if dest is full. */
+static bool
+tree_prune_cands(struct tree *dest, struct tree *src, struct tree_node *node, struct tree_node *n2)
+{
+	struct tree_cands *cands = tree_node_cands(src, node);
+	if (!cands)
+		return true;
+	struct tree_cands *c2 = tree_alloc_cands(dest, cands->count);
+	if (!c2)
+		return false;
+	memcpy(c2, cands, tree_cands_size(cands->count));
+	tree_node_cold(dest, n2)->cands = c2;
+	n2->hints |= TREE_HINT_CANDS;
+	return true;
+}
 
 /* Copy the subtree rooted at node: all nodes at or below depth
  * or with at least threshold playouts. Only for fast_alloc.
  * The code is destructive on src. The relative order of children of
  * a given node is preserved (assumed by tree_get_node in particular).
+ * Update *max_depth with the depth of the copied nodes.
  * Returns the copy of node in the destination tree, or NULL
- * if we could not copy it. */
+ * if we could not copy it.
+ * This function may be called by multiple threads in parallel
+ * on distinct subtrees. */
 static struct tree_node *
 tree_prune(struct tree *dest, struct tree *src, struct tree_node *node,
-	   int threshold, int depth)
+	   int threshold, int depth, int *max_depth)
 {
 	assert(dest->nodes && node);
 	struct tree_node *n2 = tree_alloc_node(dest, 1, true);
 	if (!n2)
 		return NULL;
 	*n2 = *node;
-	if (n2->depth > dest->max_depth)
-		dest->max_depth = n2->depth;
+	*tree_node_cold(dest, n2) = *tree_node_cold(src, node);
+	if (n2->depth > *max_depth)
+		*max_depth = n2->depth;
 	n2->children = NULL;
 	n2->is_expanded = false;
+	n2->hints &= ~(TREE_HINT_CANDS | TREE_HINT_HEAVY_PRIOR);
+	tree_node_cold(dest, n2)->cands = NULL;
 
 	if (node->depth >= depth && node->u.playouts < threshold)
 		return n2;
@@ -371,14 +1267,14 @@ tree_prune(struct tree *dest, struct tree *src, struct tree_node *node,
 		return n2;
 	struct tree_node **prev2 = &(n2->children);
 	while (ni) {
-		struct tree_node *ni2 = tree_prune(dest, src, ni, threshold, depth);
+		struct tree_node *ni2 = tree_prune(dest, src, ni, threshold, depth, max_depth);
 		if (!ni2) break;
 		*prev2 = ni2;
 		prev2 = &(ni2->sibling);
 		ni2->parent = n2;
 		ni = ni->sibling;
 	}
-	if (!ni) {
+	if (!ni && tree_prune_cands(dest, src, node, n2)) {
 		n2->is_expanded = true;
 	} else {
 		n2->children = NULL; // avoid partially expanded nodes
@@ -386,6 +1282,303 @@ tree_prune(struct tree *dest, struct tree *src, struct tree_node *node,
 	return n2;
 }
 
+/* The subtrees of the children of the top node are copied by
+ * several threads, each taking the next child not copied yet. */
+struct prune_ctx {
+	struct tree *dest, *src;
+	struct tree_node **children, **copies;
+	int count;
+	volatile int next;
+	volatile int tids; // threads started
+	int threshold, depth;
+	volatile int max_depth;
+};
+
+static void *
+tree_prune_worker(void *ctx_)
+{
+	struct prune_ctx *ctx = ctx_;
+	int max_depth = 0, i;
+	while ((i = __sync_fetch_and_add(&ctx->next, 1)) < ctx->count)
+		ctx->copies[i] = tree_prune(ctx->dest, ctx->src, ctx->children[i],
+					    ctx->threshold, ctx->depth, &max_depth);
+	int d;
+	while ((d = ctx->max_depth) < max_depth)
+		__sync_bool_compare_and_swap(&ctx->max_depth, d, max_depth);
+	return NULL;
+}
+
+/* The copies are allocated by the thread making them, so pin the
+ * threads like the search ones to fill the arenas of all nodes. */
+static void *
+tree_prune_thread(void *ctx_)
+{
+	struct prune_ctx *ctx = ctx_;
+	numa_pin_thread(__sync_add_and_fetch(&ctx->tids, 1));
+	return tree_prune_worker(ctx);
+}
+
+/* Same as tree_prune() but copy the subtrees of the children of node
+ * with the given number of threads. The nodes end up in a different
+ * order in dest but the order of the children is still preserved. */
+static struct tree_node *
+tree_prune_parallel(struct tree *dest, struct tree *src, struct tree_node *node,
+		    int threshold, int depth, int *max_depth, int threads)
+{
+	int count = 0;
+	for (struct tree_node *ni = node->children; ni; ni = ni->sibling)
+		count++;
+	if (threads <= 1 || count < 2 || (node->depth >= depth && node->u.playouts < threshold))
+		return tree_prune(dest, src, node, threshold, depth, max_depth);
+
+	/* Copy the top node alone, then its children in parallel. */
+	struct tree_node *children = node->children;
+	node->children = NULL;
+	struct tree_node *n2 = tree_prune(dest, src, node, threshold, depth, max_depth);
+	node->children = children;
+	if (!n2)
+		return NULL;
+
+	struct tree_node *child_[count], *copies[count];
+	struct prune_ctx ctx = { .dest = dest, .src = src, .children = child_, .copies = copies,
+				 .count = count, .threshold = threshold, .depth = depth,
+				 .max_depth = *max_depth };
+	int i = 0;
+	for (struct tree_node *ni = children; ni; ni = ni->sibling)
+		child_[i++] = ni;
+
+	if (threads > count) threads = count;
+	pthread_t thread[threads];
+	for (int t = 1; t < threads; t++)
+		pthread_create(&thread[t], NULL, tree_prune_thread, &ctx);
+	tree_prune_worker(&ctx);
+	for (int t = 1; t < threads; t++)
+		pthread_join(thread[t], NULL);
+	*max_depth = ctx.max_depth;
+
+	/* As in tree_prune(), drop all children if one could not be
+	 * copied, to avoid a partially expanded node. */
+	struct tree_node **prev2 = &(n2->children);
+	for (i = 0; i < count && copies[i]; i++) {
+		*prev2 = copies[i];
+		prev2 = &(copies[i]->sibling);
+		copies[i]->parent = n2;
+	}
+	*prev2 = NULL;
+	n2->is_expanded = i == count && tree_prune_cands(dest, src, node, n2);
+	if (!n2->is_expanded) n2->children = NULL;
+	return n2;
+}
+
+/* Online eviction. When the nodes buffer is full, a search thread
+ * frees the subtrees below the least searched nodes, out of the
+ * principal variation and away from the root: these nodes become
+ * leaves again, their own stats already summing up the children. The
+ * eviction is done in two walks of the tree. The first sums the
+ * memory held by the children of the candidates, by powers of two of
+ * their playouts. The second frees the children of the candidates up
+ * to the power of two freeing the requested memory.
+ *
+ * Other threads may still be walking the freed nodes, so contiguous
+ * runs of them go to tree->free_runs (or tree->small_runs, if short)
+ * tagged with a new evict_epoch.
+ * They are reused only once all the readers began a new walk (see
+ * tree_read_begin()). The nodes buffer itself is reclaimed by the
+ * next garbage collection as usual. */
+
+/* Never evict the children of nodes this near the root, which the
+ * main thread reads during the search without tree_read_begin()
+ * (except for the progress output). */
+#define TREE_EVICT_MIN_DEPTH 4
+/* Seconds between evictions. */
+#define TREE_EVICT_INTERVAL 0.2
+
+struct evict_ctx {
+	struct tree *t;
+	unsigned long mem[33]; // children bytes by bits in the parent playouts
+	int below; // evict the children of candidates with fewer playouts
+	unsigned long freed;
+	struct tree_free_run *runs;
+	int runs_n, runs_max;
+};
+
+void
+tree_evict_init(struct tree *t, int readers)
+{
+	if (!t->nodes)
+		return;
+	t->readers = readers;
+	t->reader_epoch = calloc2(readers, sizeof(*t->reader_epoch));
+	t->evict_epoch = 1;
+	pthread_mutex_init(&t->evict_lock, NULL);
+}
+
+static bool
+tree_in_nodes(struct tree *t, struct tree_node *n)
+{
+	struct tree_node *nodes = t->nodes;
+	return n >= nodes && n < nodes + t->nodes_max;
+}
+
+/* Children out of the nodes buffer could not be reused, so they are
+ * left alone rather than unlinked. */
+static bool
+tree_evict_candidate(struct tree *t, struct tree_node *n, bool on_pv)
+{
+	return n->children && !on_pv && !n->descents
+		&& n->depth - t->root->depth >= TREE_EVICT_MIN_DEPTH
+		&& tree_in_nodes(t, n->children);
+}
+
+static int
+playouts_bits(int playouts)
+{
+	int b = 0;
+	while (b < 32 && (unsigned int) playouts >> b)
+		b++;
+	return b;
+}
+
+static struct tree_node *
+tree_most_searched_child(struct tree_node *n)
+{
+	struct tree_node *best = n->children;
+	for (struct tree_node *ni = n->children; ni; ni = ni->sibling)
+		if (ni->u.playouts > best->u.playouts)
+			best = ni;
+	return best;
+}
+
+static void
+tree_evict_scan(struct evict_ctx *ctx, struct tree_node *n, bool on_pv)
+{
+	struct tree_node *best = on_pv && n->children ? tree_most_searched_child(n) : NULL;
+	int count = 0;
+	for (struct tree_node *ni = n->children; ni; ni = ni->sibling, count++)
+		tree_evict_scan(ctx, ni, ni == best);
+	struct tree_cands *cands = tree_node_cold(ctx->t, n)->cands;
+	if (cands)
+		count += tree_cands_nodes(cands->count);
+	if (tree_evict_candidate(ctx->t, n, on_pv))
+		ctx->mem[playouts_bits(n->u.playouts)] += count * TREE_NODE_SIZE;
+}
+
+static void
+tree_evict_run(struct evict_ctx *ctx, struct tree_node *first, int count)
+{
+	if (!count)
+		return;
+	if (ctx->runs_n == ctx->runs_max) {
+		ctx->runs_max = ctx->runs_max ? ctx->runs_max * 2 : 256;
+		ctx->runs = realloc2(ctx->runs, ctx->runs_max * sizeof(*ctx->runs));
+	}
+	ctx->runs[ctx->runs_n++] = (struct tree_free_run) { .first = first, .count = count };
+	ctx->freed += count * TREE_NODE_SIZE;
+}
+
+static void
+tree_evict_cands(struct evict_ctx *ctx, struct tree_cands *cands)
+{
+	if (cands && tree_in_nodes(ctx->t, (struct tree_node *) cands))
+		tree_evict_run(ctx, (struct tree_node *) cands, tree_cands_nodes(cands->count));
+}
+
+/* Collect the runs of contiguous nodes of a detached children list
+ * and everything below. */
+static void
+tree_evict_runs(struct evict_ctx *ctx, struct tree_node *list)
+{
+	struct tree_node *first = NULL;
+	int count = 0;
+	for (struct tree_node *ni = list; ni; ni = ni->sibling) {
+		if (ni->children)
+			tree_evict_runs(ctx, ni->children);
+		tree_evict_cands(ctx, tree_node_cold(ctx->t, ni)->cands);
+		if (!tree_in_nodes(ctx->t, ni))
+			continue;
+		if (first && ni == first + count) {
+			count++;
+			continue;
+		}
+		tree_evict_run(ctx, first, count);
+		first = ni;
+		count = 1;
+	}
+	tree_evict_run(ctx, first, count);
+}
+
+static void
+tree_evict_walk(struct evict_ctx *ctx, struct tree_node *n, bool on_pv)
+{
+	if (tree_evict_candidate(ctx->t, n, on_pv) && n->u.playouts < ctx->below) {
+		struct tree_node *children = n->children;
+		struct tree_node_cold *cold = tree_node_cold(ctx->t, n);
+		struct tree_cands *cands = cold->cands;
+		n->is_expanded = false;
+		__sync_fetch_and_and(&n->hints, (unsigned char) ~(TREE_HINT_LAZY_PRIOR | TREE_HINT_DCNN_PRIOR | TREE_HINT_DCNN_QUEUED | TREE_HINT_CANDS
+							     | TREE_HINT_PLUGIN_PRIOR | TREE_HINT_HEAVY_PRIOR));
+		cold->cands = NULL;
+		__sync_synchronize();
+		n->children = NULL;
+		tree_evict_runs(ctx, children);
+		tree_evict_cands(ctx, cands);
+		return;
+	}
+	struct tree_node *best = on_pv && n->children ? tree_most_searched_child(n) : NULL;
+	for (struct tree_node *ni = n->children; ni; ni = ni->sibling)
+		tree_evict_walk(ctx, ni, ni == best);
+}
+
+void
+tree_evict(struct tree *t, unsigned long bytes)
+{
+	if (!t->reader_epoch || pthread_mutex_trylock(&t->evict_lock))
+		return;
+	double start_time = time_now();
+	if (start_time - t->evict_time < TREE_EVICT_INTERVAL) {
+		pthread_mutex_unlock(&t->evict_lock);
+		return;
+	}
+
+	struct evict_ctx ctx = { .t = t };
+	tree_evict_scan(&ctx, t->root, true);
+	unsigned long mem = 0;
+	int bits = 0;
+	for (; bits < 32 && mem < bytes; bits++)
+		mem += ctx.mem[bits];
+	ctx.below = bits - 1 < 31 ? 1 << (bits - 1) : INT_MAX;
+	if (mem)
+		tree_evict_walk(&ctx, t->root, true);
+
+	/* The unlinking must be visible to the readers starting after
+	 * the new epoch. */
+	__sync_synchronize();
+	unsigned long epoch = __sync_add_and_fetch(&t->evict_epoch, 1);
+	pthread_mutex_lock(&t->free_lock);
+	if (t->free_n + ctx.runs_n > t->free_max) {
+		t->free_max = t->free_n + ctx.runs_n;
+		t->free_runs = realloc2(t->free_runs, t->free_max * sizeof(*t->free_runs));
+	}
+	for (int i = 0; i < ctx.runs_n; i++) {
+		ctx.runs[i].epoch = epoch;
+		if (ctx.runs[i].count < TREE_FREE_RUN_MIN)
+			tree_free_small(t, &ctx.runs[i]);
+		else
+			t->free_runs[t->free_n++] = ctx.runs[i];
+	}
+	pthread_mutex_unlock(&t->free_lock);
+	__sync_fetch_and_sub(&t->nodes_size, ctx.freed);
+	if (ctx.freed)
+		t->nodes_full = false;
+	free(ctx.runs);
+
+	t->evict_time = time_now();
+	if (DEBUGL(2) && ctx.freed)
+		fprintf(stderr, "evicted %lu bytes below %d playouts in %0.3fs\n",
+			ctx.freed, ctx.below, t->evict_time - start_time);
+	pthread_mutex_unlock(&t->evict_lock);
+}
+
 /* The following constants are used for garbage collection of nodes.
  * A tree is considered large if the top node has >= 40K playouts.
  * For such trees, we copy deep nodes only if they have enough
@@ -417,17 +1610,27 @@ tree_garbage_collect(struct tree *tree, struct tree_node *node)
 	assert(tree->nodes && !node->parent && !node->sibling);
 	double start_time = time_now();
 	unsigned long orig_size = tree->nodes_size;
-
-	struct tree *temp_tree = tree_init(tree->board,  tree->root_color,
-					   tree->max_pruned_size, 0, 0, tree->ltree_aging, 0);
+	/* The previous roots are not copied. */
+	tree->history_n = 0;
+
+	/* The temporary tree is kept from one collection to the next,
+	 * its buffer is already mapped and faulted in. */
+	struct tree *temp_tree = tree->gc_tree;
+	if (!temp_tree || temp_tree->max_tree_size != tree->max_pruned_size) {
+		if (temp_tree) tree_done(temp_tree);
+		temp_tree = tree->gc_tree = tree_init(tree->board,  tree->root_color,
+						      tree->max_pruned_size, 0, 0, tree->ltree_aging, 0, 0, 0);
+	}
 	temp_tree->nodes_size = 0; // We do not want the dummy pass node
+	temp_tree->max_depth = 0;
+	tree_reset_arenas(temp_tree);
         struct tree_node *temp_node;
 
 	/* Find the maximum depth at which we can copy all nodes. */
 	int max_nodes = 1;
 	for (struct tree_node *ni = node->children; ni; ni = ni->sibling)
 		max_nodes++;
-	unsigned long nodes_size = max_nodes * sizeof(*node);
+	unsigned long nodes_size = max_nodes * TREE_NODE_SIZE;
 	int max_depth = node->depth;
 	while (nodes_size < tree->max_pruned_size && max_nodes > 1) {
 		max_nodes--;
@@ -444,13 +1647,16 @@ tree_garbage_collect(struct tree *tree, struct tree_node *node)
 	int threshold = (node->u.playouts - LARGE_TREE_PLAYOUTS) * DEEP_PLAYOUTS_THRESHOLD / LARGE_TREE_PLAYOUTS;
 	if (threshold < 0) threshold = 0;
 	if (threshold > DEEP_PLAYOUTS_THRESHOLD) threshold = DEEP_PLAYOUTS_THRESHOLD; 
-	temp_node = tree_prune(temp_tree, tree, node, threshold, max_depth);
+	temp_node = tree_prune_parallel(temp_tree, tree, node, threshold, max_depth,
+					&temp_tree->max_depth, tree->gc_threads);
 	assert(temp_node);
 
 	/* Now copy back to original tree. */
 	tree->nodes_size = 0;
+	tree_reset_arenas(tree);
 	tree->max_depth = 0;
-	struct tree_node *new_node = tree_prune(tree, temp_tree, temp_node, 0, temp_tree->max_depth);
+	struct tree_node *new_node = tree_prune_parallel(tree, temp_tree, temp_node, 0, temp_tree->max_depth,
+							 &tree->max_depth, tree->gc_threads);
 
 	if (DEBUGL(1)) {
 		double now = time_now();
@@ -463,7 +1669,7 @@ tree_garbage_collect(struct tree *tree, struct tree_node *node)
 			orig_size, temp_tree->nodes_size, tree->max_pruned_size, new_node->u.playouts);
 		prev_time = start_time;
 	}
-	if (temp_tree->nodes_size >= temp_tree->max_tree_size) {
+	if (temp_tree->nodes_full) {
 		fprintf(stderr, "temp tree overflow, max_tree_size %lu, pruning_threshold %lu\n",
 			tree->max_tree_size, tree->pruning_threshold);
 		/* This is not a serious problem, we will simply recompute the discarded nodes
@@ -472,7 +1678,11 @@ tree_garbage_collect(struct tree *tree, struct tree_node *node)
 		assert(tree->nodes_size == temp_tree->nodes_size);
 		assert(tree->max_depth == temp_tree->max_depth);
 	}
-	tree_done(temp_tree);
+
+	double gc_time = time_now() - start_time;
+	metric_add(M_GC, 1);
+	metric_add(M_GC_SECONDS, gc_time);
+	metric_set(M_GC_LAST_SECONDS, gc_time);
 	return new_node;
 }
 
@@ -514,6 +1724,74 @@ tree_get_node(struct tree *t, struct tree_node *parent, coord_t c, bool create)
 	return nn;
 }
 
+/* Number of entries probed before giving up on a full transposition table. */
+#define TT_PROBES 16
+
+struct tree_tt_entry *
+tree_tt_get(struct tree *t, hash_t hash, bool create)
+{
+	assert(hash);
+	unsigned int mask = (1 << t->tt_hbits) - 1;
+	unsigned int i = hash & mask;
+	unsigned int gen = t->tt_gen;
+	struct tree_tt_entry *stale = NULL;
+	for (int probes = 0; probes < TT_PROBES; probes++, i = (i + 1) & mask) {
+		struct tree_tt_entry *e = &t->ttable[i];
+		hash_t h = e->hash;
+		if (h == hash) {
+			if (e->gen != gen)
+				e->gen = gen;
+			return e;
+		}
+		if (h) {
+			if (!stale && e->gen != gen)
+				stale = e;
+			continue;
+		}
+		if (!create)
+			return NULL;
+		/* Free entry, try to claim it. Another thread may have
+		 * claimed it meanwhile, possibly for the same position. */
+		h = __sync_val_compare_and_swap(&e->hash, 0, hash);
+		if (!h || h == hash) {
+			e->gen = gen;
+			return e;
+		}
+	}
+	if (!create || !stale)
+		return NULL;
+
+	/* No free entry around: take over the one of a position not
+	 * reached since the last move. Entries are never freed, so the
+	 * probe sequences of the other positions stay unbroken. A few
+	 * results of the old position may still land in the new stats,
+	 * which is harmless. */
+	hash_t h = stale->hash;
+	if (stale->gen == gen || !__sync_bool_compare_and_swap(&stale->hash, h, hash))
+		return NULL;
+	stale->gen = gen;
+	memset(&stale->u, 0, sizeof(stale->u));
+	return stale;
+}
+
+/* Clear the transposition table. */
+void
+tree_tt_reset(struct tree *t)
+{
+	if (!t->ttable) return;
+	memset(t->ttable, 0, (1 << t->tt_hbits) * sizeof(t->ttable[0]));
+}
+
+void
+tree_tt_update(struct tree *t, struct tree_node *node, floating_t result, int playouts)
+{
+	for (; node; node = node->parent) {
+		if (!node->hash) continue;
+		struct tree_tt_entry *e = tree_tt_get(t, node->hash, false);
+		if (e) stats_add_result(&e->u, result, playouts);
+	}
+}
+
 /* Get local tree node corresponding to given node, given local node child
  * iterator @lni (which points either at the corresponding node, or at the
  * nearest local tree node after @ni). */
@@ -556,16 +1834,105 @@ tree_lnode_for_node(struct tree *tree, struct tree_node *ni, struct tree_node *l
 }
 
 
+/* Number of entries probed before giving up on a full ltree index. */
+#define LTREE_PROBES 16
+
+struct tree_node *
+tree_get_lnode(struct tree *t, struct tree_node *parent, coord_t c)
+{
+	if (!t->ltree_index) {
+		struct tree_node *n = tree_get_node(t, parent, c, true);
+		tree_lnode_age(t, n);
+		return n;
+	}
+
+	/* Local tree nodes are never freed before the tree itself,
+	 * so entries never go stale and the index needs no deletion. */
+	unsigned int mask = (1 << t->ltree_hbits) - 1;
+	uint64_t h = ((uintptr_t) parent >> 4) * 0x9e3779b97f4a7c15ULL ^ (uint64_t) (c + 1) * 0xff51afd7ed558ccdULL;
+	unsigned int i = (h >> 32) & mask;
+	int probes;
+	for (probes = 0; probes < LTREE_PROBES; probes++, i = (i + 1) & mask) {
+		struct tree_node *ni = t->ltree_index[i];
+		if (!ni)
+			break;
+		if (ni->parent == parent && node_coord(ni) == c) {
+			tree_lnode_age(t, ni);
+			return ni;
+		}
+	}
+
+	struct tree_node *nn = tree_get_node(t, parent, c, true);
+	tree_lnode_age(t, nn);
+	/* Index the node in the free entry. If another thread took it
+	 * meanwhile, the node is simply looked up in the list next time. */
+	if (probes < LTREE_PROBES)
+		__sync_bool_compare_and_swap(&t->ltree_index[i], NULL, nn);
+	return nn;
+}
+
+
+void
+tree_lnode_age(struct tree *t, struct tree_node *n)
+{
+	/* Rather than walking the whole local tree at each promotion, the
+	 * node remembers the epoch it was last aged in (amaf is unused in
+	 * the local tree) and makes up for the epochs it missed. Nodes aged
+	 * to zero playouts are kept, the index relies on that. */
+	int epoch = n->amaf.playouts;
+	int age = t->ltree_epoch - epoch;
+	if (likely(age <= 0))
+		return;
+	/* Only the thread moving the epoch forward ages the stats. */
+	if (!__sync_bool_compare_and_swap(&n->amaf.playouts, epoch, t->ltree_epoch))
+		return;
+	n->u.playouts /= pow(t->ltree_aging, age);
+}
+
+
 /* Tree symmetry: When possible, we will localize the tree to a single part
  * of the board in tree_expand_node() and possibly flip along symmetry axes
  * to another part of the board in tree_promote_at(). We follow b->symmetry
  * guidelines here. */
 
 
-/* This function must be thread safe, given that board b is only modified by the calling thread. */
+/* Another thread may be expanding node, leave it to it. If we had the
+ * heavy priors, the next expansion computes them. */
+static void
+tree_expand_failed(struct tree_node *node, bool heavy)
+{
+	if (heavy)
+		__sync_fetch_and_and(&node->hints, (unsigned char) ~TREE_HINT_HEAVY_PRIOR);
+	if (!node->children)
+		node->is_expanded = false;
+}
+
+/* Our children lost the race to be published but have the heavy
+ * priors: give them to the winning children, whose cheap priors are
+ * the same as ours. The winning candidates may be set a bit before
+ * the children, a missed pass child is no loss. */
+static void
+tree_give_priors(struct tree *t, struct tree_node *node, struct move_stats *prior)
+{
+	struct tree_cands *cands = tree_node_cold(t, node)->cands;
+	for (int i = 0; cands && i < cands->count; i++)
+		if (!cands->cand[i].taken)
+			cands->cand[i].prior = prior[cands->cand[i].coord];
+	for (struct tree_node *ni = node->children; ni; ni = ni->sibling)
+		ni->prior = prior[node_coord(ni)];
+}
+
+/* This function must be thread safe, given that board b is only modified by the calling thread.
+ * Several threads may expand the same node at once, see tree_publish_children(). */
 void
 tree_expand_node(struct tree *t, struct tree_node *node, struct board *b, enum stone color, struct uct *u, int parity)
 {
+	node->is_expanded = true;
+	/* The children are created in the current symmetry epoch. */
+	node->sym_epoch = t->sym_epoch;
+	if (tree_tbook_expand(t, node))
+		return;
+
 	/* Get a Common Fate Graph distance map from parent node. */
 	int distances[board_size2(b)];
 	if (!is_pass(b->last_move.coord) && !is_resign(b->last_move.coord)) {
@@ -596,13 +1963,23 @@ tree_expand_node(struct tree *t, struct tree_node *node, struct board *b, enum s
 		map.consider[c] = true;
 		child_count++;
 	} foreach_free_point_end;
+	/* Racing threads all build their children, but only the first one
+	 * computes the heavy priors, as for TREE_HINT_DCNN_QUEUED. */
+	map.heavy = !(__sync_fetch_and_or(&node->hints, TREE_HINT_HEAVY_PRIOR) & TREE_HINT_HEAVY_PRIOR);
 	uct_prior(u, node, &map);
 
+	/* With lazy_children, only pass gets a node here, the other
+	 * moves become candidates. */
+	bool lazy = u->lazy_children && node != t->root;
+	struct tree_cand cand[lazy ? child_count : 1];
+	int cands = 0;
+
 	/* Now, create the nodes (all at once if fast_alloc) */
-	struct tree_node *ni = t->nodes ? tree_alloc_node(t, child_count, true) : tree_alloc_node(t, 1, false);
+	struct tree_node *ni = !t->nodes ? tree_alloc_node(t, 1, false)
+			       : tree_alloc_node(t, lazy ? 1 : child_count, true);
 	/* In fast_alloc mode we might temporarily run out of nodes but this should be rare. */
 	if (!ni) {
-		node->is_expanded = false;
+		tree_expand_failed(node, map.heavy);
 		return;
 	}
 	tree_setup_node(t, ni, pass, node->depth + 1);
@@ -636,6 +2013,10 @@ tree_expand_node(struct tree *t, struct tree_node *node, struct board *b, enum s
 				continue;
 			assert(c != node_coord(node)); // I have spotted "C3 C3" in some sequence...
 
+			if (lazy) {
+				cand[cands++] = (struct tree_cand) { .prior = map.prior[c], .coord = c, .d = distances[c] };
+				continue;
+			}
 			struct tree_node *nj = t->nodes ? first_child + child++ : tree_alloc_node(t, 1, false);
 			tree_setup_node(t, nj, c, node->depth + 1);
 			nj->parent = node; ni->sibling = nj; ni = nj;
@@ -644,7 +2025,79 @@ tree_expand_node(struct tree *t, struct tree_node *node, struct board *b, enum s
 			ni->d = distances[c];
 		}
 	}
-	node->children = first_child; // must be done at the end to avoid race
+
+	struct tree_cands *block = NULL;
+	if (lazy && cands) {
+		block = tree_alloc_cands(t, cands);
+		if (!block) {
+			/* Out of nodes (fast_alloc). */
+			tree_free_block(t, first_child, 1);
+			tree_expand_failed(node, map.heavy);
+			return;
+		}
+		memcpy(block->cand, cand, cands * sizeof(*cand));
+	}
+	if (!tree_publish_children(t, node, first_child, lazy ? 1 : child_count, block) && map.heavy)
+		tree_give_priors(t, node, map.prior);
+}
+
+struct tree_node *
+tree_take_cand(struct tree *t, struct tree_node *node, struct tree_cand *c)
+{
+	/* Once the buffer is full, this is tried at each descent: do not
+	 * let the failed allocations add up in nodes_size. */
+	if (t->nodes && t->nodes_size + TREE_NODE_SIZE > t->max_tree_size)
+		return NULL;
+	while (!__sync_bool_compare_and_swap(&c->taken, false, true)) {
+		/* Another thread took it, its node shows up soon (or the
+		 * candidate is given back if it ran out of nodes), unless
+		 * tree_evict() took the children away meanwhile. */
+		if (!(node->hints & TREE_HINT_CANDS))
+			return NULL;
+		for (struct tree_node *ni = node->children; ni; ni = ni->sibling)
+			if (node_coord(ni) == c->coord)
+				return ni;
+	}
+
+	struct tree_node *n = tree_init_node(t, c->coord, node->depth + 1, t->nodes);
+	if (!n) {
+		c->taken = false;
+		return NULL;
+	}
+	n->parent = node;
+	n->prior = c->prior;
+	n->amaf = c->amaf;
+	n->d = c->d;
+
+	/* Insert in coordinate order. Children are only ever inserted
+	 * during the search, so if another thread got in first we just
+	 * look again from the same place. */
+	struct tree_node **link = &node->children;
+	for (;;) {
+		struct tree_node *next = *link;
+		if (next && node_coord(next) < c->coord) {
+			link = &next->sibling;
+			continue;
+		}
+		n->sibling = next;
+		if (__sync_bool_compare_and_swap(link, next, n))
+			return n;
+	}
+}
+
+/* Take all the candidates of node, which must not be searched.
+ * Returns false if we ran out of nodes (fast_alloc). */
+static bool
+tree_take_cands(struct tree *t, struct tree_node *node)
+{
+	struct tree_cands *cands = tree_node_cands(t, node);
+	if (!cands)
+		return true;
+	for (int i = 0; i < cands->count; i++)
+		if (!cands->cand[i].taken && !tree_take_cand(t, node, &cands->cand[i]))
+			return false;
+	node->hints &= ~TREE_HINT_CANDS;
+	return true;
 }
 
 
@@ -665,15 +2118,56 @@ flip_coord(struct board *b, coord_t c,
 	return coord_xy(b, x, y);
 }
 
-static void
-tree_fix_node_symmetry(struct board *b, struct tree_node *node,
-                       bool flip_horiz, bool flip_vert, int flip_diag)
+static coord_t
+tree_flip_coord(struct tree *t, coord_t c, int epoch)
 {
-	if (!is_pass(node_coord(node)))
-		node->coord = flip_coord(b, node_coord(node), flip_horiz, flip_vert, flip_diag);
+	for (int e = epoch; e < t->sym_epoch; e++) {
+		struct tree_sym_flip *f = &t->sym_flips[e];
+		c = flip_coord(t->board, c, f->horiz, f->vert, f->diag);
+	}
+	return c;
+}
 
+void
+tree_fix_node_symmetry(struct tree *t, struct tree_node *node)
+{
+	pthread_mutex_lock(&t->sym_lock);
+	/* A node last seen before tree_settle_symmetry() counts as current. */
+	int epoch = node->sym_epoch;
+	if (epoch < t->sym_epoch) {
+		for (struct tree_node *ni = node->children; ni; ni = ni->sibling) {
+			if (!is_pass(node_coord(ni)))
+				ni->coord = tree_flip_coord(t, node_coord(ni), epoch);
+			/* The position key is not symmetric, recompute it on next descent. */
+			if (t->ttable)
+				ni->hash = 0;
+		}
+		struct tree_cands *cands = tree_node_cands(t, node);
+		for (int i = 0; cands && i < cands->count; i++)
+			cands->cand[i].coord = tree_flip_coord(t, cands->cand[i].coord, epoch);
+	}
+	/* Readers seeing the new epoch must see the new coordinates. */
+	__sync_synchronize();
+	node->sym_epoch = t->sym_epoch;
+	pthread_mutex_unlock(&t->sym_lock);
+}
+
+/* Bring the whole subtree up to date and back to epoch 0, when the
+ * flips do not fit in sym_flips anymore. */
+static void
+tree_settle_node(struct tree *t, struct tree_node *node)
+{
+	tree_fix_node(t, node);
+	node->sym_epoch = 0;
 	for (struct tree_node *ni = node->children; ni; ni = ni->sibling)
-		tree_fix_node_symmetry(b, ni, flip_horiz, flip_vert, flip_diag);
+		tree_settle_node(t, ni);
+}
+
+static void
+tree_settle_symmetry(struct tree *t)
+{
+	tree_settle_node(t, t->root);
+	t->sym_epoch = 0;
 }
 
 static void
@@ -711,14 +2205,32 @@ tree_fix_symmetry(struct tree *tree, struct board *b, coord_t c)
 			coord2sstr(flip_coord(b, c, flip_horiz, flip_vert, flip_diag), b),
 			s->type, s->d, b->symmetry.type, b->symmetry.d);
 	}
-	if (flip_horiz || flip_vert || flip_diag)
-		tree_fix_node_symmetry(b, tree->root, flip_horiz, flip_vert, flip_diag);
+	if (flip_horiz || flip_vert || flip_diag) {
+		/* Only the root is updated right away, the rest of the tree
+		 * follows lazily as it is visited, see tree_fix_node(). */
+		if (tree->sym_epoch == TREE_SYM_EPOCHS)
+			tree_settle_symmetry(tree);
+		tree->sym_flips[tree->sym_epoch++] = (struct tree_sym_flip) { flip_horiz, flip_vert, flip_diag };
+		struct tree_node *root = tree->root;
+		if (!is_pass(node_coord(root)))
+			root->coord = flip_coord(b, node_coord(root), flip_horiz, flip_vert, flip_diag);
+		if (tree->ttable)
+			root->hash = 0;
+		tree_fix_node(tree, root);
+		if (tree->tbook) {
+			for (coord_t c = 0; c < board_size2(b); c++)
+				tree->tbook->coord[c] = flip_coord(b, tree->tbook->coord[c], flip_horiz, flip_vert, flip_diag);
+		}
+		tree_tt_reset(tree);
+	}
 }
 
 
-static void
+/* Returns the sibling before @node, NULL if it is the first child. */
+static struct tree_node *
 tree_unlink_node(struct tree_node *node)
 {
+	struct tree_node *prev = NULL;
 	struct tree_node *ni = node->parent;
 	if (ni->children == node) {
 		ni->children = node->sibling;
@@ -727,29 +2239,29 @@ tree_unlink_node(struct tree_node *node)
 		while (ni->sibling != node)
 			ni = ni->sibling;
 		ni->sibling = node->sibling;
+		prev = ni;
 	}
 	node->sibling = NULL;
 	node->parent = NULL;
+	return prev;
 }
 
-/* Reduce weight of statistics on promotion. Remove nodes that
- * get reduced to zero playouts; returns next node to consider
- * in the children list (@node may get deleted). */
-static struct tree_node *
-tree_age_node(struct tree *tree, struct tree_node *node)
+/* Keep the old root (without @prev's next sibling, the new root) for
+ * tree_undo(), forgetting the oldest one if the history is full. */
+static void
+tree_history_push(struct tree *tree, struct tree_node *prev)
 {
-	node->u.playouts /= tree->ltree_aging;
-	if (node->parent && !node->u.playouts) {
-		struct tree_node *sibling = node->sibling;
-		/* Delete node, no playouts. */
-		tree_unlink_node(node);
-		tree_done_node(tree, node);
-		return sibling;
+	if (tree->history_n == tree->history_max) {
+		if (!tree->nodes)
+			tree_done_node_detached(tree, tree->history[0].root);
+		memmove(&tree->history[0], &tree->history[1], (tree->history_n - 1) * sizeof(tree->history[0]));
+		tree->history_n--;
 	}
-
-	struct tree_node *ni = node->children;
-	while (ni) ni = tree_age_node(tree, ni);
-	return node->sibling;
+	struct tree_history *h = &tree->history[tree->history_n++];
+	h->root = tree->root;
+	h->prev = prev;
+	h->symmetry = tree->root_symmetry;
+	h->extra_komi = tree->extra_komi;
 }
 
 /* Promotes the given node as the root of the tree. In the fast_alloc
@@ -758,32 +2270,69 @@ void
 tree_promote_node(struct tree *tree, struct tree_node **node)
 {
 	assert((*node)->parent == tree->root);
-	tree_unlink_node(*node);
-	if (!tree->nodes) {
+	struct tree_node *prev = tree_unlink_node(*node);
+	/* The opening tbook follows the game forward only. */
+	if (tree->history_max && !tree->tbook) {
+		tree_history_push(tree, prev);
+	} else if (!tree->nodes) {
 		/* Freeing the rest of the tree can take several seconds on large
 		 * trees, so we must do it asynchronously: */
 		tree_done_node_detached(tree, tree->root);
-	} else {
+	}
+	if (tree->nodes) {
 		/* Garbage collect if we run out of memory, or it is cheap to do so now: */
 		if (tree->nodes_size >= tree->pruning_threshold
 		    || (tree->nodes_size >= tree->max_tree_size / 10 && (*node)->u.playouts < SMALL_TREE_PLAYOUTS))
 			*node = tree_garbage_collect(tree, *node);
 	}
+	if (tree->tbook)
+		tree_tbook_promote(tree, node_coord(*node));
 	tree->root = *node;
 	tree->root_color = stone_other(tree->root_color);
+	tree_fix_node(tree, tree->root);
+	/* The code looking at the root children sees only nodes. */
+	tree_take_cands(tree, tree->root);
 
 	board_symmetry_update(tree->board, &tree->root_symmetry, node_coord(*node));
 	tree->avg_score.playouts = 0;
+	/* Age the transposition table. */
+	tree->tt_gen++;
 
 	/* If the tree deepest node was under node, or if we called tree_garbage_collect,
 	 * tree->max_depth is correct. Otherwise we could traverse the tree
          * to recompute max_depth but it's not worth it: it's just for debugging
 	 * and soon the tree will grow and max_depth will become correct again. */
 
-	if (tree->ltree_aging != 1.0f) { // XXX: != should work here even with the floating_t
-		tree_age_node(tree, tree->ltree_black);
-		tree_age_node(tree, tree->ltree_white);
+	/* Age the local tree, see tree_lnode_age(). */
+	if (tree->ltree_aging != 1.0f) // XXX: != should work here even with the floating_t
+		tree->ltree_epoch++;
+}
+
+bool
+tree_undo(struct tree *tree)
+{
+	if (!tree->history_n)
+		return false;
+	struct tree_history *h = &tree->history[--tree->history_n];
+	struct tree_node *node = tree->root;
+	node->parent = h->root;
+	if (h->prev) {
+		node->sibling = h->prev->sibling;
+		h->prev->sibling = node;
+	} else {
+		node->sibling = h->root->children;
+		h->root->children = node;
 	}
+	tree->root = h->root;
+	tree->root_color = stone_other(tree->root_color);
+	/* The symmetry flips made since this root was pushed are not
+	 * undone; its children were not part of them. */
+	tree->root->sym_epoch = tree->sym_epoch;
+	tree_take_cands(tree, tree->root);
+	tree->root_symmetry = h->symmetry;
+	tree->extra_komi = h->extra_komi;
+	tree->avg_score.playouts = 0;
+	return true;
 }
 
 bool
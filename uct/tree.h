@@ -22,6 +22,9 @@
  *   preference nodes with largest number of playouts.
  *   Then the temporary buffer is copied back to the original
  *   buffer, which has now plenty of space.
+ *   With thread pinning (see uct/numa.h) the buffer is split
+ *   in one arena per NUMA node, and each thread takes nodes
+ *   from the arena of its own node while it has space.
  *   Once the fast_alloc mode is proven reliable, the
  *   calloc/free method will be removed. */
 
@@ -30,6 +33,7 @@
 #include "move.h"
 #include "stats.h"
 #include "probdist.h"
+#include "uct/numa.h"
 
 struct board;
 struct uct;
@@ -48,28 +52,25 @@ struct uct;
  * +------+   +------+   +------+   +------+
  */
 
-/* TODO: Performance would benefit from a reorganization:
- * (i) Allocate all children of a node within a single block.
- * (ii) Keep all u stats together, and all amaf stats together.
- * Currently, rave_update is top source of cache misses, and
- * there is large memory overhead for having all nodes separate. */
+/* Node memory layout: struct tree_node holds only the fields needed
+ * during descent and AMAF updates (links, u, prior, amaf, coord, hints).
+ * The rarely used criticality and distributed stats live in a separate
+ * struct tree_node_cold, see tree_node_cold() below, as well as the
+ * candidates of lazily expanded nodes (see struct tree_cand).
+ * In fast_alloc mode all children of a node are allocated within
+ * a single block of the nodes buffer and the cold stats are kept in a
+ * side array parallel to it, so that walking the children touches only
+ * hot data. A block of candidates takes whole nodes of the buffer.
+ * Nodes allocated with calloc carry their cold stats right after the
+ * node in the same allocation. */
 
 struct tree_node {
-	hash_t hash;
 	struct tree_node *parent, *sibling, *children;
 
-	/*** From here on, struct is saved/loaded from opening tbook */
-
 	struct move_stats u;
 	struct move_stats prior;
 	/* XXX: Should be way for policies to add their own stats */
 	struct move_stats amaf;
-	/* Stats before starting playout; used for distributed engine. */
-	struct move_stats pu;
-	/* Criticality information; information about final board owner
-	 * of the tree coordinate corresponding to the node */
-	struct move_stats winner_owner; // owner == winner
-	struct move_stats black_owner; // owner == black
 
 	/* coord is usually coord_t, but this is very space-sensitive. */
 #define node_coord(n) ((int) (n)->coord)
@@ -83,21 +84,91 @@ struct tree_node {
 
 	/* Common Fate Graph distance from parent, but at most TREE_NODE_D_MAX+1 */
 #define TREE_NODE_D_MAX 3
-	unsigned char d;
+	unsigned char d : 3;
+	/* Symmetry epoch the coordinates of the children (and candidates)
+	 * are in, see tree_fix_node(). */
+	unsigned char sym_epoch : 5;
 
 #define TREE_HINT_INVALID 1 // don't go to this node, invalid move
+#define TREE_HINT_LAZY_PRIOR 2 // children still lack the heavy priors, see uct_prior_lazy()
+#define TREE_HINT_DCNN_PRIOR 4 // children got their dcnn priors, see dcnn_apply_result()
+#define TREE_HINT_CANDS 8 // some children are still candidates, see tree_node_cands()
+#define TREE_HINT_PLUGIN_PRIOR 16 // children got their batched plugin priors, see plugin_apply_result()
+#define TREE_HINT_DCNN_QUEUED 32 // dcnn evaluation queued, see uct_prior_dcnn_async()
+#define TREE_HINT_HEAVY_PRIOR 64 // a thread computes the heavy priors of the children, see tree_expand_node()
 	unsigned char hints;
 
-	/* In case multiple threads walk the tree, is_expanded is set
-	* atomically. Only the first thread setting it expands the node.
-	* The node goes through 3 states:
+	/* Several threads may expand a node at once, each building its
+	* own children list; the first one to set children (atomically,
+	* see tree_publish_children()) wins. The node goes through 3 states:
 	*   1) children == null, is_expanded == false: leaf node
-	*   2) children == null, is_expanded == true: one thread currently expanding
+	*   2) children == null, is_expanded == true: some thread currently expanding
 	*   2) children != null, is_expanded == true: fully expanded node */
 	bool is_expanded;
+
+	/* Unique id used for debugging. With a transposition table,
+	 * this is instead the position key (see tree_tt_key()), set
+	 * when the node is first descended, 0 until then. */
+	hash_t hash;
 };
 
-struct tree_hash;
+/* Cold per-node stats, not touched during descent. */
+struct tree_node_cold {
+	/* Stats before starting playout; used for distributed engine. */
+	struct move_stats pu;
+	/* Generation the node was queued for reporting in, see
+	 * uct_dirty_record(). */
+	unsigned int dirty;
+	/* Opening tbook record of the node plus one, 0 if none. */
+	unsigned int tbook_rec;
+	/* Criticality information; information about final board owner
+	 * of the tree coordinate corresponding to the node */
+	struct move_stats winner_owner; // owner == winner
+	struct move_stats black_owner; // owner == black
+	/* Children not allocated yet, see tree_node_cands(). */
+	struct tree_cands *cands;
+};
+
+/* With lazy_children, expanding a node creates only its pass child;
+ * the other moves are kept as compact candidates holding what the
+ * descent needs to evaluate them, and become nodes when first chosen
+ * (tree_take_cand()). Most children are never visited, so this saves
+ * most of the tree memory. The candidates stay in coordinate order.
+ * The root children are always nodes, see tree_promote_node(). */
+struct tree_cand {
+	struct move_stats prior;
+	struct move_stats amaf;
+	short coord;
+	unsigned char d;
+	bool taken; // now a child node
+};
+
+struct tree_cands {
+	int count;
+	struct tree_cand cand[];
+};
+
+/* Memory accounted for each node in tree->nodes_size. */
+#define TREE_NODE_SIZE (sizeof(struct tree_node) + sizeof(struct tree_node_cold))
+
+struct tree_htable;
+struct tree_tbook;
+
+/* Transposition table entry: stats shared by all nodes of the tree
+ * reaching the same position with the same player to move, which
+ * turns the search into a DAG as far as the values are concerned. */
+struct tree_tt_entry {
+	hash_t hash; // 0 for free entry
+	unsigned int gen; // tree tt_gen when last used
+	struct move_stats u;
+};
+
+/* Most positions tree_undo() can go back. */
+#define TREE_HISTORY_MAX 16
+
+/* Most symmetry flips kept for the lazy update of the nodes,
+ * bounded by the tree_node sym_epoch bits. */
+#define TREE_SYM_EPOCHS 31
 
 struct tree {
 	struct board *board;
@@ -105,6 +176,16 @@ struct tree {
 	struct board_symmetry root_symmetry;
 	enum stone root_color;
 
+	/* Flips applied to the tree coordinates when the root symmetry
+	 * broke; sym_flips[e] takes the coordinates from epoch e to e+1.
+	 * The nodes are not rewritten at that time, each updates its
+	 * children when first visited in a later epoch (tree_fix_node()). */
+	struct tree_sym_flip {
+		bool horiz, vert, diag;
+	} sym_flips[TREE_SYM_EPOCHS];
+	int sym_epoch;
+	pthread_mutex_t sym_lock;
+
 	/* Whether to use any extra komi during score counting. This is
 	 * tree-specific variable since this can arbitrarily change between
 	 * moves. */
@@ -124,46 +205,163 @@ struct tree {
 
 	/* We merge local (non-tenuki) sequences for both colors, occuring
 	 * anywhere in the tree; nodes are created on-demand, special 'pass'
-	 * nodes represent tenuki. Only u move_stats are used, prior and amaf
-	 * is ignored. Values in root node are ignored. */
+	 * nodes represent tenuki. Only u move_stats are used, prior is
+	 * ignored and amaf.playouts keeps the ltree_epoch the u stats were
+	 * last aged in. Values in root node are ignored. */
 	/* The value corresponds to black-to-play as usual; i.e. if white
 	 * succeeds in its replies, the values will be low. */
 	struct tree_node *ltree_black;
 	/* ltree_white has white-first sequences as children. */
 	struct tree_node *ltree_white;
 	/* Aging factor; 2 means halve all playout values after each turn.
-	 * 1 means don't age at all. */
+	 * 1 means don't age at all. The aging is lazy: promotion only bumps
+	 * ltree_epoch and the nodes catch up when they are next accessed,
+	 * see tree_lnode_age(). */
 	floating_t ltree_aging;
+	int ltree_epoch;
+	/* Index of the local tree nodes by parent and coordinate, so that
+	 * recording a sequence does not walk the sibling lists. NULL unless
+	 * enabled by ltree_hbits. */
+	struct tree_node **ltree_index;
+	int ltree_hbits;
 
 	/* Hash table used when working as slave for the distributed engine.
-	 * Maps coordinate path to tree node. */
-	struct tree_hash *htable;
-	int hbits;
+	 * Maps coordinate path to tree node, see uct/slave.c. */
+	struct tree_htable *htable;
+	/* Shared nodes updated since the last stats report, see
+	 * uct_dirty_record(). */
+	struct tree_dirty *dirty;
+
+	/* Transposition table, NULL unless enabled by tt_hbits. The
+	 * generation changes at each tree_promote_node(); the entries
+	 * not used since can be taken over by new positions. */
+	struct tree_tt_entry *ttable;
+	int tt_hbits;
+	volatile unsigned int tt_gen;
 
 	// Statistics
 	int max_depth;
 	volatile unsigned long nodes_size; // byte size of all allocated nodes
+	bool nodes_full; // a fast_alloc allocation failed since the arenas were emptied
 	unsigned long max_tree_size; // maximum byte size for entire tree, > 0 only for fast_alloc
 	unsigned long max_pruned_size;
 	unsigned long pruning_threshold;
+	int gc_threads; // threads copying the tree in tree_garbage_collect()
 	void *nodes; // nodes buffer, only for fast_alloc
+	struct tree_node_cold *nodes_cold; // cold stats parallel to nodes, only for fast_alloc
+	unsigned long nodes_max; // number of nodes in the nodes buffer
+	unsigned long nodes_mapped; // byte size of the nodes buffer mapping
+	struct tree *gc_tree; // temporary tree reused by tree_garbage_collect()
+	/* Parts of the nodes buffer, one per NUMA node (node indices). */
+	struct tree_arena {
+		volatile unsigned long used;
+		unsigned long start, size;
+	} arenas[NUMA_MAX_NODES];
+	int arenas_n;
+	struct tree_tbook *tbook; // opening tbook being followed, see tree_load()
+
+	/* Roots of the previous positions, oldest first, kept by
+	 * tree_promote_node() so that tree_undo() can move back up.
+	 * Each is detached from the tree and lacks the child that was
+	 * promoted, which goes back after @prev (NULL if it was the first
+	 * child). Dropped on garbage collection. */
+	struct tree_history {
+		struct tree_node *root, *prev;
+		struct board_symmetry symmetry;
+		floating_t extra_komi;
+	} history[TREE_HISTORY_MAX];
+	int history_n;
+	int history_max; // 0 keeps no history
+
+	/* Online eviction of the least searched subtrees when the nodes
+	 * buffer is full, fast_alloc only; see tree_evict(). The freed
+	 * runs of nodes are reused once no reader of the tree can still
+	 * be inside them. NULL reader_epoch if not enabled. */
+	struct tree_free_run {
+		struct tree_node *first;
+		int count;
+		unsigned long epoch; // evict_epoch of the eviction, 0 if never published
+	} *free_runs;
+	int free_n, free_max;
+	/* Runs too short for free_runs, oldest first from small_head. */
+	struct tree_free_run *small_runs;
+	int small_head, small_n, small_max;
+	pthread_mutex_t free_lock, evict_lock;
+	volatile unsigned long evict_epoch;
+	volatile unsigned long *reader_epoch; // per reader, 0 when idle
+	int readers;
+	double evict_time; // of the last eviction
 };
 
 /* Warning: all functions below except tree_expand_node & tree_leaf_node are THREAD-UNSAFE! */
 struct tree *tree_init(struct board *board, enum stone color, unsigned long max_tree_size,
-		       unsigned long max_pruned_size, unsigned long pruning_threshold, floating_t ltree_aging, int hbits);
+		       unsigned long max_pruned_size, unsigned long pruning_threshold, floating_t ltree_aging, int hbits,
+		       int tt_hbits, int ltree_hbits);
 void tree_done(struct tree *tree);
 void tree_dump(struct tree *tree, double thres);
 void tree_save(struct tree *tree, struct board *b, int thres);
-void tree_load(struct tree *tree, struct board *b);
+/* Map the opening tbook; if lazy, its nodes are copied into the tree
+ * only when expanded, otherwise the whole book is loaded at once. */
+void tree_load(struct tree *tree, struct board *b, bool lazy);
+/* Save the nodes of the tree with at least thres playouts and their
+ * children to the checkpoint file, while the tree is being searched
+ * (but not evicted from). The position is that of board b. */
+void tree_checkpoint(struct tree *tree, struct board *b, int thres, const char *filename);
+/* Load the checkpoint into the fresh tree, if it is of the position
+ * of board b with color to play. */
+bool tree_checkpoint_load(struct tree *tree, struct board *b, enum stone color, const char *filename);
 
 struct tree_node *tree_get_node(struct tree *tree, struct tree_node *node, coord_t c, bool create);
 struct tree_node *tree_garbage_collect(struct tree *tree, struct tree_node *node);
 void tree_promote_node(struct tree *tree, struct tree_node **node);
 bool tree_promote_at(struct tree *tree, struct board *b, coord_t c);
+/* Enable tree_evict() for @readers threads reading the tree during
+ * the search. */
+void tree_evict_init(struct tree *tree, int readers);
+/* Free about @bytes of nodes under the least searched nodes out of
+ * the principal variation, their parents becoming leaves again.
+ * Thread safe; a no-op if another thread is evicting already. */
+void tree_evict(struct tree *tree, unsigned long bytes);
+
+/* Make the root of the previous position the root again, undoing the
+ * last promotion. Returns false if it is not in the history. */
+bool tree_undo(struct tree *tree);
+
+/* Get the child node of candidate @c of @node, creating it if it was
+ * not taken yet. Returns NULL if out of memory (fast_alloc).
+ * This function may be called by multiple threads in parallel. */
+struct tree_node *tree_take_cand(struct tree *tree, struct tree_node *node, struct tree_cand *c);
 
 void tree_expand_node(struct tree *tree, struct tree_node *node, struct board *b, enum stone color, struct uct *u, int parity);
 struct tree_node *tree_lnode_for_node(struct tree *tree, struct tree_node *ni, struct tree_node *lni, int tenuki_d);
+/* Find or create the child of local tree node @parent at @c.
+ * This function may be called by multiple threads in parallel,
+ * as much as tree_get_node() can. */
+struct tree_node *tree_get_lnode(struct tree *tree, struct tree_node *parent, coord_t c);
+/* Apply the aging of local tree node @n stats pending since it was last
+ * accessed. Call before looking at n->u. Thread safe. */
+void tree_lnode_age(struct tree *tree, struct tree_node *n);
+
+void tree_fix_node_symmetry(struct tree *tree, struct tree_node *node);
+/* Bring the coordinates of @node children and candidates up to date
+ * with the tree symmetry flips. Call before looking at them, except
+ * at the root which is always up to date. Thread safe. */
+static inline void
+tree_fix_node(struct tree *tree, struct tree_node *node)
+{
+	if (unlikely(node->sym_epoch != tree->sym_epoch))
+		tree_fix_node_symmetry(tree, node);
+}
+
+/* Find the transposition table entry for position key @hash, claiming
+ * a free or stale entry if @create. Returns NULL if not found or table
+ * is full.
+ * This function may be called by multiple threads in parallel. */
+struct tree_tt_entry *tree_tt_get(struct tree *tree, hash_t hash, bool create);
+void tree_tt_reset(struct tree *tree);
+/* Add the result of @playouts playouts to the shared stats of @node and
+ * all its parents. */
+void tree_tt_update(struct tree *tree, struct tree_node *node, floating_t result, int playouts);
 
 static bool tree_leaf_node(struct tree_node *node);
 
@@ -184,9 +382,73 @@ tree_leaf_node(struct tree_node *node)
 	return !(node->children);
 }
 
+/* Reader @reader (a search thread, see tree_evict_init()) is going to
+ * walk the tree; the nodes it can see are not reused until it calls
+ * tree_read_end(). */
+static inline void
+tree_read_begin(struct tree *t, int reader)
+{
+	if (!t->reader_epoch)
+		return;
+	t->reader_epoch[reader] = t->evict_epoch;
+	__sync_synchronize();
+}
+
+static inline void
+tree_read_end(struct tree *t, int reader)
+{
+	if (!t->reader_epoch)
+		return;
+	__sync_synchronize();
+	t->reader_epoch[reader] = 0;
+}
+
+/* Transposition table key of the position with board hash @bhash
+ * after @color played; never 0. */
+static inline hash_t
+tree_tt_key(hash_t bhash, enum stone color)
+{
+	hash_t h = bhash ^ (color == S_BLACK ? 0 : 0x5ab1e7e5c0ffee01ULL);
+	return h ? h : 1;
+}
+
+/* Get the u stats for node evaluation: the shared transposition stats
+ * if they have more playouts than the node itself. */
+static inline struct move_stats
+tree_node_stats(struct tree *t, struct tree_node *node)
+{
+	if (t->ttable && node->hash) {
+		struct tree_tt_entry *e = tree_tt_get(t, node->hash, false);
+		if (e && e->u.playouts > node->u.playouts)
+			return e->u;
+	}
+	return node->u;
+}
+
+/* Get the cold stats of a node. */
+static inline struct tree_node_cold *
+tree_node_cold(const struct tree *t, const struct tree_node *node)
+{
+	const struct tree_node *first = (const struct tree_node *) t->nodes;
+	if (first && node >= first && node < first + t->nodes_max)
+		return &t->nodes_cold[node - first];
+	return (struct tree_node_cold *)(node + 1);
+}
+
+/* Get the candidates of a node, NULL if all its children are nodes.
+ * Those with taken set must be skipped, they are in the children list. */
+static inline struct tree_cands *
+tree_node_cands(const struct tree *t, const struct tree_node *node)
+{
+	if (!(node->hints & TREE_HINT_CANDS))
+		return NULL;
+	return tree_node_cold(t, node)->cands;
+}
+
 static inline floating_t
 tree_node_criticality(const struct tree *t, const struct tree_node *node)
 {
+	const struct tree_node_cold *cold = tree_node_cold(t, node);
 	/* cov(player_gets, player_wins) =
 	 * [The argument: If 'gets' and 'wins' is uncorrelated, b_gets * b_wins
 	 * is valid way to obtain winner_gets. The more correlated it is, the
@@ -195,9 +457,9 @@ tree_node_criticality(const struct tree *t, const struct tree_node *node)
 	 * = winner_gets - (b_gets * b_wins + (1 - b_gets) * (1 - b_wins))
 	 * = winner_gets - (b_gets * b_wins + 1 - b_gets - b_wins + b_gets * b_wins)
 	 * = winner_gets - (2 * b_gets * b_wins - b_gets - b_wins + 1) */
-	return node->winner_owner.value
-		- (2 * node->black_owner.value * node->u.value
-		   - node->black_owner.value - node->u.value + 1);
+	return cold->winner_owner.value
+		- (2 * cold->black_owner.value * node->u.value
+		   - cold->black_owner.value - node->u.value + 1);
 }
 
 #endif
@@ -1,9 +1,11 @@
 #include <assert.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 
 #define DEBUG
 
@@ -13,9 +15,11 @@
 #include "chat.h"
 #include "move.h"
 #include "mq.h"
+#include "perfstats.h"
 #include "joseki/base.h"
 #include "playout.h"
 #include "playout/moggy.h"
+#include "playout/gamma.h"
 #include "playout/light.h"
 #include "tactics/util.h"
 #include "timeinfo.h"
@@ -24,6 +28,8 @@
 #include "uct/plugins.h"
 #include "uct/prior.h"
 #include "uct/search.h"
+#include "uct/poscache.h"
+#include "uct/shm.h"
 #include "uct/slave.h"
 #include "uct/tree.h"
 #include "uct/uct.h"
@@ -33,6 +39,8 @@
 struct uct_policy *policy_ucb1_init(struct uct *u, char *arg);
 struct uct_policy *policy_ucb1amaf_init(struct uct *u, char *arg, struct board *board);
 static void uct_pondering_start(struct uct *u, struct board *b0, struct tree *t, enum stone color);
+static void uct_analyze_stop(struct uct *u);
+static void uct_load_wait(struct uct *u);
 
 /* Maximal simulation length. */
 #define MC_GAMELEN	MAX_GAMELEN
@@ -42,16 +50,25 @@ static void
 setup_state(struct uct *u, struct board *b, enum stone color)
 {
 	u->t = tree_init(b, color, u->fast_alloc ? u->max_tree_size : 0,
-			 u->max_pruned_size, u->pruning_threshold, u->local_tree_aging, u->stats_hbits);
+			 u->max_pruned_size, u->pruning_threshold, u->local_tree_aging, u->stats_hbits,
+			 u->tt_hbits, u->local_tree ? u->ltree_hbits : 0);
+	u->t->gc_threads = u->threads;
+	if (u->slave || u->shm)
+		u->t->dirty = uct_dirty_init(u->threads, u->shared_levels);
+	u->t->history_max = u->undo_history;
+	if (u->evict)
+		tree_evict_init(u->t, u->threads + 2); // + the analysis reporter and the main thread
 	if (u->initial_extra_komi)
 		u->t->extra_komi = u->initial_extra_komi;
 	if (u->force_seed)
 		fast_srandom(u->force_seed);
 	if (UDEBUGL(3))
 		fprintf(stderr, "Fresh board with random seed %lu\n", fast_getseed());
+	if (u->checkpoint && tree_checkpoint_load(u->t, b, color, u->checkpoint))
+		return;
 	if (!u->no_tbook && b->moves == 0) {
 		if (color == S_BLACK) {
-			tree_load(u->t, b);
+			tree_load(u->t, b, true);
 		} else if (DEBUGL(0)) {
 			fprintf(stderr, "Warning: First move appears to be white\n");
 		}
@@ -77,6 +94,7 @@ setup_dynkomi(struct uct *u, struct board *b, enum stone to_play)
 void
 uct_prepare_move(struct uct *u, struct board *b, enum stone color)
 {
+	uct_load_wait(u);
 	if (u->t) {
 		/* Verify that we have sane state. */
 		assert(b->es == u);
@@ -87,6 +105,7 @@ uct_prepare_move(struct uct *u, struct board *b, enum stone color)
 			exit(1);
 		}
 		uct_htable_reset(u->t);
+		uct_dirty_reset(u->t);
 
 	} else {
 		/* We need fresh state. */
@@ -96,6 +115,7 @@ uct_prepare_move(struct uct *u, struct board *b, enum stone color)
 
 	u->ownermap.playouts = 0;
 	memset(u->ownermap.map, 0, board_size2(b) * sizeof(u->ownermap.map[0]));
+	u->ownermap_hash = b->hash;
 	u->played_own = u->played_all = 0;
 }
 
@@ -207,6 +227,10 @@ uct_undo(struct engine *e, struct board *b)
 
 	if (!u->t) return NULL;
 	uct_pondering_stop(u);
+	/* Move the root back up if we still have the previous position,
+	 * and it is the one on the board. */
+	if (tree_undo(u->t) && u->t->root_color == b->last_move.color && b->moves)
+		return NULL;
 	u->initial_extra_komi = u->t->extra_komi;
 	reset_state(u);
 	return NULL;
@@ -245,6 +269,75 @@ uct_chat(struct engine *e, struct board *b, bool opponent, char *from, char *cmd
 			    u->threads, winrate, extra_komi);
 }
 
+/* The dead stones estimation plays until the share of the playouts
+ * each stone ended up dame, black or dame, white or dame in is this
+ * many standard errors away from the strict and the relaxed
+ * judgement thresholds, so that no group judgement is going to
+ * change anymore. */
+#define DEAD_CONFIDENCE 2.5
+#define DEAD_THRES_RELAXED 0.55
+/* How often to check for that [s]. */
+#define DEAD_POLL_INTERVAL 0.002
+/* The search threads need to merge their ownermaps more often
+ * for the checks to see their playouts. */
+#define DEAD_OWNERMAP_MERGE 16
+
+static bool
+share_settled(int count, int total, floating_t thres)
+{
+	floating_t p = (floating_t) count / total;
+	/* Never trust a share of 0 or 1 fully. */
+	floating_t se = sqrt((p * (1 - p) + 1.0 / total) / total);
+	return fabs(p - thres) > DEAD_CONFIDENCE * se;
+}
+
+static bool
+ownermap_settled(struct board *b, struct board_ownermap *ownermap)
+{
+	static const floating_t thres[] = { GJ_THRES, DEAD_THRES_RELAXED };
+	int total = ownermap->playouts;
+	if (!total)
+		return false;
+	foreach_point(b) {
+		if (!group_at(b, c))
+			continue;
+		int n = ownermap->map[c][S_NONE];
+		int black = ownermap->map[c][S_BLACK];
+		int white = ownermap->map[c][S_WHITE];
+		for (unsigned int i = 0; i < sizeof(thres) / sizeof(thres[0]); i++)
+			if (!share_settled(n, total, thres[i])
+			    || !share_settled(n + black, total, thres[i])
+			    || !share_settled(n + white, total, thres[i]))
+				return false;
+	} foreach_point_end;
+	return true;
+}
+
+/* Fill the ownermap for the dead stones estimation, running the
+ * search threads until the ownermap is settled. */
+static void
+estimate_dead(struct uct *u, struct board *b)
+{
+	struct board_ownermap ownermap;
+	ownermap.map = malloc2(board_size2(b) * sizeof(ownermap.map[0]));
+	u->ownermap_merge = DEAD_OWNERMAP_MERGE;
+
+	struct uct_search_state s;
+	uct_search_start(u, b, S_BLACK, u->t, NULL, &s);
+	do {
+		time_sleep(DEAD_POLL_INTERVAL);
+		uct_ownermap_copy(u, b, &ownermap);
+	} while (ownermap.playouts < u->dead_max_games
+		 && (ownermap.playouts < u->dead_min_games
+		     || !ownermap_settled(b, &ownermap)));
+	uct_search_stop();
+
+	u->ownermap_merge = 0;
+	free(ownermap.map);
+	if (UDEBUGL(2))
+		fprintf(stderr, "dead stones estimated from %d games\n", u->ownermap.playouts);
+}
+
 static void
 print_dead_groups(struct uct *u, struct board *b, struct move_queue *mq)
 {
@@ -284,21 +377,25 @@ uct_dead_group_list(struct engine *e, struct board *b, struct move_queue *mq)
 	if (u->pass_all_alive)
 		return; // no dead groups
 	
-	/* Create mock state */
-	if (u->t)  reset_state(u);
-	// We need S_BLACK here, but don't clobber u->my_color with uct_genmove_setup() !
-	uct_prepare_move(u, b, S_BLACK); 
-	
-	/* Make sure the ownermap is well-seeded. */
-	while (u->ownermap.playouts < GJ_MINGAMES)
-		uct_playout(u, b, S_BLACK, u->t);
+	/* The ownermap of the last search will do if it is of this
+	 * position (we passed, or the search was after the opponent's
+	 * pass) and already settled. */
+	if (u->ownermap_hash != b->hash
+	    || u->ownermap.playouts < u->dead_min_games
+	    || !ownermap_settled(b, &u->ownermap)) {
+		/* Create mock state */
+		if (u->t)  reset_state(u);
+		// We need S_BLACK here, but don't clobber u->my_color with uct_genmove_setup() !
+		uct_prepare_move(u, b, S_BLACK);
+		estimate_dead(u, b);
+	}
 	/* Show the ownermap: */
 	if (DEBUGL(2))
 		board_print_ownermap(b, stderr, &u->ownermap);
 	
 	struct move_queue relaxed; relaxed.moves = 0;
 	dead_group_list(u, b, mq, GJ_THRES);  	// Strict
-	dead_group_list(u, b, &relaxed, 0.55);  // Relaxed
+	dead_group_list(u, b, &relaxed, DEAD_THRES_RELAXED);  // Relaxed
 	if (DEBUGL(2))  print_dead_groups(u, b, mq);
 
 	/* Add own unclear dead groups if it doesn't change the outcome
@@ -323,7 +420,7 @@ uct_dead_group_list(struct engine *e, struct board *b, struct move_queue *mq)
 	/* Clean up the mock state in case we will receive
 	 * a genmove; we could get a non-alternating-move
 	 * error from uct_prepare_move() in that case otherwise. */
-	reset_state(u);
+	if (u->t)  reset_state(u);
 }
 
 static void
@@ -345,6 +442,7 @@ uct_done(struct engine *e)
 
 	struct uct *u = e->data;
 	uct_pondering_stop(u);
+	uct_load_wait(u);
 	if (u->t) reset_state(u);
 	if (u->dynkomi) u->dynkomi->done(u->dynkomi);
 	free(u->ownermap.map);
@@ -355,6 +453,10 @@ uct_done(struct engine *e)
 	uct_prior_done(u->prior);
 	joseki_done(u->jdict);
 	pluginset_done(u->plugins);
+	if (u->shm) uct_shm_done(u->shm);
+	if (u->poscache) uct_poscache_done(u->poscache);
+	free(u->patterns_arg);
+	free(u->checkpoint);
 }
 
 
@@ -376,14 +478,25 @@ uct_search(struct uct *u, struct board *b, struct time_info *ti, enum stone colo
 	/* Note that in case of TD_GAMES, threads will not wait for
 	 * the uct_search_check_stop() signalization. */
 	while (1) {
-		time_sleep(TREE_BUSYWAIT_INTERVAL);
+		/* With shm, exchange stats with the other processes at
+		 * each iteration, so poll more often. */
+		time_sleep(u->shm ? u->stats_delay : TREE_BUSYWAIT_INTERVAL);
 		/* TREE_BUSYWAIT_INTERVAL should never be less than desired time, or the
 		 * time control is broken. But if it happens to be less, we still search
 		 * at least 100ms otherwise the move is completely random. */
+		if (u->shm)
+			uct_shm_exchange(u, b, color);
 
 		int i = uct_search_games(&s);
 		/* Print notifications etc. */
 		uct_search_progress(u, b, color, t, ti, &s, i);
+		/* The deterministic search runs exactly the playouts
+		 * asked for; the workers stop by themselves. */
+		if (u->deterministic && ti->dim == TD_GAMES) {
+			if (uct_deterministic_finished(u))
+				break;
+			continue;
+		}
 		/* Check if we should stop the search. */
 		if (uct_search_check_stop(u, b, color, t, ti, &s, i))
 			break;
@@ -418,7 +531,7 @@ uct_search(struct uct *u, struct board *b, struct time_info *ti, enum stone colo
 		u->playout->debug_level = u->debug_after.level;
 		uct_halt = false;
 
-		uct_playouts(u, b, color, t, &debug_ti);
+		uct_playouts(u, b, color, t, &debug_ti, -1);
 		tree_dump(t, u->dumpthres);
 
 		uct_halt = true;
@@ -462,6 +575,7 @@ uct_pondering_stop(struct uct *u)
 {
 	if (!thread_manager_running)
 		return;
+	uct_analyze_stop(u);
 
 	/* Stop the thread manager. */
 	struct uct_thread_ctx *ctx = uct_search_stop();
@@ -515,6 +629,141 @@ uct_genmove_setup(struct uct *u, struct board *b, enum stone color)
 	}
 }
 
+
+/* lz-analyze: the search runs as pondering on the current position
+ * while a reporter thread streams the root candidates into the open
+ * GTP response, in the format of Leela Zero. The tree survives the
+ * play commands in between (they promote it as usual), so repeated
+ * analysis of a game never starts over. */
+
+#define ANALYZE_PV_MAX 30
+
+struct uct_analysis {
+	pthread_t thread;
+	FILE *out;
+	struct tree *t;
+	double interval;
+	volatile bool stop;
+};
+
+static struct tree_node *
+analyze_best_child(struct tree *t, struct tree_node *n)
+{
+	tree_fix_node(t, n);
+	struct tree_node *best = NULL;
+	for (struct tree_node *ni = n->children; ni; ni = ni->sibling)
+		if (ni->u.playouts > 0 && (!best || ni->u.playouts > best->u.playouts))
+			best = ni;
+	return best;
+}
+
+/* Root children with some playouts, by decreasing visits. */
+static int
+root_by_visits(struct tree *t, struct tree_node **can)
+{
+	int cans = 0;
+	for (struct tree_node *ni = t->root->children; ni; ni = ni->sibling) {
+		if (ni->u.playouts <= 0)
+			continue;
+		int i = cans++;
+		for (; i > 0 && can[i - 1]->u.playouts < ni->u.playouts; i--)
+			can[i] = can[i - 1];
+		can[i] = ni;
+	}
+	return cans;
+}
+
+static void
+uct_analyze_report(struct uct *u, struct tree *t, FILE *out)
+{
+	struct tree_node *can[board_size2(t->board) + 1];
+	int cans = root_by_visits(t, can);
+
+	for (int i = 0; i < cans; i++) {
+		struct tree_node *n = can[i];
+		fprintf(out, "%sinfo move %s visits %d winrate %d order %d pv",
+			i ? " " : "", coord2sstr(node_coord(n), t->board), n->u.playouts,
+			(int) (tree_node_get_value(t, 1, n->u.value) * 10000), i);
+		for (int d = 0; n && d < ANALYZE_PV_MAX; n = analyze_best_child(t, n), d++)
+			fprintf(out, " %s", coord2sstr(node_coord(n), t->board));
+	}
+	fputc('\n', out);
+	fflush(out);
+}
+
+static void *
+uct_analyze_thread(void *data)
+{
+	struct uct *u = data;
+	struct uct_analysis *a = u->analysis;
+	while (!a->stop) {
+		/* Sleep in short steps to stop promptly. */
+		double wake = time_now() + a->interval;
+		while (!a->stop && time_now() < wake)
+			time_sleep(0.01);
+		if (!a->stop) {
+			/* The last reader of the tree, see setup_state(). */
+			tree_read_begin(a->t, u->threads);
+			uct_analyze_report(u, a->t, a->out);
+			tree_read_end(a->t, u->threads);
+		}
+	}
+	return NULL;
+}
+
+/* Called by uct_pondering_stop() before the search is stopped. */
+static void
+uct_analyze_stop(struct uct *u)
+{
+	struct uct_analysis *a = u->analysis;
+	if (!a)
+		return;
+	a->stop = true;
+	pthread_join(a->thread, NULL);
+	/* The empty line ends the GTP response. */
+	fputc('\n', a->out);
+	fclose(a->out);
+	free(a);
+	u->analysis = NULL;
+}
+
+static void
+uct_analyze(struct engine *e, struct board *b, enum stone color, double interval)
+{
+	struct uct *u = e->data;
+	if (!interval) {
+		if (u->analysis)
+			uct_pondering_stop(u);
+		return;
+	}
+
+	uct_pondering_stop(u);
+	if (u->t && color != stone_other(u->t->root_color)) {
+		/* Analysis of the other color, the tree is of no use. */
+		u->initial_extra_komi = u->t->extra_komi;
+		reset_state(u);
+	}
+	if (!u->t)
+		uct_prepare_move(u, b, color);
+	/* Garbage collect now rather than under the reporter's feet
+	 * when the search starts. */
+	if (u->t->nodes && u->t->nodes_size >= u->t->pruning_threshold)
+		u->t->root = tree_garbage_collect(u->t, u->t->root);
+
+	struct uct_analysis *a = calloc2(1, sizeof(*a));
+	a->out = fdopen(dup(STDOUT_FILENO), "w");
+	a->t = u->t;
+	a->interval = interval;
+	u->analysis = a;
+
+	/* Like uct_pondering_start(), but on the current position. */
+	u->pondering = true;
+	struct board *bc = malloc2(sizeof(*bc)); board_copy(bc, b);
+	static struct uct_search_state s;
+	uct_search_start(u, bc, color, u->t, NULL, &s);
+	pthread_create(&a->thread, NULL, uct_analyze_thread, u);
+}
+
 static void
 uct_live_gfx_hook(struct engine *e)
 {
@@ -552,6 +801,29 @@ uct_best_moves(struct engine *e, struct board *b, enum stone color)
 	reset_state(u);
 }
 
+/* Keep the root candidates for uct_root_stats(), the tree is
+ * promoted or thrown away right after the search. */
+static void
+uct_save_root_stats(struct uct *u, struct tree *t)
+{
+	struct tree_node *can[board_size2(t->board) + 1];
+	u->root_n = root_by_visits(t, can);
+	for (int i = 0; i < u->root_n; i++) {
+		u->root_coords[i] = node_coord(can[i]);
+		u->root_visits[i] = can[i]->u.playouts;
+	}
+}
+
+static int
+uct_root_stats(struct engine *e, coord_t *coords, int *visits, int max)
+{
+	struct uct *u = e->data;
+	int n = u->root_n < max ? u->root_n : max;
+	memcpy(coords, u->root_coords, n * sizeof(*coords));
+	memcpy(visits, u->root_visits, n * sizeof(*visits));
+	return n;
+}
+
 static coord_t *
 uct_genmove(struct engine *e, struct board *b, struct time_info *ti, enum stone color, bool pass_all_alive)
 {
@@ -559,6 +831,7 @@ uct_genmove(struct engine *e, struct board *b, struct time_info *ti, enum stone
 	struct uct *u = e->data;
 	u->pass_all_alive |= pass_all_alive;
 	uct_pondering_stop(u);
+	uct_load_wait(u);
 
 	if (using_dcnn(b)) {
 		// dcnn hack: reset state to make dcnn priors kick in.
@@ -586,6 +859,9 @@ uct_genmove(struct engine *e, struct board *b, struct time_info *ti, enum stone
 	}
 
 	uct_progress_status(u, u->t, color, played_games, &best_coord);
+	uct_save_root_stats(u, u->t);
+	if (u->poscache)
+		uct_poscache_store(u->poscache, u->t, b, color, u->poscache_playouts);
 
 	if (!best) {
 		/* Pass or resign. */
@@ -640,14 +916,14 @@ uct_dumptbook(struct engine *e, struct board *b, enum stone color)
 {
 	struct uct *u = e->data;
 	struct tree *t = tree_init(b, color, u->fast_alloc ? u->max_tree_size : 0,
-			 u->max_pruned_size, u->pruning_threshold, u->local_tree_aging, 0);
-	tree_load(t, b);
+			 u->max_pruned_size, u->pruning_threshold, u->local_tree_aging, 0, 0, 0);
+	tree_load(t, b, false);
 	tree_dump(t, 0);
 	tree_done(t);
 }
 
 
-floating_t
+static floating_t
 uct_evaluate_one(struct engine *e, struct board *b, struct time_info *ti, coord_t c, enum stone color)
 {
 	struct uct *u = e->data;
@@ -678,9 +954,41 @@ uct_evaluate_one(struct engine *e, struct board *b, struct time_info *ti, coord_
 	return isnan(bestval) ? NAN : 1.0f - bestval;
 }
 
+/* Evaluate all the moves with a single search, the root children
+ * sharing the time and the threads, see uct_evaluate_focus(). */
+static void
+uct_evaluate_shared(struct uct *u, struct board *b, struct time_info *ti, floating_t *vals, enum stone color)
+{
+	if (u->t) reset_state(u);
+	uct_prepare_move(u, b, color);
+	assert(u->t);
+
+	u->evaluating = true;
+	uct_search(u, b, ti, color, u->t, true);
+	u->evaluating = false;
+
+	struct tree_node *nodes[board_size2(b)];
+	memset(nodes, 0, sizeof(nodes));
+	for (struct tree_node *ni = u->t->root->children; ni; ni = ni->sibling)
+		if (!is_pass(node_coord(ni)) && !(ni->hints & TREE_HINT_INVALID))
+			nodes[node_coord(ni)] = ni;
+	for (int i = 0; i < b->flen; i++) {
+		struct tree_node *ni = nodes[b->f[i]];
+		vals[i] = ni && ni->u.playouts ? tree_node_get_value(u->t, 1, ni->u.value) : NAN;
+	}
+
+	reset_state(u); // clean our junk
+}
+
 void
 uct_evaluate(struct engine *e, struct board *b, struct time_info *ti, floating_t *vals, enum stone color)
 {
+	struct uct *u = e->data;
+	if (!u->evaluate_separate) {
+		uct_evaluate_shared(u, b, ti, vals, color);
+		return;
+	}
+
 	for (int i = 0; i < b->flen; i++) {
 		if (is_pass(b->f[i]))
 			vals[i] = NAN;
@@ -690,11 +998,142 @@ uct_evaluate(struct engine *e, struct board *b, struct time_info *ti, floating_t
 }
 
 
+/* The caches of patterns_init() and dcnn_init() are not thread-safe,
+ * and the loaders of several engines may run at once. */
+static pthread_mutex_t patterns_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *
+uct_load_patterns(void *data)
+{
+	struct uct *u = data;
+	pthread_mutex_lock(&patterns_lock);
+	patterns_init(&u->pat, u->patterns_arg, false, true);
+	pthread_mutex_unlock(&patterns_lock);
+	return NULL;
+}
+
+#ifdef DCNN
+static pthread_mutex_t dcnn_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *
+uct_load_dcnn(void *data)
+{
+	struct uct *u = data;
+	pthread_mutex_lock(&dcnn_lock);
+	dcnn_init(&u->dcnn);
+	pthread_mutex_unlock(&dcnn_lock);
+	return NULL;
+}
+#endif
+
+static void
+uct_load(struct uct *u, void *(*load)(void *))
+{
+	if (!u->async_load || pthread_create(&u->loaders[u->loaders_n], NULL, load, u))
+		load(u);
+	else
+		u->loaders_n++;
+}
+
+/* Loading the spatial and probability dictionaries and the dcnn weights
+ * takes a while; they are loaded in parallel in the background, so that
+ * GTP is answered right away, and uct_load_wait() before their first
+ * use. The dcnn is loaded only for the board size it plays. */
+static void
+uct_load_start(struct uct *u, struct board *b)
+{
+	if (u->want_pat)
+		uct_load(u, uct_load_patterns);
+#ifdef DCNN
+	if (real_board_size(b) == 19)
+		uct_load(u, uct_load_dcnn);
+#endif
+}
+
+static void
+uct_load_wait(struct uct *u)
+{
+	while (u->loaders_n > 0)
+		pthread_join(u->loaders[--u->loaders_n], NULL);
+}
+
+/* Options for the size of @b from the presets file, NULL if none. Each
+ * line of the file is a board size followed by options for it, in the
+ * usual syntax; '#' starts a comment. */
+static char *
+uct_presets_read(const char *filename, struct board *b)
+{
+	FILE *f = fopen(filename, "r");
+	if (!f) {
+		perror(filename);
+		exit(1);
+	}
+	char *opts = NULL;
+	size_t len = 0;
+	char line[4096];
+	while (fgets(line, sizeof(line), f)) {
+		char *s = line + strspn(line, " \t");
+		if (!*s || *s == '#' || *s == '\n' || *s == '\r')
+			continue;
+		char *end;
+		int size = strtol(s, &end, 10);
+		if (end == s || size <= 0) {
+			fprintf(stderr, "%s: Invalid presets line: %s", filename, line);
+			exit(1);
+		}
+		if (size != real_board_size(b))
+			continue;
+		s = end + strspn(end, " \t");
+		s[strcspn(s, " \t\r\n#")] = 0;
+		if (!*s)
+			continue;
+		size_t n = strlen(s);
+		opts = realloc2(opts, len + n + 2);
+		if (len)
+			opts[len++] = ',';
+		memcpy(opts + len, s, n + 1);
+		len += n;
+	}
+	fclose(f);
+	return opts;
+}
+
+/* With the presets option, @arg with the presets of the board size in
+ * front, so that explicit options override them; NULL if none apply.
+ * The engine is set up again on boardsize, so each size gets its own. */
+static char *
+uct_presets_arg(char *arg, struct board *b)
+{
+	const char *filename = NULL;
+	size_t flen = 0;
+	for (const char *s = arg; s && *s; ) {
+		size_t n = strcspn(s, ",");
+		if (n > 8 && !strncasecmp(s, "presets=", 8)) {
+			filename = s + 8;
+			flen = n - 8;
+		}
+		s += n + !!s[n];
+	}
+	if (!filename)
+		return NULL;
+
+	char file[flen + 1];
+	memcpy(file, filename, flen);
+	file[flen] = 0;
+	char *opts = uct_presets_read(file, b);
+	if (!opts)
+		return NULL;
+	if (DEBUGL(2))
+		fprintf(stderr, "uct: %dx%d presets %s\n", real_board_size(b), real_board_size(b), opts);
+	opts = realloc2(opts, strlen(opts) + strlen(arg) + 2);
+	strcat(strcat(opts, ","), arg);
+	return opts;
+}
+
 struct uct *
 uct_state_init(char *arg, struct board *b)
 {
 	struct uct *u = calloc2(1, sizeof(struct uct));
-	bool pat_setup = false;
 
 	u->debug_level = debug_level;
 	u->reportfreq = 10000;
@@ -704,18 +1143,31 @@ uct_state_init(char *arg, struct board *b)
 	u->mercymin = 0;
 	u->significant_threshold = 50;
 	u->expand_p = 8;
+	u->expand_p_adapt = true;
+	u->expand_p_memstart = 50;
+	u->expand_p_pv = 2;
 	u->dumpthres = 0.01;
+	u->checkpoint_interval = 30;
+	u->checkpoint_thres = 1000;
 	u->playout_amaf = true;
 	u->amaf_prior = false;
 	u->max_tree_size = 1408ULL * 1048576;
 	u->fast_alloc = true;
 	u->pruning_threshold = 0;
+	u->undo_history = 4;
+	u->tt_symmetry = 30;
+	u->dead_min_games = 100;
+	u->dead_max_games = GJ_MINGAMES;
+	u->dcnn = (struct dcnn_setup) DCNN_SETUP_DEFAULT;
 
 	u->threads = 1;
 	u->thread_model = TM_TREEVL;
 	u->virtual_loss = 1;
+	u->leaf_playouts = 1;
 
 	u->pondering_opt = true;
+	u->ponder_focus_playouts = 2000;
+	u->evaluate_explore = 0.5;
 
 	u->fuseki_end = 20; // max time at 361*20% = 72 moves (our 36th move, still 99 to play)
 	u->yose_start = 40; // (100-40-25)*361/100/2 = 63 moves still to play by us then
@@ -723,6 +1175,8 @@ uct_state_init(char *arg, struct board *b)
 	// 2.5 is clearly too much, but seems to compensate well for overly stern time allocations.
 	// TODO: Further tuning and experiments with better time allocation schemes.
 	u->best2_ratio = 2.5;
+	u->forecast = true;
+	u->stop_margin = 0.01;
 	// Higher values of max_maintime_ratio sometimes cause severe time trouble in tournaments
 	// It might be necessary to reduce it to 1.5 on large board, but more tuning is needed.
 	u->max_maintime_ratio = 2.0;
@@ -733,6 +1187,7 @@ uct_state_init(char *arg, struct board *b)
 
 	u->tenuki_d = 4;
 	u->local_tree_aging = 80;
+	u->ltree_hbits = 20;
 	u->local_tree_depth_decay = 1.5;
 	u->local_tree_eval = LTE_ROOT;
 	u->local_tree_neival = true;
@@ -740,12 +1195,20 @@ uct_state_init(char *arg, struct board *b)
 	u->max_slaves = -1;
 	u->slave_index = -1;
 	u->stats_delay = 0.01; // 10 ms
+	u->shm_slots = 8;
+	u->poscache_size = 65536;
+	u->poscache_playouts = 20000;
+	u->async_load = true;
 	u->shared_levels = 1;
 
 	u->plugins = pluginset_init(b);
 
 	u->jdict = joseki_load(b->size);
 
+	char *preset_arg = uct_presets_arg(arg, b);
+	if (preset_arg)
+		arg = preset_arg;
+
 	if (arg) {
 		char *optspec, *next = arg;
 		while (*next) {
@@ -764,6 +1227,11 @@ uct_state_init(char *arg, struct board *b)
 					u->debug_level = atoi(optval);
 				else
 					u->debug_level++;
+			} else if (!strcasecmp(optname, "presets") && optval) {
+				/* Options per board size from this file (see
+				 * uct_presets_read()), say tree memory, expand_p,
+				 * playouts or threads tuned for each size. They
+				 * are applied before all the other options. */
 			} else if (!strcasecmp(optname, "reporting") && optval) {
 				/* The format of output for detailed progress
 				 * information (such as current best move and
@@ -788,6 +1256,11 @@ uct_state_init(char *arg, struct board *b)
 				/* The progress information line will be shown
 				 * every <reportfreq> simulations. */
 				u->reportfreq = atoi(optval);
+			} else if (!strcasecmp(optname, "perfstats")) {
+				/* Count calls and cycles in the hot paths,
+				 * see perfstats.h; process-wide. Also switched
+				 * by the pachi-perfstats GTP command. */
+				perf_enabled = !optval || atoi(optval);
 			} else if (!strcasecmp(optname, "dumpthres") && optval) {
 				/* When dumping the UCT tree on output, include
 				 * nodes with at least this many playouts.
@@ -800,6 +1273,10 @@ uct_state_init(char *arg, struct board *b)
 				/* Resign when this ratio of games is lost
 				 * after GJ_MINGAMES sample is taken. */
 				u->resign_threshold = atof(optval);
+			} else if (!strcasecmp(optname, "resign_score_quantile") && optval) {
+				/* Do not resign while this quantile of the
+				 * playout scores (0.9 say) is still a win. */
+				u->resign_score_quantile = atof(optval);
 			} else if (!strcasecmp(optname, "sure_win_threshold") && optval) {
 				/* Stop reading when this ratio of games is won
 				 * after PLAYOUT_EARLY_BREAK_MIN sample is
@@ -812,6 +1289,19 @@ uct_state_init(char *arg, struct board *b)
 			} else if (!strcasecmp(optname, "no_tbook")) {
 				/* Disable UCT opening tbook. */
 				u->no_tbook = true;
+			} else if (!strcasecmp(optname, "checkpoint") && optval) {
+				/* Save the top of the search tree to this file
+				 * periodically while searching, and start from
+				 * it when the process is restarted in the same
+				 * position (see tree_checkpoint()). */
+				u->checkpoint = strdup(optval);
+			} else if (!strcasecmp(optname, "checkpoint_interval") && optval) {
+				/* How often to save the checkpoint [s]. */
+				u->checkpoint_interval = atof(optval);
+			} else if (!strcasecmp(optname, "checkpoint_thres") && optval) {
+				/* Save children of the nodes with at least
+				 * this many playouts, like tree_save(). */
+				u->checkpoint_thres = atoi(optval);
 			} else if (!strcasecmp(optname, "pass_all_alive")) {
 				/* Whether to consider passing only after all
 				 * dead groups were removed from the board;
@@ -823,6 +1313,14 @@ uct_state_init(char *arg, struct board *b)
 				 * but losing situation, to be scored as a loss
 				 * for us. */
 				u->allow_losing_pass = !optval || atoi(optval);
+			} else if (!strcasecmp(optname, "dead_games") && optval) {
+				/* MIN:MAX playouts of the dead stones
+				 * estimation at the end of the game; it
+				 * stops at MIN already if the status of
+				 * all the groups is clear. */
+				u->dead_min_games = atoi(optval);
+				char *max = strchr(optval, ':');
+				u->dead_max_games = max ? atoi(max + 1) : u->dead_min_games;
 			} else if (!strcasecmp(optname, "territory_scoring")) {
 				/* Use territory scoring (default is area scoring).
 				 * An explicit kgs-rules command overrides this. */
@@ -867,6 +1365,10 @@ uct_state_init(char *arg, struct board *b)
 				if (pluginarg)
 					*pluginarg++ = 0;
 				plugin_load(u->plugins, optval, pluginarg);
+			} else if (!strcasecmp(optname, "plugin_batch") && optval) {
+				/* Hand the plugins exporting pachi_plugin_prior_batch
+				 * up to this many in-tree positions at once. */
+				plugin_batch_size(u->plugins, atoi(optval));
 
 			/** UCT behavior and policies */
 
@@ -904,6 +1406,8 @@ uct_state_init(char *arg, struct board *b)
 					u->playout = playout_moggy_init(playoutarg, b, u->jdict);
 				} else if (!strcasecmp(optval, "light")) {
 					u->playout = playout_light_init(playoutarg, b);
+				} else if (!strcasecmp(optval, "gamma")) {
+					u->playout = playout_gamma_init(playoutarg, b);
 				} else {
 					fprintf(stderr, "UCT: Invalid playout policy %s\n", optval);
 					exit(1);
@@ -922,6 +1426,14 @@ uct_state_init(char *arg, struct board *b)
 				 * hopeless playouts at the expense of some
 				 * accuracy. */
 				u->mercymin = atoi(optval);
+			} else if (!strcasecmp(optname, "playout_cutoff") && optval) {
+				/* Score difference (in points, against the
+				 * komi including dynkomi) to stop playout
+				 * and score it right away; the playouts also
+				 * stop when only eyes are left to fill.
+				 * Saves the end of the playouts, which is
+				 * mostly filling dame and eyes. */
+				u->playout_cutoff = atoi(optval);
 			} else if (!strcasecmp(optname, "gamelen") && optval) {
 				/* Maximum length of single simulation
 				 * in moves. */
@@ -930,6 +1442,20 @@ uct_state_init(char *arg, struct board *b)
 				/* Expand UCT nodes after it has been
 				 * visited this many times. */
 				u->expand_p = atoi(optval);
+			} else if (!strcasecmp(optname, "expand_p_adapt")) {
+				/* Raise expand_p as the tree fills up memory
+				 * and lower it on the main line; see below. */
+				u->expand_p_adapt = !optval || atoi(optval);
+			} else if (!strcasecmp(optname, "expand_p_memstart") && optval) {
+				/* Start raising expand_p once the tree takes
+				 * this many percent of max_tree_size; it doubles
+				 * with each further 1/16 filled. */
+				u->expand_p_memstart = atoi(optval);
+			} else if (!strcasecmp(optname, "expand_p_pv") && optval) {
+				/* Divide expand_p by this for children of nodes
+				 * on the principal variation (each a majority
+				 * child of its parent). */
+				u->expand_p_pv = atoi(optval);
 			} else if (!strcasecmp(optname, "random_policy_chance") && optval) {
 				/* If specified (N), with probability 1/N, random_policy policy
 				 * descend is used instead of main policy descend; useful
@@ -981,16 +1507,98 @@ uct_state_init(char *arg, struct board *b)
 					 * rages most threads choosing the
 					 * same tree branches to read. */
 					u->thread_model = TM_TREEVL;
+				} else if (!strcasecmp(optval, "root")) {
+					/* Root parallelization - each group
+					 * of threads (see root_groups) grinds
+					 * on a private tree, only the stats
+					 * of the root children are merged.
+					 * Scales better on many cores with
+					 * a slow interconnect. Each private
+					 * tree takes its share of
+					 * max_tree_size on top of the main
+					 * tree. */
+					u->thread_model = TM_ROOT;
 				} else {
 					fprintf(stderr, "UCT: Invalid thread model %s\n", optval);
 					exit(1);
 				}
+			} else if (!strcasecmp(optname, "deterministic")) {
+				/* Make the multi-threaded search reproducible:
+				 * the same position, seed (force_seed) and
+				 * number of threads give the same tree. The
+				 * threads take turns on the tree, see walk.c,
+				 * and the search runs exactly the number of
+				 * playouts of the time settings (-t =N);
+				 * no early stops. Turns pondering off.
+				 * Costs some speed. */
+				u->deterministic = !optval || atoi(optval);
+			} else if (!strcasecmp(optname, "root_groups") && optval) {
+				/* Number of thread groups with
+				 * thread_model=root; each group shares
+				 * a tree with virtual loss. Default is
+				 * one group per thread. */
+				u->root_groups = atoi(optval);
+			} else if (!strcasecmp(optname, "pin_threads") && optval) {
+				/* Pin the search threads to cpus, and
+				 * allocate the tree nodes (fast_alloc)
+				 * on the NUMA node of the expanding thread. */
+				if (!strcasecmp(optval, "none")) {
+					u->pin_threads = NUMA_PIN_NONE;
+				} else if (!strcasecmp(optval, "compact")) {
+					/* Fill the cpus of one node first. */
+					u->pin_threads = NUMA_PIN_COMPACT;
+				} else if (!strcasecmp(optval, "scatter")) {
+					/* Spread threads over all nodes. */
+					u->pin_threads = NUMA_PIN_SCATTER;
+				} else {
+					fprintf(stderr, "UCT: Invalid pin_threads %s\n", optval);
+					exit(1);
+				}
 			} else if (!strcasecmp(optname, "virtual_loss") && optval) {
 				/* Number of virtual losses added before evaluating a node. */
 				u->virtual_loss = atoi(optval);
+			} else if (!strcasecmp(optname, "leaf_playouts") && optval) {
+				/* Run this many playouts from each leaf reached
+				 * by a tree descent and back up their average
+				 * once. Saves tree traversal and contention on
+				 * the upper nodes with many threads, at the cost
+				 * of some tree precision; AMAF and criticality
+				 * come from the last playout only. */
+				u->leaf_playouts = atoi(optval);
+				if (u->leaf_playouts < 1) {
+					fprintf(stderr, "UCT: Invalid leaf_playouts %s\n", optval);
+					exit(1);
+				}
 			} else if (!strcasecmp(optname, "pondering")) {
 				/* Keep searching even during opponent's turn. */
 				u->pondering_opt = !optval || atoi(optval);
+			} else if (!strcasecmp(optname, "ponder_focus") && optval) {
+				/* When pondering, give this many of the
+				 * opponent's most searched replies workers
+				 * of their own, see walk.c. This grows the
+				 * tree we keep after the actual reply, at
+				 * the cost of the other replies. Default is
+				 * 0 (search the whole tree). */
+				u->ponder_focus = atoi(optval);
+				if (u->ponder_focus < 0) {
+					fprintf(stderr, "UCT: Invalid ponder_focus %s\n", optval);
+					exit(1);
+				}
+			} else if (!strcasecmp(optname, "ponder_focus_playouts") && optval) {
+				/* Wait for this many playouts in the root
+				 * before choosing the replies. Default 2000. */
+				u->ponder_focus_playouts = atoi(optval);
+			} else if (!strcasecmp(optname, "evaluate_separate")) {
+				/* pachi-evaluate runs a whole search after
+				 * each candidate move instead of a single
+				 * search with the time spread over the
+				 * candidates. Slower but deeper. */
+				u->evaluate_separate = !optval || atoi(optval);
+			} else if (!strcasecmp(optname, "evaluate_explore") && optval) {
+				/* Exploration coefficient of the bandit picking
+				 * the candidates of pachi-evaluate; higher
+				 * spreads the time more evenly. Default 0.5. */
+				u->evaluate_explore = atof(optval);
 			} else if (!strcasecmp(optname, "max_tree_size") && optval) {
 				/* Maximum amount of memory [MiB] consumed by the move tree.
 				 * For fast_alloc it includes the temp tree used for pruning.
@@ -1004,6 +1612,55 @@ uct_state_init(char *arg, struct board *b)
 				 * Increase to reduce pruning time overhead if memory is plentiful.
 				 * This option is meaningful only for fast_alloc. */
 				u->pruning_threshold = atol(optval) * 1048576;
+			} else if (!strcasecmp(optname, "evict") && optval) {
+				/* When the tree is full (fast_alloc), free
+				 * this many percent of max_tree_size under
+				 * the least searched nodes during the search
+				 * and reuse the memory, rather than stop
+				 * growing the tree; see tree_evict(). For
+				 * long searches in limited memory. Default
+				 * is 0 (off). */
+				u->evict = atoi(optval);
+				if (u->evict < 0 || u->evict > 50) {
+					fprintf(stderr, "UCT: evict must be 0 to 50\n");
+					exit(1);
+				}
+			} else if (!strcasecmp(optname, "lazy_children")) {
+				/* Expand nodes with compact candidates in
+				 * place of the children, which get a node of
+				 * their own only when first chosen by the
+				 * descent; see struct tree_cand. Makes the
+				 * tree several times smaller, most children
+				 * never being visited. */
+				u->lazy_children = !optval || atoi(optval);
+			} else if (!strcasecmp(optname, "undo_history") && optval) {
+				/* Keep the trees of this many previous positions,
+				 * so that undo and replaying a searched move do
+				 * not start the search over. They take memory
+				 * until the next pruning (fast_alloc) or until
+				 * they leave the history. Default is 4. */
+				u->undo_history = atoi(optval);
+				if (u->undo_history < 0 || u->undo_history > TREE_HISTORY_MAX) {
+					fprintf(stderr, "UCT: undo_history must be 0 to %d\n", TREE_HISTORY_MAX);
+					exit(1);
+				}
+			} else if (!strcasecmp(optname, "tt_hbits") && optval) {
+				/* Share statistics between transpositions (nodes reaching
+				 * the same position) through a hash table of 2^tt_hbits
+				 * entries. 0 (default) disables this. Try 20-22 for
+				 * long searches. */
+				u->tt_hbits = atoi(optval);
+				if (u->tt_hbits < 0 || u->tt_hbits > 30) {
+					fprintf(stderr, "UCT: tt_hbits must be 0 to 30\n");
+					exit(1);
+				}
+			} else if (!strcasecmp(optname, "tt_symmetry") && optval) {
+				/* Up to this move of the game, the transpositions
+				 * are found modulo the 8 board symmetries, so
+				 * that mirrored and rotated openings pool their
+				 * stats. Costs a board scan per new node. Default
+				 * is 30. */
+				u->tt_symmetry = atoi(optval);
 
 			/** Time control */
 
@@ -1012,6 +1669,25 @@ uct_state_init(char *arg, struct board *b)
 				 * first_best/second_best playouts ratio
 				 * is less than best2_ratio. */
 				u->best2_ratio = atof(optval);
+			} else if (!strcasecmp(optname, "forecast")) {
+				/* Stop early when the recent playout rate and
+				 * root visit gap say the best move will not
+				 * change anymore, and keep searching up to the
+				 * worst time when it is about to change. */
+				u->forecast = !optval || atoi(optval);
+			} else if (!strcasecmp(optname, "stop_confidence") && optval) {
+				/* Stop early when the second best move is
+				 * better than the best one by less than
+				 * stop_margin with high probability: by this
+				 * many standard errors of their values (the
+				 * test is repeated all along the search, use
+				 * 3 or more). 0 (default) disables. */
+				u->stop_confidence = atof(optval);
+			} else if (!strcasecmp(optname, "stop_margin") && optval) {
+				/* Value difference of the two best moves not
+				 * worth searching more for (see stop_confidence;
+				 * 0.01 by default). */
+				u->stop_margin = atof(optval);
 			} else if (!strcasecmp(optname, "bestr_ratio") && optval) {
 				/* If set, prolong simulating while
 				 * best,best_best_child values delta
@@ -1130,6 +1806,11 @@ uct_state_init(char *arg, struct board *b)
 					fprintf(stderr, "uct: tenuki_d must not be larger than TREE_NODE_D_MAX+1 %d\n", TREE_NODE_D_MAX + 1);
 					exit(1);
 				}
+			} else if (!strcasecmp(optname, "local_tree_hbits") && optval) {
+				/* Index the local tree nodes in a hash table of
+				 * 2^local_tree_hbits entries (default 20). 0 looks
+				 * them up in the sibling lists instead. */
+				u->ltree_hbits = atoi(optval);
 			} else if (!strcasecmp(optname, "local_tree_aging") && optval) {
 				/* How much to reduce local tree values between moves. */
 				u->local_tree_aging = atof(optval);
@@ -1195,8 +1876,47 @@ uct_state_init(char *arg, struct board *b)
 				 * it automatically in that case, but you
 				 * can use this option to tweak the pattern
 				 * parameters. */
-				patterns_init(&u->pat, optval, false, true);
-				u->want_pat = pat_setup = true;
+				free(u->patterns_arg);
+				u->patterns_arg = optval ? strdup(optval) : NULL;
+				u->want_pat = true;
+			} else if (!strcasecmp(optname, "dcnn_backend") && optval) {
+				/* Inference backend running the dcnn:
+				 * caffe (default), or onnx if compiled
+				 * in (DCNN_ONNX=1 in the Makefile). */
+				u->dcnn.backend = strdup(optval);
+			} else if (!strcasecmp(optname, "dcnn_precision") && optval) {
+				/* Evaluate the dcnn in fp32 (default), fp16
+				 * or int8, faster with some accuracy loss.
+				 * Only the onnx backend has the last two,
+				 * which need their own model files. */
+				if (!strcasecmp(optval, "fp32")) {
+					u->dcnn.precision = DCNN_FP32;
+				} else if (!strcasecmp(optval, "fp16")) {
+					u->dcnn.precision = DCNN_FP16;
+				} else if (!strcasecmp(optval, "int8")) {
+					u->dcnn.precision = DCNN_INT8;
+				} else {
+					fprintf(stderr, "UCT: Invalid dcnn_precision %s\n", optval);
+					exit(1);
+				}
+			} else if (!strcasecmp(optname, "dcnn_cache") && optval) {
+				/* Remember the dcnn results of this many
+				 * positions (and their symmetric ones),
+				 * shared by the threads and kept across
+				 * games; 0 disables. Each takes 1.5kB. */
+				u->dcnn.cache_size = atoi(optval);
+			} else if (!strcasecmp(optname, "dcnn_devices") && optval) {
+				/* Run the dcnn on this many gpus, each
+				 * batch going to the least loaded one.
+				 * Without gpu support (DCNN_GPU=1 in the
+				 * Makefile) these are copies of the network
+				 * evaluated in parallel on the cpu. */
+				u->dcnn.devices = atoi(optval);
+			} else if (!strcasecmp(optname, "dcnn_streams") && optval) {
+				/* Batches evaluated concurrently on each
+				 * device, to keep a gpu busy while the
+				 * next batch is being prepared. */
+				u->dcnn.streams = atoi(optval);
 			} else if (!strcasecmp(optname, "significant_threshold") && optval) {
 				/* Some heuristics (XXX: none in mainline) rely
 				 * on the knowledge of the last "significant"
@@ -1229,9 +1949,49 @@ uct_state_init(char *arg, struct board *b)
 				u->stats_hbits = atoi(optval);
 			} else if (!strcasecmp(optname, "stats_delay") && optval) {
 				/* How long to wait in slave for initial stats to build up before
-				 * replying to the genmoves command (in ms) */
+				 * replying to the genmoves command, and minimum interval
+				 * between replies while the master streams genmoves (in ms) */
 				u->stats_delay = 0.001 * atof(optval);
 
+			/** Sharing stats between processes on the same host */
+
+			} else if (!strcasecmp(optname, "shm") && optval) {
+				/* Share stats with the other pachi processes using the
+				 * shared memory segment of this name (e.g. /pachi), every
+				 * stats_delay. All processes must get the same gtp
+				 * commands and use the same shm_slots, shared_nodes and
+				 * shared_levels. See uct/shm.c. */
+				u->shm_name = strdup(optval);
+			} else if (!strcasecmp(optname, "shm_slots") && optval) {
+				/* Maximum number of processes sharing the segment. */
+				u->shm_slots = atoi(optval);
+
+			/** Position cache */
+
+			} else if (!strcasecmp(optname, "poscache") && optval) {
+				/* Keep the root stats of deep searches in this
+				 * file and use them as priors when the position
+				 * comes again, in this or later games. Several
+				 * processes can share the file. See uct/poscache.c. */
+				u->poscache_file = strdup(optval);
+			} else if (!strcasecmp(optname, "poscache_size") && optval) {
+				/* Number of positions in the cache file. */
+				u->poscache_size = atoi(optval);
+				if (u->poscache_size < 1) {
+					fprintf(stderr, "UCT: Invalid poscache_size %s\n", optval);
+					exit(1);
+				}
+			} else if (!strcasecmp(optname, "poscache_playouts") && optval) {
+				/* Store the searches with at least this many
+				 * playouts in the root. Default 20000. */
+				u->poscache_playouts = atoi(optval);
+			} else if (!strcasecmp(optname, "async_load")) {
+				/* Load the pattern dictionaries and the dcnn
+				 * in background threads, answering GTP in
+				 * the meantime; they are waited for at the
+				 * first move. Default on. */
+				u->async_load = !optval || atoi(optval);
+
 			/** Presets */
 
 			} else if (!strcasecmp(optname, "maximize_score")) {
@@ -1273,6 +2033,8 @@ uct_state_init(char *arg, struct board *b)
 		}
 	}
 
+	free(preset_arg);
+
 	if (!u->policy)
 		u->policy = policy_ucb1amaf_init(u, NULL, b);
 
@@ -1281,6 +2043,28 @@ uct_state_init(char *arg, struct board *b)
 		exit(1);
 	}
 
+	if (u->evict && (u->thread_model == TM_ROOT || u->slave)) {
+		fprintf(stderr, "uct: evict does not work with thread_model=root or slave\n");
+		exit(1);
+	}
+	if (u->checkpoint && u->evict) {
+		fprintf(stderr, "uct: checkpoint does not work with evict\n");
+		exit(1);
+	}
+	if (u->lazy_children && (u->thread_model == TM_ROOT || u->shm_name || u->slave)) {
+		fprintf(stderr, "uct: lazy_children does not work with thread_model=root, shm or slave\n");
+		exit(1);
+	}
+	if (u->deterministic && (u->thread_model == TM_ROOT || u->shm_name || u->slave)) {
+		fprintf(stderr, "uct: deterministic does not work with thread_model=root, shm or slave\n");
+		exit(1);
+	}
+	if (u->deterministic) {
+		/* The pondering playouts would carry over to the
+		 * next search, depending on the opponent's time. */
+		u->pondering_opt = false;
+	}
+
 	if (!u->local_tree) {
 		/* No ltree aging. */
 		u->local_tree_aging = 1.0f;
@@ -1304,27 +2088,41 @@ uct_state_init(char *arg, struct board *b)
 
 	if (!u->prior)
 		u->prior = uct_prior_init(NULL, b, u);
+	/* The pending requests would apply to evicted nodes, reused meanwhile. */
+	if (u->evict && uct_prior_async(u)) {
+		fprintf(stderr, "uct: evict does not work with dcnn_tree or batched plugins\n");
+		exit(1);
+	}
 
 	if (!u->playout)
 		u->playout = playout_moggy_init(NULL, b, u->jdict);
 	if (!u->playout->debug_level)
 		u->playout->debug_level = u->debug_level;
 
-	if (u->want_pat && !pat_setup)
-		patterns_init(&u->pat, NULL, false, true);
-	dcnn_init();
+	uct_load_start(u, b);
 
 	u->ownermap.map = malloc2(board_size2(b) * sizeof(u->ownermap.map[0]));
+	numa_setup(u->pin_threads);
 
-	if (u->slave) {
+	if (u->slave || u->shm_name) {
 		if (!u->stats_hbits) u->stats_hbits = DEFAULT_STATS_HBITS;
 		if (!u->shared_nodes) u->shared_nodes = DEFAULT_SHARED_NODES;
 		assert(u->shared_levels * board_bits2(b) <= 8 * (int)sizeof(path_t));
 	}
+	if (u->shm_name) {
+		if (u->slave) {
+			fprintf(stderr, "UCT: shm and slave are mutually exclusive\n");
+			exit(1);
+		}
+		u->shm = uct_shm_init(u->shm_name, u->shm_slots, u->shared_nodes);
+	}
+	if (u->poscache_file)
+		u->poscache = uct_poscache_init(u->poscache_file, u->poscache_size);
 
 	if (!u->dynkomi)
 		u->dynkomi = board_small(b) ? uct_dynkomi_init_none(u, NULL, b)
 			: uct_dynkomi_init_linear(u, NULL, b);
+	u->dynkomi->hist = score_hist_init(u->threads);
 
 	/* Some things remain uninitialized for now - the opening tbook
 	 * is not loaded and the tree not set up. */
@@ -1352,8 +2150,10 @@ engine_uct_init(char *arg, struct board *b)
 	e->dead_group_list = uct_dead_group_list;
 	e->stop = uct_stop;
 	e->done = uct_done;
+	e->analyze = uct_analyze;
 	e->owner_map = uct_owner_map;
 	e->best_moves = uct_best_moves;
+	e->root_stats = uct_root_stats;
 	e->live_gfx_hook = uct_live_gfx_hook;
 	e->data = u;
 	if (u->slave)
@@ -2,6 +2,7 @@
 #include <math.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,14 +11,19 @@
 
 #include "debug.h"
 #include "board.h"
+#include "logger.h"
+#include "memstats.h"
 #include "move.h"
+#include "perfstats.h"
 #include "playout.h"
 #include "probdist.h"
 #include "random.h"
 #include "tactics/util.h"
 #include "uct/dynkomi.h"
 #include "uct/internal.h"
+#include "uct/prior.h"
 #include "uct/search.h"
+#include "uct/slave.h"
 #include "uct/tree.h"
 #include "uct/uct.h"
 #include "uct/walk.h"
@@ -25,63 +31,448 @@
 
 #define DESCENT_DLEN 512
 
+/* Search threads accumulate playout final positions in a thread-local
+ * ownermap and merge it into the shared u->ownermap only every this
+ * many playouts, instead of writing the whole board to shared memory
+ * at the end of every playout. */
+#define OWNERMAP_MERGE_INTERVAL 256
+
+/* Playouts between updates of the speculative pondering replies,
+ * see uct_ponder_focus(). */
+#define PONDER_FOCUS_INTERVAL 256
+
+static __thread struct board_ownermap *thread_ownermap;
+
+/* Array storage the per-simulation board copies reuse, so that we do
+ * not malloc()/free() the whole board for every playout. Slot 0 is
+ * the descent board, slot 1 the scratch leaf board for leaf_playouts. */
+static __thread void *thread_board_storage[2];
+static __thread size_t thread_board_storage_size[2];
+/* Search thread id, -1 outside of uct_playouts(). */
+static __thread int thread_tid = -1;
+static pthread_mutex_t ownermap_merge_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Deterministic search (deterministic uct option): the workers take
+ * turns on the tree in epochs of one playout each. The descents run
+ * in worker order, then the random playouts all in parallel, then the
+ * result updates in worker order again:
+ *
+ *   turn  base + tid          descent of worker tid
+ *         base + T .. 2T - 1  playout of any worker finished
+ *         base + 2T + tid     update of worker tid
+ *
+ * with T workers and base = 3T * epoch. The tree then goes through
+ * the same states whatever the thread timing, and with the fixed
+ * per-worker RNG streams so do the playouts. */
+static pthread_mutex_t det_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t det_cond = PTHREAD_COND_INITIALIZER;
+static unsigned long det_turn;
+static int det_finished; // workers out of the search loop
+
+struct det_turns {
+	int tid, threads;
+	unsigned long base;
+};
 
 void
-uct_progress_text(struct uct *u, struct tree *t, enum stone color, int playouts)
+uct_deterministic_start(void)
+{
+	det_turn = 0;
+	det_finished = 0;
+}
+
+bool
+uct_deterministic_finished(struct uct *u)
+{
+	return __sync_fetch_and_add(&det_finished, 0) == u->threads;
+}
+
+void
+uct_deterministic_halt(void)
+{
+	pthread_mutex_lock(&det_mutex);
+	pthread_cond_broadcast(&det_cond);
+	pthread_mutex_unlock(&det_mutex);
+}
+
+/* Wait until the turn counter reaches @turn, or the search halts. */
+static void
+det_wait(unsigned long turn)
+{
+	pthread_mutex_lock(&det_mutex);
+	while (det_turn < turn && !uct_halt)
+		pthread_cond_wait(&det_cond, &det_mutex);
+	pthread_mutex_unlock(&det_mutex);
+}
+
+static void
+det_next(void)
+{
+	pthread_mutex_lock(&det_mutex);
+	det_turn++;
+	pthread_cond_broadcast(&det_cond);
+	pthread_mutex_unlock(&det_mutex);
+}
+
+
+/* Progress reports are taken in two steps: the search thread copies
+ * the few root and sequence stats needed into a snapshot, and the
+ * progress thread formats the snapshot into a buffer written out at
+ * once. Within the search, snapshots are queued (uct_progress_update())
+ * and a full queue drops them; otherwise they are printed right away,
+ * after the queued ones (uct_progress_status()). */
+
+#define PROGRESS_CANS 4
+#define PROGRESS_SEQ 4
+#define PROGRESS_QUEUE 8
+
+struct progress_move {
+	coord_t coord;
+	unsigned char x, y;
+	floating_t value;
+};
+
+struct progress_snapshot {
+	enum uct_reporting reporting;
+	enum stone color;
+	int playouts;
+	bool final;
+	struct progress_move choice; // final only
+	bool extra_komi;
+	floating_t komi;
+	bool best_found;
+	struct progress_move best;
+	/* Best sequence (text) */
+	int seq_n;
+	struct progress_move seq[PROGRESS_SEQ];
+	/* Candidates with the most playouts, first the best,
+	 * and their sequences. */
+	int can_n;
+	struct {
+		int n;
+		struct progress_move seq[PROGRESS_SEQ];
+	} can[PROGRESS_CANS];
+	/* UR_JSON_BIG */
+	bool avg;
+	floating_t avg_score;
+	int points;
+	unsigned char colors[BOARD_MAX_COORDS];
+	short territory[BOARD_MAX_COORDS];
+	bool perf;
+	struct perf_counters perf_sum;
+};
+
+static void
+progress_move(struct progress_move *m, struct tree *t, coord_t c, floating_t value)
+{
+	m->coord = c;
+	m->x = is_pass(c) || is_resign(c) ? 0 : coord_x(c, t->board);
+	m->y = is_pass(c) || is_resign(c) ? 0 : coord_y(c, t->board);
+	m->value = value;
+}
+
+/* Children of @node with the most playouts, best first. */
+static int
+progress_candidates(struct tree_node *node, struct tree_node **best, int n)
+{
+	struct tree_node *can[n];
+	memset(can, 0, sizeof(can));
+	for (struct tree_node *ni = node->children; ni; ni = ni->sibling) {
+		int c = 0;
+		while ((!can[c] || ni->u.playouts > can[c]->u.playouts) && ++c < n);
+		for (int d = 0; d < c; d++) can[d] = can[d + 1];
+		if (c > 0) can[c - 1] = ni;
+	}
+	int k = 0;
+	while (--n >= 0 && can[n])
+		best[k++] = can[n];
+	return k;
+}
+
+/* The sequence the policy would play from @node, as long as
+ * the nodes have enough playouts. */
+static int
+progress_sequence(struct uct *u, struct tree *t, enum stone color,
+		  struct tree_node *node, struct progress_move *seq)
+{
+	int n = 0;
+	for (int depth = 0; depth < PROGRESS_SEQ; depth++) {
+		if (!node || node->u.playouts < 25) break;
+		progress_move(&seq[n++], t, node_coord(node), tree_node_get_value(t, 1, node->u.value));
+		tree_fix_node(t, node);
+		node = u->policy->choose(u->policy, node, t->board, color, resign);
+	}
+	return n;
+}
+
+static void
+progress_snapshot(struct progress_snapshot *s, struct uct *u, struct tree *t,
+		  enum stone color, int playouts, coord_t *final)
 {
-	if (!UDEBUGL(0))
+	s->reporting = u->reporting;
+	s->color = color;
+	s->playouts = playouts;
+	s->final = !!final;
+	if (final)
+		progress_move(&s->choice, t, *final, 0);
+	s->extra_komi = t->use_extra_komi;
+	s->komi = t->extra_komi;
+
+	struct tree_node *best = NULL;
+	if (!final || s->reporting == UR_TEXT)
+		best = u->policy->choose(u->policy, t->root, t->board, color, resign);
+	s->best_found = !!best;
+	if (best)
+		progress_move(&s->best, t, node_coord(best), tree_node_get_value(t, 1, best->u.value));
+	s->seq_n = s->reporting == UR_TEXT ? progress_sequence(u, t, color, best, s->seq) : 0;
+
+	struct tree_node *can[PROGRESS_CANS];
+	s->can_n = progress_candidates(t->root, can, PROGRESS_CANS);
+	for (int i = 0; i < s->can_n; i++) {
+		if (s->reporting == UR_TEXT) {
+			/* Only the candidates themselves. */
+			s->can[i].n = 1;
+			progress_move(&s->can[i].seq[0], t, node_coord(can[i]),
+				      tree_node_get_value(t, 1, can[i]->u.value));
+		} else
+			s->can[i].n = progress_sequence(u, t, color, can[i], s->can[i].seq);
+	}
+
+	s->points = 0;
+	if (s->reporting == UR_JSON_BIG) {
+		s->avg = t->avg_score.playouts > 0;
+		s->avg_score = t->avg_score.value;
+		foreach_point(t->board) {
+			if (board_at(t->board, c) == S_OFFBOARD) continue;
+			s->colors[s->points] = board_at(t->board, c);
+			s->territory[s->points] = u->ownermap.map[c][S_BLACK] * 1000 / u->ownermap.playouts;
+			s->points++;
+		} foreach_point_end;
+	}
+
+	s->perf = perf_enabled && s->reporting != UR_TEXT;
+	if (s->perf)
+		perf_sum(&s->perf_sum);
+}
+
+
+/* Output buffer of a report, written out with a single fwrite(). */
+struct progress_writer {
+	char buf[16384];
+	int len;
+};
+
+static void
+pw_str(struct progress_writer *w, const char *s)
+{
+	int n = strlen(s);
+	if (n > (int) sizeof(w->buf) - w->len)
+		n = sizeof(w->buf) - w->len;
+	memcpy(w->buf + w->len, s, n);
+	w->len += n;
+}
+
+static void __attribute__((format(printf, 2, 3)))
+pw_printf(struct progress_writer *w, const char *format, ...)
+{
+	int left = sizeof(w->buf) - w->len;
+	if (left <= 1)
 		return;
+	va_list ap;
+	va_start(ap, format);
+	int n = vsnprintf(w->buf + w->len, left, format, ap);
+	va_end(ap);
+	w->len += n < left ? n : left - 1;
+}
 
-	/* Best move */
-	struct tree_node *best = u->policy->choose(u->policy, t->root, t->board, color, resign);
-	if (!best) {
-		fprintf(stderr, "... No moves left\n");
+/* Non-negative integer, the board arrays are long. */
+static void
+pw_uint(struct progress_writer *w, unsigned int v)
+{
+	char d[12];
+	int n = 0;
+	do {
+		d[n++] = '0' + v % 10;
+		v /= 10;
+	} while (v);
+	if (n > (int) sizeof(w->buf) - w->len)
+		return;
+	while (n > 0)
+		w->buf[w->len++] = d[--n];
+}
+
+/* As coord2bstr(), @buf of 5 chars. */
+static const char *
+pw_coord(const struct progress_move *m, char *buf)
+{
+	if (is_pass(m->coord))
+		return "pass";
+	if (is_resign(m->coord))
+		return "resign";
+	sprintf(buf, "%c%d", "ABCDEFGHJKLMNOPQRSTUVWXYZ"[m->x - 1], m->y);
+	return buf;
+}
+
+static void
+progress_text(struct progress_writer *w, struct progress_snapshot *s)
+{
+	char b[5];
+	if (!s->best_found) {
+		pw_str(w, "... No moves left\n");
 		return;
 	}
-	fprintf(stderr, "[%d] ", playouts);
-	fprintf(stderr, "best %f ", tree_node_get_value(t, 1, best->u.value));
+	pw_printf(w, "[%d] best %f ", s->playouts, s->best.value);
 
 	/* Dynamic komi */
-	if (t->use_extra_komi)
-		fprintf(stderr, "xkomi %.1f ", t->extra_komi);
+	if (s->extra_komi)
+		pw_printf(w, "xkomi %.1f ", s->komi);
 
 	/* Best sequence */
-	fprintf(stderr, "| seq ");
-	for (int depth = 0; depth < 4; depth++) {
-		if (best && best->u.playouts >= 25) {
-			fprintf(stderr, "%3s ", coord2sstr(node_coord(best), t->board));
-			best = u->policy->choose(u->policy, best, t->board, color, resign);
-		} else {
-			fprintf(stderr, "    ");
-		}
-	}
+	pw_str(w, "| seq ");
+	for (int depth = 0; depth < PROGRESS_SEQ; depth++)
+		if (depth < s->seq_n)
+			pw_printf(w, "%3s ", pw_coord(&s->seq[depth], b));
+		else
+			pw_str(w, "    ");
 
 	/* Best candidates */
-	fprintf(stderr, "| can %c ", color == S_BLACK ? 'b' : 'w');
-	int cans = 4;
-	struct tree_node *can[cans];
-	memset(can, 0, sizeof(can));
-	best = t->root->children;
-	while (best) {
-		int c = 0;
-		while ((!can[c] || best->u.playouts > can[c]->u.playouts) && ++c < cans);
-		for (int d = 0; d < c; d++) can[d] = can[d + 1];
-		if (c > 0) can[c - 1] = best;
-		best = best->sibling;
+	pw_printf(w, "| can %c ", s->color == S_BLACK ? 'b' : 'w');
+	for (int i = 0; i < PROGRESS_CANS; i++)
+		if (i < s->can_n)
+			pw_printf(w, "%3s(%.3f) ", pw_coord(&s->can[i].seq[0], b), s->can[i].seq[0].value);
+		else
+			pw_str(w, "           ");
+
+	pw_str(w, "\n");
+}
+
+static void
+progress_json(struct progress_writer *w, struct progress_snapshot *s)
+{
+	char b[5];
+	/* Prefix indicating JSON line. */
+	pw_printf(w, "{\"%s\": {\"playouts\": %d", s->final ? "move" : "frame", s->playouts);
+
+	/* Dynamic komi */
+	if (s->extra_komi)
+		pw_printf(w, ", \"extrakomi\": %.1f", s->komi);
+
+	if (s->final)
+		/* Final move choice */
+		pw_printf(w, ", \"choice\": \"%s\"", pw_coord(&s->choice, b));
+	else if (s->best_found)
+		/* Best move */
+		pw_printf(w, ", \"best\": {\"%s\": %f}", pw_coord(&s->best, b), s->best.value);
+
+	/* Best candidates and their sequences */
+	pw_str(w, ", \"can\": [");
+	for (int i = 0; i < s->can_n; i++) {
+		pw_str(w, i ? ", [" : "[");
+		for (int depth = 0; depth < s->can[i].n; depth++)
+			pw_printf(w, "%s{\"%s\":%.3f}", depth > 0 ? "," : "",
+				  pw_coord(&s->can[i].seq[depth], b), s->can[i].seq[depth].value);
+		pw_str(w, "]");
 	}
-	while (--cans >= 0) {
-		if (can[cans]) {
-			fprintf(stderr, "%3s(%.3f) ",
-			        coord2sstr(node_coord(can[cans]), t->board),
-				tree_node_get_value(t, 1, can[cans]->u.value));
-		} else {
-			fprintf(stderr, "           ");
+	pw_str(w, "]");
+
+	if (s->reporting == UR_JSON_BIG) {
+		/* Average score. */
+		if (s->avg)
+			pw_printf(w, ", \"avg\": {\"score\": %.3f}", s->avg_score);
+		/* Per-intersection information: position coloring, and
+		 * ownership statistics. Value (0..1000) for each possible
+		 * point describes likelihood of this point becoming black.
+		 * Normally, white rate is 1000-value; exception are possible
+		 * seki points, but these should be rare. */
+		pw_str(w, ", \"boards\": {\"colors\": [");
+		for (int i = 0; i < s->points; i++) {
+			if (i) pw_str(w, ",");
+			pw_uint(w, s->colors[i]);
+		}
+		pw_str(w, "], \"territory\": [");
+		for (int i = 0; i < s->points; i++) {
+			if (i) pw_str(w, ",");
+			pw_uint(w, s->territory[i]);
 		}
+		pw_str(w, "]}");
+	}
+
+	if (s->perf) {
+		/* As perf_json(). */
+		pw_str(w, ", \"perf\": {");
+		for (int p = 0; p < PERF_MAX; p++)
+			pw_printf(w, "%s\"%s\": {\"calls\": %llu, \"hits\": %llu, \"ticks\": %llu}", p ? ", " : "",
+				  perf_probe_names[p], (unsigned long long) s->perf_sum.count[p],
+				  (unsigned long long) s->perf_sum.hits[p],
+				  (unsigned long long) s->perf_sum.ticks[p]);
+		pw_str(w, "}");
 	}
 
-	fprintf(stderr, "\n");
+	pw_str(w, "}}\n");
+}
+
+static void
+progress_print(struct progress_snapshot *s)
+{
+	struct progress_writer w;
+	w.len = 0;
+	if (s->reporting == UR_TEXT)
+		progress_text(&w, s);
+	else
+		progress_json(&w, s);
+	fwrite(w.buf, 1, w.len, stderr);
+}
+
+
+static struct progress_snapshot progress_queue[PROGRESS_QUEUE];
+static int progress_head, progress_tail; // queued: tail..head-1
+static pthread_mutex_t progress_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t progress_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t progress_once = PTHREAD_ONCE_INIT;
+
+static void * __attribute__((noreturn))
+progress_thread(void *data)
+{
+	pthread_mutex_lock(&progress_mutex);
+	while (1) {
+		while (progress_tail == progress_head)
+			pthread_cond_wait(&progress_cond, &progress_mutex);
+		/* The slot is not reused before we move the tail. */
+		struct progress_snapshot *s = &progress_queue[progress_tail % PROGRESS_QUEUE];
+		pthread_mutex_unlock(&progress_mutex);
+		progress_print(s);
+		pthread_mutex_lock(&progress_mutex);
+		progress_tail++;
+		pthread_cond_broadcast(&progress_cond);
+	}
+}
+
+static void
+progress_thread_start(void)
+{
+	pthread_t thread;
+	pthread_create(&thread, NULL, progress_thread, NULL);
+	pthread_detach(thread);
+}
+
+/* Wait until the queued reports are written out. */
+static void
+progress_flush(void)
+{
+	pthread_mutex_lock(&progress_mutex);
+	while (progress_tail != progress_head)
+		pthread_cond_wait(&progress_cond, &progress_mutex);
+	pthread_mutex_unlock(&progress_mutex);
+}
+
+static bool
+progress_wanted(struct uct *u)
+{
+	/* The text reports are debugging output. */
+	return u->reporting != UR_TEXT || UDEBUGL(0);
 }
 
+
 /* Live gfx: show best sequence in GoGui */
 static void
 uct_progress_gogui_sequence(struct uct *u, struct tree *t, enum stone color, int playouts)
@@ -100,6 +491,7 @@ uct_progress_gogui_sequence(struct uct *u, struct tree *t, enum stone color, int
 			fprintf(stderr, "%c %3s ", 
 				col[(depth + (color == S_WHITE)) % 2],
 				coord2sstr(node_coord(best), t->board));
+			tree_fix_node(t, best);
 			best = u->policy->choose(u->policy, best, t->board, color, resign);
 		}
 	}
@@ -188,109 +580,9 @@ uct_progress_gogui_winrates(struct uct *u, struct tree *t, enum stone color, int
 	fprintf(stderr, "\n");	
 }
 
-void
-uct_progress_json(struct uct *u, struct tree *t, enum stone color, int playouts, coord_t *final, bool big)
-{
-	/* Prefix indicating JSON line. */
-	fprintf(stderr, "{\"%s\": {", final ? "move" : "frame");
-
-	/* Plaout count */
-	fprintf(stderr, "\"playouts\": %d", playouts);
-
-	/* Dynamic komi */
-	if (t->use_extra_komi)
-		fprintf(stderr, ", \"extrakomi\": %.1f", t->extra_komi);
-
-	if (final) {
-		/* Final move choice */
-		fprintf(stderr, ", \"choice\": \"%s\"",
-			coord2sstr(*final, t->board));
-	} else {
-		struct tree_node *best = u->policy->choose(u->policy, t->root, t->board, color, resign);
-		if (best) {
-			/* Best move */
-			fprintf(stderr, ", \"best\": {\"%s\": %f}",
-				coord2sstr(best->coord, t->board),
-				tree_node_get_value(t, 1, best->u.value));
-		}
-	}
-
-	/* Best candidates */
-	int cans = 4;
-	struct tree_node *can[cans];
-	memset(can, 0, sizeof(can));
-	struct tree_node *best = t->root->children;
-	while (best) {
-		int c = 0;
-		while ((!can[c] || best->u.playouts > can[c]->u.playouts) && ++c < cans);
-		for (int d = 0; d < c; d++) can[d] = can[d + 1];
-		if (c > 0) can[c - 1] = best;
-		best = best->sibling;
-	}
-	fprintf(stderr, ", \"can\": [");
-	while (--cans >= 0) {
-		if (!can[cans]) break;
-		/* Best sequence */
-		fprintf(stderr, "%s[", cans < 3 ? ", " : "");
-		best = can[cans];
-		for (int depth = 0; depth < 4; depth++) {
-			if (!best || best->u.playouts < 25) break;
-			fprintf(stderr, "%s{\"%s\":%.3f}", depth > 0 ? "," : "",
-				coord2sstr(best->coord, t->board),
-				tree_node_get_value(t, 1, best->u.value));
-			best = u->policy->choose(u->policy, best, t->board, color, resign);
-		}
-		fprintf(stderr, "]");
-	}
-	fprintf(stderr, "]");
-
-	if (big) {
-		/* Average score. */
-		if (t->avg_score.playouts > 0)
-			fprintf(stderr, ", \"avg\": {\"score\": %.3f}", t->avg_score.value);
-		/* Per-intersection information. */
-		fprintf(stderr, ", \"boards\": {");
-		/* Position coloring information. */
-		fprintf(stderr, "\"colors\": [");
-		int f = 0;
-		foreach_point(t->board) {
-			if (board_at(t->board, c) == S_OFFBOARD) continue;
-			fprintf(stderr, "%s%d", f++ > 0 ? "," : "", board_at(t->board, c));
-		} foreach_point_end;
-		fprintf(stderr, "]");
-		/* Ownership statistics. Value (0..1000) for each possible
-		 * point describes likelihood of this point becoming black.
-		 * Normally, white rate is 1000-value; exception are possible
-		 * seki points, but these should be rare. */
-		fprintf(stderr, ", \"territory\": [");
-		f = 0;
-		foreach_point(t->board) {
-			if (board_at(t->board, c) == S_OFFBOARD) continue;
-			int rate = u->ownermap.map[c][S_BLACK] * 1000 / u->ownermap.playouts;
-			fprintf(stderr, "%s%d", f++ > 0 ? "," : "", rate);
-		} foreach_point_end;
-		fprintf(stderr, "]");
-		fprintf(stderr, "}");
-	}
-
-	fprintf(stderr, "}}\n");
-}
-
-void
-uct_progress_status(struct uct *u, struct tree *t, enum stone color, int playouts, coord_t *final)
+static void
+uct_progress_gogui(struct uct *u, struct tree *t, enum stone color, int playouts)
 {
-	switch (u->reporting) {
-		case UR_TEXT:
-			uct_progress_text(u, t, color, playouts);
-			break;
-		case UR_JSON:
-		case UR_JSON_BIG:
-			uct_progress_json(u, t, color, playouts, final,
-			                  u->reporting == UR_JSON_BIG);
-			break;
-		default: assert(0);
-	}
-
 	if (!gogui_live_gfx)
 		return;
 	switch(gogui_live_gfx) {
@@ -307,6 +599,35 @@ uct_progress_status(struct uct *u, struct tree *t, enum stone color, int playout
 	}
 }
 
+void
+uct_progress_status(struct uct *u, struct tree *t, enum stone color, int playouts, coord_t *final)
+{
+	if (progress_wanted(u)) {
+		struct progress_snapshot s;
+		progress_snapshot(&s, u, t, color, playouts, final);
+		progress_flush();
+		progress_print(&s);
+	}
+	uct_progress_gogui(u, t, color, playouts);
+}
+
+void
+uct_progress_update(struct uct *u, struct tree *t, enum stone color, int playouts)
+{
+	if (progress_wanted(u)) {
+		struct progress_snapshot s;
+		progress_snapshot(&s, u, t, color, playouts, NULL);
+		pthread_once(&progress_once, progress_thread_start);
+		pthread_mutex_lock(&progress_mutex);
+		if (progress_head - progress_tail < PROGRESS_QUEUE) {
+			progress_queue[progress_head++ % PROGRESS_QUEUE] = s;
+			pthread_cond_broadcast(&progress_cond);
+		}
+		pthread_mutex_unlock(&progress_mutex);
+	}
+	uct_progress_gogui(u, t, color, playouts);
+}
+
 static inline void
 record_amaf_move(struct playout_amafmap *amaf, coord_t coord, bool is_ko_capture)
 {
@@ -343,6 +664,30 @@ uct_playout_postpolicy(struct playout_policy *playout, struct playout_setup *set
 }
 
 
+static void
+thread_board_copy(struct board *b2, struct board *b, int slot)
+{
+	size_t storage_size = board_storage_size(b);
+	if (storage_size > thread_board_storage_size[slot]) {
+		thread_board_storage[slot] = realloc2(thread_board_storage[slot], storage_size);
+		mem_account(MEM_BOARD, storage_size - thread_board_storage_size[slot]);
+		thread_board_storage_size[slot] = storage_size;
+	}
+	board_copy_to(b2, b, thread_board_storage[slot]);
+}
+
+/* The storage would leak when the search thread exits. */
+static void
+thread_board_storage_free(void)
+{
+	for (int slot = 0; slot < 2; slot++) {
+		free(thread_board_storage[slot]);
+		mem_account(MEM_BOARD, -(long long) thread_board_storage_size[slot]);
+		thread_board_storage[slot] = NULL;
+		thread_board_storage_size[slot] = 0;
+	}
+}
+
 static int
 uct_leaf_node(struct uct *u, struct board *b, enum stone player_color,
               struct playout_amafmap *amaf,
@@ -355,7 +700,7 @@ uct_leaf_node(struct uct *u, struct board *b, enum stone player_color,
 	int parity = (next_color == player_color ? 1 : -1);
 
 	if (UDEBUGL(7))
-		fprintf(stderr, "%s*-- UCT playout #%d start [%s] %f\n",
+		log_printf(7, "%s*-- UCT playout #%d start [%s] %f\n",
 			spaces, n->u.playouts, coord2sstr(node_coord(n), t->board),
 			tree_node_get_value(t, -parity, n->u.value));
 
@@ -370,24 +715,46 @@ uct_leaf_node(struct uct *u, struct board *b, enum stone player_color,
 	struct playout_setup ps = {
 		.gamelen = u->gamelen,
 		.mercymin = u->mercymin,
+		.cutoff = u->playout_cutoff,
+		/* Pondering yields to the search of another game
+		 * (server mode) or our own genmove as soon as asked. */
+		.halt = u->pondering ? &uct_halt : NULL,
 		.prepolicy_hook = uct_playout_prepolicy,
 		.postpolicy_hook = uct_playout_postpolicy,
 		.hook_data = &upc,
 	};
 	int result = play_random_game(&ps, b, next_color,
 	                              u->playout_amaf ? amaf : NULL,
-				      &u->ownermap, u->playout);
+				      thread_ownermap ? thread_ownermap : &u->ownermap,
+				      u->playout);
 	if (next_color == S_WHITE) {
 		/* We need the result from black's perspective. */
 		result = - result;
 	}
 	if (UDEBUGL(7))
-		fprintf(stderr, "%s -- [%d..%d] %s random playout result %d\n",
+		log_printf(7, "%s -- [%d..%d] %s random playout result %d\n",
 		        spaces, player_color, next_color, coord2sstr(node_coord(n), t->board), result);
 
 	return result;
 }
 
+/* The first @n playouts of the leaf at once, for policies with a
+ * batch routine; @b is left untouched. Results as uct_leaf_node(). */
+static void
+uct_leaf_batch(struct uct *u, struct board *b, enum stone node_color, int n, int *results)
+{
+	enum stone next_color = stone_other(node_color);
+	struct playout_setup ps = {
+		.gamelen = u->gamelen,
+		.mercymin = u->mercymin,
+	};
+	u->playout->batch(u->playout, &ps, b, next_color, n, results,
+			  thread_ownermap ? thread_ownermap : &u->ownermap);
+	if (next_color == S_WHITE)
+		for (int i = 0; i < n; i++)
+			results[i] = - results[i];
+}
+
 static floating_t
 scale_value(struct uct *u, struct board *b, enum stone node_color, struct tree_node *significant[2], int result)
 {
@@ -424,6 +791,21 @@ scale_value(struct uct *u, struct board *b, enum stone node_color, struct tree_n
 	return rval;
 }
 
+/* Value of a playout result, accounted in the running averages. */
+static floating_t
+record_result(struct uct *u, struct board *b, struct tree *t, enum stone node_color,
+	      struct tree_node *significant[2], int result)
+{
+	floating_t r = scale_value(u, b, node_color, significant, result);
+	stats_add_result(&t->avg_score, result / 2, 1);
+	score_hist_add(u->dynkomi->hist, thread_tid, result);
+	if (t->use_extra_komi) {
+		stats_add_result(&u->dynkomi->score, result / 2, 1);
+		stats_add_result(&u->dynkomi->value, r, 1);
+	}
+	return r;
+}
+
 static double
 local_value(struct uct *u, struct board *b, coord_t coord, enum stone color)
 {
@@ -448,7 +830,7 @@ record_local_sequence(struct uct *u, struct tree *t, struct board *endb,
 		return;
 
 	LTREE_DEBUG board_print(endb, stderr);
-	LTREE_DEBUG fprintf(stderr, "recording local %s sequence: ",
+	LTREE_DEBUG log_printf(6, "recording local %s sequence: ",
 		stone2str(seq_color));
 
 	/* Sequences starting deeper are less relevant in general. */
@@ -456,7 +838,7 @@ record_local_sequence(struct uct *u, struct tree *t, struct board *endb,
 	if (u->local_tree && u->local_tree_depth_decay > 0)
 		pval = ((floating_t) pval) / pow(u->local_tree_depth_decay, di - 1);
 	if (!pval) {
-		LTREE_DEBUG fprintf(stderr, "too deep @%d\n", di);
+		LTREE_DEBUG log_printf(6, "too deep @%d\n", di);
 		return;
 	}
 
@@ -468,7 +850,7 @@ record_local_sequence(struct uct *u, struct tree *t, struct board *endb,
 	double sval = 0.5;
 	if (u->local_tree_eval != LTE_EACH) {
 		sval = local_value(u, endb, node_coord(descent[di].node), seq_color);
-		LTREE_DEBUG fprintf(stderr, "(goal %s[%s %1.3f][%d]) ",
+		LTREE_DEBUG log_printf(6, "(goal %s[%s %1.3f][%d]) ",
 			coord2sstr(node_coord(descent[di].node), t->board),
 			stone2str(seq_color), sval, descent[di].node->d);
 
@@ -497,10 +879,10 @@ record_local_sequence(struct uct *u, struct tree *t, struct board *endb,
 			rval = sval;
 		else
 			rval = local_value(u, endb, node_coord(descent[di].node), color);
-		LTREE_DEBUG fprintf(stderr, "%s[%s %1.3f][%d] ",
+		LTREE_DEBUG log_printf(6, "%s[%s %1.3f][%d] ",
 			coord2sstr(node_coord(descent[di].node), t->board),
 			stone2str(color), rval, descent[di].node->d);
-		lnode = tree_get_node(t, lnode, node_coord(descent[di++].node), true);
+		lnode = tree_get_lnode(t, lnode, node_coord(descent[di++].node));
 		assert(lnode);
 		stats_add_result(&lnode->u, rval, pval);
 	}
@@ -508,24 +890,55 @@ record_local_sequence(struct uct *u, struct tree *t, struct board *endb,
 	/* Add lnode for tenuki (pass) if we descended further. */
 	if (di < dlen) {
 		double rval = u->local_tree_eval != LTE_EACH ? sval : 0.5;
-		LTREE_DEBUG fprintf(stderr, "pass ");
-		lnode = tree_get_node(t, lnode, pass, true);
+		LTREE_DEBUG log_printf(6, "pass ");
+		lnode = tree_get_lnode(t, lnode, pass);
 		assert(lnode);
 		stats_add_result(&lnode->u, rval, pval);
 	}
 	
-	LTREE_DEBUG fprintf(stderr, "\n");
+	LTREE_DEBUG log_printf(6, "\n");
 }
 
 
-int
-uct_playout(struct uct *u, struct board *b, enum stone player_color, struct tree *t)
+/* Number of visits after which a node is expanded. */
+static inline int
+uct_expand_threshold(struct uct *u, struct tree *t, bool on_pv)
+{
+	int expand_p = u->expand_p;
+	if (!u->expand_p_adapt)
+		return expand_p;
+
+	/* Rather than running into the memory limit, slow the growth of
+	 * the tree down more and more as it fills up. */
+	unsigned long start = u->max_tree_size / 100 * u->expand_p_memstart;
+	if (t->nodes_size > start) {
+		unsigned long shift = (t->nodes_size - start) * 16 / u->max_tree_size;
+		expand_p <<= shift < 16 ? shift : 16;
+	}
+	/* But keep growing the main line. */
+	if (on_pv && u->expand_p_pv > 1) {
+		expand_p /= u->expand_p_pv;
+		if (expand_p < 1)
+			expand_p = 1;
+	}
+	return expand_p;
+}
+
+/* With @det, called on the descent turn, see struct det_turns.
+ * A @focus child of the root is descended to in place of the
+ * policy's choice. */
+static int
+uct_playout_(struct uct *u, struct board *b, enum stone player_color, struct tree *t,
+	     struct det_turns *det, struct tree_node *focus)
 {
 	struct board b2;
-	board_copy(&b2, b);
+	thread_board_copy(&b2, b, 0);
 
 	struct playout_amafmap amaf;
 	amaf.gamelen = amaf.game_baselen = 0;
+	/* The deterministic search leaves the tree alone during the
+	 * playouts, the results are accounted on the update turn. */
+	int results[u->leaf_playouts];
 
 	/* Walk the tree until we find a leaf, then expand it and do
 	 * a random playout. */
@@ -534,8 +947,11 @@ uct_playout(struct uct *u, struct board *b, enum stone player_color, struct tree
 	assert(node_color == t->root_color);
 
 	/* Make sure the root node is expanded. */
-	if (tree_leaf_node(n) && !__sync_lock_test_and_set(&n->is_expanded, 1))
+	if (tree_leaf_node(n)) {
+		uint64_t pt = perf_start();
 		tree_expand_node(t, n, &b2, player_color, u, 1);
+		perf_stop(PERF_EXPAND, pt);
+	}
 
 	/* Tree descent history. */
 	/* XXX: This is somewhat messy since @n and descent[dlen-1].node are
@@ -552,7 +968,11 @@ uct_playout(struct uct *u, struct board *b, enum stone player_color, struct tree
 	if (n->u.playouts >= u->significant_threshold)
 		significant[node_color - 1] = n;
 
-	int result;
+	/* Whether all nodes of the descent so far are majority children
+	 * of their parents, i.e. on the principal variation. */
+	bool on_pv = true;
+
+	int result = 0;
 	int pass_limit = (board_size(&b2) - 2) * (board_size(&b2) - 2) / 2;
 	int passes = is_pass(b->last_move.coord) && b->moves > 0;
 
@@ -560,8 +980,9 @@ uct_playout(struct uct *u, struct board *b, enum stone player_color, struct tree
 	static char spaces[] = "\0                                                      ";
 	/* /debug */
 	if (UDEBUGL(8))
-		fprintf(stderr, "--- (#%d) UCT walk with color %d\n", t->root->u.playouts, player_color);
+		log_printf(8, "--- (#%d) UCT walk with color %d\n", t->root->u.playouts, player_color);
 
+	uint64_t pt = perf_start();
 	while (!tree_leaf_node(n) && passes < 2) {
 		spaces[dlen - 1] = ' '; spaces[dlen] = 0;
 
@@ -582,7 +1003,10 @@ uct_playout(struct uct *u, struct board *b, enum stone player_color, struct tree
 			descent[dlen].lnode = node_color == S_BLACK ? t->ltree_black : t->ltree_white;
 		}
 
-		if (!u->random_policy_chance || fast_random(u->random_policy_chance))
+		tree_fix_node(t, descent[dlen].node);
+		if (focus && dlen == 1)
+			descent[dlen] = (struct uct_descent) { .node = focus };
+		else if (!u->random_policy_chance || fast_random(u->random_policy_chance))
 			u->policy->descend(u->policy, t, &descent[dlen], parity, b2.moves > pass_limit);
 		else
 			u->random_policy->descend(u->random_policy, t, &descent[dlen], parity, b2.moves > pass_limit);
@@ -599,7 +1023,7 @@ uct_playout(struct uct *u, struct board *b, enum stone player_color, struct tree
 		n = descent[dlen++].node;
 		assert(n == t->root || n->parent);
 		if (UDEBUGL(7))
-			fprintf(stderr, "%s+-- UCT sent us to [%s:%d] %d,%f\n",
+			log_printf(7, "%s+-- UCT sent us to [%s:%d] %d,%f\n",
 			        spaces, coord2sstr(node_coord(n), t->board),
 				node_coord(n), n->u.playouts,
 				tree_node_get_value(t, parity, n->u.value));
@@ -614,43 +1038,68 @@ uct_playout(struct uct *u, struct board *b, enum stone player_color, struct tree
 		    || b2.superko_violation) {
 			if (UDEBUGL(4)) {
 				for (struct tree_node *ni = n; ni; ni = ni->parent)
-					fprintf(stderr, "%s<%"PRIhash"> ", coord2sstr(node_coord(ni), t->board), ni->hash);
-				fprintf(stderr, "marking invalid %s node %d,%d res %d group %d spk %d\n",
+					log_printf(4, "%s<%"PRIhash"> ", coord2sstr(node_coord(ni), t->board), ni->hash);
+				log_printf(4, "marking invalid %s node %d,%d res %d group %d spk %d\n",
 				        stone2str(node_color), coord_x(node_coord(n),b), coord_y(node_coord(n),b),
 					res, group_at(&b2, m.coord), b2.superko_violation);
 			}
-			n->hints |= TREE_HINT_INVALID;
+			__sync_fetch_and_or(&n->hints, TREE_HINT_INVALID);
+			perf_stop(PERF_DESCENT, pt);
 			result = 0;
+			if (det) {
+				det_next();
+				det_wait(det->base + det->threads);
+				det_next();
+				det_wait(det->base + 2 * det->threads + det->tid);
+			}
 			goto end;
 		}
 
 		assert(node_coord(n) >= -1);
 		record_amaf_move(&amaf, node_coord(n), board_playing_ko_threat(&b2));
 
+		if (t->ttable && !n->hash) {
+			/* In the opening, mirrored and rotated lines are
+			 * common: key them by the canonical position. */
+			hash_t bhash = b2.moves <= u->tt_symmetry ? board_canonical_hash(&b2, NULL) : b2.hash;
+			hash_t key = tree_tt_key(bhash, node_color);
+			if (tree_tt_get(t, key, true))
+				n->hash = key;
+		}
+
 		if (is_pass(node_coord(n)))
 			passes++;
 		else
 			passes = 0;
 
 		enum stone next_color = stone_other(node_color);
-		/* We need to make sure only one thread expands the node. If
-		 * we are unlucky enough for two threads to meet in the same
-		 * node, the latter one will simply do another simulation from
-		 * the node itself, no big deal. t->nodes_size may exceed
-		 * the maximum in multi-threaded case but not by much so it's ok.
-		 * The size test must be before the test&set not after, to allow
-		 * expansion of the node later if enough nodes have been freed. */
+		/* If two threads meet in the same leaf, both expand it and
+		 * only the first one publishing its children wins; the other
+		 * gives its block back to the allocator. Either way both
+		 * go on descending, nobody waits for the other. t->nodes_size
+		 * may exceed the maximum in multi-threaded case but not by
+		 * much so it's ok. */
+		if (u->evict && tree_leaf_node(n) && (t->nodes_full || t->nodes_size >= u->max_tree_size))
+			tree_evict(t, u->max_tree_size / 100 * u->evict);
 		if (tree_leaf_node(n)
-		    && n->u.playouts - u->virtual_loss >= u->expand_p && t->nodes_size < u->max_tree_size
-		    && !__sync_lock_test_and_set(&n->is_expanded, 1))
+		    && n->u.playouts - u->virtual_loss >= uct_expand_threshold(u, t, on_pv)
+		    && t->nodes_size < u->max_tree_size) {
+			uint64_t et = perf_start();
 			tree_expand_node(t, n, &b2, next_color, u, -parity);
+			perf_stop(PERF_EXPAND, et);
+		} else if (n->hints & TREE_HINT_LAZY_PRIOR)
+			uct_prior_lazy(u, t, n, &b2, next_color, -parity);
+		on_pv = on_pv && n->u.playouts * 2 >= n->parent->u.playouts;
 	}
+	perf_stop(PERF_DESCENT, pt);
 
 	amaf.game_baselen = amaf.gamelen;
 
 	if (t->use_extra_komi && u->dynkomi->persim) {
 		b2.komi += round(u->dynkomi->persim(u->dynkomi, &b2, t, n));
 	}
+	if (det)
+		det_next();
 
 	/* !!! !!! !!!
 	 * ALERT: The "result" number is extremely confusing. In some parts
@@ -661,7 +1110,49 @@ uct_playout(struct uct *u, struct board *b, enum stone player_color, struct tree
 	// assert(tree_leaf_node(n));
 	/* In case of parallel tree search, the assertion might
 	 * not hold if two threads chew on the same node. */
-	result = uct_leaf_node(u, &b2, player_color, &amaf, descent, &dlen, significant, t, n, node_color, spaces);
+	/* With leaf_playouts, all but the last playout run on a scratch
+	 * copy of the leaf, or together if the policy can batch them;
+	 * the last one runs on b2 itself so that it holds the final
+	 * position for the updates below. */
+	floating_t rval = 0;
+	int batched = 0, played = 0;
+	if (u->leaf_playouts > 1 && u->playout->batch) {
+		batched = u->leaf_playouts - 1;
+		uct_leaf_batch(u, &b2, node_color, batched, results);
+		for (int i = 0; !det && i < batched; i++, played++)
+			rval += record_result(u, b, t, node_color, significant, results[i]);
+	}
+	for (int i = batched; i < u->leaf_playouts; i++) {
+		struct board b3, *bp = &b2;
+		if (i < u->leaf_playouts - 1) {
+			thread_board_copy(&b3, &b2, 1);
+			bp = &b3;
+		}
+		amaf.gamelen = amaf.game_baselen;
+		result = uct_leaf_node(u, bp, player_color, &amaf, descent, &dlen, significant, t, n, node_color, spaces);
+		if (bp == &b3 && b3.ps) free(b3.ps);
+		if (u->pondering && uct_halt && !det) {
+			/* Cut short, throw it away; the playouts already
+			 * recorded still go to the transposition table. */
+			result = 0;
+			if (t->ttable && played)
+				tree_tt_update(t, n, rval / played, played);
+			goto end;
+		}
+		results[i] = result;
+		if (!det) {
+			rval += record_result(u, b, t, node_color, significant, result);
+			played++;
+		}
+	}
+	if (det) {
+		det_wait(det->base + det->threads);
+		det_next();
+		det_wait(det->base + 2 * det->threads + det->tid);
+		for (int i = 0; i < u->leaf_playouts; i++, played++)
+			rval += record_result(u, b, t, node_color, significant, results[i]);
+	}
+	rval /= played;
 
 	if (u->policy->wants_amaf && u->playout_amaf_cutoff) {
 		unsigned int cutoff = amaf.game_baselen;
@@ -671,15 +1162,13 @@ uct_playout(struct uct *u, struct board *b, enum stone player_color, struct tree
 
 	/* Record the result. */
 
+	pt = perf_start();
 	assert(n == t->root || n->parent);
-	floating_t rval = scale_value(u, b, node_color, significant, result);
-	u->policy->update(u->policy, t, n, node_color, player_color, &amaf, &b2, rval);
-
-	stats_add_result(&t->avg_score, result / 2, 1);
-	if (t->use_extra_komi) {
-		stats_add_result(&u->dynkomi->score, result / 2, 1);
-		stats_add_result(&u->dynkomi->value, rval, 1);
-	}
+	u->policy->update(u->policy, t, n, node_color, player_color, &amaf, &b2, rval, u->leaf_playouts);
+	if (t->dirty)
+		uct_dirty_record(t, thread_tid, descent, dlen);
+	if (t->ttable && played)
+		tree_tt_update(t, n, rval, played);
 
 	if (u->local_tree && n->parent && !is_pass(node_coord(n)) && dlen > 0) {
 		/* Get the local sequences and record them in ltree. */
@@ -710,6 +1199,7 @@ uct_playout(struct uct *u, struct board *b, enum stone player_color, struct tree
 			}
 		}
 	}
+	perf_stop(PERF_BACKPROP, pt);
 
 end:
 	/* We need to undo the virtual loss we added during descend. */
@@ -719,20 +1209,150 @@ end:
 		}
 	}
 
-	board_done_noalloc(&b2);
+	if (det)
+		det_next();
+
+	if (b2.ps) free(b2.ps);
 	return result;
 }
 
 int
-uct_playouts(struct uct *u, struct board *b, enum stone color, struct tree *t, struct time_info *ti)
+uct_playout(struct uct *u, struct board *b, enum stone player_color, struct tree *t)
+{
+	return uct_playout_(u, b, player_color, t, NULL, NULL);
+}
+
+static void
+uct_ownermap_merge(struct uct *u, struct board *b, struct board_ownermap *ownermap)
+{
+	pthread_mutex_lock(&ownermap_merge_mutex);
+	board_ownermap_merge(board_size2(b), &u->ownermap, ownermap);
+	pthread_mutex_unlock(&ownermap_merge_mutex);
+	ownermap->playouts = 0;
+	memset(ownermap->map, 0, board_size2(b) * sizeof(ownermap->map[0]));
+}
+
+void
+uct_ownermap_copy(struct uct *u, struct board *b, struct board_ownermap *dst)
+{
+	pthread_mutex_lock(&ownermap_merge_mutex);
+	dst->playouts = u->ownermap.playouts;
+	memcpy(dst->map, u->ownermap.map, board_size2(b) * sizeof(dst->map[0]));
+	pthread_mutex_unlock(&ownermap_merge_mutex);
+}
+
+/* Speculative pondering (ponder_focus uct option): once the root has
+ * ponder_focus_playouts, the opponent's most searched replies get
+ * workers of their own, so that the tree kept after the actual reply
+ * is as large as possible. With more threads than replies, thread
+ * groups (tid modulo replies + 1) stick to the reply, group 0 searches
+ * as usual; otherwise the workers go round the replies and the whole
+ * tree playout by playout. Returns the number of replies in @focus. */
+static int
+uct_ponder_focus(struct uct *u, struct tree *t, struct tree_node **focus)
+{
+	if (t->root->u.playouts < u->ponder_focus_playouts)
+		return 0;
+	int n = 0;
+	for (struct tree_node *ni = t->root->children; ni; ni = ni->sibling) {
+		if (is_pass(node_coord(ni)) || (ni->hints & TREE_HINT_INVALID) || !ni->u.playouts)
+			continue;
+		if (n == u->ponder_focus && focus[n - 1]->u.playouts >= ni->u.playouts)
+			continue;
+		int j = n < u->ponder_focus ? n++ : n - 1;
+		for (; j > 0 && focus[j - 1]->u.playouts < ni->u.playouts; j--)
+			focus[j] = focus[j - 1];
+		focus[j] = ni;
+	}
+	return n;
+}
+
+/* Shared evaluation search (pachi-evaluate): each playout descends to
+ * the root child a UCB1 bandit on the child values picks, so that all
+ * the candidates get searched at once and the time goes to those
+ * whose value is still unsure. Unvisited children are tried first,
+ * in random order so that the threads do not all pick the same. */
+static struct tree_node *
+uct_evaluate_focus(struct uct *u, struct tree *t)
+{
+	struct tree_node *best = NULL, *untried = NULL;
+	floating_t best_urgency = -1;
+	floating_t log_n = log(t->root->u.playouts + 1);
+	int untried_n = 0;
+	for (struct tree_node *ni = t->root->children; ni; ni = ni->sibling) {
+		if (is_pass(node_coord(ni)) || (ni->hints & TREE_HINT_INVALID))
+			continue;
+		if (!ni->u.playouts) {
+			if (!fast_random(++untried_n))
+				untried = ni;
+			continue;
+		}
+		floating_t urgency = tree_node_get_value(t, 1, ni->u.value)
+			+ u->evaluate_explore * sqrt(log_n / ni->u.playouts);
+		if (urgency > best_urgency) {
+			best_urgency = urgency;
+			best = ni;
+		}
+	}
+	return untried ? untried : best;
+}
+
+int
+uct_playouts(struct uct *u, struct board *b, enum stone color, struct tree *t, struct time_info *ti, int tid)
 {
+	struct board_ownermap ownermap;
+	ownermap.playouts = 0;
+	ownermap.map = calloc2(board_size2(b), sizeof(ownermap.map[0]));
+	thread_ownermap = &ownermap;
+	thread_tid = tid;
+	int merge_interval = u->ownermap_merge ? u->ownermap_merge : OWNERMAP_MERGE_INTERVAL;
+
+	struct det_turns det = { .tid = tid, .threads = u->threads };
+	struct det_turns *detp = u->deterministic && tid >= 0 ? &det : NULL;
+
+	/* Not when analyzing, the user wants to see the whole tree. */
+	bool ponder_focus = u->ponder_focus && u->pondering && !u->analysis && tid >= 0;
+	struct tree_node *focus[u->ponder_focus + 1];
+	int focus_n = 0;
+
 	int i;
-	if (ti && ti->dim == TD_GAMES) {
-		for (i = 0; t->root->u.playouts <= ti->len.games && !uct_halt; i++)
-			uct_playout(u, b, color, t);
-	} else {
-		for (i = 0; !uct_halt; i++)
-			uct_playout(u, b, color, t);
+	for (i = 0; !uct_halt; i += u->leaf_playouts) {
+		/* The root playouts are the same at all the descent
+		 * turns of an epoch, so the workers all stop together. */
+		if (detp)
+			det_wait(det.base + tid);
+		if (ti && ti->dim == TD_GAMES && t->root->u.playouts > ti->len.games) {
+			if (detp)
+				det_next();
+			break;
+		}
+		struct tree_node *f = NULL;
+		if (ponder_focus) {
+			int k = i / u->leaf_playouts;
+			if (!(k % PONDER_FOCUS_INTERVAL))
+				focus_n = uct_ponder_focus(u, t, focus);
+			int group = (u->threads > u->ponder_focus ? tid : tid + k) % (u->ponder_focus + 1);
+			if (group && group <= focus_n)
+				f = focus[group - 1];
+		}
+		if (u->evaluating && t->root->children)
+			f = uct_evaluate_focus(u, t);
+		if (tid >= 0)
+			tree_read_begin(t, tid);
+		uct_playout_(u, b, color, t, detp, f);
+		if (tid >= 0)
+			tree_read_end(t, tid);
+		det.base += 3 * det.threads;
+		if (ownermap.playouts >= merge_interval)
+			uct_ownermap_merge(u, b, &ownermap);
 	}
+
+	uct_ownermap_merge(u, b, &ownermap);
+	thread_ownermap = NULL;
+	thread_tid = -1;
+	free(ownermap.map);
+	thread_board_storage_free();
+	if (detp)
+		__sync_fetch_and_add(&det_finished, 1);
 	return i;
 }
@@ -1,15 +1,33 @@
 #ifndef PACHI_UCT_WALK_H
 #define PACHI_UCT_WALK_H
 
+#include <stdbool.h>
+
 #include "move.h"
 
 struct tree;
 struct uct;
 struct board;
+struct board_ownermap;
 
+/* Print the search progress report, @final with the move chosen. */
 void uct_progress_status(struct uct *u, struct tree *t, enum stone color, int playouts, coord_t *final);
+/* The same, printed by a background thread. For the reports
+ * during the search. */
+void uct_progress_update(struct uct *u, struct tree *t, enum stone color, int playouts);
 
 int uct_playout(struct uct *u, struct board *b, enum stone player_color, struct tree *t);
-int uct_playouts(struct uct *u, struct board *b, enum stone color, struct tree *t, struct time_info *ti);
+/* Copy of u->ownermap, consistent while the search threads merge
+ * their playouts into it. */
+void uct_ownermap_copy(struct uct *u, struct board *b, struct board_ownermap *dst);
+/* @tid: number of the search worker, -1 outside of the search. */
+int uct_playouts(struct uct *u, struct board *b, enum stone color, struct tree *t, struct time_info *ti, int tid);
+
+/* Turn taking of the deterministic search, see walk.c. Reset before
+ * starting the workers; wake them up after setting uct_halt. */
+void uct_deterministic_start(void);
+void uct_deterministic_halt(void);
+/* All the workers stopped searching by themselves. */
+bool uct_deterministic_finished(struct uct *u);
 
 #endif
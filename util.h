@@ -80,7 +80,20 @@ checked_calloc(size_t nmemb, size_t size, const char *filename, unsigned int lin
 	return p;
 }
 
+static inline void *
+checked_realloc(void *ptr, size_t size, const char *filename, unsigned int line, const char *func)
+{
+	void *p = realloc(ptr, size);
+	if (!p) {
+		fprintf(stderr, "%s:%u: %s: OUT OF MEMORY realloc(%u)\n",
+			filename, line, func, (unsigned) size);
+		exit(1);
+	}
+	return p;
+}
+
 #define malloc2(size)        checked_malloc((size), __FILE__, __LINE__, __func__)
 #define calloc2(nmemb, size) checked_calloc((nmemb), (size), __FILE__, __LINE__, __func__)
+#define realloc2(ptr, size)  checked_realloc((ptr), (size), __FILE__, __LINE__, __func__)
 
 #endif